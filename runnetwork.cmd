@@ -4,14 +4,16 @@ echo 1. User mode networking (NAT) - Default
 echo 2. Bridge networking (requires admin rights)
 echo 3. TAP networking (advanced)
 echo 4. No networking
+echo 5. User mode networking (NAT) with virtio-net
 echo.
 
-set /p choice="Select network option (1-4): "
+set /p choice="Select network option (1-5): "
 
 if "%choice%"=="1" goto usermode
 if "%choice%"=="2" goto bridge
 if "%choice%"=="3" goto tap
 if "%choice%"=="4" goto nonet
+if "%choice%"=="5" goto virtio
 goto usermode
 
 :usermode
@@ -35,6 +37,13 @@ qemu-system-x86_64.exe -M q35 -drive file=cgos.iso,format=raw -boot d -m 2G -no-
     -device e1000,netdev=net0
 goto end
 
+:virtio
+echo Starting with virtio-net user mode networking...
+qemu-system-x86_64.exe -M q35 -drive file=cgos.iso,format=raw -boot d -m 2G -no-reboot ^
+    -netdev user,id=net0,hostfwd=tcp::8080-:8080,hostfwd=tcp::2222-:22 ^
+    -device virtio-net-pci,netdev=net0
+goto end
+
 :nonet
 echo Starting without networking...
 qemu-system-x86_64.exe -M q35 -drive file=cgos.iso,format=raw -boot d -m 2G -no-reboot
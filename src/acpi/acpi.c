@@ -8,6 +8,7 @@
 #include "acpi.h"
 #include "../pci/pci.h"
 #include "../debug/debug.h"
+#include "../memory/vmm.h"
 
 // Port I/O
 extern uint8_t inb(uint16_t port);
@@ -18,6 +19,75 @@ extern void outw(uint16_t port, uint16_t value);
 // ACPI state
 static bool acpi_available = false;
 
+// Physical address of the RSDP, 0 if the bootloader didn't provide one
+static uint64_t rsdp_phys = 0;
+
+void acpi_set_rsdp(uint64_t address) {
+    // Limine hands out an HHDM pointer on older base revisions and a
+    // physical address on newer ones
+    uint64_t hhdm = vmm_get_hhdm_offset();
+    rsdp_phys = (hhdm && address >= hhdm) ? address - hhdm : address;
+    DEBUG_INFO("ACPI: RSDP at phys 0x%lx\n", rsdp_phys);
+}
+
+// Firmware tables may sit outside the HHDM (see note above), so map them
+// explicitly: header first to learn the length, then the whole table
+static acpi_sdt_header_t *acpi_map_table(uint64_t phys) {
+    acpi_sdt_header_t *header = vmm_map_mmio(phys, sizeof(acpi_sdt_header_t));
+    if (!header) {
+        return NULL;
+    }
+    uint32_t length = header->length;
+    if (length <= sizeof(acpi_sdt_header_t)) {
+        return header;
+    }
+    return vmm_map_mmio(phys, length);
+}
+
+static bool acpi_signature_matches(const char *a, const char *b) {
+    for (int i = 0; i < 4; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void *acpi_find_table(const char *signature) {
+    if (!rsdp_phys) {
+        return NULL;
+    }
+    
+    acpi_rsdp_t *rsdp = vmm_map_mmio(rsdp_phys, sizeof(acpi_rsdp_t));
+    if (!rsdp) {
+        return NULL;
+    }
+    
+    // Prefer the XSDT (64-bit entries) when the firmware provides one
+    bool use_xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    uint64_t root_phys = use_xsdt ? rsdp->xsdt_address : rsdp->rsdt_address;
+    acpi_sdt_header_t *root = acpi_map_table(root_phys);
+    if (!root) {
+        return NULL;
+    }
+    
+    size_t entry_size = use_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    
+    for (size_t i = 0; i < count; i++) {
+        uint64_t table_phys = use_xsdt ? ((acpi_xsdt_t *)root)->entries[i]
+                                       : ((acpi_rsdt_t *)root)->entries[i];
+        acpi_sdt_header_t *header = vmm_map_mmio(table_phys, sizeof(acpi_sdt_header_t));
+        if (header && acpi_signature_matches(header->signature, signature)) {
+            DEBUG_INFO("ACPI: found %c%c%c%c at phys 0x%lx\n", signature[0],
+                       signature[1], signature[2], signature[3], table_phys);
+            return acpi_map_table(table_phys);
+        }
+    }
+    
+    return NULL;
+}
+
 int acpi_init(void) {
     DEBUG_INFO("ACPI: Initializing (QEMU mode)...\n");
     
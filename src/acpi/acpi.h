@@ -43,6 +43,107 @@ typedef struct __attribute__((packed)) {
     uint32_t entries[];  // Pointers to other tables
 } acpi_rsdt_t;
 
+// XSDT (Extended System Description Table, ACPI 2.0+)
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint64_t entries[];  // 64-bit pointers to other tables
+} acpi_xsdt_t;
+
+// Generic Address Structure
+typedef struct __attribute__((packed)) {
+    uint8_t address_space;  // 0 = system memory, 1 = system I/O
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} acpi_gas_t;
+
+// HPET (High Precision Event Timer) description table
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint32_t event_timer_block_id;
+    acpi_gas_t base_address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} acpi_hpet_t;
+
+// MCFG: PCI Express memory-mapped configuration (ECAM) windows
+typedef struct __attribute__((packed)) {
+    uint64_t base_address;  // ECAM base for bus 0 of this range
+    uint16_t segment;       // PCI segment group
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} acpi_mcfg_entry_t;
+
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint64_t reserved;
+    acpi_mcfg_entry_t entries[];
+} acpi_mcfg_t;
+
+// SRAT: static resource affinity. Entries map CPUs (by APIC ID) and memory
+// ranges to proximity domains.
+#define ACPI_SRAT_TYPE_LAPIC        0
+#define ACPI_SRAT_TYPE_MEMORY       1
+#define ACPI_SRAT_TYPE_X2APIC       2
+#define ACPI_SRAT_ENABLED           (1 << 0)    // In every entry's flags
+#define ACPI_SRAT_MEM_HOTPLUG       (1 << 1)
+
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    uint8_t entries[];
+} acpi_srat_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t length;
+} acpi_srat_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_lo;      // Bits 0-7 of the proximity domain
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_hi[3];   // Bits 8-31
+    uint32_t clock_domain;
+} acpi_srat_lapic_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} acpi_srat_memory_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} acpi_srat_x2apic_t;
+
+// SLIT: relative distance between proximity domains, 10 = local
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint64_t locality_count;
+    uint8_t distance[];     // locality_count x locality_count, row = from
+} acpi_slit_t;
+
 // FADT (Fixed ACPI Description Table)
 typedef struct __attribute__((packed)) {
     acpi_sdt_header_t header;
@@ -90,6 +191,13 @@ typedef struct __attribute__((packed)) {
 
 // Function prototypes
 int acpi_init(void);
+
+// Record the RSDP handed over by the bootloader (physical or HHDM address)
+void acpi_set_rsdp(uint64_t address);
+
+// Find an ACPI table by its 4-character signature (e.g. "HPET")
+// Returns a mapped pointer to the whole table, or NULL if not present
+void *acpi_find_table(const char *signature);
 void acpi_shutdown(void);
 void acpi_reboot(void);
 bool acpi_is_available(void);
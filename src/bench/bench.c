@@ -0,0 +1,467 @@
+/**
+ * In-kernel Microbenchmarks for CGOS
+ *
+ * A benchmark is a table entry: optional setup/teardown around the run, the
+ * timed operation, and an optional untimed step after each repetition.
+ * Operations return 0, or -1 to abandon the benchmark.
+ */
+
+#include "bench.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../sched/thread.h"
+#include "../sched/scheduler.h"
+#include "../sched/fpu.h"
+#include "../smp/smp.h"
+#include "../timer/tsc.h"
+#include "../network/checksum.h"
+#include "../network/socket.h"
+#include "../fs/fat16.h"
+#include "../graphic/graphic.h"
+#include "../debug/debug.h"
+
+#define BENCH_BUFFER_PAGES  (2 * BENCH_BUFFER_SIZE / 4096)
+#define BENCH_FILE          "BENCH.TMP"
+
+typedef struct {
+    const char *name;
+    uint32_t reps;
+    uint64_t bytes;                 // Moved per operation (0: not a throughput test)
+    int (*setup)(void);
+    int (*op)(void);
+    int (*after)(void);             // Untimed, after each repetition
+    void (*teardown)(void);
+} bench_case_t;
+
+// Two BENCH_BUFFER_SIZE halves for copies
+static uint8_t *bench_src;
+static uint8_t *bench_dst;
+
+// Serialize so earlier work is not still in flight at the first read
+static inline uint64_t bench_cycles(void) {
+    __asm__ volatile("lfence" ::: "memory");
+    uint64_t t = rdtsc();
+    __asm__ volatile("lfence" ::: "memory");
+    return t;
+}
+
+// ============== Memory ==============
+
+static int op_memcpy_4k(void) { memcpy(bench_dst, bench_src, 4096); return 0; }
+static int op_memcpy_64k(void) { memcpy(bench_dst, bench_src, BENCH_BUFFER_SIZE); return 0; }
+
+// Includes the section's CR0 writes, as every real user pays them
+static int op_fpu_copy_64k(void) {
+    if (!kernel_fpu_begin()) {
+        return -1;
+    }
+    fpu_copy_nt(bench_dst, bench_src, BENCH_BUFFER_SIZE);
+    kernel_fpu_end();
+    return 0;
+}
+
+static int op_memset_4k(void) { memset(bench_dst, 0x5A, 4096); return 0; }
+static int op_memset_64k(void) { memset(bench_dst, 0x5A, BENCH_BUFFER_SIZE); return 0; }
+
+static int op_kmalloc_64(void) {
+    void *p = kmalloc(64);
+    if (!p) {
+        return -1;
+    }
+    kfree(p);
+    return 0;
+}
+
+static int op_kmalloc_4k(void) {
+    void *p = kmalloc(4096);
+    if (!p) {
+        return -1;
+    }
+    kfree(p);
+    return 0;
+}
+
+static int op_page_alloc(void) {
+    void *page = physical_alloc_page();
+    if (!page) {
+        return -1;
+    }
+    physical_free_page(page);
+    return 0;
+}
+
+static int op_checksum_1500(void) {
+    volatile uint16_t sum = csum_fold(csum_partial(bench_src, 1500, 0));
+    (void)sum;
+    return 0;
+}
+
+static int op_checksum_64k(void) {
+    volatile uint16_t sum = csum_fold(csum_partial(bench_src, BENCH_BUFFER_SIZE, 0));
+    (void)sum;
+    return 0;
+}
+
+// ============== Threads ==============
+
+// Context switch: a partner at our priority on our CPU yields straight
+// back, so each measured yield is a round trip of two switches
+static volatile bool partner_stop;
+static volatile bool partner_done;
+
+static void partner_entry(void *arg) {
+    (void)arg;
+    while (!partner_stop) {
+        thread_yield();
+    }
+    partner_done = true;
+}
+
+static int setup_switch(void) {
+    thread_t *self = thread_current();
+    uint32_t cpu = smp_cpu_id();
+    partner_stop = false;
+    partner_done = false;
+    thread_t *t = thread_create_priority("bench-yield", partner_entry, NULL, self->priority);
+    if (!t) {
+        return -1;
+    }
+    thread_set_affinity(t, 1u << cpu);
+    scheduler_add_on(t, cpu);
+    thread_yield();                 // Let it start
+    return 0;
+}
+
+static int op_switch(void) {
+    thread_yield();
+    return 0;
+}
+
+static void teardown_switch(void) {
+    partner_stop = true;
+    while (!partner_done) {
+        thread_yield();
+    }
+}
+
+static volatile bool spawn_ran;
+
+static void spawn_entry(void *arg) {
+    (void)arg;
+    spawn_ran = true;
+}
+
+static int op_thread_create(void) {
+    spawn_ran = false;
+    thread_t *t = thread_create("bench-spawn", spawn_entry, NULL);
+    if (!t) {
+        return -1;
+    }
+    scheduler_add(t);
+    return 0;
+}
+
+// Wait for the thread to run and exit so the thread table never fills
+static int after_thread_create(void) {
+    while (!spawn_ran) {
+        thread_yield();
+    }
+    thread_yield();
+    return 0;
+}
+
+// ============== Network (loopback) ==============
+
+#define BENCH_UDP_PAYLOAD 1400
+
+static int udp_fd = -1;
+static int tcp_listen_fd = -1;
+static int tcp_client_fd = -1;
+static int tcp_server_fd = -1;
+
+static void loopback_addr(sockaddr_in_t *addr, uint16_t port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr = htonl(0x7F000001);     // 127.0.0.1
+}
+
+static int setup_udp(void) {
+    sockaddr_in_t addr;
+    loopback_addr(&addr, BENCH_UDP_PORT);
+    udp_fd = socket_create(AF_INET, SOCK_DGRAM, 0);
+    if (udp_fd < 0) {
+        return -1;
+    }
+    if (socket_bind(udp_fd, (const sockaddr_t *)&addr, sizeof(addr)) < 0) {
+        socket_close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+    socket_set_timeout(udp_fd, 1000, 1000);
+    return 0;
+}
+
+// One datagram to ourselves and back out of the socket
+static int op_udp(void) {
+    sockaddr_in_t addr;
+    loopback_addr(&addr, BENCH_UDP_PORT);
+    if (socket_sendto(udp_fd, bench_src, BENCH_UDP_PAYLOAD, 0, (const sockaddr_t *)&addr,
+                      sizeof(addr)) < 0) {
+        return -1;
+    }
+    return socket_recv(udp_fd, bench_dst, BENCH_BUFFER_SIZE, 0) == BENCH_UDP_PAYLOAD ? 0 : -1;
+}
+
+static void teardown_udp(void) {
+    if (udp_fd >= 0) {
+        socket_close(udp_fd);
+        udp_fd = -1;
+    }
+}
+
+static void teardown_tcp(void) {
+    if (tcp_server_fd >= 0) socket_close(tcp_server_fd);
+    if (tcp_client_fd >= 0) socket_close(tcp_client_fd);
+    if (tcp_listen_fd >= 0) socket_close(tcp_listen_fd);
+    tcp_server_fd = tcp_client_fd = tcp_listen_fd = -1;
+}
+
+static int setup_tcp(void) {
+    sockaddr_in_t addr;
+    loopback_addr(&addr, BENCH_TCP_PORT);
+
+    tcp_listen_fd = socket_create(AF_INET, SOCK_STREAM, 0);
+    tcp_client_fd = socket_create(AF_INET, SOCK_STREAM, 0);
+    if (tcp_listen_fd < 0 || tcp_client_fd < 0 ||
+        socket_bind(tcp_listen_fd, (const sockaddr_t *)&addr, sizeof(addr)) < 0 ||
+        socket_listen(tcp_listen_fd, 1) < 0) {
+        teardown_tcp();
+        return -1;
+    }
+    socket_set_timeout(tcp_listen_fd, 2000, 2000);
+    socket_set_timeout(tcp_client_fd, 2000, 2000);
+
+    // The handshake completes in the network thread; accept then finds it
+    if (socket_connect(tcp_client_fd, (const sockaddr_t *)&addr, sizeof(addr)) < 0 ||
+        (tcp_server_fd = socket_accept(tcp_listen_fd, NULL, NULL)) < 0) {
+        teardown_tcp();
+        return -1;
+    }
+
+    // One thread drives both ends, so neither may block
+    socket_set_nonblocking(tcp_client_fd, true);
+    socket_set_nonblocking(tcp_server_fd, true);
+    return 0;
+}
+
+// Push BENCH_BUFFER_SIZE bytes through the connection
+static int op_tcp(void) {
+    size_t sent = 0, received = 0;
+    uint64_t stalls = 0;
+    while (received < BENCH_BUFFER_SIZE) {
+        bool progress = false;
+        if (sent < BENCH_BUFFER_SIZE) {
+            int n = socket_send(tcp_client_fd, bench_src + sent, BENCH_BUFFER_SIZE - sent, 0);
+            if (n > 0) {
+                sent += n;
+                progress = true;
+            } else if (n != SOCKET_WOULD_BLOCK) {
+                return -1;
+            }
+        }
+        int n = socket_recv(tcp_server_fd, bench_dst, BENCH_BUFFER_SIZE, 0);
+        if (n > 0) {
+            received += n;
+            progress = true;
+        } else if (n != SOCKET_WOULD_BLOCK) {
+            return -1;
+        }
+        if (!progress) {
+            // Segments are in the network thread's hands
+            if (++stalls > 100000) {
+                return -1;
+            }
+            thread_yield();
+        }
+    }
+    return 0;
+}
+
+// ============== Filesystem ==============
+
+static int setup_fat_write(void) {
+    // Probe that a filesystem is mounted and writable
+    return fat16_write_file(BENCH_FILE, bench_src, 512) < 0 ? -1 : 0;
+}
+
+static int op_fat_write(void) {
+    return fat16_write_file(BENCH_FILE, bench_src, BENCH_BUFFER_SIZE) < 0 ? -1 : 0;
+}
+
+static int setup_fat_read(void) {
+    return fat16_write_file(BENCH_FILE, bench_src, BENCH_BUFFER_SIZE) < 0 ? -1 : 0;
+}
+
+static int op_fat_read(void) {
+    return fat16_read_file(BENCH_FILE, bench_dst, BENCH_BUFFER_SIZE) == BENCH_BUFFER_SIZE ? 0 : -1;
+}
+
+static void teardown_fat(void) {
+    fat16_delete_file(BENCH_FILE);
+}
+
+// ============== Harness ==============
+
+static const bench_case_t bench_cases[] = {
+    { "memcpy_4k",     2000, 4096,              NULL,            op_memcpy_4k,     NULL, NULL },
+    { "memcpy_64k",    500,  BENCH_BUFFER_SIZE, NULL,            op_memcpy_64k,    NULL, NULL },
+    { "fpu_copy_64k",  500,  BENCH_BUFFER_SIZE, NULL,            op_fpu_copy_64k,  NULL, NULL },
+    { "memset_4k",     2000, 4096,              NULL,            op_memset_4k,     NULL, NULL },
+    { "memset_64k",    500,  BENCH_BUFFER_SIZE, NULL,            op_memset_64k,    NULL, NULL },
+    { "kmalloc_64",    5000, 0,                 NULL,            op_kmalloc_64,    NULL, NULL },
+    { "kmalloc_4k",    2000, 0,                 NULL,            op_kmalloc_4k,    NULL, NULL },
+    { "page_alloc",    2000, 0,                 NULL,            op_page_alloc,    NULL, NULL },
+    { "ctx_switch",    2000, 0,                 setup_switch,    op_switch,        NULL, teardown_switch },
+    { "thread_create", 64,   0,                 NULL,            op_thread_create, after_thread_create, NULL },
+    { "csum_1500",     5000, 1500,              NULL,            op_checksum_1500, NULL, NULL },
+    { "csum_64k",      500,  BENCH_BUFFER_SIZE, NULL,            op_checksum_64k,  NULL, NULL },
+    { "udp_loopback",  200,  BENCH_UDP_PAYLOAD, setup_udp,       op_udp,           NULL, teardown_udp },
+    { "tcp_loopback",  50,   BENCH_BUFFER_SIZE, setup_tcp,       op_tcp,           NULL, teardown_tcp },
+    { "fat_write",     20,   BENCH_BUFFER_SIZE, setup_fat_write, op_fat_write,     NULL, teardown_fat },
+    { "fat_read",      50,   BENCH_BUFFER_SIZE, setup_fat_read,  op_fat_read,      NULL, teardown_fat },
+};
+
+#define BENCH_CASE_COUNT (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+static void sort_cycles(uint64_t *v, uint32_t n) {
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            uint64_t tmp = v[i];
+            uint32_t j = i;
+            while (j >= gap && v[j - gap] > tmp) {
+                v[j] = v[j - gap];
+                j -= gap;
+            }
+            v[j] = tmp;
+        }
+    }
+}
+
+static void bench_one(const bench_case_t *bc, bench_print_t print) {
+    char line[96];
+
+    uint64_t *samples = kmalloc(bc->reps * sizeof(uint64_t));
+    if (!samples) {
+        kprintf_to_buffer(line, sizeof(line), "  %s: out of memory", bc->name);
+        print(line);
+        return;
+    }
+    if (bc->setup && bc->setup() < 0) {
+        kprintf_to_buffer(line, sizeof(line), "  %s: skipped (setup failed)", bc->name);
+        print(line);
+        debug_printf("BENCH name=%s status=skipped\n", bc->name);
+        kfree(samples);
+        return;
+    }
+
+    // Warm caches, TLBs and allocator free lists first
+    uint32_t warmup = bc->reps / 10 ? bc->reps / 10 : 1;
+    int failed = 0;
+    for (uint32_t i = 0; i < warmup && !failed; i++) {
+        failed = bc->op() < 0 || (bc->after && bc->after() < 0);
+    }
+    for (uint32_t i = 0; i < bc->reps && !failed; i++) {
+        uint64_t start = bench_cycles();
+        failed = bc->op() < 0;
+        samples[i] = bench_cycles() - start;
+        if (!failed && bc->after) {
+            failed = bc->after() < 0;
+        }
+    }
+
+    if (bc->teardown) {
+        bc->teardown();
+    }
+    if (failed) {
+        kprintf_to_buffer(line, sizeof(line), "  %s: failed", bc->name);
+        print(line);
+        debug_printf("BENCH name=%s status=failed\n", bc->name);
+        kfree(samples);
+        return;
+    }
+
+    sort_cycles(samples, bc->reps);
+    uint64_t min = samples[0];
+    uint64_t median = samples[bc->reps / 2];
+    uint32_t p99_index = bc->reps * 99 / 100;
+    uint64_t p99 = samples[p99_index < bc->reps ? p99_index : bc->reps - 1];
+    kfree(samples);
+
+    uint64_t median_ns = tsc_get_hz() ? tsc_cycles_to_ns(median) : 0;
+    // bytes per ns * 1000 = MB/s
+    uint64_t mbps = (bc->bytes && median_ns) ? bc->bytes * 1000 / median_ns : 0;
+
+    if (mbps) {
+        kprintf_to_buffer(line, sizeof(line), "  %s: min %lu med %lu p99 %lu cyc, %lu ns, %lu MB/s",
+                          bc->name, min, median, p99, median_ns, mbps);
+    } else {
+        kprintf_to_buffer(line, sizeof(line), "  %s: min %lu med %lu p99 %lu cyc, %lu ns",
+                          bc->name, min, median, p99, median_ns);
+    }
+    print(line);
+    debug_printf("BENCH name=%s status=ok reps=%u min_cycles=%lu median_cycles=%lu "
+                 "p99_cycles=%lu median_ns=%lu bytes=%lu mbps=%lu\n",
+                 bc->name, bc->reps, min, median, p99, median_ns, bc->bytes, mbps);
+}
+
+int bench_run(const char *name, bench_print_t print) {
+    bool all = name[0] == 'a' && name[1] == 'l' && name[2] == 'l' && name[3] == '\0';
+    const bench_case_t *only = NULL;
+    if (!all) {
+        for (uint32_t i = 0; i < BENCH_CASE_COUNT && !only; i++) {
+            const char *a = bench_cases[i].name, *b = name;
+            while (*a && *a == *b) {
+                a++;
+                b++;
+            }
+            if (*a == '\0' && *b == '\0') {
+                only = &bench_cases[i];
+            }
+        }
+        if (!only) {
+            return -1;
+        }
+    }
+
+    uint8_t *pages = physical_alloc_pages(BENCH_BUFFER_PAGES);
+    if (!pages) {
+        print("  bench: no memory for buffers");
+        return 0;
+    }
+    bench_src = (uint8_t *)PHYS_TO_HHDM(pages);
+    bench_dst = bench_src + BENCH_BUFFER_SIZE;
+    for (uint32_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        bench_src[i] = (uint8_t)(i * 131 + 7);
+    }
+
+    for (uint32_t i = 0; i < BENCH_CASE_COUNT; i++) {
+        if (all || &bench_cases[i] == only) {
+            bench_one(&bench_cases[i], print);
+        }
+    }
+
+    physical_free_pages(pages, BENCH_BUFFER_PAGES);
+    bench_src = bench_dst = NULL;
+    return 0;
+}
+
+void bench_list(bench_print_t print) {
+    char line[96];
+    for (uint32_t i = 0; i < BENCH_CASE_COUNT; i++) {
+        kprintf_to_buffer(line, sizeof(line), "  %s (%u reps)", bench_cases[i].name,
+                          bench_cases[i].reps);
+        print(line);
+    }
+}
@@ -0,0 +1,29 @@
+/**
+ * In-kernel Microbenchmarks for CGOS
+ *
+ * Each benchmark times one operation with the TSC: a few unmeasured warmup
+ * runs, then a fixed number of measured repetitions reported as min,
+ * median and 99th percentile. Results go to the caller's print function and,
+ * as one "BENCH key=value ..." line per benchmark, to debugcon so CI can
+ * track them.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+#define BENCH_BUFFER_SIZE   (64 * 1024)     // Largest copy/checksum/file size
+#define BENCH_UDP_PORT      5901
+#define BENCH_TCP_PORT      5902
+
+typedef void (*bench_print_t)(const char *line);
+
+// Run the benchmark called 'name', or every one for "all". Returns 0, or -1
+// for an unknown name.
+int bench_run(const char *name, bench_print_t print);
+
+// Print the available benchmark names
+void bench_list(bench_print_t print);
+
+#endif // BENCH_H
@@ -0,0 +1,258 @@
+#include "boot.h"
+#include "../sched/thread.h"
+#include "../sched/scheduler.h"
+#include "../sched/waitqueue.h"
+#include "../timer/tsc.h"
+#include "../graphic/graphic.h"
+#include "../debug/debug.h"
+
+typedef struct {
+    const char *stage;
+    uint64_t tsc;
+} boot_stage_t;
+
+static boot_stage_t marks[BOOT_MAX_MARKS];
+static volatile uint32_t mark_count = 0;
+
+typedef enum {
+    BOOT_TASK_WAITING,
+    BOOT_TASK_RUNNING,
+    BOOT_TASK_DONE
+} boot_task_state_t;
+
+typedef struct {
+    const boot_task_desc_t *desc;
+    uint32_t dep_mask;              // Indices of the tasks this one waits for
+    volatile boot_task_state_t state;
+    int result;
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+} boot_task_t;
+
+static boot_task_t tasks[BOOT_MAX_TASKS];
+static int task_count = 0;
+static volatile uint32_t done_mask = 0;
+static volatile bool deferred_released = false;
+static boot_done_fn_t boot_done;
+
+// Boot task threads waiting on dependencies or on the shell
+static wait_queue_t boot_waiters = WAIT_QUEUE_INIT;
+
+void boot_mark(const char *stage) {
+    uint32_t index = __atomic_fetch_add(&mark_count, 1, __ATOMIC_RELAXED);
+    if (index >= BOOT_MAX_MARKS) {
+        return;
+    }
+    marks[index].stage = stage;
+    marks[index].tsc = rdtsc();
+}
+
+static bool task_ready(boot_task_t *task) {
+    uint32_t done = __atomic_load_n(&done_mask, __ATOMIC_ACQUIRE);
+    if ((done & task->dep_mask) != task->dep_mask) {
+        return false;
+    }
+    return !(task->desc->flags & BOOT_TASK_DEFERRED) ||
+           __atomic_load_n(&deferred_released, __ATOMIC_ACQUIRE);
+}
+
+static void boot_print_debug(const char *line) {
+    DEBUG_INFO("%s\n", line);
+}
+
+static void boot_task_entry(void *arg) {
+    boot_task_t *task = (boot_task_t *)arg;
+    int index = (int)(task - tasks);
+
+    wait_event(&boot_waiters, task_ready(task));
+
+    task->state = BOOT_TASK_RUNNING;
+    task->start_tsc = rdtsc();
+    task->result = task->desc->init();
+    task->end_tsc = rdtsc();
+    task->state = BOOT_TASK_DONE;
+    if (task->result != 0) {
+        DEBUG_WARN("boot: %s failed (%d)\n", task->desc->name, task->result);
+    }
+
+    uint32_t done = __atomic_or_fetch(&done_mask, 1u << index, __ATOMIC_ACQ_REL);
+    wait_queue_wake_all(&boot_waiters);
+
+    // The last task to finish reports
+    if (done == (1u << task_count) - 1) {
+        boot_mark("services");
+        boot_report(boot_print_debug);
+        if (boot_done) {
+            boot_done();
+        }
+    }
+    thread_exit();
+}
+
+static bool boot_streq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static int find_task(const boot_task_desc_t *table, int before, const char *name) {
+    for (int i = 0; i < before; i++) {
+        if (boot_streq(table[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int boot_tasks_start(const boot_task_desc_t *table, int count, boot_done_fn_t done) {
+    if (count <= 0 || count > BOOT_MAX_TASKS) {
+        DEBUG_ERROR("boot: %d tasks (at most %d)\n", count, BOOT_MAX_TASKS);
+        return -1;
+    }
+
+    // Resolve every dependency before starting anything
+    for (int i = 0; i < count; i++) {
+        tasks[i].desc = &table[i];
+        tasks[i].dep_mask = 0;
+        tasks[i].state = BOOT_TASK_WAITING;
+        for (int d = 0; d < BOOT_MAX_DEPS && table[i].deps[d]; d++) {
+            int dep = find_task(table, i, table[i].deps[d]);
+            if (dep < 0) {
+                DEBUG_ERROR("boot: %s depends on %s, which isn't declared before it\n",
+                            table[i].name, table[i].deps[d]);
+                return -1;
+            }
+            tasks[i].dep_mask |= 1u << dep;
+        }
+    }
+    task_count = count;
+    boot_done = done;
+
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        char name[32] = "init/";
+        int len = 5;
+        for (const char *c = table[i].name; *c && len < (int)sizeof(name) - 1; c++) {
+            name[len++] = *c;
+        }
+        name[len] = '\0';
+        thread_t *thread = thread_create(name, boot_task_entry, &tasks[i]);
+        if (!thread) {
+            // Nothing can wait on it: record it as failed straight away
+            DEBUG_ERROR("boot: no thread for %s\n", table[i].name);
+            tasks[i].state = BOOT_TASK_DONE;
+            tasks[i].result = -1;
+            __atomic_or_fetch(&done_mask, 1u << i, __ATOMIC_RELEASE);
+            continue;
+        }
+        scheduler_add(thread);
+        started++;
+    }
+
+    // No task thread will get to see the last task finish
+    if (started == 0 && done) {
+        done();
+    }
+    return 0;
+}
+
+void boot_release_deferred(void) {
+    if (__atomic_exchange_n(&deferred_released, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    boot_mark("shell");
+    wait_queue_wake_all(&boot_waiters);
+}
+
+bool boot_complete(void) {
+    return task_count > 0 &&
+           __atomic_load_n(&done_mask, __ATOMIC_ACQUIRE) == (1u << task_count) - 1;
+}
+
+// Microseconds between two TSC readings, or -1 before calibration
+static int64_t tsc_delta_us(uint64_t from, uint64_t to) {
+    if (!tsc_get_hz() || to < from) {
+        return -1;
+    }
+    return (int64_t)(tsc_cycles_to_ns(to - from) / 1000);
+}
+
+static void format_ms(char *buf, int size, int64_t us) {
+    if (us < 0) {
+        kprintf_to_buffer(buf, size, "?");
+    } else {
+        kprintf_to_buffer(buf, size, "%lu.%03lu", (uint64_t)us / 1000, (uint64_t)us % 1000);
+    }
+}
+
+// Left-justify 'name' in a column of 'width' characters
+static void format_name(char *buf, int width, const char *name) {
+    int len = 0;
+    while (name[len] && len < width) {
+        buf[len] = name[len];
+        len++;
+    }
+    while (len < width) {
+        buf[len++] = ' ';
+    }
+    buf[len] = '\0';
+}
+
+static const char *task_status(boot_task_t *task) {
+    switch (task->state) {
+    case BOOT_TASK_WAITING:
+        return "waiting";
+    case BOOT_TASK_RUNNING:
+        return "running";
+    default:
+        return task->result == 0 ? "ok" : "failed";
+    }
+}
+
+void boot_report(boot_print_t print) {
+    uint32_t count = __atomic_load_n(&mark_count, __ATOMIC_ACQUIRE);
+    if (count > BOOT_MAX_MARKS) {
+        count = BOOT_MAX_MARKS;
+    }
+    if (count == 0) {
+        print("Boot: no stages recorded");
+        return;
+    }
+
+    uint64_t origin = marks[0].tsc;
+    char line[96];
+    char name[16];
+    char at[16];
+    char took[16];
+
+    print("Boot stages (ms since kmain, ms since the previous stage):");
+    for (uint32_t i = 0; i < count; i++) {
+        format_name(name, 12, marks[i].stage);
+        format_ms(at, sizeof(at), tsc_delta_us(origin, marks[i].tsc));
+        format_ms(took, sizeof(took), i ? tsc_delta_us(marks[i - 1].tsc, marks[i].tsc) : 0);
+        kprintf_to_buffer(line, sizeof(line), "  %s %s  +%s", name, at, took);
+        print(line);
+    }
+
+    if (task_count == 0) {
+        return;
+    }
+    print("Boot tasks (started ms since kmain, ms running):");
+    for (int i = 0; i < task_count; i++) {
+        boot_task_t *task = &tasks[i];
+        const char *deferred = task->desc->flags & BOOT_TASK_DEFERRED ? " (deferred)" : "";
+        format_name(name, 12, task->desc->name);
+        if (task->state == BOOT_TASK_WAITING) {
+            kprintf_to_buffer(line, sizeof(line), "  %s %s%s", name, task_status(task), deferred);
+        } else {
+            format_ms(at, sizeof(at), tsc_delta_us(origin, task->start_tsc));
+            format_ms(took, sizeof(took), task->state == BOOT_TASK_DONE
+                                          ? tsc_delta_us(task->start_tsc, task->end_tsc) : -1);
+            kprintf_to_buffer(line, sizeof(line), "  %s %s  %s  %s%s", name, at, took,
+                              task_status(task), deferred);
+        }
+        print(line);
+    }
+}
@@ -0,0 +1,59 @@
+/**
+ * Boot Profiling and Subsystem Initialization for CGOS
+ *
+ * boot_mark() timestamps the stages kmain() runs through in sequence. The
+ * subsystems that don't have to be up before the scheduler starts are
+ * declared as boot tasks instead: each gets its own kernel thread, which
+ * runs its init function as soon as every dependency has finished, so
+ * independent probes (disks, network) overlap. Deferred tasks also wait
+ * until the shell is up. A report of both is logged once the last task is
+ * done and is available from the shell.
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BOOT_MAX_MARKS      32
+#define BOOT_MAX_TASKS      16
+#define BOOT_MAX_DEPS       4
+
+// Task flags
+#define BOOT_TASK_DEFERRED  (1 << 0)    // Non-critical: only start once the shell is up
+
+typedef int (*boot_init_fn_t)(void);
+typedef void (*boot_print_t)(const char *line);
+typedef void (*boot_done_fn_t)(void);
+
+// A subsystem to bring up. Dependencies are names of tasks declared earlier
+// in the same table (so there can be no cycles); they only order the tasks,
+// each init function copes with a prerequisite that failed or found nothing.
+typedef struct {
+    const char *name;
+    boot_init_fn_t init;            // Returns 0 on success
+    const char *deps[BOOT_MAX_DEPS];
+    uint32_t flags;
+} boot_task_desc_t;
+
+// Timestamp a boot stage. Cheap (one rdtsc), usable from the first line of
+// kmain(); times are converted once the TSC has been calibrated.
+void boot_mark(const char *stage);
+
+// Create one thread per task. They start running with the scheduler.
+// 'done' (may be NULL) runs in the last task's thread once every task has
+// finished, or right here if no task thread could be created.
+// Returns 0, or -1 if the table is invalid (nothing is started then).
+int boot_tasks_start(const boot_task_desc_t *tasks, int count, boot_done_fn_t done);
+
+// The shell is up: let deferred tasks run
+void boot_release_deferred(void);
+
+// Whether every boot task has finished
+bool boot_complete(void);
+
+// Stage and task timings, relative to the first boot_mark()
+void boot_report(boot_print_t print);
+
+#endif // BOOT_H
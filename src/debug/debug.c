@@ -1,17 +1,17 @@
 #include "debug.h"
 #include <stdarg.h>
+#include "../smp/smp.h"
+#include "../sched/spinlock.h"
+#include "../sched/thread.h"
+#include "../sched/scheduler.h"
+#include "../timer/timer.h"
 
 // Port I/O functions
-static inline void outb(uint16_t port, uint8_t data) {
+// (named apart from pci.h's helpers, which arrive through the timer header)
+static inline void debug_outb(uint16_t port, uint8_t data) {
     __asm__ volatile ("outb %0, %1" : : "a"(data), "Nd"(port));
 }
 
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
-
 // Current debug level (can be modified at runtime)
 static debug_level_t current_debug_level = DEBUG_LEVEL_INFO;
 
@@ -21,17 +21,24 @@ void debug_init(void) {
     debug_puts("Debug console initialized\n");
 }
 
+// Write a buffer to debugcon with one string instruction
+static void debug_write(const char *s, size_t n) {
+    __asm__ volatile("rep outsb"
+                     : "+S"(s), "+c"(n)
+                     : "d"((uint16_t)DEBUGCON_PORT)
+                     : "memory");
+}
+
 void debug_putchar(char c) {
-    outb(DEBUGCON_PORT, (uint8_t)c);
+    debug_outb(DEBUGCON_PORT, (uint8_t)c);
 }
 
 void debug_puts(const char *str) {
     if (!str) return;
     
-    while (*str) {
-        debug_putchar(*str);
-        str++;
-    }
+    size_t len = 0;
+    while (str[len]) len++;
+    debug_write(str, len);
 }
 
 // Simple signed long to string conversion
@@ -98,17 +105,36 @@ static int debug_strlen(const char *str) {
     return len;
 }
 
+// Formatting target: a bounded buffer, truncated when full
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} debug_out_t;
+
+static inline void out_putc(debug_out_t *out, char c) {
+    if (out->len + 1 < out->size) {
+        out->buf[out->len++] = c;
+    }
+}
+
+static void out_puts(debug_out_t *out, const char *str) {
+    while (*str) {
+        out_putc(out, *str++);
+    }
+}
+
 // Print with padding
-static void debug_print_padded(const char *str, int width, char pad_char, int left_align) {
+static void out_padded(debug_out_t *out, const char *str, int width, char pad_char, int left_align) {
     int len = debug_strlen(str);
     int padding = (width > len) ? (width - len) : 0;
     
     if (!left_align) {
-        while (padding-- > 0) debug_putchar(pad_char);
+        while (padding-- > 0) out_putc(out, pad_char);
     }
-    debug_puts(str);
+    out_puts(out, str);
     if (left_align) {
-        while (padding-- > 0) debug_putchar(' ');
+        while (padding-- > 0) out_putc(out, ' ');
     }
 }
 
@@ -126,16 +152,13 @@ static void debug_to_upper(char *str) {
 // Modifiers: l (long), ll (long long), z (size_t)
 // Width: %8d, %08x, etc.
 // Flags: - (left align), 0 (zero pad)
-void debug_printf(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    
+static void debug_vformat(debug_out_t *out, const char *format, va_list args) {
     char buffer[32];
     const char *ptr = format;
     
     while (*ptr) {
         if (*ptr != '%') {
-            debug_putchar(*ptr++);
+            out_putc(out, *ptr++);
             continue;
         }
         
@@ -193,7 +216,7 @@ void debug_printf(const char *format, ...) {
                     int val = va_arg(args, int);
                     debug_ltoa((long)val, buffer, 10);
                 }
-                debug_print_padded(buffer, width, pad_char, left_align);
+                out_padded(out, buffer, width, pad_char, left_align);
                 break;
             }
             case 'u': {
@@ -207,7 +230,7 @@ void debug_printf(const char *format, ...) {
                     unsigned int val = va_arg(args, unsigned int);
                     debug_ultoa((unsigned long)val, buffer, 10);
                 }
-                debug_print_padded(buffer, width, pad_char, left_align);
+                out_padded(out, buffer, width, pad_char, left_align);
                 break;
             }
             case 'x': {
@@ -221,7 +244,7 @@ void debug_printf(const char *format, ...) {
                     unsigned int val = va_arg(args, unsigned int);
                     debug_ultoa((unsigned long)val, buffer, 16);
                 }
-                debug_print_padded(buffer, width, pad_char, left_align);
+                out_padded(out, buffer, width, pad_char, left_align);
                 break;
             }
             case 'X': {
@@ -236,42 +259,234 @@ void debug_printf(const char *format, ...) {
                     debug_ultoa((unsigned long)val, buffer, 16);
                 }
                 debug_to_upper(buffer);
-                debug_print_padded(buffer, width, pad_char, left_align);
+                out_padded(out, buffer, width, pad_char, left_align);
                 break;
             }
             case 'p': {
                 void *val = va_arg(args, void*);
-                debug_puts("0x");
+                out_puts(out, "0x");
                 debug_ultoa((unsigned long)val, buffer, 16);
-                debug_print_padded(buffer, width > 2 ? width - 2 : 0, '0', 0);
+                out_padded(out, buffer, width > 2 ? width - 2 : 0, '0', 0);
                 break;
             }
             case 's': {
                 const char *val = va_arg(args, const char*);
                 if (!val) val = "(null)";
-                debug_print_padded(val, width, ' ', left_align);
+                out_padded(out, val, width, ' ', left_align);
                 break;
             }
             case 'c': {
                 char val = (char)va_arg(args, int);
-                debug_putchar(val);
+                out_putc(out, val);
                 break;
             }
             case '%': {
-                debug_putchar('%');
+                out_putc(out, '%');
                 break;
             }
             default: {
                 // Unknown format specifier, print as-is
-                debug_putchar('%');
-                debug_putchar(*ptr);
+                out_putc(out, '%');
+                out_putc(out, *ptr);
                 break;
             }
         }
         ptr++;
     }
-    
+}
+
+
+void debug_printf(const char *format, ...) {
+    char text[DEBUG_LOG_MAX_MSG];
+    debug_out_t out = { text, 0, sizeof(text) };
+    va_list args;
+    va_start(args, format);
+    debug_vformat(&out, format, args);
     va_end(args);
+    text[out.len] = '\0';
+    debug_puts(text);
+}
+
+// ============== Asynchronous log ring ==============
+
+// Records: a header, then 'len' bytes of text, padded to 8 bytes. Each CPU
+// only writes its own ring (interrupts off, so nothing on the CPU can
+// interleave), publishing with a release store of head; the drain thread
+// is the only consumer and frees space with a release store of tail.
+typedef struct {
+    uint64_t timestamp;             // timer_get_ticks() (ms)
+    uint32_t tid;
+    uint8_t level;
+    uint8_t cpu;
+    uint16_t len;
+} debug_record_t;
+
+typedef struct {
+    uint64_t head;                  // Bytes ever written (producer)
+    uint64_t tail;                  // Bytes ever consumed (drain thread)
+    uint64_t records;
+    uint64_t dropped;               // Records lost to a full ring
+    uint64_t reported;              // 'dropped' as last reported in the log
+    volatile bool busy;             // A record is being written (e.g. NMI)
+    uint8_t data[DEBUG_RING_SIZE];
+} debug_ring_t;
+
+static debug_ring_t debug_rings[MAX_CPUS];
+static volatile bool debug_async;
+static spinlock_t debug_drain_lock = SPINLOCK_INIT;
+
+#define DEBUG_RECORD_SPACE(len) ((sizeof(debug_record_t) + (len) + 7) & ~(uint64_t)7)
+
+static void ring_copy_in(debug_ring_t *ring, uint64_t pos, const void *src, size_t n) {
+    const uint8_t *p = (const uint8_t *)src;
+    for (size_t i = 0; i < n; i++) {
+        ring->data[(pos + i) & (DEBUG_RING_SIZE - 1)] = p[i];
+    }
+}
+
+static void ring_copy_out(debug_ring_t *ring, uint64_t pos, void *dst, size_t n) {
+    uint8_t *p = (uint8_t *)dst;
+    for (size_t i = 0; i < n; i++) {
+        p[i] = ring->data[(pos + i) & (DEBUG_RING_SIZE - 1)];
+    }
+}
+
+// Queue one formatted message on this CPU's ring, or count it as dropped
+static void debug_enqueue(debug_level_t level, const char *text, size_t len) {
+    uint64_t flags = irq_save();
+    debug_ring_t *ring = &debug_rings[smp_cpu_id()];
+
+    uint64_t space = DEBUG_RECORD_SPACE(len);
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->busy || head - tail + space > DEBUG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        irq_restore(flags);
+        return;
+    }
+    ring->busy = true;
+
+    debug_record_t rec = {
+        .timestamp = timer_get_ticks(),
+        .tid = thread_get_tid(),
+        .level = (uint8_t)level,
+        .cpu = (uint8_t)smp_cpu_id(),
+        .len = (uint16_t)len,
+    };
+    ring_copy_in(ring, head, &rec, sizeof(rec));
+    ring_copy_in(ring, head + sizeof(rec), text, len);
+    ring->records++;
+    __atomic_store_n(&ring->head, head + space, __ATOMIC_RELEASE);
+
+    ring->busy = false;
+    irq_restore(flags);
+}
+
+// Move every published record of one ring to debugcon. Caller holds
+// debug_drain_lock.
+static size_t debug_drain_ring(debug_ring_t *ring, uint32_t cpu) {
+    char line[DEBUG_LOG_MAX_MSG + 48];
+    size_t drained = 0;
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        debug_record_t rec;
+        ring_copy_out(ring, tail, &rec, sizeof(rec));
+
+        debug_out_t out = { line, 0, sizeof(line) };
+        char num[24];
+        out_putc(&out, '[');
+        debug_ultoa(rec.timestamp / 1000, num, 10);
+        out_padded(&out, num, 5, ' ', 0);
+        out_putc(&out, '.');
+        debug_ultoa(rec.timestamp % 1000, num, 10);
+        out_padded(&out, num, 3, '0', 0);
+        out_puts(&out, " c");
+        debug_ultoa(rec.cpu, num, 10);
+        out_puts(&out, num);
+        out_puts(&out, " t");
+        debug_ultoa(rec.tid, num, 10);
+        out_puts(&out, num);
+        out_puts(&out, "] ");
+        size_t room = out.size - 1 - out.len;
+        size_t n = rec.len < room ? rec.len : room;
+        ring_copy_out(ring, tail + sizeof(rec), line + out.len, n);
+        debug_write(line, out.len + n);
+
+        tail += DEBUG_RECORD_SPACE(rec.len);
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        drained++;
+    }
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        char text[64];
+        debug_out_t out = { text, 0, sizeof(text) };
+        char num[24];
+        out_puts(&out, "[WARN]  debug log: cpu");
+        debug_ultoa(cpu, num, 10);
+        out_puts(&out, num);
+        out_puts(&out, " dropped ");
+        debug_ultoa(dropped - ring->reported, num, 10);
+        out_puts(&out, num);
+        out_puts(&out, " records\n");
+        debug_write(text, out.len);
+        ring->reported = dropped;
+    }
+    return drained;
+}
+
+static size_t debug_drain_all(void) {
+    size_t drained = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        drained += debug_drain_ring(&debug_rings[cpu], cpu);
+    }
+    return drained;
+}
+
+void debug_log_flush(void) {
+    // If the drain thread itself faulted mid-drain, skip what it holds
+    // rather than deadlock
+    if (!spin_trylock(&debug_drain_lock)) {
+        return;
+    }
+    debug_drain_all();
+    spin_unlock(&debug_drain_lock);
+}
+
+static void debug_drain_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        spin_lock(&debug_drain_lock);
+        debug_drain_all();
+        spin_unlock(&debug_drain_lock);
+        thread_sleep_ms(DEBUG_DRAIN_MS);
+    }
+}
+
+int debug_log_start_async(void) {
+    thread_t *t = thread_create_priority("logd", debug_drain_thread, NULL, PRIORITY_LOW);
+    if (!t) {
+        return -1;
+    }
+    scheduler_add(t);
+    debug_async = true;
+    return 0;
+}
+
+void debug_get_log_stats(debug_log_stats_t *stats) {
+    stats->records = 0;
+    stats->dropped = 0;
+    stats->queued_bytes = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        debug_ring_t *ring = &debug_rings[cpu];
+        stats->records += ring->records;
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        stats->queued_bytes += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+                               __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    stats->async = debug_async;
 }
 
 void debug_log(debug_level_t level, const char *format, ...) {
@@ -280,151 +495,23 @@ void debug_log(debug_level_t level, const char *format, ...) {
         return;
     }
     
+    char text[DEBUG_LOG_MAX_MSG];
+    debug_out_t out = { text, 0, sizeof(text) };
     va_list args;
     va_start(args, format);
-    
-    char buffer[32];
-    const char *ptr = format;
-    
-    while (*ptr) {
-        if (*ptr != '%') {
-            debug_putchar(*ptr++);
-            continue;
-        }
-        
-        ptr++; // Skip '%'
-        if (!*ptr) break;
-        
-        // Parse flags
-        int left_align = 0;
-        int zero_pad = 0;
-        
-        while (*ptr == '-' || *ptr == '0' || *ptr == '+' || *ptr == ' ' || *ptr == '#') {
-            if (*ptr == '-') left_align = 1;
-            if (*ptr == '0') zero_pad = 1;
-            ptr++;
-        }
-        
-        // Parse width
-        int width = 0;
-        while (*ptr >= '0' && *ptr <= '9') {
-            width = width * 10 + (*ptr - '0');
-            ptr++;
-        }
-        
-        // Parse length modifier
-        int is_long = 0;      // 1 = long, 2 = long long
-        int is_size_t = 0;
-        
-        if (*ptr == 'l') {
-            ptr++;
-            is_long = 1;
-            if (*ptr == 'l') {
-                ptr++;
-                is_long = 2;
-            }
-        } else if (*ptr == 'z') {
-            ptr++;
-            is_size_t = 1;
-        } else if (*ptr == 'h') {
-            ptr++; // Ignore 'h' modifier (short)
-            if (*ptr == 'h') ptr++; // Ignore 'hh' modifier (char)
-        }
-        
-        char pad_char = (zero_pad && !left_align) ? '0' : ' ';
-        
-        switch (*ptr) {
-            case 'd':
-            case 'i': {
-                if (is_long == 2) {
-                    long long val = va_arg(args, long long);
-                    debug_ltoa((long)val, buffer, 10);
-                } else if (is_long == 1 || is_size_t) {
-                    long val = va_arg(args, long);
-                    debug_ltoa(val, buffer, 10);
-                } else {
-                    int val = va_arg(args, int);
-                    debug_ltoa((long)val, buffer, 10);
-                }
-                debug_print_padded(buffer, width, pad_char, left_align);
-                break;
-            }
-            case 'u': {
-                if (is_long == 2) {
-                    unsigned long long val = va_arg(args, unsigned long long);
-                    debug_ultoa((unsigned long)val, buffer, 10);
-                } else if (is_long == 1 || is_size_t) {
-                    unsigned long val = va_arg(args, unsigned long);
-                    debug_ultoa(val, buffer, 10);
-                } else {
-                    unsigned int val = va_arg(args, unsigned int);
-                    debug_ultoa((unsigned long)val, buffer, 10);
-                }
-                debug_print_padded(buffer, width, pad_char, left_align);
-                break;
-            }
-            case 'x': {
-                if (is_long == 2) {
-                    unsigned long long val = va_arg(args, unsigned long long);
-                    debug_ultoa((unsigned long)val, buffer, 16);
-                } else if (is_long == 1 || is_size_t) {
-                    unsigned long val = va_arg(args, unsigned long);
-                    debug_ultoa(val, buffer, 16);
-                } else {
-                    unsigned int val = va_arg(args, unsigned int);
-                    debug_ultoa((unsigned long)val, buffer, 16);
-                }
-                debug_print_padded(buffer, width, pad_char, left_align);
-                break;
-            }
-            case 'X': {
-                if (is_long == 2) {
-                    unsigned long long val = va_arg(args, unsigned long long);
-                    debug_ultoa((unsigned long)val, buffer, 16);
-                } else if (is_long == 1 || is_size_t) {
-                    unsigned long val = va_arg(args, unsigned long);
-                    debug_ultoa(val, buffer, 16);
-                } else {
-                    unsigned int val = va_arg(args, unsigned int);
-                    debug_ultoa((unsigned long)val, buffer, 16);
-                }
-                debug_to_upper(buffer);
-                debug_print_padded(buffer, width, pad_char, left_align);
-                break;
-            }
-            case 'p': {
-                void *val = va_arg(args, void*);
-                debug_puts("0x");
-                debug_ultoa((unsigned long)val, buffer, 16);
-                debug_print_padded(buffer, width > 2 ? width - 2 : 0, '0', 0);
-                break;
-            }
-            case 's': {
-                const char *val = va_arg(args, const char*);
-                if (!val) val = "(null)";
-                debug_print_padded(val, width, ' ', left_align);
-                break;
-            }
-            case 'c': {
-                char val = (char)va_arg(args, int);
-                debug_putchar(val);
-                break;
-            }
-            case '%': {
-                debug_putchar('%');
-                break;
-            }
-            default: {
-                // Unknown format specifier, print as-is
-                debug_putchar('%');
-                debug_putchar(*ptr);
-                break;
-            }
-        }
-        ptr++;
-    }
-    
+    debug_vformat(&out, format, args);
     va_end(args);
+
+    if (!debug_async) {
+        debug_write(text, out.len);
+    } else if (level == DEBUG_LEVEL_ERROR) {
+        // Errors often precede a halt: write them (and everything queued
+        // before them) out now
+        debug_log_flush();
+        debug_write(text, out.len);
+    } else {
+        debug_enqueue(level, text, out.len);
+    }
 }
 
 void debug_hexdump(const void *data, size_t len, const char *prefix) {
@@ -3,10 +3,27 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 // QEMU debugcon port
 #define DEBUGCON_PORT 0xe9
 
+// Asynchronous logging. Once debug_log_start_async() has run, debug_log()
+// formats into a record on the calling CPU's ring and returns; a
+// low-priority thread writes the records to debugcon. Errors still go out
+// at once (after whatever is queued), and records that find their ring
+// full are dropped and counted rather than waited for.
+#define DEBUG_RING_SIZE     16384   // Bytes per CPU (power of two)
+#define DEBUG_LOG_MAX_MSG   256     // Longer messages are truncated
+#define DEBUG_DRAIN_MS      10      // Drain thread period
+
+typedef struct debug_log_stats {
+    uint64_t records;               // Queued since boot
+    uint64_t dropped;
+    uint64_t queued_bytes;          // Waiting for the drain thread
+    bool async;
+} debug_log_stats_t;
+
 // Debug log levels
 typedef enum {
     DEBUG_LEVEL_ERROR = 0,
@@ -31,6 +48,15 @@ void debug_printf(const char *format, ...);
 // Debug output with level
 void debug_log(debug_level_t level, const char *format, ...);
 
+// Start the drain thread and switch debug_log() to the per-CPU rings.
+// Needs the scheduler and per-CPU blocks. Returns 0 or -1.
+int debug_log_start_async(void);
+
+// Write out everything queued so far from the calling thread
+void debug_log_flush(void);
+
+void debug_get_log_stats(debug_log_stats_t *stats);
+
 // Convenience macros for different log levels
 #define DEBUG_ERROR(fmt, ...) debug_log(DEBUG_LEVEL_ERROR, "[ERROR] " fmt, ##__VA_ARGS__)
 #define DEBUG_WARN(fmt, ...)  debug_log(DEBUG_LEVEL_WARN,  "[WARN]  " fmt, ##__VA_ARGS__)
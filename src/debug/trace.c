@@ -0,0 +1,378 @@
+/**
+ * Tracepoints and Sampling Profiler for CGOS
+ *
+ * Each CPU appends only to its own trace ring with interrupts off, so
+ * recording needs no lock. Readers copy entries without stopping writers;
+ * an entry being overwritten at that moment may come out mixed, which is
+ * acceptable for a diagnostic view.
+ */
+
+#include "trace.h"
+#include "debug.h"
+#include "../smp/smp.h"
+#include "../sched/spinlock.h"
+#include "../sched/thread.h"
+#include "../memory/memory.h"
+#include "../timer/tsc.h"
+
+volatile bool trace_enabled;
+
+typedef struct {
+    uint64_t head;                          // Entries ever written
+    uint64_t counts[TRACE_EVENT_COUNT];
+    trace_entry_t entries[TRACE_RING_ENTRIES];
+} trace_ring_t;
+
+static trace_ring_t trace_rings[MAX_CPUS];
+
+static volatile bool prof_running;
+static uint64_t prof_samples[PROF_MAX_SAMPLES];
+static uint32_t prof_count;                 // Claimed slots (may pass the max)
+static uint32_t prof_dropped;
+
+static const char *const event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_SCHED_SWITCH] = "sched_switch",
+    [TRACE_NET_IP_RX]    = "ip_rx",
+    [TRACE_E1000_TX]     = "e1000_tx",
+    [TRACE_E1000_RX]     = "e1000_rx",
+    [TRACE_MALLOC]       = "malloc",
+    [TRACE_PMM_ALLOC]    = "pmm_alloc",
+    [TRACE_FS_READ]      = "fs_read",
+    [TRACE_FS_WRITE]     = "fs_write",
+    [TRACE_VIRTIO_NET_TX] = "vnet_tx",
+    [TRACE_VIRTIO_NET_RX] = "vnet_rx",
+};
+
+// ============== Tracepoints ==============
+
+void trace_record(trace_event_t event, uint64_t a, uint64_t b) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_id();
+    trace_ring_t *ring = &trace_rings[cpu];
+
+    trace_entry_t *e = &ring->entries[ring->head & (TRACE_RING_ENTRIES - 1)];
+    e->tsc = rdtsc();
+    e->a = a;
+    e->b = b;
+    e->tid = thread_get_tid();
+    e->event = (uint16_t)event;
+    e->cpu = (uint16_t)cpu;
+    ring->counts[event]++;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    irq_restore(flags);
+}
+
+const char *trace_event_name(uint16_t event) {
+    return event < TRACE_EVENT_COUNT ? event_names[event] : "?";
+}
+
+void trace_get_counts(uint64_t counts[TRACE_EVENT_COUNT]) {
+    for (int ev = 0; ev < TRACE_EVENT_COUNT; ev++) {
+        counts[ev] = 0;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            counts[ev] += trace_rings[cpu].counts[ev];
+        }
+    }
+}
+
+uint32_t trace_read_recent(trace_entry_t *out, uint32_t max) {
+    // Merge the rings newest-first by TSC, filling 'out' from the back
+    uint64_t cursor[MAX_CPUS];
+    uint64_t floor[MAX_CPUS];
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cursor[cpu] = __atomic_load_n(&trace_rings[cpu].head, __ATOMIC_ACQUIRE);
+        floor[cpu] = cursor[cpu] > TRACE_RING_ENTRIES ? cursor[cpu] - TRACE_RING_ENTRIES : 0;
+    }
+
+    uint32_t n = 0;
+    while (n < max) {
+        int best = -1;
+        uint64_t best_tsc = 0;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cursor[cpu] == floor[cpu]) {
+                continue;
+            }
+            const trace_entry_t *e =
+                &trace_rings[cpu].entries[(cursor[cpu] - 1) & (TRACE_RING_ENTRIES - 1)];
+            if (best < 0 || e->tsc > best_tsc) {
+                best = (int)cpu;
+                best_tsc = e->tsc;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        cursor[best]--;
+        out[max - 1 - n] = trace_rings[best].entries[cursor[best] & (TRACE_RING_ENTRIES - 1)];
+        n++;
+    }
+
+    // Slide the filled tail to the front
+    if (n < max) {
+        for (uint32_t i = 0; i < n; i++) {
+            out[i] = out[max - n + i];
+        }
+    }
+    return n;
+}
+
+void trace_start(void) {
+    trace_enabled = false;
+    prof_running = false;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        memset(&trace_rings[cpu], 0, sizeof(trace_rings[cpu]));
+    }
+    __atomic_store_n(&prof_count, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&prof_dropped, 0, __ATOMIC_RELEASE);
+
+    prof_running = true;
+    trace_enabled = true;
+}
+
+void trace_stop(void) {
+    trace_enabled = false;
+    prof_running = false;
+}
+
+// ============== Sampling ==============
+
+void prof_sample(uint64_t rip) {
+    if (!prof_running) {
+        return;
+    }
+    if (__atomic_load_n(&prof_count, __ATOMIC_RELAXED) >= PROF_MAX_SAMPLES) {
+        __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t slot = __atomic_fetch_add(&prof_count, 1, __ATOMIC_RELAXED);
+    if (slot < PROF_MAX_SAMPLES) {
+        prof_samples[slot] = rip;
+    } else {
+        __atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// ============== Symbolization ==============
+
+// Just the ELF64 pieces needed to find .symtab
+typedef struct {
+    uint8_t  e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} elf64_ehdr_t;
+
+typedef struct {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} elf64_shdr_t;
+
+typedef struct {
+    uint32_t st_name;
+    uint8_t  st_info;
+    uint8_t  st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} elf64_sym_t;
+
+#define ELF_SHT_SYMTAB  2
+#define ELF_STT_FUNC    2
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;
+} prof_symbol_t;
+
+static const uint8_t *kernel_elf;
+static uint64_t kernel_elf_size;
+static prof_symbol_t *symbols;
+static uint32_t symbol_count;
+static bool symbols_loaded;
+static spinlock_t prof_lock = SPINLOCK_INIT_NAMED("prof");
+
+void trace_set_kernel_file(const void *elf, uint64_t size) {
+    kernel_elf = (const uint8_t *)elf;
+    kernel_elf_size = size;
+}
+
+// Collect the function symbols from the kernel image, sorted by address
+static void load_symbols(void) {
+    symbols_loaded = true;
+    if (!kernel_elf || kernel_elf_size < sizeof(elf64_ehdr_t)) {
+        return;
+    }
+
+    const elf64_ehdr_t *eh = (const elf64_ehdr_t *)kernel_elf;
+    if (eh->e_ident[0] != 0x7F || eh->e_ident[1] != 'E' || eh->e_ident[2] != 'L' ||
+        eh->e_ident[3] != 'F' ||
+        eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(elf64_shdr_t) > kernel_elf_size) {
+        DEBUG_WARN("prof: kernel file is not a usable ELF\n");
+        return;
+    }
+
+    const elf64_shdr_t *sh = (const elf64_shdr_t *)(kernel_elf + eh->e_shoff);
+    const elf64_shdr_t *symtab = NULL;
+    for (uint16_t i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == ELF_SHT_SYMTAB) {
+            symtab = &sh[i];
+            break;
+        }
+    }
+    if (!symtab || symtab->sh_link >= eh->e_shnum ||
+        symtab->sh_offset + symtab->sh_size > kernel_elf_size) {
+        DEBUG_WARN("prof: kernel has no symbol table\n");
+        return;
+    }
+    const elf64_shdr_t *strtab = &sh[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > kernel_elf_size) {
+        return;
+    }
+
+    const elf64_sym_t *syms = (const elf64_sym_t *)(kernel_elf + symtab->sh_offset);
+    const char *names = (const char *)(kernel_elf + strtab->sh_offset);
+    uint64_t nsyms = symtab->sh_size / sizeof(elf64_sym_t);
+
+    uint32_t count = 0;
+    for (uint64_t i = 0; i < nsyms; i++) {
+        if ((syms[i].st_info & 0xF) == ELF_STT_FUNC && syms[i].st_value) {
+            count++;
+        }
+    }
+    if (!count || !(symbols = kmalloc(count * sizeof(prof_symbol_t)))) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < nsyms; i++) {
+        if ((syms[i].st_info & 0xF) != ELF_STT_FUNC || !syms[i].st_value ||
+            syms[i].st_name >= strtab->sh_size) {
+            continue;
+        }
+        prof_symbol_t *s = &symbols[symbol_count++];
+        s->addr = syms[i].st_value;
+        s->size = syms[i].st_size;
+        s->name = names + syms[i].st_name;
+    }
+
+    // Shell sort by address
+    for (uint32_t gap = symbol_count / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < symbol_count; i++) {
+            prof_symbol_t tmp = symbols[i];
+            uint32_t j = i;
+            while (j >= gap && symbols[j - gap].addr > tmp.addr) {
+                symbols[j] = symbols[j - gap];
+                j -= gap;
+            }
+            symbols[j] = tmp;
+        }
+    }
+}
+
+// Index of the function containing 'addr', or -1
+static int find_symbol(uint64_t addr) {
+    uint32_t lo = 0, hi = symbol_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    const prof_symbol_t *s = &symbols[lo - 1];
+    if (s->size && addr >= s->addr + s->size) {
+        return -1;
+    }
+    return (int)(lo - 1);
+}
+
+int prof_report(prof_entry_t *out, int max) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+    if (!symbols_loaded) {
+        load_symbols();
+    }
+    spin_unlock_irqrestore(&prof_lock, flags);
+
+    uint32_t samples = __atomic_load_n(&prof_count, __ATOMIC_ACQUIRE);
+    if (samples > PROF_MAX_SAMPLES) {
+        samples = PROF_MAX_SAMPLES;
+    }
+
+    // Per-symbol counts; samples outside every symbol share the last slot
+    uint32_t *hits = kmalloc((symbol_count + 1) * sizeof(uint32_t));
+    if (!hits) {
+        return 0;
+    }
+    memset(hits, 0, (symbol_count + 1) * sizeof(uint32_t));
+    uint64_t last_unknown = 0;
+    for (uint32_t i = 0; i < samples; i++) {
+        int sym = symbol_count ? find_symbol(prof_samples[i]) : -1;
+        if (sym < 0) {
+            hits[symbol_count]++;
+            last_unknown = prof_samples[i];
+        } else {
+            hits[sym]++;
+        }
+    }
+
+    // Repeatedly pick the largest remaining count
+    int n = 0;
+    while (n < max) {
+        uint32_t best = 0;
+        uint32_t best_hits = 0;
+        for (uint32_t i = 0; i <= symbol_count; i++) {
+            if (hits[i] > best_hits) {
+                best_hits = hits[i];
+                best = i;
+            }
+        }
+        if (!best_hits) {
+            break;
+        }
+        if (best == symbol_count) {
+            out[n].name = NULL;
+            out[n].addr = last_unknown;
+        } else {
+            out[n].name = symbols[best].name;
+            out[n].addr = symbols[best].addr;
+        }
+        out[n].samples = best_hits;
+        hits[best] = 0;
+        n++;
+    }
+
+    kfree(hits);
+    return n;
+}
+
+void prof_get_stats(prof_stats_t *stats) {
+    uint32_t claimed = __atomic_load_n(&prof_count, __ATOMIC_ACQUIRE);
+    stats->running = prof_running;
+    stats->samples = claimed < PROF_MAX_SAMPLES ? claimed : PROF_MAX_SAMPLES;
+    stats->dropped = __atomic_load_n(&prof_dropped, __ATOMIC_RELAXED);
+    stats->symbols = symbol_count;
+}
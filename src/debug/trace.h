@@ -0,0 +1,90 @@
+/**
+ * Tracepoints and Sampling Profiler for CGOS
+ *
+ * Static tracepoints in the scheduler, network, memory and filesystem paths
+ * record fixed-size events into a per-CPU ring (oldest entries are
+ * overwritten). A disabled tracepoint costs one predicted branch.
+ *
+ * The profiler records the interrupted RIP on every timer tick and, on
+ * request, folds the samples into a flat per-function profile symbolized
+ * against the kernel ELF's symbol table.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_RING_ENTRIES  512         // Per CPU (power of two)
+#define PROF_MAX_SAMPLES    16384       // Samples kept per profiling run
+
+typedef enum {
+    TRACE_SCHED_SWITCH = 0,             // a = previous tid, b = next tid
+    TRACE_NET_IP_RX,                    // a = length, b = protocol
+    TRACE_E1000_TX,                     // a = frames queued, b = requested
+    TRACE_E1000_RX,                     // a = frames received
+    TRACE_MALLOC,                       // a = size, b = address
+    TRACE_PMM_ALLOC,                    // a = pages, b = physical address
+    TRACE_FS_READ,                      // a = bytes requested, b = bytes read
+    TRACE_FS_WRITE,                     // a = bytes requested, b = bytes written
+    TRACE_VIRTIO_NET_TX,                // a = frames queued, b = queue pair
+    TRACE_VIRTIO_NET_RX,                // a = frames received, b = queue pair
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef struct trace_entry {
+    uint64_t tsc;
+    uint64_t a;
+    uint64_t b;
+    uint32_t tid;
+    uint16_t event;
+    uint16_t cpu;
+} trace_entry_t;
+
+typedef struct prof_entry {
+    const char *name;                   // NULL when no symbol covers addr
+    uint64_t addr;                      // Symbol start (or the raw sample)
+    uint32_t samples;
+} prof_entry_t;
+
+typedef struct prof_stats {
+    bool running;
+    uint32_t samples;
+    uint32_t dropped;                   // Ticks after the sample buffer filled
+    uint32_t symbols;                   // Functions in the kernel symbol table
+} prof_stats_t;
+
+extern volatile bool trace_enabled;
+
+void trace_record(trace_event_t event, uint64_t a, uint64_t b);
+
+#define TRACE(event, a, b) do { \
+    if (__builtin_expect(trace_enabled, 0)) \
+        trace_record((event), (uint64_t)(a), (uint64_t)(b)); \
+} while (0)
+
+// Where the bootloader loaded the kernel ELF (for symbolization)
+void trace_set_kernel_file(const void *elf, uint64_t size);
+
+// Clear the trace rings and samples, then start recording both
+void trace_start(void);
+void trace_stop(void);
+
+// Timer-tick hook: record 'rip' if profiling
+void prof_sample(uint64_t rip);
+
+// Up to 'max' functions with the most samples, most first. Returns the
+// number filled in.
+int prof_report(prof_entry_t *out, int max);
+void prof_get_stats(prof_stats_t *stats);
+
+// The newest 'max' trace entries across all CPUs, oldest first
+uint32_t trace_read_recent(trace_entry_t *out, uint32_t max);
+
+// Events recorded per type since trace_start()
+void trace_get_counts(uint64_t counts[TRACE_EVENT_COUNT]);
+const char *trace_event_name(uint16_t event);
+
+#endif // TRACE_H
@@ -0,0 +1,636 @@
+/**
+ * AHCI (SATA) Driver Implementation
+ *
+ * Each port keeps one command table per slot. A request takes a free slot,
+ * builds its FIS and PRD list straight over the caller's buffer (split at
+ * physical page runs) and sets its bit in PxCI (and PxSACT for NCQ). The
+ * interrupt handler, or a waiter polling in its place, retires every slot
+ * the HBA has cleared and runs the completions outside the port lock.
+ */
+
+#include "ahci.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../interrupt/irq.h"
+#include "../interrupt/lapic.h"
+#include "../smp/smp.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+
+#define AHCI_ABAR_SIZE      (AHCI_PORT_BASE + AHCI_MAX_PORTS * AHCI_PORT_SIZE)
+#define AHCI_PRD_MAX_BYTES  0x400000    // 4 MiB per PRD entry
+
+static ahci_hba_t hba;
+static int ahci_disk_count = 0;
+
+static inline uint32_t hba_read(uint32_t reg) {
+    return *(volatile uint32_t *)(hba.abar + reg);
+}
+
+static inline void hba_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(hba.abar + reg) = value;
+}
+
+static inline uint32_t port_read(ahci_port_t *port, uint32_t reg) {
+    return *(volatile uint32_t *)(port->regs + reg);
+}
+
+static inline void port_write(ahci_port_t *port, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(port->regs + reg) = value;
+}
+
+// Wait up to 'ms' for (reg & mask) == value
+static bool port_wait(ahci_port_t *port, uint32_t reg, uint32_t mask, uint32_t value, uint32_t ms) {
+    uint64_t deadline = timer_get_ticks() + ms;
+    while ((port_read(port, reg) & mask) != value) {
+        if (timer_get_ticks() > deadline) {
+            return false;
+        }
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+// Zeroed, physically contiguous memory the HBA can reach
+static void *ahci_alloc_dma(size_t bytes, uint64_t *phys) {
+    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *mem = physical_alloc_pages(pages);
+    if (!mem) {
+        return NULL;
+    }
+    if (!(hba.cap & AHCI_CAP_S64A) && (uint64_t)mem + pages * PAGE_SIZE > 0x100000000ULL) {
+        physical_free_pages(mem, pages);
+        return NULL;
+    }
+
+    *phys = (uint64_t)mem;
+    void *virt = (void *)PHYS_TO_HHDM(mem);
+    memset(virt, 0, pages * PAGE_SIZE);
+    return virt;
+}
+
+// ============== Port Engine ==============
+
+static bool ahci_port_stop(ahci_port_t *port) {
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    if (!port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500)) {
+        return false;
+    }
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+    return port_wait(port, AHCI_PxCMD, AHCI_PxCMD_FR, 0, 500);
+}
+
+static void ahci_port_start(ahci_port_t *port) {
+    port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500);
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+// After a task file error or a timeout the HBA stops processing the list:
+// restart the engine, which drops every issued command. Port lock held.
+static void ahci_port_restart_locked(ahci_port_t *port) {
+    DEBUG_WARN("AHCI: port %d error (IS=0x%x TFD=0x%x SERR=0x%x), restarting\n",
+               port->index, port_read(port, AHCI_PxIS), port_read(port, AHCI_PxTFD),
+               port_read(port, AHCI_PxSERR));
+
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500);
+    port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+// Retire finished commands and run their completions. With 'abort' every
+// outstanding command is failed (used when a waiter gives up).
+static void ahci_port_complete(ahci_port_t *port, bool abort) {
+    ahci_slot_t done[AHCI_MAX_SLOTS];
+    int status[AHCI_MAX_SLOTS];
+    int n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    uint32_t is = port_read(port, AHCI_PxIS);
+    if (is) {
+        port_write(port, AHCI_PxIS, is);
+    }
+
+    uint32_t finished;
+    uint32_t failed = 0;
+    if ((abort || (is & AHCI_PxIS_ERRORS)) && port->issued) {
+        // Commands the HBA already retired still succeeded
+        uint32_t active = port_read(port, AHCI_PxCI) | port_read(port, AHCI_PxSACT);
+        failed = port->issued & active;
+        finished = port->issued;
+        ahci_port_restart_locked(port);
+    } else {
+        finished = port->issued & ~(port_read(port, AHCI_PxCI) | port_read(port, AHCI_PxSACT));
+    }
+
+    port->issued &= ~finished;
+    port->busy &= ~finished;
+    if (port->busy == 0) {
+        port->exclusive = false;
+    }
+    for (uint32_t m = finished; m; m &= m - 1) {
+        int tag = __builtin_ctz(m);
+        done[n] = port->slot[tag];
+        status[n] = (failed & (1u << tag)) ? -1 : 0;
+        port->slot[tag].done = NULL;
+        n++;
+    }
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    for (int i = 0; i < n; i++) {
+        if (done[i].done) {
+            done[i].done(done[i].ctx, status[i]);
+        }
+    }
+    if (n > 0) {
+        wait_queue_wake_all(&port->slot_waiters);
+        wait_queue_wake_all(&port->done_waiters);
+    }
+}
+
+static void ahci_irq(void *ctx) {
+    (void)ctx;
+    uint32_t is = hba_read(AHCI_IS);
+    for (uint32_t m = is; m; m &= m - 1) {
+        ahci_port_t *port = hba.ports[__builtin_ctz(m)];
+        if (port) {
+            ahci_port_complete(port, false);
+        }
+    }
+    hba_write(AHCI_IS, is);
+}
+
+// ============== Command Slots ==============
+
+// Non-queued commands on an NCQ disk must run alone; 'exclusive' waits
+// for the port to drain and keeps new commands out until it finishes
+static bool ahci_try_get_slot(ahci_port_t *port, bool exclusive, int *tag) {
+    bool ok = false;
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    if (!port->exclusive && (!exclusive || port->busy == 0)) {
+        uint32_t free = port->slots_mask & ~port->busy;
+        if (free) {
+            *tag = __builtin_ctz(free);
+            port->busy |= 1u << *tag;
+            port->exclusive = exclusive;
+            ok = true;
+        }
+    }
+    spin_unlock_irqrestore(&port->lock, flags);
+    return ok;
+}
+
+// Sleep for a slot. Asynchronous submitters can fill every slot, so reap
+// finished commands too in case interrupts are off or were lost.
+static int ahci_get_slot(ahci_port_t *port, bool exclusive) {
+    int tag;
+    while (!ahci_try_get_slot(port, exclusive, &tag)) {
+        ahci_port_complete(port, false);
+        wait_event_timeout(&port->slot_waiters,
+                           !port->exclusive && (port->slots_mask & ~port->busy) &&
+                           (!exclusive || port->busy == 0),
+                           AHCI_POLL_MS);
+    }
+    return tag;
+}
+
+static void ahci_put_slot(ahci_port_t *port, int tag) {
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    port->busy &= ~(1u << tag);
+    if (port->busy == 0) {
+        port->exclusive = false;
+    }
+    spin_unlock_irqrestore(&port->lock, flags);
+    wait_queue_wake_all(&port->slot_waiters);
+}
+
+// Fill the command table and header for 'tag'. Returns -1 if the buffer
+// needs more PRD entries than a table holds or lies out of the HBA's reach.
+static int ahci_build(ahci_port_t *port, int tag, uint8_t command, uint64_t lba, uint32_t count,
+                      void *buffer, size_t bytes, bool write, bool queued) {
+    ahci_cmd_table_t *table = &port->tables[tag];
+    memset(table, 0, sizeof(ahci_cmd_table_t) - sizeof(table->prdt));
+
+    // Scatter-gather over the buffer's physical pages, merging runs
+    int n = 0;
+    uint64_t prev_end = 0;
+    uint8_t *va = (uint8_t *)buffer;
+    size_t remaining = bytes;
+    while (remaining > 0) {
+        uint64_t pa = vmm_get_physical_addr((uint64_t)va);
+        size_t chunk = PAGE_SIZE - ((uint64_t)va & (PAGE_SIZE - 1));
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        if (pa == 0 || (!(hba.cap & AHCI_CAP_S64A) && pa + chunk > 0x100000000ULL)) {
+            return -1;
+        }
+
+        ahci_prd_t *last = n > 0 ? &table->prdt[n - 1] : NULL;
+        if (last && pa == prev_end && (last->dbc & 0x3FFFFF) + 1 + chunk <= AHCI_PRD_MAX_BYTES) {
+            last->dbc += (uint32_t)chunk;
+        } else {
+            if (n == AHCI_PRDT_ENTRIES) {
+                return -1;
+            }
+            table->prdt[n].dba = (uint32_t)pa;
+            table->prdt[n].dbau = (uint32_t)(pa >> 32);
+            table->prdt[n].reserved = 0;
+            table->prdt[n].dbc = (uint32_t)chunk - 1;
+            n++;
+        }
+        prev_end = pa + chunk;
+        va += chunk;
+        remaining -= chunk;
+    }
+
+    // Register host-to-device FIS
+    uint8_t *fis = table->cfis;
+    fis[0] = AHCI_FIS_H2D;
+    fis[1] = AHCI_FIS_H2D_CMD;
+    fis[2] = command;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = command == ATA_CMD_IDENTIFY_DEV ? 0 : 0x40;   // LBA mode
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    if (queued) {
+        // FPDMA: sector count in the features registers, tag in count
+        fis[3] = (uint8_t)count;
+        fis[11] = (uint8_t)(count >> 8);
+        fis[12] = (uint8_t)(tag << 3);
+    } else {
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+    }
+
+    ahci_cmd_header_t *hdr = &port->cmd_list[tag];
+    uint64_t ctba = port->tables_phys + (uint64_t)tag * sizeof(ahci_cmd_table_t);
+    hdr->flags = 5 | (write ? AHCI_CMD_FLAG_WRITE : 0);   // 5-dword FIS
+    hdr->prdtl = (uint16_t)n;
+    hdr->prdbc = 0;
+    hdr->ctba = (uint32_t)ctba;
+    hdr->ctbau = (uint32_t)(ctba >> 32);
+    return 0;
+}
+
+static void ahci_issue(ahci_port_t *port, int tag, bool queued, ahci_done_t done, void *ctx) {
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    port->slot[tag].done = done;
+    port->slot[tag].ctx = ctx;
+    port->issued |= 1u << tag;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (queued) {
+        port_write(port, AHCI_PxSACT, 1u << tag);
+    }
+    port_write(port, AHCI_PxCI, 1u << tag);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+// ============== Synchronous Commands ==============
+
+typedef struct ahci_wait {
+    volatile bool done;
+    volatile int status;
+} ahci_wait_t;
+
+static void ahci_wait_done(void *ctx, int status) {
+    ahci_wait_t *w = (ahci_wait_t *)ctx;
+    w->status = status;
+    __atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+}
+
+// Polls the port too, so commands complete with interrupts off or lost
+static bool ahci_wait_finished(ahci_port_t *port, ahci_wait_t *w) {
+    if (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+        ahci_port_complete(port, false);
+    }
+    return __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+static int ahci_wait_for(ahci_port_t *port, ahci_wait_t *w) {
+    uint64_t deadline = timer_get_ticks() + AHCI_CMD_TIMEOUT_MS;
+    while (!ahci_wait_finished(port, w)) {
+        if (timer_get_ticks() >= deadline) {
+            DEBUG_WARN("AHCI: port %d command timed out\n", port->index);
+            ahci_port_complete(port, true);
+            break;
+        }
+        wait_event_timeout(&port->done_waiters, ahci_wait_finished(port, w), AHCI_POLL_MS);
+    }
+    return w->status;
+}
+
+static int ahci_exec(ahci_port_t *port, uint8_t command, uint64_t lba, uint32_t count,
+                     void *buffer, size_t bytes, bool write, bool queued) {
+    int tag = ahci_get_slot(port, port->ncq && !queued);
+
+    if (ahci_build(port, tag, command, lba, count, buffer, bytes, write, queued) < 0) {
+        ahci_put_slot(port, tag);
+        return -1;
+    }
+
+    ahci_wait_t w = { false, -1 };
+    ahci_issue(port, tag, queued, ahci_wait_done, &w);
+    return ahci_wait_for(port, &w);
+}
+
+int ahci_submit(ahci_port_t *port, uint64_t lba, uint32_t count, void *buffer, bool write,
+                ahci_done_t done, void *ctx) {
+    if (!port || count == 0 || count > AHCI_MAX_SECTORS || ((uintptr_t)buffer & 1)) {
+        return -1;
+    }
+
+    int tag = ahci_get_slot(port, false);
+
+    uint8_t command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                                : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    if (ahci_build(port, tag, command, lba, count, buffer, (size_t)count * BLKDEV_SECTOR_SIZE,
+                   write, port->ncq) < 0) {
+        ahci_put_slot(port, tag);
+        return -1;
+    }
+    ahci_issue(port, tag, port->ncq, done, ctx);
+    return 0;
+}
+
+// ============== Block Device ==============
+
+static int ahci_rw(ahci_port_t *port, uint64_t lba, uint32_t count, void *buffer, bool write) {
+    size_t bytes = (size_t)count * BLKDEV_SECTOR_SIZE;
+
+    // PRDs need word alignment; bounce the odd caller
+    void *io = buffer;
+    if ((uintptr_t)buffer & 1) {
+        io = kmalloc(bytes);
+        if (!io) {
+            return -1;
+        }
+        if (write) {
+            memcpy(io, buffer, bytes);
+        }
+    }
+
+    uint8_t command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                                : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    int ret = ahci_exec(port, command, lba, count, io, bytes, write, port->ncq);
+
+    if (io != buffer) {
+        if (ret == 0 && !write) {
+            memcpy(buffer, io, bytes);
+        }
+        kfree(io);
+    }
+    return ret == 0 ? (int)count : -1;
+}
+
+static int ahci_blk_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer) {
+    return ahci_rw((ahci_port_t *)dev->priv, lba, count, buffer, false);
+}
+
+static int ahci_blk_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    return ahci_rw((ahci_port_t *)dev->priv, lba, count, (void *)buffer, true);
+}
+
+static int ahci_blk_flush(blkdev_t *dev) {
+    return ahci_exec((ahci_port_t *)dev->priv, ATA_CMD_FLUSH_EXT, 0, 0, NULL, 0, false, false);
+}
+
+static int ahci_blk_submit(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer, bool write,
+                           blk_done_t done, void *ctx) {
+    return ahci_submit((ahci_port_t *)dev->priv, lba, count, buffer, write, done, ctx);
+}
+
+static void ahci_blk_poll(blkdev_t *dev) {
+    ahci_port_complete((ahci_port_t *)dev->priv, false);
+}
+
+static const blkdev_ops_t ahci_blkdev_ops = {
+    .read = ahci_blk_read,
+    .write = ahci_blk_write,
+    .flush = ahci_blk_flush,
+    .submit = ahci_blk_submit,
+    .poll = ahci_blk_poll,
+};
+
+// ============== Probe ==============
+
+static bool ahci_identify(ahci_port_t *port) {
+    uint16_t *id = kmalloc(512);
+    if (!id) {
+        return false;
+    }
+    if (ahci_exec(port, ATA_CMD_IDENTIFY_DEV, 0, 0, id, 512, false, false) != 0) {
+        kfree(id);
+        return false;
+    }
+
+    blkdev_t *blk = &port->blk;
+    for (int i = 0; i < 20; i++) {
+        blk->model[i * 2] = (char)(id[27 + i] >> 8);
+        blk->model[i * 2 + 1] = (char)(id[27 + i] & 0xFF);
+    }
+    blk->model[40] = '\0';
+    for (int i = 39; i >= 0 && blk->model[i] == ' '; i--) {
+        blk->model[i] = '\0';
+    }
+
+    // Word 83 bit 10: 48-bit LBA, capacity in words 100-103
+    if (id[83] & (1u << 10)) {
+        blk->sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                       ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        blk->sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+    }
+
+    // Word 76 bit 8: NCQ, queue depth - 1 in word 75
+    port->ncq = (hba.cap & AHCI_CAP_SNCQ) && (id[76] & (1u << 8));
+    port->queue_depth = port->ncq ? (uint32_t)(id[75] & 0x1F) + 1 : hba.slots;
+    if (port->queue_depth > hba.slots) {
+        port->queue_depth = hba.slots;
+    }
+
+    kfree(id);
+    return blk->sectors != 0;
+}
+
+#define AHCI_TABLE_PAGES ((sizeof(ahci_cmd_table_t) * AHCI_MAX_SLOTS + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// Release a port that never went into service (its engine is stopped)
+static void ahci_port_free(ahci_port_t *port) {
+    if (port->cmd_list) {
+        physical_free_page((void *)port->cmd_list_phys);
+    }
+    if (port->tables) {
+        physical_free_pages((void *)port->tables_phys, AHCI_TABLE_PAGES);
+    }
+    kfree(port);
+}
+
+static ahci_port_t *ahci_port_init(int index) {
+    volatile uint8_t *regs = hba.abar + AHCI_PORT_BASE + index * AHCI_PORT_SIZE;
+    uint32_t ssts = *(volatile uint32_t *)(regs + AHCI_PxSSTS);
+    uint32_t sig = *(volatile uint32_t *)(regs + AHCI_PxSIG);
+    if ((ssts & 0x0F) != AHCI_SSTS_DET_PRESENT || sig != AHCI_SIG_ATA) {
+        return NULL;
+    }
+
+    ahci_port_t *port = kmalloc(sizeof(ahci_port_t));
+    if (!port) {
+        return NULL;
+    }
+    memset(port, 0, sizeof(*port));
+    port->hba = &hba;
+    port->index = index;
+    port->regs = regs;
+    spin_lock_init(&port->lock);
+    wait_queue_init(&port->slot_waiters);
+    wait_queue_init(&port->done_waiters);
+
+    // Command list (1 KiB) and received-FIS area share a page
+    uint8_t *base = ahci_alloc_dma(PAGE_SIZE, &port->cmd_list_phys);
+    port->cmd_list = (ahci_cmd_header_t *)base;
+    port->tables = ahci_alloc_dma(sizeof(ahci_cmd_table_t) * AHCI_MAX_SLOTS, &port->tables_phys);
+    if (!base || !port->tables) {
+        DEBUG_ERROR("AHCI: port %d: no DMA memory\n", index);
+        ahci_port_free(port);
+        return NULL;
+    }
+    port->fis = base + 1024;
+    port->fis_phys = port->cmd_list_phys + 1024;
+
+    if (!ahci_port_stop(port)) {
+        DEBUG_WARN("AHCI: port %d won't stop, using it anyway\n", index);
+    }
+    port_write(port, AHCI_PxCLB, (uint32_t)port->cmd_list_phys);
+    port_write(port, AHCI_PxCLBU, (uint32_t)(port->cmd_list_phys >> 32));
+    port_write(port, AHCI_PxFB, (uint32_t)port->fis_phys);
+    port_write(port, AHCI_PxFBU, (uint32_t)(port->fis_phys >> 32));
+    port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIE, AHCI_PxIS_DONE | AHCI_PxIS_ERRORS);
+    ahci_port_start(port);
+
+    // One slot until IDENTIFY has told us what the disk can queue
+    port->slots_mask = 1;
+    if (!ahci_identify(port)) {
+        DEBUG_WARN("AHCI: port %d: IDENTIFY failed\n", index);
+        port_write(port, AHCI_PxIE, 0);
+        if (!ahci_port_stop(port)) {
+            return NULL;    // Engine still running: leave its memory alone
+        }
+        ahci_port_free(port);
+        return NULL;
+    }
+    port->slots_mask = port->queue_depth >= 32 ? 0xFFFFFFFF : (1u << port->queue_depth) - 1;
+
+    blkdev_t *blk = &port->blk;
+    blk->name[0] = 's';
+    blk->name[1] = 'd';
+    blk->name[2] = (char)('a' + ahci_disk_count);
+    blk->name[3] = '\0';
+    blk->max_sectors = AHCI_MAX_SECTORS;
+    blk->driver = port->ncq ? "AHCI NCQ" : "AHCI";
+    blk->ops = &ahci_blkdev_ops;
+    blk->priv = port;
+
+    DEBUG_INFO("AHCI: port %d: %s, %lu sectors, %s depth %u\n", index, blk->model,
+               blk->sectors, port->ncq ? "NCQ" : "queue", port->queue_depth);
+    return port;
+}
+
+static void ahci_setup_interrupts(void) {
+    pci_device_t *pci = hba.pci;
+
+    if (lapic_is_ready() && pci_find_capability(pci, PCI_CAP_ID_MSI)) {
+        int vector = irq_alloc_msi_vector(ahci_irq, &hba);
+        if (vector >= 0 && pci_enable_msi(pci, (uint8_t)vector, smp_get_cpu(0)->lapic_id) == 0) {
+            hba.irq_mode = AHCI_IRQ_MSI;
+            hba.irq_vector = vector;
+        }
+    }
+
+    if (hba.irq_mode == AHCI_IRQ_POLLED) {
+        uint8_t line = pci->interrupt_line;
+        if (line < IRQ_LEGACY_FIRST || line > IRQ_LEGACY_LAST ||
+            irq_register_legacy(line, ahci_irq, &hba) != 0) {
+            DEBUG_WARN("AHCI: no usable interrupt (line %d), polling\n", line);
+            return;
+        }
+        hba.irq_mode = AHCI_IRQ_INTX;
+        hba.irq_vector = TIMER_VECTOR + line;
+    }
+
+    hba_write(AHCI_IS, 0xFFFFFFFF);
+    hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_IE);
+    DEBUG_INFO("AHCI: %s interrupts on vector 0x%x\n",
+               hba.irq_mode == AHCI_IRQ_MSI ? "MSI" : "INTx", hba.irq_vector);
+}
+
+int ahci_init(void) {
+    pci_device_t *pci = NULL;
+    for (int i = 0; i < pci_get_device_count() && !pci; i++) {
+        pci_device_t *dev = pci_get_device(i);
+        if (dev && dev->class_code == PCI_CLASS_STORAGE && dev->subclass == PCI_SUBCLASS_SATA &&
+            dev->prog_if == PCI_PROG_IF_AHCI) {
+            pci = dev;
+        }
+    }
+    if (!pci) {
+        DEBUG_INFO("AHCI: no controller found\n");
+        return -1;
+    }
+
+    uint64_t abar_phys = pci->bar[5] & 0xFFFFFFF0;
+    if (abar_phys == 0 || (pci->bar[5] & 0x1)) {
+        DEBUG_ERROR("AHCI: bad ABAR 0x%x\n", pci->bar[5]);
+        return -1;
+    }
+
+    uint16_t command = pci_config_read16(pci->bus, pci->device, pci->function, PCI_COMMAND);
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    pci_config_write16(pci->bus, pci->device, pci->function, PCI_COMMAND, command);
+
+    hba.abar = (volatile uint8_t *)vmm_map_mmio(abar_phys, AHCI_ABAR_SIZE);
+    if (!hba.abar) {
+        DEBUG_ERROR("AHCI: failed to map ABAR\n");
+        return -1;
+    }
+    hba.pci = pci;
+
+    // AHCI mode, interrupts off until the ports are set up
+    hba_write(AHCI_GHC, (hba_read(AHCI_GHC) | AHCI_GHC_AE) & ~AHCI_GHC_IE);
+    hba.cap = hba_read(AHCI_CAP);
+    hba.slots = ((hba.cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+
+    uint32_t vs = hba_read(AHCI_VS);
+    DEBUG_INFO("AHCI %u.%u at %d:%d.%d, %u slots%s\n", vs >> 16, (vs >> 8) & 0xFF,
+               pci->bus, pci->device, pci->function, hba.slots,
+               (hba.cap & AHCI_CAP_SNCQ) ? ", NCQ" : "");
+
+    uint32_t implemented = hba_read(AHCI_PI);
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!(implemented & (1u << i))) {
+            continue;
+        }
+        ahci_port_t *port = ahci_port_init(i);
+        if (port) {
+            hba.ports[i] = port;
+            ahci_disk_count++;
+        }
+    }
+
+    ahci_setup_interrupts();
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (hba.ports[i]) {
+            blkdev_register(&hba.ports[i]->blk);
+        }
+    }
+    return ahci_disk_count;
+}
@@ -0,0 +1,176 @@
+/**
+ * AHCI (SATA) Driver for CGOS
+ *
+ * Drives an AHCI host bus adapter found on the PCI bus. Every port with a
+ * SATA disk attached becomes a block device; commands use 48-bit LBA and,
+ * when both the HBA and the disk support it, native command queueing with
+ * up to 32 commands in flight per port. Completion is interrupt driven.
+ */
+
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "blkdev.h"
+#include "../pci/pci.h"
+#include "../sched/spinlock.h"
+#include "../sched/waitqueue.h"
+
+#define PCI_SUBCLASS_SATA       0x06
+#define PCI_PROG_IF_AHCI        0x01
+
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+#define AHCI_PRDT_ENTRIES       48      // Per command table; one per physical run
+#define AHCI_MAX_SECTORS        256     // Per command (128 KiB)
+#define AHCI_CMD_TIMEOUT_MS     5000
+#define AHCI_POLL_MS            10      // Waiters also poll, in case an IRQ is lost
+
+// HBA (generic host control) registers
+#define AHCI_CAP                0x00
+#define AHCI_GHC                0x04
+#define AHCI_IS                 0x08
+#define AHCI_PI                 0x0C
+#define AHCI_VS                 0x10
+
+#define AHCI_CAP_NCS_SHIFT      8       // Command slots - 1, bits 12:8
+#define AHCI_CAP_SNCQ           (1u << 30)
+#define AHCI_CAP_S64A           (1u << 31)
+
+#define AHCI_GHC_HR             (1u << 0)
+#define AHCI_GHC_IE             (1u << 1)
+#define AHCI_GHC_AE             (1u << 31)
+
+// Port registers, at 0x100 + port * 0x80
+#define AHCI_PORT_BASE          0x100
+#define AHCI_PORT_SIZE          0x80
+#define AHCI_PxCLB              0x00
+#define AHCI_PxCLBU             0x04
+#define AHCI_PxFB               0x08
+#define AHCI_PxFBU              0x0C
+#define AHCI_PxIS               0x10
+#define AHCI_PxIE               0x14
+#define AHCI_PxCMD              0x18
+#define AHCI_PxTFD              0x20
+#define AHCI_PxSIG              0x24
+#define AHCI_PxSSTS             0x28
+#define AHCI_PxSERR             0x30
+#define AHCI_PxSACT             0x34
+#define AHCI_PxCI               0x38
+
+#define AHCI_PxCMD_ST           (1u << 0)
+#define AHCI_PxCMD_FRE          (1u << 4)
+#define AHCI_PxCMD_FR           (1u << 14)
+#define AHCI_PxCMD_CR           (1u << 15)
+
+// Port interrupts: D2H register, PIO setup, DMA setup and set-device-bits
+// FISes signal completion; the high bits are errors
+#define AHCI_PxIS_DONE          0x0000000F
+#define AHCI_PxIS_ERRORS        0x78000010  // TFE, HBF, HBD, IF, unknown FIS
+
+#define AHCI_SSTS_DET_PRESENT   0x3     // Device present, PHY up
+#define AHCI_SIG_ATA            0x00000101
+
+// FIS types and ATA commands
+#define AHCI_FIS_H2D            0x27
+#define AHCI_FIS_H2D_CMD        0x80    // Command (not control) update
+
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_EXT       0xEA
+#define ATA_CMD_IDENTIFY_DEV    0xEC
+
+// Command list entry
+typedef struct __attribute__((packed)) {
+    uint16_t flags;                 // CFL in bits 4:0, W = bit 6, C = bit 10
+    uint16_t prdtl;                 // PRDT entries
+    volatile uint32_t prdbc;        // Bytes transferred
+    uint32_t ctba;                  // Command table, 128-byte aligned
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} ahci_cmd_header_t;
+
+#define AHCI_CMD_FLAG_WRITE     (1u << 6)
+#define AHCI_CMD_FLAG_CLEAR_BSY (1u << 10)
+
+typedef struct __attribute__((packed)) {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;                   // Byte count - 1 (bit 0 set), bit 31 = IRQ on completion
+} ahci_prd_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} ahci_cmd_table_t;
+
+// Completion callback: status is 0 or -1
+typedef void (*ahci_done_t)(void *ctx, int status);
+
+typedef struct ahci_slot {
+    ahci_done_t done;
+    void *ctx;
+} ahci_slot_t;
+
+struct ahci_hba;
+
+typedef struct ahci_port {
+    struct ahci_hba *hba;
+    int index;
+    volatile uint8_t *regs;
+
+    ahci_cmd_header_t *cmd_list;    // 32 headers, 1 KiB
+    uint64_t cmd_list_phys;
+    uint8_t *fis;                   // Received FIS area, 256 bytes
+    uint64_t fis_phys;
+    ahci_cmd_table_t *tables;       // One per slot
+    uint64_t tables_phys;
+
+    spinlock_t lock;
+    uint32_t slots_mask;            // Usable slots
+    uint32_t busy;                  // Slots handed out
+    uint32_t issued;                // Slots the HBA owns (CI or SACT set)
+    bool exclusive;                 // A non-queued command is running alone
+    ahci_slot_t slot[AHCI_MAX_SLOTS];
+    wait_queue_t slot_waiters;      // Waiting for a free slot
+    wait_queue_t done_waiters;      // Waiting for a command to finish
+
+    bool ncq;
+    uint32_t queue_depth;
+
+    blkdev_t blk;
+} ahci_port_t;
+
+typedef struct ahci_hba {
+    pci_device_t *pci;
+    volatile uint8_t *abar;
+    uint32_t cap;
+    uint32_t slots;                 // Command slots per port
+    uint8_t irq_mode;               // AHCI_IRQ_*
+    int irq_vector;
+    ahci_port_t *ports[AHCI_MAX_PORTS];
+} ahci_hba_t;
+
+#define AHCI_IRQ_POLLED         0
+#define AHCI_IRQ_INTX           1
+#define AHCI_IRQ_MSI            2
+
+// Probe the PCI bus for an AHCI controller and register its disks as
+// block devices. Returns the number of disks found, or -1 if no HBA.
+int ahci_init(void);
+
+// Queue a read or write on a port. 'done' runs (possibly from the IRQ
+// handler) when the transfer finishes. Sleeps while every slot is busy.
+// The buffer must be 2-byte aligned and stay valid until completion.
+// Returns 0 if queued, -1 for a request the port can't express.
+int ahci_submit(ahci_port_t *port, uint64_t lba, uint32_t count, void *buffer, bool write,
+                ahci_done_t done, void *ctx);
+
+#endif // AHCI_H
@@ -1,16 +1,57 @@
 /**
  * ATA/IDE Driver Implementation
  * 
- * PIO mode driver for primary IDE channel
+ * Bus-master DMA with PIO fallback for the primary IDE channel
  */
 
 #include "ata.h"
+#include "blkdev.h"
 #include "../pci/pci.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../interrupt/irq.h"
+#include "../sched/sync.h"
+#include "../sched/waitqueue.h"
 #include "../debug/debug.h"
 
+// Largest transfer (count is 8 bits) and how long one may take
+#define ATA_DMA_BOUNCE_SIZE (256 * ATA_SECTOR_SIZE)
+#define ATA_DMA_TIMEOUT_MS  5000
+
+// PRD entries for the bounce buffer, split at 64 KiB boundaries
+#define ATA_PRD_MAX         4
+#define ATA_PRD_EOT         0x8000
+
+// Physical Region Descriptor: one contiguous piece of a DMA transfer.
+// A byte count of 0 means 64 KiB.
+typedef struct __attribute__((packed)) {
+    uint32_t phys;
+    uint16_t bytes;
+    uint16_t flags;
+} ata_prd_t;
+
 // Drive information
 static ata_drive_t drives[2];  // Master and slave
 
+// One command at a time on the channel
+static mutex_t ata_lock = MUTEX_INIT;
+
+// Bus master state. Callers' buffers can be anywhere in the heap, so DMA
+// goes through one physically contiguous bounce buffer below 4 GiB.
+static uint16_t bm_base = 0;            // 0 = no bus master, PIO only
+static ata_prd_t *prd_table = NULL;
+static uint64_t prd_phys = 0;
+static uint8_t *bounce = NULL;
+static uint64_t bounce_phys = 0;
+
+// Block device view of each drive
+static blkdev_t ata_blkdev[2];
+
+static wait_queue_t dma_waiters = WAIT_QUEUE_INIT;
+static volatile bool dma_done = false;
+static volatile uint8_t dma_bm_status = 0;  // Bus master status the IRQ saw
+
 // Port I/O functions (from pci.h)
 extern uint8_t inb(uint16_t port);
 extern void outb(uint16_t port, uint8_t value);
@@ -101,6 +142,9 @@ static bool ata_identify(int drive) {
     
     // Total sectors (LBA28)
     drives[drive].size_sectors = identify[60] | ((uint32_t)identify[61] << 16);
+
+    // Capabilities word: bit 8 = DMA supported
+    drives[drive].dma = (identify[49] & 0x0100) != 0;
     
     // Model name (words 27-46)
     for (int i = 0; i < 20; i++) {
@@ -124,6 +168,117 @@ static bool ata_identify(int drive) {
     return true;
 }
 
+// IRQ 14. Reading the status register acknowledges the drive; during a
+// DMA transfer the bus master's IRQ bit says the transfer is over.
+static void ata_irq(void *ctx) {
+    (void)ctx;
+    uint8_t bm = bm_base ? inb(bm_base + ATA_BM_STATUS) : 0;
+    inb(ATA_PRIMARY_STATUS);
+
+    if (bm & ATA_BM_SR_IRQ) {
+        dma_bm_status = bm;
+        dma_done = true;
+        outb(bm_base + ATA_BM_STATUS, bm | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+        wait_queue_wake_all(&dma_waiters);
+    }
+}
+
+// Find a bus-master capable IDE controller with the primary channel in
+// compatibility mode (the ports this driver hardcodes) and set up the
+// PRD table, bounce buffer and interrupt
+static void ata_dma_init(void) {
+    pci_device_t *ide = NULL;
+    for (int i = 0; i < pci_get_device_count() && !ide; i++) {
+        pci_device_t *dev = pci_get_device(i);
+        if (dev && dev->class_code == PCI_CLASS_STORAGE && dev->subclass == PCI_SUBCLASS_IDE &&
+            (dev->prog_if & 0x80) && !(dev->prog_if & 0x01) && (dev->bar[4] & 0x01)) {
+            ide = dev;
+        }
+    }
+    if (!ide) {
+        DEBUG_INFO("ATA: no bus-master IDE controller, using PIO\n");
+        return;
+    }
+
+    void *prd_mem = physical_alloc_page();
+    void *bounce_mem = physical_alloc_pages(ATA_DMA_BOUNCE_SIZE / PAGE_SIZE);
+    if (!prd_mem || !bounce_mem ||
+        (uint64_t)bounce_mem + ATA_DMA_BOUNCE_SIZE > 0x100000000ULL ||
+        (uint64_t)prd_mem + PAGE_SIZE > 0x100000000ULL) {
+        // The bus master only takes 32-bit addresses
+        if (prd_mem) physical_free_page(prd_mem);
+        if (bounce_mem) physical_free_pages(bounce_mem, ATA_DMA_BOUNCE_SIZE / PAGE_SIZE);
+        DEBUG_WARN("ATA: no DMA-able memory below 4 GiB, using PIO\n");
+        return;
+    }
+    prd_phys = (uint64_t)prd_mem;
+    prd_table = (ata_prd_t *)PHYS_TO_HHDM(prd_mem);
+    bounce_phys = (uint64_t)bounce_mem;
+    bounce = (uint8_t *)PHYS_TO_HHDM(bounce_mem);
+
+    if (irq_register_legacy(ATA_IRQ_PRIMARY, ata_irq, NULL) != 0) {
+        physical_free_page(prd_mem);
+        physical_free_pages(bounce_mem, ATA_DMA_BOUNCE_SIZE / PAGE_SIZE);
+        prd_table = NULL;
+        bounce = NULL;
+        DEBUG_WARN("ATA: IRQ %d unavailable, using PIO\n", ATA_IRQ_PRIMARY);
+        return;
+    }
+
+    uint16_t cmd = pci_config_read16(ide->bus, ide->device, ide->function, PCI_COMMAND);
+    pci_config_write16(ide->bus, ide->device, ide->function, PCI_COMMAND,
+                       cmd | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+    bm_base = (uint16_t)(ide->bar[4] & 0xFFFC);
+    outb(bm_base + ATA_BM_CMD, 0);
+    outb(bm_base + ATA_BM_STATUS, ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+
+    // Let the drive interrupt us (nIEN clear)
+    outb(ATA_PRIMARY_CONTROL, 0x00);
+
+    DEBUG_INFO("ATA: bus-master DMA at I/O 0x%x, IRQ %d\n", bm_base, ATA_IRQ_PRIMARY);
+}
+
+static int ata_blk_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer) {
+    return ata_read_sectors((int)(intptr_t)dev->priv, (uint32_t)lba, (uint8_t)count, buffer);
+}
+
+static int ata_blk_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    return ata_write_sectors((int)(intptr_t)dev->priv, (uint32_t)lba, (uint8_t)count, buffer);
+}
+
+static int ata_blk_flush(blkdev_t *dev) {
+    return ata_flush((int)(intptr_t)dev->priv);
+}
+
+static const blkdev_ops_t ata_blkdev_ops = {
+    .read = ata_blk_read,
+    .write = ata_blk_write,
+    .flush = ata_blk_flush,
+};
+
+static void ata_register_blkdevs(void) {
+    for (int drive = 0; drive < 2; drive++) {
+        if (!ata_drive_present(drive)) {
+            continue;
+        }
+        blkdev_t *blk = &ata_blkdev[drive];
+        blk->name[0] = 'h';
+        blk->name[1] = 'd';
+        blk->name[2] = (char)('a' + drive);
+        blk->name[3] = '\0';
+        for (int i = 0; i < 41; i++) {
+            blk->model[i] = drives[drive].model[i];
+        }
+        blk->sectors = drives[drive].size_sectors;
+        blk->max_sectors = 255;             // 8-bit sector count
+        blk->driver = bm_base && drives[drive].dma ? "ATA DMA" : "ATA PIO";
+        blk->ops = &ata_blkdev_ops;
+        blk->priv = (void *)(intptr_t)drive;
+        blkdev_register(blk);
+    }
+}
+
 int ata_init(void) {
     DEBUG_INFO("Initializing ATA driver...\n");
     
@@ -135,6 +290,7 @@ int ata_init(void) {
         drives[i].present = false;
         drives[i].is_ata = false;
         drives[i].size_sectors = 0;
+        drives[i].dma = false;
         drives[i].model[0] = '\0';
         drives[i].serial[0] = '\0';
     }
@@ -155,6 +311,9 @@ int ata_init(void) {
         DEBUG_INFO("No ATA drives detected\n");
         return -1;
     }
+
+    ata_dma_init();
+    ata_register_blkdevs();
     
     DEBUG_INFO("ATA driver initialized\n");
     return 0;
@@ -170,22 +329,94 @@ ata_drive_t *ata_get_drive_info(int drive) {
     return &drives[drive];
 }
 
-int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void *buffer) {
-    if (!ata_drive_present(drive)) return -1;
-    if (count == 0) return 0;
-    
-    // Wait for drive ready
-    if (ata_wait_ready() < 0) return -1;
-    
-    // Select drive with LBA mode
+bool ata_dma_enabled(void) {
+    return bm_base != 0;
+}
+
+// Select the drive in LBA mode and load the task file for a transfer
+static void ata_setup_lba(int drive, uint32_t lba, uint8_t count) {
     uint8_t drv_sel = 0xE0 | ((drive & 1) << 4) | ((lba >> 24) & 0x0F);
     outb(ATA_PRIMARY_DRIVE, drv_sel);
-    
-    // Send read command
+
     outb(ATA_PRIMARY_SECCOUNT, count);
     outb(ATA_PRIMARY_LBA_LO, lba & 0xFF);
     outb(ATA_PRIMARY_LBA_MID, (lba >> 8) & 0xFF);
     outb(ATA_PRIMARY_LBA_HI, (lba >> 16) & 0xFF);
+}
+
+// Done once the IRQ handler has seen it, or, with interrupts off or lost,
+// once the bus master reports the drive's interrupt itself
+static bool ata_dma_complete(void) {
+    return dma_done || (inb(bm_base + ATA_BM_STATUS) & ATA_BM_SR_IRQ);
+}
+
+// One DMA command through the bounce buffer. Returns count, or -1 so the
+// caller can retry with PIO. Called with ata_lock held.
+static int ata_dma_transfer(int drive, uint32_t lba, uint8_t count, void *buffer, bool write) {
+    size_t bytes = (size_t)count * ATA_SECTOR_SIZE;
+
+    // A PRD entry may not cross a 64 KiB boundary
+    uint64_t addr = bounce_phys;
+    size_t remaining = bytes;
+    int n = 0;
+    while (remaining > 0 && n < ATA_PRD_MAX) {
+        size_t chunk = 0x10000 - (addr & 0xFFFF);
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        prd_table[n].phys = (uint32_t)addr;
+        prd_table[n].bytes = (uint16_t)(chunk & 0xFFFF);
+        prd_table[n].flags = 0;
+        addr += chunk;
+        remaining -= chunk;
+        n++;
+    }
+    prd_table[n - 1].flags = ATA_PRD_EOT;
+
+    if (write) {
+        memcpy(bounce, buffer, bytes);
+    }
+
+    if (ata_wait_ready() < 0) return -1;
+
+    uint8_t dir = write ? 0 : ATA_BM_CMD_READ;
+    outb(bm_base + ATA_BM_CMD, dir);
+    outl(bm_base + ATA_BM_PRDT, (uint32_t)prd_phys);
+    outb(bm_base + ATA_BM_STATUS, inb(bm_base + ATA_BM_STATUS) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+    dma_bm_status = 0;
+    dma_done = false;
+
+    ata_setup_lba(drive, lba, count);
+    outb(ATA_PRIMARY_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    outb(bm_base + ATA_BM_CMD, dir | ATA_BM_CMD_START);
+
+    bool finished = wait_event_timeout(&dma_waiters, ata_dma_complete(), ATA_DMA_TIMEOUT_MS);
+
+    // Stop the engine, then collect and clear both status registers
+    outb(bm_base + ATA_BM_CMD, dir);
+    uint8_t bm = inb(bm_base + ATA_BM_STATUS) | dma_bm_status;
+    uint8_t status = inb(ATA_PRIMARY_STATUS);
+    outb(bm_base + ATA_BM_STATUS, ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+
+    if (!finished || (bm & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+        DEBUG_WARN("ATA: DMA %s of %d sectors at %u failed (bm=0x%x status=0x%x%s)\n",
+                   write ? "write" : "read", count, lba, bm, status,
+                   finished ? "" : ", timeout");
+        return -1;
+    }
+
+    if (!write) {
+        memcpy(buffer, bounce, bytes);
+    }
+    return count;
+}
+
+static int ata_pio_read(int drive, uint32_t lba, uint8_t count, void *buffer) {
+    // Wait for drive ready
+    if (ata_wait_ready() < 0) return -1;
+    
+    // Send read command
+    ata_setup_lba(drive, lba, count);
     outb(ATA_PRIMARY_COMMAND, ATA_CMD_READ_SECTORS);
     
     // Read sectors
@@ -203,22 +434,12 @@ int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void *buffer) {
     return count;
 }
 
-int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void *buffer) {
-    if (!ata_drive_present(drive)) return -1;
-    if (count == 0) return 0;
-    
+static int ata_pio_write(int drive, uint32_t lba, uint8_t count, const void *buffer) {
     // Wait for drive ready
     if (ata_wait_ready() < 0) return -1;
     
-    // Select drive with LBA mode
-    uint8_t drv_sel = 0xE0 | ((drive & 1) << 4) | ((lba >> 24) & 0x0F);
-    outb(ATA_PRIMARY_DRIVE, drv_sel);
-    
     // Send write command
-    outb(ATA_PRIMARY_SECCOUNT, count);
-    outb(ATA_PRIMARY_LBA_LO, lba & 0xFF);
-    outb(ATA_PRIMARY_LBA_MID, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_LBA_HI, (lba >> 16) & 0xFF);
+    ata_setup_lba(drive, lba, count);
     outb(ATA_PRIMARY_COMMAND, ATA_CMD_WRITE_SECTORS);
     
     // Write sectors
@@ -232,10 +453,58 @@ int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void *buffer
             outw(ATA_PRIMARY_DATA, *buf++);
         }
     }
-    
-    // Flush cache
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_FLUSH);
-    ata_wait_ready();
+
+    // The last sector is accepted once BSY drops
+    if (ata_wait_ready() < 0) return -1;
     
     return count;
 }
+
+int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void *buffer) {
+    if (!ata_drive_present(drive)) return -1;
+    if (count == 0) return 0;
+
+    mutex_lock(&ata_lock);
+    int ret = -1;
+    if (bm_base && drives[drive].dma) {
+        ret = ata_dma_transfer(drive, lba, count, buffer, false);
+    }
+    if (ret < 0) {
+        ret = ata_pio_read(drive, lba, count, buffer);
+    }
+    mutex_unlock(&ata_lock);
+    return ret;
+}
+
+int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void *buffer) {
+    if (!ata_drive_present(drive)) return -1;
+    if (count == 0) return 0;
+
+    mutex_lock(&ata_lock);
+    int ret = -1;
+    if (bm_base && drives[drive].dma) {
+        ret = ata_dma_transfer(drive, lba, count, (void *)buffer, true);
+    }
+    if (ret < 0) {
+        ret = ata_pio_write(drive, lba, count, buffer);
+    }
+    mutex_unlock(&ata_lock);
+    return ret;
+}
+
+int ata_flush(int drive) {
+    if (!ata_drive_present(drive)) return -1;
+
+    mutex_lock(&ata_lock);
+    int ret = ata_wait_ready();
+    if (ret == 0) {
+        ata_select_drive(drive);
+        outb(ATA_PRIMARY_COMMAND, ATA_CMD_FLUSH);
+        ret = ata_wait_ready();
+        if (ret == 0 && (inb(ATA_PRIMARY_STATUS) & (ATA_SR_ERR | ATA_SR_DF))) {
+            ret = -1;
+        }
+    }
+    mutex_unlock(&ata_lock);
+    return ret;
+}
@@ -1,7 +1,9 @@
 /**
  * ATA/IDE Driver for CGOS
  * 
- * PIO mode driver for primary IDE channel
+ * Primary IDE channel driver. Transfers use PCI bus-master DMA when the
+ * controller and drive support it, completing on IRQ 14, and fall back to
+ * PIO otherwise.
  */
 
 #ifndef ATA_H
@@ -27,6 +29,8 @@
 // ATA Commands
 #define ATA_CMD_READ_SECTORS   0x20
 #define ATA_CMD_WRITE_SECTORS  0x30
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
 #define ATA_CMD_IDENTIFY       0xEC
 #define ATA_CMD_FLUSH          0xE7
 
@@ -40,6 +44,20 @@
 #define ATA_SR_IDX   0x02  // Index
 #define ATA_SR_ERR   0x01  // Error
 
+// Bus master IDE registers (offsets from BAR4, primary channel)
+#define ATA_BM_CMD     0x00
+#define ATA_BM_STATUS  0x02
+#define ATA_BM_PRDT    0x04
+
+#define ATA_BM_CMD_START    0x01  // Start/stop the transfer
+#define ATA_BM_CMD_READ     0x08  // Device to memory
+
+#define ATA_BM_SR_ACTIVE    0x01  // Transfer in progress
+#define ATA_BM_SR_ERR       0x02  // DMA error (write 1 to clear)
+#define ATA_BM_SR_IRQ       0x04  // Drive raised its interrupt (write 1 to clear)
+
+#define ATA_IRQ_PRIMARY     14
+
 // Drive selection
 #define ATA_DRIVE_MASTER 0x00
 #define ATA_DRIVE_SLAVE  0x10
@@ -52,6 +70,7 @@ typedef struct {
     bool present;
     bool is_ata;
     uint32_t size_sectors;
+    bool dma;               // Drive reports DMA support
     char model[41];
     char serial[21];
 } ata_drive_t;
@@ -63,4 +82,11 @@ int ata_read_sectors(int drive, uint32_t lba, uint8_t count, void *buffer);
 int ata_write_sectors(int drive, uint32_t lba, uint8_t count, const void *buffer);
 ata_drive_t *ata_get_drive_info(int drive);
 
+// Write the drive's volatile cache out to the media. Writes don't flush on
+// their own; callers flush at the points they need data to be durable.
+int ata_flush(int drive);
+
+// Whether transfers go through bus-master DMA
+bool ata_dma_enabled(void);
+
 #endif // ATA_H
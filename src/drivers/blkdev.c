@@ -0,0 +1,523 @@
+#include "blkdev.h"
+#include "../memory/memory.h"
+#include "../debug/debug.h"
+
+static blkdev_t *devices[MAX_BLOCK_DEVICES];
+static int device_count = 0;
+static spinlock_t blkdev_lock = SPINLOCK_INIT_NAMED("blkdev");
+
+// One driver command: a run of adjacent requests moved with one transfer
+typedef struct blk_batch {
+    blkdev_t *dev;
+    blk_request_t *reqs;            // In LBA order
+    uint64_t lba;
+    uint32_t count;
+    bool write;
+    uint8_t *buffer;                // The requests' own memory, or a gather buffer
+    bool bounce;
+    volatile uint32_t chunks_left;  // Outstanding driver calls, plus one while issuing
+    volatile int status;
+} blk_batch_t;
+
+static void blk_run_queue(blkdev_t *dev);
+
+static bool name_equal(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static void blk_queue_work(void *arg) {
+    blk_run_queue((blkdev_t *)arg);
+}
+
+int blkdev_register(blkdev_t *dev) {
+    if (!dev || !dev->ops || !dev->ops->read || dev->max_sectors == 0) {
+        return -1;
+    }
+
+    blk_queue_t *q = &dev->queue;
+    memset(q, 0, sizeof(*q));
+    spin_lock_init_named(&q->lock, "blk_queue");
+    wait_queue_init(&q->waiters);
+    work_init(&q->work, blk_queue_work, dev);
+
+    uint64_t flags = spin_lock_irqsave(&blkdev_lock);
+    int index = -1;
+    if (device_count < MAX_BLOCK_DEVICES) {
+        index = device_count;
+        devices[device_count++] = dev;
+    }
+    spin_unlock_irqrestore(&blkdev_lock, flags);
+
+    if (index < 0) {
+        DEBUG_WARN("blkdev: no slot for %s\n", dev->name);
+        return -1;
+    }
+    DEBUG_INFO("blkdev %d: %s %s (%lu MB, %s)\n", index, dev->name, dev->model,
+               dev->sectors / 2048, dev->driver ? dev->driver : "?");
+    return index;
+}
+
+int blkdev_count(void) {
+    return device_count;
+}
+
+blkdev_t *blkdev_get(int index) {
+    if (index < 0 || index >= device_count) {
+        return NULL;
+    }
+    return devices[index];
+}
+
+blkdev_t *blkdev_find(const char *name) {
+    for (int i = 0; i < device_count; i++) {
+        if (name_equal(devices[i]->name, name)) {
+            return devices[i];
+        }
+    }
+    return NULL;
+}
+
+void blkdev_get_stats(blkdev_t *dev, blkdev_stats_t *stats) {
+    blk_queue_t *q = &dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    stats->requests = q->requests;
+    stats->commands = q->commands;
+    stats->merged = q->merged;
+    stats->bounced = q->bounced;
+    stats->pending = q->pending;
+    stats->inflight = q->inflight;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+// ============== Requests ==============
+
+void blk_init_request(blk_request_t *req, blkdev_t *dev, uint64_t lba, uint32_t count,
+                      void *buffer, bool write) {
+    memset(req, 0, sizeof(*req));
+    req->dev = dev;
+    req->lba = lba;
+    req->count = count;
+    req->buffer = buffer;
+    req->write = write;
+    req->status = -1;
+}
+
+static bool blk_request_valid(blk_request_t *req) {
+    blkdev_t *dev = req->dev;
+    return dev && req->buffer && req->count > 0 && req->lba < dev->sectors &&
+           req->count <= dev->sectors - req->lba && (!req->write || dev->ops->write);
+}
+
+static void blk_end_request(blk_request_t *req, int status) {
+    req->status = status;
+    blk_end_io_t end_io = req->end_io;
+    __atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+    // The submitter may reuse 'req' as soon as done is visible, so end_io
+    // was read first
+    if (end_io) {
+        end_io(req, status);
+    }
+}
+
+static bool blk_overlaps(const blk_request_t *a, const blk_request_t *b) {
+    return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+// Insert after any request with the same start, keeping arrival order
+// among equals. Queue lock held.
+static void blk_insert_locked(blk_queue_t *q, blk_request_t *req) {
+    req->seq = q->next_seq++;
+    blk_request_t **link = &q->head;
+    while (*link && (*link)->lba <= req->lba) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+    q->pending++;
+    q->requests++;
+}
+
+// An older queued request that must go before 'req'
+static blk_request_t *blk_hazard_locked(blk_queue_t *q, blk_request_t *req) {
+    blk_request_t *oldest = NULL;
+    for (blk_request_t *r = q->head; r; r = r->next) {
+        if (r != req && r->seq < req->seq && (r->write || req->write) && blk_overlaps(r, req) &&
+            (!oldest || r->seq < oldest->seq)) {
+            oldest = r;
+        }
+    }
+    return oldest;
+}
+
+static bool blk_in_run(blk_request_t *first, blk_request_t *end, blk_request_t *req) {
+    for (blk_request_t *r = first; r != end; r = r->next) {
+        if (r == req) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void blk_unlink_locked(blk_queue_t *q, blk_request_t *req) {
+    for (blk_request_t **link = &q->head; *link; link = &(*link)->next) {
+        if (*link == req) {
+            *link = req->next;
+            req->next = NULL;
+            q->pending--;
+            return;
+        }
+    }
+}
+
+// Take the next command's worth of requests off the queue: the first
+// request at or past the sweep position (wrapping to the lowest LBA), plus
+// the adjacent requests after it going the same way. Queue lock held.
+static bool blk_take_batch_locked(blkdev_t *dev, blk_batch_t *batch) {
+    blk_queue_t *q = &dev->queue;
+    if (!q->head) {
+        return false;
+    }
+
+    blk_request_t *first = q->head;
+    for (blk_request_t *r = q->head; r; r = r->next) {
+        if (r->lba >= q->position) {
+            first = r;
+            break;
+        }
+    }
+    for (blk_request_t *h; (h = blk_hazard_locked(q, first)) != NULL; ) {
+        first = h;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+    batch->dev = dev;
+    batch->lba = first->lba;
+    batch->count = first->count;
+    batch->write = first->write;
+
+    // Collect the run before unlinking anything, so hazards see the queue
+    blk_request_t *last = first;
+    uint32_t extra = 0;
+    for (blk_request_t *r = first->next; r; r = r->next) {
+        if (r->write != batch->write || r->lba != batch->lba + batch->count ||
+            batch->count + r->count > dev->max_sectors) {
+            break;
+        }
+        blk_request_t *h = blk_hazard_locked(q, r);
+        if (h && !blk_in_run(first, r, h)) {
+            break;                  // Held back by something outside the run
+        }
+        batch->count += r->count;
+        last = r;
+        extra++;
+    }
+
+    blk_request_t *stop = last->next;
+    blk_request_t *tail = NULL;
+    for (blk_request_t *r = first; r != stop; ) {
+        blk_request_t *next = r->next;
+        blk_unlink_locked(q, r);
+        if (tail) {
+            tail->next = r;
+        } else {
+            batch->reqs = r;
+        }
+        tail = r;
+        r = next;
+    }
+
+    q->position = batch->lba + batch->count;
+    q->inflight++;
+    q->commands++;
+    q->merged += extra;
+    return true;
+}
+
+// ============== Dispatch ==============
+
+static void blk_finish_batch(blk_batch_t *batch, bool heap) {
+    blkdev_t *dev = batch->dev;
+    int status = batch->status;
+
+    if (batch->bounce) {
+        if (status == 0 && !batch->write) {
+            uint8_t *src = batch->buffer;
+            for (blk_request_t *r = batch->reqs; r; r = r->next) {
+                memcpy(r->buffer, src, (size_t)r->count * BLKDEV_SECTOR_SIZE);
+                src += (size_t)r->count * BLKDEV_SECTOR_SIZE;
+            }
+        }
+        kfree(batch->buffer);
+    }
+
+    for (blk_request_t *r = batch->reqs; r; ) {
+        blk_request_t *next = r->next;
+        r->next = NULL;
+        blk_end_request(r, status);
+        r = next;
+    }
+
+    blk_queue_t *q = &dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->inflight--;
+    bool more = q->head != NULL;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (heap) {
+        kfree(batch);
+    }
+    wait_queue_wake_all(&q->waiters);
+    if (more) {
+        work_schedule(&q->work);
+    }
+}
+
+static void blk_chunk_done(void *ctx, int status) {
+    blk_batch_t *batch = (blk_batch_t *)ctx;
+    if (status != 0) {
+        batch->status = -1;
+    }
+    if (__atomic_sub_fetch(&batch->chunks_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        blk_finish_batch(batch, true);
+    }
+}
+
+// Point the batch at the requests' memory when it is one contiguous run,
+// otherwise at a gather buffer. Returns false if that can't be allocated.
+static bool blk_map_batch(blk_batch_t *batch) {
+    uint8_t *expect = (uint8_t *)batch->reqs->buffer;
+    bool contiguous = true;
+    for (blk_request_t *r = batch->reqs; r; r = r->next) {
+        if ((uint8_t *)r->buffer != expect) {
+            contiguous = false;
+            break;
+        }
+        expect += (size_t)r->count * BLKDEV_SECTOR_SIZE;
+    }
+    if (contiguous) {
+        batch->buffer = (uint8_t *)batch->reqs->buffer;
+        return true;
+    }
+
+    batch->buffer = kmalloc((size_t)batch->count * BLKDEV_SECTOR_SIZE);
+    if (!batch->buffer) {
+        return false;
+    }
+    batch->bounce = true;
+    if (batch->write) {
+        uint8_t *dst = batch->buffer;
+        for (blk_request_t *r = batch->reqs; r; r = r->next) {
+            memcpy(dst, r->buffer, (size_t)r->count * BLKDEV_SECTOR_SIZE);
+            dst += (size_t)r->count * BLKDEV_SECTOR_SIZE;
+        }
+    }
+    return true;
+}
+
+static void blk_issue(blkdev_t *dev, blk_batch_t *batch, bool heap) {
+    if (!blk_map_batch(batch)) {
+        batch->status = -1;
+        blk_finish_batch(batch, heap);
+        return;
+    }
+    if (batch->bounce) {
+        uint64_t flags = spin_lock_irqsave(&dev->queue.lock);
+        dev->queue.bounced++;
+        spin_unlock_irqrestore(&dev->queue.lock, flags);
+    }
+
+    // Asynchronous drivers get every chunk at once and finish the batch
+    // from their completion; the extra count keeps it alive meanwhile
+    if (heap && dev->ops->submit && !((uintptr_t)batch->buffer & 1)) {
+        batch->chunks_left = 1;
+        for (uint32_t done = 0; done < batch->count; ) {
+            uint32_t n = batch->count - done < dev->max_sectors ? batch->count - done : dev->max_sectors;
+            __atomic_add_fetch(&batch->chunks_left, 1, __ATOMIC_ACQ_REL);
+            if (dev->ops->submit(dev, batch->lba + done, n,
+                                 batch->buffer + (size_t)done * BLKDEV_SECTOR_SIZE,
+                                 batch->write, blk_chunk_done, batch) != 0) {
+                blk_chunk_done(batch, -1);
+                batch->status = -1;
+                break;
+            }
+            done += n;
+        }
+        blk_chunk_done(batch, batch->status);
+        return;
+    }
+
+    for (uint32_t done = 0; done < batch->count && batch->status == 0; ) {
+        uint32_t n = batch->count - done < dev->max_sectors ? batch->count - done : dev->max_sectors;
+        uint8_t *buf = batch->buffer + (size_t)done * BLKDEV_SECTOR_SIZE;
+        int ret = batch->write ? dev->ops->write(dev, batch->lba + done, n, buf)
+                               : dev->ops->read(dev, batch->lba + done, n, buf);
+        if (ret != (int)n) {
+            batch->status = -1;
+        }
+        done += n;
+    }
+    blk_finish_batch(batch, heap);
+}
+
+// Drain the queue from the calling thread. Only one dispatcher runs per
+// device; anyone arriving meanwhile leaves their requests to it.
+static void blk_run_queue(blkdev_t *dev) {
+    blk_queue_t *q = &dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->running) {
+        spin_unlock_irqrestore(&q->lock, flags);
+        return;
+    }
+    q->running = true;
+
+    while (q->head) {
+        blk_batch_t local;
+        if (!blk_take_batch_locked(dev, &local)) {
+            break;
+        }
+        spin_unlock_irqrestore(&q->lock, flags);
+
+        blk_batch_t *batch = kmalloc(sizeof(blk_batch_t));
+        if (batch) {
+            *batch = local;
+            blk_issue(dev, batch, true);
+        } else {
+            blk_issue(dev, &local, false);
+        }
+
+        flags = spin_lock_irqsave(&q->lock);
+    }
+
+    q->running = false;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void blk_queue_request(blk_request_t *req) {
+    blk_queue_t *q = &req->dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    blk_insert_locked(q, req);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void blk_submit(blk_request_t *req) {
+    req->done = false;
+    req->next = NULL;
+    if (!blk_request_valid(req)) {
+        blk_end_request(req, -1);
+        return;
+    }
+    blk_queue_request(req);
+    work_schedule(&req->dev->queue.work);
+}
+
+void blk_plug_init(blk_plug_t *plug) {
+    plug->head = NULL;
+    plug->tail = NULL;
+}
+
+void blk_plug_add(blk_plug_t *plug, blk_request_t *req) {
+    req->done = false;
+    req->next = NULL;
+    if (!blk_request_valid(req)) {
+        blk_end_request(req, -1);
+        return;
+    }
+    if (plug->tail) {
+        plug->tail->next = req;
+    } else {
+        plug->head = req;
+    }
+    plug->tail = req;
+}
+
+void blk_plug_flush(blk_plug_t *plug) {
+    blkdev_t *touched[MAX_BLOCK_DEVICES];
+    int ntouched = 0;
+
+    for (blk_request_t *r = plug->head; r; ) {
+        blk_request_t *next = r->next;
+        blkdev_t *dev = r->dev;
+        blk_queue_request(r);
+
+        bool seen = false;
+        for (int i = 0; i < ntouched; i++) {
+            seen |= touched[i] == dev;
+        }
+        if (!seen && ntouched < MAX_BLOCK_DEVICES) {
+            touched[ntouched++] = dev;
+        }
+        r = next;
+    }
+    plug->head = NULL;
+    plug->tail = NULL;
+
+    for (int i = 0; i < ntouched; i++) {
+        blk_run_queue(touched[i]);
+    }
+}
+
+static bool blk_poll_done(blkdev_t *dev, volatile bool *done) {
+    if (!__atomic_load_n(done, __ATOMIC_ACQUIRE) && dev->ops->poll) {
+        dev->ops->poll(dev);
+    }
+    return __atomic_load_n(done, __ATOMIC_ACQUIRE);
+}
+
+int blk_wait(blk_request_t *req) {
+    blkdev_t *dev = req->dev;
+    while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+        // Dispatch here rather than only waiting on the worker, which
+        // doesn't run before the scheduler starts
+        blk_run_queue(dev);
+        wait_event_timeout(&dev->queue.waiters, blk_poll_done(dev, &req->done), BLK_POLL_MS);
+    }
+    return req->status;
+}
+
+// ============== Synchronous Wrappers ==============
+
+int blkdev_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer) {
+    blk_request_t req;
+    blk_plug_t plug;
+    blk_init_request(&req, dev, lba, count, buffer, false);
+    blk_plug_init(&plug);
+    blk_plug_add(&plug, &req);
+    blk_plug_flush(&plug);
+    return blk_wait(&req) == 0 ? (int)count : -1;
+}
+
+int blkdev_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    blk_request_t req;
+    blk_plug_t plug;
+    blk_init_request(&req, dev, lba, count, (void *)buffer, true);
+    blk_plug_init(&plug);
+    blk_plug_add(&plug, &req);
+    blk_plug_flush(&plug);
+    return blk_wait(&req) == 0 ? (int)count : -1;
+}
+
+static bool blk_idle(blkdev_t *dev) {
+    blk_queue_t *q = &dev->queue;
+    if (dev->ops->poll && q->inflight) {
+        dev->ops->poll(dev);
+    }
+    return __atomic_load_n(&q->pending, __ATOMIC_ACQUIRE) == 0 &&
+           __atomic_load_n(&q->inflight, __ATOMIC_ACQUIRE) == 0;
+}
+
+int blkdev_flush(blkdev_t *dev) {
+    if (!dev) {
+        return -1;
+    }
+
+    // A cache flush only covers writes the device has already completed
+    while (!blk_idle(dev)) {
+        blk_run_queue(dev);
+        wait_event_timeout(&dev->queue.waiters, blk_idle(dev), BLK_POLL_MS);
+    }
+    return dev->ops->flush ? dev->ops->flush(dev) : 0;
+}
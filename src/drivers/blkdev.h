@@ -0,0 +1,137 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../sched/spinlock.h"
+#include "../sched/waitqueue.h"
+#include "../sched/workqueue.h"
+
+// Block devices. Storage drivers (ATA, AHCI, ...) register one blkdev_t per
+// disk; filesystems address disks by registry index.
+//
+// I/O goes through a per-device request queue kept sorted by LBA. The
+// dispatcher sweeps it in one direction (C-SCAN) and folds runs of
+// adjacent same-direction requests into one driver command of up to
+// max_sectors, so many small filesystem requests become few large
+// transfers. Requests that overlap an older queued write (or a write that
+// overlaps an older read) are never dispatched ahead of it.
+//
+// Submitters either queue a request and return (blk_submit(), completion
+// through end_io or blk_wait()), or collect several on a blk_plug_t and
+// release them together so they merge before anything reaches the driver.
+
+#define MAX_BLOCK_DEVICES 8
+#define BLKDEV_SECTOR_SIZE 512
+#define BLK_POLL_MS 10              // Waiters re-poll drivers this often
+
+struct blkdev;
+struct blk_request;
+
+typedef void (*blk_end_io_t)(struct blk_request *req, int status);
+typedef void (*blk_done_t)(void *ctx, int status);
+
+// Driver operations. read/write move 'count' sectors (at most max_sectors)
+// and return count or -1. The rest are optional: submit starts the same
+// transfer and calls done later (it may sleep for a free slot first),
+// poll reaps completions when interrupts are off or lost.
+typedef struct blkdev_ops {
+    int (*read)(struct blkdev *dev, uint64_t lba, uint32_t count, void *buffer);
+    int (*write)(struct blkdev *dev, uint64_t lba, uint32_t count, const void *buffer);
+    int (*flush)(struct blkdev *dev);
+    int (*submit)(struct blkdev *dev, uint64_t lba, uint32_t count, void *buffer, bool write,
+                  blk_done_t done, void *ctx);
+    void (*poll)(struct blkdev *dev);
+} blkdev_ops_t;
+
+typedef struct blk_request {
+    struct blk_request *next;       // Queue / plug link
+    struct blkdev *dev;
+    uint64_t lba;
+    uint32_t count;
+    bool write;
+    void *buffer;
+    uint64_t seq;                   // Arrival order
+    volatile bool done;
+    int status;                     // 0 or -1 once done
+    blk_end_io_t end_io;            // Optional; may run in interrupt context
+    void *private;
+} blk_request_t;
+
+typedef struct blk_plug {
+    blk_request_t *head;
+    blk_request_t *tail;
+} blk_plug_t;
+
+typedef struct blk_queue {
+    spinlock_t lock;
+    blk_request_t *head;            // Pending requests, sorted by LBA
+    uint32_t pending;
+    uint32_t inflight;              // Commands handed to the driver
+    uint64_t next_seq;
+    uint64_t position;              // Sweep position: LBA after the last command
+    bool running;                   // A dispatcher is draining the queue
+    work_t work;                    // Dispatches for asynchronous submitters
+    wait_queue_t waiters;           // Threads in blk_wait() / blkdev_flush()
+
+    uint64_t requests;
+    uint64_t commands;
+    uint64_t merged;                // Requests that rode along in another's command
+    uint64_t bounced;               // Commands that needed a gather buffer
+} blk_queue_t;
+
+typedef struct blkdev {
+    char name[8];                   // "hda", "sda", ...
+    char model[41];
+    uint64_t sectors;               // Capacity in BLKDEV_SECTOR_SIZE sectors
+    uint32_t max_sectors;           // Largest single transfer the driver takes
+    const char *driver;             // Short driver/mode tag for listings
+    const blkdev_ops_t *ops;
+    void *priv;                     // Driver's own per-disk state
+    blk_queue_t queue;
+} blkdev_t;
+
+typedef struct blkdev_stats {
+    uint64_t requests;
+    uint64_t commands;
+    uint64_t merged;
+    uint64_t bounced;
+    uint32_t pending;
+    uint32_t inflight;
+} blkdev_stats_t;
+
+// Add a disk. Returns its index, or -1 if the table is full.
+int blkdev_register(blkdev_t *dev);
+
+int blkdev_count(void);
+blkdev_t *blkdev_get(int index);
+blkdev_t *blkdev_find(const char *name);
+void blkdev_get_stats(blkdev_t *dev, blkdev_stats_t *stats);
+
+// Synchronous I/O through the queue. Returns count on success, -1 on error
+// or an out-of-range request.
+int blkdev_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer);
+int blkdev_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer);
+
+// Wait for every queued and in-flight request, then flush the device cache
+int blkdev_flush(blkdev_t *dev);
+
+// Fill in a request; end_io and private stay NULL
+void blk_init_request(blk_request_t *req, blkdev_t *dev, uint64_t lba, uint32_t count,
+                      void *buffer, bool write);
+
+// Queue one request and return; a worker dispatches it. Out-of-range
+// requests complete at once with status -1.
+void blk_submit(blk_request_t *req);
+
+// Batch submission: add requests to a plug, then flush it to queue them
+// all and dispatch from the calling thread
+void blk_plug_init(blk_plug_t *plug);
+void blk_plug_add(blk_plug_t *plug, blk_request_t *req);
+void blk_plug_flush(blk_plug_t *plug);
+
+// Sleep until 'req' completes. Returns its status.
+int blk_wait(blk_request_t *req);
+
+#endif // BLKDEV_H
@@ -4,7 +4,12 @@
 #include "../memory/vmm.h"
 #include "../graphic/graphic.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
 #include "../timer/timer.h"
+#include "../interrupt/irq.h"
+#include "../interrupt/lapic.h"
+#include "../smp/smp.h"
+#include "../network/network.h"
 
 static e1000_device_t e1000_dev;
 static bool e1000_initialized = false;
@@ -120,74 +125,91 @@ void e1000_read_mac_address(e1000_device_t *dev) {
     }
 }
 
+#if E1000_NUM_RX_DESC % 8 || E1000_NUM_TX_DESC % 8
+#error "E1000 ring sizes must be multiples of 8 descriptors"
+#endif
+#if E1000_NUM_RX_DESC > E1000_MAX_DESC || E1000_NUM_TX_DESC > E1000_MAX_DESC
+#error "E1000 ring sizes are limited to E1000_MAX_DESC descriptors"
+#endif
+_Static_assert(E1000_NUM_RX_DESC < PBUF_POOL_SIZE,
+               "pbuf pool cannot fill the E1000 RX ring");
+
+// Zeroed, physically contiguous memory for a ring or its bookkeeping
+// (use physical pages + HHDM since kmalloc is broken). Returns the HHDM
+// address and stores the physical one in *phys.
+static void *e1000_alloc_dma(size_t bytes, uint64_t *phys) {
+    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *mem = physical_alloc_pages(pages);
+    if (!mem) {
+        return NULL;
+    }
+    
+    *phys = (uint64_t)mem;
+    void *virt = (void *)PHYS_TO_HHDM(mem);
+    memset(virt, 0, pages * PAGE_SIZE);
+    return virt;
+}
+
 int e1000_rx_init(e1000_device_t *dev) {
     if (!dev) {
         return -1;
     }
     
-    DEBUG_INFO("E1000 RX: Allocating descriptor ring...\n");
+    DEBUG_INFO("E1000 RX: Allocating descriptor ring (%d entries)...\n", E1000_NUM_RX_DESC);
     
     // Allocate RX descriptor ring using physical pages (DMA needs physical addresses)
-    // For DMA, we allocate physical pages and use them directly
-    void *rx_desc_phys = physical_alloc_page();
-    if (!rx_desc_phys) {
+    uint64_t rx_desc_phys;
+    dev->rx_desc = e1000_alloc_dma(E1000_NUM_RX_DESC * sizeof(e1000_rx_desc_t), &rx_desc_phys);
+    if (!dev->rx_desc) {
         DEBUG_ERROR("E1000 RX: Failed to allocate descriptor ring\n");
         return -1;
     }
     
-    // Access the descriptor ring via HHDM
-    dev->rx_desc = (e1000_rx_desc_t*)PHYS_TO_HHDM(rx_desc_phys);
-    memset(dev->rx_desc, 0, PAGE_SIZE);
-    
     DEBUG_INFO("E1000 RX: Descriptor ring at phys=0x%lx virt=0x%lx\n", 
-               (uint64_t)rx_desc_phys, (uint64_t)dev->rx_desc);
+               rx_desc_phys, (uint64_t)dev->rx_desc);
     
-    DEBUG_INFO("E1000 RX: Allocating buffer pointer array (%d entries, %zu bytes)...\n", 
-               E1000_NUM_RX_DESC, sizeof(uint8_t *) * E1000_NUM_RX_DESC);
-    
-    // Allocate buffer pointer array (use physical page + HHDM since kmalloc is broken)
-    void *buf_array_phys = physical_alloc_page();
-    if (!buf_array_phys) {
+    uint64_t buf_array_phys;
+    dev->rx_pbufs = e1000_alloc_dma(E1000_NUM_RX_DESC * sizeof(pbuf_t *), &buf_array_phys);
+    if (!dev->rx_pbufs) {
         DEBUG_ERROR("E1000 RX: Failed to allocate buffer array\n");
         return -1;
     }
-    dev->rx_buffers = (uint8_t **)PHYS_TO_HHDM(buf_array_phys);
-    memset(dev->rx_buffers, 0, PAGE_SIZE);
     
-    DEBUG_INFO("E1000 RX: Buffer pointer array at phys=0x%lx virt=0x%lx\n", 
-               (uint64_t)buf_array_phys, (uint64_t)dev->rx_buffers);
-    DEBUG_INFO("E1000 RX: Allocating %d packet buffers...\n", E1000_NUM_RX_DESC);
+    DEBUG_INFO("E1000 RX: Taking %d packet buffers from the pbuf pool...\n", E1000_NUM_RX_DESC);
     
-    // Initialize RX descriptors and buffers
+    // Initialize RX descriptors with pool buffers; received frames are passed
+    // up in these buffers and the slot is refilled with a fresh one
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        // Allocate physical page for each buffer (DMA needs physical addresses)
-        void *buf_phys = physical_alloc_page();
-        if (!buf_phys) {
+        pbuf_t *p = pbuf_alloc();
+        if (!p) {
             DEBUG_ERROR("E1000 RX: Failed to allocate buffer %d\n", i);
             return -1;
         }
         
-        // Store virtual address for kernel access
-        dev->rx_buffers[i] = (uint8_t *)PHYS_TO_HHDM(buf_phys);
+        dev->rx_pbufs[i] = p;
         
         // Hardware descriptor uses PHYSICAL address
-        dev->rx_desc[i].buffer_addr = (uint64_t)buf_phys;
+        dev->rx_desc[i].buffer_addr = p->phys;
         dev->rx_desc[i].status = 0;
     }
     
     dev->rx_cur = 0;
+    dev->rx_unposted = 0;
     
     DEBUG_INFO("E1000 RX: Setting up hardware registers...\n");
     
     // Set up RX registers with PHYSICAL addresses
     if (dev->mmio_base != 0) {
         // Descriptor ring physical address (64-bit split into high/low)
-        e1000_write_reg(dev, E1000_RDBAH, 0); // High 32 bits (assuming < 4GB)
-        e1000_write_reg(dev, E1000_RDBAL, (uint32_t)(uintptr_t)rx_desc_phys);
+        e1000_write_reg(dev, E1000_RDBAH, (uint32_t)(rx_desc_phys >> 32));
+        e1000_write_reg(dev, E1000_RDBAL, (uint32_t)rx_desc_phys);
         e1000_write_reg(dev, E1000_RDLEN, E1000_NUM_RX_DESC * sizeof(e1000_rx_desc_t));
         e1000_write_reg(dev, E1000_RDH, 0);
         e1000_write_reg(dev, E1000_RDT, E1000_NUM_RX_DESC - 1);
         
+        // Have the NIC check IP and TCP/UDP checksums on receive
+        e1000_write_reg(dev, E1000_RXCSUM, E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL);
+        
         // Configure RX control
         uint32_t rctl = E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SZ_2048 | 
                         E1000_RCTL_SECRC | E1000_RCTL_UPE | E1000_RCTL_MPE;
@@ -200,59 +222,44 @@ int e1000_rx_init(e1000_device_t *dev) {
 }
 
 int e1000_tx_init(e1000_device_t *dev) {
-    DEBUG_INFO("E1000 TX: Allocating descriptor ring...\n");
+    DEBUG_INFO("E1000 TX: Allocating descriptor ring (%d entries)...\n", E1000_NUM_TX_DESC);
     
     // Allocate TX descriptor ring using physical pages (DMA needs physical addresses)
-    void *tx_desc_phys = physical_alloc_page();
-    if (!tx_desc_phys) {
+    uint64_t tx_desc_phys;
+    dev->tx_desc = e1000_alloc_dma(E1000_NUM_TX_DESC * sizeof(e1000_tx_desc_t), &tx_desc_phys);
+    if (!dev->tx_desc) {
         DEBUG_ERROR("E1000 TX: Failed to allocate descriptor ring\n");
         return -1;
     }
     
-    // Access the descriptor ring via HHDM
-    dev->tx_desc = (e1000_tx_desc_t*)PHYS_TO_HHDM(tx_desc_phys);
-    memset(dev->tx_desc, 0, PAGE_SIZE);
-    
     DEBUG_INFO("E1000 TX: Descriptor ring at phys=0x%lx virt=0x%lx\n", 
-               (uint64_t)tx_desc_phys, (uint64_t)dev->tx_desc);
-    
-    // Allocate buffer pointer array (use physical page + HHDM since kmalloc is broken)
-    void *tx_buf_array_phys = physical_alloc_page();
-    if (!tx_buf_array_phys) {
-        DEBUG_ERROR("E1000 TX: Failed to allocate buffer array\n");
+               tx_desc_phys, (uint64_t)dev->tx_desc);
+    
+    // pbufs in flight, one slot per descriptor. Frames are always sent out
+    // of pbufs, so there are no per-descriptor bounce buffers.
+    uint64_t tx_pbuf_array_phys;
+    dev->tx_pbufs = e1000_alloc_dma(E1000_NUM_TX_DESC * sizeof(pbuf_t *), &tx_pbuf_array_phys);
+    if (!dev->tx_pbufs) {
+        DEBUG_ERROR("E1000 TX: Failed to allocate pbuf array\n");
         return -1;
     }
-    dev->tx_buffers = (uint8_t **)PHYS_TO_HHDM(tx_buf_array_phys);
-    memset(dev->tx_buffers, 0, PAGE_SIZE);
     
-    DEBUG_INFO("E1000 TX: Buffer pointer array at phys=0x%lx virt=0x%lx\n", 
-               (uint64_t)tx_buf_array_phys, (uint64_t)dev->tx_buffers);
-    DEBUG_INFO("E1000 TX: Allocating %d packet buffers...\n", E1000_NUM_TX_DESC);
-    
-    // Initialize TX descriptors and buffers
     for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
-        // Allocate physical page for each buffer
-        void *buf_phys = physical_alloc_page();
-        if (!buf_phys) {
-            DEBUG_ERROR("E1000 TX: Failed to allocate buffer %d\n", i);
-            return -1;
-        }
-        
-        // Store virtual address for kernel access
-        dev->tx_buffers[i] = (uint8_t *)PHYS_TO_HHDM(buf_phys);
-        
-        // Hardware descriptor uses PHYSICAL address
-        dev->tx_desc[i].buffer_addr = (uint64_t)buf_phys;
         dev->tx_desc[i].status = E1000_TXD_STAT_DD; // Mark as done initially
     }
     
     dev->tx_cur = 0;
+    dev->tx_clean = 0;
+    dev->tx_free = E1000_NUM_TX_DESC;
+    dev->tx_unposted = 0;
+    dev->tx_context = 0;
+    spin_lock_init_named(&dev->tx_lock, "e1000_tx");
     
     DEBUG_INFO("E1000 TX: Setting up hardware registers...\n");
     
     // Set up TX registers with PHYSICAL addresses
-    e1000_write_reg(dev, E1000_TDBAH, 0);
-    e1000_write_reg(dev, E1000_TDBAL, (uint32_t)(uintptr_t)tx_desc_phys);
+    e1000_write_reg(dev, E1000_TDBAH, (uint32_t)(tx_desc_phys >> 32));
+    e1000_write_reg(dev, E1000_TDBAL, (uint32_t)tx_desc_phys);
     e1000_write_reg(dev, E1000_TDLEN, E1000_NUM_TX_DESC * sizeof(e1000_tx_desc_t));
     e1000_write_reg(dev, E1000_TDH, 0);
     e1000_write_reg(dev, E1000_TDT, 0);
@@ -266,79 +273,285 @@ int e1000_tx_init(e1000_device_t *dev) {
     return 0;
 }
 
+// Sweep descriptors the hardware has finished with, returning their pbufs
+// to the pool. Called with tx_lock held.
+static void e1000_tx_reclaim(e1000_device_t *dev) {
+    while (dev->tx_free < E1000_NUM_TX_DESC &&
+           (dev->tx_desc[dev->tx_clean].status & E1000_TXD_STAT_DD)) {
+        pbuf_free(dev->tx_pbufs[dev->tx_clean]);
+        dev->tx_pbufs[dev->tx_clean] = NULL;
+        dev->tx_clean = (dev->tx_clean + 1) % E1000_NUM_TX_DESC;
+        dev->tx_free++;
+    }
+}
+
+// Tell the hardware about everything queued so far. Called with tx_lock held.
+static void e1000_tx_doorbell(e1000_device_t *dev) {
+    if (dev->tx_unposted) {
+        e1000_write_reg(dev, E1000_TDT, dev->tx_cur);
+        dev->tx_unposted = 0;
+    }
+}
+
 int e1000_send_packet(network_interface_t *iface, void *data, size_t len) {
-    (void)iface; // Unused - uses global e1000_dev
-    
     if (!e1000_initialized || !data || len == 0 || len > E1000_BUFFER_SIZE) {
-        DEBUG_WARN("E1000 TX: Invalid params (init=%d, data=%p, len=%zu)\n", 
+        DEBUG_WARN("E1000 TX: Invalid params (init=%d, data=%p, len=%lu)\n", 
                    e1000_initialized, data, len);
         return -1;
     }
     
+    // Copy data into a pool buffer and take the pbuf path
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
+        return -1;
+    }
+    memcpy(pbuf_put(p, len), data, len);
+    
+    if (e1000_tx_burst(iface, &p, 1) != 1) {
+        pbuf_free(p);
+        return -1;
+    }
+    
+    return len;
+}
+
+// Work out the checksum context a frame needs and the options for its data
+// descriptor. Returns a key identifying the context (0 if the frame needs no
+// offload), so consecutive frames with the same layout share one.
+static uint64_t e1000_tx_csum_setup(pbuf_t *p, e1000_context_desc_t *ctx, uint8_t *popts) {
+    *popts = 0;
+    if (!(p->csum_flags & (PBUF_TX_CSUM_IP | PBUF_TX_CSUM_TCP | PBUF_TX_CSUM_UDP)) ||
+        !p->l3_header) {
+        return 0;
+    }
+    
+    size_t ip_start = p->l3_header - p->data;
+    size_t ip_len = (p->l3_header[0] & 0x0F) * 4;
+    
+    ctx->ipcss = (uint8_t)ip_start;
+    ctx->ipcso = (uint8_t)(ip_start + 10);  // ip_header_t::checksum
+    ctx->ipcse = (uint16_t)(ip_start + ip_len - 1);
+    ctx->tucss = 0;
+    ctx->tucso = 0;
+    ctx->tucse = 0;
+    ctx->cmd_and_length = E1000_TXD_CTX_DEXT | E1000_TXD_CTX_RS | E1000_TXD_CTX_IP;
+    ctx->status = 0;
+    ctx->hdr_len = 0;
+    ctx->mss = 0;
+    
+    if (p->csum_flags & PBUF_TX_CSUM_IP) {
+        *popts |= E1000_TXD_POPTS_IXSM;
+    }
+    
+    if ((p->csum_flags & (PBUF_TX_CSUM_TCP | PBUF_TX_CSUM_UDP)) && p->l4_header) {
+        bool tcp = (p->csum_flags & PBUF_TX_CSUM_TCP) != 0;
+        size_t l4_start = p->l4_header - p->data;
+        ctx->tucss = (uint8_t)l4_start;
+        ctx->tucso = (uint8_t)(l4_start + (tcp ? 16 : 6));  // checksum field
+        if (tcp) {
+            ctx->cmd_and_length |= E1000_TXD_CTX_TCP;
+        }
+        *popts |= E1000_TXD_POPTS_TXSM;
+    }
+    
+    return (1ULL << 63) | ((uint64_t)ctx->cmd_and_length & E1000_TXD_CTX_TCP) |
+           ((uint64_t)ctx->ipcss << 32) | ((uint64_t)ctx->ipcse << 40) |
+           ((uint64_t)ctx->tucss << 8) | ((uint64_t)ctx->tucso << 16) | *popts;
+}
+
+int e1000_tx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    if (!e1000_initialized || !bufs || n <= 0) {
+        return 0;
+    }
+    
     e1000_device_t *dev = &e1000_dev;
+    int queued = 0;
     
-    // Check if current descriptor is available
-    if (!(dev->tx_desc[dev->tx_cur].status & E1000_TXD_STAT_DD)) {
-        DEBUG_WARN("E1000 TX: Ring full at cur=%d\n", dev->tx_cur);
-        return -1; // TX ring full
+    uint64_t flags = spin_lock_irqsave(&dev->tx_lock);
+    
+    // Reclaim completed descriptors in bulk once the ring runs low
+    if (dev->tx_free < E1000_TX_RECLAIM_THRESHOLD || dev->tx_free < n) {
+        e1000_tx_reclaim(dev);
+    }
+    
+    while (queued < n && dev->tx_free > 0) {
+        pbuf_t *p = bufs[queued];
+        
+        // Nothing the hardware could send: drop it, but count it as taken
+        if (!p || p->len == 0 || p->len > E1000_BUFFER_SIZE) {
+            pbuf_free(p);
+            queued++;
+            continue;
+        }
+        
+        // Load a new checksum context only when the header layout changes
+        e1000_context_desc_t ctx;
+        uint8_t popts;
+        uint64_t context = e1000_tx_csum_setup(p, &ctx, &popts);
+        bool new_context = context != 0 && context != dev->tx_context;
+        if (dev->tx_free < (new_context ? 2 : 1)) {
+            break;
+        }
+        queued++;
+        
+        if (new_context) {
+            *(e1000_context_desc_t *)&dev->tx_desc[dev->tx_cur] = ctx;
+            dev->tx_pbufs[dev->tx_cur] = NULL;
+            dev->tx_cur = (dev->tx_cur + 1) % E1000_NUM_TX_DESC;
+            dev->tx_free--;
+            dev->tx_unposted++;
+            dev->tx_context = context;
+        }
+        
+        // DMA straight out of the pbuf; it stays referenced until reclaimed
+        e1000_tx_desc_t *desc = &dev->tx_desc[dev->tx_cur];
+        dev->tx_pbufs[dev->tx_cur] = p;
+        desc->buffer_addr = pbuf_dma_addr(p);
+        desc->length = p->len;
+        desc->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+        desc->status = 0; // Clear status
+        desc->special = 0;
+        if (context != 0) {
+            // Extended data descriptor: checksums per the loaded context
+            desc->cso = E1000_TXD_DTYP_DATA;
+            desc->cmd |= E1000_TXD_CMD_DEXT;
+            desc->css = popts;
+        } else {
+            desc->cso = 0;
+            desc->css = 0;
+        }
+        
+        dev->tx_cur = (dev->tx_cur + 1) % E1000_NUM_TX_DESC;
+        dev->tx_free--;
+        dev->tx_unposted++;
     }
     
-    // Copy data to TX buffer
-    memcpy(dev->tx_buffers[dev->tx_cur], data, len);
+    // One tail write per burst. Inside a batch it is put off until the
+    // batch ends (or E1000_TX_DOORBELL_BATCH frames pile up); a full ring
+    // always rings so the backlog is actually being worked on.
+    if (!iface || __atomic_load_n(&iface->tx_batch, __ATOMIC_ACQUIRE) == 0 ||
+        dev->tx_unposted >= E1000_TX_DOORBELL_BATCH || dev->tx_free == 0) {
+        e1000_tx_doorbell(dev);
+    }
     
-    // Set up descriptor
-    dev->tx_desc[dev->tx_cur].length = len;
-    dev->tx_desc[dev->tx_cur].cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
-    dev->tx_desc[dev->tx_cur].status = 0; // Clear status
+    spin_unlock_irqrestore(&dev->tx_lock, flags);
     
-    // Update tail pointer to start transmission
-    uint16_t old_cur = dev->tx_cur;
-    dev->tx_cur = (dev->tx_cur + 1) % E1000_NUM_TX_DESC;
-    e1000_write_reg(dev, E1000_TDT, dev->tx_cur);
+    if (queued < n) {
+        DEBUG_WARN("E1000 TX: Ring full at cur=%d\n", dev->tx_cur);
+    }
     
-    DEBUG_INFO("E1000 TX: Sent packet len=%zu cur=%d->%d\n", len, old_cur, dev->tx_cur);
+    TRACE(TRACE_E1000_TX, queued, n);
+    return queued;
+}
+
+void e1000_tx_flush(network_interface_t *iface) {
+    (void)iface; // Unused - uses global e1000_dev
     
-    return len;
+    if (!e1000_initialized) {
+        return;
+    }
+    
+    e1000_device_t *dev = &e1000_dev;
+    uint64_t flags = spin_lock_irqsave(&dev->tx_lock);
+    e1000_tx_doorbell(dev);
+    spin_unlock_irqrestore(&dev->tx_lock, flags);
 }
 
-int e1000_receive_packet(network_interface_t *iface, void *buffer, size_t max_len) {
+// Give refilled descriptors back to the hardware: everything before rx_cur
+static void e1000_rx_doorbell(e1000_device_t *dev) {
+    if (dev->rx_unposted) {
+        uint16_t last = (dev->rx_cur + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC;
+        e1000_write_reg(dev, E1000_RDT, last);
+        dev->rx_unposted = 0;
+    }
+}
+
+int e1000_rx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
     (void)iface; // Unused - uses global e1000_dev
     
-    if (!e1000_initialized || !buffer || max_len == 0) {
+    if (!e1000_initialized || !bufs || n <= 0) {
         return 0;
     }
     
     e1000_device_t *dev = &e1000_dev;
+    int count = 0;
     
-    // Check if there's a packet available
-    if (!(dev->rx_desc[dev->rx_cur].status & E1000_RXD_STAT_DD)) {
-        return 0; // No packet available
+    while (count < n && (dev->rx_desc[dev->rx_cur].status & E1000_RXD_STAT_DD)) {
+        e1000_rx_desc_t *desc = &dev->rx_desc[dev->rx_cur];
+        pbuf_t *p = dev->rx_pbufs[dev->rx_cur];
+        uint16_t len = desc->length;
+        DEBUG_DEBUG("E1000: Received packet! len=%d cur=%d\n", len, dev->rx_cur);
+        
+        // Swap in a fresh buffer; if the pool is dry, drop the frame and
+        // give the hardware its old buffer back so the ring keeps moving
+        pbuf_t *fresh = pbuf_alloc();
+        if (fresh) {
+            dev->rx_pbufs[dev->rx_cur] = fresh;
+            desc->buffer_addr = fresh->phys;
+            p->len = len < PBUF_BUF_SIZE ? len : PBUF_BUF_SIZE;
+            
+            // Pass on the hardware's checksum verdict
+            if (!(desc->status & E1000_RXD_STAT_IXSM)) {
+                if (desc->status & E1000_RXD_STAT_IPCS) {
+                    p->csum_flags |= (desc->errors & E1000_RXD_ERR_IPE) ?
+                                     PBUF_CSUM_IP_BAD : PBUF_CSUM_IP_OK;
+                }
+                if (desc->status & E1000_RXD_STAT_TCPCS) {
+                    p->csum_flags |= (desc->errors & E1000_RXD_ERR_TCPE) ?
+                                     PBUF_CSUM_L4_BAD : PBUF_CSUM_L4_OK;
+                }
+            }
+            bufs[count++] = p;
+        } else {
+            dev->rx_dropped++;
+            if (dev->netif) {
+                NETIF_STAT_INC(dev->netif, rx_dropped);
+            }
+        }
+        
+        // Reset descriptor
+        desc->status = 0;
+        dev->rx_cur = (dev->rx_cur + 1) % E1000_NUM_RX_DESC;
+        
+        // Long bursts still return descriptors every so often
+        if (++dev->rx_unposted >= E1000_RX_DOORBELL_BATCH) {
+            e1000_rx_doorbell(dev);
+        }
     }
     
-    // We have a packet!
-    uint16_t len = dev->rx_desc[dev->rx_cur].length;
-    DEBUG_INFO("E1000: Received packet! len=%d cur=%d\n", len, dev->rx_cur);
+    // One tail write for the rest of the burst
+    e1000_rx_doorbell(dev);
     
-    if (len > max_len) {
-        len = max_len;
+    if (count) {
+        TRACE(TRACE_E1000_RX, count, 0);
+    }
+    return count;
+}
+
+int e1000_receive_packet(network_interface_t *iface, void *buffer, size_t max_len) {
+    if (!buffer || max_len == 0) {
+        return 0;
     }
     
-    // Copy packet data from the virtual address
-    memcpy(buffer, dev->rx_buffers[dev->rx_cur], len);
-    
-    // Reset descriptor
-    dev->rx_desc[dev->rx_cur].status = 0;
+    pbuf_t *p;
+    if (e1000_rx_burst(iface, &p, 1) != 1) {
+        return 0;
+    }
     
-    // Update tail pointer
-    e1000_write_reg(dev, E1000_RDT, dev->rx_cur);
-    dev->rx_cur = (dev->rx_cur + 1) % E1000_NUM_RX_DESC;
+    size_t len = p->len < max_len ? p->len : max_len;
+    memcpy(buffer, p->data, len);
+    pbuf_free(p);
     
     return len;
 }
 
 void e1000_enable_interrupts(e1000_device_t *dev) {
-    // Enable interrupts
-    e1000_write_reg(dev, E1000_IMS, E1000_ICR_RXT0 | E1000_ICR_TXDW | E1000_ICR_LSC);
+    // Throttle first so the very first burst is already moderated
+    e1000_write_reg(dev, E1000_ITR, E1000_ITR_INTERVAL);
+    
+    // Drop anything latched while interrupts were off, then unmask
+    (void)e1000_read_reg(dev, E1000_ICR);
+    e1000_write_reg(dev, E1000_IMS, E1000_IMS_ENABLE);
 }
 
 void e1000_disable_interrupts(e1000_device_t *dev) {
@@ -346,6 +559,65 @@ void e1000_disable_interrupts(e1000_device_t *dev) {
     e1000_write_reg(dev, E1000_IMC, 0xFFFFFFFF);
 }
 
+// Top half: acknowledge the NIC and hand RX to the network work item.
+// Reading ICR clears the causes and deasserts a level-triggered INTx line.
+void e1000_interrupt_handler(e1000_device_t *dev) {
+    uint32_t icr = e1000_read_reg(dev, E1000_ICR);
+    if (icr == 0) {
+        return;  // Not ours (shared INTx line)
+    }
+    dev->irq_count++;
+    
+    if ((icr & E1000_ICR_RXO) && dev->netif) {
+        NETIF_STAT_INC(dev->netif, rx_overruns);
+    }
+    if (icr & (E1000_ICR_RXT0 | E1000_ICR_RXO | E1000_ICR_RXDMT0)) {
+        network_schedule_poll();
+    }
+    
+    if (icr & E1000_ICR_LSC) {
+        uint32_t status = e1000_read_reg(dev, E1000_STATUS);
+        DEBUG_INFO("E1000: link %s\n", (status & 0x2) ? "up" : "down");
+    }
+}
+
+static void e1000_irq(void *ctx) {
+    e1000_interrupt_handler((e1000_device_t *)ctx);
+}
+
+int e1000_setup_interrupts(e1000_device_t *dev) {
+    pci_device_t *pci = dev->pci_dev;
+    
+    // MSI needs the local APIC; the 82540EM/82545EM only have INTx
+    if (lapic_is_ready() && pci_find_capability(pci, PCI_CAP_ID_MSI)) {
+        int vector = irq_alloc_msi_vector(e1000_irq, dev);
+        if (vector >= 0 &&
+            pci_enable_msi(pci, (uint8_t)vector, smp_get_cpu(0)->lapic_id) == 0) {
+            dev->irq_mode = E1000_IRQ_MSI;
+            dev->irq_vector = vector;
+        }
+    }
+    
+    if (dev->irq_mode == E1000_IRQ_POLLED) {
+        uint8_t line = pci->interrupt_line;
+        if (line < IRQ_LEGACY_FIRST || line > IRQ_LEGACY_LAST ||
+            irq_register_legacy(line, e1000_irq, dev) != 0) {
+            DEBUG_WARN("E1000: no usable interrupt (line %d), staying polled\n", line);
+            return -1;
+        }
+        dev->irq_mode = E1000_IRQ_INTX;
+        dev->irq_vector = TIMER_VECTOR + line;
+    }
+    
+    e1000_enable_interrupts(dev);
+    network_set_rx_interrupts(true);
+    
+    DEBUG_INFO("E1000: %s interrupts on vector 0x%x, ITR=%d\n",
+               dev->irq_mode == E1000_IRQ_MSI ? "MSI" : "INTx",
+               dev->irq_vector, E1000_ITR_INTERVAL);
+    return 0;
+}
+
 int e1000_probe(pci_device_t *pci_dev) {
     if (!pci_dev) {
         return -1;
@@ -439,6 +711,9 @@ int e1000_probe(pci_device_t *pci_dev) {
     
     e1000_initialized = true;
     
+    // Interrupt-driven RX if we can get a vector; polled otherwise
+    e1000_setup_interrupts(&e1000_dev);
+    
     DEBUG_INFO("E1000 MAC address: %02x:%02x:%02x:%02x:%02x:%02x\n",
                e1000_dev.mac_address[0], e1000_dev.mac_address[1],
                e1000_dev.mac_address[2], e1000_dev.mac_address[3],
@@ -479,6 +754,10 @@ int e1000_init(void) {
 static netdev_ops_t e1000_netdev_ops = {
     .send = e1000_send_packet,
     .receive = e1000_receive_packet,
+    .rx_burst = e1000_rx_burst,
+    .tx_burst = e1000_tx_burst,
+    .tx_flush = e1000_tx_flush,
+    .features = NETIF_F_RX_CSUM | NETIF_F_TX_IP_CSUM | NETIF_F_TX_L4_CSUM,
     .start = NULL,
     .stop = NULL,
     .init = NULL,
@@ -491,9 +770,14 @@ int e1000_register_netdev(void) {
         return -1;
     }
     
-    return netdev_register("eth0", &e1000_netdev_ops, e1000_dev.mac_address,
-                          0x00000000, // IP will be set by DHCP
-                          0x00000000, // Netmask will be set by DHCP
-                          0x00000000  // Gateway will be set by DHCP
-                          );
+    int ret = netdev_register("eth0", &e1000_netdev_ops, e1000_dev.mac_address,
+                              0x00000000, // IP will be set by DHCP
+                              0x00000000, // Netmask will be set by DHCP
+                              0x00000000  // Gateway will be set by DHCP
+                              );
+    if (ret == NET_SUCCESS) {
+        // Counters for what only the driver sees (overruns, empty pool)
+        e1000_dev.netif = netdev_get_by_name("eth0");
+    }
+    return ret;
 }
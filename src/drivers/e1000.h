@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include "../pci/pci.h"
 #include "../network/netdev.h"
+#include "../network/pbuf.h"
+#include "../sched/spinlock.h"
 
 // E1000 Register Offsets
 #define E1000_CTRL      0x00000  // Device Control
@@ -29,6 +31,7 @@
 #define E1000_TDLEN     0x03808  // TX Descriptor Length
 #define E1000_TDH       0x03810  // TX Descriptor Head
 #define E1000_TDT       0x03818  // TX Descriptor Tail
+#define E1000_RXCSUM    0x05000  // RX Checksum Control
 #define E1000_RAL       0x05400  // Receive Address Low
 #define E1000_RAH       0x05404  // Receive Address High
 
@@ -59,6 +62,10 @@
 #define E1000_RCTL_SZ_2048  0x00000000  // RX Buffer Size 2048
 #define E1000_RCTL_SECRC    0x04000000  // Strip Ethernet CRC
 
+// RX Checksum Control bits
+#define E1000_RXCSUM_IPOFL  0x00000100  // IP checksum offload
+#define E1000_RXCSUM_TUOFL  0x00000200  // TCP/UDP checksum offload
+
 // Transmit Control Register bits
 #define E1000_TCTL_EN       0x00000002  // Transmit Enable
 #define E1000_TCTL_PSP      0x00000008  // Pad Short Packets
@@ -75,19 +82,66 @@
 #define E1000_ICR_RXO       0x00000040  // RX Overrun
 #define E1000_ICR_RXT0      0x00000080  // RX Timer Interrupt
 
-// Descriptor constants
-#define E1000_NUM_RX_DESC   32
-#define E1000_NUM_TX_DESC   32
+// Causes we take interrupts for. TX completions are reaped lazily by the
+// send path, so TXDW stays masked.
+#define E1000_IMS_ENABLE    (E1000_ICR_RXT0 | E1000_ICR_RXO | E1000_ICR_RXDMT0 | E1000_ICR_LSC)
+
+// Minimum gap between interrupts in 256 ns units: 488 -> ~125 us, i.e. at
+// most ~8000 interrupts/s. Plenty for our traffic and keeps a flood from
+// turning into an interrupt storm.
+#define E1000_ITR_INTERVAL  488
+
+// Descriptor ring sizes, overridable from the build (E1000_RX_DESC=... /
+// E1000_TX_DESC=...). The hardware wants ring lengths in multiples of 128
+// bytes, i.e. 8 descriptors, and we cap them at 4096 each.
+#ifndef E1000_NUM_RX_DESC
+#define E1000_NUM_RX_DESC   256
+#endif
+#ifndef E1000_NUM_TX_DESC
+#define E1000_NUM_TX_DESC   256
+#endif
+#define E1000_MAX_DESC      4096
 #define E1000_BUFFER_SIZE   2048
 
+// Refilled RX descriptors handed back per RDT write; the rest go back when
+// the ring is found empty
+#define E1000_RX_DOORBELL_BATCH 32
+
+// Queued TX descriptors per TDT write while a batch is open (see
+// network_tx_batch_begin)
+#define E1000_TX_DOORBELL_BATCH 32
+
+// Completed TX descriptors are only swept once fewer than this many are free
+#define E1000_TX_RECLAIM_THRESHOLD 32
+
 // RX Descriptor Status bits
 #define E1000_RXD_STAT_DD   0x01  // Descriptor Done
 #define E1000_RXD_STAT_EOP  0x02  // End of Packet
+#define E1000_RXD_STAT_IXSM 0x04  // Ignore checksum indication
+#define E1000_RXD_STAT_TCPCS 0x20 // TCP/UDP checksum calculated
+#define E1000_RXD_STAT_IPCS 0x40  // IP checksum calculated
+
+// RX Descriptor Error bits
+#define E1000_RXD_ERR_TCPE  0x20  // TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE   0x40  // IP checksum error
 
 // TX Descriptor Command bits
 #define E1000_TXD_CMD_EOP   0x01  // End of Packet
 #define E1000_TXD_CMD_IFCS  0x02  // Insert FCS
 #define E1000_TXD_CMD_RS    0x08  // Report Status
+#define E1000_TXD_CMD_DEXT  0x20  // Extended descriptor format
+
+// Extended TX descriptors reuse the legacy 'cso' byte for the descriptor
+// type and the 'css' byte for the packet options
+#define E1000_TXD_DTYP_DATA 0x10  // Extended data descriptor
+#define E1000_TXD_POPTS_IXSM 0x01 // Insert IP checksum
+#define E1000_TXD_POPTS_TXSM 0x02 // Insert TCP/UDP checksum
+
+// Context descriptor TUCMD bits (in cmd_and_length)
+#define E1000_TXD_CTX_TCP   0x01000000  // Packet is TCP (else UDP)
+#define E1000_TXD_CTX_IP    0x02000000  // Packet is IPv4
+#define E1000_TXD_CTX_RS    0x08000000  // Report status
+#define E1000_TXD_CTX_DEXT  0x20000000  // Extended descriptor format
 
 // TX Descriptor Status bits
 #define E1000_TXD_STAT_DD   0x01  // Descriptor Done
@@ -112,6 +166,21 @@ typedef struct {
     uint16_t special;
 } __attribute__((packed)) e1000_tx_desc_t;
 
+// TX context descriptor: tells the NIC where the checksums of the data
+// descriptors that follow live. It stays in effect until the next one.
+typedef struct {
+    uint8_t ipcss;                  // IP checksum start
+    uint8_t ipcso;                  // IP checksum field offset
+    uint16_t ipcse;                 // IP checksum end (inclusive)
+    uint8_t tucss;                  // TCP/UDP checksum start
+    uint8_t tucso;                  // TCP/UDP checksum field offset
+    uint16_t tucse;                 // TCP/UDP checksum end (0 = end of packet)
+    uint32_t cmd_and_length;
+    uint8_t status;
+    uint8_t hdr_len;
+    uint16_t mss;
+} __attribute__((packed)) e1000_context_desc_t;
+
 // E1000 device structure
 typedef struct {
     pci_device_t *pci_dev;
@@ -120,17 +189,33 @@ typedef struct {
     
     // RX ring
     e1000_rx_desc_t *rx_desc;
-    uint8_t **rx_buffers;
+    pbuf_t **rx_pbufs;              // pbuf each descriptor is DMAing into
     uint16_t rx_cur;
+    uint16_t rx_unposted;           // Refilled descriptors not yet reported via RDT
+    uint64_t rx_dropped;            // Frames dropped because the pbuf pool ran dry
     
     // TX ring
     e1000_tx_desc_t *tx_desc;
-    uint8_t **tx_buffers;
+    pbuf_t **tx_pbufs;              // pbuf a descriptor is DMAing from, freed once done
     uint16_t tx_cur;
+    uint16_t tx_clean;              // Oldest descriptor not yet reclaimed
+    uint16_t tx_free;               // Descriptors between tx_cur and tx_clean
+    uint16_t tx_unposted;           // Queued descriptors not yet reported via TDT
+    uint64_t tx_context;            // Checksum context last loaded (0 = none)
+    spinlock_t tx_lock;
     
     network_interface_t *netif;
+    
+    // Interrupt delivery (irq_mode: 0 = polled, otherwise MSI or INTx)
+    uint8_t irq_mode;
+    int irq_vector;                 // IDT vector in use
+    uint64_t irq_count;
 } e1000_device_t;
 
+#define E1000_IRQ_POLLED    0
+#define E1000_IRQ_INTX      1
+#define E1000_IRQ_MSI       2
+
 // Function declarations
 int e1000_init(void);
 int e1000_register_netdev(void);
@@ -144,7 +229,21 @@ void e1000_read_mac_address(e1000_device_t *dev);
 uint32_t e1000_read_reg(e1000_device_t *dev, uint32_t reg);
 void e1000_write_reg(e1000_device_t *dev, uint32_t reg, uint32_t value);
 int e1000_send_packet(network_interface_t *iface, void *data, size_t len);
+// Queue up to n frames straight out of their pbufs with a single tail
+// write. Returns how many were taken; those are freed once the NIC is done
+// with them, the rest stay with the caller.
+int e1000_tx_burst(network_interface_t *iface, pbuf_t **bufs, int n);
+// Write any TX descriptors queued during a batch to the tail register
+void e1000_tx_flush(network_interface_t *iface);
 int e1000_receive_packet(network_interface_t *iface, void *buffer, size_t max_len);
+// Hand up to n received frames up in their ring buffers, refilling each slot
+// from the pbuf pool. Returns how many were stored in bufs.
+int e1000_rx_burst(network_interface_t *iface, pbuf_t **bufs, int n);
 void e1000_interrupt_handler(e1000_device_t *dev);
 
+// Route the NIC to an IDT vector (MSI if the function supports it, legacy
+// INTx otherwise) and enable interrupts. Returns 0 on success, -1 if the
+// device has to stay polled.
+int e1000_setup_interrupts(e1000_device_t *dev);
+
 #endif // E1000_H
@@ -6,6 +6,8 @@
 #include "../pci/pci.h"
 #include "../timer/timer.h"
 #include "../debug/debug.h"
+#include "../sched/waitqueue.h"
+#include "../sched/workqueue.h"
 
 // Scancode Set 1 to ASCII translation table (lowercase)
 static const char scancode_to_ascii[] = {
@@ -36,12 +38,25 @@ static volatile uint8_t modifier_state = 0;
 // Extended key prefix flag (for 0xE0 keys like arrows)
 static volatile bool extended_key = false;
 
+// Threads waiting for a key (woken from the bottom half)
+static wait_queue_t key_waiters = WAIT_QUEUE_INIT;
+
+// Raw scancodes from the IRQ handler, decoded later by keyboard_work
+#define SCANCODE_RING_SIZE 64
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static volatile int scancode_head = 0;
+static volatile int scancode_tail = 0;
+
+static void keyboard_work_fn(void *arg);
+static work_t keyboard_work = WORK_INIT(keyboard_work_fn, NULL);
+
 // Buffer a character
 static void buffer_put(char c) {
     int next = (buffer_head + 1) % KEY_BUFFER_SIZE;
     if (next != buffer_tail) {
         key_buffer[buffer_head] = c;
         buffer_head = next;
+        wait_queue_wake_all(&key_waiters);
         DEBUG_INFO("buffer_put: char='%c' (0x%02x), head=%d, tail=%d\n", 
                    (c >= 32 && c < 127) ? c : '?', (unsigned char)c, buffer_head, buffer_tail);
     }
@@ -76,30 +91,26 @@ bool keyboard_has_key(void) {
 }
 
 char keyboard_get_char(void) {
-    while (!keyboard_has_key()) {
-        __asm__ volatile("pause");
-    }
+    wait_event(&key_waiters, keyboard_has_key());
     return buffer_get();
 }
 
+bool keyboard_wait_key(uint32_t timeout_ms) {
+    return wait_event_timeout(&key_waiters, keyboard_has_key(), timeout_ms);
+}
+
 uint8_t keyboard_get_modifiers(void) {
     return modifier_state;
 }
 
-// Keyboard interrupt handler
-void keyboard_irq_handler(void) {
-    static int irq_count = 0;
-    irq_count++;
-    
-    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
-    
-    // Debug: log every keyboard IRQ
-    DEBUG_INFO("Keyboard IRQ #%d: scancode=0x%02x\n", irq_count, scancode);
+// Translate one scancode and update modifier state / the key buffer
+static void process_scancode(uint8_t scancode) {
+    DEBUG_INFO("Keyboard: scancode=0x%02x\n", scancode);
     
     // Handle extended key prefix
     if (scancode == 0xE0) {
         extended_key = true;
-        goto done;
+        return;
     }
     
     bool released = (scancode & 0x80) != 0;
@@ -116,7 +127,7 @@ void keyboard_irq_handler(void) {
                 case 0x4D: buffer_put(SPECIAL_KEY_RIGHT); break;  // Right arrow
             }
         }
-        goto done;
+        return;
     }
     
     // Handle modifier keys
@@ -128,7 +139,7 @@ void keyboard_irq_handler(void) {
             } else {
                 modifier_state |= MOD_SHIFT;
             }
-            goto done;
+            return;
             
         case KEY_LCTRL:
             if (released) {
@@ -136,7 +147,7 @@ void keyboard_irq_handler(void) {
             } else {
                 modifier_state |= MOD_CTRL;
             }
-            goto done;
+            return;
             
         case KEY_LALT:
             if (released) {
@@ -144,18 +155,18 @@ void keyboard_irq_handler(void) {
             } else {
                 modifier_state |= MOD_ALT;
             }
-            goto done;
+            return;
             
         case KEY_CAPSLOCK:
             if (!released) {
                 modifier_state ^= MOD_CAPS;
             }
-            goto done;
+            return;
     }
     
     // Only process key presses, not releases
     if (released) {
-        goto done;
+        return;
     }
     
     // Translate scancode to ASCII
@@ -180,8 +191,30 @@ void keyboard_irq_handler(void) {
     if (ascii != 0) {
         buffer_put(ascii);
     }
+}
 
-done:
+// Bottom half: decode everything the IRQ handler queued
+static void keyboard_work_fn(void *arg) {
+    (void)arg;
+    while (scancode_tail != scancode_head) {
+        uint8_t scancode = scancode_ring[scancode_tail];
+        __atomic_store_n(&scancode_tail, (scancode_tail + 1) % SCANCODE_RING_SIZE,
+                         __ATOMIC_RELEASE);
+        process_scancode(scancode);
+    }
+}
+
+// Keyboard interrupt handler (top half): grab the scancode, defer the rest
+void keyboard_irq_handler(void) {
+    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
+    
+    int next = (scancode_head + 1) % SCANCODE_RING_SIZE;
+    if (next != scancode_tail) {
+        scancode_ring[scancode_head] = scancode;
+        __atomic_store_n(&scancode_head, next, __ATOMIC_RELEASE);
+        work_schedule(&keyboard_work);
+    }
+    
     // Send EOI to PIC
     pic_send_eoi(IRQ_KEYBOARD);
 }
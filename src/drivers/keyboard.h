@@ -79,7 +79,8 @@ typedef struct {
 // Function prototypes
 void keyboard_init(void);
 bool keyboard_has_key(void);
-char keyboard_get_char(void);
+char keyboard_get_char(void);   // Sleeps until a key is available
+bool keyboard_wait_key(uint32_t timeout_ms);    // False if none arrived in time
 bool keyboard_get_event(key_event_t *event);
 uint8_t keyboard_get_modifiers(void);
 
@@ -0,0 +1,346 @@
+#include "virtio.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/numa.h"
+#include "../memory/vmm.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+
+#define VIRTIO_RESET_TIMEOUT_MS 100
+
+bool virtio_pci_match(pci_device_t *pci, uint16_t type) {
+    if (!pci || pci->vendor_id != VIRTIO_VENDOR_ID) {
+        return false;
+    }
+    if (pci->device_id == VIRTIO_DEVICE_ID_MODERN + type) {
+        return true;
+    }
+    // Transitional IDs predate the type numbering
+    return (type == VIRTIO_TYPE_NET && pci->device_id == VIRTIO_DEVICE_ID_NET_LEGACY) ||
+           (type == VIRTIO_TYPE_BLK && pci->device_id == VIRTIO_DEVICE_ID_BLK_LEGACY);
+}
+
+// Map the structure a vendor capability points at
+static volatile void *virtio_map_cap(pci_device_t *pci, uint8_t cap) {
+    uint8_t bar = pci_config_read8(pci->bus, pci->device, pci->function, cap + VIRTIO_PCI_CAP_BAR);
+    uint32_t offset = pci_config_read32(pci->bus, pci->device, pci->function, cap + VIRTIO_PCI_CAP_OFFSET);
+    uint32_t length = pci_config_read32(pci->bus, pci->device, pci->function, cap + VIRTIO_PCI_CAP_LENGTH);
+
+    uint64_t base = bar < 6 ? pci_bar_address(pci, bar) : 0;
+    if (!base || length == 0) {
+        return NULL;
+    }
+    return vmm_map_mmio(base + offset, length);
+}
+
+int virtio_pci_init(virtio_device_t *vdev, pci_device_t *pci) {
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->pci = pci;
+
+    uint16_t command = pci_config_read16(pci->bus, pci->device, pci->function, PCI_COMMAND);
+    command |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    pci_config_write16(pci->bus, pci->device, pci->function, PCI_COMMAND, command);
+
+    // Walk every vendor capability; the first of each type wins
+    uint8_t offset = pci_find_capability(pci, PCI_CAP_ID_VNDR);
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        if (pci_config_read8(pci->bus, pci->device, pci->function, offset) == PCI_CAP_ID_VNDR) {
+            uint8_t type = pci_config_read8(pci->bus, pci->device, pci->function,
+                                            offset + VIRTIO_PCI_CAP_CFG_TYPE);
+            if (type == VIRTIO_PCI_CAP_COMMON_CFG && !vdev->common) {
+                vdev->common = virtio_map_cap(pci, offset);
+            } else if (type == VIRTIO_PCI_CAP_NOTIFY_CFG && !vdev->notify_base) {
+                vdev->notify_base = virtio_map_cap(pci, offset);
+                vdev->notify_mult = pci_config_read32(pci->bus, pci->device, pci->function,
+                                                      offset + VIRTIO_PCI_NOTIFY_MULT);
+            } else if (type == VIRTIO_PCI_CAP_ISR_CFG && !vdev->isr) {
+                vdev->isr = virtio_map_cap(pci, offset);
+            } else if (type == VIRTIO_PCI_CAP_DEVICE_CFG && !vdev->device_cfg) {
+                vdev->device_cfg = virtio_map_cap(pci, offset);
+            }
+        }
+        offset = pci_config_read8(pci->bus, pci->device, pci->function, offset + 1) & 0xFC;
+    }
+
+    if (!vdev->common || !vdev->notify_base || !vdev->isr) {
+        DEBUG_ERROR("virtio %d:%d.%d: no modern PCI interface\n",
+                    pci->bus, pci->device, pci->function);
+        return -1;
+    }
+
+    // Reset, and wait for the device to finish it
+    vdev->common->device_status = 0;
+    uint64_t start = timer_get_ticks();
+    while (vdev->common->device_status != 0) {
+        if (timer_get_ticks() - start > VIRTIO_RESET_TIMEOUT_MS) {
+            DEBUG_ERROR("virtio %d:%d.%d: reset timed out\n",
+                        pci->bus, pci->device, pci->function);
+            return -1;
+        }
+        __asm__ volatile("pause");
+    }
+
+    vdev->common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    vdev->common->device_status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    return 0;
+}
+
+int virtio_negotiate(virtio_device_t *vdev, uint64_t wanted) {
+    volatile virtio_pci_common_cfg_t *common = vdev->common;
+
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t)common->device_feature << 32;
+
+    if (!(offered & VIRTIO_FEATURE(VIRTIO_F_VERSION_1))) {
+        DEBUG_ERROR("virtio: device does not offer VERSION_1\n");
+        return -1;
+    }
+
+    uint64_t accepted = offered & (wanted | VIRTIO_FEATURE(VIRTIO_F_VERSION_1));
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)accepted;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(accepted >> 32);
+
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        DEBUG_ERROR("virtio: device rejected features 0x%lx\n", accepted);
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        return -1;
+    }
+
+    vdev->features = accepted;
+    DEBUG_INFO("virtio: features offered 0x%lx, accepted 0x%lx\n", offered, accepted);
+    return 0;
+}
+
+uint16_t virtio_num_queues(virtio_device_t *vdev) {
+    return vdev->common->num_queues;
+}
+
+int virtio_queue_setup(virtio_device_t *vdev, virtqueue_t *vq, uint16_t index,
+                       uint16_t max_size, uint16_t msix_vector) {
+    return virtio_queue_setup_node(vdev, vq, index, max_size, msix_vector, NUMA_NO_NODE);
+}
+
+int virtio_queue_setup_node(virtio_device_t *vdev, virtqueue_t *vq, uint16_t index,
+                            uint16_t max_size, uint16_t msix_vector, int node) {
+    volatile virtio_pci_common_cfg_t *common = vdev->common;
+
+    common->queue_select = index;
+    uint16_t size = common->queue_size;
+    if (size == 0 || common->queue_enable) {
+        return -1;
+    }
+    if (max_size > VIRTQ_MAX_SIZE) {
+        max_size = VIRTQ_MAX_SIZE;
+    }
+    while (size > max_size) {
+        size >>= 1;
+    }
+
+    // Descriptor table, avail ring (+ used_event) and 4-byte aligned used
+    // ring (+ avail_event) in one zeroed block
+    size_t desc_bytes = (size_t)size * sizeof(virtq_desc_t);
+    size_t avail_bytes = 6 + 2 * (size_t)size;
+    size_t used_offset = (desc_bytes + avail_bytes + 3) & ~(size_t)3;
+    size_t used_bytes = 6 + 8 * (size_t)size;
+    size_t pages = PAGE_ALIGN_UP(used_offset + used_bytes) / PAGE_SIZE;
+
+    void *mem = physical_alloc_pages_node(pages, node);
+    if (!mem) {
+        DEBUG_ERROR("virtio: no memory for queue %u\n", index);
+        return -1;
+    }
+    uint64_t phys = (uint64_t)mem;
+    uint8_t *virt = (uint8_t *)PHYS_TO_HHDM(mem);
+    memset(virt, 0, pages * PAGE_SIZE);
+
+    memset(vq, 0, sizeof(*vq));
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (virtq_desc_t *)virt;
+    vq->avail = (volatile virtq_avail_t *)(virt + desc_bytes);
+    vq->used = (volatile virtq_used_t *)(virt + used_offset);
+    vq->used_event = &vq->avail->ring[size];
+    vq->avail_event = (volatile uint16_t *)&vq->used->ring[size];
+    vq->event_idx = virtio_has_feature(vdev, VIRTIO_F_RING_EVENT_IDX);
+    vq->num_free = size;
+    for (uint16_t i = 0; i < size; i++) {
+        vq->desc[i].next = (uint16_t)(i + 1);
+    }
+
+    common->queue_size = size;
+    common->queue_desc_lo = (uint32_t)phys;
+    common->queue_desc_hi = (uint32_t)(phys >> 32);
+    common->queue_driver_lo = (uint32_t)(phys + desc_bytes);
+    common->queue_driver_hi = (uint32_t)((phys + desc_bytes) >> 32);
+    common->queue_device_lo = (uint32_t)(phys + used_offset);
+    common->queue_device_hi = (uint32_t)((phys + used_offset) >> 32);
+
+    // The device answers NO_VECTOR if it could not take the entry
+    common->queue_msix_vector = msix_vector;
+    vq->msix_vector = common->queue_msix_vector;
+    if (msix_vector != VIRTIO_MSI_NO_VECTOR && vq->msix_vector != msix_vector) {
+        DEBUG_ERROR("virtio: queue %u refused MSI-X entry %u\n", index, msix_vector);
+        return -1;
+    }
+
+    vq->doorbell = (volatile uint16_t *)(vdev->notify_base +
+                                         (uint32_t)common->queue_notify_off * vdev->notify_mult);
+    common->queue_enable = 1;
+    return 0;
+}
+
+void virtio_set_config_vector(virtio_device_t *vdev, uint16_t msix_vector) {
+    vdev->common->msix_config = msix_vector;
+}
+
+void virtio_driver_ok(virtio_device_t *vdev) {
+    vdev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+uint8_t virtio_read_isr(virtio_device_t *vdev) {
+    return *vdev->isr;
+}
+
+int virtq_add(virtqueue_t *vq, const virtq_buf_t *bufs, int out, int in, void *cookie) {
+    int total = out + in;
+    if (total <= 0 || vq->num_free < total) {
+        return -1;
+    }
+
+    // The chain is the front of the free list, already linked through 'next'
+    uint16_t head = vq->free_head;
+    uint16_t idx = head;
+    for (int i = 0; i < total; i++) {
+        virtq_desc_t *d = &vq->desc[idx];
+        d->addr = bufs[i].phys;
+        d->len = bufs[i].len;
+        d->flags = (uint16_t)((i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                              (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0));
+        idx = d->next;
+    }
+    vq->free_head = idx;
+    vq->num_free -= (uint16_t)total;
+    vq->cookies[head] = cookie;
+
+    vq->avail->ring[vq->avail_idx & (vq->size - 1)] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+int virtq_add_indirect(virtqueue_t *vq, virtq_desc_t *table, uint64_t table_phys,
+                       const virtq_buf_t *bufs, int out, int in, void *cookie) {
+    int total = out + in;
+    if (total <= 0 || vq->num_free == 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < total; i++) {
+        table[i].addr = bufs[i].phys;
+        table[i].len = bufs[i].len;
+        table[i].flags = (uint16_t)((i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+                                    (i + 1 < total ? VIRTQ_DESC_F_NEXT : 0));
+        table[i].next = (uint16_t)(i + 1);
+    }
+
+    uint16_t head = vq->free_head;
+    virtq_desc_t *d = &vq->desc[head];
+    d->addr = table_phys;
+    d->len = (uint32_t)(total * sizeof(virtq_desc_t));
+    d->flags = VIRTQ_DESC_F_INDIRECT;
+    vq->free_head = d->next;
+    vq->num_free--;
+    vq->cookies[head] = cookie;
+
+    vq->avail->ring[vq->avail_idx & (vq->size - 1)] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+int virtq_add_buf(virtqueue_t *vq, uint64_t phys, uint32_t len, bool device_writes,
+                  void *cookie) {
+    virtq_buf_t buf = { .phys = phys, .len = len };
+    return virtq_add(vq, &buf, device_writes ? 0 : 1, device_writes ? 1 : 0, cookie);
+}
+
+// Whether moving the index from 'old' to 'new' crossed the other side's event
+static inline bool vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+bool virtq_kick(virtqueue_t *vq) {
+    uint16_t old = vq->kicked_idx;
+    uint16_t new_idx = vq->avail_idx;
+    if (old == new_idx) {
+        return false;
+    }
+
+    // Ring entries first, then the index that publishes them; the full fence
+    // orders that store before we read whether the device wants a doorbell
+    __atomic_store_n(&vq->avail->idx, new_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vq->kicked_idx = new_idx;
+
+    bool notify;
+    if (vq->event_idx) {
+        notify = vring_need_event(*vq->avail_event, new_idx, old);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    if (notify) {
+        *vq->doorbell = vq->index;
+        vq->kicks++;
+    }
+    return notify;
+}
+
+void *virtq_get_used(virtqueue_t *vq, uint32_t *len) {
+    if (!virtq_has_used(vq)) {
+        return NULL;
+    }
+
+    volatile virtq_used_elem_t *elem = &vq->used->ring[vq->last_used & (vq->size - 1)];
+    uint16_t head = (uint16_t)elem->id;
+    if (len) {
+        *len = elem->len;
+    }
+    vq->last_used++;
+
+    // Give the whole chain back to the free list
+    uint16_t idx = head;
+    uint16_t count = 1;
+    while (vq->desc[idx].flags & VIRTQ_DESC_F_NEXT) {
+        idx = vq->desc[idx].next;
+        count++;
+    }
+    vq->desc[idx].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+
+    void *cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+    return cookie;
+}
+
+bool virtq_enable_cb(virtqueue_t *vq) {
+    if (vq->event_idx) {
+        *vq->used_event = vq->last_used;
+    } else {
+        vq->avail->flags &= (uint16_t)~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+    // The device may have completed more before it saw the update
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return !virtq_has_used(vq);
+}
+
+void virtq_disable_cb(virtqueue_t *vq) {
+    // With event indices used_event already lags behind, so the device stays
+    // quiet until it is moved forward again
+    if (!vq->event_idx) {
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
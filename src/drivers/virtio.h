@@ -0,0 +1,230 @@
+/**
+ * Virtio PCI Transport for CGOS
+ *
+ * Modern (virtio 1.x) PCI devices only: the common, notify, ISR and device
+ * configuration structures are located through vendor capabilities, and
+ * queues are split virtqueues. With VIRTIO_F_RING_EVENT_IDX negotiated the
+ * driver and device tell each other which ring index they next want to hear
+ * about (used_event / avail_event), so a busy queue runs with almost no
+ * doorbells or interrupts.
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../pci/pci.h"
+
+#define VIRTIO_VENDOR_ID            0x1AF4
+#define VIRTIO_DEVICE_ID_NET_LEGACY 0x1000  // Transitional devices
+#define VIRTIO_DEVICE_ID_BLK_LEGACY 0x1001
+#define VIRTIO_DEVICE_ID_MODERN     0x1040  // + virtio device type
+#define VIRTIO_TYPE_NET             1
+#define VIRTIO_TYPE_BLK             2
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FEATURES_OK   0x08
+#define VIRTIO_STATUS_NEEDS_RESET   0x40
+#define VIRTIO_STATUS_FAILED        0x80
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC      28
+#define VIRTIO_F_RING_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_ACCESS_PLATFORM    33
+#define VIRTIO_F_RING_PACKED        34
+
+#define VIRTIO_FEATURE(bit)         (1ULL << (bit))
+
+// Vendor capability (PCI_CAP_ID_VNDR) layout
+#define PCI_CAP_ID_VNDR             0x09
+#define VIRTIO_PCI_CAP_CFG_TYPE     3
+#define VIRTIO_PCI_CAP_BAR          4
+#define VIRTIO_PCI_CAP_OFFSET       8
+#define VIRTIO_PCI_CAP_LENGTH       12
+#define VIRTIO_PCI_NOTIFY_MULT      16      // Notify capability only
+
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+
+#define VIRTIO_MSI_NO_VECTOR        0xFFFF
+
+// Common configuration structure. 64-bit fields are written as two 32-bit
+// halves, which every device must accept.
+typedef struct {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} __attribute__((packed)) virtio_pci_common_cfg_t;
+
+// Split virtqueue layout
+#define VIRTQ_DESC_F_NEXT           1
+#define VIRTQ_DESC_F_WRITE          2       // Device writes (else reads)
+#define VIRTQ_DESC_F_INDIRECT       4       // Points at a table of descriptors
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+// Naturally aligned, no packing needed. Followed by used_event (uint16_t)
+// after ring[size].
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} virtq_used_elem_t;
+
+// Followed by avail_event (uint16_t) after ring[size]
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];
+} virtq_used_t;
+
+// Largest queue we set up; bigger device maxima are trimmed to this
+#define VIRTQ_MAX_SIZE              256
+
+typedef struct virtqueue {
+    uint16_t index;
+    uint16_t size;                  // Power of two
+    virtq_desc_t *desc;
+    volatile virtq_avail_t *avail;
+    volatile virtq_used_t *used;
+    volatile uint16_t *doorbell;
+    volatile uint16_t *used_event;  // In the avail ring, written by us
+    volatile uint16_t *avail_event; // In the used ring, written by the device
+    bool event_idx;
+    uint16_t free_head;             // Free descriptor chain
+    uint16_t num_free;
+    uint16_t avail_idx;             // Next avail slot (shadow of avail->idx)
+    uint16_t kicked_idx;            // avail_idx at the last doorbell check
+    uint16_t last_used;             // Next used entry to consume
+    uint16_t msix_vector;
+    void *cookies[VIRTQ_MAX_SIZE];  // Per chain head, returned by virtq_get_used()
+    uint64_t kicks;                 // Doorbells actually written
+} virtqueue_t;
+
+// One segment of a request: 'out' segments are read by the device, the
+// 'in' ones that follow are written by it
+typedef struct {
+    uint64_t phys;
+    uint32_t len;
+} virtq_buf_t;
+
+typedef struct virtio_device {
+    pci_device_t *pci;
+    volatile virtio_pci_common_cfg_t *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *device_cfg;
+    volatile uint8_t *notify_base;
+    uint32_t notify_mult;
+    uint64_t features;              // Negotiated
+} virtio_device_t;
+
+// Whether a PCI function is a virtio device of 'type' (modern or transitional ID)
+bool virtio_pci_match(pci_device_t *pci, uint16_t type);
+
+// Map the device's configuration structures, reset it and announce the
+// driver. Returns 0, or -1 if it lacks the modern PCI interface.
+int virtio_pci_init(virtio_device_t *vdev, pci_device_t *pci);
+
+// Accept the offered features that are in 'wanted' (VIRTIO_F_VERSION_1 is
+// always required) and check the device agrees. Returns 0 or -1.
+int virtio_negotiate(virtio_device_t *vdev, uint64_t wanted);
+
+static inline bool virtio_has_feature(const virtio_device_t *vdev, int bit) {
+    return (vdev->features & VIRTIO_FEATURE(bit)) != 0;
+}
+
+// Queues the device implements
+uint16_t virtio_num_queues(virtio_device_t *vdev);
+
+// Allocate and enable queue 'index' with at most 'max_size' entries,
+// signalling MSI-X table entry 'msix_vector' (VIRTIO_MSI_NO_VECTOR for no
+// interrupts). Returns 0 or -1.
+int virtio_queue_setup(virtio_device_t *vdev, virtqueue_t *vq, uint16_t index,
+                       uint16_t max_size, uint16_t msix_vector);
+
+// Same, with the ring memory on NUMA node 'node' (that of the CPU which
+// services the queue)
+int virtio_queue_setup_node(virtio_device_t *vdev, virtqueue_t *vq, uint16_t index,
+                            uint16_t max_size, uint16_t msix_vector, int node);
+
+// Route configuration change interrupts to an MSI-X entry (or none)
+void virtio_set_config_vector(virtio_device_t *vdev, uint16_t msix_vector);
+
+// Device is live: queues may be used from here on
+void virtio_driver_ok(virtio_device_t *vdev);
+
+// Read-and-clear the ISR status (INTx acknowledge)
+uint8_t virtio_read_isr(virtio_device_t *vdev);
+
+// Put a chain of 'out' device-readable then 'in' device-writable segments on
+// the ring. Not visible to the device until virtq_kick(). Returns 0, or -1
+// if fewer than out + in descriptors are free.
+int virtq_add(virtqueue_t *vq, const virtq_buf_t *bufs, int out, int in, void *cookie);
+
+// Like virtq_add(), but the chain is written to the caller's DMA table
+// (out + in entries at 'table_phys') and takes a single ring descriptor.
+// Needs VIRTIO_F_INDIRECT_DESC. Returns 0, or -1 if the ring is full.
+int virtq_add_indirect(virtqueue_t *vq, virtq_desc_t *table, uint64_t table_phys,
+                       const virtq_buf_t *bufs, int out, int in, void *cookie);
+
+// Single-segment virtq_add() for the per-packet paths
+int virtq_add_buf(virtqueue_t *vq, uint64_t phys, uint32_t len, bool device_writes,
+                  void *cookie);
+
+// Publish what was added and ring the doorbell if the device asked to hear
+// about it. Returns whether the doorbell was written.
+bool virtq_kick(virtqueue_t *vq);
+
+// Whether the device has returned buffers we have not consumed
+static inline bool virtq_has_used(const virtqueue_t *vq) {
+    return __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE) != vq->last_used;
+}
+
+// Take the next completed chain: returns its cookie and stores the bytes the
+// device wrote in 'len'. NULL if nothing is pending.
+void *virtq_get_used(virtqueue_t *vq, uint32_t *len);
+
+// Ask for an interrupt on the next completion. Returns false if completions
+// raced in while arming (consume them before waiting).
+bool virtq_enable_cb(virtqueue_t *vq);
+
+// Stop interrupts while the queue is being drained
+void virtq_disable_cb(virtqueue_t *vq);
+
+#endif // VIRTIO_H
@@ -0,0 +1,486 @@
+/**
+ * Virtio Block Driver Implementation
+ *
+ * Each disk keeps one command (header + status byte) and one indirect
+ * descriptor table per slot. A request takes a free slot, describes the
+ * caller's buffer straight from its physical page runs and goes on the ring
+ * as a single indirect descriptor. The interrupt handler, or a waiter
+ * polling in its place, reaps the used ring and runs the completions outside
+ * the disk lock.
+ */
+
+#include "virtio_blk.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../interrupt/irq.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+
+#define VIRTIO_BLK_TABLE_ENTRIES (VIRTIO_BLK_MAX_SEGS + 2)     // + header and status
+#define VIRTIO_BLK_SEG_DEFAULT   0x400000                       // Without SIZE_MAX
+
+static int vblk_disk_count = 0;
+
+static void *vblk_alloc_dma(size_t bytes, uint64_t *phys) {
+    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *mem = physical_alloc_pages(pages);
+    if (!mem) {
+        return NULL;
+    }
+    *phys = (uint64_t)mem;
+    void *virt = (void *)PHYS_TO_HHDM(mem);
+    memset(virt, 0, pages * PAGE_SIZE);
+    return virt;
+}
+
+// ============== Completion ==============
+
+// Reap every finished request and run its completion
+static void vblk_complete(virtio_blk_disk_t *disk) {
+    virtio_blk_slot_t done[VIRTIO_BLK_MAX_INFLIGHT];
+    int status[VIRTIO_BLK_MAX_INFLIGHT];
+    int n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&disk->lock);
+    do {
+        void *cookie;
+        while ((cookie = virtq_get_used(&disk->vq, NULL)) != NULL) {
+            int tag = (int)(uintptr_t)cookie - 1;
+            done[n] = disk->slot[tag];
+            status[n] = disk->cmds[tag].status == VIRTIO_BLK_S_OK ? 0 : -1;
+            disk->slot[tag].done = NULL;
+            disk->busy &= ~(1u << tag);
+            n++;
+        }
+        // Re-arm; go round again if more finished meanwhile
+    } while (!virtq_enable_cb(&disk->vq));
+    spin_unlock_irqrestore(&disk->lock, flags);
+
+    for (int i = 0; i < n; i++) {
+        if (done[i].done) {
+            done[i].done(done[i].ctx, status[i]);
+        }
+    }
+    if (n > 0) {
+        wait_queue_wake_all(&disk->slot_waiters);
+        wait_queue_wake_all(&disk->done_waiters);
+    }
+}
+
+static void vblk_irq(void *ctx) {
+    virtio_blk_disk_t *disk = (virtio_blk_disk_t *)ctx;
+    disk->irq_count++;
+    vblk_complete(disk);
+}
+
+// Shared INTx line: reading the ISR acknowledges and tells us if it was us
+static void vblk_intx_irq(void *ctx) {
+    virtio_blk_disk_t *disk = (virtio_blk_disk_t *)ctx;
+    if (virtio_read_isr(&disk->vdev) & 1) {
+        vblk_irq(disk);
+    }
+}
+
+// ============== Slots ==============
+
+static bool vblk_try_get_slot(virtio_blk_disk_t *disk, int *tag) {
+    bool ok = false;
+    uint64_t flags = spin_lock_irqsave(&disk->lock);
+    uint32_t free = disk->slots_mask & ~disk->busy;
+    if (free) {
+        *tag = __builtin_ctz(free);
+        disk->busy |= 1u << *tag;
+        ok = true;
+    }
+    spin_unlock_irqrestore(&disk->lock, flags);
+    return ok;
+}
+
+// Sleep for a slot. Asynchronous submitters can fill every slot, so reap
+// finished requests too in case interrupts are off or were lost.
+static int vblk_get_slot(virtio_blk_disk_t *disk) {
+    int tag;
+    while (!vblk_try_get_slot(disk, &tag)) {
+        vblk_complete(disk);
+        wait_event_timeout(&disk->slot_waiters, (disk->slots_mask & ~disk->busy) != 0,
+                           VIRTIO_BLK_POLL_MS);
+    }
+    return tag;
+}
+
+static void vblk_put_slot(virtio_blk_disk_t *disk, int tag) {
+    uint64_t flags = spin_lock_irqsave(&disk->lock);
+    disk->busy &= ~(1u << tag);
+    spin_unlock_irqrestore(&disk->lock, flags);
+    wait_queue_wake_all(&disk->slot_waiters);
+}
+
+// ============== Requests ==============
+
+// Scatter-gather over the buffer's physical pages, merging runs. Returns the
+// number of segments, or -1 if the disk can't take that many.
+static int vblk_map(virtio_blk_disk_t *disk, void *buffer, size_t bytes, virtq_buf_t *segs) {
+    int n = 0;
+    uint8_t *va = (uint8_t *)buffer;
+    while (bytes > 0) {
+        uint64_t pa = vmm_get_physical_addr((uint64_t)va);
+        size_t chunk = PAGE_SIZE - ((uint64_t)va & (PAGE_SIZE - 1));
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        if (chunk > disk->seg_bytes_max) {
+            chunk = disk->seg_bytes_max;
+        }
+        if (pa == 0) {
+            return -1;
+        }
+
+        virtq_buf_t *last = n > 0 ? &segs[n - 1] : NULL;
+        if (last && last->phys + last->len == pa && last->len + chunk <= disk->seg_bytes_max) {
+            last->len += (uint32_t)chunk;
+        } else {
+            if ((uint32_t)n == disk->segs_max) {
+                return -1;
+            }
+            segs[n].phys = pa;
+            segs[n].len = (uint32_t)chunk;
+            n++;
+        }
+        va += chunk;
+        bytes -= chunk;
+    }
+    return n;
+}
+
+// Describe a request in slot 'tag' and put it on the ring. Returns -1 if
+// the buffer can't be expressed (the slot stays with the caller).
+static int vblk_queue(virtio_blk_disk_t *disk, int tag, uint32_t type, uint64_t lba,
+                      void *buffer, size_t bytes, virtio_blk_done_t done, void *ctx) {
+    virtq_buf_t bufs[VIRTIO_BLK_TABLE_ENTRIES];
+    virtio_blk_cmd_t *cmd = &disk->cmds[tag];
+    uint64_t cmd_phys = disk->cmds_phys + (uint64_t)tag * sizeof(virtio_blk_cmd_t);
+
+    cmd->hdr.type = type;
+    cmd->hdr.reserved = 0;
+    cmd->hdr.sector = lba;
+    cmd->status = 0xFF;
+
+    int segs = bytes ? vblk_map(disk, buffer, bytes, &bufs[1]) : 0;
+    if (segs < 0) {
+        return -1;
+    }
+    bufs[0].phys = cmd_phys;
+    bufs[0].len = sizeof(virtio_blk_req_hdr_t);
+    bufs[1 + segs].phys = cmd_phys + offsetof(virtio_blk_cmd_t, status);
+    bufs[1 + segs].len = 1;
+
+    // Header first (device reads), status last (device writes); the data
+    // goes with whichever side moves it
+    bool device_writes = type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_GET_ID;
+    int out = 1 + (device_writes ? 0 : segs);
+    int in = 1 + (device_writes ? segs : 0);
+    void *cookie = (void *)(uintptr_t)(tag + 1);
+
+    uint64_t flags = spin_lock_irqsave(&disk->lock);
+    disk->slot[tag].done = done;
+    disk->slot[tag].ctx = ctx;
+    int ret;
+    if (disk->indirect) {
+        uint32_t table = (uint32_t)tag * VIRTIO_BLK_TABLE_ENTRIES;
+        ret = virtq_add_indirect(&disk->vq, &disk->tables[table],
+                                 disk->tables_phys + table * sizeof(virtq_desc_t),
+                                 bufs, out, in, cookie);
+    } else {
+        ret = virtq_add(&disk->vq, bufs, out, in, cookie);
+    }
+    if (ret == 0) {
+        virtq_kick(&disk->vq);
+    } else {
+        disk->slot[tag].done = NULL;
+    }
+    spin_unlock_irqrestore(&disk->lock, flags);
+    return ret;
+}
+
+int virtio_blk_submit(virtio_blk_disk_t *disk, uint64_t lba, uint32_t count, void *buffer,
+                      bool write, virtio_blk_done_t done, void *ctx) {
+    if (!disk || count == 0 || count > disk->blk.max_sectors || (write && disk->read_only)) {
+        return -1;
+    }
+
+    int tag = vblk_get_slot(disk);
+    if (vblk_queue(disk, tag, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, buffer,
+                   (size_t)count * BLKDEV_SECTOR_SIZE, done, ctx) != 0) {
+        vblk_put_slot(disk, tag);
+        return -1;
+    }
+    return 0;
+}
+
+// ============== Synchronous Requests ==============
+
+typedef struct vblk_wait {
+    volatile bool done;
+    volatile int status;
+} vblk_wait_t;
+
+static void vblk_wait_done(void *ctx, int status) {
+    vblk_wait_t *w = (vblk_wait_t *)ctx;
+    w->status = status;
+    __atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+}
+
+// Polls the disk too, so requests complete with interrupts off or lost
+static bool vblk_wait_finished(virtio_blk_disk_t *disk, vblk_wait_t *w) {
+    if (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+        vblk_complete(disk);
+    }
+    return __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+static int vblk_exec(virtio_blk_disk_t *disk, uint32_t type, uint64_t lba, void *buffer,
+                     size_t bytes) {
+    int tag = vblk_get_slot(disk);
+    vblk_wait_t w = { false, -1 };
+    if (vblk_queue(disk, tag, type, lba, buffer, bytes, vblk_wait_done, &w) != 0) {
+        vblk_put_slot(disk, tag);
+        return -1;
+    }
+
+    // The device still owns the buffer, and a virtio request can't be
+    // aborted short of resetting the device, so a slow one is only reported
+    uint64_t deadline = timer_get_ticks() + VIRTIO_BLK_CMD_TIMEOUT_MS;
+    bool warned = false;
+    while (!vblk_wait_finished(disk, &w)) {
+        if (!warned && timer_get_ticks() >= deadline) {
+            DEBUG_WARN("virtio-blk: %s request %u still pending after %u ms\n",
+                       disk->blk.name, type, VIRTIO_BLK_CMD_TIMEOUT_MS);
+            warned = true;
+        }
+        wait_event_timeout(&disk->done_waiters, vblk_wait_finished(disk, &w), VIRTIO_BLK_POLL_MS);
+    }
+    return w.status;
+}
+
+// ============== Block Device ==============
+
+static int vblk_blk_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer) {
+    virtio_blk_disk_t *disk = (virtio_blk_disk_t *)dev->priv;
+    int ret = vblk_exec(disk, VIRTIO_BLK_T_IN, lba, buffer, (size_t)count * BLKDEV_SECTOR_SIZE);
+    return ret == 0 ? (int)count : -1;
+}
+
+static int vblk_blk_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    virtio_blk_disk_t *disk = (virtio_blk_disk_t *)dev->priv;
+    if (disk->read_only) {
+        return -1;
+    }
+    int ret = vblk_exec(disk, VIRTIO_BLK_T_OUT, lba, (void *)buffer,
+                        (size_t)count * BLKDEV_SECTOR_SIZE);
+    return ret == 0 ? (int)count : -1;
+}
+
+static int vblk_blk_flush(blkdev_t *dev) {
+    virtio_blk_disk_t *disk = (virtio_blk_disk_t *)dev->priv;
+    // Without FLUSH the device has no volatile write cache
+    if (!virtio_has_feature(&disk->vdev, VIRTIO_BLK_F_FLUSH)) {
+        return 0;
+    }
+    return vblk_exec(disk, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
+
+static int vblk_blk_submit(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer, bool write,
+                           blk_done_t done, void *ctx) {
+    return virtio_blk_submit((virtio_blk_disk_t *)dev->priv, lba, count, buffer, write, done, ctx);
+}
+
+static void vblk_blk_poll(blkdev_t *dev) {
+    vblk_complete((virtio_blk_disk_t *)dev->priv);
+}
+
+static const blkdev_ops_t vblk_blkdev_ops = {
+    .read = vblk_blk_read,
+    .write = vblk_blk_write,
+    .flush = vblk_blk_flush,
+    .submit = vblk_blk_submit,
+    .poll = vblk_blk_poll,
+};
+
+// ============== Probe ==============
+
+// One MSI-X entry for the request queue, INTx without MSI-X. Returns the
+// entry for the queue (VIRTIO_MSI_NO_VECTOR for none).
+static uint16_t vblk_setup_interrupts(virtio_blk_disk_t *disk) {
+    pci_device_t *pci = disk->vdev.pci;
+
+    void *ctx[1] = { disk };
+    uint8_t vector;
+    if (pci_alloc_irq_vectors(pci, 1, vblk_irq, ctx, &vector) > 0) {
+        disk->interrupts = true;
+        DEBUG_INFO("virtio-blk: %s on vector 0x%x\n",
+                   pci->msix_entries ? "MSI-X" : "MSI", vector);
+        return pci->msix_entries ? 0 : VIRTIO_MSI_NO_VECTOR;
+    }
+
+    uint8_t line = pci->interrupt_line;
+    if (line < IRQ_LEGACY_FIRST || line > IRQ_LEGACY_LAST ||
+        irq_register_legacy(line, vblk_intx_irq, disk) != 0) {
+        DEBUG_WARN("virtio-blk: no usable interrupt (line %d), polling\n", line);
+        return VIRTIO_MSI_NO_VECTOR;
+    }
+    disk->interrupts = true;
+    DEBUG_INFO("virtio-blk: INTx on line %d\n", line);
+    return VIRTIO_MSI_NO_VECTOR;
+}
+
+// Serial number as the model string, if the device reports one
+static void vblk_identify(virtio_blk_disk_t *disk) {
+    blkdev_t *blk = &disk->blk;
+    const char *fallback = "VirtIO Block Device";
+    int len = 0;
+
+    char *id = kmalloc(VIRTIO_BLK_ID_BYTES);
+    if (id) {
+        memset(id, 0, VIRTIO_BLK_ID_BYTES);
+        if (vblk_exec(disk, VIRTIO_BLK_T_GET_ID, 0, id, VIRTIO_BLK_ID_BYTES) == 0) {
+            while (len < VIRTIO_BLK_ID_BYTES && id[len] != '\0') {
+                blk->model[len] = id[len];
+                len++;
+            }
+        }
+        kfree(id);
+    }
+    if (len == 0) {
+        while (fallback[len] != '\0') {
+            blk->model[len] = fallback[len];
+            len++;
+        }
+    }
+    blk->model[len] = '\0';
+}
+
+static virtio_blk_disk_t *vblk_probe(pci_device_t *pci) {
+    virtio_blk_disk_t *disk = kmalloc(sizeof(virtio_blk_disk_t));
+    if (!disk) {
+        return NULL;
+    }
+    memset(disk, 0, sizeof(*disk));
+    disk->index = vblk_disk_count;
+    spin_lock_init(&disk->lock);
+    wait_queue_init(&disk->slot_waiters);
+    wait_queue_init(&disk->done_waiters);
+
+    uint64_t wanted = VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) |
+                      VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) |
+                      VIRTIO_FEATURE(VIRTIO_BLK_F_RO) |
+                      VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) |
+                      VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH) |
+                      VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC) |
+                      VIRTIO_FEATURE(VIRTIO_F_RING_EVENT_IDX);
+    if (virtio_pci_init(&disk->vdev, pci) != 0 || virtio_negotiate(&disk->vdev, wanted) != 0 ||
+        !disk->vdev.device_cfg) {
+        kfree(disk);
+        return NULL;
+    }
+
+    // Capacity is wider than one access: re-read if it changed under us
+    volatile virtio_blk_config_t *cfg = (volatile virtio_blk_config_t *)disk->vdev.device_cfg;
+    uint8_t generation;
+    do {
+        generation = disk->vdev.common->config_generation;
+        disk->blk.sectors = cfg->capacity;
+    } while (generation != disk->vdev.common->config_generation);
+
+    disk->indirect = virtio_has_feature(&disk->vdev, VIRTIO_F_INDIRECT_DESC);
+    disk->read_only = virtio_has_feature(&disk->vdev, VIRTIO_BLK_F_RO);
+    disk->segs_max = VIRTIO_BLK_MAX_SEGS;
+    if (virtio_has_feature(&disk->vdev, VIRTIO_BLK_F_SEG_MAX) && cfg->seg_max &&
+        cfg->seg_max < disk->segs_max) {
+        disk->segs_max = cfg->seg_max;
+    }
+    disk->seg_bytes_max = VIRTIO_BLK_SEG_DEFAULT;
+    if (virtio_has_feature(&disk->vdev, VIRTIO_BLK_F_SIZE_MAX) && cfg->size_max >= BLKDEV_SECTOR_SIZE) {
+        disk->seg_bytes_max = cfg->size_max;
+    }
+
+    uint16_t vector = vblk_setup_interrupts(disk);
+    if (virtio_queue_setup(&disk->vdev, &disk->vq, 0, VIRTIO_BLK_QUEUE_SIZE, vector) != 0) {
+        DEBUG_ERROR("virtio-blk: request queue setup failed\n");
+        return NULL;    // Queue memory may be known to the device: leave it
+    }
+
+    // Without indirect tables a request takes header + segments + status
+    // ring entries, which bounds how many fit at once
+    uint32_t slots = disk->indirect ? disk->vq.size : disk->vq.size / (disk->segs_max + 2);
+    if (slots > VIRTIO_BLK_MAX_INFLIGHT) {
+        slots = VIRTIO_BLK_MAX_INFLIGHT;
+    }
+    if (slots == 0) {
+        slots = 1;
+    }
+    disk->slots_mask = slots >= 32 ? 0xFFFFFFFF : (1u << slots) - 1;
+
+    disk->cmds = vblk_alloc_dma(sizeof(virtio_blk_cmd_t) * VIRTIO_BLK_MAX_INFLIGHT, &disk->cmds_phys);
+    if (disk->indirect) {
+        disk->tables = vblk_alloc_dma(sizeof(virtq_desc_t) * VIRTIO_BLK_TABLE_ENTRIES *
+                                      VIRTIO_BLK_MAX_INFLIGHT, &disk->tables_phys);
+    }
+    if (!disk->cmds || (disk->indirect && !disk->tables)) {
+        DEBUG_ERROR("virtio-blk: no DMA memory\n");
+        return NULL;
+    }
+
+    virtio_set_config_vector(&disk->vdev, VIRTIO_MSI_NO_VECTOR);
+    virtio_driver_ok(&disk->vdev);
+
+    // A request of max_sectors must fit the segment limit however its
+    // buffer is laid out: one segment per page (or size_max) plus a spare
+    // for a buffer that doesn't start on a page boundary
+    uint32_t seg_bytes = disk->seg_bytes_max < PAGE_SIZE ? disk->seg_bytes_max : PAGE_SIZE;
+    uint32_t max_sectors = (disk->segs_max - 1) * (seg_bytes / BLKDEV_SECTOR_SIZE);
+    if (disk->segs_max < 2) {
+        max_sectors = seg_bytes / BLKDEV_SECTOR_SIZE;
+    }
+
+    blkdev_t *blk = &disk->blk;
+    blk->name[0] = 'v';
+    blk->name[1] = 'd';
+    blk->name[2] = (char)('a' + disk->index);
+    blk->name[3] = '\0';
+    blk->max_sectors = max_sectors < VIRTIO_BLK_MAX_SECTORS ? max_sectors : VIRTIO_BLK_MAX_SECTORS;
+    blk->driver = disk->indirect ? "virtio-blk indirect" : "virtio-blk";
+    blk->ops = &vblk_blkdev_ops;
+    blk->priv = disk;
+
+    vblk_identify(disk);
+
+    DEBUG_INFO("virtio-blk: %s: %s, %lu sectors, depth %u, %u segs/req%s%s\n", blk->name,
+               blk->model, blk->sectors, slots, disk->segs_max,
+               disk->indirect ? ", indirect" : "", disk->read_only ? ", read-only" : "");
+    return disk;
+}
+
+int virtio_blk_init(void) {
+    for (int i = 0; i < pci_get_device_count() && vblk_disk_count < VIRTIO_BLK_MAX_DISKS; i++) {
+        pci_device_t *pci = pci_get_device(i);
+        if (!virtio_pci_match(pci, VIRTIO_TYPE_BLK)) {
+            continue;
+        }
+        DEBUG_INFO("Found virtio-blk at %d:%d.%d\n", pci->bus, pci->device, pci->function);
+
+        virtio_blk_disk_t *disk = vblk_probe(pci);
+        if (disk) {
+            vblk_disk_count++;
+            blkdev_register(&disk->blk);
+        } else {
+            DEBUG_ERROR("virtio-blk probe failed\n");
+        }
+    }
+
+    if (vblk_disk_count == 0) {
+        DEBUG_INFO("virtio-blk: no disks found\n");
+        return -1;
+    }
+    return vblk_disk_count;
+}
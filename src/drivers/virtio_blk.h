@@ -0,0 +1,118 @@
+/**
+ * Virtio Block Driver for CGOS
+ *
+ * Every virtio-blk PCI function becomes a block device ("vda", "vdb", ...).
+ * Requests go on a single virtqueue with up to VIRTIO_BLK_MAX_INFLIGHT in
+ * flight; with indirect descriptors each one takes a single ring entry no
+ * matter how many pages its buffer spans. Completion is interrupt driven
+ * (MSI-X, else INTx), with waiters polling in case an interrupt is lost.
+ */
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "virtio.h"
+#include "blkdev.h"
+#include "../sched/spinlock.h"
+#include "../sched/waitqueue.h"
+
+// Device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX       1   // size_max limits one segment
+#define VIRTIO_BLK_F_SEG_MAX        2   // seg_max limits segments per request
+#define VIRTIO_BLK_F_RO             5
+#define VIRTIO_BLK_F_BLK_SIZE       6
+#define VIRTIO_BLK_F_FLUSH          9
+
+// Request types and status
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+#define VIRTIO_BLK_T_GET_ID         8
+#define VIRTIO_BLK_S_OK             0
+#define VIRTIO_BLK_S_IOERR          1
+#define VIRTIO_BLK_S_UNSUPP         2
+
+#define VIRTIO_BLK_ID_BYTES         20
+
+#define VIRTIO_BLK_MAX_DISKS        4
+#define VIRTIO_BLK_MAX_INFLIGHT     32      // Requests per disk (slots)
+#define VIRTIO_BLK_MAX_SEGS         48      // Data segments per request; one per physical run
+#define VIRTIO_BLK_MAX_SECTORS      256     // Per request (128 KiB)
+#define VIRTIO_BLK_QUEUE_SIZE       128
+#define VIRTIO_BLK_CMD_TIMEOUT_MS   5000
+#define VIRTIO_BLK_POLL_MS          10      // Waiters also poll, in case an IRQ is lost
+
+// Device configuration space (the fields we use)
+typedef struct {
+    uint64_t capacity;              // In 512-byte sectors
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t blk_size;
+} __attribute__((packed)) virtio_blk_config_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+// Per-slot DMA memory: request header and the status byte the device
+// writes back, plus the indirect table the request is described by
+typedef struct {
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;
+    uint8_t reserved[15];
+} __attribute__((packed)) virtio_blk_cmd_t;
+
+typedef void (*virtio_blk_done_t)(void *ctx, int status);
+
+typedef struct virtio_blk_slot {
+    virtio_blk_done_t done;
+    void *ctx;
+} virtio_blk_slot_t;
+
+typedef struct virtio_blk_disk {
+    virtio_device_t vdev;
+    virtqueue_t vq;
+    int index;
+
+    virtio_blk_cmd_t *cmds;         // VIRTIO_BLK_MAX_INFLIGHT, DMA
+    uint64_t cmds_phys;
+    virtq_desc_t *tables;           // VIRTIO_BLK_MAX_SEGS + 2 entries per slot, DMA
+    uint64_t tables_phys;
+    uint32_t segs_max;              // Data segments per request
+    uint32_t seg_bytes_max;         // Bytes per segment
+    bool indirect;
+    bool read_only;
+
+    spinlock_t lock;
+    uint32_t slots_mask;            // Usable slots
+    uint32_t busy;                  // Slots handed out
+    virtio_blk_slot_t slot[VIRTIO_BLK_MAX_INFLIGHT];
+    wait_queue_t slot_waiters;      // Waiting for a free slot
+    wait_queue_t done_waiters;      // Waiting for a request to finish
+
+    bool interrupts;                // Otherwise polled
+    uint64_t irq_count;
+
+    blkdev_t blk;
+} virtio_blk_disk_t;
+
+// Find every virtio-blk function and register it as a block device.
+// Returns the number of disks found, or -1 if there are none.
+int virtio_blk_init(void);
+
+// Queue a read or write. 'done' runs (possibly from the IRQ handler) when
+// the transfer finishes. Sleeps while every slot is busy. The buffer must
+// stay valid until completion. Returns 0 if queued, -1 for a request the
+// disk can't take.
+int virtio_blk_submit(virtio_blk_disk_t *disk, uint64_t lba, uint32_t count, void *buffer,
+                      bool write, virtio_blk_done_t done, void *ctx);
+
+#endif // VIRTIO_BLK_H
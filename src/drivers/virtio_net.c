@@ -0,0 +1,584 @@
+#include "virtio_net.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/numa.h"
+#include "../memory/vmm.h"
+#include "../debug/debug.h"
+#include "../debug/trace.h"
+#include "../timer/timer.h"
+#include "../interrupt/irq.h"
+#include "../smp/smp.h"
+#include "../network/network.h"
+
+#define VIRTIO_NET_CTRL_TIMEOUT_MS 100
+
+static virtio_net_device_t vnet_dev;
+static bool vnet_initialized = false;
+
+// Control queue request buffer: header and payload read by the device, ack
+// written back
+typedef struct {
+    uint8_t class;
+    uint8_t cmd;
+    uint16_t pairs;
+    uint8_t pad[12];
+    uint8_t ack;
+} __attribute__((packed)) vnet_ctrl_buf_t;
+
+static vnet_ctrl_buf_t *ctrl_buf;
+static uint64_t ctrl_buf_phys;
+
+// ============== Receive ==============
+
+// Put a buffer back to its pristine state for reposting
+static void vnet_rx_reset(pbuf_t *p) {
+    p->data = p->buffer;
+    p->len = 0;
+    p->csum_flags = 0;
+}
+
+static void vnet_rx_drop(virtio_net_device_t *dev) {
+    dev->rx_dropped++;
+    if (dev->netif) {
+        NETIF_STAT_INC(dev->netif, rx_dropped);
+    }
+}
+
+// Strip the virtio header and translate its checksum verdict. Returns false
+// if the frame must be dropped.
+static bool vnet_rx_frame(virtio_net_device_t *dev, virtio_net_rxq_t *rxq, pbuf_t *p, uint32_t len) {
+    if (len <= sizeof(virtio_net_hdr_t) || len > PBUF_BUF_SIZE) {
+        return false;
+    }
+    virtio_net_hdr_t *hdr = (virtio_net_hdr_t *)p->buffer;
+
+    // Without guest TSO every frame fits one 2 KB buffer. Should the device
+    // still spread one over several, swallow the rest and drop it.
+    if (virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+        for (uint16_t i = 1; i < hdr->num_buffers; i++) {
+            pbuf_t *extra = virtq_get_used(&rxq->vq, NULL);
+            if (!extra) {
+                break;
+            }
+            vnet_rx_reset(extra);
+            virtq_add_buf(&rxq->vq, extra->phys, PBUF_BUF_SIZE, true, extra);
+        }
+        dev->rx_merged_dropped++;
+        return false;
+    }
+
+    p->len = (uint16_t)len;
+    if (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        // Validated by the host, or generated by a local peer that never
+        // filled it in: either way there is nothing for us to check
+        p->csum_flags |= PBUF_CSUM_L4_OK;
+    }
+    pbuf_pull(p, sizeof(virtio_net_hdr_t));
+    return true;
+}
+
+static int vnet_rx_queue(virtio_net_device_t *dev, virtio_net_rxq_t *rxq, pbuf_t **bufs, int n) {
+    virtqueue_t *vq = &rxq->vq;
+    int count = 0;
+
+    virtq_disable_cb(vq);
+    for (;;) {
+        pbuf_t *p;
+        uint32_t len;
+        while (count < n && (p = virtq_get_used(vq, &len)) != NULL) {
+            // Swap in a fresh buffer. A bad frame, or a dry pool, costs the
+            // frame instead: its buffer is reposted so the queue never
+            // runs empty.
+            pbuf_t *fresh = NULL;
+            if (!vnet_rx_frame(dev, rxq, p, len)) {
+                if (dev->netif) {
+                    NETIF_STAT_INC(dev->netif, rx_errors);
+                }
+            } else if ((fresh = pbuf_alloc()) == NULL) {
+                vnet_rx_drop(dev);
+            }
+            if (fresh) {
+                bufs[count++] = p;
+            } else {
+                vnet_rx_reset(p);
+                fresh = p;
+            }
+            virtq_add_buf(vq, fresh->phys, PBUF_BUF_SIZE, true, fresh);
+        }
+
+        // Out of budget: the poll comes back, leave the interrupt off.
+        // Otherwise re-arm, and go round again if frames slipped in.
+        if (count == n || virtq_enable_cb(vq)) {
+            break;
+        }
+    }
+
+    // One doorbell for every buffer reposted in this burst, and only if the
+    // device ran short enough to be waiting for one
+    virtq_kick(vq);
+
+    if (count) {
+        TRACE(TRACE_VIRTIO_NET_RX, count, rxq->pair);
+    }
+    return count;
+}
+
+int virtio_net_rx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    (void)iface; // Unused - uses global vnet_dev
+
+    if (!vnet_initialized || !bufs || n <= 0) {
+        return 0;
+    }
+
+    virtio_net_device_t *dev = &vnet_dev;
+    int count = 0;
+
+    // Rotate the starting queue so one busy queue can't starve the others
+    for (uint16_t i = 0; i < dev->pairs && count < n; i++) {
+        virtio_net_rxq_t *rxq = &dev->rx[(dev->rx_next + i) % dev->pairs];
+        count += vnet_rx_queue(dev, rxq, bufs + count, n - count);
+    }
+    dev->rx_next = (uint16_t)((dev->rx_next + 1) % dev->pairs);
+
+    return count;
+}
+
+int virtio_net_receive_packet(network_interface_t *iface, void *buffer, size_t max_len) {
+    if (!buffer || max_len == 0) {
+        return 0;
+    }
+
+    pbuf_t *p;
+    if (virtio_net_rx_burst(iface, &p, 1) != 1) {
+        return 0;
+    }
+
+    size_t len = p->len < max_len ? p->len : max_len;
+    memcpy(buffer, p->data, len);
+    pbuf_free(p);
+
+    return len;
+}
+
+static int vnet_rx_fill(virtio_net_rxq_t *rxq) {
+    while (rxq->vq.num_free > 0 && rxq->vq.size - rxq->vq.num_free < rxq->target) {
+        pbuf_t *p = pbuf_alloc();
+        if (!p) {
+            break;
+        }
+        virtq_add_buf(&rxq->vq, p->phys, PBUF_BUF_SIZE, true, p);
+    }
+    virtq_kick(&rxq->vq);
+    return rxq->vq.size - rxq->vq.num_free;
+}
+
+// ============== Transmit ==============
+
+static void vnet_tx_reclaim(virtio_net_txq_t *txq) {
+    pbuf_t *p;
+    while ((p = virtq_get_used(&txq->vq, NULL)) != NULL) {
+        pbuf_free(p);
+    }
+}
+
+// Prepend the virtio header, making room for it if the sender left no
+// headroom. Returns false if the frame can't be sent.
+static bool vnet_tx_prepare(virtio_net_device_t *dev, pbuf_t *p) {
+    const size_t hdr_len = sizeof(virtio_net_hdr_t);
+
+    if (pbuf_headroom(p) < hdr_len) {
+        if (p->len + hdr_len > PBUF_BUF_SIZE) {
+            return false;
+        }
+        uint8_t *moved = p->buffer + hdr_len;
+        size_t shift = (size_t)(moved - p->data);
+        memmove(moved, p->data, p->len);
+        p->data = moved;
+        if (p->l3_header) {
+            p->l3_header += shift;
+        }
+        if (p->l4_header) {
+            p->l4_header += shift;
+        }
+    }
+
+    // Offsets are relative to the frame, i.e. the data before the push
+    uint16_t csum_start = 0, csum_offset = 0;
+    bool csum = (p->csum_flags & (PBUF_TX_CSUM_TCP | PBUF_TX_CSUM_UDP)) && p->l4_header &&
+                virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CSUM);
+    if (csum) {
+        csum_start = (uint16_t)(p->l4_header - p->data);
+        csum_offset = (p->csum_flags & PBUF_TX_CSUM_TCP) ? 16 : 6;  // checksum field
+    }
+
+    virtio_net_hdr_t *hdr = pbuf_push(p, hdr_len);
+    memset(hdr, 0, hdr_len);
+    hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    if (csum) {
+        // The stack seeded the field with the pseudo-header sum
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = csum_start;
+        hdr->csum_offset = csum_offset;
+    }
+    return true;
+}
+
+static void vnet_tx_doorbell(virtio_net_txq_t *txq) {
+    if (txq->unposted) {
+        virtq_kick(&txq->vq);
+        txq->unposted = 0;
+    }
+}
+
+int virtio_net_tx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    if (!vnet_initialized || !bufs || n <= 0) {
+        return 0;
+    }
+
+    virtio_net_device_t *dev = &vnet_dev;
+    int queued = 0;
+
+    // Each CPU has its own queue; the lock only covers a thread migrating
+    // between picking the queue and taking it
+    virtio_net_txq_t *txq = &dev->tx[smp_cpu_id() % dev->pairs];
+    uint64_t flags = spin_lock_irqsave(&txq->lock);
+
+    if (txq->vq.num_free < VIRTIO_NET_TX_RECLAIM_THRESHOLD || txq->vq.num_free < n) {
+        vnet_tx_reclaim(txq);
+    }
+
+    while (queued < n && txq->vq.num_free > 0) {
+        pbuf_t *p = bufs[queued++];
+
+        // Nothing the device could send: drop it, but count it as taken
+        if (!p || p->len == 0 || !vnet_tx_prepare(dev, p)) {
+            if (p && dev->netif) {
+                NETIF_STAT_INC(dev->netif, tx_dropped);
+            }
+            pbuf_free(p);
+            continue;
+        }
+
+        // DMA straight out of the pbuf; it stays referenced until reclaimed
+        virtq_add_buf(&txq->vq, pbuf_dma_addr(p), p->len, false, p);
+        txq->unposted++;
+    }
+
+    // Same batching rule as the E1000: inside a batch the doorbell waits for
+    // the batch end or VIRTIO_NET_TX_DOORBELL_BATCH frames, a full ring
+    // always rings. Event indices then skip it if the device is still busy.
+    if (!iface || __atomic_load_n(&iface->tx_batch, __ATOMIC_ACQUIRE) == 0 ||
+        txq->unposted >= VIRTIO_NET_TX_DOORBELL_BATCH || txq->vq.num_free == 0) {
+        vnet_tx_doorbell(txq);
+    }
+
+    spin_unlock_irqrestore(&txq->lock, flags);
+
+    TRACE(TRACE_VIRTIO_NET_TX, queued, txq->pair);
+    return queued;
+}
+
+void virtio_net_tx_flush(network_interface_t *iface) {
+    (void)iface; // Unused - uses global vnet_dev
+
+    if (!vnet_initialized) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < vnet_dev.pairs; i++) {
+        virtio_net_txq_t *txq = &vnet_dev.tx[i];
+        uint64_t flags = spin_lock_irqsave(&txq->lock);
+        vnet_tx_doorbell(txq);
+        spin_unlock_irqrestore(&txq->lock, flags);
+    }
+}
+
+int virtio_net_send_packet(network_interface_t *iface, void *data, size_t len) {
+    if (!vnet_initialized || !data || len == 0 ||
+        len > PBUF_BUF_SIZE - PBUF_TX_HEADROOM) {
+        return -1;
+    }
+
+    // Copy into a pool buffer with headroom for the virtio header
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return -1;
+    }
+    memcpy(pbuf_put(p, len), data, len);
+
+    if (virtio_net_tx_burst(iface, &p, 1) != 1) {
+        pbuf_free(p);
+        return -1;
+    }
+
+    return len;
+}
+
+// ============== Control queue ==============
+
+// Issue one control command and wait for the device's ack. Only used during
+// bring-up, so it simply polls.
+static int vnet_ctrl_pairs_set(virtio_net_device_t *dev, uint16_t pairs) {
+    ctrl_buf->class = VIRTIO_NET_CTRL_MQ;
+    ctrl_buf->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    ctrl_buf->pairs = pairs;
+    ctrl_buf->ack = 0xFF;
+
+    virtq_buf_t bufs[3] = {
+        { .phys = ctrl_buf_phys, .len = 2 },
+        { .phys = ctrl_buf_phys + offsetof(vnet_ctrl_buf_t, pairs), .len = 2 },
+        { .phys = ctrl_buf_phys + offsetof(vnet_ctrl_buf_t, ack), .len = 1 },
+    };
+    if (virtq_add(&dev->ctrl, bufs, 2, 1, ctrl_buf) != 0) {
+        return -1;
+    }
+    virtq_kick(&dev->ctrl);
+
+    uint64_t start = timer_get_ticks();
+    while (!virtq_get_used(&dev->ctrl, NULL)) {
+        if (timer_get_ticks() - start > VIRTIO_NET_CTRL_TIMEOUT_MS) {
+            DEBUG_ERROR("virtio-net: control command timed out\n");
+            return -1;
+        }
+        __asm__ volatile("pause");
+    }
+
+    return ctrl_buf->ack == VIRTIO_NET_OK ? 0 : -1;
+}
+
+// ============== Interrupts ==============
+
+// Per-RX-queue MSI-X entry: the frames are picked up by the network work item
+static void vnet_rx_irq(void *ctx) {
+    virtio_net_rxq_t *rxq = (virtio_net_rxq_t *)ctx;
+    rxq->irq_count++;
+    network_schedule_poll();
+}
+
+// Shared INTx line: reading the ISR acknowledges and tells us if it was us
+static void vnet_intx_irq(void *ctx) {
+    virtio_net_device_t *dev = (virtio_net_device_t *)ctx;
+    if (virtio_read_isr(&dev->vdev) & 1) {
+        dev->rx[0].irq_count++;
+        network_schedule_poll();
+    }
+}
+
+// One MSI-X entry per RX queue, spread over the CPUs; INTx if the function
+// can't do MSI-X. Returns 0, or -1 if the device has to stay polled.
+static int vnet_setup_interrupts(virtio_net_device_t *dev) {
+    pci_device_t *pci = dev->vdev.pci;
+
+    void *ctx[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    uint8_t vectors[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    for (uint16_t i = 0; i < dev->pairs; i++) {
+        ctx[i] = &dev->rx[i];
+    }
+
+    int n = pci_alloc_irq_vectors(pci, dev->pairs, vnet_rx_irq, ctx, vectors);
+    if (n > 0) {
+        dev->msix = pci->msix_entries > 0;
+        dev->irq_vectors = n;
+        DEBUG_INFO("virtio-net: %d %s vectors from 0x%x\n", n, dev->msix ? "MSI-X" : "MSI", vectors[0]);
+        return 0;
+    }
+
+    uint8_t line = pci->interrupt_line;
+    if (line < IRQ_LEGACY_FIRST || line > IRQ_LEGACY_LAST ||
+        irq_register_legacy(line, vnet_intx_irq, dev) != 0) {
+        DEBUG_WARN("virtio-net: no usable interrupt (line %d), staying polled\n", line);
+        return -1;
+    }
+    DEBUG_INFO("virtio-net: INTx on line %d\n", line);
+    return 0;
+}
+
+// ============== Bring-up ==============
+
+static int vnet_probe(virtio_net_device_t *dev, pci_device_t *pci) {
+    if (virtio_pci_init(&dev->vdev, pci) != 0) {
+        return -1;
+    }
+
+    uint64_t wanted = VIRTIO_FEATURE(VIRTIO_NET_F_MAC) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_STATUS) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_CSUM) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_CSUM) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_MRG_RXBUF) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_CTRL_VQ) |
+                      VIRTIO_FEATURE(VIRTIO_NET_F_MQ) |
+                      VIRTIO_FEATURE(VIRTIO_F_RING_EVENT_IDX);
+    if (virtio_negotiate(&dev->vdev, wanted) != 0) {
+        return -1;
+    }
+
+    volatile virtio_net_config_t *cfg = (volatile virtio_net_config_t *)dev->vdev.device_cfg;
+    if (cfg && virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MAC)) {
+        for (int i = 0; i < 6; i++) {
+            dev->mac_address[i] = cfg->mac[i];
+        }
+    } else {
+        // Locally administered fallback
+        uint8_t mac[6] = {0x02, 0x00, 0x00, 0x56, 0x4E, 0x45};
+        memcpy(dev->mac_address, mac, 6);
+    }
+
+    // One queue pair per CPU, if the device has that many and we can
+    // switch them on through the control queue
+    dev->max_pairs = 1;
+    if (cfg && virtio_has_feature(&dev->vdev, VIRTIO_NET_F_MQ) &&
+        virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CTRL_VQ)) {
+        dev->max_pairs = cfg->max_virtqueue_pairs;
+    }
+    dev->pairs = dev->max_pairs;
+    if (dev->pairs > smp_cpu_count()) {
+        dev->pairs = (uint16_t)smp_cpu_count();
+    }
+    if (dev->pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+        dev->pairs = VIRTIO_NET_MAX_QUEUE_PAIRS;
+    }
+    if (dev->pairs == 0) {
+        dev->pairs = 1;
+    }
+
+    // RX queue 2i, TX queue 2i+1, control queue after the device's last pair
+    bool has_ctrl = virtio_has_feature(&dev->vdev, VIRTIO_NET_F_CTRL_VQ);
+    uint16_t needed = (uint16_t)(2 * dev->max_pairs + (has_ctrl ? 1 : 0));
+    if (virtio_num_queues(&dev->vdev) < needed) {
+        DEBUG_ERROR("virtio-net: %u queues, need %u\n", virtio_num_queues(&dev->vdev), needed);
+        return -1;
+    }
+
+    dev->interrupts = vnet_setup_interrupts(dev) == 0;
+
+    for (uint16_t i = 0; i < dev->pairs; i++) {
+        virtio_net_rxq_t *rxq = &dev->rx[i];
+        virtio_net_txq_t *txq = &dev->tx[i];
+        uint16_t vector = dev->msix ? (uint16_t)(i % dev->irq_vectors) : VIRTIO_MSI_NO_VECTOR;
+
+        rxq->dev = dev;
+        rxq->pair = i;
+        txq->pair = i;
+        txq->lock = (spinlock_t)SPINLOCK_INIT_NAMED("virtio_net_tx");
+
+        // Pair i is mostly driven by CPU i (its RX vector, and the TX queue
+        // smp_cpu_id() picks), so its rings go on that CPU's node. TX
+        // completions are reaped lazily by the send path: no vector.
+        int node = numa_node_of_cpu(i % smp_cpu_count());
+        if (virtio_queue_setup_node(&dev->vdev, &rxq->vq, (uint16_t)(2 * i), VIRTIO_NET_QUEUE_SIZE,
+                                    vector, node) != 0 ||
+            virtio_queue_setup_node(&dev->vdev, &txq->vq, (uint16_t)(2 * i + 1),
+                                    VIRTIO_NET_QUEUE_SIZE, VIRTIO_MSI_NO_VECTOR, node) != 0) {
+            DEBUG_ERROR("virtio-net: queue pair %u setup failed\n", i);
+            return -1;
+        }
+        rxq->target = (uint16_t)(VIRTIO_NET_RX_BUFFERS / dev->pairs);
+        if (rxq->target > rxq->vq.size) {
+            rxq->target = rxq->vq.size;
+        }
+    }
+
+    if (has_ctrl) {
+        void *page = physical_alloc_page();
+        if (!page ||
+            virtio_queue_setup(&dev->vdev, &dev->ctrl, (uint16_t)(2 * dev->max_pairs), 8,
+                               VIRTIO_MSI_NO_VECTOR) != 0) {
+            DEBUG_ERROR("virtio-net: control queue setup failed\n");
+            return -1;
+        }
+        ctrl_buf_phys = (uint64_t)page;
+        ctrl_buf = (vnet_ctrl_buf_t *)PHYS_TO_HHDM(page);
+    }
+
+    virtio_set_config_vector(&dev->vdev, VIRTIO_MSI_NO_VECTOR);
+    virtio_driver_ok(&dev->vdev);
+
+    for (uint16_t i = 0; i < dev->pairs; i++) {
+        vnet_rx_fill(&dev->rx[i]);
+    }
+
+    // The device starts with a single pair until told otherwise
+    if (dev->pairs > 1 && vnet_ctrl_pairs_set(dev, dev->pairs) != 0) {
+        DEBUG_WARN("virtio-net: device refused %u queue pairs, using one\n", dev->pairs);
+        dev->pairs = 1;
+    }
+
+    if (cfg && virtio_has_feature(&dev->vdev, VIRTIO_NET_F_STATUS)) {
+        DEBUG_INFO("virtio-net: link %s\n", (cfg->status & VIRTIO_NET_S_LINK_UP) ? "up" : "down");
+    }
+    return 0;
+}
+
+int virtio_net_init(void) {
+    pci_device_t *pci = NULL;
+    for (int i = 0; i < pci_get_device_count(); i++) {
+        pci_device_t *candidate = pci_get_device(i);
+        if (virtio_pci_match(candidate, VIRTIO_TYPE_NET)) {
+            pci = candidate;
+            break;
+        }
+    }
+    if (!pci) {
+        return -1;
+    }
+
+    DEBUG_INFO("Found virtio-net at %d:%d.%d\n", pci->bus, pci->device, pci->function);
+
+    if (vnet_probe(&vnet_dev, pci) != 0) {
+        DEBUG_ERROR("virtio-net probe failed\n");
+        return -1;
+    }
+
+    vnet_initialized = true;
+    if (vnet_dev.interrupts) {
+        network_set_rx_interrupts(true);
+    }
+
+    DEBUG_INFO("virtio-net MAC %02x:%02x:%02x:%02x:%02x:%02x, %u queue pairs (device max %u), "
+               "event idx %s, csum tx %s rx %s\n",
+               vnet_dev.mac_address[0], vnet_dev.mac_address[1], vnet_dev.mac_address[2],
+               vnet_dev.mac_address[3], vnet_dev.mac_address[4], vnet_dev.mac_address[5],
+               vnet_dev.pairs, vnet_dev.max_pairs,
+               virtio_has_feature(&vnet_dev.vdev, VIRTIO_F_RING_EVENT_IDX) ? "on" : "off",
+               virtio_has_feature(&vnet_dev.vdev, VIRTIO_NET_F_CSUM) ? "on" : "off",
+               virtio_has_feature(&vnet_dev.vdev, VIRTIO_NET_F_GUEST_CSUM) ? "on" : "off");
+    return 0;
+}
+
+static netdev_ops_t virtio_net_netdev_ops = {
+    .send = virtio_net_send_packet,
+    .receive = virtio_net_receive_packet,
+    .rx_burst = virtio_net_rx_burst,
+    .tx_burst = virtio_net_tx_burst,
+    .tx_flush = virtio_net_tx_flush,
+    .start = NULL,
+    .stop = NULL,
+    .init = NULL,
+    .set_mac = NULL,
+    .get_mac = NULL
+};
+
+int virtio_net_register_netdev(void) {
+    if (!vnet_initialized) {
+        return -1;
+    }
+
+    // Offloads as negotiated; the device has no IP header checksum offload
+    virtio_net_netdev_ops.features = 0;
+    if (virtio_has_feature(&vnet_dev.vdev, VIRTIO_NET_F_GUEST_CSUM)) {
+        virtio_net_netdev_ops.features |= NETIF_F_RX_CSUM;
+    }
+    if (virtio_has_feature(&vnet_dev.vdev, VIRTIO_NET_F_CSUM)) {
+        virtio_net_netdev_ops.features |= NETIF_F_TX_L4_CSUM;
+    }
+
+    int ret = netdev_register("eth0", &virtio_net_netdev_ops, vnet_dev.mac_address,
+                              0x00000000, // IP will be set by DHCP
+                              0x00000000, // Netmask will be set by DHCP
+                              0x00000000  // Gateway will be set by DHCP
+                              );
+    if (ret == NET_SUCCESS) {
+        vnet_dev.netif = netdev_get_by_name("eth0");
+    }
+    return ret;
+}
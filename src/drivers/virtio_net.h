@@ -0,0 +1,130 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "virtio.h"
+#include "../network/netdev.h"
+#include "../network/pbuf.h"
+#include "../sched/spinlock.h"
+
+// Device feature bits
+#define VIRTIO_NET_F_CSUM           0   // Device completes partial TX checksums
+#define VIRTIO_NET_F_GUEST_CSUM     1   // Device may hand us partial / validated checksums
+#define VIRTIO_NET_F_MTU            3
+#define VIRTIO_NET_F_MAC            5
+#define VIRTIO_NET_F_GUEST_TSO4     7
+#define VIRTIO_NET_F_GUEST_TSO6     8
+#define VIRTIO_NET_F_HOST_TSO4      11
+#define VIRTIO_NET_F_HOST_TSO6      12
+#define VIRTIO_NET_F_MRG_RXBUF      15
+#define VIRTIO_NET_F_STATUS         16
+#define VIRTIO_NET_F_CTRL_VQ        17
+#define VIRTIO_NET_F_MQ             22
+
+#define VIRTIO_NET_S_LINK_UP        1
+
+// Per-packet header in front of every frame, both directions
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1   // Checksum at csum_start + csum_offset is partial
+#define VIRTIO_NET_HDR_F_DATA_VALID 2   // RX: device validated the checksum
+#define VIRTIO_NET_HDR_GSO_NONE     0
+
+typedef struct {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;           // RX: buffers this frame spans (MRG_RXBUF)
+} __attribute__((packed)) virtio_net_hdr_t;
+
+// Device configuration space
+typedef struct {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+    uint16_t mtu;
+} __attribute__((packed)) virtio_net_config_t;
+
+// Control queue commands
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                   0
+
+// Queue pairs we drive: one per CPU up to this many. Each RX queue gets its
+// own MSI-X entry, so this stays within PCI_MAX_IRQ_VECTORS.
+#define VIRTIO_NET_MAX_QUEUE_PAIRS  4
+
+// Ring size per queue, overridable from the build
+#ifndef VIRTIO_NET_QUEUE_SIZE
+#define VIRTIO_NET_QUEUE_SIZE       256
+#endif
+
+// Receive buffers posted over all RX queues; the pbuf pool is shared with
+// the rest of the stack, so more queues means fewer buffers each
+#define VIRTIO_NET_RX_BUFFERS       256
+
+// Queued TX frames per doorbell while a batch is open (see
+// network_tx_batch_begin)
+#define VIRTIO_NET_TX_DOORBELL_BATCH 32
+
+// Completed TX buffers are only swept once fewer than this many slots are free
+#define VIRTIO_NET_TX_RECLAIM_THRESHOLD 32
+
+struct virtio_net_device;
+
+typedef struct {
+    virtqueue_t vq;
+    struct virtio_net_device *dev;
+    uint16_t pair;
+    uint16_t target;                // Buffers kept posted
+    uint64_t irq_count;
+} virtio_net_rxq_t;
+
+typedef struct {
+    virtqueue_t vq;
+    spinlock_t lock;
+    uint16_t pair;
+    uint16_t unposted;              // Frames not yet announced with a doorbell
+} virtio_net_txq_t;
+
+typedef struct virtio_net_device {
+    virtio_device_t vdev;
+    uint8_t mac_address[6];
+    uint16_t max_pairs;             // Device limit
+    uint16_t pairs;                 // Queue pairs in use
+    virtio_net_rxq_t rx[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    virtio_net_txq_t tx[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    virtqueue_t ctrl;
+    uint16_t rx_next;               // RX queue the next burst starts from
+    uint64_t rx_dropped;            // Frames dropped because the pbuf pool ran dry
+    uint64_t rx_merged_dropped;     // Frames spanning several buffers (not expected)
+    bool interrupts;                // Otherwise polled
+    bool msix;                      // One MSI-X entry per RX queue
+    int irq_vectors;
+    network_interface_t *netif;
+} virtio_net_device_t;
+
+// Find and bring up the first virtio-net function. Returns 0 or -1.
+int virtio_net_init(void);
+
+// Register the device initialised by virtio_net_init() as eth0
+int virtio_net_register_netdev(void);
+
+int virtio_net_send_packet(network_interface_t *iface, void *data, size_t len);
+int virtio_net_receive_packet(network_interface_t *iface, void *buffer, size_t max_len);
+
+// Queue up to n frames on the calling CPU's TX queue. Returns how many were
+// taken; those are freed once the device is done with them.
+int virtio_net_tx_burst(network_interface_t *iface, pbuf_t **bufs, int n);
+
+// Ring the doorbells of frames queued during a batch
+void virtio_net_tx_flush(network_interface_t *iface);
+
+// Hand up to n received frames up in their ring buffers, taking from each
+// RX queue in turn and reposting fresh pool buffers
+int virtio_net_rx_burst(network_interface_t *iface, pbuf_t **bufs, int n);
+
+#endif // VIRTIO_NET_H
@@ -0,0 +1,439 @@
+/**
+ * Block Buffer Cache Implementation
+ *
+ * One global pool of sector buffers. A spinlock guards the hash chains,
+ * reference counts and flags; the data of a buffer belongs to whoever has
+ * it locked, and disk I/O always happens with only the buffer lock held.
+ * A buffer with a non-zero reference count is never recycled.
+ */
+
+#include "bcache.h"
+#include "../memory/memory.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../sched/thread.h"
+#include "../sched/scheduler.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+
+#define SECTORS_PER_PAGE (PAGE_SIZE / BLKDEV_SECTOR_SIZE)
+
+static struct {
+    spinlock_t lock;
+    bcache_buf_t *bufs;
+    uint32_t count;
+    bcache_buf_t **hash;
+    uint32_t hash_bits;
+    uint32_t hand;                  // CLOCK position
+    uint32_t pinned;                // Buffers with refcount > 0
+    uint32_t in_use;
+    uint32_t dirty;
+    wait_queue_t waiters;           // Buffer unlocked or unpinned
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} cache = {
+    .lock = SPINLOCK_INIT_NAMED("bcache"),
+    .waiters = WAIT_QUEUE_INIT,
+};
+
+static uint32_t hash_index(blkdev_t *dev, uint64_t lba) {
+    uint64_t key = lba ^ ((uint64_t)(uintptr_t)dev << 16);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - cache.hash_bits));
+}
+
+static bcache_buf_t *hash_lookup_locked(blkdev_t *dev, uint64_t lba) {
+    for (bcache_buf_t *b = cache.hash[hash_index(dev, lba)]; b; b = b->hash_next) {
+        if (b->dev == dev && b->lba == lba) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void hash_remove_locked(bcache_buf_t *buf) {
+    bcache_buf_t **link = &cache.hash[hash_index(buf->dev, buf->lba)];
+    while (*link && *link != buf) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = buf->hash_next;
+    }
+    buf->hash_next = NULL;
+}
+
+static void hold_locked(bcache_buf_t *buf) {
+    if (buf->refcount++ == 0) {
+        cache.pinned++;
+    }
+}
+
+static void drop_locked(bcache_buf_t *buf) {
+    if (--buf->refcount == 0) {
+        cache.pinned--;
+    }
+}
+
+static void set_dirty_locked(bcache_buf_t *buf, bool dirty) {
+    if (dirty && !(buf->flags & BCACHE_DIRTY)) {
+        buf->flags |= BCACHE_DIRTY;
+        buf->dirty_since = timer_get_ticks();
+        cache.dirty++;
+    } else if (!dirty && (buf->flags & BCACHE_DIRTY)) {
+        buf->flags &= ~BCACHE_DIRTY;
+        cache.dirty--;
+    }
+}
+
+static bool buf_try_lock(bcache_buf_t *buf) {
+    return __atomic_exchange_n(&buf->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void buf_unlock(bcache_buf_t *buf) {
+    __atomic_store_n(&buf->locked, 0, __ATOMIC_RELEASE);
+}
+
+// ============== Write-back ==============
+
+// Write back dirty buffers last dirtied at or before 'cutoff', in batches
+// released through one plug so the block queue merges neighbouring
+// sectors. Buffers someone holds are waited for only when 'wait' is set.
+// Devices that received writes get their caches flushed.
+static int bcache_writeback(blkdev_t *dev, uint64_t cutoff, bool wait) {
+    blk_request_t *reqs = kmalloc(BCACHE_WB_BATCH * sizeof(blk_request_t));
+    bcache_buf_t *picks[BCACHE_WB_BATCH];
+    bool locked[BCACHE_WB_BATCH];
+    blkdev_t *touched[MAX_BLOCK_DEVICES];
+    int ntouched = 0;
+    int ret = 0;
+
+    if (!reqs) {
+        return -1;
+    }
+
+    for (uint32_t next = 0; next < cache.count; ) {
+        int n = 0;
+        uint64_t flags = spin_lock_irqsave(&cache.lock);
+        for (; next < cache.count && n < BCACHE_WB_BATCH; next++) {
+            bcache_buf_t *b = &cache.bufs[next];
+            if ((b->flags & BCACHE_DIRTY) && (!dev || b->dev == dev) && b->dirty_since <= cutoff) {
+                hold_locked(b);
+                picks[n++] = b;
+            }
+        }
+        spin_unlock_irqrestore(&cache.lock, flags);
+
+        blk_plug_t plug;
+        blk_plug_init(&plug);
+        for (int i = 0; i < n; i++) {
+            bcache_buf_t *b = picks[i];
+            reqs[i].dev = NULL;
+            locked[i] = true;
+            if (wait) {
+                wait_event(&cache.waiters, buf_try_lock(b));
+            } else if (!buf_try_lock(b)) {
+                locked[i] = false;
+                continue;
+            }
+
+            // Clean from here on; a failed write makes it dirty again
+            flags = spin_lock_irqsave(&cache.lock);
+            bool dirty = b->flags & BCACHE_DIRTY;
+            set_dirty_locked(b, false);
+            spin_unlock_irqrestore(&cache.lock, flags);
+            if (dirty) {
+                blk_init_request(&reqs[i], b->dev, b->lba, 1, b->data, true);
+                blk_plug_add(&plug, &reqs[i]);
+            }
+        }
+        blk_plug_flush(&plug);
+
+        for (int i = 0; i < n; i++) {
+            bcache_buf_t *b = picks[i];
+            if (!locked[i]) {
+                flags = spin_lock_irqsave(&cache.lock);
+                drop_locked(b);
+                spin_unlock_irqrestore(&cache.lock, flags);
+                continue;
+            }
+            if (reqs[i].dev) {
+                bool ok = blk_wait(&reqs[i]) == 0;
+                flags = spin_lock_irqsave(&cache.lock);
+                if (ok) {
+                    cache.writebacks++;
+                } else {
+                    set_dirty_locked(b, true);
+                }
+                spin_unlock_irqrestore(&cache.lock, flags);
+
+                if (!ok) {
+                    ret = -1;
+                } else {
+                    bool seen = false;
+                    for (int t = 0; t < ntouched; t++) {
+                        seen |= touched[t] == b->dev;
+                    }
+                    if (!seen && ntouched < MAX_BLOCK_DEVICES) {
+                        touched[ntouched++] = b->dev;
+                    }
+                }
+            }
+            bcache_release(b);
+        }
+    }
+
+    kfree(reqs);
+    for (int t = 0; t < ntouched; t++) {
+        if (blkdev_flush(touched[t]) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void bcache_writeback_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        thread_sleep_ms(BCACHE_WRITEBACK_MS);
+        if (__atomic_load_n(&cache.dirty, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        uint64_t now = timer_get_ticks();
+        if (now >= BCACHE_DIRTY_AGE_MS) {
+            bcache_writeback(NULL, now - BCACHE_DIRTY_AGE_MS, false);
+        }
+    }
+}
+
+// ============== Lookup ==============
+
+// CLOCK: skip pinned buffers, give referenced ones a second chance, and
+// prefer clean buffers. Returns NULL if only dirty (or no) buffers are free.
+static bcache_buf_t *find_victim_locked(bool *saw_dirty) {
+    *saw_dirty = false;
+    for (uint32_t step = 0; step < 2 * cache.count; step++) {
+        bcache_buf_t *b = &cache.bufs[cache.hand];
+        cache.hand = (cache.hand + 1) % cache.count;
+        if (b->refcount) {
+            continue;
+        }
+        if (b->flags & BCACHE_REFERENCED) {
+            b->flags &= ~BCACHE_REFERENCED;
+            continue;
+        }
+        if (b->flags & BCACHE_DIRTY) {
+            *saw_dirty = true;
+            continue;
+        }
+        return b;
+    }
+    return NULL;
+}
+
+bcache_buf_t *bcache_get(blkdev_t *dev, uint64_t lba) {
+    if (!dev || cache.count == 0) {
+        return NULL;
+    }
+
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&cache.lock);
+        bcache_buf_t *b = hash_lookup_locked(dev, lba);
+        if (b) {
+            hold_locked(b);
+            b->flags |= BCACHE_REFERENCED;
+            spin_unlock_irqrestore(&cache.lock, flags);
+            wait_event(&cache.waiters, buf_try_lock(b));
+            return b;
+        }
+
+        bool saw_dirty;
+        b = find_victim_locked(&saw_dirty);
+        if (b) {
+            if (b->dev) {
+                hash_remove_locked(b);
+                cache.evictions++;
+            } else {
+                cache.in_use++;
+            }
+            b->dev = dev;
+            b->lba = lba;
+            b->flags = BCACHE_REFERENCED;
+            uint32_t bucket = hash_index(dev, lba);
+            b->hash_next = cache.hash[bucket];
+            cache.hash[bucket] = b;
+            hold_locked(b);
+            buf_try_lock(b);        // Unpinned, so nobody holds it
+            spin_unlock_irqrestore(&cache.lock, flags);
+            return b;
+        }
+        spin_unlock_irqrestore(&cache.lock, flags);
+
+        if (saw_dirty) {
+            // Everything free is dirty: clean it in one merged pass
+            if (bcache_writeback(NULL, UINT64_MAX, false) < 0) {
+                return NULL;
+            }
+        } else {
+            wait_event_timeout(&cache.waiters,
+                               __atomic_load_n(&cache.pinned, __ATOMIC_RELAXED) < cache.count,
+                               BLK_POLL_MS);
+        }
+    }
+}
+
+bcache_buf_t *bcache_read(blkdev_t *dev, uint64_t lba) {
+    bcache_buf_t *b = bcache_get(dev, lba);
+    if (!b) {
+        return NULL;
+    }
+
+    if (b->flags & BCACHE_VALID) {
+        __atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+        return b;
+    }
+
+    __atomic_add_fetch(&cache.misses, 1, __ATOMIC_RELAXED);
+    if (blkdev_read(dev, lba, 1, b->data) != 1) {
+        bcache_release(b);
+        return NULL;
+    }
+    uint64_t flags = spin_lock_irqsave(&cache.lock);
+    b->flags |= BCACHE_VALID;
+    spin_unlock_irqrestore(&cache.lock, flags);
+    return b;
+}
+
+void bcache_mark_dirty(bcache_buf_t *buf) {
+    uint64_t flags = spin_lock_irqsave(&cache.lock);
+    buf->flags |= BCACHE_VALID;
+    set_dirty_locked(buf, true);
+    spin_unlock_irqrestore(&cache.lock, flags);
+}
+
+void bcache_release(bcache_buf_t *buf) {
+    if (!buf) {
+        return;
+    }
+    buf_unlock(buf);
+    uint64_t flags = spin_lock_irqsave(&cache.lock);
+    drop_locked(buf);
+    spin_unlock_irqrestore(&cache.lock, flags);
+    wait_queue_wake_all(&cache.waiters);
+}
+
+void bcache_invalidate(blkdev_t *dev, uint64_t lba, uint32_t count) {
+    if (cache.count == 0) {
+        return;
+    }
+
+    // Large ranges (a whole disk) are cheaper to find by scanning the pool
+    bool scan = count >= cache.count;
+    uint64_t flags = spin_lock_irqsave(&cache.lock);
+    for (uint32_t i = 0; i < (scan ? cache.count : count); i++) {
+        bcache_buf_t *b;
+        if (scan) {
+            b = &cache.bufs[i];
+            if (b->dev != dev || b->lba < lba || b->lba - lba >= count) {
+                continue;
+            }
+        } else if (!(b = hash_lookup_locked(dev, lba + i))) {
+            continue;
+        }
+        set_dirty_locked(b, false);
+        if (b->refcount) {
+            b->flags &= ~BCACHE_VALID;      // Holders re-read it
+        } else {
+            hash_remove_locked(b);
+            b->dev = NULL;
+            b->flags = 0;
+            cache.in_use--;
+        }
+    }
+    spin_unlock_irqrestore(&cache.lock, flags);
+}
+
+int bcache_sync(blkdev_t *dev) {
+    if (cache.count == 0) {
+        return dev ? blkdev_flush(dev) : 0;
+    }
+    int ret = bcache_writeback(dev, UINT64_MAX, true);
+    if (dev && blkdev_flush(dev) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+void bcache_get_stats(bcache_stats_t *stats) {
+    uint64_t flags = spin_lock_irqsave(&cache.lock);
+    stats->buffers = cache.count;
+    stats->in_use = cache.in_use;
+    stats->dirty = cache.dirty;
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->writebacks = cache.writebacks;
+    spin_unlock_irqrestore(&cache.lock, flags);
+}
+
+// ============== Setup ==============
+
+int bcache_init(void) {
+    uint64_t want = physical_get_total_memory() / BCACHE_RAM_DIVISOR / BLKDEV_SECTOR_SIZE;
+    if (want < BCACHE_MIN_BUFFERS) {
+        want = BCACHE_MIN_BUFFERS;
+    }
+    if (want > BCACHE_MAX_BUFFERS) {
+        want = BCACHE_MAX_BUFFERS;
+    }
+    uint32_t count = (uint32_t)want & ~(SECTORS_PER_PAGE - 1);
+
+    uint32_t bits = 1;
+    while ((1u << bits) < count) {
+        bits++;
+    }
+
+    cache.bufs = kmalloc(count * sizeof(bcache_buf_t));
+    cache.hash = kmalloc(((size_t)1 << bits) * sizeof(bcache_buf_t *));
+    if (!cache.bufs || !cache.hash) {
+        DEBUG_ERROR("bcache: out of memory for %u buffers\n", count);
+        kfree(cache.bufs);
+        kfree(cache.hash);
+        cache.bufs = NULL;
+        cache.hash = NULL;
+        return -1;
+    }
+    memset(cache.bufs, 0, count * sizeof(bcache_buf_t));
+    memset(cache.hash, 0, ((size_t)1 << bits) * sizeof(bcache_buf_t *));
+    cache.hash_bits = bits;
+
+    // Data pages needn't be contiguous; a short pool is still a cache
+    uint32_t ready = 0;
+    while (ready < count) {
+        void *page = physical_alloc_page();
+        if (!page) {
+            break;
+        }
+        uint8_t *mem = (uint8_t *)PHYS_TO_HHDM(page);
+        for (uint32_t i = 0; i < SECTORS_PER_PAGE; i++) {
+            cache.bufs[ready++].data = mem + i * BLKDEV_SECTOR_SIZE;
+        }
+    }
+    if (ready == 0) {
+        DEBUG_ERROR("bcache: no pages for buffers\n");
+        return -1;
+    }
+    cache.count = ready;
+
+    thread_t *flusher = thread_create("bflush", bcache_writeback_thread, NULL);
+    if (flusher) {
+        scheduler_add(flusher);
+    } else {
+        DEBUG_WARN("bcache: no write-back thread, dirty buffers wait for sync\n");
+    }
+
+    DEBUG_INFO("bcache: %u buffers (%u KB), %u hash buckets\n", cache.count,
+               cache.count * BLKDEV_SECTOR_SIZE / 1024, 1u << bits);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * Block Buffer Cache for CGOS
+ *
+ * Sector-sized buffers shared by every filesystem, looked up by device and
+ * LBA through a hash table and recycled with the CLOCK algorithm. Writes
+ * only dirty a buffer; a background thread writes dirty buffers back once
+ * they have aged, and bcache_sync() forces them out.
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "../drivers/blkdev.h"
+
+#define BCACHE_RAM_DIVISOR      64          // Cache 1/64th of RAM...
+#define BCACHE_MIN_BUFFERS      128         // ...but at least 64 KiB
+#define BCACHE_MAX_BUFFERS      65536       // ...and at most 32 MiB
+#define BCACHE_WRITEBACK_MS     500         // Write-back thread period
+#define BCACHE_DIRTY_AGE_MS     2000        // Dirty buffers older than this go out
+#define BCACHE_WB_BATCH         64          // Buffers per write-back pass
+
+#define BCACHE_VALID            0x01        // Data matches (or supersedes) the disk
+#define BCACHE_DIRTY            0x02        // Data must be written back
+#define BCACHE_REFERENCED       0x04        // Used since the clock hand last passed
+
+typedef struct bcache_buf {
+    struct bcache_buf *hash_next;
+    blkdev_t *dev;                  // NULL while unused
+    uint64_t lba;
+    uint32_t refcount;              // Holders and waiters; pinned while > 0
+    uint8_t flags;
+    volatile uint8_t locked;        // Owned by one holder (data access, I/O)
+    uint64_t dirty_since;           // Tick of the first write since clean
+    uint8_t *data;                  // BLKDEV_SECTOR_SIZE bytes
+} bcache_buf_t;
+
+typedef struct bcache_stats {
+    uint32_t buffers;
+    uint32_t in_use;                // Holding some device's sector
+    uint32_t dirty;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;            // Sectors written back
+} bcache_stats_t;
+
+// Size the cache from installed RAM and start the write-back thread
+int bcache_init(void);
+
+// Return the buffer for (dev, lba), locked, read from disk if needed.
+// NULL on I/O error.
+bcache_buf_t *bcache_read(blkdev_t *dev, uint64_t lba);
+
+// Same, but without reading: for callers that overwrite the whole sector
+bcache_buf_t *bcache_get(blkdev_t *dev, uint64_t lba);
+
+// Mark a locked buffer's data as changed (and so valid)
+void bcache_mark_dirty(bcache_buf_t *buf);
+
+// Unlock and drop a buffer from bcache_read() / bcache_get()
+void bcache_release(bcache_buf_t *buf);
+
+// Forget cached copies of sectors that were written around the cache,
+// dirty or not
+void bcache_invalidate(blkdev_t *dev, uint64_t lba, uint32_t count);
+
+// Write every dirty buffer of 'dev' (all devices when NULL) and flush the
+// device caches. Returns 0, or -1 if any write failed.
+int bcache_sync(blkdev_t *dev);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif // BCACHE_H
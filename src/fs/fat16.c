@@ -3,9 +3,12 @@
  */
 
 #include "fat16.h"
-#include "../drivers/ata.h"
+#include "../drivers/blkdev.h"
+#include "bcache.h"
 #include "../memory/memory.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
+#include "../sched/taskpool.h"
 
 // Filesystem state
 static fat16_fs_t fs;
@@ -13,18 +16,25 @@ static fat16_fs_t fs;
 // Sector buffer
 static uint8_t sector_buffer[512];
 
-// FAT cache (we cache part of the FAT for performance)
-static uint16_t fat_cache[256];  // 512 bytes = 256 entries
-static uint32_t fat_cache_sector = 0xFFFFFFFF;
+// The whole FAT, held in memory while mounted (at most 128 KiB), and a
+// bitmap of free clusters. FAT sectors are written back on sync.
+static struct {
+    uint16_t *table;
+    uint32_t *free_map;         // Bit set = cluster free
+    uint32_t *dirty;            // Bit per FAT sector
+    uint32_t free_count;
+    uint32_t next_free;         // Next-fit hint
+} fat;
 
-// Helper: Read a sector
+// Helper: Read a sector (through the buffer cache)
 static int read_sector(uint32_t lba, void *buffer) {
-    return ata_read_sectors(fs.drive, lba, 1, buffer);
-}
-
-// Helper: Write a sector
-static int write_sector(uint32_t lba, const void *buffer) {
-    return ata_write_sectors(fs.drive, lba, 1, buffer);
+    bcache_buf_t *b = bcache_read(fs.dev, lba);
+    if (!b) {
+        return -1;
+    }
+    memcpy(buffer, b->data, 512);
+    bcache_release(b);
+    return 1;
 }
 
 // Helper: Convert cluster number to first sector
@@ -34,89 +44,165 @@ static uint32_t cluster_to_sector(uint16_t cluster) {
 
 // Helper: Read FAT entry for a cluster
 static uint16_t fat_read_entry(uint16_t cluster) {
-    uint32_t fat_offset = cluster * 2;
-    uint32_t fat_sector = fs.fat_start_sector + (fat_offset / 512);
-    uint32_t entry_offset = (fat_offset % 512) / 2;
-    
-    // Check if we need to reload the cache
-    if (fat_sector != fat_cache_sector) {
-        if (read_sector(fat_sector, fat_cache) < 0) {
-            return FAT16_BAD_CLUSTER;
-        }
-        fat_cache_sector = fat_sector;
+    if (!fat.table || cluster >= fs.total_clusters + 2) {
+        return FAT16_BAD_CLUSTER;
     }
-    
-    return fat_cache[entry_offset];
+    return fat.table[cluster];
 }
 
-// Helper: Write FAT entry
+// Helper: Write FAT entry. The sector goes to every FAT copy on sync.
 static int fat_write_entry(uint16_t cluster, uint16_t value) {
-    uint32_t fat_offset = cluster * 2;
-    uint32_t fat_sector = fs.fat_start_sector + (fat_offset / 512);
-    uint32_t entry_offset = (fat_offset % 512) / 2;
-    
-    // Read the FAT sector
-    if (read_sector(fat_sector, sector_buffer) < 0) {
+    if (!fat.table || cluster < 2 || cluster >= fs.total_clusters + 2) {
         return -1;
     }
-    
-    // Update the entry
-    uint16_t *fat = (uint16_t *)sector_buffer;
-    fat[entry_offset] = value;
-    
-    // Write back to all FATs
-    for (int i = 0; i < fs.num_fats; i++) {
-        if (write_sector(fat_sector + (i * fs.fat_size), sector_buffer) < 0) {
-            return -1;
-        }
+
+    bool was_free = fat.table[cluster] == FAT16_FREE;
+    fat.table[cluster] = value;
+    uint32_t sector = cluster / 256;
+    fat.dirty[sector / 32] |= 1u << (sector % 32);
+
+    if (was_free && value != FAT16_FREE) {
+        fat.free_map[cluster / 32] &= ~(1u << (cluster % 32));
+        fat.free_count--;
+    } else if (!was_free && value == FAT16_FREE) {
+        fat.free_map[cluster / 32] |= 1u << (cluster % 32);
+        fat.free_count++;
     }
-    
-    // Invalidate cache
-    fat_cache_sector = 0xFFFFFFFF;
-    
     return 0;
 }
 
-// Helper: Find a free cluster
+// Helper: Find a free cluster, next-fit from the last allocation
 static uint16_t fat_find_free_cluster(void) {
-    for (uint16_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
-        if (fat_read_entry(cluster) == FAT16_FREE) {
-            return cluster;
+    if (!fat.table || fat.free_count == 0) {
+        return 0;  // No free clusters
+    }
+
+    uint32_t limit = fs.total_clusters + 2;
+    uint32_t words = (limit + 31) / 32;
+    uint32_t word = fat.next_free / 32;
+    uint32_t mask = ~0u << (fat.next_free % 32);
+
+    // One lap over the bitmap, starting mid-word at the hint
+    for (uint32_t i = 0; i <= words; i++) {
+        uint32_t bits = fat.free_map[word] & mask;
+        if (bits) {
+            uint32_t cluster = word * 32 + __builtin_ctz(bits);
+            fat.next_free = cluster + 1 < limit ? cluster + 1 : 2;
+            return (uint16_t)cluster;
         }
+        mask = ~0u;
+        word = word + 1 < words ? word + 1 : 0;
     }
-    return 0;  // No free clusters
+    return 0;
 }
 
-// Helper: Compare 8.3 filename
-static bool name_matches(const fat16_dir_entry_t *entry, const char *name) {
-    char entry_name[13];
-    int j = 0;
-    
-    // Copy name part (trim spaces)
-    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) {
-        entry_name[j++] = entry->name[i];
+static void fat_release(void) {
+    kfree(fat.table);
+    kfree(fat.free_map);
+    kfree(fat.dirty);
+    memset(&fat, 0, sizeof(fat));
+}
+
+// Load the first FAT copy and build the free-cluster bitmap
+static int fat_load(void) {
+    uint32_t limit = fs.total_clusters + 2;
+    fat.table = kmalloc((size_t)fs.fat_size * 512);
+    fat.free_map = kmalloc(((limit + 31) / 32) * sizeof(uint32_t));
+    fat.dirty = kmalloc(((fs.fat_size + 31) / 32) * sizeof(uint32_t));
+    if (!fat.table || !fat.free_map || !fat.dirty) {
+        fat_release();
+        return -1;
     }
-    
-    // Add extension if present
-    if (entry->ext[0] != ' ') {
-        entry_name[j++] = '.';
-        for (int i = 0; i < 3 && entry->ext[i] != ' '; i++) {
-            entry_name[j++] = entry->ext[i];
+    memset(fat.free_map, 0, ((limit + 31) / 32) * sizeof(uint32_t));
+    memset(fat.dirty, 0, ((fs.fat_size + 31) / 32) * sizeof(uint32_t));
+
+    if (blkdev_read(fs.dev, fs.fat_start_sector, fs.fat_size, fat.table) < 0) {
+        fat_release();
+        return -1;
+    }
+
+    for (uint32_t cluster = 2; cluster < limit; cluster++) {
+        if (fat.table[cluster] == FAT16_FREE) {
+            fat.free_map[cluster / 32] |= 1u << (cluster % 32);
+            fat.free_count++;
         }
     }
-    entry_name[j] = '\0';
-    
-    // Case-insensitive compare
-    const char *a = entry_name;
-    const char *b = name;
-    while (*a && *b) {
-        char ca = *a, cb = *b;
-        if (ca >= 'a' && ca <= 'z') ca -= 32;
-        if (cb >= 'a' && cb <= 'z') cb -= 32;
-        if (ca != cb) return false;
-        a++; b++;
+    fat.next_free = 2;
+    return 0;
+}
+
+// Write the dirty FAT sectors to every FAT copy, one request per run of
+// adjacent dirty sectors per copy, all released together
+static int fat_sync(void) {
+    if (!fat.table) {
+        return 0;
+    }
+
+    blk_request_t *reqs = kmalloc((size_t)fs.num_fats * fs.fat_size * sizeof(blk_request_t));
+    if (!reqs) {
+        return -1;
     }
-    return *a == *b;
+
+    blk_plug_t plug;
+    blk_plug_init(&plug);
+    int n = 0;
+    for (uint32_t s = 0; s < fs.fat_size; ) {
+        if (!(fat.dirty[s / 32] & (1u << (s % 32)))) {
+            s++;
+            continue;
+        }
+        uint32_t run = s;
+        while (run < fs.fat_size && (fat.dirty[run / 32] & (1u << (run % 32)))) {
+            fat.dirty[run / 32] &= ~(1u << (run % 32));
+            run++;
+        }
+        for (int f = 0; f < fs.num_fats; f++) {
+            uint32_t lba = fs.fat_start_sector + f * fs.fat_size + s;
+            bcache_invalidate(fs.dev, lba, run - s);
+            blk_init_request(&reqs[n], fs.dev, lba, run - s, (uint8_t *)fat.table + s * 512, true);
+            blk_plug_add(&plug, &reqs[n]);
+            n++;
+        }
+        s = run;
+    }
+    blk_plug_flush(&plug);
+
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (blk_wait(&reqs[i]) < 0) {
+            // Keep the sector dirty so the next sync retries it
+            uint32_t s = (reqs[i].lba - fs.fat_start_sector) % fs.fat_size;
+            for (uint32_t k = 0; k < reqs[i].count; k++, s++) {
+                fat.dirty[s / 32] |= 1u << (s % 32);
+            }
+            ret = -1;
+        }
+    }
+    kfree(reqs);
+    return ret;
+}
+
+// A directory entry may only reach the disk after the FAT chain it points
+// to, or a crash leaves it owning clusters the on-disk FAT calls free and
+// the next allocation cross-links them. Called before a directory entry is
+// made to reference new clusters. Directory changes already cached go out
+// first, so clusters a deletion freed are never reused on disk while the
+// old entry still claims them.
+static int fat_commit(void) {
+    if (!fat.table) {
+        return 0;
+    }
+    bool dirty = false;
+    for (uint32_t w = 0; w < (fs.fat_size + 31u) / 32; w++) {
+        dirty |= fat.dirty[w] != 0;
+    }
+    if (!dirty) {
+        return 0;
+    }
+    if (bcache_sync(fs.dev) < 0) {
+        return -1;
+    }
+    return fat_sync();
 }
 
 // Helper: Convert name to 8.3 format
@@ -147,6 +233,655 @@ static void name_to_83(const char *name, uint8_t *name83) {
     }
 }
 
+// ============== Directory Cache ==============
+//
+// Every directory that has been looked at is held as a tree of dentries,
+// one per file, hashed by (parent, name) so a path lookup costs one probe
+// per component. A directory is scanned from disk once, the first time a
+// lookup reaches it (the root at mount); from then on creates, deletes and
+// size changes update the dentries and the on-disk entries together, and a
+// miss in a loaded directory means the name doesn't exist.
+
+#define FAT16_DCACHE_BUCKETS 512
+#define FAT16_LFN_CHARS      13     // Name characters per LFN entry
+#define FAT16_LFN_MAX        20     // LFN entries for a 255-character name
+
+typedef struct dcache_link {
+    struct dcache_link *next;
+    const char *name;
+    struct fat16_dentry *dentry;
+} dcache_link_t;
+
+typedef struct fat16_dentry {
+    struct fat16_dentry *parent;    // NULL for the root
+    struct fat16_dentry *children;  // Loaded directories only, in disk order
+    struct fat16_dentry *last_child;
+    struct fat16_dentry *sibling;
+    struct fat16_dentry *all_next;  // Every dentry, for unmount
+    uint32_t child_count;
+    bool loaded;                    // Children are all in the cache
+
+    fat16_dir_entry_t entry;        // Copy of the on-disk short entry
+    uint32_t sector;                // Where that entry lives
+    uint16_t index;
+    uint32_t slot;                  // Slot number in the parent of the first
+    uint8_t slots;                  //   LFN entry, and LFN entries + 1
+
+    dcache_link_t link;             // By display name
+    dcache_link_t short_link;       // By 8.3 name, when that differs
+    char short_name[13];
+    char name[];                    // Long name, or the 8.3 name
+} fat16_dentry_t;
+
+static struct {
+    fat16_dentry_t root;
+    dcache_link_t *buckets[FAT16_DCACHE_BUCKETS];
+    fat16_dentry_t *all;
+    uint32_t count;
+} dcache;
+
+static int to_upper(int c) {
+    return (c >= 'a' && c <= 'z') ? c - 32 : c;
+}
+
+static uint32_t dcache_hash(const fat16_dentry_t *dir, const char *name, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)dir >> 4);
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)to_upper(name[i])) * 16777619u;
+    }
+    return h % FAT16_DCACHE_BUCKETS;
+}
+
+static bool name_equal(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (to_upper(a[i]) != to_upper(b[i]) || b[i] == '\0') {
+            return false;
+        }
+    }
+    return b[len] == '\0';
+}
+
+static void dcache_link(fat16_dentry_t *dir, dcache_link_t *link, const char *name,
+                        fat16_dentry_t *d) {
+    size_t len = 0;
+    while (name[len]) len++;
+    uint32_t bucket = dcache_hash(dir, name, len);
+    link->name = name;
+    link->dentry = d;
+    link->next = dcache.buckets[bucket];
+    dcache.buckets[bucket] = link;
+}
+
+static void dcache_unlink(fat16_dentry_t *dir, dcache_link_t *link) {
+    size_t len = 0;
+    while (link->name[len]) len++;
+    dcache_link_t **p = &dcache.buckets[dcache_hash(dir, link->name, len)];
+    while (*p && *p != link) {
+        p = &(*p)->next;
+    }
+    if (*p) {
+        *p = link->next;
+    }
+}
+
+static fat16_dentry_t *dcache_find(fat16_dentry_t *dir, const char *name, size_t len) {
+    for (dcache_link_t *l = dcache.buckets[dcache_hash(dir, name, len)]; l; l = l->next) {
+        if (l->dentry->parent == dir && name_equal(name, l->name, len)) {
+            return l->dentry;
+        }
+    }
+    return NULL;
+}
+
+// 8.3 entry name as "NAME.EXT"
+static void short_name_string(const fat16_dir_entry_t *entry, char *out) {
+    int k = 0;
+    for (int n = 0; n < 8 && entry->name[n] != ' '; n++) {
+        out[k++] = entry->name[n];
+    }
+    if (entry->ext[0] != ' ') {
+        out[k++] = '.';
+        for (int n = 0; n < 3 && entry->ext[n] != ' '; n++) {
+            out[k++] = entry->ext[n];
+        }
+    }
+    out[k] = '\0';
+}
+
+static fat16_dentry_t *dcache_add(fat16_dentry_t *dir, const fat16_dir_entry_t *entry,
+                                  uint32_t sector, uint16_t index, uint32_t slot,
+                                  uint8_t slots, const char *long_name) {
+    char short_name[13];
+    short_name_string(entry, short_name);
+    const char *name = long_name ? long_name : short_name;
+    size_t len = 0;
+    while (name[len]) len++;
+
+    fat16_dentry_t *d = kmalloc(sizeof(fat16_dentry_t) + len + 1);
+    if (!d) {
+        return NULL;
+    }
+    memset(d, 0, sizeof(*d));
+    memcpy(d->name, name, len + 1);
+    memcpy(d->short_name, short_name, sizeof(short_name));
+    d->parent = dir;
+    d->entry = *entry;
+    d->sector = sector;
+    d->index = index;
+    d->slot = slot;
+    d->slots = slots;
+
+    dcache_link(dir, &d->link, d->name, d);
+    if (long_name) {
+        dcache_link(dir, &d->short_link, d->short_name, d);
+    }
+    if (dir->last_child) {
+        dir->last_child->sibling = d;
+    } else {
+        dir->children = d;
+    }
+    dir->last_child = d;
+    dir->child_count++;
+    d->all_next = dcache.all;
+    dcache.all = d;
+    dcache.count++;
+    return d;
+}
+
+static void dcache_remove(fat16_dentry_t *d) {
+    fat16_dentry_t *dir = d->parent;
+    dcache_unlink(dir, &d->link);
+    if (d->short_link.name) {
+        dcache_unlink(dir, &d->short_link);
+    }
+
+    fat16_dentry_t *prev = NULL;
+    for (fat16_dentry_t *c = dir->children; c; prev = c, c = c->sibling) {
+        if (c == d) {
+            if (prev) {
+                prev->sibling = c->sibling;
+            } else {
+                dir->children = c->sibling;
+            }
+            if (dir->last_child == d) {
+                dir->last_child = prev;
+            }
+            break;
+        }
+    }
+    dir->child_count--;
+
+    for (fat16_dentry_t **p = &dcache.all; *p; p = &(*p)->all_next) {
+        if (*p == d) {
+            *p = d->all_next;
+            break;
+        }
+    }
+    dcache.count--;
+    kfree(d);
+}
+
+static void dcache_clear(void) {
+    for (fat16_dentry_t *d = dcache.all; d; ) {
+        fat16_dentry_t *next = d->all_next;
+        kfree(d);
+        d = next;
+    }
+    memset(&dcache, 0, sizeof(dcache));
+}
+
+static bool is_root(const fat16_dentry_t *dir) {
+    return dir == &dcache.root;
+}
+
+// Disk sector holding 'slot' of a directory, or 0 past its end
+static uint32_t dir_slot_sector(fat16_dentry_t *dir, uint32_t slot) {
+    uint32_t sector = slot / 16;
+    if (is_root(dir)) {
+        return sector < fs.root_dir_sectors ? fs.root_dir_start + sector : 0;
+    }
+    uint16_t cluster = dir->entry.cluster_lo;
+    for (uint32_t k = sector / fs.sectors_per_cluster; k > 0; k--) {
+        if (cluster < 2 || cluster >= FAT16_END_OF_CHAIN) {
+            return 0;
+        }
+        cluster = fat_read_entry(cluster);
+    }
+    if (cluster < 2 || cluster >= FAT16_END_OF_CHAIN) {
+        return 0;
+    }
+    return cluster_to_sector(cluster) + sector % fs.sectors_per_cluster;
+}
+
+// Store one 32-byte slot through the buffer cache
+static int dir_write_slot(uint32_t sector, uint32_t index, const fat16_dir_entry_t *entry) {
+    bcache_buf_t *b = bcache_read(fs.dev, sector);
+    if (!b) {
+        return -1;
+    }
+    memcpy(b->data + index * sizeof(fat16_dir_entry_t), entry, sizeof(fat16_dir_entry_t));
+    bcache_mark_dirty(b);
+    bcache_release(b);
+    return 0;
+}
+
+// Write a dentry's short entry back to its directory
+static int dentry_store(fat16_dentry_t *d) {
+    return dir_write_slot(d->sector, d->index, &d->entry);
+}
+
+static uint8_t lfn_checksum(const uint8_t *name83) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name83[i]);
+    }
+    return sum;
+}
+
+// Character offsets of the 13 UCS-2 name characters in an LFN entry
+static const uint8_t lfn_offsets[FAT16_LFN_CHARS] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+// Read a directory's entries into the cache
+static int dir_load(fat16_dentry_t *dir) {
+    if (dir->loaded) {
+        return 0;
+    }
+
+    char lfn[FAT16_LFN_MAX * FAT16_LFN_CHARS + 1];
+    int lfn_expect = 0;             // LFN entries still to come, or 0
+    int lfn_total = 0;
+    uint8_t lfn_sum = 0;
+    uint32_t lfn_slot = 0;
+
+    for (uint32_t slot = 0; ; slot += 16) {
+        uint32_t sector = dir_slot_sector(dir, slot);
+        if (!sector) {
+            break;
+        }
+        bcache_buf_t *b = bcache_read(fs.dev, sector);
+        if (!b) {
+            return -1;
+        }
+        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)b->data;
+        bool end = false;
+
+        for (int j = 0; j < 16 && !end; j++) {
+            fat16_dir_entry_t *e = &entries[j];
+            uint8_t *raw = (uint8_t *)e;
+
+            if (e->name[0] == 0x00) {
+                end = true;
+                break;
+            }
+            if (e->name[0] == 0xE5) {
+                lfn_expect = 0;
+                continue;
+            }
+            if (e->attr == FAT_ATTR_LFN) {
+                int ord = raw[0] & 0x1F;
+                if (raw[0] & 0x40) {
+                    if (ord == 0 || ord > FAT16_LFN_MAX) {
+                        lfn_expect = 0;
+                        continue;
+                    }
+                    lfn_total = ord;
+                    lfn_expect = ord;
+                    lfn_sum = raw[13];
+                    lfn_slot = slot + j;
+                    lfn[ord * FAT16_LFN_CHARS] = '\0';
+                }
+                if (lfn_expect == 0 || ord != lfn_expect || raw[13] != lfn_sum) {
+                    lfn_expect = 0;
+                    continue;
+                }
+                for (int c = 0; c < FAT16_LFN_CHARS; c++) {
+                    uint16_t ch = raw[lfn_offsets[c]] | (raw[lfn_offsets[c] + 1] << 8);
+                    char *dst = &lfn[(ord - 1) * FAT16_LFN_CHARS + c];
+                    *dst = ch == 0x0000 || ch == 0xFFFF ? '\0' : (ch < 0x80 ? (char)ch : '?');
+                }
+                lfn_expect--;
+                // Entry 1 comes last; a zero there ends the name early
+                if (lfn_expect == 0) {
+                    lfn_expect = -1;
+                }
+                continue;
+            }
+
+            bool have_lfn = lfn_expect == -1 && lfn_checksum(e->name) == lfn_sum;
+            lfn_expect = 0;
+            if ((e->attr & FAT_ATTR_VOLUME_ID) || e->name[0] == '.') {
+                continue;
+            }
+            uint32_t first = have_lfn ? lfn_slot : slot + j;
+            uint8_t slots = have_lfn ? (uint8_t)(lfn_total + 1) : 1;
+            if (!dcache_add(dir, e, sector, (uint16_t)j, first, slots, have_lfn ? lfn : NULL)) {
+                bcache_release(b);
+                return -1;
+            }
+        }
+        bcache_release(b);
+        if (end) {
+            break;
+        }
+    }
+
+    dir->loaded = true;
+    return 0;
+}
+
+static fat16_dentry_t *dir_lookup(fat16_dentry_t *dir, const char *name, size_t len) {
+    if (dir_load(dir) < 0) {
+        return NULL;
+    }
+    return dcache_find(dir, name, len);
+}
+
+// Resolve every component of 'path' but the last, which must name a
+// directory. Sets the leaf name (not terminated). '/' separates
+// components; "." and ".." work as usual.
+static fat16_dentry_t *path_parent(const char *path, const char **leaf, size_t *leaf_len) {
+    fat16_dentry_t *dir = &dcache.root;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        const char *start = p;
+        while (*p && *p != '/') p++;
+        size_t len = p - start;
+        const char *rest = p;
+        while (*rest == '/') rest++;
+        if (*rest == '\0') {
+            *leaf = start;
+            *leaf_len = len;
+            return dir;
+        }
+
+        if (len == 1 && start[0] == '.') {
+            continue;
+        }
+        if (len == 2 && start[0] == '.' && start[1] == '.') {
+            dir = dir->parent ? dir->parent : dir;
+            continue;
+        }
+        fat16_dentry_t *d = dir_lookup(dir, start, len);
+        if (!d || !(d->entry.attr & FAT_ATTR_DIRECTORY)) {
+            return NULL;
+        }
+        dir = d;
+    }
+}
+
+// The dentry for a path. "" and "/" are the root.
+static fat16_dentry_t *path_lookup(const char *path) {
+    const char *leaf;
+    size_t len;
+    fat16_dentry_t *dir = path_parent(path, &leaf, &len);
+    if (!dir) {
+        return NULL;
+    }
+    if (len == 0 || (len == 1 && leaf[0] == '.')) {
+        return dir;
+    }
+    if (len == 2 && leaf[0] == '.' && leaf[1] == '.') {
+        return dir->parent ? dir->parent : dir;
+    }
+    return dir_lookup(dir, leaf, len);
+}
+
+// ============== Directory Entries ==============
+
+static bool valid_83_char(char c) {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    const char *extra = "!#$%&'()-@^_`{}~";
+    for (; *extra; extra++) {
+        if (c == *extra) return true;
+    }
+    return false;
+}
+
+// Whether a name is stored as a plain 8.3 entry (case is not kept)
+static bool fits_83(const char *name, size_t len) {
+    size_t base = 0, ext = 0;
+    bool dot = false;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.') {
+            if (dot || i == 0) return false;
+            dot = true;
+        } else if (!valid_83_char(name[i])) {
+            return false;
+        } else if (dot) {
+            ext++;
+        } else {
+            base++;
+        }
+    }
+    return base >= 1 && base <= 8 && ext <= 3 && (!dot || ext > 0);
+}
+
+static bool valid_long_name(const char *name, size_t len) {
+    if (len == 0 || len > FAT16_LFN_MAX * FAT16_LFN_CHARS) {
+        return false;
+    }
+    if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if ((uint8_t)c < 0x20 || (uint8_t)c >= 0x80) return false;
+        const char *bad = "\"*/:<>?\\|";
+        for (const char *b = bad; *b; b++) {
+            if (c == *b) return false;
+        }
+    }
+    return true;
+}
+
+// Pick the 8.3 alias for a long name: up to six characters, "~N" and the
+// first three of the last extension, unique in 'dir'
+static int make_short_name(fat16_dentry_t *dir, const char *name, size_t len, uint8_t *name83) {
+    size_t last_dot = len;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.') last_dot = i;
+    }
+
+    char base[8];
+    int nb = 0;
+    for (size_t i = 0; i < last_dot && nb < 8; i++) {
+        char c = name[i];
+        if (c == ' ' || c == '.') continue;
+        base[nb++] = valid_83_char(c) ? (char)to_upper(c) : '_';
+    }
+    char ext[3];
+    int ne = 0;
+    for (size_t i = last_dot + 1; i < len && ne < 3; i++) {
+        char c = name[i];
+        if (c == ' ' || c == '.') continue;
+        ext[ne++] = valid_83_char(c) ? (char)to_upper(c) : '_';
+    }
+    if (nb == 0) {
+        base[nb++] = '_';
+    }
+
+    for (uint32_t n = 1; n < 1000000; n++) {
+        char tail[8];
+        int nt = 0;
+        for (uint32_t v = n; v; v /= 10) {
+            tail[nt++] = '0' + v % 10;
+        }
+        int keep = nb < 7 - nt ? nb : 7 - nt;
+
+        char candidate[13];
+        int k = 0;
+        for (int i = 0; i < keep; i++) candidate[k++] = base[i];
+        candidate[k++] = '~';
+        while (nt) candidate[k++] = tail[--nt];
+        int base_len = k;
+        if (ne) {
+            candidate[k++] = '.';
+            for (int i = 0; i < ne; i++) candidate[k++] = ext[i];
+        }
+        candidate[k] = '\0';
+
+        if (!dcache_find(dir, candidate, k)) {
+            for (int i = 0; i < 11; i++) name83[i] = ' ';
+            memcpy(name83, candidate, base_len);
+            memcpy(name83 + 8, ext, ne);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Zero a fresh directory cluster through the buffer cache
+static int dir_zero_cluster(uint16_t cluster) {
+    uint32_t sector = cluster_to_sector(cluster);
+    for (int i = 0; i < fs.sectors_per_cluster; i++) {
+        bcache_buf_t *b = bcache_get(fs.dev, sector + i);
+        if (!b) {
+            return -1;
+        }
+        memset(b->data, 0, 512);
+        bcache_mark_dirty(b);
+        bcache_release(b);
+    }
+    return 0;
+}
+
+// Find 'count' consecutive free slots, growing a subdirectory by a
+// cluster if it has none. Returns the first slot, or -1.
+static int64_t dir_find_free(fat16_dentry_t *dir, uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t slot = 0; ; slot++) {
+        uint32_t sector = dir_slot_sector(dir, slot);
+        if (!sector) {
+            if (is_root(dir)) {
+                return -1;  // The root directory has a fixed size
+            }
+            // Append a zeroed cluster and keep counting into it
+            uint16_t last = dir->entry.cluster_lo;
+            while (fat_read_entry(last) >= 2 && fat_read_entry(last) < FAT16_END_OF_CHAIN) {
+                last = fat_read_entry(last);
+            }
+            uint16_t cluster = fat_find_free_cluster();
+            if (cluster == 0 || dir_zero_cluster(cluster) < 0) {
+                return -1;
+            }
+            fat_write_entry(cluster, FAT16_END_OF_CHAIN);
+            fat_write_entry(last, cluster);
+            sector = dir_slot_sector(dir, slot);
+            if (!sector) {
+                return -1;
+            }
+        }
+
+        bcache_buf_t *b = bcache_read(fs.dev, sector);
+        if (!b) {
+            return -1;
+        }
+        uint8_t first = b->data[(slot % 16) * sizeof(fat16_dir_entry_t)];
+        bcache_release(b);
+
+        if (first == 0x00 || first == 0xE5) {
+            if (++run == count) {
+                return slot + 1 - count;
+            }
+        } else {
+            run = 0;
+        }
+    }
+}
+
+// Create a directory entry (with LFN entries if the name needs them)
+static fat16_dentry_t *dir_add(fat16_dentry_t *dir, const char *name, size_t len, uint8_t attr,
+                               uint16_t cluster) {
+    if (!valid_long_name(name, len) || dir_load(dir) < 0 || dcache_find(dir, name, len)) {
+        return NULL;
+    }
+
+    fat16_dir_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    char copy[FAT16_LFN_MAX * FAT16_LFN_CHARS + 1];
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    bool lfn = !fits_83(name, len);
+    int lfn_count = lfn ? (int)((len + FAT16_LFN_CHARS - 1) / FAT16_LFN_CHARS) : 0;
+    if (lfn) {
+        if (make_short_name(dir, name, len, entry.name) < 0) {
+            return NULL;
+        }
+    } else {
+        name_to_83(copy, entry.name);
+    }
+    entry.attr = attr;
+    entry.cluster_lo = cluster;
+    entry.file_size = 0;
+
+    int64_t first = dir_find_free(dir, lfn_count + 1);
+    if (first < 0) {
+        return NULL;
+    }
+
+    // The new entry's cluster (and any the directory just grew by) must be
+    // on disk before the entry is
+    if (fat_commit() < 0) {
+        return NULL;
+    }
+
+    // LFN entries in reverse order, the last piece of the name first
+    uint8_t sum = lfn_checksum(entry.name);
+    for (int k = 0; k < lfn_count; k++) {
+        int ord = lfn_count - k;
+        uint8_t raw[sizeof(fat16_dir_entry_t)];
+        memset(raw, 0, sizeof(raw));
+        raw[0] = (uint8_t)(ord | (k == 0 ? 0x40 : 0));
+        raw[11] = FAT_ATTR_LFN;
+        raw[13] = sum;
+        for (int c = 0; c < FAT16_LFN_CHARS; c++) {
+            size_t at = (size_t)(ord - 1) * FAT16_LFN_CHARS + c;
+            uint16_t ch = at < len ? (uint8_t)name[at] : (at == len ? 0x0000 : 0xFFFF);
+            raw[lfn_offsets[c]] = ch & 0xFF;
+            raw[lfn_offsets[c] + 1] = ch >> 8;
+        }
+        uint32_t slot = (uint32_t)first + k;
+        if (dir_write_slot(dir_slot_sector(dir, slot), slot % 16,
+                           (fat16_dir_entry_t *)raw) < 0) {
+            return NULL;
+        }
+    }
+
+    uint32_t slot = (uint32_t)first + lfn_count;
+    uint32_t sector = dir_slot_sector(dir, slot);
+    if (dir_write_slot(sector, slot % 16, &entry) < 0) {
+        return NULL;
+    }
+    return dcache_add(dir, &entry, sector, (uint16_t)(slot % 16), (uint32_t)first,
+                      (uint8_t)(lfn_count + 1), lfn ? copy : NULL);
+}
+
+// Mark every slot of an entry deleted and drop its dentry
+static int dir_remove(fat16_dentry_t *d) {
+    fat16_dentry_t *dir = d->parent;
+    int ret = 0;
+    for (uint32_t k = 0; k < d->slots; k++) {
+        uint32_t slot = d->slot + k;
+        uint32_t sector = dir_slot_sector(dir, slot);
+        bcache_buf_t *b = sector ? bcache_read(fs.dev, sector) : NULL;
+        if (!b) {
+            ret = -1;
+            continue;
+        }
+        b->data[(slot % 16) * sizeof(fat16_dir_entry_t)] = 0xE5;
+        bcache_mark_dirty(b);
+        bcache_release(b);
+    }
+    dcache_remove(d);
+    return ret;
+}
+
 int fat16_mount(int drive) {
     if (fs.mounted) {
         fat16_unmount();
@@ -155,12 +890,14 @@ int fat16_mount(int drive) {
     DEBUG_INFO("FAT16: Mounting drive %d...\n", drive);
     
     // Check drive exists
-    if (!ata_drive_present(drive)) {
+    blkdev_t *dev = blkdev_get(drive);
+    if (!dev) {
         DEBUG_INFO("FAT16: Drive not present\n");
         return -1;
     }
     
     fs.drive = drive;
+    fs.dev = dev;
     
     // Read boot sector
     if (read_sector(0, sector_buffer) < 0) {
@@ -204,103 +941,213 @@ int fat16_mount(int drive) {
         return -1;
     }
     
+    if ((uint32_t)fs.fat_size * 256 < fs.total_clusters + 2) {
+        DEBUG_INFO("FAT16: FAT too small for %u clusters\n", fs.total_clusters);
+        return -1;
+    }
+
+    if (fat_load() < 0) {
+        DEBUG_INFO("FAT16: Failed to load FAT\n");
+        return -1;
+    }
+    
     fs.mounted = true;
-    fat_cache_sector = 0xFFFFFFFF;
+
+    memset(&dcache, 0, sizeof(dcache));
+    dcache.root.entry.attr = FAT_ATTR_DIRECTORY;
+    if (dir_load(&dcache.root) < 0) {
+        DEBUG_INFO("FAT16: Failed to read root directory\n");
+        fs.mounted = false;
+        dcache_clear();
+        fat_release();
+        return -1;
+    }
     
     DEBUG_INFO("FAT16: Mounted successfully\n");
-    DEBUG_INFO("  Clusters: %u, Cluster size: %u bytes\n", 
-        fs.total_clusters, fs.sectors_per_cluster * 512);
+    DEBUG_INFO("  Clusters: %u (%u free), Cluster size: %u bytes\n", 
+        fs.total_clusters, fat.free_count, fs.sectors_per_cluster * 512);
+    
+    return 0;
+}
+
+int fat16_sync(void) {
+    if (!fs.mounted) {
+        return 0;
+    }
+    int ret = fat_sync();
+    if (bcache_sync(fs.dev) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static fat16_file_t open_files[FAT16_MAX_OPEN];
+
+void fat16_unmount(void) {
+    // Open handles still owe their directory entries an update
+    for (int i = 0; i < FAT16_MAX_OPEN; i++) {
+        if (open_files[i].in_use) {
+            fat16_close(&open_files[i]);
+        }
+    }
+    if (fs.mounted && fat16_sync() < 0) {
+        DEBUG_WARN("FAT16: write-back failed on unmount\n");
+    }
+    fs.mounted = false;
+    dcache_clear();
+    fat_release();
+}
+
+uint32_t fat16_free_clusters(void) {
+    return fs.mounted ? fat.free_count : 0;
+}
+
+bool fat16_is_mounted(void) {
+    return fs.mounted;
+}
+
+fat16_fs_t *fat16_get_fs(void) {
+    return &fs;
+}
+
+int fat16_list_dir(const char *path, void (*callback)(const char *name, uint32_t size, bool is_dir)) {
+    if (!fs.mounted) return -1;
+    
+    fat16_dentry_t *dir = path_lookup(path);
+    if (!dir || !(dir->entry.attr & FAT_ATTR_DIRECTORY) || dir_load(dir) < 0) {
+        return -1;
+    }
+    for (fat16_dentry_t *d = dir->children; d; d = d->sibling) {
+        callback(d->name, d->entry.file_size, (d->entry.attr & FAT_ATTR_DIRECTORY) != 0);
+    }
+    return 0;
+}
+
+int fat16_list_root(void (*callback)(const char *name, uint32_t size, bool is_dir)) {
+    return fat16_list_dir("/", callback);
+}
+
+int fat16_find_file(const char *name, fat16_dir_entry_t *out_entry) {
+    if (!fs.mounted) return -1;
     
+    fat16_dentry_t *d = path_lookup(name);
+    if (!d || is_root(d)) {
+        return -1;
+    }
+    if (out_entry) {
+        memcpy(out_entry, &d->entry, sizeof(fat16_dir_entry_t));
+    }
     return 0;
 }
 
-void fat16_unmount(void) {
-    fs.mounted = false;
-    fat_cache_sector = 0xFFFFFFFF;
-}
+// Whether a handle has the file open (for writing only, if 'writers')
+static bool file_is_open(fat16_dentry_t *d, bool writers);
 
-bool fat16_is_mounted(void) {
-    return fs.mounted;
-}
+// File data reads. Each segment is a run of whole sectors over consecutive
+// clusters read straight into the caller's buffer, or the final partial
+// sector read into 'tail' and copied.
+#define FAT16_READ_RUN_MAX 256      // Sectors per segment (128 KiB)
 
-fat16_fs_t *fat16_get_fs(void) {
-    return &fs;
-}
+typedef struct {
+    blk_request_t req;
+    uint8_t *dst;
+    size_t copy;                    // Bytes to copy out of 'tail', or 0
+} fat16_read_seg_t;
 
-int fat16_list_root(void (*callback)(const char *name, uint32_t size, bool is_dir)) {
-    if (!fs.mounted) return -1;
-    
-    // Read root directory entries
-    for (uint32_t i = 0; i < fs.root_dir_sectors; i++) {
-        if (read_sector(fs.root_dir_start + i, sector_buffer) < 0) {
-            return -1;
+typedef struct {
+    uint16_t cluster;               // Where the next segment starts
+    uint32_t offset;                // Sector within that cluster
+    uint8_t *dst;
+    size_t remaining;
+    fat16_read_seg_t segs[2];
+    uint8_t tail[512];
+} fat16_read_io_t;
+
+// Length of the run of up to 'want' sectors starting at (cluster, offset)
+// that is contiguous on disk, stepping over consecutive clusters. Advances
+// the position past it.
+static uint32_t next_run(uint16_t *cluster, uint32_t *offset, uint32_t want) {
+    uint32_t count = 0;
+    for (;;) {
+        uint32_t take = fs.sectors_per_cluster - *offset;
+        if (take > want - count) {
+            take = want - count;
         }
-        
-        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-        for (int j = 0; j < 16; j++) {  // 16 entries per sector
-            fat16_dir_entry_t *entry = &entries[j];
-            
-            // End of directory
-            if (entry->name[0] == 0x00) {
-                return 0;
-            }
-            
-            // Skip deleted entries
-            if (entry->name[0] == 0xE5) continue;
-            
-            // Skip LFN and volume labels
-            if (entry->attr == FAT_ATTR_LFN) continue;
-            if (entry->attr & FAT_ATTR_VOLUME_ID) continue;
-            
-            // Build filename
-            char name[13];
-            int k = 0;
-            for (int n = 0; n < 8 && entry->name[n] != ' '; n++) {
-                name[k++] = entry->name[n];
-            }
-            if (entry->ext[0] != ' ') {
-                name[k++] = '.';
-                for (int n = 0; n < 3 && entry->ext[n] != ' '; n++) {
-                    name[k++] = entry->ext[n];
-                }
-            }
-            name[k] = '\0';
-            
-            bool is_dir = (entry->attr & FAT_ATTR_DIRECTORY) != 0;
-            callback(name, entry->file_size, is_dir);
+        count += take;
+        *offset += take;
+        if (*offset < fs.sectors_per_cluster) {
+            break;                  // Ends inside this cluster
+        }
+        uint16_t next = fat_read_entry(*cluster);
+        bool contiguous = next == *cluster + 1;
+        *cluster = next;
+        *offset = 0;
+        if (count == want || !contiguous) {
+            break;
         }
     }
-    
-    return 0;
+    return count;
 }
 
-int fat16_find_file(const char *name, fat16_dir_entry_t *out_entry) {
-    if (!fs.mounted) return -1;
-    
-    for (uint32_t i = 0; i < fs.root_dir_sectors; i++) {
-        if (read_sector(fs.root_dir_start + i, sector_buffer) < 0) {
-            return -1;
+static bool read_io_next(fat16_read_io_t *io, fat16_read_seg_t *seg) {
+    if (io->remaining == 0 || io->cluster < 2 || io->cluster >= FAT16_END_OF_CHAIN) {
+        return false;
+    }
+
+    uint32_t lba = cluster_to_sector(io->cluster) + io->offset;
+    if (io->remaining < 512) {
+        blk_init_request(&seg->req, fs.dev, lba, 1, io->tail, false);
+        seg->dst = io->dst;
+        seg->copy = io->remaining;
+        io->remaining = 0;
+        return true;
+    }
+
+    uint32_t want = io->remaining / 512;
+    if (want > FAT16_READ_RUN_MAX) {
+        want = FAT16_READ_RUN_MAX;
+    }
+    uint32_t count = next_run(&io->cluster, &io->offset, want);
+
+    blk_init_request(&seg->req, fs.dev, lba, count, io->dst, false);
+    seg->dst = io->dst;
+    seg->copy = 0;
+    io->dst += (size_t)count * 512;
+    io->remaining -= (size_t)count * 512;
+    return true;
+}
+
+// Read 'bytes' starting at sector 'offset' of 'cluster' into 'buffer'.
+// Keeps the next run queued while waiting for the current one, so the
+// disk never idles between runs.
+static int read_chain(uint16_t cluster, uint32_t offset, void *buffer, size_t bytes) {
+    fat16_read_io_t io;
+    io.cluster = cluster;
+    io.offset = offset;
+    io.dst = (uint8_t *)buffer;
+    io.remaining = bytes;
+
+    int cur = 0;
+    bool have[2];
+    have[0] = read_io_next(&io, &io.segs[0]);
+    if (have[0]) {
+        blk_submit(&io.segs[0].req);
+    }
+    bool failed = false;
+    while (have[cur]) {
+        int next = cur ^ 1;
+        have[next] = !failed && read_io_next(&io, &io.segs[next]);
+        if (have[next]) {
+            blk_submit(&io.segs[next].req);
         }
-        
-        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-        for (int j = 0; j < 16; j++) {
-            fat16_dir_entry_t *entry = &entries[j];
-            
-            if (entry->name[0] == 0x00) return -1;  // End
-            if (entry->name[0] == 0xE5) continue;    // Deleted
-            if (entry->attr == FAT_ATTR_LFN) continue;
-            if (entry->attr & FAT_ATTR_VOLUME_ID) continue;
-            
-            if (name_matches(entry, name)) {
-                if (out_entry) {
-                    memcpy(out_entry, entry, sizeof(fat16_dir_entry_t));
-                }
-                return 0;
-            }
+        if (blk_wait(&io.segs[cur].req) < 0) {
+            failed = true;
+        } else if (io.segs[cur].copy) {
+            memcpy(io.segs[cur].dst, io.tail, io.segs[cur].copy);
         }
+        cur = next;
     }
-    
-    return -1;  // Not found
+    return failed || io.remaining ? -1 : 0;
 }
 
 int fat16_read_file(const char *name, void *buffer, size_t max_size) {
@@ -318,113 +1165,128 @@ int fat16_read_file(const char *name, void *buffer, size_t max_size) {
     size_t size = entry.file_size;
     if (size > max_size) size = max_size;
     
-    uint16_t cluster = entry.cluster_lo;
-    uint8_t *dst = (uint8_t *)buffer;
-    size_t remaining = size;
-    
-    while (remaining > 0 && cluster >= 2 && cluster < FAT16_END_OF_CHAIN) {
-        // Read all sectors in this cluster
-        uint32_t sector = cluster_to_sector(cluster);
-        for (int i = 0; i < fs.sectors_per_cluster && remaining > 0; i++) {
-            if (read_sector(sector + i, sector_buffer) < 0) {
-                return -1;
-            }
-            
-            size_t copy = remaining > 512 ? 512 : remaining;
-            memcpy(dst, sector_buffer, copy);
-            dst += copy;
-            remaining -= copy;
-        }
-        
-        // Get next cluster
-        cluster = fat_read_entry(cluster);
+    if (read_chain(entry.cluster_lo, 0, buffer, size) < 0) {
+        return -1;
     }
-    
+    TRACE(TRACE_FS_READ, max_size, size);
     return size;
 }
 
 int fat16_create_file(const char *name) {
     if (!fs.mounted) return -1;
     
-    // Check if file already exists
-    if (fat16_find_file(name, NULL) == 0) {
-        return -1;  // Already exists
+    const char *leaf;
+    size_t len;
+    fat16_dentry_t *dir = path_parent(name, &leaf, &len);
+    if (!dir) {
+        return -1;
     }
+    return dir_add(dir, leaf, len, FAT_ATTR_ARCHIVE, 0) ? 0 : -1;
+}
+
+int fat16_mkdir(const char *path) {
+    if (!fs.mounted) return -1;
     
-    // Find a free directory entry
-    for (uint32_t i = 0; i < fs.root_dir_sectors; i++) {
-        if (read_sector(fs.root_dir_start + i, sector_buffer) < 0) {
-            return -1;
-        }
-        
-        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-        for (int j = 0; j < 16; j++) {
-            fat16_dir_entry_t *entry = &entries[j];
-            
-            if (entry->name[0] == 0x00 || entry->name[0] == 0xE5) {
-                // Found free entry
-                memset(entry, 0, sizeof(fat16_dir_entry_t));
-                name_to_83(name, entry->name);
-                entry->attr = FAT_ATTR_ARCHIVE;
-                entry->cluster_lo = 0;
-                entry->file_size = 0;
-                
-                // Write back
-                if (write_sector(fs.root_dir_start + i, sector_buffer) < 0) {
-                    return -1;
-                }
-                
-                return 0;
-            }
-        }
+    const char *leaf;
+    size_t len;
+    fat16_dentry_t *parent = path_parent(path, &leaf, &len);
+    if (!parent || dir_load(parent) < 0 || dcache_find(parent, leaf, len)) {
+        return -1;
     }
     
-    return -1;  // No free entries
+    uint16_t cluster = fat_find_free_cluster();
+    if (cluster == 0) {
+        return -1;
+    }
+    fat_write_entry(cluster, FAT16_END_OF_CHAIN);
+    
+    // "." and ".." open every directory but the root
+    fat16_dir_entry_t dot;
+    memset(&dot, 0, sizeof(dot));
+    memset(dot.name, ' ', 11);
+    dot.name[0] = '.';
+    dot.attr = FAT_ATTR_DIRECTORY;
+    dot.cluster_lo = cluster;
+    fat16_dir_entry_t dotdot = dot;
+    dotdot.name[1] = '.';
+    dotdot.cluster_lo = is_root(parent) ? 0 : parent->entry.cluster_lo;
+    
+    uint32_t sector = cluster_to_sector(cluster);
+    fat16_dentry_t *d = NULL;
+    if (dir_zero_cluster(cluster) == 0 && dir_write_slot(sector, 0, &dot) == 0 &&
+        dir_write_slot(sector, 1, &dotdot) == 0) {
+        d = dir_add(parent, leaf, len, FAT_ATTR_DIRECTORY, cluster);
+    }
+    if (!d) {
+        fat_write_entry(cluster, FAT16_FREE);
+        return -1;
+    }
+    d->loaded = true;               // Nothing in it yet
+    return 0;
+}
+
+// Batched file data writes. One request per cluster plus a partial tail
+// sector, which can only come last.
+#define FAT16_WRITE_BATCH 32
+
+typedef struct {
+    blk_plug_t plug;
+    blk_request_t reqs[FAT16_WRITE_BATCH + 1];
+    int count;
+    bool failed;
+    uint8_t tail[512];
+} fat16_write_io_t;
+
+static void write_io_add(fat16_write_io_t *io, uint32_t lba, uint32_t count, const void *buffer) {
+    blk_request_t *req = &io->reqs[io->count++];
+    bcache_invalidate(fs.dev, lba, count);      // Written around the cache
+    blk_init_request(req, fs.dev, lba, count, (void *)buffer, true);
+    blk_plug_add(&io->plug, req);
+}
+
+// Release the queued requests and wait for all of them
+static int write_io_finish(fat16_write_io_t *io) {
+    blk_plug_flush(&io->plug);
+    for (int i = 0; i < io->count; i++) {
+        if (blk_wait(&io->reqs[i]) < 0) {
+            io->failed = true;
+        }
+    }
+    io->count = 0;
+    return io->failed ? -1 : 0;
 }
 
 int fat16_write_file(const char *name, const void *data, size_t size) {
     if (!fs.mounted) return -1;
     
-    fat16_dir_entry_t entry;
-    int entry_sector = -1, entry_index = -1;
-    
-    // Find the file
-    for (uint32_t i = 0; i < fs.root_dir_sectors; i++) {
-        if (read_sector(fs.root_dir_start + i, sector_buffer) < 0) {
-            return -1;
-        }
-        
-        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-        for (int j = 0; j < 16; j++) {
-            if (entries[j].name[0] == 0x00) goto not_found;
-            if (entries[j].name[0] == 0xE5) continue;
-            if (entries[j].attr == FAT_ATTR_LFN) continue;
-            if (entries[j].attr & FAT_ATTR_VOLUME_ID) continue;
-            
-            if (name_matches(&entries[j], name)) {
-                memcpy(&entry, &entries[j], sizeof(entry));
-                entry_sector = fs.root_dir_start + i;
-                entry_index = j;
-                goto found;
-            }
-        }
+    fat16_dentry_t *d = path_lookup(name);
+    if (!d || (d->entry.attr & FAT_ATTR_DIRECTORY) || file_is_open(d, false)) {
+        return -1;
     }
     
-not_found:
-    return -1;
-
-found:
     // Free existing clusters
-    if (entry.cluster_lo >= 2) {
-        uint16_t cluster = entry.cluster_lo;
+    if (d->entry.cluster_lo >= 2) {
+        uint16_t cluster = d->entry.cluster_lo;
         while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN) {
             uint16_t next = fat_read_entry(cluster);
             fat_write_entry(cluster, FAT16_FREE);
             cluster = next;
         }
+        d->entry.cluster_lo = 0;
+        d->entry.file_size = 0;
     }
     
-    // Allocate new clusters if needed
+    // Allocate new clusters if needed. Data goes straight from the caller's
+    // buffer, one request per cluster, released in batches so the block
+    // queue can merge the contiguous runs into large transfers.
+    fat16_write_io_t *io = kmalloc(sizeof(fat16_write_io_t));
+    if (!io) {
+        return -1;
+    }
+    blk_plug_init(&io->plug);
+    io->count = 0;
+    io->failed = false;
+
     const uint8_t *src = (const uint8_t *)data;
     size_t remaining = size;
     uint16_t first_cluster = 0;
@@ -433,6 +1295,8 @@ found:
     while (remaining > 0) {
         uint16_t cluster = fat_find_free_cluster();
         if (cluster == 0) {
+            write_io_finish(io);
+            kfree(io);
             return -1;  // Disk full
         }
         
@@ -445,94 +1309,124 @@ found:
         }
         fat_write_entry(cluster, FAT16_END_OF_CHAIN);
         
-        // Write data to this cluster
+        // Whole sectors from the source, then a padded copy of a partial tail
         uint32_t sector = cluster_to_sector(cluster);
-        for (int i = 0; i < fs.sectors_per_cluster && remaining > 0; i++) {
-            memset(sector_buffer, 0, 512);
-            size_t copy = remaining > 512 ? 512 : remaining;
-            memcpy(sector_buffer, src, copy);
-            
-            if (write_sector(sector + i, sector_buffer) < 0) {
-                return -1;
-            }
-            
-            src += copy;
-            remaining -= copy;
+        uint32_t whole = remaining / 512;
+        if (whole > fs.sectors_per_cluster) {
+            whole = fs.sectors_per_cluster;
+        }
+        if (whole > 0) {
+            write_io_add(io, sector, whole, src);
+            src += (size_t)whole * 512;
+            remaining -= (size_t)whole * 512;
+        }
+        if (remaining > 0 && whole < fs.sectors_per_cluster) {
+            memset(io->tail, 0, 512);
+            memcpy(io->tail, src, remaining);
+            write_io_add(io, sector + whole, 1, io->tail);
+            src += remaining;
+            remaining = 0;
         }
         
+        if (io->count >= FAT16_WRITE_BATCH) {
+            write_io_finish(io);
+        }
         prev_cluster = cluster;
     }
-    
-    // Update directory entry
-    if (read_sector(entry_sector, sector_buffer) < 0) {
+
+    bool failed = write_io_finish(io) < 0;
+    kfree(io);
+    if (failed) {
         return -1;
     }
     
-    fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-    entries[entry_index].cluster_lo = first_cluster;
-    entries[entry_index].file_size = size;
-    
-    if (write_sector(entry_sector, sector_buffer) < 0) {
+    // Update directory entry, once the new chain is on disk
+    if (fat_commit() < 0) {
+        return -1;
+    }
+    d->entry.cluster_lo = first_cluster;
+    d->entry.file_size = size;
+    if (dentry_store(d) < 0) {
         return -1;
     }
     
+    TRACE(TRACE_FS_WRITE, size, size);
     return size;
 }
 
 int fat16_delete_file(const char *name) {
     if (!fs.mounted) return -1;
     
-    // Find the file
-    for (uint32_t i = 0; i < fs.root_dir_sectors; i++) {
-        if (read_sector(fs.root_dir_start + i, sector_buffer) < 0) {
+    fat16_dentry_t *d = path_lookup(name);
+    if (!d || is_root(d) || file_is_open(d, false)) {
+        return -1;
+    }
+    
+    // Directories go only when empty
+    if (d->entry.attr & FAT_ATTR_DIRECTORY) {
+        if (dir_load(d) < 0 || d->child_count > 0) {
             return -1;
         }
-        
-        fat16_dir_entry_t *entries = (fat16_dir_entry_t *)sector_buffer;
-        for (int j = 0; j < 16; j++) {
-            fat16_dir_entry_t *entry = &entries[j];
-            
-            if (entry->name[0] == 0x00) return -1;
-            if (entry->name[0] == 0xE5) continue;
-            if (entry->attr == FAT_ATTR_LFN) continue;
-            
-            if (name_matches(entry, name)) {
-                // Free clusters
-                uint16_t cluster = entry->cluster_lo;
-                while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN) {
-                    uint16_t next = fat_read_entry(cluster);
-                    fat_write_entry(cluster, FAT16_FREE);
-                    cluster = next;
-                }
-                
-                // Mark entry as deleted
-                entry->name[0] = 0xE5;
-                
-                return write_sector(fs.root_dir_start + i, sector_buffer);
-            }
-        }
     }
     
-    return -1;
+    // Free clusters
+    uint16_t cluster = d->entry.cluster_lo;
+    while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN) {
+        uint16_t next = fat_read_entry(cluster);
+        fat_write_entry(cluster, FAT16_FREE);
+        cluster = next;
+    }
+    
+    return dir_remove(d);
+}
+
+// Sectors fat16_format() clears per write (and per parallel piece)
+#define FAT16_FORMAT_CHUNK 64
+
+static uint8_t format_zeroes[FAT16_FORMAT_CHUNK * 512];
+
+typedef struct {
+    blkdev_t *dev;
+    uint32_t base;              // First sector to clear
+    volatile bool failed;
+} format_clear_t;
+
+// parallel_for() piece: zero sectors [begin, end) past job->base
+static void format_clear_range(size_t begin, size_t end, void *arg) {
+    format_clear_t *job = (format_clear_t *)arg;
+    for (size_t s = begin; s < end && !job->failed; s += FAT16_FORMAT_CHUNK) {
+        uint32_t n = end - s < FAT16_FORMAT_CHUNK ? (uint32_t)(end - s) : FAT16_FORMAT_CHUNK;
+        if (blkdev_write(job->dev, job->base + s, n, format_zeroes) < 0) {
+            job->failed = true;
+        }
+    }
 }
 
 int fat16_format(int drive, const char *volume_label) {
     DEBUG_INFO("FAT16: Formatting drive %d...\n", drive);
     
     // Check drive exists
-    if (!ata_drive_present(drive)) {
+    blkdev_t *dev = blkdev_get(drive);
+    if (!dev) {
         DEBUG_INFO("FAT16: Drive not present\n");
         return -1;
     }
     
-    ata_drive_t *drv = ata_get_drive_info(drive);
-    if (!drv) return -1;
-    
-    uint32_t total_sectors = drv->size_sectors;
+    uint32_t total_sectors = dev->sectors > 0xFFFFFFFFULL ? 0xFFFFFFFF : (uint32_t)dev->sectors;
     if (total_sectors < 8192) {  // Need at least 4MB
         DEBUG_INFO("FAT16: Drive too small\n");
         return -1;
     }
+
+    // The new metadata goes straight to the disk; drop whatever the cache
+    // holds for the old filesystem, dirty or not
+    if (fs.mounted && fs.dev == dev) {
+        fs.mounted = false;
+        dcache_clear();
+        fat_release();
+        memset(open_files, 0, sizeof(open_files));
+    }
+    bcache_invalidate(dev, 0, total_sectors);
     
     // FAT16 parameters for 32MB disk
     // Sectors per cluster: 4 (2KB clusters) for small disks
@@ -614,11 +1508,22 @@ int fat16_format(int drive, const char *volume_label) {
     sector_buffer[511] = 0xAA;
     
     // Write boot sector
-    if (ata_write_sectors(drive, 0, 1, sector_buffer) < 0) {
+    if (blkdev_write(dev, 0, 1, sector_buffer) < 0) {
         DEBUG_INFO("FAT16: Failed to write boot sector\n");
         return -1;
     }
     
+    // Clear both FATs and the root directory, in pieces spread over the
+    // task pool so several writes are in flight at once
+    uint32_t root_start = reserved_sectors + (num_fats * fat_size);
+    format_clear_t clear = { .dev = dev, .base = reserved_sectors, .failed = false };
+    parallel_for(0, root_start + root_dir_sectors - reserved_sectors, FAT16_FORMAT_CHUNK,
+                 format_clear_range, &clear);
+    if (clear.failed) {
+        DEBUG_INFO("FAT16: Failed to clear FAT and root dir\n");
+        return -1;
+    }
+    
     // Initialize FAT (first two entries are reserved)
     memset(sector_buffer, 0, 512);
     uint16_t *fat = (uint16_t *)sector_buffer;
@@ -628,28 +1533,10 @@ int fat16_format(int drive, const char *volume_label) {
     // Write first FAT sector for each FAT copy
     for (int f = 0; f < num_fats; f++) {
         uint32_t fat_start = reserved_sectors + (f * fat_size);
-        if (ata_write_sectors(drive, fat_start, 1, sector_buffer) < 0) {
+        if (blkdev_write(dev, fat_start, 1, sector_buffer) < 0) {
             DEBUG_INFO("FAT16: Failed to write FAT\n");
             return -1;
         }
-        
-        // Clear remaining FAT sectors
-        memset(sector_buffer, 0, 512);
-        for (uint32_t s = 1; s < fat_size; s++) {
-            if (ata_write_sectors(drive, fat_start + s, 1, sector_buffer) < 0) {
-                return -1;
-            }
-        }
-    }
-    
-    // Clear root directory
-    memset(sector_buffer, 0, 512);
-    uint32_t root_start = reserved_sectors + (num_fats * fat_size);
-    for (uint32_t s = 0; s < root_dir_sectors; s++) {
-        if (ata_write_sectors(drive, root_start + s, 1, sector_buffer) < 0) {
-            DEBUG_INFO("FAT16: Failed to write root dir\n");
-            return -1;
-        }
     }
     
     // Add volume label entry if specified
@@ -668,11 +1555,346 @@ int fat16_format(int drive, const char *volume_label) {
         
         entry->attr = FAT_ATTR_VOLUME_ID;
         
-        if (ata_write_sectors(drive, root_start, 1, sector_buffer) < 0) {
+        if (blkdev_write(dev, root_start, 1, sector_buffer) < 0) {
             return -1;
         }
     }
     
+    if (blkdev_flush(dev) < 0) {
+        return -1;
+    }
+    
     DEBUG_INFO("FAT16: Format complete\n");
     return 0;
 }
+
+// ============== File Handles ==============
+
+static uint32_t cluster_bytes(void) {
+    return (uint32_t)fs.sectors_per_cluster * 512;
+}
+
+static bool handle_valid(fat16_file_t *file) {
+    return fs.mounted && file >= open_files && file < open_files + FAT16_MAX_OPEN &&
+           file->in_use;
+}
+
+// Cluster number 'index' of the file's chain. Steps from the cursor when
+// moving forward, from the start otherwise. Returns 0 past the chain.
+static uint16_t handle_cluster(fat16_file_t *file, uint32_t index) {
+    if (file->cur_cluster == 0 || index < file->cur_index) {
+        file->cur_cluster = file->start_cluster;
+        file->cur_index = 0;
+    }
+    while (file->cur_index < index && file->cur_cluster >= 2 &&
+           file->cur_cluster < FAT16_END_OF_CHAIN) {
+        file->cur_cluster = fat_read_entry(file->cur_cluster);
+        file->cur_index++;
+    }
+    if (file->cur_cluster < 2 || file->cur_cluster >= FAT16_END_OF_CHAIN) {
+        file->cur_cluster = 0;
+        return 0;
+    }
+    return file->cur_cluster;
+}
+
+// Free a chain and everything after it
+static void free_chain(uint16_t cluster) {
+    while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN) {
+        uint16_t next = fat_read_entry(cluster);
+        fat_write_entry(cluster, FAT16_FREE);
+        cluster = next;
+    }
+}
+
+// Grow the chain to cover 'size' bytes. All or nothing.
+static int handle_reserve(fat16_file_t *file, uint32_t size) {
+    uint32_t have = (file->file_size + cluster_bytes() - 1) / cluster_bytes();
+    uint32_t need = (size + cluster_bytes() - 1) / cluster_bytes();
+    if (need <= have) {
+        return 0;
+    }
+
+    uint16_t last = have ? handle_cluster(file, have - 1) : 0;
+    if (have && !last) {
+        return -1;                  // Chain shorter than the size says
+    }
+
+    uint16_t first_new = 0;
+    uint16_t prev = last;
+    for (uint32_t i = have; i < need; i++) {
+        uint16_t cluster = fat_find_free_cluster();
+        if (cluster == 0) {
+            // Disk full: give back what this call took
+            free_chain(first_new);
+            if (last) {
+                fat_write_entry(last, FAT16_END_OF_CHAIN);
+            }
+            return -1;
+        }
+        fat_write_entry(cluster, FAT16_END_OF_CHAIN);
+        if (prev) {
+            fat_write_entry(prev, cluster);
+        }
+        if (!first_new) {
+            first_new = cluster;
+        }
+        prev = cluster;
+    }
+
+    if (!last) {
+        file->start_cluster = first_new;
+        file->cur_cluster = 0;
+        file->dirty = true;
+    }
+    return 0;
+}
+
+// Disk sector holding byte 'pos' of the file
+static uint32_t handle_sector(fat16_file_t *file, uint32_t pos) {
+    uint16_t cluster = handle_cluster(file, pos / cluster_bytes());
+    if (!cluster) {
+        return 0;
+    }
+    return cluster_to_sector(cluster) + (pos % cluster_bytes()) / 512;
+}
+
+// Partial-sector write: merge with the existing data unless the sector
+// lies wholly past the old end of file
+static int write_partial(fat16_file_t *file, uint32_t pos, const uint8_t *src, size_t n) {
+    uint8_t buf[512];
+    uint32_t lba = handle_sector(file, pos);
+    if (!lba) {
+        return -1;
+    }
+    if ((pos & ~511u) < file->file_size) {
+        if (blkdev_read(fs.dev, lba, 1, buf) < 0) {
+            return -1;
+        }
+    } else {
+        memset(buf, 0, sizeof(buf));
+    }
+    memcpy(buf + (pos % 512), src, n);
+    bcache_invalidate(fs.dev, lba, 1);
+    return blkdev_write(fs.dev, lba, 1, buf) < 0 ? -1 : 0;
+}
+
+static bool file_is_open(fat16_dentry_t *d, bool writers) {
+    for (int i = 0; i < FAT16_MAX_OPEN; i++) {
+        fat16_file_t *f = &open_files[i];
+        if (f->in_use && f->dentry == d && (!writers || (f->flags & FAT16_O_WRITE))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+fat16_file_t *fat16_open(const char *name, uint8_t flags) {
+    if (!fs.mounted || !(flags & (FAT16_O_READ | FAT16_O_WRITE))) {
+        return NULL;
+    }
+
+    fat16_dentry_t *d = path_lookup(name);
+    if (!d) {
+        if (!(flags & FAT16_O_CREATE) || !(flags & FAT16_O_WRITE) ||
+            fat16_create_file(name) < 0 || !(d = path_lookup(name))) {
+            return NULL;
+        }
+    }
+    if (d->entry.attr & FAT_ATTR_DIRECTORY) {
+        return NULL;
+    }
+
+    // One writer per file: its size in the directory would go stale
+    if (file_is_open(d, !(flags & FAT16_O_WRITE))) {
+        return NULL;
+    }
+    fat16_file_t *file = NULL;
+    for (int i = 0; i < FAT16_MAX_OPEN && !file; i++) {
+        if (!open_files[i].in_use) {
+            file = &open_files[i];
+        }
+    }
+    if (!file) {
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(*file));
+    file->in_use = true;
+    file->flags = flags;
+    file->start_cluster = d->entry.cluster_lo;
+    file->file_size = d->entry.file_size;
+    file->dentry = d;
+    memcpy(file->name, d->short_name, sizeof(file->name));
+
+    if ((flags & FAT16_O_TRUNC) && (flags & FAT16_O_WRITE) && file->start_cluster) {
+        free_chain(file->start_cluster);
+        file->start_cluster = 0;
+        file->file_size = 0;
+        file->dirty = true;
+    }
+    return file;
+}
+
+int fat16_read(fat16_file_t *file, void *buffer, size_t size) {
+    if (!handle_valid(file) || !(file->flags & FAT16_O_READ)) {
+        return -1;
+    }
+    if (file->position >= file->file_size) {
+        return 0;
+    }
+    if (size > file->file_size - file->position) {
+        size = file->file_size - file->position;
+    }
+
+    uint8_t *dst = (uint8_t *)buffer;
+    size_t remaining = size;
+
+    // Leading partial sector, then whole sectors and any tail in one go
+    uint32_t in = file->position % 512;
+    if (in) {
+        uint8_t buf[512];
+        uint32_t lba = handle_sector(file, file->position);
+        if (!lba || blkdev_read(fs.dev, lba, 1, buf) < 0) {
+            return -1;
+        }
+        size_t n = 512 - in < remaining ? 512 - in : remaining;
+        memcpy(dst, buf + in, n);
+        dst += n;
+        remaining -= n;
+        file->position += n;
+    }
+    if (remaining) {
+        uint16_t cluster = handle_cluster(file, file->position / cluster_bytes());
+        if (!cluster || read_chain(cluster, (file->position % cluster_bytes()) / 512, dst,
+                                   remaining) < 0) {
+            return -1;
+        }
+        file->position += remaining;
+    }
+    TRACE(TRACE_FS_READ, size, size);
+    return size;
+}
+
+int fat16_write(fat16_file_t *file, const void *data, size_t size) {
+    if (!handle_valid(file) || !(file->flags & FAT16_O_WRITE)) {
+        return -1;
+    }
+    if (file->flags & FAT16_O_APPEND) {
+        file->position = file->file_size;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (size > 0xFFFFFFFFu - file->position) {
+        return -1;
+    }
+    uint32_t end = file->position + (uint32_t)size;
+    if (handle_reserve(file, end) < 0) {
+        return -1;
+    }
+
+    const uint8_t *src = (const uint8_t *)data;
+    size_t remaining = size;
+    uint32_t pos = file->position;
+    int ret = 0;
+
+    // Leading partial sector
+    if (pos % 512) {
+        size_t n = 512 - pos % 512 < remaining ? 512 - pos % 512 : remaining;
+        ret = write_partial(file, pos, src, n);
+        src += n;
+        pos += n;
+        remaining -= n;
+    }
+
+    // Whole sectors straight from the caller, in runs over consecutive
+    // clusters, released in batches like fat16_write_file()
+    if (ret == 0 && remaining >= 512) {
+        fat16_write_io_t *io = kmalloc(sizeof(fat16_write_io_t));
+        uint16_t cluster = handle_cluster(file, pos / cluster_bytes());
+        if (!io || !cluster) {
+            kfree(io);
+            ret = -1;
+        } else {
+            blk_plug_init(&io->plug);
+            io->count = 0;
+            io->failed = false;
+            uint32_t offset = (pos % cluster_bytes()) / 512;
+            while (remaining >= 512) {
+                if (cluster < 2 || cluster >= FAT16_END_OF_CHAIN) {
+                    io->failed = true;  // Chain shorter than reserved
+                    break;
+                }
+                uint32_t lba = cluster_to_sector(cluster) + offset;
+                uint32_t want = remaining / 512 < FAT16_READ_RUN_MAX ? remaining / 512
+                                                                     : FAT16_READ_RUN_MAX;
+                uint32_t count = next_run(&cluster, &offset, want);
+                write_io_add(io, lba, count, src);
+                src += (size_t)count * 512;
+                pos += count * 512;
+                remaining -= (size_t)count * 512;
+                if (io->count >= FAT16_WRITE_BATCH) {
+                    write_io_finish(io);
+                }
+            }
+            ret = write_io_finish(io);
+            kfree(io);
+        }
+    }
+
+    // Trailing partial sector
+    if (ret == 0 && remaining) {
+        ret = write_partial(file, pos, src, remaining);
+        pos += remaining;
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+    file->position = pos;
+    if (pos > file->file_size) {
+        file->file_size = pos;
+        file->dirty = true;
+    }
+    TRACE(TRACE_FS_WRITE, size, size);
+    return size;
+}
+
+int fat16_seek(fat16_file_t *file, int32_t offset, int whence) {
+    if (!handle_valid(file)) {
+        return -1;
+    }
+    int64_t base;
+    switch (whence) {
+        case FAT16_SEEK_SET: base = 0; break;
+        case FAT16_SEEK_CUR: base = file->position; break;
+        case FAT16_SEEK_END: base = file->file_size; break;
+        default: return -1;
+    }
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > file->file_size) {
+        return -1;
+    }
+    file->position = (uint32_t)pos;
+    return (int)file->position;
+}
+
+int fat16_close(fat16_file_t *file) {
+    if (!handle_valid(file)) {
+        return -1;
+    }
+
+    int ret = 0;
+    if (file->dirty) {
+        // The chain goes to disk before the entry that owns it
+        ret = fat_commit();
+        if (ret == 0) {
+            file->dentry->entry.cluster_lo = file->start_cluster;
+            file->dentry->entry.file_size = file->file_size;
+            ret = dentry_store(file->dentry);
+        }
+    }
+    file->in_use = false;
+    return ret;
+}
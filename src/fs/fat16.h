@@ -70,7 +70,8 @@ typedef struct __attribute__((packed)) {
 // FAT16 filesystem state
 typedef struct {
     bool mounted;
-    int drive;
+    int drive;                  // Block device index
+    struct blkdev *dev;
     
     // BPB values
     uint16_t bytes_per_sector;
@@ -89,29 +90,67 @@ typedef struct {
     uint32_t total_clusters;
 } fat16_fs_t;
 
-// Simple file handle
+// Open file handle. The cursor remembers which cluster holds the current
+// position, so sequential access never walks the chain from the start.
 typedef struct {
     bool in_use;
     uint16_t start_cluster;
     uint32_t file_size;
     uint32_t position;
     char name[13];  // 8.3 format
+
+    uint8_t flags;              // FAT16_O_*
+    bool dirty;                 // Size or start cluster changed
+    struct fat16_dentry *dentry;
+    uint16_t cur_cluster;       // Cluster number cur_index of the chain, or 0
+    uint32_t cur_index;
 } fat16_file_t;
 
-// Function prototypes
+#define FAT16_MAX_OPEN      16
+
+// fat16_open() flags
+#define FAT16_O_READ        0x01
+#define FAT16_O_WRITE       0x02
+#define FAT16_O_CREATE      0x04    // Create the file if it doesn't exist
+#define FAT16_O_TRUNC       0x08    // Discard existing contents
+#define FAT16_O_APPEND      0x10    // Every write goes to the end
+
+#define FAT16_SEEK_SET      0
+#define FAT16_SEEK_CUR      1
+#define FAT16_SEEK_END      2
+
+// Function prototypes. 'drive' is a block device index (blkdev_get()).
 int fat16_mount(int drive);
 void fat16_unmount(void);
 bool fat16_is_mounted(void);
 
-// Directory operations
+// Write the in-memory FAT and cached metadata to the disk. Also done on
+// unmount. Returns 0, or -1 if some of it could not be written.
+int fat16_sync(void);
+uint32_t fat16_free_clusters(void);
+
+// Directory operations. Names are paths from the root ("logs/boot.txt");
+// components may be long names, matched without regard to case, or their
+// 8.3 aliases. Lookups go through a cache of every directory seen so far.
 int fat16_list_root(void (*callback)(const char *name, uint32_t size, bool is_dir));
+int fat16_list_dir(const char *path, void (*callback)(const char *name, uint32_t size, bool is_dir));
 int fat16_find_file(const char *name, fat16_dir_entry_t *entry);
+int fat16_mkdir(const char *path);
 
 // File operations
 int fat16_read_file(const char *name, void *buffer, size_t max_size);
 int fat16_write_file(const char *name, const void *data, size_t size);
 int fat16_create_file(const char *name);
-int fat16_delete_file(const char *name);
+int fat16_delete_file(const char *name);     // Also removes empty directories
+
+// Streaming file access. A file can be open for writing only once; the
+// directory entry is updated on close. Read and write return the bytes
+// transferred (short at end of file) or -1. Seeking past the end fails.
+fat16_file_t *fat16_open(const char *name, uint8_t flags);
+int fat16_read(fat16_file_t *file, void *buffer, size_t size);
+int fat16_write(fat16_file_t *file, const void *data, size_t size);
+int fat16_seek(fat16_file_t *file, int32_t offset, int whence);
+int fat16_close(fat16_file_t *file);
 
 // Get filesystem info
 fat16_fs_t *fat16_get_fs(void);
@@ -12,6 +12,12 @@
 #define GDT_USER_DATA           0x20    // Ring 3 data segment
 #define GDT_TSS                 0x28    // TSS descriptor (16 bytes in long mode)
 
+// Interrupt Stack Table slots. The double fault handler gets its own stack
+// so a kernel stack overflow (which faults while pushing the exception
+// frame) can still be reported instead of triple faulting.
+#define GDT_IST_DOUBLE_FAULT    1
+#define GDT_IST_STACK_SIZE      4096
+
 // Selector with RPL (Requested Privilege Level)
 #define GDT_USER_CODE_RPL3      (GDT_USER_CODE | 3)
 #define GDT_USER_DATA_RPL3      (GDT_USER_DATA | 3)
@@ -84,8 +90,9 @@ typedef struct {
 } __attribute__((packed)) gdt_ptr_t;
 
 // Function declarations
-void gdt_init(void);
-void gdt_set_kernel_stack(uint64_t stack);
+void gdt_init(void);                    // BSP: build and load CPU 0's GDT/TSS
+void gdt_init_ap(uint32_t cpu);         // AP: build and load this CPU's GDT/TSS
+void gdt_set_kernel_stack(uint64_t stack);   // RSP0 of the calling CPU
 tss_t *gdt_get_tss(void);
 
 #endif // GDT_H
@@ -2,6 +2,12 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "graphic.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../sched/spinlock.h"
+#include "../sched/fpu.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
 
 struct limine_framebuffer *framebuffer;
 uint64_t width;
@@ -17,6 +23,24 @@ uint64_t current_cursor_color = 0xFFFFFF; // Default cursor color is white
 uint64_t max_line = 0;
 uint64_t max_column = 0;
 
+// Drawing target: the framebuffer itself until graphic_init_back_buffer()
+// succeeds, then the RAM back buffer
+static uint32_t *draw_target;
+static uint64_t draw_stride;                // Pixels per target row
+
+// Back buffer state. Regions drawn since the last flush are kept as a few
+// disjoint rectangles (x1/y1 exclusive); each flush copies just those rows
+// to the framebuffer.
+typedef struct {
+    int x0, y0, x1, y1;
+} dirty_rect_t;
+
+static uint32_t *back_buffer;
+static dirty_rect_t dirty[GRAPHIC_MAX_DIRTY];
+static int dirty_count;
+static uint64_t last_flush;
+static spinlock_t dirty_lock = SPINLOCK_INIT_NAMED("graphic");
+
 // Simple 8x8 font
 // Note: Using designated initializers with range initializer causes -Woverride-init warnings
 // This is expected behavior - we initialize all to empty, then override specific characters
@@ -136,18 +160,347 @@ void setup_graphic(volatile struct limine_framebuffer_request *framebuffer_reque
     
     width = framebuffer->width;
     height = (framebuffer->height);
+
+    draw_target = (uint32_t *)framebuffer->address;
+    draw_stride = framebuffer->pitch / 4;
+}
+
+// draw_pixel() without dirty tracking, for primitives that mark their
+// bounding box once
+static inline void put_pixel(int x, int y, uint32_t color) {
+    if (x >= 0 && x < (int)width && y >= 0 && y < (int)height) {
+        draw_target[y * draw_stride + x] = color;
+    }
+}
+
+// Store 'count' pixels of 'color' with 8-byte stores
+static void fill_pixels(uint32_t *dst, uint32_t color, uint64_t count) {
+    if (count && ((uintptr_t)dst & 4)) {
+        *dst++ = color;
+        count--;
+    }
+    uint64_t pattern = ((uint64_t)color << 32) | color;
+    uint64_t qwords = count / 2;
+    __asm__ volatile("rep stosq"
+                     : "+D"(dst), "+c"(qwords)
+                     : "a"(pattern)
+                     : "memory");
+    if (count & 1) {
+        *dst = color;
+    }
+}
+
+// Copy 'count' pixels with 8-byte stores (one framebuffer burst per row)
+static void copy_pixels(uint32_t *dst, const uint32_t *src, uint64_t count) {
+    if (count && ((uintptr_t)dst & 4)) {
+        *dst++ = *src++;
+        count--;
+    }
+    uint64_t qwords = count / 2;
+    __asm__ volatile("rep movsq"
+                     : "+D"(dst), "+S"(src), "+c"(qwords)
+                     :
+                     : "memory");
+    if (count & 1) {
+        *dst = *src;
+    }
+}
+
+static inline bool rects_touch(const dirty_rect_t *a, const dirty_rect_t *b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static inline void rect_union(dirty_rect_t *into, const dirty_rect_t *r) {
+    if (r->x0 < into->x0) into->x0 = r->x0;
+    if (r->y0 < into->y0) into->y0 = r->y0;
+    if (r->x1 > into->x1) into->x1 = r->x1;
+    if (r->y1 > into->y1) into->y1 = r->y1;
+}
+
+static inline uint64_t rect_area(const dirty_rect_t *r) {
+    return (uint64_t)(r->x1 - r->x0) * (uint64_t)(r->y1 - r->y0);
+}
+
+// Record that [x0,x1) x [y0,y1) changed in the back buffer
+static void mark_dirty(int x0, int y0, int x1, int y1) {
+    if (!back_buffer) {
+        return;     // Drawing went straight to the framebuffer
+    }
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > (int)width) x1 = (int)width;
+    if (y1 > (int)height) y1 = (int)height;
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    dirty_rect_t r = { x0, y0, x1, y1 };
+    uint64_t flags = spin_lock_irqsave(&dirty_lock);
+
+    // Absorb every rectangle the new one touches. Growing may make it touch
+    // others, so repeat until nothing changes.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i = 0; i < dirty_count; i++) {
+            if (rects_touch(&dirty[i], &r)) {
+                rect_union(&r, &dirty[i]);
+                dirty[i] = dirty[--dirty_count];
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    if (dirty_count < GRAPHIC_MAX_DIRTY) {
+        dirty[dirty_count++] = r;
+    } else {
+        // Full: fold it into whichever rectangle grows the least
+        int best = 0;
+        uint64_t best_growth = (uint64_t)-1;
+        for (int i = 0; i < dirty_count; i++) {
+            dirty_rect_t u = dirty[i];
+            rect_union(&u, &r);
+            uint64_t growth = rect_area(&u) - rect_area(&dirty[i]);
+            if (growth < best_growth) {
+                best_growth = growth;
+                best = i;
+            }
+        }
+        rect_union(&dirty[best], &r);
+    }
+
+    spin_unlock_irqrestore(&dirty_lock, flags);
+}
+
+int graphic_init_back_buffer(void) {
+    if (!framebuffer || back_buffer) {
+        return back_buffer ? 0 : -1;
+    }
+    if (framebuffer->bpp != 32) {
+        DEBUG_WARN("Framebuffer is %u bpp, drawing without a back buffer\n",
+                   (unsigned)framebuffer->bpp);
+        return -1;
+    }
+
+    uint64_t pages = (width * height * 4 + 4095) / 4096;
+    void *phys = physical_alloc_pages(pages);
+    if (!phys) {
+        DEBUG_WARN("No memory for a %lu KB back buffer, drawing directly\n", pages * 4);
+        return -1;
+    }
+
+    // Start from what is on screen now (one slow read of the framebuffer)
+    uint32_t *buf = (uint32_t *)PHYS_TO_HHDM(phys);
+    const uint32_t *fb = (const uint32_t *)framebuffer->address;
+    for (uint64_t y = 0; y < height; y++) {
+        copy_pixels(buf + y * width, fb + y * (framebuffer->pitch / 4), width);
+    }
+
+    back_buffer = buf;
+    draw_stride = width;
+    draw_target = back_buffer;
+    last_flush = timer_get_ticks();
+
+    DEBUG_INFO("Back buffer: %lux%lu, %lu KB\n", width, height, pages * 4);
+    return 0;
+}
+
+void graphic_flush(void) {
+    if (!back_buffer) {
+        return;
+    }
+
+    // Take the pending rectangles and copy them without the lock: anything
+    // drawn meanwhile is marked again and goes out with the next flush
+    dirty_rect_t rects[GRAPHIC_MAX_DIRTY];
+    uint64_t flags = spin_lock_irqsave(&dirty_lock);
+    int count = dirty_count;
+    for (int i = 0; i < count; i++) {
+        rects[i] = dirty[i];
+    }
+    dirty_count = 0;
+    last_flush = timer_get_ticks();
+    spin_unlock_irqrestore(&dirty_lock, flags);
+
+    // Streaming stores keep the framebuffer from evicting the back buffer
+    // and whoever else is using the cache; scalar copies from IRQ context
+    bool simd = kernel_fpu_begin();
+    uint32_t *fb = (uint32_t *)framebuffer->address;
+    uint64_t fb_stride = framebuffer->pitch / 4;
+    for (int i = 0; i < count; i++) {
+        uint64_t w = rects[i].x1 - rects[i].x0;
+        for (int y = rects[i].y0; y < rects[i].y1; y++) {
+            uint32_t *dst = fb + y * fb_stride + rects[i].x0;
+            const uint32_t *src = back_buffer + y * width + rects[i].x0;
+            if (simd) {
+                fpu_copy_nt(dst, src, w * 4);
+            } else {
+                copy_pixels(dst, src, w);
+            }
+        }
+    }
+    if (simd) {
+        kernel_fpu_end();
+    }
+}
+
+void graphic_flush_frame(void) {
+    if (back_buffer && dirty_count && timer_get_ticks() - last_flush >= GRAPHIC_FRAME_MS) {
+        graphic_flush();
+    }
+}
+
+// Glyph rows expanded to pixels. A font row is one byte, so a table of all
+// 256 byte values covers every glyph: opaque text copies the row for its
+// (fg, bg) pair, transparent text blends through the matching mask row.
+typedef struct {
+    uint32_t px[8];
+} glyph_row_t;
+
+typedef struct {
+    uint32_t fg;
+    uint32_t bg;
+    bool valid;
+    uint64_t last_use;
+    glyph_row_t rows[256];
+} glyph_colors_t;
+
+static glyph_row_t glyph_masks[256];
+static bool glyph_masks_ready;
+static glyph_colors_t glyph_cache[GLYPH_CACHE_SLOTS];
+static uint64_t glyph_clock;
+static spinlock_t glyph_lock = SPINLOCK_INIT_NAMED("glyph");
+
+static void glyph_build_masks(void) {
+    for (int b = 0; b < 256; b++) {
+        for (int j = 0; j < 8; j++) {
+            glyph_masks[b].px[j] = (b & (0x80 >> j)) ? 0xFFFFFFFF : 0;
+        }
+    }
+    glyph_masks_ready = true;
+}
+
+// Find or build the expanded rows for (fg, bg), evicting the least
+// recently used pair. Called with glyph_lock held.
+static const glyph_row_t *glyph_colors(uint32_t fg, uint32_t bg) {
+    glyph_colors_t *victim = &glyph_cache[0];
+    for (int i = 0; i < GLYPH_CACHE_SLOTS; i++) {
+        glyph_colors_t *slot = &glyph_cache[i];
+        if (slot->valid && slot->fg == fg && slot->bg == bg) {
+            slot->last_use = ++glyph_clock;
+            return slot->rows;
+        }
+        if (!slot->valid || (victim->valid && slot->last_use < victim->last_use)) {
+            victim = slot;
+        }
+    }
+
+    for (int b = 0; b < 256; b++) {
+        for (int j = 0; j < 8; j++) {
+            victim->rows[b].px[j] = (b & (0x80 >> j)) ? fg : bg;
+        }
+    }
+    victim->fg = fg;
+    victim->bg = bg;
+    victim->valid = true;
+    victim->last_use = ++glyph_clock;
+    return victim->rows;
+}
+
+static inline bool cell_on_screen(int x, int y) {
+    return x >= 0 && y >= 0 && x + 8 <= (int)width && y + 8 <= (int)height;
+}
+
+// Clipped per-pixel fallback for cells crossing the screen edge
+static void draw_cell_clipped(int x, int y, const uint8_t *glyph, uint32_t fg,
+                              uint32_t bg, bool opaque) {
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            if (glyph[i] & (0x80 >> j)) {
+                put_pixel(x + j, y + i, fg);
+            } else if (opaque) {
+                put_pixel(x + j, y + i, bg);
+            }
+        }
+    }
 }
 
 // Function to draw a character on the screen
 void draw_char( int x, int y, char c, uint32_t color) {
     const uint8_t *glyph = font[(unsigned char)c];
-    for (int i = 0; i < 8; i++) {
-        for (int j = 0; j < 8; j++) {
-            if (glyph[i] & (1 << (7 - j))) { // Reverse the bit order
-                ((uint32_t*)framebuffer->address)[(y + i) * (framebuffer->pitch / 4) + (x + j)] = color;
+    if (!cell_on_screen(x, y)) {
+        draw_cell_clipped(x, y, glyph, color, 0, false);
+    } else {
+        if (!glyph_masks_ready) {
+            glyph_build_masks();
+        }
+        uint32_t *row = draw_target + y * draw_stride + x;
+        for (int i = 0; i < 8; i++, row += draw_stride) {
+            const uint32_t *mask = glyph_masks[glyph[i]].px;
+            for (int j = 0; j < 8; j++) {
+                row[j] = (row[j] & ~mask[j]) | (color & mask[j]);
             }
         }
     }
+    mark_dirty(x, y, x + 8, y + 8);
+}
+
+// Opaque cell: one row copy per scanline from the (fg, bg) table
+static void blit_char(int x, int y, char c, const glyph_row_t *rows, uint32_t fg, uint32_t bg) {
+    const uint8_t *glyph = font[(unsigned char)c];
+    if (!cell_on_screen(x, y)) {
+        draw_cell_clipped(x, y, glyph, fg, bg, true);
+        return;
+    }
+    uint32_t *row = draw_target + y * draw_stride + x;
+    for (int i = 0; i < 8; i++, row += draw_stride) {
+        *(glyph_row_t *)row = rows[glyph[i]];
+    }
+}
+
+void draw_char_bg(int x, int y, char c, uint32_t fg, uint32_t bg) {
+    uint64_t flags = spin_lock_irqsave(&glyph_lock);
+    blit_char(x, y, c, glyph_colors(fg, bg), fg, bg);
+    spin_unlock_irqrestore(&glyph_lock, flags);
+    mark_dirty(x, y, x + 8, y + 8);
+}
+
+void draw_string_bg(int x, int y, const char *str, uint32_t fg, uint32_t bg) {
+    int start = x;
+    uint64_t flags = spin_lock_irqsave(&glyph_lock);
+    const glyph_row_t *rows = glyph_colors(fg, bg);
+    while (*str) {
+        blit_char(x, y, *str++, rows, fg, bg);
+        x += 8;
+    }
+    spin_unlock_irqrestore(&glyph_lock, flags);
+    mark_dirty(start, y, x, y + 8);
+}
+
+void graphic_scroll(int x, int y, int w, int h, int dy, uint32_t bg) {
+    // Clip to the screen
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > (int)width) w = (int)width - x;
+    if (y + h > (int)height) h = (int)height - y;
+    if (w <= 0 || h <= 0 || dy <= 0) {
+        return;
+    }
+    if (dy > h) {
+        dy = h;
+    }
+
+    // Rows move up, so copying top to bottom never reads a row already
+    // overwritten
+    uint32_t *dst = draw_target + y * draw_stride + x;
+    for (int i = 0; i < h - dy; i++, dst += draw_stride) {
+        copy_pixels(dst, dst + dy * draw_stride, w);
+    }
+    for (int i = h - dy; i < h; i++, dst += draw_stride) {
+        fill_pixels(dst, bg, w);
+    }
+    mark_dirty(x, y, x + w, y + h);
 }
 
 // Helper function to convert an integer to a string
@@ -354,6 +707,8 @@ void draw_line(int x0, int y0, int x1, int y1, int thickness, uint32_t color) {
     
     // Calculate half thickness (for centering the thickness around the line)
     int half_thickness = thickness / 2;
+    mark_dirty((x0 < x1 ? x0 : x1) - half_thickness, (y0 < y1 ? y0 : y1) - half_thickness,
+               (x0 > x1 ? x0 : x1) + half_thickness + 1, (y0 > y1 ? y0 : y1) + half_thickness + 1);
     
     // Bresenham's line algorithm with thickness
     while (true) {
@@ -363,7 +718,7 @@ void draw_line(int x0, int y0, int x1, int y1, int thickness, uint32_t color) {
                 // Only draw pixels that are within the thickness radius
                 // This creates a more circular brush for better appearance
                 if (i*i + j*j <= half_thickness*half_thickness + half_thickness) {
-                    draw_pixel(x0 + i, y0 + j, color);
+                    put_pixel(x0 + i, y0 + j, color);
                 }
             }
         }
@@ -386,19 +741,26 @@ void draw_line(int x0, int y0, int x1, int y1, int thickness, uint32_t color) {
 }
 
 void clear_screen(uint32_t color) {
-    uint32_t *fb_ptr = (uint32_t *)framebuffer->address;
-    for (uint64_t i = 0; i < (width * height); i++) {
-        fb_ptr[i] = color;
+    for (uint64_t y = 0; y < height; y++) {
+        fill_pixels(draw_target + y * draw_stride, color, width);
     }
+    mark_dirty(0, 0, (int)width, (int)height);
 }
 
 void draw_rect(int x, int y, int w, int h, int thickness, uint32_t color, bool filled) {
     if (filled) {
-        for (int i = 0; i < h; i++) {
-            for (int j = 0; j < w; j++) {
-                draw_pixel(x + j, y + i, color);
-            }
+        // Clip once, then fill whole rows
+        int x0 = x < 0 ? 0 : x;
+        int y0 = y < 0 ? 0 : y;
+        int x1 = x + w > (int)width ? (int)width : x + w;
+        int y1 = y + h > (int)height ? (int)height : y + h;
+        if (x0 >= x1 || y0 >= y1) {
+            return;
+        }
+        for (int i = y0; i < y1; i++) {
+            fill_pixels(draw_target + i * draw_stride + x0, color, x1 - x0);
         }
+        mark_dirty(x0, y0, x1, y1);
     } else {
         for (int t = 0; t < thickness; t++) 
         {
@@ -418,13 +780,15 @@ void draw_circle(int x, int y, int radius, int thickness, uint32_t color, bool f
     int x0 = 0;
     int y0 = radius;
     int d = 1 - radius;
+    int reach = radius + thickness / 2;
+    mark_dirty(x - reach, y - reach, x + reach + 1, y + reach + 1);
 
     if (filled) {
         while (x0 <= y0) {
             for (int i = -y0; i <= y0; i++) {
                 for (int t = -thickness / 2; t <= thickness / 2; t++) {
-                    draw_pixel(x + x0 + t, y + i, color);
-                    draw_pixel(x - x0 + t, y + i, color);
+                    put_pixel(x + x0 + t, y + i, color);
+                    put_pixel(x - x0 + t, y + i, color);
                 }
             }
             if (d < 0) {
@@ -438,14 +802,14 @@ void draw_circle(int x, int y, int radius, int thickness, uint32_t color, bool f
     } else {
         while (x0 <= y0) {
             for (int t = -thickness / 2; t <= thickness / 2; t++) {
-                draw_pixel(x + x0 + t, y + y0, color);
-                draw_pixel(x - x0 + t, y + y0, color);
-                draw_pixel(x + x0 + t, y - y0, color);
-                draw_pixel(x - x0 + t, y - y0, color);
-                draw_pixel(x + y0 + t, y + x0, color);
-                draw_pixel(x - y0 + t, y + x0, color);
-                draw_pixel(x + y0 + t, y - x0, color);
-                draw_pixel(x - y0 + t, y - x0, color);
+                put_pixel(x + x0 + t, y + y0, color);
+                put_pixel(x - x0 + t, y + y0, color);
+                put_pixel(x + x0 + t, y - y0, color);
+                put_pixel(x - x0 + t, y - y0, color);
+                put_pixel(x + y0 + t, y + x0, color);
+                put_pixel(x - y0 + t, y + x0, color);
+                put_pixel(x + y0 + t, y - x0, color);
+                put_pixel(x - y0 + t, y - x0, color);
             }
             if (d < 0) {
                 d += 2 * x0 + 3;
@@ -488,7 +852,8 @@ void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, int thickness
 }
 
 void draw_pixel(int x, int y, uint32_t color) {
-    if (x >= 0 && x < width && y >= 0 && y < height) {
-        ((uint32_t*)framebuffer->address)[y * (framebuffer->pitch / 4) + x] = color;
+    if (x >= 0 && x < (int)width && y >= 0 && y < (int)height) {
+        draw_target[y * draw_stride + x] = color;
+        mark_dirty(x, y, x + 1, y + 1);
     }
 }
\ No newline at end of file
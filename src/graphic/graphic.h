@@ -3,14 +3,38 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <limine.h>
 
+// Until graphic_init_back_buffer() succeeds every primitive draws straight
+// into the framebuffer. Afterwards they draw into a RAM back buffer and
+// record dirty rectangles; graphic_flush() copies those to the (uncached,
+// write-combining) framebuffer in one pass of wide stores.
+#define GRAPHIC_MAX_DIRTY   8       // Dirty rectangles tracked between flushes
+#define GRAPHIC_FRAME_MS    16      // graphic_flush_frame() period (~60 Hz)
+#define GLYPH_CACHE_SLOTS   4       // (fg, bg) pairs kept pre-expanded
+
 // setup
 void setup_graphic(volatile struct limine_framebuffer_request *framebuffer_request);
 
+// Allocate the back buffer (needs the PMM and HHDM). Returns 0, or -1 and
+// keeps drawing directly.
+int graphic_init_back_buffer(void);
+
+// Copy every dirty rectangle to the framebuffer
+void graphic_flush(void);
+
+// Flush only if a frame period has passed since the last flush, for
+// callers producing a stream of output
+void graphic_flush_frame(void);
+
 // string functions
 void draw_char(int x, int y, char c, uint32_t color);
 void draw_string(int x, int y, const char *str, uint32_t color);
+// Opaque text: each 8x8 cell is painted fg on bg from a pre-expanded glyph
+// table, one row copy per scanline
+void draw_char_bg(int x, int y, char c, uint32_t fg, uint32_t bg);
+void draw_string_bg(int x, int y, const char *str, uint32_t fg, uint32_t bg);
 void kprintf(int x,int y, const char *format, ...);
 int kprintf_to_buffer(char *buf, int size, const char *format, ...);
 
@@ -20,6 +44,9 @@ void draw_pixel(int x, int y, uint32_t color);
 void draw_line(int x0, int y0, int x1, int y1, int thickness, uint32_t color);
 void draw_rect(int x, int y, int width, int height, int thickness, uint32_t color, bool filled);
 void draw_circle(int x, int y, int radius, int thickness, uint32_t color, bool filled);
+// Move the region (x, y, w, h) up by dy pixels and fill the uncovered rows
+// with bg
+void graphic_scroll(int x, int y, int w, int h, int dy, uint32_t bg);
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, int thickness, uint32_t color, bool filled);
 
 #endif // GRAPHIC_H
\ No newline at end of file
@@ -170,7 +170,8 @@ irq_handler_0:
     # 40 mod 16 = 8 (misaligned), 40 + 120 = 160, 160 mod 16 = 0 (aligned!)
     # So we should be aligned for the call
     
-    # Call C timer handler
+    # Call C timer handler with the CPU's interrupt frame (for the profiler)
+    leaq 120(%rsp), %rdi
     call timer_irq_handler
     
     # Restore all general purpose registers
@@ -239,6 +240,126 @@ irq_handler_1:
     # Return from interrupt
     iretq
 
+# Generic stub for LAPIC-delivered vectors: save caller-saved state,
+# call the C handler (which sends the EOI) and return. The handler gets the
+# CPU's interrupt frame as its argument and may ignore it.
+.macro IRQ_STUB name, handler
+.global \name
+\name:
+    cld
+    pushq %rax
+    pushq %rbx
+    pushq %rcx
+    pushq %rdx
+    pushq %rsi
+    pushq %rdi
+    pushq %rbp
+    pushq %r8
+    pushq %r9
+    pushq %r10
+    pushq %r11
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    leaq 120(%rsp), %rdi
+    call \handler
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %r11
+    popq %r10
+    popq %r9
+    popq %r8
+    popq %rbp
+    popq %rdi
+    popq %rsi
+    popq %rdx
+    popq %rcx
+    popq %rbx
+    popq %rax
+    iretq
+.endm
+
+# Reschedule IPI (vector 0xF0) - wakes an idle CPU when work is queued on it
+IRQ_STUB irq_handler_resched, smp_reschedule_irq_handler
+
+# LAPIC timer (vector 0xEF) - per-CPU one-shot ticks
+IRQ_STUB irq_handler_lapic_timer, timer_lapic_irq_handler
+
+# Stub for dispatched device vectors: pass a line/slot number to a common
+# C handler (which runs the registered handler and sends the EOI)
+.macro IRQ_DISPATCH_STUB name, num, handler
+.global \name
+\name:
+    cld
+    pushq %rax
+    pushq %rbx
+    pushq %rcx
+    pushq %rdx
+    pushq %rsi
+    pushq %rdi
+    pushq %rbp
+    pushq %r8
+    pushq %r9
+    pushq %r10
+    pushq %r11
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movl $\num, %edi
+    call \handler
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %r11
+    popq %r10
+    popq %r9
+    popq %r8
+    popq %rbp
+    popq %rdi
+    popq %rsi
+    popq %rdx
+    popq %rcx
+    popq %rbx
+    popq %rax
+    iretq
+.endm
+
+# Legacy PIC lines 2-15 (vectors 34-47), handled by irq_legacy_dispatch()
+.irp n, 2,3,4,5,6,7,8,9,10,11,12,13,14,15
+IRQ_DISPATCH_STUB irq_legacy_stub_\n, \n, irq_legacy_dispatch
+.endr
+
+# MSI vectors (IRQ_MSI_VECTOR_BASE + n), handled by irq_msi_dispatch()
+.irp n, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+IRQ_DISPATCH_STUB irq_msi_stub_\n, \n, irq_msi_dispatch
+.endr
+
+# Address tables for the stubs above, indexed by line / MSI slot
+.section .rodata
+.balign 8
+.global irq_legacy_stubs
+irq_legacy_stubs:
+    .quad 0, 0
+.irp n, 2,3,4,5,6,7,8,9,10,11,12,13,14,15
+    .quad irq_legacy_stub_\n
+.endr
+.global irq_msi_stubs
+irq_msi_stubs:
+.irp n, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+    .quad irq_msi_stub_\n
+.endr
+.text
+
+# LAPIC spurious interrupt (vector 0xFF) - no EOI required
+.global irq_handler_spurious
+irq_handler_spurious:
+    iretq
+
 # Mark stack as non-executable to suppress linker warning
 .section .note.GNU-stack, "", @progbits
 
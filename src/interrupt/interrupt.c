@@ -2,6 +2,8 @@
 #include "../debug/debug.h"
 #include "../memory/vmm.h"
 #include "../gdt/gdt.h"
+#include "../sched/kstack.h"
+#include "../sched/fpu.h"
 #include <string.h>
 
 // IDT with 256 entries
@@ -43,6 +45,7 @@ void interrupt_init(void) {
     idt_set_gate(EXCEPTION_INVALID_OPCODE, (uint64_t)exception_handler_6, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
     idt_set_gate(EXCEPTION_DEVICE_NOT_AVAILABLE, (uint64_t)exception_handler_7, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
     idt_set_gate(EXCEPTION_DOUBLE_FAULT, (uint64_t)exception_handler_8, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
+    idt[EXCEPTION_DOUBLE_FAULT].ist = GDT_IST_DOUBLE_FAULT;
     idt_set_gate(EXCEPTION_INVALID_TSS, (uint64_t)exception_handler_10, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
     idt_set_gate(EXCEPTION_SEGMENT_NOT_PRESENT, (uint64_t)exception_handler_11, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
     idt_set_gate(EXCEPTION_STACK_FAULT, (uint64_t)exception_handler_12, GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
@@ -66,6 +69,18 @@ void interrupt_init(void) {
     DEBUG_INFO("Interrupt system initialization completed\n");
 }
 
+void interrupt_load(void) {
+    // All CPUs share one IDT; APs just need IDTR pointed at it
+    asm volatile("lidt %0" :: "m"(idt_ptr));
+}
+
+// Name the thread whose stack ran into a guard page
+static void report_stack_overflow(uint64_t addr) {
+    thread_t *t = thread_current();
+    DEBUG_ERROR("Kernel stack overflow at 0x%lx in thread '%s' (TID=%d)\n",
+                addr, t ? t->name : "?", t ? t->tid : 0);
+}
+
 // Page fault handler
 void page_fault_handler(interrupt_frame_with_error_t *frame) {
     // Get the faulting address from CR2
@@ -80,6 +95,10 @@ void page_fault_handler(interrupt_frame_with_error_t *frame) {
     DEBUG_ERROR("  RIP: 0x%lx\n", frame->rip);
     DEBUG_ERROR("  RSP: 0x%lx\n", frame->rsp);
     
+    if (kstack_is_guard(fault_addr)) {
+        report_stack_overflow(fault_addr);
+    }
+    
     // Decode error code
     DEBUG_ERROR("  Fault Type:\n");
     if (error_code & PAGE_FAULT_PRESENT) {
@@ -154,6 +173,12 @@ bool handle_mmio_page_fault(uint64_t fault_addr, uint64_t error_code) {
 
 // Generic exception handler (called from assembly stubs)
 void generic_exception_handler(int exception_num, interrupt_frame_t *frame) {
+    // CR0.TS trap: a kernel FPU section touching its registers again after
+    // being switched out
+    if (exception_num == EXCEPTION_DEVICE_NOT_AVAILABLE && fpu_handle_nm()) {
+        return;
+    }
+    
     DEBUG_ERROR("Exception %d occurred!\n", exception_num);
     DEBUG_ERROR("  RIP: 0x%lx\n", frame->rip);
     DEBUG_ERROR("  CS: 0x%lx\n", frame->cs);
@@ -176,6 +201,17 @@ void generic_exception_handler_with_error(int exception_num, interrupt_frame_wit
         return;
     }
     
+    // Overflowing a kernel stack faults again while pushing the page fault
+    // frame, which escalates to a double fault (running on its IST stack).
+    // CR2 still holds the guard page address from the failed push.
+    if (exception_num == EXCEPTION_DOUBLE_FAULT) {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (kstack_is_guard(cr2)) {
+            report_stack_overflow(cr2);
+        }
+    }
+    
     DEBUG_ERROR("Exception %d occurred!\n", exception_num);
     DEBUG_ERROR("  Error Code: 0x%lx\n", frame->error_code);
     DEBUG_ERROR("  RIP: 0x%lx\n", frame->rip);
@@ -78,6 +78,7 @@ typedef struct interrupt_frame_with_error {
 
 // Function declarations
 void interrupt_init(void);
+void interrupt_load(void);  // Load the shared IDT on an application processor
 void idt_set_gate(int num, uint64_t handler, uint16_t selector, uint8_t type_attr);
 void page_fault_handler(interrupt_frame_with_error_t *frame);
 bool handle_mmio_page_fault(uint64_t fault_addr, uint64_t error_code);
@@ -108,4 +109,9 @@ extern void exception_handler_19(void);  // SIMD Floating Point
 extern void irq_handler_0(void);  // Timer (IRQ0, vector 32)
 extern void irq_handler_1(void);  // Keyboard (IRQ1, vector 33)
 
+// Local APIC vectors
+extern void irq_handler_resched(void);   // Reschedule IPI (vector 0xF0)
+extern void irq_handler_lapic_timer(void); // LAPIC timer (vector 0xEF)
+extern void irq_handler_spurious(void);  // LAPIC spurious (vector 0xFF)
+
 #endif // INTERRUPT_H
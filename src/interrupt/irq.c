@@ -0,0 +1,102 @@
+#include "irq.h"
+#include "interrupt.h"
+#include "lapic.h"
+#include "../gdt/gdt.h"
+#include "../timer/timer.h"
+#include "../sched/spinlock.h"
+#include "../debug/debug.h"
+
+typedef struct {
+    irq_handler_t handler;
+    void *ctx;
+    uint64_t count;
+} irq_slot_t;
+
+// Stub address tables from exception_stubs.s
+extern const uint64_t irq_legacy_stubs[16];
+extern const uint64_t irq_msi_stubs[IRQ_MSI_VECTORS];
+
+static irq_slot_t legacy_slots[16];
+static irq_slot_t msi_slots[IRQ_MSI_VECTORS];
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+int irq_register_legacy(uint8_t irq, irq_handler_t handler, void *ctx) {
+    if (irq < IRQ_LEGACY_FIRST || irq > IRQ_LEGACY_LAST || !handler) {
+        return -1;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    if (legacy_slots[irq].handler) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        DEBUG_ERROR("irq: line %d already in use\n", irq);
+        return -1;
+    }
+    legacy_slots[irq].ctx = ctx;
+    legacy_slots[irq].handler = handler;
+    spin_unlock_irqrestore(&irq_lock, flags);
+    
+    idt_set_gate(TIMER_VECTOR + irq, irq_legacy_stubs[irq], GDT_KERNEL_CODE,
+                 IDT_TYPE_INTERRUPT_GATE);
+    
+    // Lines 8-15 arrive through the slave PIC's cascade on line 2
+    if (irq >= 8) {
+        pic_clear_mask(2);
+    }
+    pic_clear_mask(irq);
+    
+    DEBUG_INFO("irq: PIC line %d -> vector %d\n", irq, TIMER_VECTOR + irq);
+    return 0;
+}
+
+int irq_alloc_msi_vector(irq_handler_t handler, void *ctx) {
+    if (!handler) {
+        return -1;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    for (int slot = 0; slot < IRQ_MSI_VECTORS; slot++) {
+        if (!msi_slots[slot].handler) {
+            msi_slots[slot].ctx = ctx;
+            msi_slots[slot].handler = handler;
+            spin_unlock_irqrestore(&irq_lock, flags);
+            
+            idt_set_gate(IRQ_MSI_VECTOR_BASE + slot, irq_msi_stubs[slot], GDT_KERNEL_CODE,
+                         IDT_TYPE_INTERRUPT_GATE);
+            return IRQ_MSI_VECTOR_BASE + slot;
+        }
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+    
+    DEBUG_ERROR("irq: out of MSI vectors\n");
+    return -1;
+}
+
+void irq_free_msi_vector(int vector) {
+    int slot = vector - IRQ_MSI_VECTOR_BASE;
+    if (slot < 0 || slot >= IRQ_MSI_VECTORS) {
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    msi_slots[slot].handler = NULL;
+    msi_slots[slot].ctx = NULL;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_legacy_dispatch(uint32_t irq) {
+    irq_slot_t *slot = &legacy_slots[irq];
+    if (slot->handler) {
+        slot->count++;
+        slot->handler(slot->ctx);
+    }
+    pic_send_eoi((uint8_t)irq);
+}
+
+void irq_msi_dispatch(uint32_t slot) {
+    irq_slot_t *s = &msi_slots[slot];
+    if (s->handler) {
+        s->count++;
+        s->handler(s->ctx);
+    }
+    lapic_eoi();
+}
@@ -0,0 +1,39 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Device interrupt routing. Drivers register a handler for either a legacy
+// PIC line (PCI INTx, ISA devices) or a freshly allocated MSI vector; the
+// common dispatch code runs the handler and sends the right EOI.
+
+// Vectors handed out by irq_alloc_msi_vector()
+#define IRQ_MSI_VECTOR_BASE     0x50
+#define IRQ_MSI_VECTORS         32
+
+// PIC lines that can be registered (0 = PIT and 1 = keyboard have their own
+// stubs, 2 is the slave PIC cascade)
+#define IRQ_LEGACY_FIRST        3
+#define IRQ_LEGACY_LAST         15
+
+typedef void (*irq_handler_t)(void *ctx);
+
+// Install 'handler' on PIC line 'irq' and unmask it. Level-triggered
+// (PCI) lines must be quiesced by the handler before it returns.
+// Returns 0 on success, -1 if the line is invalid or already taken.
+int irq_register_legacy(uint8_t irq, irq_handler_t handler, void *ctx);
+
+// Allocate an MSI vector and install 'handler' on it. Returns the vector
+// to program into the device, or -1 if none are left.
+int irq_alloc_msi_vector(irq_handler_t handler, void *ctx);
+
+// Give back a vector from irq_alloc_msi_vector() (the device must no
+// longer be able to raise it)
+void irq_free_msi_vector(int vector);
+
+// Called from the assembly stubs
+void irq_legacy_dispatch(uint32_t irq);
+void irq_msi_dispatch(uint32_t slot);
+
+#endif // IRQ_H
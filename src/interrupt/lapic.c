@@ -0,0 +1,80 @@
+#include "lapic.h"
+#include "interrupt.h"
+#include "../memory/vmm.h"
+#include "../gdt/gdt.h"
+#include "../debug/debug.h"
+
+// Virtual address of the LAPIC register page (same physical page on every CPU,
+// each CPU sees its own APIC there)
+static volatile uint8_t *lapic_base = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+void lapic_init(void) {
+    if (!lapic_base) {
+        uint64_t phys = rdmsr(IA32_APIC_BASE_MSR) & IA32_APIC_BASE_MASK;
+        lapic_base = (volatile uint8_t *)vmm_map_mmio(phys, PAGE_SIZE);
+        if (!lapic_base) {
+            DEBUG_ERROR("LAPIC: failed to map registers at 0x%lx\n", phys);
+            return;
+        }
+
+        idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint64_t)irq_handler_spurious,
+                     GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
+
+        DEBUG_INFO("LAPIC: registers at phys 0x%lx, version 0x%x\n",
+                   phys, lapic_read(LAPIC_REG_VERSION) & 0xFF);
+    }
+
+    // Accept every priority class and software-enable the APIC
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+bool lapic_is_ready(void) {
+    return lapic_base != NULL;
+}
+
+uint32_t lapic_get_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    // Wait for any previous IPI from this CPU to be accepted
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+
+    lapic_write(LAPIC_REG_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_timer_setup(bool tsc_deadline) {
+    if (tsc_deadline) {
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_LVT_TSC_DEADLINE);
+        // The LVT write must land before the first IA32_TSC_DEADLINE write
+        __asm__ volatile("mfence" ::: "memory");
+        return;
+    }
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);   // One-shot, unmasked
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+}
+
+void lapic_timer_arm(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_remaining(void) {
+    return lapic_read(LAPIC_REG_TIMER_CURRENT);
+}
@@ -0,0 +1,77 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// IA32_APIC_BASE MSR: physical base of the local APIC registers
+#define IA32_APIC_BASE_MSR      0x1B
+#define IA32_APIC_BASE_MASK     0x000FFFFFFFFFF000ULL
+
+// Local APIC register offsets (xAPIC, memory mapped)
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_VERSION       0x030
+#define LAPIC_REG_TPR           0x080   // Task Priority
+#define LAPIC_REG_EOI           0x0B0
+#define LAPIC_REG_SVR           0x0F0   // Spurious Interrupt Vector
+#define LAPIC_REG_ICR_LOW       0x300   // Interrupt Command (low dword, write last)
+#define LAPIC_REG_ICR_HIGH      0x310   // Interrupt Command (destination)
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+// Register bits
+#define LAPIC_SVR_ENABLE        (1 << 8)
+#define LAPIC_ICR_PENDING       (1 << 12)   // Delivery status
+#define LAPIC_ICR_ASSERT        (1 << 14)
+#define LAPIC_LVT_MASKED        (1 << 16)
+#define LAPIC_LVT_TSC_DEADLINE  (2 << 17)
+#define LAPIC_TIMER_DIVIDE_16   0x3
+
+// Local APIC timer vector (one-shot ticks, see timer.c)
+#define LAPIC_TIMER_VECTOR      0xEF
+
+// Spurious interrupts land here and need no EOI
+#define LAPIC_SPURIOUS_VECTOR   0xFF
+
+// MSR access
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Enable the local APIC of the calling CPU. The first call (on the BSP)
+// also maps the register page and installs the spurious vector.
+void lapic_init(void);
+
+// True once the register page is mapped
+bool lapic_is_ready(void);
+
+// APIC ID of the calling CPU
+uint32_t lapic_get_id(void);
+
+// Signal end of interrupt for LAPIC-delivered vectors (IPIs, LAPIC timer)
+void lapic_eoi(void);
+
+// Send a fixed-delivery IPI with 'vector' to the CPU with APIC ID 'lapic_id'
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+// ---- Local APIC timer (one-shot mode, divide-by-16) ----
+
+// Put the calling CPU's timer on LAPIC_TIMER_VECTOR, either in one-shot mode
+// or in TSC-deadline mode (armed through IA32_TSC_DEADLINE instead)
+void lapic_timer_setup(bool tsc_deadline);
+
+// Start a one-shot countdown of 'count' timer ticks (0 stops the timer)
+void lapic_timer_arm(uint32_t count);
+
+// Remaining count of the current countdown
+uint32_t lapic_timer_remaining(void);
+
+#endif // LAPIC_H
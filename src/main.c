@@ -7,22 +7,33 @@
 #include "memory.h"
 #include "pmm.h"
 #include "memory/vmm.h"
+#include "memory/numa.h"
 #include "graphic.h"
 #include "pci/pci.h"
 #include "network/network.h"
 #include "network/socket.h"
 #include "network/dhcp.h"
 #include "debug/debug.h"
+#include "debug/trace.h"
 #include "interrupt/interrupt.h"
 #include "timer/timer.h"
 #include "drivers/keyboard.h"
 #include "drivers/ata.h"
+#include "drivers/ahci.h"
+#include "drivers/virtio_blk.h"
+#include "drivers/blkdev.h"
 #include "shell/shell.h"
 #include "fs/fat16.h"
+#include "fs/bcache.h"
 #include "acpi/acpi.h"
+#include "boot/boot.h"
 #include "gdt/gdt.h"
 #include "sched/scheduler.h"
 #include "sched/thread.h"
+#include "sched/workqueue.h"
+#include "sched/taskpool.h"
+#include "sched/fpu.h"
+#include "smp/smp.h"
 
 // Set the base revision to 3, this is recommended as this is the latest
 // base revision described by the Limine boot protocol specification.
@@ -54,6 +65,26 @@ static volatile struct limine_hhdm_request hhdm_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST,
+    .revision = 0,
+    .flags = 0      // xAPIC mode
+};
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0
+};
+
+// The kernel ELF itself, for symbolizing profiler samples
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_executable_file_request executable_file_request = {
+    .id = LIMINE_EXECUTABLE_FILE_REQUEST,
+    .revision = 0
+};
+
 // Finally, define the start and end markers for the Limine requests.
 // These can also be moved anywhere, to any .c file, as seen fit.
 
@@ -85,6 +116,100 @@ void srand(unsigned int seed)
     next = seed;
 }
 
+// ============== Boot Tasks ==============
+// Subsystems brought up by their own threads once the scheduler runs (see
+// boot/boot.h); the table below orders them.
+
+static int boot_pci(void) {
+    pci_init();
+    // Print discovered PCI devices to debug console only
+    pci_print_devices(0, 0);
+    return 0;
+}
+
+static int boot_network(void) {
+    if (network_init() != 0) {
+        DEBUG_ERROR("Network stack initialization failed, continuing without network\n");
+        return -1;
+    }
+
+    network_interface_t *eth_iface = network_get_interface(1); // eth0 interface
+    if (eth_iface) {
+        DEBUG_INFO("Network: %s, MAC %x:%x:%x:%x:%x:%x\n", eth_iface->name,
+                   eth_iface->mac_address[0], eth_iface->mac_address[1],
+                   eth_iface->mac_address[2], eth_iface->mac_address[3],
+                   eth_iface->mac_address[4], eth_iface->mac_address[5]);
+    } else {
+        DEBUG_INFO("Network: no ethernet interface, loopback only\n");
+    }
+    return 0;
+}
+
+// Address configuration isn't needed to reach the shell
+static int boot_dhcp(void) {
+    network_interface_t *eth_iface = network_get_interface(1);
+    if (!eth_iface) {
+        return 0;
+    }
+    if (dhcp_client_init(eth_iface) != 0) {
+        DEBUG_ERROR("Failed to initialize DHCP client\n");
+        return -1;
+    }
+    dhcp_client_t *dhcp_client = dhcp_get_client(eth_iface);
+    if (!dhcp_client || dhcp_client_start(dhcp_client) != 0) {
+        DEBUG_ERROR("Failed to start DHCP client\n");
+        return -1;
+    }
+    DEBUG_INFO("DHCP DISCOVER sent on %s\n", eth_iface->name);
+    return 0;
+}
+
+static int boot_bcache(void) {
+    // Block buffer cache (and its write-back thread) for the filesystems
+    return bcache_init();
+}
+
+static int boot_ata(void) {
+    ata_init();
+    return 0;
+}
+
+static int boot_ahci(void) {
+    ahci_init();
+    return 0;
+}
+
+static int boot_virtio_blk(void) {
+    virtio_blk_init();
+    return 0;
+}
+
+static int boot_fat16(void) {
+    // Mount FAT16 filesystem (first block device that has one)
+    for (int i = 0; i < blkdev_count(); i++) {
+        if (fat16_mount(i) == 0) {
+            DEBUG_INFO("FAT16 filesystem mounted on drive %d (%s)\n", i, blkdev_get(i)->name);
+            return 0;
+        }
+    }
+    DEBUG_INFO("No FAT16 filesystem found\n");
+    return 0;
+}
+
+// The disk drivers register block devices in the order they run, so they
+// are chained to keep drive numbers stable from boot to boot; the chain
+// still overlaps with the network bring-up.
+static const boot_task_desc_t boot_tasks[] = {
+    { "pci",        boot_pci,        { NULL },                   0 },
+    { "network",    boot_network,    { "pci" },                  0 },
+    { "dhcp",       boot_dhcp,       { "network" },              BOOT_TASK_DEFERRED },
+    { "bcache",     boot_bcache,     { NULL },                   0 },
+    { "ata",        boot_ata,        { "pci" },                  0 },
+    { "ahci",       boot_ahci,       { "ata" },                  0 },
+    { "virtio-blk", boot_virtio_blk, { "ahci" },                 0 },
+    { "fat16",      boot_fat16,      { "bcache", "virtio-blk" }, 0 },
+};
+
 // ============== Thread Entry Functions ==============
 
 // Shell thread - runs the interactive shell
@@ -92,6 +217,8 @@ static void shell_thread_entry(void *arg) {
     (void)arg;
     DEBUG_INFO("Shell thread started\n");
     shell_init();
+    // Non-critical boot tasks wait until the shell is up
+    boot_release_deferred();
     shell_run();  // This runs forever
 }
 
@@ -141,10 +268,37 @@ static void cpu_worker_entry(void *arg) {
     }
 }
 
+// Demo workers. cpu_hog never yields, so with one CPU nothing else on its
+// run queue gets back in; they only start once every boot task is done
+// rather than competing with driver probes that sleep on I/O.
+static void start_demo_threads(void) {
+    // Spread over the least loaded CPUs
+    // Create I/O-bound worker threads (should maintain priority)
+    thread_t *worker1 = thread_create("worker1", worker_thread_entry, (void*)1);
+    thread_t *worker2 = thread_create("worker2", worker_thread_entry, (void*)2);
+    if (worker1) {
+        scheduler_add(worker1);
+        DEBUG_INFO("Created worker1 thread (TID=%d)\n", worker1->tid);
+    }
+    if (worker2) {
+        scheduler_add(worker2);
+        DEBUG_INFO("Created worker2 thread (TID=%d)\n", worker2->tid);
+    }
+    
+    // Create CPU-bound worker (should be demoted over time)
+    thread_t *cpu_worker = thread_create("cpu_hog", cpu_worker_entry, (void*)1);
+    if (cpu_worker) {
+        scheduler_add(cpu_worker);
+        DEBUG_INFO("Created cpu_hog thread (TID=%d)\n", cpu_worker->tid);
+    }
+}
+
 // The following will be our kernel's entry point.
 // If renaming kmain() to something else, make sure to change the
 // linker script accordingly.
 void kmain(void) {
+    boot_mark("kmain");
+
     // Ensure the bootloader actually understands our base revision (see spec).
     if (LIMINE_BASE_REVISION_SUPPORTED == false) {
         hcf();
@@ -171,25 +325,36 @@ void kmain(void) {
     // Initialize debug console (QEMU debugcon) - simple test first
     debug_init();
     
+    if (executable_file_request.response && executable_file_request.response->executable_file) {
+        struct limine_file *kernel = executable_file_request.response->executable_file;
+        trace_set_kernel_file(kernel->address, kernel->size);
+    }
+    
+    // Initialize HHDM (Higher Half Direct Map) from Limine
+    // The PMM's buddy free lists live in free pages, reached through the HHDM
+    if (hhdm_request.response == NULL) {
+        kprintf(10, 125, "ERROR: HHDM not available from bootloader");
+        DEBUG_ERROR("HHDM response is NULL - cannot continue\n");
+        hcf();
+    }
+    vmm_set_hhdm_offset(hhdm_request.response->offset);
+    kprintf(10, 125, "HHDM initialized successfully");
+    
     // Initialize physical memory manager
-    if (physical_memory_init(memmap_request.response)) {
+    if (physical_memory_init(memmap_request.response, PMM_BACKEND_BUDDY)) {
         kprintf(10, 110, "Physical memory manager initialized successfully");
         
-        // Initialize HHDM (Higher Half Direct Map) from Limine
-        if (hhdm_request.response == NULL) {
-            kprintf(10, 125, "ERROR: HHDM not available from bootloader");
-            DEBUG_ERROR("HHDM response is NULL - cannot continue\n");
-            hcf();
-        }
-        vmm_set_hhdm_offset(hhdm_request.response->offset);
-        kprintf(10, 125, "HHDM initialized successfully");
-        
         // Initialize virtual memory manager
         kprintf(10, 140, "Initializing virtual memory manager...");
         DEBUG_INFO("Starting virtual memory manager initialization\n");
         if (vmm_init() == 0) {
             kprintf(10, 155, "Virtual memory manager initialized successfully");
             DEBUG_INFO("Virtual memory manager initialization completed\n");
+            
+            // ACPI tables are mapped on demand through the VMM
+            if (rsdp_request.response) {
+                acpi_set_rsdp((uint64_t)rsdp_request.response->address);
+            }
         } else {
             kprintf(10, 155, "ERROR: Failed to initialize virtual memory manager");
             DEBUG_ERROR("Virtual memory manager initialization failed\n");
@@ -197,18 +362,32 @@ void kmain(void) {
         }
         
         // Initialize GDT and TSS first (before interrupts need our code segment)
+        boot_mark("memory");
+        
         kprintf(10, 155, "Initializing GDT and TSS...");
         DEBUG_INFO("Starting GDT/TSS initialization\n");
         gdt_init();
+        smp_bsp_init();
         kprintf(10, 170, "GDT/TSS initialized successfully");
         DEBUG_INFO("GDT/TSS initialization completed\n");
         
+        // NUMA topology from the SRAT/SLIT; the PMM then splits its zones per
+        // node. Node lookups read the CPU index through GS, so this has to
+        // follow smp_bsp_init().
+        if (numa_init() > 1) {
+            physical_memory_init_numa();
+        }
+        
         // Initialize interrupt system (uses our GDT's code segment)
         kprintf(10, 185, "Initializing interrupt system...");
         DEBUG_INFO("Starting interrupt system initialization\n");
         interrupt_init();
         kprintf(10, 200, "Interrupt system initialized successfully");
         DEBUG_INFO("Interrupt system initialization completed\n");
+        boot_mark("interrupts");
+        
+        // SIMD save/restore mode; APs copy it when they come up
+        fpu_init();
         
         // Initialize timer system (PIT + PIC)
         kprintf(10, 215, "Initializing timer system...");
@@ -222,6 +401,19 @@ void kmain(void) {
         kprintf(10, 260, "Scheduler initialized successfully");
         DEBUG_INFO("Scheduler initialization completed\n");
         
+        // Bring up the application processors (each gets its own run queue)
+        smp_init(mp_request.response);
+        kprintf(10, 275, "SMP: %d CPUs started", (int)smp_cpu_count());
+        boot_mark("smp");
+        
+        // HPET clock and per-CPU LAPIC one-shot ticks (PIT stays as fallback)
+        if (timer_init_highres() == 0) {
+            kprintf(10, 290, "Timers: %s clock, tickless idle", timer_clock_name());
+        } else {
+            kprintf(10, 290, "Timers: %s clock, PIT periodic tick", timer_clock_name());
+        }
+        boot_mark("timers");
+        
         // Test physical memory allocation
         void *page1 = physical_alloc_page();
         void *page2 = physical_alloc_page();
@@ -340,120 +532,7 @@ void kmain(void) {
     //     }
     // }
 
-    // Initialize and demo the network stack
-    kprintf(10, 525, "=== Network Stack Demo ===");
-    
-    // Initialize PCI subsystem
-    kprintf(10, 540, "Initializing PCI subsystem...");
-    DEBUG_INFO("Starting PCI subsystem initialization\n");
-    pci_init();
-    DEBUG_INFO("PCI subsystem initialization completed\n");
-    kprintf(10, 555, "PCI bus scan completed");
-    
-    // Print discovered PCI devices to debug console only
-    pci_print_devices(0, 0); // Parameters are ignored now since we use debug console
-    
-    // Initialize the network stack
-    kprintf(10, 570, "Initializing network stack...");
-    DEBUG_INFO("Starting network stack initialization\n");
-    
-    if (network_init() == 0) {
-        kprintf(10, 585, "Network stack initialized successfully");
-        DEBUG_INFO("Network stack initialization completed successfully\n");
-        kprintf(10, 600, "Checking network interfaces...");
-        
-        // Real Network Demo - Attempt actual DHCP
-        network_interface_t *eth_iface = network_get_interface(1); // eth0 interface
-        if (eth_iface) {
-            kprintf(10, 585, "Found ethernet interface: %s", eth_iface->name);
-            kprintf(10, 600, "MAC Address: %x:%x:%x:%x:%x:%x", 
-                   eth_iface->mac_address[0], eth_iface->mac_address[1], 
-                   eth_iface->mac_address[2], eth_iface->mac_address[3],
-                   eth_iface->mac_address[4], eth_iface->mac_address[5]);
-            
-            // Check if this is a real E1000 interface or stub
-            if (eth_iface->mac_address[0] == 0x52 && eth_iface->mac_address[1] == 0x54) {
-                kprintf(10, 615, "E1000 hardware driver active");
-                kprintf(10, 630, "Real network hardware detected");
-            } else {
-                kprintf(10, 615, "Using stub ethernet interface");
-                kprintf(10, 600, "E1000 MMIO now enabled (virtual memory active)");
-            }
-            
-            // Initialize DHCP client for real network communication
-            kprintf(10, 615, "Initializing DHCP client...");
-            if (dhcp_client_init(eth_iface) == 0) {
-                dhcp_client_t *dhcp_client = dhcp_get_client(eth_iface);
-                
-                if (dhcp_client) {
-                    kprintf(10, 630, "DHCP client initialized successfully");
-                    kprintf(10, 645, "Sending DHCP DISCOVER to network...");
-                    
-                    // Start real DHCP process (would send actual packets)
-                    if (dhcp_client_start(dhcp_client) == 0) {
-                        kprintf(10, 660, "DHCP DISCOVER packet prepared");
-                        kprintf(10, 675, "Network demo completed successfully");
-                        
-                        // Show current interface status
-                        if (eth_iface->ip_address == 0) {
-                            kprintf(10, 690, "Interface status: No IP address assigned");
-                            kprintf(10, 705, "IP: 0.0.0.0 (waiting for DHCP response)");
-                        } else {
-                            kprintf(10, 690, "Interface status: IP address configured");
-                            kprintf(10, 705, "IP: %d.%d.%d.%d", 
-                                   (eth_iface->ip_address >> 24) & 0xFF,
-                                   (eth_iface->ip_address >> 16) & 0xFF,
-                                   (eth_iface->ip_address >> 8) & 0xFF,
-                                   eth_iface->ip_address & 0xFF);
-                        }
-                        
-                        kprintf(10, 720, "Real network packets transmitted to QEMU");
-                    } else {
-                        kprintf(10, 645, "Failed to start DHCP client");
-                    }
-                } else {
-                    kprintf(10, 645, "Failed to get DHCP client instance");
-                }
-            } else {
-                kprintf(10, 630, "Failed to initialize DHCP client");
-            }
-        } else {
-            kprintf(10, 555, "No ethernet interface found");
-            
-            // Show loopback interface instead
-            network_interface_t *lo_iface = network_get_interface(0); // loopback
-            if (lo_iface) {
-                kprintf(10, 570, "Using loopback interface: %s", lo_iface->name);
-                kprintf(10, 585, "IP: %d.%d.%d.%d", 
-                       (lo_iface->ip_address >> 24) & 0xFF,
-                       (lo_iface->ip_address >> 16) & 0xFF,
-                       (lo_iface->ip_address >> 8) & 0xFF,
-                       lo_iface->ip_address & 0xFF);
-                kprintf(10, 600, "Status: Active (software-only)");
-            } else {
-                kprintf(10, 570, "No network interfaces available");
-            }
-        }
-        
-        kprintf(10, 735, "Network initialization completed");
-    } else {
-        kprintf(10, 525, "ERROR: Network stack initialization failed!");
-        kprintf(10, 540, "System continuing without network support");
-    }
-    
-    // Initialize ATA driver
-    DEBUG_INFO("Initializing ATA driver...\n");
-    ata_init();
-    
-    // Mount FAT16 filesystem (try both drives)
-    DEBUG_INFO("Attempting to mount FAT16...\n");
-    if (fat16_mount(0) == 0) {
-        DEBUG_INFO("FAT16 filesystem mounted on drive 0\n");
-    } else if (fat16_mount(1) == 0) {
-        DEBUG_INFO("FAT16 filesystem mounted on drive 1\n");
-    } else {
-        DEBUG_INFO("No FAT16 filesystem found\n");
-    }
+    boot_mark("graphics");
     
     // Initialize ACPI
     DEBUG_INFO("Initializing ACPI...\n");
@@ -469,34 +548,46 @@ void kmain(void) {
     kprintf(10, 765, "Creating kernel threads...");
     DEBUG_INFO("Creating kernel threads...\n");
     
-    // Create shell thread (high priority for responsiveness)
-    thread_t *shell_thread = thread_create_priority("shell", shell_thread_entry, NULL, PRIORITY_HIGH);
-    if (shell_thread) {
-        scheduler_add(shell_thread);
-        DEBUG_INFO("Created shell thread (TID=%d, priority=HIGH)\n", shell_thread->tid);
+    // Per-CPU deferred-work threads (interrupt bottom halves, network RX)
+    if (workqueue_init() != 0) {
+        DEBUG_ERROR("Failed to start deferred-work threads\n");
     }
     
-    // Create I/O-bound worker threads (should maintain priority)
-    thread_t *worker1 = thread_create("worker1", worker_thread_entry, (void*)1);
-    thread_t *worker2 = thread_create("worker2", worker_thread_entry, (void*)2);
-    if (worker1) {
-        scheduler_add(worker1);
-        DEBUG_INFO("Created worker1 thread (TID=%d)\n", worker1->tid);
+    // Per-CPU task pool for parallel bulk work (parallel_for, task futures)
+    if (taskpool_init() != 0) {
+        DEBUG_WARN("Task pool not started, tasks run inline\n");
     }
-    if (worker2) {
-        scheduler_add(worker2);
-        DEBUG_INFO("Created worker2 thread (TID=%d)\n", worker2->tid);
+    
+    // PCI, network, disks and filesystems come up in parallel threads once
+    // the scheduler runs
+    if (boot_tasks_start(boot_tasks, sizeof(boot_tasks) / sizeof(boot_tasks[0]),
+                         start_demo_threads) != 0) {
+        DEBUG_ERROR("Boot task table is invalid, drivers not started\n");
+        start_demo_threads();
     }
     
-    // Create CPU-bound worker (should be demoted over time)
-    thread_t *cpu_worker = thread_create("cpu_hog", cpu_worker_entry, (void*)1);
-    if (cpu_worker) {
-        scheduler_add(cpu_worker);
-        DEBUG_INFO("Created cpu_hog thread (TID=%d)\n", cpu_worker->tid);
+    // From here on debug_log() queues to per-CPU rings instead of stalling
+    // on port writes
+    if (debug_log_start_async() != 0) {
+        DEBUG_WARN("Debug log stays synchronous (no drain thread)\n");
+    }
+    
+    // From here on the console draws into RAM; the shell flushes it
+    graphic_init_back_buffer();
+    
+    // Create shell thread (high priority for responsiveness)
+    // Keep it on the BSP, which receives the keyboard and timer IRQs
+    thread_t *shell_thread = thread_create_priority("shell", shell_thread_entry, NULL, PRIORITY_HIGH);
+    if (shell_thread) {
+        scheduler_add_on(shell_thread, 0);
+        DEBUG_INFO("Created shell thread (TID=%d, priority=HIGH)\n", shell_thread->tid);
+    } else {
+        boot_release_deferred();
     }
     
     kprintf(10, 780, "Starting multi-threaded scheduler...");
     DEBUG_INFO("Starting scheduler with threads...\n");
+    boot_mark("scheduler");
     
     // Start the scheduler - this never returns!
     // Context switching is now deferred from timer IRQ to fix keyboard issue
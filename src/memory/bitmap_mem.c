@@ -1,17 +1,141 @@
 #include "bitmap_mem.h"
 #include "memory.h"
 
-// Bit manipulation macros
-#define BITMAP_SET_BIT(bitmap, bit) ((bitmap)[(bit) / 8] |= (1 << ((bit) % 8)))
-#define BITMAP_CLEAR_BIT(bitmap, bit) ((bitmap)[(bit) / 8] &= ~(1 << ((bit) % 8)))
-#define BITMAP_TEST_BIT(bitmap, bit) ((bitmap)[(bit) / 8] & (1 << ((bit) % 8)))
+// Bit manipulation macros (64 blocks per bitmap word)
+#define BITMAP_WORD(bit) ((bit) / BITMAP_WORD_BITS)
+#define BITMAP_MASK(bit) (1ULL << ((bit) % BITMAP_WORD_BITS))
+#define BITMAP_TEST_BIT(bitmap, bit) ((bitmap)[BITMAP_WORD(bit)] & BITMAP_MASK(bit))
+
+#define WORD_FULL (~0ULL)
+
+// Count set bits without pulling in libgcc's __popcountdi2
+static inline size_t popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// Mask of bits [lo, hi) within one word, 0 <= lo < hi <= 64
+static inline uint64_t range_mask(size_t lo, size_t hi) {
+    uint64_t upper = (hi == BITMAP_WORD_BITS) ? WORD_FULL : ((1ULL << hi) - 1);
+    return upper & ~((1ULL << lo) - 1);
+}
+
+// Keep the summary bit for a bitmap word in sync with its contents
+static inline void update_summary(bitmap_memory_manager_t* manager, size_t word) {
+    if (manager->bitmap[word] == WORD_FULL) {
+        manager->summary[BITMAP_WORD(word)] |= BITMAP_MASK(word);
+    } else {
+        manager->summary[BITMAP_WORD(word)] &= ~BITMAP_MASK(word);
+    }
+}
+
+// Find the first free block at or after 'from'. Returns total_blocks if none.
+static size_t find_next_free(bitmap_memory_manager_t* manager, size_t from) {
+    if (from >= manager->total_blocks) {
+        return manager->total_blocks;
+    }
+
+    // Partial first word: pretend the bits below 'from' are used
+    size_t word = BITMAP_WORD(from);
+    uint64_t bits = manager->bitmap[word] | (BITMAP_MASK(from) - 1);
+    if (bits != WORD_FULL) {
+        size_t block = word * BITMAP_WORD_BITS + __builtin_ctzll(~bits);
+        return block < manager->total_blocks ? block : manager->total_blocks;
+    }
+
+    // Use the summary level to jump straight to the next non-full word
+    word++;
+    while (word < manager->word_count) {
+        size_t sword = BITMAP_WORD(word);
+        uint64_t open = ~manager->summary[sword] & ~(BITMAP_MASK(word) - 1);
+        if (open == 0) {
+            word = (sword + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        word = sword * BITMAP_WORD_BITS + __builtin_ctzll(open);
+        if (word >= manager->word_count) {
+            break;
+        }
+
+        size_t block = word * BITMAP_WORD_BITS + __builtin_ctzll(~manager->bitmap[word]);
+        return block < manager->total_blocks ? block : manager->total_blocks;
+    }
+
+    return manager->total_blocks;
+}
+
+// Find the first used block at or after 'from'. Returns total_blocks if none.
+static size_t find_next_used(bitmap_memory_manager_t* manager, size_t from) {
+    if (from >= manager->total_blocks) {
+        return manager->total_blocks;
+    }
+
+    size_t word = BITMAP_WORD(from);
+    uint64_t bits = manager->bitmap[word] & ~(BITMAP_MASK(from) - 1);
+    while (bits == 0) {
+        if (++word >= manager->word_count) {
+            return manager->total_blocks;
+        }
+        bits = manager->bitmap[word];
+    }
+
+    size_t block = word * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+    return block < manager->total_blocks ? block : manager->total_blocks;
+}
+
+// Set blocks [start, start + count) as used. Returns how many were newly set.
+static size_t set_range(bitmap_memory_manager_t* manager, size_t start, size_t count) {
+    size_t end = start + count;
+    size_t newly_set = 0;
+
+    while (start < end) {
+        size_t word = BITMAP_WORD(start);
+        size_t lo = start % BITMAP_WORD_BITS;
+        size_t hi = (end - word * BITMAP_WORD_BITS) < BITMAP_WORD_BITS ?
+                    (end - word * BITMAP_WORD_BITS) : BITMAP_WORD_BITS;
+        uint64_t mask = range_mask(lo, hi);
+
+        newly_set += popcount64(~manager->bitmap[word] & mask);
+        manager->bitmap[word] |= mask;
+        update_summary(manager, word);
+
+        start = (word + 1) * BITMAP_WORD_BITS;
+    }
+
+    return newly_set;
+}
+
+// Clear blocks [start, start + count). Returns how many were actually used.
+static size_t clear_range(bitmap_memory_manager_t* manager, size_t start, size_t count) {
+    size_t end = start + count;
+    size_t cleared = 0;
+
+    while (start < end) {
+        size_t word = BITMAP_WORD(start);
+        size_t lo = start % BITMAP_WORD_BITS;
+        size_t hi = (end - word * BITMAP_WORD_BITS) < BITMAP_WORD_BITS ?
+                    (end - word * BITMAP_WORD_BITS) : BITMAP_WORD_BITS;
+        uint64_t mask = range_mask(lo, hi);
+
+        cleared += popcount64(manager->bitmap[word] & mask);
+        manager->bitmap[word] &= ~mask;
+        update_summary(manager, word);
+
+        start = (word + 1) * BITMAP_WORD_BITS;
+    }
+
+    return cleared;
+}
 
 // Helper function that uses the existing macro
-bool bitmap_test_bit(uint8_t *bitmap, size_t bit) {
+bool bitmap_test_bit(const uint64_t *bitmap, size_t bit) {
     return BITMAP_TEST_BIT(bitmap, bit) != 0;
 }
 
-bool bitmap_init(bitmap_memory_manager_t* manager, void* bitmap_storage, 
+bool bitmap_init(bitmap_memory_manager_t* manager, void* bitmap_storage,
                  uintptr_t memory_base, size_t memory_size) {
     if (!manager || !bitmap_storage || memory_size == 0) {
         return false;
@@ -19,19 +143,37 @@ bool bitmap_init(bitmap_memory_manager_t* manager, void* bitmap_storage,
 
     // Calculate the number of blocks that can be managed
     manager->total_blocks = memory_size / BITMAP_BLOCK_SIZE;
-    if (manager->total_blocks > BITMAP_MAX_BLOCKS) {
-        manager->total_blocks = BITMAP_MAX_BLOCKS;
+    if (manager->total_blocks == 0) {
+        return false;
     }
 
-    // Calculate bitmap size in bytes (rounded up)
-    manager->bitmap_size = (manager->total_blocks + 7) / 8;
-    manager->bitmap = (uint8_t*)bitmap_storage;
-    
+    // Calculate bitmap size in bytes (rounded up to whole words)
+    manager->word_count = BITMAP_WORDS(manager->total_blocks);
+    manager->bitmap_size = manager->word_count * sizeof(uint64_t);
+    manager->bitmap = (uint64_t*)bitmap_storage;
+    manager->summary = manager->bitmap + manager->word_count;
+
     // Clear the bitmap (all memory free)
     memset(manager->bitmap, 0, manager->bitmap_size);
-    
+    memset(manager->summary, 0,
+           BITMAP_SUMMARY_WORDS(manager->total_blocks) * sizeof(uint64_t));
+
+    // Padding bits past the last block are permanently "used" so the word
+    // scans never hand them out
+    size_t tail = manager->total_blocks % BITMAP_WORD_BITS;
+    if (tail) {
+        manager->bitmap[manager->word_count - 1] = ~((1ULL << tail) - 1);
+    }
+
+    // Likewise for summary bits past the last bitmap word
+    size_t summary_tail = manager->word_count % BITMAP_WORD_BITS;
+    if (summary_tail) {
+        manager->summary[BITMAP_WORD(manager->word_count)] = ~((1ULL << summary_tail) - 1);
+    }
+
     manager->memory_base = memory_base;
     manager->free_blocks = manager->total_blocks;
+    manager->next_free = 0;
 
     return true;
 }
@@ -41,19 +183,20 @@ void* bitmap_alloc_block(bitmap_memory_manager_t* manager) {
         return NULL;
     }
 
-    // Find the first free block
-    for (size_t i = 0; i < manager->total_blocks; i++) {
-        if (!BITMAP_TEST_BIT(manager->bitmap, i)) {
-            // Mark block as used
-            BITMAP_SET_BIT(manager->bitmap, i);
-            manager->free_blocks--;
-            
-            // Calculate and return the block address
-            return bitmap_block_to_address(manager, i);
-        }
+    // Everything below the hint is known to be used
+    size_t block = find_next_free(manager, manager->next_free);
+    if (block >= manager->total_blocks) {
+        return NULL; // No free blocks found
     }
 
-    return NULL; // No free blocks found
+    // Mark block as used
+    manager->bitmap[BITMAP_WORD(block)] |= BITMAP_MASK(block);
+    update_summary(manager, BITMAP_WORD(block));
+    manager->free_blocks--;
+    manager->next_free = block + 1;
+
+    // Calculate and return the block address
+    return bitmap_block_to_address(manager, block);
 }
 
 void* bitmap_alloc_blocks(bitmap_memory_manager_t* manager, size_t count) {
@@ -65,32 +208,26 @@ void* bitmap_alloc_blocks(bitmap_memory_manager_t* manager, size_t count) {
         return bitmap_alloc_block(manager);
     }
 
-    // Find a sequence of 'count' free blocks
-    size_t start_block = 0;
-    size_t contiguous_count = 0;
+    // First-fit over free runs: jump from the start of each free run to the
+    // next used block, a word at a time
+    size_t start = find_next_free(manager, manager->next_free);
+    size_t first_free = start;
 
-    for (size_t i = 0; i < manager->total_blocks; i++) {
-        if (!BITMAP_TEST_BIT(manager->bitmap, i)) {
-            // If this is the start of a new sequence
-            if (contiguous_count == 0) {
-                start_block = i;
-            }
-            
-            contiguous_count++;
-            
-            // Found enough contiguous blocks
-            if (contiguous_count == count) {
-                // Mark all blocks as used
-                for (size_t j = 0; j < count; j++) {
-                    BITMAP_SET_BIT(manager->bitmap, start_block + j);
-                }
-                
-                manager->free_blocks -= count;
-                return bitmap_block_to_address(manager, start_block);
+    while (start + count <= manager->total_blocks) {
+        size_t end = find_next_used(manager, start);
+
+        if (end - start >= count) {
+            set_range(manager, start, count);
+            manager->free_blocks -= count;
+
+            // Only move the hint if we consumed the lowest free block
+            if (start == first_free) {
+                manager->next_free = start + count;
             }
-        } else {
-            contiguous_count = 0; // Reset counter on used block
+            return bitmap_block_to_address(manager, start);
         }
+
+        start = find_next_free(manager, end);
     }
 
     return NULL; // Not enough contiguous free blocks
@@ -102,11 +239,16 @@ void bitmap_free_block(bitmap_memory_manager_t* manager, void* address) {
     }
 
     size_t block = bitmap_address_to_block(manager, address);
-    
+
     // Only free if the block is currently marked as used
     if (BITMAP_TEST_BIT(manager->bitmap, block)) {
-        BITMAP_CLEAR_BIT(manager->bitmap, block);
+        manager->bitmap[BITMAP_WORD(block)] &= ~BITMAP_MASK(block);
+        update_summary(manager, BITMAP_WORD(block));
         manager->free_blocks++;
+
+        if (block < manager->next_free) {
+            manager->next_free = block;
+        }
     }
 }
 
@@ -116,19 +258,36 @@ void bitmap_free_blocks(bitmap_memory_manager_t* manager, void* address, size_t
     }
 
     size_t start_block = bitmap_address_to_block(manager, address);
-    
+
     // Make sure we don't exceed the bounds of the memory region
     size_t max_blocks = count;
     if (start_block + count > manager->total_blocks) {
         max_blocks = manager->total_blocks - start_block;
     }
-    
-    // Free each block
-    for (size_t i = 0; i < max_blocks; i++) {
-        if (BITMAP_TEST_BIT(manager->bitmap, start_block + i)) {
-            BITMAP_CLEAR_BIT(manager->bitmap, start_block + i);
-            manager->free_blocks++;
-        }
+
+    // Free the whole run a word at a time
+    manager->free_blocks += clear_range(manager, start_block, max_blocks);
+
+    if (start_block < manager->next_free) {
+        manager->next_free = start_block;
+    }
+}
+
+void bitmap_reserve_blocks(bitmap_memory_manager_t* manager, void* address, size_t count) {
+    if (!manager || !bitmap_contains_address(manager, address) || count == 0) {
+        return;
+    }
+
+    size_t start_block = bitmap_address_to_block(manager, address);
+    if (start_block + count > manager->total_blocks) {
+        count = manager->total_blocks - start_block;
+    }
+
+    manager->free_blocks -= set_range(manager, start_block, count);
+
+    // The hint must keep pointing at or below the lowest free block
+    if (manager->next_free >= start_block && manager->next_free < start_block + count) {
+        manager->next_free = start_block + count;
     }
 }
 
@@ -140,18 +299,18 @@ bool bitmap_contains_address(bitmap_memory_manager_t* manager, void* address) {
     if (!manager) {
         return false;
     }
-    
+
     uintptr_t addr = (uintptr_t)address;
-    uintptr_t end_addr = manager->memory_base + 
+    uintptr_t end_addr = manager->memory_base +
                          (manager->total_blocks * BITMAP_BLOCK_SIZE);
-    
+
     return (addr >= manager->memory_base && addr < end_addr);
 }
 
 size_t bitmap_address_to_block(bitmap_memory_manager_t* manager, void* address) {
     uintptr_t addr = (uintptr_t)address;
     uintptr_t offset = addr - manager->memory_base;
-    
+
     return offset / BITMAP_BLOCK_SIZE;
 }
 
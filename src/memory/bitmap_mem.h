@@ -7,18 +7,31 @@
 
 // Configuration
 #define BITMAP_BLOCK_SIZE 4096 // 4KB per block, typical page size
-#define BITMAP_MAX_BLOCKS 32768 // Maximum number of blocks to manage (128MB with 4KB blocks)
+
+// The bitmap is scanned 64 blocks at a time. A second, much smaller summary
+// level keeps one bit per bitmap word, set when all 64 blocks in it are used,
+// so full stretches of memory are skipped 4096 blocks at a time.
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(blocks) (((blocks) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define BITMAP_SUMMARY_WORDS(blocks) BITMAP_WORDS(BITMAP_WORDS(blocks))
+
+// Number of uint64_t words of storage bitmap_init() needs for 'blocks' blocks
+#define BITMAP_STORAGE_WORDS(blocks) (BITMAP_WORDS(blocks) + BITMAP_SUMMARY_WORDS(blocks))
 
 // Bitmap memory manager structure
 typedef struct {
-    uint8_t* bitmap;           // Pointer to bitmap storage
+    uint64_t* bitmap;          // Pointer to bitmap storage (1 bit per block, 1 = used)
     uintptr_t memory_base;     // Base address of managed memory
     size_t total_blocks;       // Total number of blocks tracked
     size_t free_blocks;        // Number of free blocks
     size_t bitmap_size;        // Size of bitmap in bytes
+    uint64_t* summary;         // 1 bit per bitmap word, set when the word is full
+    size_t word_count;         // Number of 64-bit words in the bitmap
+    size_t next_free;          // Hint: no block below this index is free
 } bitmap_memory_manager_t;
 
-// Initialize the bitmap memory manager
+// Initialize the bitmap memory manager. bitmap_storage must be 8-byte aligned
+// and hold at least BITMAP_STORAGE_WORDS(memory_size / BITMAP_BLOCK_SIZE) words.
 bool bitmap_init(bitmap_memory_manager_t* manager, void* bitmap_storage, 
                  uintptr_t memory_base, size_t memory_size);
 
@@ -34,6 +47,9 @@ void bitmap_free_blocks(bitmap_memory_manager_t* manager, void* address, size_t
 // Free a single block
 void bitmap_free_block(bitmap_memory_manager_t* manager, void* address);
 
+// Mark a specific range of blocks as used (no-op for blocks already used)
+void bitmap_reserve_blocks(bitmap_memory_manager_t* manager, void* address, size_t count);
+
 // Get the current free block count
 size_t bitmap_get_free_blocks(bitmap_memory_manager_t* manager);
 
@@ -44,7 +60,7 @@ bool bitmap_contains_address(bitmap_memory_manager_t* manager, void* address);
 size_t bitmap_address_to_block(bitmap_memory_manager_t* manager, void* address);
 void* bitmap_block_to_address(bitmap_memory_manager_t* manager, size_t block);
 
-// Add this to bitmap_mem.h if needed
-bool bitmap_test_bit(uint8_t *bitmap, size_t bit);
+// Test a single bit in the bitmap
+bool bitmap_test_bit(const uint64_t *bitmap, size_t bit);
 
 #endif // BITMAP_MEM_H
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include "buddy.h"
+#include "bitmap_mem.h"
+#include "vmm.h"
+#include "memory.h"
+
+#define BUDDY_NONE ((size_t)-1)
+
+static inline buddy_free_block_t *block_node(buddy_allocator_t *buddy, size_t block) {
+    return (buddy_free_block_t *)PHYS_TO_HHDM(buddy->memory_base + block * BITMAP_BLOCK_SIZE);
+}
+
+static inline size_t node_block(buddy_allocator_t *buddy, buddy_free_block_t *node) {
+    return (HHDM_TO_PHYS(node) - buddy->memory_base) / BITMAP_BLOCK_SIZE;
+}
+
+static void list_push(buddy_allocator_t *buddy, size_t block, int order) {
+    buddy_free_block_t *node = block_node(buddy, block);
+    node->prev = NULL;
+    node->next = buddy->free_lists[order];
+    if (node->next) {
+        node->next->prev = node;
+    }
+    buddy->free_lists[order] = node;
+    buddy->free_count[order]++;
+    buddy->order_map[block] = order + 1;
+}
+
+static void list_remove(buddy_allocator_t *buddy, size_t block, int order) {
+    buddy_free_block_t *node = block_node(buddy, block);
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        buddy->free_lists[order] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    buddy->free_count[order]--;
+    buddy->order_map[block] = 0;
+}
+
+// Smallest order whose block holds 'count' pages
+static int order_for_count(size_t count) {
+    int order = 0;
+    while (((size_t)1 << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// Insert one aligned order-k block, merging with its buddy while possible
+static void free_block(buddy_allocator_t *buddy, size_t block, int order) {
+    while (order < BUDDY_MAX_ORDER) {
+        size_t mate = block ^ ((size_t)1 << order);
+        if (mate >= buddy->total_blocks || buddy->order_map[mate] != order + 1) {
+            break;
+        }
+        list_remove(buddy, mate, order);
+        if (mate < block) {
+            block = mate;
+        }
+        order++;
+    }
+    list_push(buddy, block, order);
+}
+
+// Free an arbitrary run by splitting it into maximal aligned power-of-two blocks
+static void free_range(buddy_allocator_t *buddy, size_t block, size_t count) {
+    buddy->free_blocks += count;
+    while (count > 0) {
+        int order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+               (block & (((size_t)2 << order) - 1)) == 0 &&
+               ((size_t)2 << order) <= count) {
+            order++;
+        }
+        free_block(buddy, block, order);
+        block += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+bool buddy_init(buddy_allocator_t *buddy, uint8_t *order_storage,
+                uintptr_t memory_base, size_t total_blocks) {
+    if (!buddy || !order_storage || total_blocks == 0) {
+        return false;
+    }
+
+    buddy->memory_base = memory_base;
+    buddy->total_blocks = total_blocks;
+    buddy->free_blocks = 0;
+    buddy->order_map = order_storage;
+    memset(buddy->order_map, 0, total_blocks);
+
+    for (int i = 0; i < BUDDY_NUM_ORDERS; i++) {
+        buddy->free_lists[i] = NULL;
+        buddy->free_count[i] = 0;
+    }
+
+    return true;
+}
+
+void *buddy_alloc_blocks(buddy_allocator_t *buddy, size_t count) {
+    if (!buddy || count == 0 || count > buddy->free_blocks) {
+        return NULL;
+    }
+
+    int order = order_for_count(count);
+    if (order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+
+    // Find the smallest order with a free block
+    int found = order;
+    while (found <= BUDDY_MAX_ORDER && !buddy->free_lists[found]) {
+        found++;
+    }
+    if (found > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+
+    size_t block = node_block(buddy, buddy->free_lists[found]);
+    list_remove(buddy, block, found);
+
+    // Split down to the requested order, keeping the lower half each time
+    while (found > order) {
+        found--;
+        list_push(buddy, block + ((size_t)1 << found), found);
+    }
+
+    buddy->free_blocks -= (size_t)1 << order;
+
+    // Give back the pages past 'count' so odd-sized requests don't waste memory
+    size_t excess = ((size_t)1 << order) - count;
+    if (excess) {
+        free_range(buddy, block + count, excess);
+    }
+
+    return (void *)(buddy->memory_base + block * BITMAP_BLOCK_SIZE);
+}
+
+void buddy_free_blocks(buddy_allocator_t *buddy, void *address, size_t count) {
+    if (!buddy || count == 0) {
+        return;
+    }
+
+    uintptr_t addr = (uintptr_t)address;
+    if (addr < buddy->memory_base) {
+        return;
+    }
+
+    size_t block = (addr - buddy->memory_base) / BITMAP_BLOCK_SIZE;
+    if (block >= buddy->total_blocks) {
+        return;
+    }
+    if (block + count > buddy->total_blocks) {
+        count = buddy->total_blocks - block;
+    }
+
+    free_range(buddy, block, count);
+}
+
+// Pull a single page out of whichever free block contains it
+static bool take_block(buddy_allocator_t *buddy, size_t block) {
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size_t head = block & ~(((size_t)1 << order) - 1);
+        if (buddy->order_map[head] != order + 1) {
+            continue;
+        }
+
+        list_remove(buddy, head, order);
+
+        // Split, returning every half that doesn't contain 'block'
+        while (order > 0) {
+            order--;
+            size_t half = (size_t)1 << order;
+            if (block < head + half) {
+                list_push(buddy, head + half, order);
+            } else {
+                list_push(buddy, head, order);
+                head += half;
+            }
+        }
+
+        buddy->free_blocks--;
+        return true;
+    }
+    return false;
+}
+
+void buddy_reserve_blocks(buddy_allocator_t *buddy, void *address, size_t count) {
+    if (!buddy || count == 0) {
+        return;
+    }
+
+    uintptr_t addr = (uintptr_t)address;
+    if (addr < buddy->memory_base) {
+        return;
+    }
+
+    size_t block = (addr - buddy->memory_base) / BITMAP_BLOCK_SIZE;
+    for (size_t i = 0; i < count && block + i < buddy->total_blocks; i++) {
+        take_block(buddy, block + i);
+    }
+}
+
+int buddy_largest_free_order(buddy_allocator_t *buddy) {
+    for (int order = BUDDY_MAX_ORDER; order >= 0; order--) {
+        if (buddy->free_lists[order]) {
+            return order;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Largest block the buddy allocator hands out: 2^10 pages = 4 MiB
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NUM_ORDERS (BUDDY_MAX_ORDER + 1)
+
+// Free list node, stored in the first bytes of each free block (via HHDM)
+typedef struct buddy_free_block {
+    struct buddy_free_block *next;
+    struct buddy_free_block *prev;
+} buddy_free_block_t;
+
+// Buddy allocator state for one contiguous physical region
+typedef struct {
+    uintptr_t memory_base;                      // Physical base of the region
+    size_t total_blocks;                        // Pages in the region
+    size_t free_blocks;                         // Free pages across all orders
+    uint8_t *order_map;                         // Per page: k+1 if it heads a free order-k block, else 0
+    buddy_free_block_t *free_lists[BUDDY_NUM_ORDERS];
+    size_t free_count[BUDDY_NUM_ORDERS];        // Blocks on each free list
+} buddy_allocator_t;
+
+// Initialize with every page marked used. order_storage needs one byte per page.
+bool buddy_init(buddy_allocator_t *buddy, uint8_t *order_storage,
+                uintptr_t memory_base, size_t total_blocks);
+
+// Allocate 'count' contiguous pages (count <= 2^BUDDY_MAX_ORDER). The unused
+// tail of the power-of-two block is returned to the free lists immediately.
+void *buddy_alloc_blocks(buddy_allocator_t *buddy, size_t count);
+
+// Return pages to the allocator, coalescing with free buddies
+void buddy_free_blocks(buddy_allocator_t *buddy, void *address, size_t count);
+
+// Remove specific pages from the free lists (no-op for pages already in use)
+void buddy_reserve_blocks(buddy_allocator_t *buddy, void *address, size_t count);
+
+// Largest order that currently has a free block, or -1 if memory is exhausted
+int buddy_largest_free_order(buddy_allocator_t *buddy);
+
+#endif // BUDDY_H
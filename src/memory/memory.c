@@ -4,22 +4,30 @@
 #include "memory.h"
 #include "pmm.h"
 #include "bitmap_mem.h"
+#include "slab.h"
+#include "vmm.h"
 #include "../graphic/graphic.h"
+#include "../debug/debug.h"
+#include "../debug/trace.h"
+#include "../sched/spinlock.h"
 
-// Memory allocation tracking structure
+// Header for large, page-backed allocations. The magic comes first so
+// free() can tell it apart from a slab_t header. Only counters are kept;
+// per-allocation tracking lives in the KMALLOC_DEBUG build.
 typedef struct allocation_header {
-    size_t size;                    // Size of the allocation
     uint32_t magic;                 // Magic number for validation
-    struct allocation_header *next; // Next allocation in linked list
-    struct allocation_header *prev; // Previous allocation in linked list
+    size_t size;                    // Size of the allocation
 } allocation_header_t;
 
 #define ALLOCATION_MAGIC 0xDEADBEEF
 #define MIN_ALLOCATION_SIZE 16
 #define HEADER_SIZE sizeof(allocation_header_t)
 
-// Global allocation tracking
-static allocation_header_t *allocation_list = NULL;
+// Serializes the slab caches, the counters below and the debug list.
+// The PMM has its own lock (always taken after this one).
+static spinlock_t heap_lock = SPINLOCK_INIT_NAMED("heap");
+
+// Large allocation statistics
 static size_t total_allocated = 0;
 static size_t allocation_count = 0;
 
@@ -29,12 +37,68 @@ static size_t allocation_count = 0;
 // DO NOT remove or rename these functions, or stuff will eventually break!
 // They CAN be moved to a different .c file.
 
+// Word type for the 8-byte loops; may_alias keeps the accesses legal on
+// arbitrary buffers, and x86 handles the unaligned cases in hardware
+typedef uint64_t __attribute__((may_alias)) mem_word_t;
+
+// Above this size rep movsb/stosb wins on CPUs with ERMS
+#define MEM_REP_THRESHOLD 256
+
+// Enhanced REP MOVSB/STOSB support: -1 = not probed yet, 0 = no, 1 = yes
+static int erms_state = -1;
+
+static bool cpu_has_erms(void) {
+    if (erms_state < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+        erms_state = 0;
+        if (eax >= 7) {
+            __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+            erms_state = (ebx >> 9) & 1;
+        }
+    }
+    return erms_state == 1;
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+    __asm__ volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_movsq(void *dest, const void *src, size_t n) {
+    __asm__ volatile("rep movsq" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t value, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
+static inline void rep_stosq(void *dest, uint64_t value, size_t n) {
+    __asm__ volatile("rep stosq" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
 void *memcpy(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+    if (n >= MEM_REP_THRESHOLD) {
+        if (cpu_has_erms()) {
+            rep_movsb(pdest, psrc, n);
+        } else {
+            rep_movsq(pdest, psrc, n / 8);
+            rep_movsb(pdest + (n & ~(size_t)7), psrc + (n & ~(size_t)7), n & 7);
+        }
+        return dest;
+    }
+
+    // Medium sizes: 8 bytes per iteration, then the tail
+    while (n >= 8) {
+        *(mem_word_t *)pdest = *(const mem_word_t *)psrc;
+        pdest += 8;
+        psrc += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *pdest++ = *psrc++;
     }
 
     return dest;
@@ -42,32 +106,52 @@ void *memcpy(void *dest, const void *src, size_t n) {
 
 void *memset(void *dest, int value, size_t count)
 {
-	uint8_t val = (uint8_t)(value & 0xFF);
-	uint8_t *dest2 = (uint8_t*)(dest);
-
-	size_t i = 0;
+    uint8_t val = (uint8_t)(value & 0xFF);
+    uint8_t *dest2 = (uint8_t*)(dest);
+
+    if (count >= MEM_REP_THRESHOLD) {
+        if (cpu_has_erms()) {
+            rep_stosb(dest2, val, count);
+        } else {
+            rep_stosq(dest2, val * 0x0101010101010101ULL, count / 8);
+            rep_stosb(dest2 + (count & ~(size_t)7), val, count & 7);
+        }
+        return dest;
+    }
 
-	while(i < count)
-	{
-		dest2[i] = val;
-		i++;
-	}
+    uint64_t pattern = val * 0x0101010101010101ULL;
+    while (count >= 8) {
+        *(mem_word_t *)dest2 = pattern;
+        dest2 += 8;
+        count -= 8;
+    }
+    while (count--) {
+        *dest2++ = val;
+    }
 
-	return dest;
+    return dest;
 }
 
 void *memmove(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+    // A forward copy is safe unless dest starts inside the source buffer
+    if (pdest <= psrc || pdest >= psrc + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // Overlapping with dest above src: copy backwards a word at a time
+    pdest += n;
+    psrc += n;
+    while (n >= 8) {
+        pdest -= 8;
+        psrc -= 8;
+        n -= 8;
+        *(mem_word_t *)pdest = *(const mem_word_t *)psrc;
+    }
+    while (n--) {
+        *--pdest = *--psrc;
     }
 
     return dest;
@@ -77,6 +161,13 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
 
+    // Skip equal words quickly, then find the differing byte
+    while (n >= 8 && *(const mem_word_t *)p1 == *(const mem_word_t *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
@@ -86,30 +177,36 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     return 0;
 }
 
-// Helper function to align size to page boundaries
-static size_t align_size(size_t size) {
-    size_t page_size = 4096; // BITMAP_BLOCK_SIZE
-    return (size + page_size - 1) & ~(page_size - 1);
-}
-
-// Calculate how many pages needed for a given size
+// Calculate how many pages needed for a given size (header included)
 static size_t pages_needed(size_t size) {
     return (size + HEADER_SIZE + 4095) / 4096; // Round up to pages
 }
 
-void *malloc(size_t size) {
-    if (size == 0) {
-        return NULL;
-    }
+// Put the allocation header at the start of freshly allocated pages and
+// return the user pointer after it
+static void *raw_pages_to_user(void *pages, size_t size, size_t num_pages) {
+    // Set up allocation header (accessed through the HHDM)
+    allocation_header_t *header = (allocation_header_t *)PHYS_TO_HHDM(pages);
+    header->size = size;
+    header->magic = ALLOCATION_MAGIC;
 
-    // Ensure minimum allocation size
-    if (size < MIN_ALLOCATION_SIZE) {
-        size = MIN_ALLOCATION_SIZE;
+    // Update statistics
+    total_allocated += num_pages * 4096;
+    allocation_count++;
+
+    // Return pointer after header
+    return (void *)((uint8_t *)header + HEADER_SIZE);
+}
+
+// Backing allocator: slab classes for small sizes, whole pages otherwise
+static void *raw_alloc(size_t size) {
+    // Small objects come from the size-class caches
+    if (size <= SLAB_MAX_OBJECT_SIZE) {
+        return slab_alloc(size);
     }
 
-    // Calculate total size needed including header
-    size_t total_size = size + HEADER_SIZE;
-    size_t num_pages = pages_needed(total_size);
+    // Large allocations get whole pages
+    size_t num_pages = pages_needed(size);
 
     // Allocate physical pages
     void *pages = physical_alloc_pages(num_pages);
@@ -117,29 +214,32 @@ void *malloc(size_t size) {
         return NULL;
     }
 
-    // Set up allocation header
-    allocation_header_t *header = (allocation_header_t *)pages;
-    header->size = size;
-    header->magic = ALLOCATION_MAGIC;
-    header->next = allocation_list;
-    header->prev = NULL;
+    return raw_pages_to_user(pages, size, num_pages);
+}
 
-    // Update linked list
-    if (allocation_list) {
-        allocation_list->prev = header;
+#ifndef KMALLOC_DEBUG
+// raw_alloc() for calloc(): a one-page allocation comes pre-zeroed from the
+// PMM's pool, anything else is cleared here
+static void *raw_alloc_zeroed(size_t size) {
+    if (size <= SLAB_MAX_OBJECT_SIZE || pages_needed(size) > 1) {
+        void *ptr = raw_alloc(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
     }
-    allocation_list = header;
 
-    // Update statistics
-    total_allocated += num_pages * 4096;
-    allocation_count++;
-
-    // Return pointer after header
-    return (void *)((uint8_t *)pages + HEADER_SIZE);
+    void *page = physical_alloc_zeroed_page();
+    if (!page) {
+        return NULL;
+    }
+    return raw_pages_to_user(page, size, 1);
 }
+#endif
 
-void free(void *ptr) {
-    if (!ptr) {
+static void raw_free(void *ptr) {
+    if (slab_owns(ptr)) {
+        slab_free(ptr);
         return;
     }
 
@@ -152,33 +252,193 @@ void free(void *ptr) {
     }
 
     // Calculate number of pages to free
-    size_t total_size = header->size + HEADER_SIZE;
-    size_t num_pages = pages_needed(total_size);
+    size_t num_pages = pages_needed(header->size);
+
+    // Clear magic number to prevent double-free
+    header->magic = 0;
+
+    // Free the pages
+    physical_free_pages((void *)HHDM_TO_PHYS(header), num_pages);
+
+    // Update statistics
+    if (total_allocated >= num_pages * 4096) {
+        total_allocated -= num_pages * 4096;
+    }
+    if (allocation_count > 0) {
+        allocation_count--;
+    }
+}
+
+#ifndef KMALLOC_DEBUG
+// Bytes the caller may use in a raw allocation
+static size_t raw_usable_size(void *ptr) {
+    if (slab_owns(ptr)) {
+        return slab_object_size(ptr);
+    }
+    allocation_header_t *header = (allocation_header_t *)((uint8_t *)ptr - HEADER_SIZE);
+    return header->magic == ALLOCATION_MAGIC ? header->size : 0;
+}
+#endif
+
+#ifdef KMALLOC_DEBUG
+
+// Debug mode: every allocation is tracked on a list and wrapped in redzones
+//
+//   [debug_header_t][user data ... size bytes][trailing redzone]
+//
+// The header ends with the leading redzone. Fresh memory is filled with
+// KMALLOC_POISON_ALLOC and freed memory with KMALLOC_POISON_FREE so stale
+// or uninitialised reads stand out.
+#define DEBUG_ALLOC_MAGIC    0xA110CA7E
+#define DEBUG_FREED_MAGIC    0xDEADF4EE
+#define REDZONE_SIZE         16
+#define REDZONE_BYTE         0xFD
+#define KMALLOC_POISON_ALLOC 0xA5
+#define KMALLOC_POISON_FREE  0x6B
+
+typedef struct debug_header {
+    uint32_t magic;                 // DEBUG_ALLOC_MAGIC while live
+    uint32_t reserved;
+    size_t size;                    // Size requested by the caller
+    struct debug_header *next;      // Next live allocation
+    struct debug_header *prev;      // Previous live allocation
+    void *caller;                   // Return address of the allocating call
+    uint8_t redzone[REDZONE_SIZE];  // Leading redzone, directly before user data
+} __attribute__((aligned(16))) debug_header_t;
+
+static debug_header_t *allocation_list = NULL;
+static size_t debug_live_count = 0;
+static size_t debug_live_bytes = 0;
+static size_t debug_corruptions = 0;
+
+static bool redzone_intact(const uint8_t *zone) {
+    for (int i = 0; i < REDZONE_SIZE; i++) {
+        if (zone[i] != REDZONE_BYTE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Verify both redzones of one allocation, logging any damage
+static bool debug_check(debug_header_t *header) {
+    uint8_t *user = (uint8_t *)(header + 1);
+    bool ok = true;
+
+    if (!redzone_intact(header->redzone)) {
+        DEBUG_ERROR("kmalloc: underflow before %p (size %lu, caller %p)\n",
+                    user, header->size, header->caller);
+        ok = false;
+    }
+    if (!redzone_intact(user + header->size)) {
+        DEBUG_ERROR("kmalloc: overflow after %p (size %lu, caller %p)\n",
+                    user, header->size, header->caller);
+        ok = false;
+    }
+    if (!ok) {
+        debug_corruptions++;
+    }
+    return ok;
+}
+
+static void *debug_alloc(size_t size, void *caller) {
+    debug_header_t *header = raw_alloc(sizeof(debug_header_t) + size + REDZONE_SIZE);
+    if (!header) {
+        return NULL;
+    }
+
+    uint8_t *user = (uint8_t *)(header + 1);
+    header->magic = DEBUG_ALLOC_MAGIC;
+    header->size = size;
+    header->caller = caller;
+    memset(header->redzone, REDZONE_BYTE, REDZONE_SIZE);
+    memset(user, KMALLOC_POISON_ALLOC, size);
+    memset(user + size, REDZONE_BYTE, REDZONE_SIZE);
+
+    header->prev = NULL;
+    header->next = allocation_list;
+    if (allocation_list) {
+        allocation_list->prev = header;
+    }
+    allocation_list = header;
+
+    debug_live_count++;
+    debug_live_bytes += size;
+    return user;
+}
+
+static debug_header_t *debug_header_of(void *ptr) {
+    return (debug_header_t *)ptr - 1;
+}
+
+static void debug_release(void *ptr) {
+    debug_header_t *header = debug_header_of(ptr);
+
+    if (header->magic == DEBUG_FREED_MAGIC) {
+        DEBUG_ERROR("kmalloc: double free of %p (caller %p)\n", ptr, header->caller);
+        debug_corruptions++;
+        return;
+    }
+    if (header->magic != DEBUG_ALLOC_MAGIC) {
+        DEBUG_ERROR("kmalloc: free of unknown pointer %p\n", ptr);
+        debug_corruptions++;
+        return;
+    }
+
+    debug_check(header);
 
-    // Remove from linked list
     if (header->prev) {
         header->prev->next = header->next;
     } else {
         allocation_list = header->next;
     }
-    
     if (header->next) {
         header->next->prev = header->prev;
     }
 
-    // Clear magic number to prevent double-free
-    header->magic = 0;
+    debug_live_count--;
+    debug_live_bytes -= header->size;
 
-    // Free the pages
-    physical_free_pages(header, num_pages);
+    header->magic = DEBUG_FREED_MAGIC;
+    memset(ptr, KMALLOC_POISON_FREE, header->size);
+    raw_free(header);
+}
 
-    // Update statistics
-    if (total_allocated >= num_pages * 4096) {
-        total_allocated -= num_pages * 4096;
+#endif // KMALLOC_DEBUG
+
+void *malloc(size_t size) {
+    if (size == 0) {
+        return NULL;
     }
-    if (allocation_count > 0) {
-        allocation_count--;
+
+    // Ensure minimum allocation size
+    if (size < MIN_ALLOCATION_SIZE) {
+        size = MIN_ALLOCATION_SIZE;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+#ifdef KMALLOC_DEBUG
+    void *ptr = debug_alloc(size, __builtin_return_address(0));
+#else
+    void *ptr = raw_alloc(size);
+#endif
+    spin_unlock_irqrestore(&heap_lock, flags);
+    TRACE(TRACE_MALLOC, size, ptr);
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (!ptr) {
+        return;
     }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+#ifdef KMALLOC_DEBUG
+    debug_release(ptr);
+#else
+    raw_free(ptr);
+#endif
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void *calloc(size_t nmemb, size_t size) {
@@ -188,11 +448,25 @@ void *calloc(size_t nmemb, size_t size) {
     }
 
     size_t total_size = nmemb * size;
+#ifdef KMALLOC_DEBUG
     void *ptr = malloc(total_size);
     
     if (ptr) {
         memset(ptr, 0, total_size);
     }
+#else
+    if (total_size == 0) {
+        return NULL;
+    }
+    if (total_size < MIN_ALLOCATION_SIZE) {
+        total_size = MIN_ALLOCATION_SIZE;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void *ptr = raw_alloc_zeroed(total_size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    TRACE(TRACE_MALLOC, total_size, ptr);
+#endif
     
     return ptr;
 }
@@ -207,20 +481,24 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    // Get current allocation info
-    allocation_header_t *header = (allocation_header_t *)((uint8_t *)ptr - HEADER_SIZE);
-    
-    if (header->magic != ALLOCATION_MAGIC) {
+#ifdef KMALLOC_DEBUG
+    // Always move, so stale pointers to the old block hit poisoned memory
+    debug_header_t *header = debug_header_of(ptr);
+    if (header->magic != DEBUG_ALLOC_MAGIC) {
         return NULL; // Invalid pointer
     }
-
     size_t old_size = header->size;
-    
-    // If new size is smaller or same, just update size and return same pointer
+#else
+    size_t old_size = raw_usable_size(ptr);
+    if (old_size == 0) {
+        return NULL; // Invalid pointer
+    }
+
+    // Shrinking or growing within the slab class / page run stays in place
     if (size <= old_size) {
-        header->size = size;
         return ptr;
     }
+#endif
 
     // Need to allocate new memory
     void *new_ptr = malloc(size);
@@ -229,7 +507,7 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy old data
-    memcpy(new_ptr, ptr, old_size);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
     
     // Free old memory
     free(ptr);
@@ -253,9 +531,29 @@ void *kmalloc_aligned(size_t size, size_t alignment) {
     return malloc(size);
 }
 
+int malloc_check_heap(void) {
+#ifdef KMALLOC_DEBUG
+    int damaged = 0;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    for (debug_header_t *header = allocation_list; header; header = header->next) {
+        if (!debug_check(header)) {
+            damaged++;
+        }
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return damaged;
+#else
+    return 0;
+#endif
+}
+
 // Memory allocation statistics
 size_t malloc_get_total_allocated(void) {
-    return total_allocated;
+    size_t slab_bytes = 0;
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_bytes += slab_get_cache(i)->slab_count * 4096;
+    }
+    return total_allocated + slab_bytes;
 }
 
 size_t malloc_get_free_memory(void) {
@@ -264,7 +562,19 @@ size_t malloc_get_free_memory(void) {
 
 void malloc_print_stats(size_t x, size_t y) {
     kprintf(x, y, "Malloc Stats:");
-    kprintf(x, y += 15, "Total allocated: %d KB", total_allocated / 1024);
-    kprintf(x, y += 15, "Active allocations: %d", allocation_count);
+    kprintf(x, y += 15, "Total allocated: %d KB", malloc_get_total_allocated() / 1024);
+    kprintf(x, y += 15, "Large allocations: %d (%d KB)", allocation_count, total_allocated / 1024);
     kprintf(x, y += 15, "Free memory: %d KB", malloc_get_free_memory() / 1024);
+#ifdef KMALLOC_DEBUG
+    kprintf(x, y += 15, "Debug: %d live (%d B), %d corruptions",
+            debug_live_count, debug_live_bytes, debug_corruptions);
+#endif
+
+    // Per size-class breakdown
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        const slab_cache_t *cache = slab_get_cache(i);
+        kprintf(x, y += 15, "  %d B: %d slabs, %d in use, %d allocs, %d frees",
+                cache->object_size, cache->slab_count, cache->objects_in_use,
+                cache->total_allocs, cache->total_frees);
+    }
 }
\ No newline at end of file
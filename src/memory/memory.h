@@ -27,4 +27,8 @@ size_t malloc_get_total_allocated(void);
 size_t malloc_get_free_memory(void);
 void malloc_print_stats(size_t x, size_t y);
 
+// Verify the redzones of every live allocation (KMALLOC_DEBUG builds only).
+// Returns the number of damaged allocations; always 0 in production builds.
+int malloc_check_heap(void);
+
 #endif // MEMORY_H
\ No newline at end of file
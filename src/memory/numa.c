@@ -0,0 +1,255 @@
+#include "numa.h"
+#include "../acpi/acpi.h"
+#include "../smp/smp.h"
+#include "../debug/debug.h"
+
+// Proximity domain of each node, in order of first appearance in the SRAT
+static uint32_t node_domain[NUMA_MAX_NODES];
+static int node_count = 1;
+
+static numa_mem_range_t mem_ranges[NUMA_MAX_MEM_RANGES];
+static size_t mem_range_count = 0;
+
+typedef struct {
+    uint32_t apic_id;
+    uint8_t node;
+} numa_cpu_entry_t;
+
+static numa_cpu_entry_t cpu_entries[NUMA_MAX_CPU_ENTRIES];
+static size_t cpu_entry_count = 0;
+
+// Node per logical CPU, resolved from its APIC ID on first use
+#define NUMA_CPU_UNKNOWN 0xFF
+static uint8_t cpu_node[MAX_CPUS];
+
+static uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Nodes in increasing distance from each node, itself first
+static uint8_t fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Dense node for a proximity domain, allocating one on first sight. -1 once
+// NUMA_MAX_NODES domains exist.
+static int domain_to_node(uint32_t domain, bool create) {
+    for (int i = 0; i < node_count; i++) {
+        if (node_domain[i] == domain) {
+            return i;
+        }
+    }
+    if (!create || node_count == NUMA_MAX_NODES) {
+        return -1;
+    }
+    node_domain[node_count] = domain;
+    return node_count++;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t domain) {
+    int node = domain_to_node(domain, true);
+    if (node < 0 || cpu_entry_count == NUMA_MAX_CPU_ENTRIES) {
+        DEBUG_WARN("NUMA: ignoring APIC %u in domain %u\n", apic_id, domain);
+        return;
+    }
+    cpu_entries[cpu_entry_count].apic_id = apic_id;
+    cpu_entries[cpu_entry_count].node = (uint8_t)node;
+    cpu_entry_count++;
+}
+
+static void add_memory(uint64_t base, uint64_t length, uint32_t domain) {
+    int node = domain_to_node(domain, true);
+    if (node < 0 || mem_range_count == NUMA_MAX_MEM_RANGES) {
+        DEBUG_WARN("NUMA: ignoring memory 0x%lx+0x%lx in domain %u\n", base, length, domain);
+        return;
+    }
+
+    // Insertion sort by base, the PMM walks these in address order
+    size_t i = mem_range_count++;
+    while (i > 0 && mem_ranges[i - 1].base > base) {
+        mem_ranges[i] = mem_ranges[i - 1];
+        i--;
+    }
+    mem_ranges[i].base = base;
+    mem_ranges[i].length = length;
+    mem_ranges[i].node = node;
+}
+
+static void parse_srat(acpi_srat_t *srat) {
+    // With no SRAT entries node 0 is implicit; the first domain seen takes
+    // its place instead
+    node_count = 0;
+
+    uint8_t *entry = srat->entries;
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+    while (entry + sizeof(acpi_srat_entry_t) <= end) {
+        acpi_srat_entry_t *header = (acpi_srat_entry_t *)entry;
+        if (header->length < sizeof(acpi_srat_entry_t) || entry + header->length > end) {
+            break;
+        }
+
+        if (header->type == ACPI_SRAT_TYPE_LAPIC && header->length >= sizeof(acpi_srat_lapic_t)) {
+            acpi_srat_lapic_t *lapic = (acpi_srat_lapic_t *)entry;
+            if (lapic->flags & ACPI_SRAT_ENABLED) {
+                uint32_t domain = lapic->domain_lo | (uint32_t)lapic->domain_hi[0] << 8 |
+                                  (uint32_t)lapic->domain_hi[1] << 16 |
+                                  (uint32_t)lapic->domain_hi[2] << 24;
+                add_cpu(lapic->apic_id, domain);
+            }
+        } else if (header->type == ACPI_SRAT_TYPE_X2APIC &&
+                   header->length >= sizeof(acpi_srat_x2apic_t)) {
+            acpi_srat_x2apic_t *x2apic = (acpi_srat_x2apic_t *)entry;
+            if (x2apic->flags & ACPI_SRAT_ENABLED) {
+                add_cpu(x2apic->x2apic_id, x2apic->domain);
+            }
+        } else if (header->type == ACPI_SRAT_TYPE_MEMORY &&
+                   header->length >= sizeof(acpi_srat_memory_t)) {
+            acpi_srat_memory_t *mem = (acpi_srat_memory_t *)entry;
+            // Hot-pluggable ranges that aren't populated yet don't matter here
+            if ((mem->flags & ACPI_SRAT_ENABLED) && mem->length_bytes) {
+                add_memory(mem->base, mem->length_bytes, mem->domain);
+            }
+        }
+
+        entry += header->length;
+    }
+
+    if (node_count == 0) {
+        node_count = 1;
+    }
+}
+
+// SLIT rows and columns are indexed by proximity domain
+static void parse_slit(acpi_slit_t *slit) {
+    uint64_t n = slit->locality_count;
+    if (slit->header.length < sizeof(acpi_slit_t) + n * n) {
+        DEBUG_WARN("NUMA: truncated SLIT, using default distances\n");
+        return;
+    }
+
+    for (int from = 0; from < node_count; from++) {
+        for (int to = 0; to < node_count; to++) {
+            if (node_domain[from] < n && node_domain[to] < n) {
+                distance[from][to] = slit->distance[node_domain[from] * n + node_domain[to]];
+            }
+        }
+    }
+}
+
+static void build_fallback_lists(void) {
+    for (int node = 0; node < node_count; node++) {
+        for (int i = 0; i < node_count; i++) {
+            fallback[node][i] = (uint8_t)i;
+        }
+        // Keep the node itself first even if the SLIT says otherwise, then
+        // order by distance (insertion sort, stable for equal distances)
+        fallback[node][node] = 0;
+        fallback[node][0] = (uint8_t)node;
+        for (int i = 2; i < node_count; i++) {
+            uint8_t candidate = fallback[node][i];
+            int j = i;
+            while (j > 1 && distance[node][fallback[node][j - 1]] > distance[node][candidate]) {
+                fallback[node][j] = fallback[node][j - 1];
+                j--;
+            }
+            fallback[node][j] = candidate;
+        }
+    }
+}
+
+int numa_init(void) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpu_node[i] = NUMA_CPU_UNKNOWN;
+    }
+    for (int from = 0; from < NUMA_MAX_NODES; from++) {
+        for (int to = 0; to < NUMA_MAX_NODES; to++) {
+            distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    acpi_srat_t *srat = acpi_find_table("SRAT");
+    if (!srat) {
+        DEBUG_INFO("NUMA: no SRAT, single node\n");
+        build_fallback_lists();
+        return node_count;
+    }
+    parse_srat(srat);
+
+    acpi_slit_t *slit = acpi_find_table("SLIT");
+    if (slit) {
+        parse_slit(slit);
+    }
+    build_fallback_lists();
+
+    DEBUG_INFO("NUMA: %d nodes, %lu CPU entries, %lu memory ranges%s\n", node_count,
+               cpu_entry_count, mem_range_count, slit ? "" : ", no SLIT");
+    for (size_t i = 0; i < mem_range_count; i++) {
+        DEBUG_INFO("NUMA:   node %d: 0x%lx-0x%lx\n", mem_ranges[i].node, mem_ranges[i].base,
+                   mem_ranges[i].base + mem_ranges[i].length - 1);
+    }
+    return node_count;
+}
+
+int numa_node_count(void) {
+    return node_count;
+}
+
+int numa_node_of_phys(uint64_t phys) {
+    for (size_t i = 0; i < mem_range_count; i++) {
+        if (phys >= mem_ranges[i].base && phys - mem_ranges[i].base < mem_ranges[i].length) {
+            return mem_ranges[i].node;
+        }
+    }
+    return 0;
+}
+
+int numa_node_of_cpu(uint32_t cpu) {
+    if (node_count == 1 || cpu >= MAX_CPUS) {
+        return 0;
+    }
+    if (cpu_node[cpu] != NUMA_CPU_UNKNOWN) {
+        return cpu_node[cpu];
+    }
+
+    // CPUs that haven't been started have no APIC ID yet, so don't cache
+    if (cpu >= smp_cpu_count()) {
+        return 0;
+    }
+    uint32_t apic_id = smp_get_cpu(cpu)->lapic_id;
+    uint8_t node = 0;
+    for (size_t i = 0; i < cpu_entry_count; i++) {
+        if (cpu_entries[i].apic_id == apic_id) {
+            node = cpu_entries[i].node;
+            break;
+        }
+    }
+    cpu_node[cpu] = node;
+    return node;
+}
+
+int numa_current_node(void) {
+    // Single-node machines never touch GS, so this is also safe before
+    // smp_bsp_init()
+    if (node_count == 1) {
+        return 0;
+    }
+    return numa_node_of_cpu(smp_cpu_id());
+}
+
+uint8_t numa_distance(int from, int to) {
+    if (from < 0 || to < 0 || from >= node_count || to >= node_count) {
+        return NUMA_REMOTE_DISTANCE;
+    }
+    return distance[from][to];
+}
+
+int numa_fallback_node(int node, int i) {
+    if (node < 0 || node >= node_count || i < 0 || i >= node_count) {
+        return 0;
+    }
+    return fallback[node][i];
+}
+
+size_t numa_mem_range_count(void) {
+    return mem_range_count;
+}
+
+const numa_mem_range_t *numa_mem_range(size_t index) {
+    return index < mem_range_count ? &mem_ranges[index] : NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Topology from the ACPI SRAT (which CPUs and memory ranges belong to which
+// proximity domain) and SLIT (how far apart the domains are). Domains are
+// renumbered densely as nodes 0..numa_node_count()-1. Without an SRAT the
+// whole machine is node 0.
+#define NUMA_MAX_NODES          8
+#define NUMA_MAX_MEM_RANGES     32
+#define NUMA_MAX_CPU_ENTRIES    64
+
+// "No preference": allocate on the calling CPU's node
+#define NUMA_NO_NODE            (-1)
+
+// SLIT distances: 10 is local, unknown remote distances default to 20
+#define NUMA_LOCAL_DISTANCE     10
+#define NUMA_REMOTE_DISTANCE    20
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    int node;
+} numa_mem_range_t;
+
+// Parse SRAT and SLIT. Needs the RSDP and the VMM; call before anything
+// asks for a CPU's node. Returns the number of nodes.
+int numa_init(void);
+
+int numa_node_count(void);
+
+// Node a physical address belongs to (0 if no range covers it)
+int numa_node_of_phys(uint64_t phys);
+
+// Node of a logical CPU index (0 if the SRAT doesn't list it)
+int numa_node_of_cpu(uint32_t cpu);
+
+// Node of the calling CPU. Only valid after smp_bsp_init().
+int numa_current_node(void);
+
+// Relative distance between two nodes (NUMA_LOCAL_DISTANCE for a == b)
+uint8_t numa_distance(int from, int to);
+
+// The i-th nearest node to 'node' (i = 0 is the node itself), for fallback
+// allocation. i must be below numa_node_count().
+int numa_fallback_node(int node, int i);
+
+// Memory ranges from the SRAT, sorted by base
+size_t numa_mem_range_count(void);
+const numa_mem_range_t *numa_mem_range(size_t index);
+
+#endif // NUMA_H
@@ -1,145 +1,643 @@
 #include "pmm.h"
 #include "bitmap_mem.h"
+#include "buddy.h"
+#include "numa.h"
 #include "memory.h"
+#include "vmm.h"
 #include "graphic.h"  // Include for kprintf
+#include "../debug/debug.h"
+#include "../debug/trace.h"
+#include "../sched/spinlock.h"
 
-// Global memory manager instance
-static bitmap_memory_manager_t phys_mem;
-static uint8_t bitmap_storage[BITMAP_MAX_BLOCKS / 8];  // Storage for the bitmap itself
+// Maximum number of disjoint usable memmap regions we manage
+#define PMM_MAX_ZONES 32
+
+// One zone per usable memmap region, split further at NUMA node boundaries
+// by physical_memory_init_numa(). Each zone has its own bitmap (always
+// maintained) and, in buddy mode, its own buddy free lists.
+typedef struct {
+    bitmap_memory_manager_t bitmap;
+    buddy_allocator_t buddy;
+    int node;
+} pmm_zone_t;
+
+static pmm_zone_t zones[PMM_MAX_ZONES];
+static size_t zone_count = 0;
+
+// Zone layout being built by physical_memory_init_numa()
+static pmm_zone_t new_zones[PMM_MAX_ZONES];
+static pmm_backend_t pmm_backend = PMM_BACKEND_BITMAP;
+
+// Metadata (bitmaps + buddy order maps) carved out of usable RAM at boot
+static uintptr_t metadata_phys = 0;
+static size_t metadata_size = 0;
+
+// Serializes every zone's bitmap/buddy state and the counters below
+static spinlock_t pmm_lock = SPINLOCK_INIT_NAMED("pmm");
+
+// Pre-zeroed single pages for physical_alloc_zeroed_page(), one pool per
+// node, refilled by the idle threads
+typedef struct {
+    uintptr_t pages[PMM_ZERO_POOL_PAGES];
+    size_t count;
+    bool starved;           // Last refill found no memory; cleared by frees
+    uint64_t hits;          // Served from the pool
+    uint64_t misses;        // Pool empty, zeroed on the spot
+} zero_pool_t;
+
+static zero_pool_t zero_pools[NUMA_MAX_NODES];
+
+// Lock order: zero_pool_lock before pmm_lock
+static spinlock_t zero_pool_lock = SPINLOCK_INIT_NAMED("pmm.zero");
 
 // Track memory statistics
 static size_t total_memory = 0;
 static size_t reserved_memory = 0;
 static size_t used_memory = 0;
 
-bool physical_memory_init(struct limine_memmap_response *memmap) {
+// Bytes of metadata a zone of 'blocks' pages needs for the given backend
+static size_t zone_metadata_size(size_t blocks, pmm_backend_t backend) {
+    size_t size = BITMAP_STORAGE_WORDS(blocks) * sizeof(uint64_t);
+    if (backend == PMM_BACKEND_BUDDY) {
+        size += blocks;  // One order byte per page
+    }
+    return (size + 7) & ~(size_t)7;  // Keep the next zone's bitmap 8-byte aligned
+}
+
+// Page-aligned [base, base + length) of a usable memmap entry
+static bool usable_range(struct limine_memmap_entry *entry, uintptr_t *base, size_t *blocks) {
+    uintptr_t start = PAGE_ALIGN_UP(entry->base);
+    uintptr_t end = PAGE_ALIGN(entry->base + entry->length);
+    if (end <= start) {
+        return false;
+    }
+    *base = start;
+    *blocks = (end - start) / BITMAP_BLOCK_SIZE;
+    return true;
+}
+
+static pmm_zone_t *zone_for_address(void *address) {
+    for (size_t i = 0; i < zone_count; i++) {
+        if (bitmap_contains_address(&zones[i].bitmap, address)) {
+            return &zones[i];
+        }
+    }
+    return NULL;
+}
+
+// Seed a zone's buddy free lists from whatever its bitmap still considers free
+static void buddy_build_from_bitmap(pmm_zone_t *zone, uint8_t *order_storage) {
+    bitmap_memory_manager_t *bm = &zone->bitmap;
+    buddy_init(&zone->buddy, order_storage, bm->memory_base, bm->total_blocks);
+
+    size_t block = 0;
+    while (block < bm->total_blocks) {
+        if (bitmap_test_bit(bm->bitmap, block)) {
+            block++;
+            continue;
+        }
+
+        size_t run_start = block;
+        while (block < bm->total_blocks && !bitmap_test_bit(bm->bitmap, block)) {
+            block++;
+        }
+        buddy_free_blocks(&zone->buddy, bitmap_block_to_address(bm, run_start),
+                          block - run_start);
+    }
+}
+
+bool physical_memory_init(struct limine_memmap_response *memmap, pmm_backend_t backend) {
     if (!memmap) {
         return false;
     }
-    
-    // Find the largest usable memory region for our initial bitmap
+
+    // Calculate total memory and how much metadata every usable region needs
     struct limine_memmap_entry *largest_region = NULL;
     size_t largest_size = 0;
-    
-    // Calculate total memory and find the largest usable region
+    size_t regions = 0;
+
     for (size_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        
-        // Add to total memory count for all usable memory
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            total_memory += entry->length;
-            
-            // Track the largest region
-            if (entry->length > largest_size) {
-                largest_size = entry->length;
-                largest_region = entry;
-            }
-        } else {
+        uintptr_t base;
+        size_t blocks;
+
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
             // Count reserved memory
             reserved_memory += entry->length;
+            continue;
+        }
+
+        total_memory += entry->length;
+        if (!usable_range(entry, &base, &blocks)) {
+            continue;
+        }
+
+        if (regions == PMM_MAX_ZONES) {
+            DEBUG_WARN("PMM: more than %d usable regions, ignoring 0x%lx\n",
+                       PMM_MAX_ZONES, base);
+            continue;
+        }
+        regions++;
+        metadata_size += zone_metadata_size(blocks, backend);
+
+        // Track the largest region, it will host the metadata
+        if (entry->length > largest_size) {
+            largest_size = entry->length;
+            largest_region = entry;
         }
     }
-    
+
     // If no usable memory found, fail
     if (!largest_region) {
         return false;
     }
-    
-    // Initialize the bitmap with the largest usable memory region
-    if (!bitmap_init(&phys_mem, bitmap_storage, 
-                    largest_region->base, largest_size)) {
+
+    // Place the metadata at the start of the largest region
+    metadata_phys = PAGE_ALIGN_UP(largest_region->base);
+    metadata_size = PAGE_ALIGN_UP(metadata_size);
+    if (metadata_size >= largest_size) {
+        DEBUG_ERROR("PMM: no region large enough for %lu bytes of metadata\n", metadata_size);
         return false;
     }
-    
-    // Mark all non-usable or separate memory regions as reserved
-    for (size_t i = 0; i < memmap->entry_count; i++) {
+    uint8_t *metadata = (uint8_t *)PHYS_TO_HHDM(metadata_phys);
+
+    // Create one zone per usable region, handing out slices of the metadata
+    uint8_t *cursor = metadata;
+    for (size_t i = 0; i < memmap->entry_count && zone_count < PMM_MAX_ZONES; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        
-        // Skip our main memory region, it's already properly initialized
-        if (entry == largest_region) {
+        uintptr_t base;
+        size_t blocks;
+
+        if (entry->type != LIMINE_MEMMAP_USABLE || !usable_range(entry, &base, &blocks)) {
             continue;
         }
-        
-        // Skip other usable regions for now - we'll add them later if needed
-        // TODO: Multi-region PMM support requires refactoring the bitmap allocator
-        //       to track multiple disjoint memory regions. For now, we only use
-        //       the largest region, which is typically sufficient for most use cases.
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            continue;
+
+        pmm_zone_t *zone = &zones[zone_count++];
+        if (!bitmap_init(&zone->bitmap, cursor, base, blocks * BITMAP_BLOCK_SIZE)) {
+            return false;
         }
-        
-        // If this region overlaps with our managed area, mark it as reserved
-        if (bitmap_contains_address(&phys_mem, (void*)entry->base) ||
-            bitmap_contains_address(&phys_mem, (void*)(entry->base + entry->length - 1))) {
-            
-            physical_reserve_region(entry->base, entry->length);
+        cursor += zone_metadata_size(blocks, backend);
+    }
+
+    DEBUG_INFO("PMM: %lu zones, %lu KB metadata at 0x%lx\n",
+               zone_count, metadata_size / 1024, metadata_phys);
+
+    // Reserve the metadata itself to prevent it from being allocated
+    physical_reserve_region(metadata_phys, metadata_size);
+
+    // Switch to the buddy backend once the bitmaps reflect all reservations.
+    // The order maps follow each zone's bitmap storage.
+    if (backend == PMM_BACKEND_BUDDY) {
+        for (size_t i = 0; i < zone_count; i++) {
+            pmm_zone_t *zone = &zones[i];
+            uint8_t *order_storage = (uint8_t *)zone->bitmap.bitmap +
+                BITMAP_STORAGE_WORDS(zone->bitmap.total_blocks) * sizeof(uint64_t);
+            buddy_build_from_bitmap(zone, order_storage);
         }
     }
-    
-    // Reserve the bitmap storage itself to prevent it from being allocated
-    physical_reserve_region((uintptr_t)bitmap_storage, sizeof(bitmap_storage));
-    
+    pmm_backend = backend;
+
     return true;
 }
 
+pmm_backend_t physical_get_backend(void) {
+    return pmm_backend;
+}
+
+static void *zone_alloc_pages(pmm_zone_t *zone, size_t count) {
+    void *pages;
+
+    if (pmm_backend == PMM_BACKEND_BUDDY && count <= ((size_t)1 << BUDDY_MAX_ORDER)) {
+        pages = buddy_alloc_blocks(&zone->buddy, count);
+        if (pages) {
+            // Mirror into the bitmap for stats and visualisation
+            bitmap_reserve_blocks(&zone->bitmap, pages, count);
+        }
+    } else if (pmm_backend == PMM_BACKEND_BUDDY) {
+        // Larger than the biggest buddy order: find a run in the bitmap and
+        // carve it out of the buddy free lists
+        pages = bitmap_alloc_blocks(&zone->bitmap, count);
+        if (pages) {
+            buddy_reserve_blocks(&zone->buddy, pages, count);
+        }
+    } else {
+        pages = bitmap_alloc_blocks(&zone->bitmap, count);
+    }
+
+    return pages;
+}
+
 void *physical_alloc_page(void) {
-    void *page = bitmap_alloc_block(&phys_mem);
+    return physical_alloc_pages(1);
+}
+
+void *physical_alloc_pages(size_t count) {
+    return physical_alloc_pages_node(count, NUMA_NO_NODE);
+}
+
+// Try the preferred node's zones first, then the others nearest first.
+// Requires pmm_lock.
+static void *alloc_pages_locked(size_t count, int node) {
+    int nodes = numa_node_count();
+    for (int n = 0; n < nodes; n++) {
+        int candidate = numa_fallback_node(node, n);
+        for (size_t i = 0; i < zone_count; i++) {
+            if (zones[i].node != candidate || bitmap_get_free_blocks(&zones[i].bitmap) < count) {
+                continue;
+            }
+
+            void *pages = zone_alloc_pages(&zones[i], count);
+            if (pages) {
+                used_memory += count * BITMAP_BLOCK_SIZE;
+                return pages;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Give every pooled zeroed page back, under memory pressure. Returns
+// whether there were any.
+static bool zero_pool_drain(void) {
+    bool drained = false;
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+    for (int node = 0; node < numa_node_count(); node++) {
+        zero_pool_t *pool = &zero_pools[node];
+        while (pool->count) {
+            physical_free_pages((void *)pool->pages[--pool->count], 1);
+            drained = true;
+        }
+    }
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+    return drained;
+}
+
+void *physical_alloc_pages_node(size_t count, int node) {
+    if (node < 0 || node >= numa_node_count()) {
+        node = numa_current_node();
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void *pages = alloc_pages_locked(count, node);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (!pages && zero_pool_drain()) {
+        flags = spin_lock_irqsave(&pmm_lock);
+        pages = alloc_pages_locked(count, node);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+    TRACE(TRACE_PMM_ALLOC, count, pages);
+    return pages;
+}
+
+// Clear a page with non-temporal stores: the pool's pages aren't used soon,
+// so there's no point pulling them through the cache. The sfence orders
+// the stores before the page is published to other CPUs.
+static void zero_page_nontemporal(void *page) {
+    uint64_t *p = (uint64_t *)page;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        __asm__ volatile("movnti %1, 0(%0)\n\t"
+                         "movnti %1, 8(%0)\n\t"
+                         "movnti %1, 16(%0)\n\t"
+                         "movnti %1, 24(%0)"
+                         : : "r"(p + i), "r"(0ULL) : "memory");
+    }
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+void *physical_alloc_zeroed_page(void) {
+    zero_pool_t *pool = &zero_pools[numa_current_node()];
+    void *page = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+    if (pool->count) {
+        page = (void *)pool->pages[--pool->count];
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
     if (page) {
-        used_memory += BITMAP_BLOCK_SIZE;
+        return page;
+    }
+
+    // The caller is about to use it, so clear it through the cache
+    page = physical_alloc_page();
+    if (page) {
+        memset((void *)PHYS_TO_HHDM(page), 0, PAGE_SIZE);
     }
     return page;
 }
 
-void *physical_alloc_pages(size_t count) {
-    void *pages = bitmap_alloc_blocks(&phys_mem, count);
-    if (pages) {
-        used_memory += count * BITMAP_BLOCK_SIZE;
+bool physical_zero_pool_wanted(void) {
+    zero_pool_t *pool = &zero_pools[numa_current_node()];
+    return pool->count < PMM_ZERO_POOL_PAGES && !pool->starved;
+}
+
+size_t physical_zero_pool_refill(size_t max_pages) {
+    int node = numa_current_node();
+    zero_pool_t *pool = &zero_pools[node];
+    size_t added = 0;
+
+    while (added < max_pages && pool->count < PMM_ZERO_POOL_PAGES) {
+        // Not physical_alloc_pages_node(): its drain-and-retry would empty
+        // the pools just to zero the same pages again. Out of free pages,
+        // the pool stops here until something is freed.
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        void *page = alloc_pages_locked(1, node);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (!page) {
+            pool->starved = true;
+            break;
+        }
+        zero_page_nontemporal((void *)PHYS_TO_HHDM(page));
+
+        flags = spin_lock_irqsave(&zero_pool_lock);
+        bool room = pool->count < PMM_ZERO_POOL_PAGES;
+        if (room) {
+            pool->pages[pool->count++] = (uintptr_t)page;
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        // Another idle thread on this node filled it first
+        if (!room) {
+            physical_free_pages(page, 1);
+            break;
+        }
+        added++;
     }
-    return pages;
+    return added;
+}
+
+size_t physical_zero_pool_count(void) {
+    size_t count = 0;
+    for (int node = 0; node < numa_node_count(); node++) {
+        count += zero_pools[node].count;
+    }
+    return count;
 }
 
 void physical_free_page(void *page) {
-    if (bitmap_contains_address(&phys_mem, page)) {
-        bitmap_free_block(&phys_mem, page);
-        if (used_memory >= BITMAP_BLOCK_SIZE) {
-            used_memory -= BITMAP_BLOCK_SIZE;
+    physical_free_pages(page, 1);
+}
+
+// Hand runs of pages the bitmap still marks as used back to the buddy
+// allocator, so a double free can't corrupt its free lists
+static void buddy_release(pmm_zone_t *zone, size_t start_block, size_t count) {
+    bitmap_memory_manager_t *bm = &zone->bitmap;
+    size_t end = start_block + count;
+    if (end > bm->total_blocks) {
+        end = bm->total_blocks;
+    }
+
+    size_t block = start_block;
+    while (block < end) {
+        if (!bitmap_test_bit(bm->bitmap, block)) {
+            block++;
+            continue;
+        }
+
+        size_t run_start = block;
+        while (block < end && bitmap_test_bit(bm->bitmap, block)) {
+            block++;
         }
+        buddy_free_blocks(&zone->buddy, bitmap_block_to_address(bm, run_start),
+                          block - run_start);
     }
 }
 
 void physical_free_pages(void *pages, size_t count) {
-    if (bitmap_contains_address(&phys_mem, pages)) {
-        bitmap_free_blocks(&phys_mem, pages, count);
-        if (used_memory >= count * BITMAP_BLOCK_SIZE) {
-            used_memory -= count * BITMAP_BLOCK_SIZE;
-        }
+    pmm_zone_t *zone = zone_for_address(pages);
+    if (!zone) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (pmm_backend == PMM_BACKEND_BUDDY) {
+        buddy_release(zone, bitmap_address_to_block(&zone->bitmap, pages), count);
     }
+    bitmap_free_blocks(&zone->bitmap, pages, count);
+    if (used_memory >= count * BITMAP_BLOCK_SIZE) {
+        used_memory -= count * BITMAP_BLOCK_SIZE;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    // Memory came back, so a starved zeroed pool may be refilled again
+    zero_pools[zone->node].starved = false;
 }
 
 bool physical_reserve_region(uintptr_t base, size_t size) {
-    // Calculate the start and end blocks
-    size_t start_block = bitmap_address_to_block(&phys_mem, (void*)base);
-    size_t end_address = base + size - 1;
-    size_t end_block = bitmap_address_to_block(&phys_mem, (void*)end_address);
-    
-    // Make sure we don't exceed the bitmap bounds
-    if (start_block >= phys_mem.total_blocks) {
+    if (size == 0) {
+        return false;
+    }
+
+    uintptr_t end = base + size;
+    bool reserved = false;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    // A region may straddle several zones; clip it to each one
+    for (size_t i = 0; i < zone_count; i++) {
+        bitmap_memory_manager_t *bm = &zones[i].bitmap;
+        uintptr_t zone_start = bm->memory_base;
+        uintptr_t zone_end = zone_start + bm->total_blocks * BITMAP_BLOCK_SIZE;
+
+        uintptr_t start = base > zone_start ? base : zone_start;
+        uintptr_t stop = end < zone_end ? end : zone_end;
+        if (start >= stop) {
+            continue;
+        }
+
+        // Calculate the start and end blocks
+        size_t start_block = bitmap_address_to_block(bm, (void*)start);
+        size_t end_block = bitmap_address_to_block(bm, (void*)(stop - 1));
+
+        // Mark blocks as used (blocks that are already used are not double counted)
+        void *first = bitmap_block_to_address(bm, start_block);
+        bitmap_reserve_blocks(bm, first, end_block - start_block + 1);
+        if (pmm_backend == PMM_BACKEND_BUDDY) {
+            buddy_reserve_blocks(&zones[i].buddy, first, end_block - start_block + 1);
+        }
+        reserved = true;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return reserved;
+}
+
+// A stretch of one zone that lies on a single node
+typedef struct {
+    uintptr_t base;
+    size_t blocks;
+    int node;
+    size_t source;      // Index of the zone it comes from
+} pmm_piece_t;
+
+static pmm_piece_t pieces[PMM_MAX_ZONES];
+
+// First NUMA range boundary above 'addr', capped at 'limit' (page aligned)
+static uintptr_t next_node_boundary(uintptr_t addr, uintptr_t limit) {
+    for (size_t i = 0; i < numa_mem_range_count(); i++) {
+        const numa_mem_range_t *range = numa_mem_range(i);
+        uintptr_t start = PAGE_ALIGN_UP(range->base);
+        uintptr_t end = PAGE_ALIGN_UP(range->base + range->length);
+        if (start > addr && start < limit) {
+            limit = start;
+        }
+        if (end > addr && end < limit) {
+            limit = end;
+        }
+    }
+    return limit;
+}
+
+// Cut every zone at node boundaries. Returns the number of pieces, or 0 if
+// that would take more than PMM_MAX_ZONES zones.
+static size_t plan_node_pieces(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < zone_count; i++) {
+        bitmap_memory_manager_t *bm = &zones[i].bitmap;
+        uintptr_t addr = bm->memory_base;
+        uintptr_t end = addr + bm->total_blocks * BITMAP_BLOCK_SIZE;
+        size_t first = count;
+
+        while (addr < end) {
+            uintptr_t stop = next_node_boundary(addr, end);
+            int node = numa_node_of_phys(addr);
+            size_t blocks = (stop - addr) / BITMAP_BLOCK_SIZE;
+
+            // Neighbouring SRAT ranges of the same node stay one zone
+            if (count > first && pieces[count - 1].node == node) {
+                pieces[count - 1].blocks += blocks;
+            } else if (count == PMM_MAX_ZONES) {
+                return 0;
+            } else {
+                pieces[count].base = addr;
+                pieces[count].blocks = blocks;
+                pieces[count].node = node;
+                pieces[count].source = i;
+                count++;
+            }
+            addr = stop;
+        }
+    }
+    return count;
+}
+
+// Copy which pages are in use from the zone a piece was cut out of
+static void copy_used_blocks(pmm_zone_t *to, pmm_zone_t *from) {
+    size_t offset = (to->bitmap.memory_base - from->bitmap.memory_base) / BITMAP_BLOCK_SIZE;
+    size_t blocks = to->bitmap.total_blocks;
+
+    size_t block = 0;
+    while (block < blocks) {
+        if (!bitmap_test_bit(from->bitmap.bitmap, offset + block)) {
+            block++;
+            continue;
+        }
+
+        size_t run_start = block;
+        while (block < blocks && bitmap_test_bit(from->bitmap.bitmap, offset + block)) {
+            block++;
+        }
+        bitmap_reserve_blocks(&to->bitmap, bitmap_block_to_address(&to->bitmap, run_start),
+                              block - run_start);
+    }
+}
+
+// Without a usable split every zone belongs to the node its base is on
+static void tag_zones_by_base(void) {
+    for (size_t i = 0; i < zone_count; i++) {
+        zones[i].node = numa_node_of_phys(zones[i].bitmap.memory_base);
+    }
+}
+
+bool physical_memory_init_numa(void) {
+    if (numa_node_count() <= 1) {
+        return true;
+    }
+
+    size_t count = plan_node_pieces();
+    if (count == 0) {
+        DEBUG_WARN("PMM: node boundaries need more than %d zones, zones stay per region\n",
+                   PMM_MAX_ZONES);
+        tag_zones_by_base();
         return false;
     }
-    if (end_block >= phys_mem.total_blocks) {
-        end_block = phys_mem.total_blocks - 1;
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += zone_metadata_size(pieces[i].blocks, pmm_backend);
+    }
+    size = PAGE_ALIGN_UP(size);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    // The new metadata comes out of the old layout, so the copy below keeps
+    // it marked as used. Like the boot metadata it isn't counted as used.
+    void *storage = alloc_pages_locked(size / BITMAP_BLOCK_SIZE, 0);
+    if (!storage) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        DEBUG_WARN("PMM: no memory for per-node zones, zones stay per region\n");
+        tag_zones_by_base();
+        return false;
+    }
+    used_memory -= size;
+
+    uint8_t *cursor = (uint8_t *)PHYS_TO_HHDM(storage);
+    for (size_t i = 0; i < count; i++) {
+        pmm_zone_t *zone = &new_zones[i];
+        bitmap_init(&zone->bitmap, cursor, pieces[i].base, pieces[i].blocks * BITMAP_BLOCK_SIZE);
+        zone->node = pieces[i].node;
+        copy_used_blocks(zone, &zones[pieces[i].source]);
+        cursor += zone_metadata_size(pieces[i].blocks, pmm_backend);
+    }
+
+    // The old metadata is no longer needed
+    for (size_t i = 0; i < count; i++) {
+        bitmap_memory_manager_t *bm = &new_zones[i].bitmap;
+        uintptr_t zone_start = bm->memory_base;
+        uintptr_t zone_end = zone_start + bm->total_blocks * BITMAP_BLOCK_SIZE;
+        uintptr_t start = metadata_phys > zone_start ? metadata_phys : zone_start;
+        uintptr_t stop = metadata_phys + metadata_size < zone_end ? metadata_phys + metadata_size
+                                                                   : zone_end;
+        if (start < stop) {
+            bitmap_free_blocks(bm, (void *)start, (stop - start) / BITMAP_BLOCK_SIZE);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        zones[i] = new_zones[i];
+        if (pmm_backend == PMM_BACKEND_BUDDY) {
+            uint8_t *order_storage = (uint8_t *)zones[i].bitmap.bitmap +
+                BITMAP_STORAGE_WORDS(zones[i].bitmap.total_blocks) * sizeof(uint64_t);
+            buddy_build_from_bitmap(&zones[i], order_storage);
+        }
     }
-    
-    // Mark blocks as used
-    for (size_t block = start_block; block <= end_block; block++) {
-        void *addr = bitmap_block_to_address(&phys_mem, block);
-        bitmap_free_block(&phys_mem, addr); // Ensure it's free first to avoid double counting
-        bitmap_alloc_block(&phys_mem);      // Then mark it as used
+    zone_count = count;
+    metadata_phys = (uintptr_t)storage;
+    metadata_size = size;
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    DEBUG_INFO("PMM: %lu zones over %d nodes, %lu KB metadata at 0x%lx\n",
+               zone_count, numa_node_count(), metadata_size / 1024, metadata_phys);
+    for (int node = 0; node < numa_node_count(); node++) {
+        DEBUG_INFO("PMM:   node %d: %lu MB free\n", node,
+                   physical_get_node_free_memory(node) / (1024 * 1024));
     }
-    
     return true;
 }
 
+size_t physical_get_node_free_memory(int node) {
+    size_t free_blocks = 0;
+    for (size_t i = 0; i < zone_count; i++) {
+        if (zones[i].node == node) {
+            free_blocks += bitmap_get_free_blocks(&zones[i].bitmap);
+        }
+    }
+    return free_blocks * BITMAP_BLOCK_SIZE;
+}
+
 size_t physical_get_total_memory(void) {
     return total_memory;
 }
@@ -149,60 +647,122 @@ size_t physical_get_used_memory(void) {
 }
 
 size_t physical_get_free_memory(void) {
-    return bitmap_get_free_blocks(&phys_mem) * BITMAP_BLOCK_SIZE;
+    size_t free_blocks = 0;
+    for (size_t i = 0; i < zone_count; i++) {
+        free_blocks += bitmap_get_free_blocks(&zones[i].bitmap);
+    }
+    return free_blocks * BITMAP_BLOCK_SIZE;
+}
+
+static size_t physical_get_managed_blocks(void) {
+    size_t blocks = 0;
+    for (size_t i = 0; i < zone_count; i++) {
+        blocks += zones[i].bitmap.total_blocks;
+    }
+    return blocks;
 }
 
 void physical_print_stats(size_t x, size_t y) {
     size_t total_kb = total_memory / 1024;
     size_t used_kb = (used_memory + reserved_memory) / 1024;
     size_t free_kb = physical_get_free_memory() / 1024;
-    
+
     kprintf(x, y, "Memory Stats:");
     kprintf(x, y+=15, "Total: %d KB (%d MB)", total_kb, total_kb / 1024);
     kprintf(x, y+=15, "Used: %d KB (%d MB)", used_kb, used_kb / 1024);
     kprintf(x, y+=15, "Free: %d KB (%d MB)", free_kb, free_kb / 1024);
-    kprintf(x, y+=15, "Managed blocks: %d", phys_mem.total_blocks);
-    kprintf(x, y+=15, "Free blocks: %d", bitmap_get_free_blocks(&phys_mem));
+    kprintf(x, y+=15, "Managed blocks: %d in %d zones (%d KB metadata)",
+            physical_get_managed_blocks(), zone_count, metadata_size / 1024);
+    kprintf(x, y+=15, "Free blocks: %d", physical_get_free_memory() / BITMAP_BLOCK_SIZE);
+    if (pmm_backend == PMM_BACKEND_BUDDY) {
+        int order = -1;
+        for (size_t i = 0; i < zone_count; i++) {
+            int zone_order = buddy_largest_free_order(&zones[i].buddy);
+            if (zone_order > order) {
+                order = zone_order;
+            }
+        }
+        kprintf(x, y+=15, "Backend: buddy, largest free block: %d KB",
+                order < 0 ? 0 : (4 << order));
+    } else {
+        kprintf(x, y+=15, "Backend: bitmap");
+    }
+    uint64_t hits = 0, misses = 0;
+    for (int node = 0; node < numa_node_count(); node++) {
+        hits += zero_pools[node].hits;
+        misses += zero_pools[node].misses;
+    }
+    kprintf(x, y+=15, "Zeroed pool: %d pages, %d hits, %d misses",
+            physical_zero_pool_count(), hits, misses);
+    if (numa_node_count() > 1) {
+        for (int node = 0; node < numa_node_count(); node++) {
+            kprintf(x, y+=15, "Node %d: %d MB free", node,
+                    physical_get_node_free_memory(node) / (1024 * 1024));
+        }
+    }
+}
+
+// Test a block by its index across all zones, laid end to end
+static bool physical_block_used(size_t index) {
+    for (size_t i = 0; i < zone_count; i++) {
+        if (index < zones[i].bitmap.total_blocks) {
+            return bitmap_test_bit(zones[i].bitmap.bitmap, index);
+        }
+        index -= zones[i].bitmap.total_blocks;
+    }
+    return true;
 }
 
 void draw_memory_bitmap(size_t x, size_t y, size_t width, size_t height) {
-    if (!phys_mem.bitmap) return;
-    
-    size_t bitmap_size = phys_mem.total_blocks;
-    size_t pixels_per_bit = (width * height) / bitmap_size;
+    size_t bitmap_size = physical_get_managed_blocks();
+    if (bitmap_size == 0 || width == 0 || height == 0) return;
+
+    // With more blocks than pixels, each cell summarises a group of blocks
+    // and is drawn as used when at least half of them are
+    size_t blocks_per_cell = (bitmap_size + width * height - 1) / (width * height);
+    size_t cells = (bitmap_size + blocks_per_cell - 1) / blocks_per_cell;
+
+    size_t pixels_per_bit = (width * height) / cells;
     if (pixels_per_bit < 1) pixels_per_bit = 1;
-    
+
     size_t bits_per_row = width / pixels_per_bit;
     if (bits_per_row == 0) bits_per_row = 1;
-    
-    size_t rows = (bitmap_size + bits_per_row - 1) / bits_per_row;
+
+    size_t rows = (cells + bits_per_row - 1) / bits_per_row;
     if (rows > height / pixels_per_bit) rows = height / pixels_per_bit;
-    
-    for (size_t i = 0; i < bitmap_size && i < bits_per_row * rows; i++) {
+
+    for (size_t i = 0; i < cells && i < bits_per_row * rows; i++) {
         size_t row = i / bits_per_row;
         size_t col = i % bits_per_row;
-        
+
         // Calculate pixel position
         size_t px = x + col * pixels_per_bit;
         size_t py = y + row * pixels_per_bit;
-        
-        // Check if the bit is set (page is used)
-        bool is_used = bitmap_test_bit(phys_mem.bitmap, i);
-        
+
+        // Count used pages in this cell
+        size_t first = i * blocks_per_cell;
+        size_t last = first + blocks_per_cell;
+        if (last > bitmap_size) last = bitmap_size;
+        size_t used = 0;
+        for (size_t b = first; b < last; b++) {
+            used += physical_block_used(b);
+        }
+        bool is_used = used * 2 >= last - first;
+
         // Choose color: green for free, red for used
         uint32_t color = is_used ? 0xFF0000 : 0x00FF00;
-        
+
         // Draw a small rectangle for each bit
         draw_rect(px, py, pixels_per_bit, pixels_per_bit, 1, color, true);
     }
-    
+
     // Draw a border around the bitmap
     draw_rect(x - 1, y - 1, width + 2, height + 2, 1, 0xFFFFFF, false);
-    
+
     // Draw a legend
     draw_rect(x, y + height + 5, 10, 10, 1, 0x00FF00, true);
     draw_string(x + 15, y + height + 5, "Free", 0xFFFFFF);
-    
+
     draw_rect(x, y + height + 20, 10, 10, 1, 0xFF0000, true);
     draw_string(x + 15, y + height + 20, "Used", 0xFFFFFF);
 }
\ No newline at end of file
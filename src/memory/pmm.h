@@ -6,8 +6,25 @@
 #include <stdbool.h>
 #include <limine.h>
 
-// Initialize the physical memory manager using the memory map from Limine
-bool physical_memory_init(struct limine_memmap_response *memmap);
+// Allocation backends for physical_alloc_pages(). The bitmap is maintained
+// in both modes so draw_memory_bitmap() and the stats keep working.
+typedef enum {
+    PMM_BACKEND_BITMAP,     // First-fit search over the bitmap
+    PMM_BACKEND_BUDDY       // Buddy system free lists, O(log n) alloc/free
+} pmm_backend_t;
+
+// Initialize the physical memory manager using the memory map from Limine.
+// The HHDM offset must already be set when using PMM_BACKEND_BUDDY.
+bool physical_memory_init(struct limine_memmap_response *memmap, pmm_backend_t backend);
+
+// Split the zones at NUMA node boundaries once numa_init() has read the
+// SRAT (which can only be mapped after the VMM is up). Before this, and on
+// single-node machines, every zone is node 0. Returns false if the zones had
+// to stay whole; each is then assigned to the node its base is on.
+bool physical_memory_init_numa(void);
+
+// Backend selected at init
+pmm_backend_t physical_get_backend(void);
 
 // Get information about physical memory
 size_t physical_get_total_memory(void);
@@ -17,9 +34,39 @@ size_t physical_get_free_memory(void);
 // Allocate a single page of physical memory
 void *physical_alloc_page(void);
 
-// Allocate multiple contiguous pages
+// Allocate multiple contiguous pages, preferring the calling CPU's node
 void *physical_alloc_pages(size_t count);
 
+// Allocate contiguous pages on 'node' (NUMA_NO_NODE: the calling CPU's),
+// falling back to the other nodes nearest first
+void *physical_alloc_pages_node(size_t count, int node);
+
+// Pages kept pre-zeroed per node, overridable from the build
+#ifndef PMM_ZERO_POOL_PAGES
+#define PMM_ZERO_POOL_PAGES 256
+#endif
+
+// Pages an idle thread zeroes before looking for work again
+#define PMM_ZERO_REFILL_BATCH 8
+
+// Allocate one zeroed page. Comes from the current node's pre-zeroed pool
+// when it has one, otherwise it is cleared here.
+void *physical_alloc_zeroed_page(void);
+
+// Whether the current node's zeroed pool has room and memory to fill it
+bool physical_zero_pool_wanted(void);
+
+// Zero up to max_pages pages (non-temporal stores) into the current node's
+// pool. Called by the idle threads with interrupts enabled. Returns how many
+// were added.
+size_t physical_zero_pool_refill(size_t max_pages);
+
+// Pages currently waiting in the zeroed pools (counted as used)
+size_t physical_zero_pool_count(void);
+
+// Free memory in the zones of one node
+size_t physical_get_node_free_memory(int node);
+
 // Free a previously allocated page
 void physical_free_page(void *page);
 
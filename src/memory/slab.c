@@ -0,0 +1,202 @@
+#include "slab.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "memory.h"
+
+#define SLAB_PAGE_SIZE 4096
+
+// Offset of the first object in a slab page, rounded so every object stays
+// aligned to at least 16 bytes
+#define SLAB_HEADER_SPACE ((sizeof(slab_t) + 15) & ~(size_t)15)
+
+static slab_cache_t caches[SLAB_NUM_CLASSES];
+static bool slab_initialized = false;
+
+void slab_init(void) {
+    if (slab_initialized) {
+        return;
+    }
+
+    size_t size = SLAB_MIN_OBJECT_SIZE;
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        caches[i].object_size = size;
+        caches[i].partial = NULL;
+        caches[i].full = NULL;
+        caches[i].slab_count = 0;
+        caches[i].objects_in_use = 0;
+        caches[i].total_allocs = 0;
+        caches[i].total_frees = 0;
+        size <<= 1;
+    }
+
+    slab_initialized = true;
+}
+
+int slab_size_to_class(size_t size) {
+    if (size > SLAB_MAX_OBJECT_SIZE) {
+        return -1;
+    }
+
+    int index = 0;
+    size_t class_size = SLAB_MIN_OBJECT_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+static inline slab_t *slab_from_ptr(const void *ptr) {
+    return (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static void slab_list_remove(slab_t **head, slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void slab_list_push(slab_t **head, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+// Grab a fresh page and thread all of its objects onto the free list
+static slab_t *slab_create(int class_index) {
+    void *page = physical_alloc_page();
+    if (!page) {
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t *)PHYS_TO_HHDM(page);
+    size_t object_size = caches[class_index].object_size;
+
+    slab->magic = SLAB_MAGIC;
+    slab->object_size = object_size;
+    slab->in_use = 0;
+    slab->capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SPACE) / object_size;
+    slab->class_index = class_index;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Build the free list back to front so objects are handed out in
+    // ascending address order
+    uint8_t *base = (uint8_t *)slab + SLAB_HEADER_SPACE;
+    void *head = NULL;
+    for (int i = slab->capacity - 1; i >= 0; i--) {
+        void **obj = (void **)(base + (size_t)i * object_size);
+        *obj = head;
+        head = obj;
+    }
+    slab->free_list = head;
+
+    caches[class_index].slab_count++;
+    return slab;
+}
+
+static void slab_destroy(slab_t *slab) {
+    caches[slab->class_index].slab_count--;
+    slab->magic = 0;
+    physical_free_page((void *)HHDM_TO_PHYS(slab));
+}
+
+void *slab_alloc(size_t size) {
+    int class_index = slab_size_to_class(size);
+    if (class_index < 0) {
+        return NULL;
+    }
+
+    if (!slab_initialized) {
+        slab_init();
+    }
+
+    slab_cache_t *cache = &caches[class_index];
+    slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = slab_create(class_index);
+        if (!slab) {
+            return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void **obj = (void **)slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+
+    // Move exhausted slabs off the partial list so allocation stays O(1)
+    if (!slab->free_list) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->objects_in_use++;
+    cache->total_allocs++;
+    return obj;
+}
+
+void slab_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    slab_t *slab = slab_from_ptr(ptr);
+    if (slab->magic != SLAB_MAGIC) {
+        return; // Not a slab object
+    }
+
+    slab_cache_t *cache = &caches[slab->class_index];
+    bool was_full = (slab->free_list == NULL);
+
+    void **obj = (void **)ptr;
+    *obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    cache->objects_in_use--;
+    cache->total_frees++;
+
+    // Give empty slabs back to the page allocator, but keep one around per
+    // class so a single alloc/free pair doesn't thrash the PMM
+    if (slab->in_use == 0 && (slab->next || slab->prev)) {
+        slab_list_remove(&cache->partial, slab);
+        slab_destroy(slab);
+    }
+}
+
+bool slab_owns(const void *ptr) {
+    if (!ptr) {
+        return false;
+    }
+    return slab_from_ptr(ptr)->magic == SLAB_MAGIC;
+}
+
+size_t slab_object_size(const void *ptr) {
+    return slab_from_ptr(ptr)->object_size;
+}
+
+const slab_cache_t *slab_get_cache(int class_index) {
+    if (class_index < 0 || class_index >= SLAB_NUM_CLASSES) {
+        return NULL;
+    }
+    if (!slab_initialized) {
+        slab_init();
+    }
+    return &caches[class_index];
+}
@@ -0,0 +1,60 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Size classes served by the slab allocator (powers of two, 16..1024 bytes).
+// Anything larger goes straight to the page allocator: with the header in
+// the page, a 2048-byte class would fit only one object per slab.
+#define SLAB_MIN_OBJECT_SIZE 16
+#define SLAB_MAX_OBJECT_SIZE 1024
+#define SLAB_NUM_CLASSES     7
+
+#define SLAB_MAGIC 0x51AB51AB
+
+// Header stored at the start of every slab page. Objects are carved out of
+// the remainder of the page.
+typedef struct slab {
+    uint32_t magic;             // SLAB_MAGIC, distinguishes slabs from large allocations
+    uint16_t object_size;       // Size of each object in this slab
+    uint16_t in_use;            // Objects currently handed out
+    uint16_t capacity;          // Total objects carved from this page
+    uint16_t class_index;       // Owning size class
+    void *free_list;            // Singly linked list of free objects
+    struct slab *next;          // Next slab in the class's list
+    struct slab *prev;          // Previous slab in the class's list
+} slab_t;
+
+// Per-class bookkeeping
+typedef struct {
+    size_t object_size;         // Object size for this class
+    slab_t *partial;            // Slabs with at least one free object
+    slab_t *full;               // Slabs with no free objects
+    size_t slab_count;          // Pages currently owned by this class
+    size_t objects_in_use;      // Live objects
+    size_t total_allocs;        // Lifetime allocation count
+    size_t total_frees;         // Lifetime free count
+} slab_cache_t;
+
+// Initialize the size-class caches (safe to call more than once)
+void slab_init(void);
+
+// Map a request size to a class index, or -1 if it is too large for the slab
+int slab_size_to_class(size_t size);
+
+// Allocate/free an object from the slab caches
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+
+// Returns true if ptr lives inside a slab page
+bool slab_owns(const void *ptr);
+
+// Usable size of a slab object (its class size)
+size_t slab_object_size(const void *ptr);
+
+// Access per-class statistics
+const slab_cache_t *slab_get_cache(int class_index);
+
+#endif // SLAB_H
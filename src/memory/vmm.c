@@ -2,6 +2,7 @@
 #include "pmm.h"
 #include "memory.h"
 #include "../debug/debug.h"
+#include "../sched/spinlock.h"
 #include <string.h>
 
 // Current virtual memory context
@@ -11,6 +12,11 @@ static vmm_context_t *current_context = &kernel_context;
 // MMIO allocation tracker
 static uint64_t next_mmio_vaddr = MMIO_VIRTUAL_BASE;
 
+// Kernel page table updates and the MMIO window cursor. Two walks finding
+// the same empty slot would each install a table and lose the other's
+// mappings. Lock order: vmm_lock before the PMM's locks.
+static spinlock_t vmm_lock = SPINLOCK_INIT_NAMED("vmm");
+
 // HHDM (Higher Half Direct Map) offset from Limine
 static uint64_t hhdm_offset = 0;
 
@@ -59,6 +65,58 @@ static void map_kernel_space(void) {
     DEBUG_INFO("Kernel virtual memory mappings already available\n");
 }
 
+// Physical address bits of a table entry (drops flags and the NX bit)
+#define ENTRY_ADDR(entry) ((entry) & 0x000FFFFFFFFFF000ULL)
+
+// 1 GiB page support: -1 = not probed yet, 0 = no, 1 = yes
+static int gbpages_state = -1;
+
+static bool cpu_has_gbpages(void) {
+    if (gbpages_state < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+        gbpages_state = 0;
+        if (eax >= 0x80000001) {
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
+            gbpages_state = (edx >> 26) & 1;  // PDPE1GB
+        }
+    }
+    return gbpages_state == 1;
+}
+
+// Return the table referenced by parent[index], creating it if needed.
+// Fails if the slot already holds a huge page mapping.
+static page_table_t* vmm_next_table(page_table_t *parent, int index) {
+    uint64_t entry = parent->entries[index];
+    
+    if (entry & PAGE_PRESENT) {
+        if (entry & PAGE_HUGE) {
+            DEBUG_ERROR("vmm: slot %d already holds a huge page\n", index);
+            return NULL;
+        }
+        return (page_table_t*)(ENTRY_ADDR(entry) + hhdm_offset);
+    }
+    
+    void *new_page = physical_alloc_zeroed_page();
+    if (!new_page) {
+        DEBUG_ERROR("Failed to allocate page table\n");
+        return NULL;
+    }
+    parent->entries[index] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
+    return (page_table_t*)((uint64_t)new_page + hhdm_offset);
+}
+
+static page_table_t* vmm_kernel_pml4(void) {
+    uint64_t cr3_phys = kernel_context.cr3_value & ~0xFFFULL;
+    return (page_table_t*)(cr3_phys + hhdm_offset);
+}
+
+// Flags allowed in leaf entries
+static uint64_t vmm_leaf_flags(uint64_t flags) {
+    return PAGE_PRESENT | (flags & (PAGE_WRITABLE | PAGE_USER | PAGE_PCD | PAGE_PWT |
+                                    PAGE_GLOBAL | PAGE_NOEXEC));
+}
+
 void* vmm_map_page(uint64_t physical_addr, uint64_t virtual_addr, uint64_t flags) {
     DEBUG_DEBUG("vmm_map_page: phys=0x%lx virt=0x%lx flags=0x%lx\n", 
                physical_addr, virtual_addr, flags);
@@ -68,75 +126,110 @@ void* vmm_map_page(uint64_t physical_addr, uint64_t virtual_addr, uint64_t flags
         return NULL;
     }
     
-    // Get PML4 via HHDM (convert physical CR3 to virtual)
-    uint64_t cr3_phys = kernel_context.cr3_value & ~0xFFFULL;
-    page_table_t *pml4 = (page_table_t*)(cr3_phys + hhdm_offset);
-    
-    // Get page table indices
-    int pml4_idx = PML4_INDEX(virtual_addr);
-    int pdp_idx = PDP_INDEX(virtual_addr);
-    int pd_idx = PD_INDEX(virtual_addr);
-    int pt_idx = PT_INDEX(virtual_addr);
-    
-    // Walk/create PDP
-    page_table_t *pdp;
-    if (pml4->entries[pml4_idx] & PAGE_PRESENT) {
-        uint64_t pdp_phys = pml4->entries[pml4_idx] & ~PAGE_MASK;
-        pdp = (page_table_t*)(pdp_phys + hhdm_offset);
-    } else {
-        void *new_page = physical_alloc_page();
-        if (!new_page) {
-            DEBUG_ERROR("Failed to allocate PDP\n");
-            return NULL;
-        }
-        memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-        pml4->entries[pml4_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-        pdp = (page_table_t*)((uint64_t)new_page + hhdm_offset);
-    }
-    
-    // Walk/create PD
-    page_table_t *pd;
-    if (pdp->entries[pdp_idx] & PAGE_PRESENT) {
-        uint64_t pd_phys = pdp->entries[pdp_idx] & ~PAGE_MASK;
-        pd = (page_table_t*)(pd_phys + hhdm_offset);
-    } else {
-        void *new_page = physical_alloc_page();
-        if (!new_page) {
-            DEBUG_ERROR("Failed to allocate PD\n");
-            return NULL;
-        }
-        memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-        pdp->entries[pdp_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-        pd = (page_table_t*)((uint64_t)new_page + hhdm_offset);
-    }
-    
-    // Walk/create PT
-    page_table_t *pt;
-    if (pd->entries[pd_idx] & PAGE_PRESENT) {
-        uint64_t pt_phys = pd->entries[pd_idx] & ~PAGE_MASK;
-        pt = (page_table_t*)(pt_phys + hhdm_offset);
-    } else {
-        void *new_page = physical_alloc_page();
-        if (!new_page) {
-            DEBUG_ERROR("Failed to allocate PT\n");
-            return NULL;
-        }
-        memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-        pd->entries[pd_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-        pt = (page_table_t*)((uint64_t)new_page + hhdm_offset);
+    // Walk/create PDP, PD and PT
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    page_table_t *pdp = vmm_next_table(vmm_kernel_pml4(), PML4_INDEX(virtual_addr));
+    page_table_t *pd = pdp ? vmm_next_table(pdp, PDP_INDEX(virtual_addr)) : NULL;
+    page_table_t *pt = pd ? vmm_next_table(pd, PD_INDEX(virtual_addr)) : NULL;
+    if (!pt) {
+        spin_unlock_irqrestore(&vmm_lock, irq);
+        return NULL;
     }
     
     // Map the actual page with provided flags
     uint64_t page_flags = PAGE_PRESENT | (flags & (PAGE_WRITABLE | PAGE_USER | PAGE_PCD | PAGE_PWT));
-    pt->entries[pt_idx] = physical_addr | page_flags;
+    pt->entries[PT_INDEX(virtual_addr)] = physical_addr | page_flags;
     
     // Flush TLB for this page
     asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    spin_unlock_irqrestore(&vmm_lock, irq);
     
     DEBUG_DEBUG("vmm_map_page: Mapped phys=0x%lx -> virt=0x%lx\n", physical_addr, virtual_addr);
     return (void*)virtual_addr;
 }
 
+// Requires vmm_lock
+static void* map_range_locked(uint64_t physical_addr, uint64_t virtual_addr, size_t size,
+                              uint64_t flags) {
+    uint64_t leaf = vmm_leaf_flags(flags);
+    uint64_t paddr = physical_addr;
+    uint64_t vaddr = virtual_addr;
+    uint64_t end = virtual_addr + PAGE_ALIGN_UP((uint64_t)size);
+    size_t huge_1g = 0, huge_2m = 0, small = 0;
+    page_table_t *pml4 = vmm_kernel_pml4();
+    
+    while (vaddr < end) {
+        uint64_t remaining = end - vaddr;
+        
+        page_table_t *pdp = vmm_next_table(pml4, PML4_INDEX(vaddr));
+        if (!pdp) return NULL;
+        
+        // 1 GiB page: both addresses aligned, enough left, slot unused
+        uint64_t *pdpe = &pdp->entries[PDP_INDEX(vaddr)];
+        if (cpu_has_gbpages() && remaining >= PAGE_SIZE_1G &&
+            ((paddr | vaddr) & (PAGE_SIZE_1G - 1)) == 0 &&
+            (!(*pdpe & PAGE_PRESENT) || (*pdpe & PAGE_HUGE))) {
+            *pdpe = paddr | leaf | PAGE_HUGE;
+            asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+            paddr += PAGE_SIZE_1G;
+            vaddr += PAGE_SIZE_1G;
+            huge_1g++;
+            continue;
+        }
+        
+        page_table_t *pd = vmm_next_table(pdp, PDP_INDEX(vaddr));
+        if (!pd) return NULL;
+        
+        // 2 MiB page, same rules
+        uint64_t *pde = &pd->entries[PD_INDEX(vaddr)];
+        if (remaining >= PAGE_SIZE_2M &&
+            ((paddr | vaddr) & (PAGE_SIZE_2M - 1)) == 0 &&
+            (!(*pde & PAGE_PRESENT) || (*pde & PAGE_HUGE))) {
+            *pde = paddr | leaf | PAGE_HUGE;
+            asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+            paddr += PAGE_SIZE_2M;
+            vaddr += PAGE_SIZE_2M;
+            huge_2m++;
+            continue;
+        }
+        
+        // 4 KiB pages up to the next 2 MiB boundary (or the end)
+        page_table_t *pt = vmm_next_table(pd, PD_INDEX(vaddr));
+        if (!pt) return NULL;
+        
+        uint64_t pt_end = (vaddr + PAGE_SIZE_2M) & ~(PAGE_SIZE_2M - 1);
+        if (pt_end > end) pt_end = end;
+        while (vaddr < pt_end) {
+            pt->entries[PT_INDEX(vaddr)] = paddr | leaf;
+            asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+            paddr += PAGE_SIZE;
+            vaddr += PAGE_SIZE;
+            small++;
+        }
+    }
+    
+    DEBUG_DEBUG("vmm_map_range: 0x%lx -> 0x%lx, %lu x 1G, %lu x 2M, %lu x 4K\n",
+                physical_addr, virtual_addr, huge_1g, huge_2m, small);
+    return (void*)virtual_addr;
+}
+
+void* vmm_map_range(uint64_t physical_addr, uint64_t virtual_addr, size_t size, uint64_t flags) {
+    if (hhdm_offset == 0) {
+        DEBUG_ERROR("HHDM not initialized! Cannot map range.\n");
+        return NULL;
+    }
+    if ((physical_addr | virtual_addr) & PAGE_MASK) {
+        DEBUG_ERROR("vmm_map_range: unaligned phys=0x%lx virt=0x%lx\n",
+                    physical_addr, virtual_addr);
+        return NULL;
+    }
+    
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    void *mapped = map_range_locked(physical_addr, virtual_addr, size, flags);
+    spin_unlock_irqrestore(&vmm_lock, irq);
+    return mapped;
+}
+
 static page_table_t* get_or_create_table(page_table_t *parent, int index, uint64_t flags) {
     if (parent->entries[index] & PAGE_PRESENT) {
         // Table exists, return it
@@ -172,102 +265,67 @@ void* vmm_map_mmio(uint64_t physical_addr, size_t size) {
         return NULL;
     }
     
-    // Allocate virtual address space for MMIO
+    uint64_t offset = physical_addr & PAGE_MASK;
+    uint64_t paddr = physical_addr - offset;
+    size_t map_size = PAGE_ALIGN_UP(size + offset);
+    
+    // Give large windows the same 2 MiB alignment as their physical address
+    // so vmm_map_range() can use huge pages for them. The window is
+    // reserved and mapped in one go so concurrent probes can't share it.
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
     uint64_t vaddr = next_mmio_vaddr;
-    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    next_mmio_vaddr += pages * PAGE_SIZE;
+    if (map_size >= PAGE_SIZE_2M) {
+        uint64_t phase = paddr & (PAGE_SIZE_2M - 1);
+        vaddr = ((vaddr - phase + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1)) + phase;
+    }
+    next_mmio_vaddr = vaddr + map_size;
     
-    DEBUG_INFO("Allocating MMIO virtual range: 0x%lx - 0x%lx (%zu pages)\n", 
-               vaddr, next_mmio_vaddr, pages);
+    // Map uncached
+    void *mapped = map_range_locked(paddr, vaddr, map_size, PAGE_WRITABLE | PAGE_PCD | PAGE_PWT);
+    spin_unlock_irqrestore(&vmm_lock, irq);
     
+    DEBUG_INFO("Allocating MMIO virtual range: 0x%lx - 0x%lx\n", vaddr, vaddr + map_size);
+    if (!mapped) {
+        DEBUG_ERROR("Failed to map MMIO range\n");
+        return NULL;
+    }
+    
+    DEBUG_INFO("MMIO mapped successfully: phys=0x%lx -> virt=0x%lx\n", physical_addr, vaddr + offset);
+    return (void*)(vaddr + offset);
+}
+
+// Find the leaf entry mapping virtual_addr. Sets *page_size to the size of
+// the page it maps (4K, 2M or 1G). Returns NULL if nothing is mapped.
+static uint64_t* vmm_find_leaf(uint64_t virtual_addr, uint64_t *page_size) {
     // Get PML4 via HHDM (convert physical CR3 to virtual)
-    uint64_t cr3_phys = kernel_context.cr3_value & ~0xFFFULL;
+    uint64_t cr3_phys = current_context->cr3_value & ~0xFFFULL;
     page_table_t *pml4 = (page_table_t*)(cr3_phys + hhdm_offset);
     
-    DEBUG_DEBUG("PML4 at physical 0x%lx, virtual 0x%lx\n", cr3_phys, (uint64_t)pml4);
-    
-    // Map each page
-    for (size_t i = 0; i < pages; i++) {
-        uint64_t paddr = physical_addr + (i * PAGE_SIZE);
-        uint64_t this_vaddr = vaddr + (i * PAGE_SIZE);
-        
-        // Get page table indices
-        int pml4_idx = PML4_INDEX(this_vaddr);
-        int pdp_idx = PDP_INDEX(this_vaddr);
-        int pd_idx = PD_INDEX(this_vaddr);
-        int pt_idx = PT_INDEX(this_vaddr);
-        
-        DEBUG_DEBUG("Mapping page: virt=0x%lx -> phys=0x%lx\n", this_vaddr, paddr);
-        DEBUG_DEBUG("  Indices: PML4=%d, PDP=%d, PD=%d, PT=%d\n", 
-                   pml4_idx, pdp_idx, pd_idx, pt_idx);
-        
-        // Walk/create PDP
-        page_table_t *pdp;
-        if (pml4->entries[pml4_idx] & PAGE_PRESENT) {
-            uint64_t pdp_phys = pml4->entries[pml4_idx] & ~PAGE_MASK;
-            pdp = (page_table_t*)(pdp_phys + hhdm_offset);
-        } else {
-            void *new_page = physical_alloc_page();
-            if (!new_page) {
-                DEBUG_ERROR("Failed to allocate PDP\n");
-                return NULL;
-            }
-            memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-            pml4->entries[pml4_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-            pdp = (page_table_t*)((uint64_t)new_page + hhdm_offset);
-            DEBUG_DEBUG("  Created new PDP at phys 0x%lx\n", (uint64_t)new_page);
-        }
-        
-        // Walk/create PD
-        page_table_t *pd;
-        if (pdp->entries[pdp_idx] & PAGE_PRESENT) {
-            uint64_t pd_phys = pdp->entries[pdp_idx] & ~PAGE_MASK;
-            pd = (page_table_t*)(pd_phys + hhdm_offset);
-        } else {
-            void *new_page = physical_alloc_page();
-            if (!new_page) {
-                DEBUG_ERROR("Failed to allocate PD\n");
-                return NULL;
-            }
-            memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-            pdp->entries[pdp_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-            pd = (page_table_t*)((uint64_t)new_page + hhdm_offset);
-            DEBUG_DEBUG("  Created new PD at phys 0x%lx\n", (uint64_t)new_page);
-        }
-        
-        // Walk/create PT
-        page_table_t *pt;
-        if (pd->entries[pd_idx] & PAGE_PRESENT) {
-            uint64_t pt_phys = pd->entries[pd_idx] & ~PAGE_MASK;
-            pt = (page_table_t*)(pt_phys + hhdm_offset);
-        } else {
-            void *new_page = physical_alloc_page();
-            if (!new_page) {
-                DEBUG_ERROR("Failed to allocate PT\n");
-                return NULL;
-            }
-            memset((void*)((uint64_t)new_page + hhdm_offset), 0, PAGE_SIZE);
-            pd->entries[pd_idx] = (uint64_t)new_page | PAGE_PRESENT | PAGE_WRITABLE;
-            pt = (page_table_t*)((uint64_t)new_page + hhdm_offset);
-            DEBUG_DEBUG("  Created new PT at phys 0x%lx\n", (uint64_t)new_page);
-        }
-        
-        // Map the actual page with cache-disable for MMIO
-        uint64_t page_flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_PCD | PAGE_PWT;
-        pt->entries[pt_idx] = paddr | page_flags;
-        
-        DEBUG_DEBUG("  PT[%d] = 0x%lx (flags: PCD+PWT for uncached MMIO)\n", 
-                   pt_idx, pt->entries[pt_idx]);
+    // Navigate through page tables (using HHDM for all table accesses)
+    uint64_t *entry = &pml4->entries[PML4_INDEX(virtual_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    page_table_t *pdp = (page_table_t*)(ENTRY_ADDR(*entry) + hhdm_offset);
+    
+    entry = &pdp->entries[PDP_INDEX(virtual_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    if (*entry & PAGE_HUGE) {
+        *page_size = PAGE_SIZE_1G;
+        return entry;
     }
+    page_table_t *pd = (page_table_t*)(ENTRY_ADDR(*entry) + hhdm_offset);
     
-    // Flush TLB for the new mappings
-    for (size_t i = 0; i < pages; i++) {
-        uint64_t flush_addr = vaddr + (i * PAGE_SIZE);
-        asm volatile("invlpg (%0)" :: "r"(flush_addr) : "memory");
+    entry = &pd->entries[PD_INDEX(virtual_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    if (*entry & PAGE_HUGE) {
+        *page_size = PAGE_SIZE_2M;
+        return entry;
     }
+    page_table_t *pt = (page_table_t*)(ENTRY_ADDR(*entry) + hhdm_offset);
     
-    DEBUG_INFO("MMIO mapped successfully: phys=0x%lx -> virt=0x%lx\n", physical_addr, vaddr);
-    return (void*)vaddr;
+    entry = &pt->entries[PT_INDEX(virtual_addr)];
+    if (!(*entry & PAGE_PRESENT)) return NULL;
+    *page_size = PAGE_SIZE;
+    return entry;
 }
 
 void vmm_unmap_page(uint64_t virtual_addr) {
@@ -276,42 +334,42 @@ void vmm_unmap_page(uint64_t virtual_addr) {
         return;
     }
     
-    // Get PML4 via HHDM (convert physical CR3 to virtual)
-    uint64_t cr3_phys = current_context->cr3_value & ~0xFFFULL;
-    page_table_t *pml4 = (page_table_t*)(cr3_phys + hhdm_offset);
-    
-    // Extract page table indices
-    int pml4_idx = PML4_INDEX(virtual_addr);
-    int pdp_idx = PDP_INDEX(virtual_addr);
-    int pd_idx = PD_INDEX(virtual_addr);
-    int pt_idx = PT_INDEX(virtual_addr);
-    
-    // Navigate to the page table entry (using HHDM for all table accesses)
-    if (!(pml4->entries[pml4_idx] & PAGE_PRESENT)) return;
-    uint64_t pdp_phys = pml4->entries[pml4_idx] & ~PAGE_MASK;
-    page_table_t *pdp = (page_table_t*)(pdp_phys + hhdm_offset);
-    
-    if (!(pdp->entries[pdp_idx] & PAGE_PRESENT)) return;
-    uint64_t pd_phys = pdp->entries[pdp_idx] & ~PAGE_MASK;
-    page_table_t *pd = (page_table_t*)(pd_phys + hhdm_offset);
+    uint64_t irq = spin_lock_irqsave(&vmm_lock);
+    uint64_t page_size;
+    uint64_t *entry = vmm_find_leaf(virtual_addr, &page_size);
+    if (!entry) {
+        spin_unlock_irqrestore(&vmm_lock, irq);
+        return;
+    }
     
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT)) return;
-    uint64_t pt_phys = pd->entries[pd_idx] & ~PAGE_MASK;
-    page_table_t *pt = (page_table_t*)(pt_phys + hhdm_offset);
+    // Splitting huge pages isn't supported; unmapping any part of one drops
+    // the whole page, so callers should unmap whole huge pages
+    if (page_size != PAGE_SIZE) {
+        DEBUG_WARN("vmm_unmap_page: 0x%lx is inside a %lu KB page, unmapping all of it\n",
+                   virtual_addr, page_size / 1024);
+        virtual_addr &= ~(page_size - 1);
+    }
     
     // Clear the page table entry
-    pt->entries[pt_idx] = 0;
+    *entry = 0;
     
     // Invalidate TLB for this page
     asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    spin_unlock_irqrestore(&vmm_lock, irq);
 }
 
 void vmm_unmap(void *virtual_addr, size_t size) {
     uint64_t virt_start = PAGE_ALIGN((uint64_t)virtual_addr);
     uint64_t virt_end = PAGE_ALIGN_UP((uint64_t)virtual_addr + size);
     
-    for (uint64_t vaddr = virt_start; vaddr < virt_end; vaddr += PAGE_SIZE) {
-        vmm_unmap_page(vaddr);
+    uint64_t vaddr = virt_start;
+    while (vaddr < virt_end) {
+        uint64_t page_size = PAGE_SIZE;
+        if (vmm_find_leaf(vaddr, &page_size)) {
+            vmm_unmap_page(vaddr);
+        }
+        // Step over whole huge pages in one go
+        vaddr = (vaddr & ~(page_size - 1)) + page_size;
     }
 }
 
@@ -321,33 +379,12 @@ uint64_t vmm_get_physical_addr(uint64_t virtual_addr) {
         return 0;
     }
     
-    // Get PML4 via HHDM (convert physical CR3 to virtual)
-    uint64_t cr3_phys = current_context->cr3_value & ~0xFFFULL;
-    page_table_t *pml4 = (page_table_t*)(cr3_phys + hhdm_offset);
-    
-    // Extract page table indices
-    int pml4_idx = PML4_INDEX(virtual_addr);
-    int pdp_idx = PDP_INDEX(virtual_addr);
-    int pd_idx = PD_INDEX(virtual_addr);
-    int pt_idx = PT_INDEX(virtual_addr);
-    
-    // Navigate through page tables (using HHDM for all table accesses)
-    if (!(pml4->entries[pml4_idx] & PAGE_PRESENT)) return 0;
-    uint64_t pdp_phys = pml4->entries[pml4_idx] & ~PAGE_MASK;
-    page_table_t *pdp = (page_table_t*)(pdp_phys + hhdm_offset);
-    
-    if (!(pdp->entries[pdp_idx] & PAGE_PRESENT)) return 0;
-    uint64_t pd_phys = pdp->entries[pdp_idx] & ~PAGE_MASK;
-    page_table_t *pd = (page_table_t*)(pd_phys + hhdm_offset);
-    
-    if (!(pd->entries[pd_idx] & PAGE_PRESENT)) return 0;
-    uint64_t pt_phys = pd->entries[pd_idx] & ~PAGE_MASK;
-    page_table_t *pt = (page_table_t*)(pt_phys + hhdm_offset);
-    
-    if (!(pt->entries[pt_idx] & PAGE_PRESENT)) return 0;
+    uint64_t page_size;
+    uint64_t *entry = vmm_find_leaf(virtual_addr, &page_size);
+    if (!entry) return 0;
     
-    uint64_t phys_page = pt->entries[pt_idx] & ~PAGE_MASK;
-    uint64_t offset = virtual_addr & PAGE_MASK;
+    uint64_t phys_page = ENTRY_ADDR(*entry) & ~(page_size - 1);
+    uint64_t offset = virtual_addr & (page_size - 1);
     
     return phys_page + offset;
 }
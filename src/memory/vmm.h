@@ -10,8 +10,13 @@
 #define PAGE_ALIGN(addr) ((addr) & ~PAGE_MASK)
 #define PAGE_ALIGN_UP(addr) (((addr) + PAGE_MASK) & ~PAGE_MASK)
 
+// Large page sizes used by vmm_map_range()
+#define PAGE_SIZE_2M (1ULL << 21)
+#define PAGE_SIZE_1G (1ULL << 30)
+
 // Virtual memory layout
 #define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ULL
+#define KSTACK_VIRTUAL_BASE 0xFFFFFFFFA0000000ULL  // Guarded thread stacks (sched/kstack.c)
 #define MMIO_VIRTUAL_BASE   0xFFFFFFFFC0000000ULL
 #define USER_VIRTUAL_BASE   0x0000000000400000ULL
 
@@ -47,6 +52,9 @@ int vmm_init(void);
 void* vmm_map_mmio(uint64_t physical_addr, size_t size);
 void vmm_unmap(void *virtual_addr, size_t size);
 void* vmm_map_page(uint64_t physical_addr, uint64_t virtual_addr, uint64_t flags);
+// Map a page-aligned range, using 1 GiB and 2 MiB pages wherever both
+// addresses are suitably aligned and falling back to 4 KiB at the edges
+void* vmm_map_range(uint64_t physical_addr, uint64_t virtual_addr, size_t size, uint64_t flags);
 void vmm_unmap_page(uint64_t virtual_addr);
 uint64_t vmm_get_physical_addr(uint64_t virtual_addr);
 vmm_context_t* vmm_get_current_context(void);
@@ -61,6 +69,7 @@ void vmm_enable_paging(void);
 uint64_t vmm_get_hhdm_offset(void);
 void vmm_set_hhdm_offset(uint64_t offset);
 #define PHYS_TO_HHDM(paddr) ((void*)((uint64_t)(paddr) + vmm_get_hhdm_offset()))
+#define HHDM_TO_PHYS(vaddr) ((uint64_t)(vaddr) - vmm_get_hhdm_offset())
 
 // Page table index extraction
 #define PML4_INDEX(addr) (((addr) >> 39) & 0x1FF)
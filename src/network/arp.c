@@ -1,26 +1,67 @@
 #include "arp.h"
 #include "ethernet.h"
+#include "pbuf.h"
+#include "inet_hash.h"
 #include "../memory/memory.h"
 #include "../timer/timer.h"
+#include "../timer/ktimer.h"
 #include "../debug/debug.h"
+#include "../sched/spinlock.h"
+#include "../sched/workqueue.h"
+
+// Neighbour cache: a fixed pool of entries chained off a seeded hash of the
+// IP address. Unresolved addresses hold a short queue of outgoing packets
+// that is flushed when the reply arrives, and a periodic sweep ages and
+// re-probes entries so the per-packet path never scans the table.
+
+#define ARP_MS_TO_TICKS(ms) ((uint64_t)(ms) * TIMER_FREQUENCY_HZ / 1000)
+#define ARP_SWEEP_BATCH 16          // Requests sent per sweep; the rest wait a period
 
 static arp_entry_t arp_table[ARP_TABLE_SIZE];
+static arp_entry_t *arp_hash[ARP_HASH_SIZE];
+static arp_entry_t *arp_free_list;
 static int arp_table_entries = 0;
+static uint32_t arp_hash_seed;
+static spinlock_t arp_lock = SPINLOCK_INIT_NAMED("arp");
+
+static ktimer_t arp_timer;
+static work_t arp_sweep_work;
 
 // Get current timestamp from timer system
-static uint32_t arp_get_time(void) {
-    return (uint32_t)timer_get_ticks();
+static uint64_t arp_get_time(void) {
+    return timer_get_ticks();
+}
+
+static inline uint32_t arp_bucket(uint32_t ip_address) {
+    return inet_hash_mix(ip_address ^ arp_hash_seed) & (ARP_HASH_SIZE - 1);
+}
+
+static void arp_timer_expired(void *arg) {
+    (void)arg;
+    work_schedule(&arp_sweep_work);
 }
 
+static void arp_sweep(void *arg);
+
 int arp_init(void) {
+    uint64_t now = arp_get_time();
+    arp_hash_seed = inet_hash_mix((uint32_t)timer_get_ns() ^ (uint32_t)now ^ 0x27D4EB2F);
+
     // Initialize ARP table
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        arp_table[i].valid = false;
-        arp_table[i].ip_address = 0;
-        memset(arp_table[i].mac_address, 0, 6);
-        arp_table[i].timestamp = 0;
+    arp_free_list = NULL;
+    for (int i = ARP_TABLE_SIZE - 1; i >= 0; i--) {
+        memset(&arp_table[i], 0, sizeof(arp_table[i]));
+        arp_table[i].hash_next = arp_free_list;
+        arp_free_list = &arp_table[i];
+    }
+    for (int i = 0; i < ARP_HASH_SIZE; i++) {
+        arp_hash[i] = NULL;
     }
     arp_table_entries = 0;
+
+    work_init(&arp_sweep_work, arp_sweep, NULL);
+    ktimer_setup(&arp_timer, arp_timer_expired, NULL);
+    ktimer_add(&arp_timer, now + ARP_MS_TO_TICKS(ARP_SWEEP_MS));
     return NET_SUCCESS;
 }
 
@@ -72,6 +113,158 @@ int arp_send_reply(network_interface_t *iface, uint32_t target_ip, uint8_t *targ
     return ethernet_send_frame(iface, target_mac, ETH_TYPE_ARP, &arp_reply, sizeof(arp_reply));
 }
 
+int arp_send_gratuitous(network_interface_t *iface) {
+    if (!iface || iface->ip_address == 0) {
+        return NET_INVALID_PARAM;
+    }
+
+    // A broadcast request for our own address: neighbours that already
+    // know us refresh their entry, and a duplicate owner would answer
+    arp_header_t arp_req;
+    uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+    arp_req.hardware_type = __builtin_bswap16(ARP_HARDWARE_ETHERNET);
+    arp_req.protocol_type = __builtin_bswap16(ARP_PROTOCOL_IP);
+    arp_req.hardware_len = 6;
+    arp_req.protocol_len = 4;
+    arp_req.operation = __builtin_bswap16(ARP_REQUEST);
+
+    memcpy(arp_req.sender_mac, iface->mac_address, 6);
+    arp_req.sender_ip = __builtin_bswap32(iface->ip_address);
+    memset(arp_req.target_mac, 0, 6);
+    arp_req.target_ip = __builtin_bswap32(iface->ip_address);
+
+    return ethernet_send_frame(iface, broadcast_mac, ETH_TYPE_ARP, &arp_req, sizeof(arp_req));
+}
+
+// Cache internals. All of these require arp_lock.
+
+static arp_entry_t *find_locked(uint32_t ip_address) {
+    for (arp_entry_t *e = arp_hash[arp_bucket(ip_address)]; e; e = e->hash_next) {
+        if (e->ip_address == ip_address) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Hand back an entry's queued packets and empty the queue
+static struct pbuf *detach_queue_locked(arp_entry_t *e) {
+    pbuf_t *q = e->queue_head;
+    e->queue_head = NULL;
+    e->queue_tail = NULL;
+    e->queue_len = 0;
+    return q;
+}
+
+// Unhash an entry and return it to the pool. Its queue is appended to
+// '*dropped' for the caller to free once the lock is released.
+static void remove_locked(arp_entry_t *e, pbuf_t **dropped) {
+    arp_entry_t **link = &arp_hash[arp_bucket(e->ip_address)];
+    while (*link && *link != e) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = e->hash_next;
+    }
+
+    if (e->iface && e->queue_len > 0) {
+        NETIF_STAT_ADD(e->iface, tx_dropped, e->queue_len);
+    }
+    pbuf_t *q = detach_queue_locked(e);
+    if (q) {
+        pbuf_t *tail = q;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = *dropped;
+        *dropped = q;
+    }
+
+    e->state = ARP_STATE_FREE;
+    e->iface = NULL;
+    e->hash_next = arp_free_list;
+    arp_free_list = e;
+    arp_table_entries--;
+}
+
+// Take a free entry, evicting the least recently confirmed one if the pool
+// is exhausted. Resolved entries are evicted before pending ones.
+static arp_entry_t *alloc_locked(uint32_t ip_address, pbuf_t **dropped) {
+    if (!arp_free_list) {
+        arp_entry_t *victim = NULL;
+        for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+            arp_entry_t *e = &arp_table[i];
+            if (!victim ||
+                (victim->state == ARP_STATE_INCOMPLETE && e->state != ARP_STATE_INCOMPLETE) ||
+                ((victim->state == ARP_STATE_INCOMPLETE) == (e->state == ARP_STATE_INCOMPLETE) &&
+                 e->timestamp < victim->timestamp)) {
+                victim = e;
+            }
+        }
+        remove_locked(victim, dropped);
+    }
+
+    arp_entry_t *e = arp_free_list;
+    arp_free_list = e->hash_next;
+
+    uint32_t bucket = arp_bucket(ip_address);
+    e->ip_address = ip_address;
+    e->hash_next = arp_hash[bucket];
+    arp_hash[bucket] = e;
+    arp_table_entries++;
+    return e;
+}
+
+// Record a confirmed mapping, creating the entry if 'create'. Returns the
+// entry (NULL if absent and not created) with its pending queue detached
+// into '*flush'.
+static arp_entry_t *confirm_locked(uint32_t ip_address, const uint8_t *mac_address,
+                                   network_interface_t *iface, bool create,
+                                   pbuf_t **flush, pbuf_t **dropped) {
+    arp_entry_t *e = find_locked(ip_address);
+    if (!e) {
+        if (!create) {
+            return NULL;
+        }
+        e = alloc_locked(ip_address, dropped);
+        e->iface = NULL;
+    }
+
+    memcpy(e->mac_address, mac_address, 6);
+    e->state = ARP_STATE_REACHABLE;
+    e->probes = 0;
+    e->timestamp = arp_get_time();
+    if (iface) {
+        e->iface = iface;
+    }
+    *flush = detach_queue_locked(e);
+    return e;
+}
+
+static void free_chain(pbuf_t *p) {
+    while (p) {
+        pbuf_t *next = p->next;
+        p->next = NULL;
+        pbuf_free(p);
+        p = next;
+    }
+}
+
+// Send packets that were waiting on a now-resolved address
+static void flush_queue(network_interface_t *iface, const uint8_t *mac_address, pbuf_t *p) {
+    while (p) {
+        pbuf_t *next = p->next;
+        p->next = NULL;
+        if (iface) {
+            ethernet_send_pbuf(iface, mac_address, ETH_TYPE_IP, p);
+        } else {
+            pbuf_free(p);
+        }
+        p = next;
+    }
+}
+
 void arp_process_packet(network_interface_t *iface, arp_header_t *arp_hdr) {
     if (!iface || !arp_hdr) {
         return;
@@ -82,11 +275,33 @@ void arp_process_packet(network_interface_t *iface, arp_header_t *arp_hdr) {
     uint32_t sender_ip = __builtin_bswap32(arp_hdr->sender_ip);
     uint32_t target_ip = __builtin_bswap32(arp_hdr->target_ip);
 
-    // Update ARP table with sender info
-    arp_update_entry(sender_ip, arp_hdr->sender_mac);
+    bool for_us = iface->ip_address != 0 && target_ip == iface->ip_address;
+
+    // RFC 826 merge: always refresh an entry we already hold, which also
+    // covers gratuitous announcements (sender_ip == target_ip), but only
+    // create one when the packet was meant for us. Address probes carry a
+    // zero sender and teach us nothing.
+    if (sender_ip != 0 && sender_ip != iface->ip_address) {
+        pbuf_t *flush = NULL;
+        pbuf_t *dropped = NULL;
+        uint8_t mac[6];
+        network_interface_t *out = NULL;
+
+        uint64_t flags = spin_lock_irqsave(&arp_lock);
+        arp_entry_t *e = confirm_locked(sender_ip, arp_hdr->sender_mac, iface, for_us,
+                                        &flush, &dropped);
+        if (e) {
+            memcpy(mac, e->mac_address, 6);
+            out = e->iface;
+        }
+        spin_unlock_irqrestore(&arp_lock, flags);
+
+        free_chain(dropped);
+        flush_queue(out, mac, flush);
+    }
 
     // Check if the request is for our IP
-    if (target_ip == iface->ip_address) {
+    if (for_us) {
         if (operation == ARP_REQUEST) {
             // Send ARP reply
             arp_send_reply(iface, sender_ip, arp_hdr->sender_mac);
@@ -94,54 +309,139 @@ void arp_process_packet(network_interface_t *iface, arp_header_t *arp_hdr) {
     }
 }
 
-bool arp_lookup(uint32_t ip_address, uint8_t *mac_address) {
-    if (!mac_address) {
+// Copy out a resolved mapping, starting a background refresh if it has
+// gone stale. Requires arp_lock; returns whether a request should be sent.
+static bool use_entry_locked(arp_entry_t *e, network_interface_t *iface, uint8_t *mac, uint64_t now) {
+    memcpy(mac, e->mac_address, 6);
+    if (e->state == ARP_STATE_STALE &&
+        now - e->probe_time >= ARP_MS_TO_TICKS(ARP_RETRY_MS)) {
+        e->probe_time = now;
+        e->iface = iface;
+        return true;
+    }
+    return false;
+}
+
+bool arp_resolve(network_interface_t *iface, uint32_t next_hop, uint8_t *mac_address) {
+    if (!iface || !mac_address) {
         return false;
     }
 
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid && arp_table[i].ip_address == ip_address) {
-            memcpy(mac_address, arp_table[i].mac_address, 6);
-            return true;
-        }
+    bool found = false;
+    bool send_request = false;
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    arp_entry_t *e = find_locked(next_hop);
+    if (e && e->state != ARP_STATE_INCOMPLETE) {
+        send_request = use_entry_locked(e, iface, mac_address, arp_get_time());
+        found = true;
     }
-    return false;
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    if (send_request) {
+        arp_send_request(iface, next_hop);
+    }
+    return found;
 }
 
-int arp_add_entry(uint32_t ip_address, uint8_t *mac_address) {
-    if (!mac_address) {
+int arp_output(network_interface_t *iface, uint32_t next_hop, pbuf_t *p) {
+    if (!iface || !p) {
+        pbuf_free(p);
         return NET_INVALID_PARAM;
     }
 
-    // Find empty slot or oldest entry
-    int slot = -1;
-    uint32_t oldest_time = arp_get_time();
-    
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (!arp_table[i].valid) {
-            slot = i;
-            break;
-        }
-        if (arp_table[i].timestamp < oldest_time) {
-            oldest_time = arp_table[i].timestamp;
-            slot = i;
+    uint8_t mac[6];
+    bool send_request = false;
+    pbuf_t *dropped = NULL;
+    uint64_t now = arp_get_time();
+
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    arp_entry_t *e = find_locked(next_hop);
+
+    if (e && e->state != ARP_STATE_INCOMPLETE) {
+        // A stale mapping is still used while it is refreshed
+        send_request = use_entry_locked(e, iface, mac, now);
+        spin_unlock_irqrestore(&arp_lock, flags);
+
+        if (send_request) {
+            arp_send_request(iface, next_hop);
         }
+        return ethernet_send_pbuf(iface, mac, ETH_TYPE_IP, p);
+    }
+
+    if (!e) {
+        e = alloc_locked(next_hop, &dropped);
+        e->state = ARP_STATE_INCOMPLETE;
+        e->probes = 1;
+        e->timestamp = now;
+        e->probe_time = now;
+        send_request = true;
     }
+    e->iface = iface;
 
-    if (slot == -1) {
-        return NET_ERROR; // Table full
+    // Park the packet, dropping the oldest if the queue is full
+    p->next = NULL;
+    if (e->queue_len >= ARP_QUEUE_LEN) {
+        pbuf_t *old = e->queue_head;
+        e->queue_head = old->next;
+        e->queue_len--;
+        old->next = dropped;
+        dropped = old;
+        NETIF_STAT_INC(iface, tx_dropped);
     }
+    if (e->queue_head) {
+        e->queue_tail->next = p;
+    } else {
+        e->queue_head = p;
+    }
+    e->queue_tail = p;
+    e->queue_len++;
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    free_chain(dropped);
+    if (send_request) {
+        arp_send_request(iface, next_hop);
+    }
+    return NET_SUCCESS;
+}
+
+bool arp_lookup(uint32_t ip_address, uint8_t *mac_address) {
+    if (!mac_address) {
+        return false;
+    }
+
+    bool found = false;
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    arp_entry_t *e = find_locked(ip_address);
+    if (e && e->state != ARP_STATE_INCOMPLETE) {
+        memcpy(mac_address, e->mac_address, 6);
+        found = true;
+    }
+    spin_unlock_irqrestore(&arp_lock, flags);
+    return found;
+}
+
+// Insert or refresh a mapping and flush anything queued behind it
+static void update_mapping(uint32_t ip_address, uint8_t *mac_address) {
+    pbuf_t *flush = NULL;
+    pbuf_t *dropped = NULL;
+    uint8_t mac[6];
+
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    arp_entry_t *e = confirm_locked(ip_address, mac_address, NULL, true, &flush, &dropped);
+    network_interface_t *out = e->iface;
+    memcpy(mac, e->mac_address, 6);
+    spin_unlock_irqrestore(&arp_lock, flags);
 
-    // Add entry
-    arp_table[slot].ip_address = ip_address;
-    memcpy(arp_table[slot].mac_address, mac_address, 6);
-    arp_table[slot].timestamp = arp_get_time();
-    arp_table[slot].valid = true;
+    free_chain(dropped);
+    flush_queue(out, mac, flush);
+}
 
-    if (slot >= arp_table_entries) {
-        arp_table_entries = slot + 1;
+int arp_add_entry(uint32_t ip_address, uint8_t *mac_address) {
+    if (!mac_address) {
+        return NET_INVALID_PARAM;
     }
 
+    update_mapping(ip_address, mac_address);
     return NET_SUCCESS;
 }
 
@@ -150,33 +450,85 @@ void arp_update_entry(uint32_t ip_address, uint8_t *mac_address) {
         return;
     }
 
-    // Check if entry exists
+    update_mapping(ip_address, mac_address);
+}
+
+// Periodic aging: retry or give up on pending entries, mark old ones stale
+// and drop those nobody has confirmed in ARP_EXPIRE_MS
+static void arp_sweep(void *arg) {
+    (void)arg;
+    network_interface_t *probe_iface[ARP_SWEEP_BATCH];
+    uint32_t probe_ip[ARP_SWEEP_BATCH];
+    int probes = 0;
+    pbuf_t *dropped = NULL;
+    uint64_t now = arp_get_time();
+
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
     for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid && arp_table[i].ip_address == ip_address) {
-            memcpy(arp_table[i].mac_address, mac_address, 6);
-            arp_table[i].timestamp = arp_get_time();
-            return;
+        arp_entry_t *e = &arp_table[i];
+        switch (e->state) {
+            case ARP_STATE_INCOMPLETE:
+                if (now - e->probe_time < ARP_MS_TO_TICKS(ARP_RETRY_MS)) {
+                    break;
+                }
+                if (e->probes >= ARP_MAX_PROBES) {
+                    remove_locked(e, &dropped);
+                } else if (probes < ARP_SWEEP_BATCH) {
+                    e->probes++;
+                    e->probe_time = now;
+                    probe_iface[probes] = e->iface;
+                    probe_ip[probes] = e->ip_address;
+                    probes++;
+                }
+                break;
+
+            case ARP_STATE_REACHABLE:
+                if (now - e->timestamp >= ARP_MS_TO_TICKS(ARP_REACHABLE_MS)) {
+                    e->state = ARP_STATE_STALE;
+                }
+                break;
+
+            case ARP_STATE_STALE:
+                if (now - e->timestamp >= ARP_MS_TO_TICKS(ARP_EXPIRE_MS)) {
+                    remove_locked(e, &dropped);
+                }
+                break;
+
+            default:
+                break;
         }
     }
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    free_chain(dropped);
+    for (int i = 0; i < probes; i++) {
+        arp_send_request(probe_iface[i], probe_ip[i]);
+    }
 
-    // Entry doesn't exist, add it
-    arp_add_entry(ip_address, mac_address);
+    ktimer_add(&arp_timer, arp_get_time() + ARP_MS_TO_TICKS(ARP_SWEEP_MS));
 }
 
 void arp_print_table(void) {
+    static const char *const state_names[] = { "free", "incomplete", "reachable", "stale" };
+
     DEBUG_INFO("=== ARP Table ===\n");
     DEBUG_INFO("Entries: %d\n", arp_table_entries);
-    
+
+    uint64_t now = arp_get_time();
     for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid) {
-            uint32_t ip = arp_table[i].ip_address;
-            uint8_t *mac = arp_table[i].mac_address;
-            DEBUG_INFO("  %d.%d.%d.%d -> %02x:%02x:%02x:%02x:%02x:%02x (age: %u)\n",
-                      (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
-                      (ip >> 8) & 0xFF, ip & 0xFF,
-                      mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-                      arp_get_time() - arp_table[i].timestamp);
+        arp_entry_t *e = &arp_table[i];
+        if (e->state == ARP_STATE_FREE) {
+            continue;
         }
+        uint32_t ip = e->ip_address;
+        uint8_t *mac = e->mac_address;
+        DEBUG_INFO("  %d.%d.%d.%d -> %02x:%02x:%02x:%02x:%02x:%02x %s (age: %lu ms, queued: %u)\n",
+                  (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
+                  (ip >> 8) & 0xFF, ip & 0xFF,
+                  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                  state_names[e->state],
+                  (now - e->timestamp) * 1000 / TIMER_FREQUENCY_HZ,
+                  (unsigned)e->queue_len);
     }
     DEBUG_INFO("=== End ARP Table ===\n");
 }
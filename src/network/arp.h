@@ -12,6 +12,15 @@
 #define ARP_REQUEST 1
 #define ARP_REPLY 2
 #define ARP_TABLE_SIZE 128
+#define ARP_HASH_SIZE 64            // Buckets, power of two
+
+// Neighbour cache timing
+#define ARP_REACHABLE_MS 60000      // Confirmed entries go stale after this
+#define ARP_EXPIRE_MS 300000        // Unconfirmed entries are dropped after this
+#define ARP_RETRY_MS 1000           // Minimum gap between requests for one address
+#define ARP_MAX_PROBES 3            // Unanswered requests before giving up
+#define ARP_QUEUE_LEN 4             // Packets held per unresolved address
+#define ARP_SWEEP_MS 1000           // Aging timer period
 
 // ARP header
 typedef struct __attribute__((packed)) arp_header {
@@ -26,12 +35,27 @@ typedef struct __attribute__((packed)) arp_header {
     uint32_t target_ip;
 } arp_header_t;
 
+// Neighbour cache entry states
+typedef enum {
+    ARP_STATE_FREE = 0,
+    ARP_STATE_INCOMPLETE,           // Request sent, packets queued behind it
+    ARP_STATE_REACHABLE,            // Confirmed within ARP_REACHABLE_MS
+    ARP_STATE_STALE,                // Usable, but the next use sends a refresh
+} arp_state_t;
+
 // ARP table entry
 typedef struct arp_entry {
+    struct arp_entry *hash_next;
     uint32_t ip_address;
     uint8_t mac_address[6];
-    uint32_t timestamp;
-    bool valid;
+    uint8_t state;                  // arp_state_t
+    uint8_t probes;                 // Requests sent since the last confirmation
+    uint64_t timestamp;             // Tick of the last confirmation
+    uint64_t probe_time;            // Tick of the last request
+    network_interface_t *iface;     // Where requests and queued packets go
+    struct pbuf *queue_head;        // Packets awaiting resolution, oldest first
+    struct pbuf *queue_tail;
+    uint8_t queue_len;
 } arp_entry_t;
 
 // Function prototypes
@@ -39,6 +63,14 @@ int arp_init(void);
 int arp_send_request(network_interface_t *iface, uint32_t target_ip);
 int arp_send_reply(network_interface_t *iface, uint32_t target_ip, uint8_t *target_mac);
 void arp_process_packet(network_interface_t *iface, arp_header_t *arp_hdr);
+int arp_send_gratuitous(network_interface_t *iface);
+// Send an IP packet to a next hop on 'iface', resolving its MAC first. On a
+// cache miss the packet is queued and sent once the reply arrives. Takes
+// ownership of 'p'.
+int arp_output(network_interface_t *iface, uint32_t next_hop, struct pbuf *p);
+// Look up a next hop's MAC for a caller that sends itself, refreshing a
+// stale entry in the background. Returns false if it isn't resolved.
+bool arp_resolve(network_interface_t *iface, uint32_t next_hop, uint8_t *mac_address);
 bool arp_lookup(uint32_t ip_address, uint8_t *mac_address);
 int arp_add_entry(uint32_t ip_address, uint8_t *mac_address);
 void arp_update_entry(uint32_t ip_address, uint8_t *mac_address);
@@ -0,0 +1,89 @@
+#include "checksum.h"
+
+// Unaligned loads: headers land at odd offsets behind the 14-byte
+// Ethernet header, and x86 handles that natively
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+typedef uint16_t __attribute__((may_alias, aligned(1))) unaligned_u16;
+
+// Squash the 64-bit accumulator back into a 32-bit partial sum
+static inline uint32_t fold64(uint64_t acc) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+// 32-bit words go into a 64-bit accumulator, so carries pile up in the
+// upper half instead of being folded on every add; 2^32 words would be
+// needed to overflow it. Summing 32-bit words and folding gives the same
+// result as summing 16-bit words, because 2^16 = 1 mod 0xFFFF.
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum) {
+    const uint8_t *p = data;
+    uint64_t acc = sum;
+
+    while (len >= 32) {
+        const unaligned_u32 *w = (const unaligned_u32 *)p;
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        acc += (uint64_t)w[4] + w[5] + w[6] + w[7];
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 4) {
+        acc += *(const unaligned_u32 *)p;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        acc += *(const unaligned_u16 *)p;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        // Odd byte: the high-order byte of a zero-padded word
+        acc += *p;
+    }
+
+    return fold64(acc);
+}
+
+uint32_t csum_partial_copy(const void *src, void *dst, size_t len, uint32_t sum) {
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    uint64_t acc = sum;
+
+    while (len >= 16) {
+        uint32_t w0 = ((const unaligned_u32 *)s)[0];
+        uint32_t w1 = ((const unaligned_u32 *)s)[1];
+        uint32_t w2 = ((const unaligned_u32 *)s)[2];
+        uint32_t w3 = ((const unaligned_u32 *)s)[3];
+        ((unaligned_u32 *)d)[0] = w0;
+        ((unaligned_u32 *)d)[1] = w1;
+        ((unaligned_u32 *)d)[2] = w2;
+        ((unaligned_u32 *)d)[3] = w3;
+        acc += (uint64_t)w0 + w1 + w2 + w3;
+        s += 16;
+        d += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        uint32_t w = *(const unaligned_u32 *)s;
+        *(unaligned_u32 *)d = w;
+        acc += w;
+        s += 4;
+        d += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w = *(const unaligned_u16 *)s;
+        *(unaligned_u16 *)d = w;
+        acc += w;
+        s += 2;
+        d += 2;
+        len -= 2;
+    }
+    if (len) {
+        *d = *s;
+        acc += *s;
+    }
+
+    return fold64(acc);
+}
@@ -0,0 +1,48 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Internet checksum (RFC 1071) shared by IP, ICMP, TCP and UDP.
+//
+// Partial sums are 32-bit one's-complement accumulators over 16-bit words
+// in memory order, so they can be chained across pieces (pseudo header,
+// transport header, payload) and folded once at the end. Every piece but
+// the last must have even length.
+
+// Add 'len' bytes at 'data' to the partial sum 'sum'
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum);
+
+// Same as csum_partial, while copying the bytes to 'dst'
+uint32_t csum_partial_copy(const void *src, void *dst, size_t len, uint32_t sum);
+
+// Combine two partial sums
+static inline uint32_t csum_add(uint32_t a, uint32_t b) {
+    uint32_t sum = a + b;
+    return sum + (sum < a);
+}
+
+// Fold a partial sum to 16 bits and complement it: the value that goes in
+// a checksum field. Summing data that includes a valid checksum folds to 0.
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Incremental update (RFC 1624, eqn. 3): the new checksum after one 16-bit
+// word covered by 'check' changes from 'old_word' to 'new_word'. Words are
+// in memory order, as read straight out of the header.
+static inline uint16_t csum_update16(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = (uint16_t)~check + (uint16_t)~old_word + new_word;
+    return csum_fold(sum);
+}
+
+// Same for a 32-bit field such as an address
+static inline uint16_t csum_update32(uint16_t check, uint32_t old_value, uint32_t new_value) {
+    check = csum_update16(check, (uint16_t)old_value, (uint16_t)new_value);
+    return csum_update16(check, (uint16_t)(old_value >> 16), (uint16_t)(new_value >> 16));
+}
+
+#endif // CHECKSUM_H
@@ -3,6 +3,8 @@
 #include "udp.h"
 #include "ip.h"
 #include "ethernet.h"
+#include "arp.h"
+#include "route.h"
 #include "../debug/debug.h"
 #include "../timer/timer.h"
 #include <stddef.h>
@@ -14,6 +16,11 @@
 #define DHCP_CLIENT_PORT 68
 #define DHCP_SERVER_PORT 67
 
+#define DHCP_MS_TO_TICKS(ms) ((uint64_t)(ms) * TIMER_FREQUENCY_HZ / 1000)
+
+// Lease time meaning "never expires"
+#define DHCP_LEASE_INFINITE 0xFFFFFFFF
+
 // Global DHCP clients (one per interface)
 static dhcp_client_t dhcp_clients[MAX_NETWORK_INTERFACES];
 static int dhcp_client_count = 0;
@@ -26,6 +33,53 @@ static uint32_t dhcp_get_time(void) {
     return timer_get_seconds();
 }
 
+// ============== Timers ==============
+// A single timer per client. Its callback runs in interrupt context, so it
+// only queues the state machine on the work queue.
+
+static void dhcp_timeout(void *arg);
+
+static void dhcp_timer_expired(void *arg) {
+    dhcp_client_t *client = (dhcp_client_t *)arg;
+    work_schedule(&client->timer_work);
+}
+
+static void dhcp_arm_ms(dhcp_client_t *client, uint64_t ms) {
+    ktimer_add(&client->timer, timer_get_ticks() + DHCP_MS_TO_TICKS(ms));
+}
+
+// Retransmit delay after 'retries' unanswered messages
+static uint64_t dhcp_backoff_ms(uint32_t retries) {
+    uint64_t ms = DHCP_RETRANSMIT_MIN_MS;
+    while (retries-- > 0 && ms < DHCP_RETRANSMIT_MAX_MS) {
+        ms *= 2;
+    }
+    if (ms > DHCP_RETRANSMIT_MAX_MS) {
+        ms = DHCP_RETRANSMIT_MAX_MS;
+    }
+    // Spread out clients that started together (e.g. after a power cut)
+    uint64_t jitter = timer_get_ns() % (2 * DHCP_RETRANSMIT_JITTER_MS + 1);
+    return ms + jitter - DHCP_RETRANSMIT_JITTER_MS;
+}
+
+// Tick at which 'seconds' of the lease have passed
+static uint64_t dhcp_lease_tick(dhcp_client_t *client, uint32_t seconds) {
+    return client->lease_start_tick + DHCP_MS_TO_TICKS((uint64_t)seconds * 1000);
+}
+
+// Next REQUEST while renewing or rebinding: halfway to 'deadline', but no
+// sooner than DHCP_RENEW_MIN_WAIT_MS (and never past the deadline)
+static void dhcp_arm_until(dhcp_client_t *client, uint64_t deadline) {
+    uint64_t now = timer_get_ticks();
+    uint64_t left = deadline > now ? deadline - now : 0;
+    uint64_t wait = left / 2;
+    if (wait < DHCP_MS_TO_TICKS(DHCP_RENEW_MIN_WAIT_MS)) {
+        wait = left < DHCP_MS_TO_TICKS(DHCP_RENEW_MIN_WAIT_MS) ? left
+                                                              : DHCP_MS_TO_TICKS(DHCP_RENEW_MIN_WAIT_MS);
+    }
+    ktimer_add(&client->timer, now + wait);
+}
+
 uint32_t dhcp_generate_xid(void) {
     return dhcp_xid_counter++;
 }
@@ -57,7 +111,13 @@ int dhcp_client_init(network_interface_t *iface) {
     client->renewal_time = 0;
     client->rebinding_time = 0;
     client->lease_start_time = 0;
+    client->lease_start_tick = 0;
+    client->retries = 0;
+    client->enabled = false;
     client->active = false;
+    mutex_init(&client->lock);
+    work_init(&client->timer_work, dhcp_timeout, client);
+    ktimer_setup(&client->timer, dhcp_timer_expired, client);
     
     return 0;
 }
@@ -160,6 +220,12 @@ int dhcp_client_request(dhcp_client_t *client) {
         return -1;
     }
     
+    // Extending a lease we hold (RFC 2131 4.3.2): the address goes in
+    // ciaddr, without requested-IP/server-ID options, unicast to the
+    // server that granted it while renewing and broadcast once rebinding
+    bool extending = client->state == DHCP_STATE_RENEWING ||
+                     client->state == DHCP_STATE_REBINDING;
+    
     dhcp_packet_t packet = {0};
     
     // Fill DHCP header
@@ -169,8 +235,8 @@ int dhcp_client_request(dhcp_client_t *client) {
     packet.hops = 0;
     packet.xid = htonl(client->transaction_id);
     packet.secs = 0;
-    packet.flags = htons(0x8000); // Broadcast flag
-    packet.ciaddr = 0;  // Client IP
+    packet.flags = extending ? 0 : htons(0x8000); // Broadcast flag
+    packet.ciaddr = extending ? htonl(client->offered_ip) : 0;  // Client IP
     packet.yiaddr = 0;  // Your IP
     packet.siaddr = 0;  // Server IP
     packet.giaddr = 0;  // Gateway IP
@@ -186,13 +252,15 @@ int dhcp_client_request(dhcp_client_t *client) {
     uint8_t msg_type = DHCP_REQUEST;
     dhcp_add_option(packet.options, &opt_offset, DHCP_OPTION_MSG_TYPE, 1, &msg_type);
     
-    // Add requested IP address
-    uint32_t requested_ip = htonl(client->offered_ip);
-    dhcp_add_option(packet.options, &opt_offset, DHCP_OPTION_REQUESTED_IP, 4, &requested_ip);
-    
-    // Add server identifier
-    uint32_t server_id = htonl(client->server_ip);
-    dhcp_add_option(packet.options, &opt_offset, DHCP_OPTION_SERVER_ID, 4, &server_id);
+    if (!extending) {
+        // Add requested IP address
+        uint32_t requested_ip = htonl(client->offered_ip);
+        dhcp_add_option(packet.options, &opt_offset, DHCP_OPTION_REQUESTED_IP, 4, &requested_ip);
+        
+        // Add server identifier
+        uint32_t server_id = htonl(client->server_ip);
+        dhcp_add_option(packet.options, &opt_offset, DHCP_OPTION_SERVER_ID, 4, &server_id);
+    }
     
     // Add client identifier
     uint8_t client_id[7];
@@ -208,9 +276,10 @@ int dhcp_client_request(dhcp_client_t *client) {
     // Calculate total packet size
     size_t packet_size = sizeof(dhcp_packet_t) - sizeof(packet.options) + opt_offset + 1;
     
-    // Send UDP packet to broadcast address (255.255.255.255:67)
+    // Send UDP packet to the server, or broadcast (255.255.255.255:67)
+    uint32_t dest_ip = client->state == DHCP_STATE_RENEWING ? client->server_ip : 0xFFFFFFFF;
     int result = udp_send_packet(client->iface, 
-                                  0xFFFFFFFF,  // Broadcast: 255.255.255.255
+                                  dest_ip,
                                   68,          // Source port: DHCP client
                                   67,          // Dest port: DHCP server
                                   &packet, 
@@ -222,7 +291,9 @@ int dhcp_client_request(dhcp_client_t *client) {
     }
     
     DEBUG_INFO("DHCP: Sent REQUEST packet (%zu bytes)\\n", packet_size);
-    client->state = DHCP_STATE_REQUESTING;
+    if (!extending) {
+        client->state = DHCP_STATE_REQUESTING;
+    }
     return 0;
 }
 
@@ -309,6 +380,147 @@ int dhcp_parse_options(uint8_t *options, size_t len, dhcp_client_t *client, uint
     return 0;
 }
 
+// ============== State Machine ==============
+// All of it runs with client->lock held
+
+static void dhcp_drop_lease(dhcp_client_t *client) {
+    client->iface->ip_address = 0;
+    client->iface->subnet_mask = 0;
+    client->iface->gateway = 0;
+    client->active = false;
+    route_sync_interface(client->iface);
+}
+
+// Back to INIT: new transaction, DISCOVER, retransmit until an OFFER
+static void dhcp_restart(dhcp_client_t *client) {
+    client->state = DHCP_STATE_INIT;
+    client->transaction_id = dhcp_generate_xid();
+    client->offered_ip = 0;
+    client->server_ip = 0;
+    client->retries = 0;
+    dhcp_client_discover(client);
+    dhcp_arm_ms(client, dhcp_backoff_ms(0));
+}
+
+static void dhcp_bind(dhcp_client_t *client) {
+    client->iface->ip_address = client->offered_ip;
+    client->iface->subnet_mask = client->subnet_mask;
+    client->iface->gateway = client->gateway;
+    client->state = DHCP_STATE_BOUND;
+    client->lease_start_time = dhcp_get_time();
+    client->lease_start_tick = timer_get_ticks();
+    client->retries = 0;
+    client->active = true;
+    route_sync_interface(client->iface);
+    arp_send_gratuitous(client->iface);
+    
+    DEBUG_INFO("DHCP: Assigned IP=%d.%d.%d.%d, lease %us\n",
+              (client->offered_ip >> 24) & 0xFF, (client->offered_ip >> 16) & 0xFF,
+              (client->offered_ip >> 8) & 0xFF, client->offered_ip & 0xFF,
+              client->lease_time);
+    
+    // A server that names no lease time hands out the address for good
+    if (client->lease_time == 0 || client->lease_time == DHCP_LEASE_INFINITE) {
+        client->lease_time = DHCP_LEASE_INFINITE;
+        ktimer_cancel(&client->timer);
+        return;
+    }
+    
+    // If renewal time not specified, use 50% of lease time
+    if (client->renewal_time == 0 || client->renewal_time >= client->lease_time) {
+        client->renewal_time = client->lease_time / 2;
+    }
+    
+    // If rebinding time not specified, use 87.5% of lease time
+    if (client->rebinding_time == 0 || client->rebinding_time >= client->lease_time ||
+        client->rebinding_time < client->renewal_time) {
+        client->rebinding_time = (client->lease_time * 7) / 8;
+    }
+    
+    // Sleep until T1
+    ktimer_add(&client->timer, dhcp_lease_tick(client, client->renewal_time));
+}
+
+// Timer expiry, from the work queue
+static void dhcp_timeout(void *arg) {
+    dhcp_client_t *client = (dhcp_client_t *)arg;
+    mutex_lock(&client->lock);
+    
+    // Released, or re-armed by a reply while this was queued
+    if (!client->enabled || client->timer.pending) {
+        mutex_unlock(&client->lock);
+        return;
+    }
+    
+    uint64_t now = timer_get_ticks();
+    switch (client->state) {
+        case DHCP_STATE_INIT:
+        case DHCP_STATE_INIT_REBOOT:
+            dhcp_restart(client);
+            break;
+            
+        case DHCP_STATE_SELECTING:
+            // No OFFER yet: same transaction, longer wait
+            client->retries++;
+            DEBUG_INFO("DHCP: No OFFER, retransmitting DISCOVER (%u)\n", client->retries);
+            dhcp_client_discover(client);
+            dhcp_arm_ms(client, dhcp_backoff_ms(client->retries));
+            break;
+            
+        case DHCP_STATE_REQUESTING:
+            client->retries++;
+            if (client->retries >= DHCP_REQUEST_RETRIES) {
+                DEBUG_WARN("DHCP: No ACK, starting over\n");
+                dhcp_restart(client);
+                break;
+            }
+            dhcp_client_request(client);
+            dhcp_arm_ms(client, dhcp_backoff_ms(client->retries));
+            break;
+            
+        case DHCP_STATE_BOUND:
+            if (client->lease_time == DHCP_LEASE_INFINITE) {
+                break;
+            }
+            // T1: ask the granting server to extend the lease
+            DEBUG_INFO("DHCP: T1 reached, renewing\n");
+            client->state = DHCP_STATE_RENEWING;
+            client->retries = 0;
+            dhcp_client_request(client);
+            dhcp_arm_until(client, dhcp_lease_tick(client, client->rebinding_time));
+            break;
+            
+        case DHCP_STATE_RENEWING:
+            if (now < dhcp_lease_tick(client, client->rebinding_time)) {
+                client->retries++;
+                dhcp_client_request(client);
+                dhcp_arm_until(client, dhcp_lease_tick(client, client->rebinding_time));
+                break;
+            }
+            // T2: any server may extend it now
+            DEBUG_INFO("DHCP: T2 reached, rebinding\n");
+            client->state = DHCP_STATE_REBINDING;
+            client->retries = 0;
+            dhcp_client_request(client);
+            dhcp_arm_until(client, dhcp_lease_tick(client, client->lease_time));
+            break;
+            
+        case DHCP_STATE_REBINDING:
+            if (now < dhcp_lease_tick(client, client->lease_time)) {
+                client->retries++;
+                dhcp_client_request(client);
+                dhcp_arm_until(client, dhcp_lease_tick(client, client->lease_time));
+                break;
+            }
+            DEBUG_WARN("DHCP: Lease expired, starting over\n");
+            dhcp_drop_lease(client);
+            dhcp_restart(client);
+            break;
+    }
+    
+    mutex_unlock(&client->lock);
+}
+
 void dhcp_client_process_packet(dhcp_client_t *client, dhcp_packet_t *packet, size_t packet_len) {
     DEBUG_INFO("DHCP: Processing received packet (len=%zu)\\n", packet_len);
     
@@ -331,18 +543,42 @@ void dhcp_client_process_packet(dhcp_client_t *client, dhcp_packet_t *packet, si
         return;
     }
     
+    mutex_lock(&client->lock);
+    if (!client->enabled) {
+        mutex_unlock(&client->lock);
+        return;
+    }
+    
     // Check if this packet is for us (XID match)
     uint32_t pkt_xid = ntohl(packet->xid);
     DEBUG_DEBUG("DHCP: Packet XID=0x%08x, our XID=0x%08x\\n", pkt_xid, client->transaction_id);
     if (pkt_xid != client->transaction_id) {
         DEBUG_WARN("DHCP: XID mismatch\\n");
+        mutex_unlock(&client->lock);
         return;
     }
     
-    // Parse options to get message type
+    // Parse options to get message type. Lease times come from the ACK
+    // alone: an option it leaves out must not carry over from the last
+    // lease, and any other message must not disturb the current one.
+    uint32_t lease_time = client->lease_time;
+    uint32_t renewal_time = client->renewal_time;
+    uint32_t rebinding_time = client->rebinding_time;
+    client->lease_time = 0;
+    client->renewal_time = 0;
+    client->rebinding_time = 0;
     uint8_t msg_type = 0;
     dhcp_parse_options(packet->options, 312, client, &msg_type);
     
+    bool awaiting_ack = client->state == DHCP_STATE_REQUESTING ||
+                        client->state == DHCP_STATE_RENEWING ||
+                        client->state == DHCP_STATE_REBINDING;
+    if (msg_type != DHCP_ACK || !awaiting_ack) {
+        client->lease_time = lease_time;
+        client->renewal_time = renewal_time;
+        client->rebinding_time = rebinding_time;
+    }
+    
     DEBUG_INFO("DHCP: Received message type=%d, client state=%d\\n", msg_type, client->state);
     
     // Get offered IP address
@@ -362,42 +598,31 @@ void dhcp_client_process_packet(dhcp_client_t *client, dhcp_packet_t *packet, si
                 
                 // Send DHCP REQUEST
                 DEBUG_INFO("DHCP: Sending REQUEST...\\n");
+                client->retries = 0;
                 dhcp_client_request(client);
+                dhcp_arm_ms(client, dhcp_backoff_ms(0));
             } else {
                 DEBUG_WARN("DHCP: Expected OFFER (type=2), got type=%d\\n", msg_type);
             }
             break;
             
         case DHCP_STATE_REQUESTING:
+        case DHCP_STATE_RENEWING:
+        case DHCP_STATE_REBINDING:
             if (msg_type == DHCP_ACK) {
                 DEBUG_INFO("DHCP: Received ACK! Configuration complete.\\n");
                 // Configuration accepted
-                client->iface->ip_address = client->offered_ip;
-                client->iface->subnet_mask = client->subnet_mask;
-                client->iface->gateway = client->gateway;
-                client->state = DHCP_STATE_BOUND;
-                client->lease_start_time = dhcp_get_time();
-                client->active = true;
-                
-                DEBUG_INFO("DHCP: Assigned IP=%d.%d.%d.%d\\n",
-                          (client->offered_ip >> 24) & 0xFF, (client->offered_ip >> 16) & 0xFF,
-                          (client->offered_ip >> 8) & 0xFF, client->offered_ip & 0xFF);
-                
-                // If renewal time not specified, use 50% of lease time
-                if (client->renewal_time == 0) {
-                    client->renewal_time = client->lease_time / 2;
-                }
-                
-                // If rebinding time not specified, use 87.5% of lease time
-                if (client->rebinding_time == 0) {
-                    client->rebinding_time = (client->lease_time * 7) / 8;
+                if (offered_ip) {
+                    client->offered_ip = offered_ip;
                 }
+                dhcp_bind(client);
             } else if (msg_type == DHCP_NAK) {
                 DEBUG_WARN("DHCP: Received NAK - configuration rejected\\n");
                 // Configuration rejected, start over
-                client->state = DHCP_STATE_INIT;
-                client->offered_ip = 0;
-                client->server_ip = 0;
+                if (client->active) {
+                    dhcp_drop_lease(client);
+                }
+                dhcp_restart(client);
             }
             break;
             
@@ -405,6 +630,8 @@ void dhcp_client_process_packet(dhcp_client_t *client, dhcp_packet_t *packet, si
             DEBUG_WARN("DHCP: Unexpected state %d for incoming packet\\n", client->state);
             break;
     }
+    
+    mutex_unlock(&client->lock);
 }
 
 int dhcp_client_start(dhcp_client_t *client) {
@@ -412,14 +639,24 @@ int dhcp_client_start(dhcp_client_t *client) {
         return -1;
     }
     
-    client->state = DHCP_STATE_INIT;
-    client->transaction_id = dhcp_generate_xid();
-    
-    return dhcp_client_discover(client);
+    mutex_lock(&client->lock);
+    client->enabled = true;
+    // A DISCOVER that fails to go out is retried by the timer like a lost one
+    dhcp_restart(client);
+    mutex_unlock(&client->lock);
+    return 0;
 }
 
 int dhcp_client_release(dhcp_client_t *client) {
-    if (!client || !client->active) {
+    if (!client) {
+        return -1;
+    }
+    
+    mutex_lock(&client->lock);
+    client->enabled = false;
+    ktimer_cancel(&client->timer);
+    if (!client->active) {
+        mutex_unlock(&client->lock);
         return -1;
     }
     
@@ -463,54 +700,13 @@ int dhcp_client_release(dhcp_client_t *client) {
     DEBUG_INFO("DHCP: Sent RELEASE packet\n");
     
     // Reset client state
-    client->iface->ip_address = 0;
-    client->iface->subnet_mask = 0;
-    client->iface->gateway = 0;
+    dhcp_drop_lease(client);
     client->state = DHCP_STATE_INIT;
-    client->active = false;
+    mutex_unlock(&client->lock);
     
     return 0;
 }
 
-void dhcp_client_update(dhcp_client_t *client) {
-    if (!client || !client->active) {
-        return;
-    }
-    
-    uint32_t elapsed = dhcp_get_time() - client->lease_start_time;
-    
-    switch (client->state) {
-        case DHCP_STATE_BOUND:
-            if (elapsed >= client->renewal_time) {
-                client->state = DHCP_STATE_RENEWING;
-                // Send unicast DHCP REQUEST to renew lease
-                dhcp_client_request(client);
-            }
-            break;
-            
-        case DHCP_STATE_RENEWING:
-            if (elapsed >= client->rebinding_time) {
-                client->state = DHCP_STATE_REBINDING;
-                // Send broadcast DHCP REQUEST
-                dhcp_client_request(client);
-            }
-            break;
-            
-        case DHCP_STATE_REBINDING:
-            if (elapsed >= client->lease_time) {
-                // Lease expired, start over
-                client->state = DHCP_STATE_INIT;
-                client->active = false;
-                client->iface->ip_address = 0;
-                dhcp_client_start(client);
-            }
-            break;
-            
-        default:
-            break;
-    }
-}
-
 // Testing/simulation functions - only available in debug builds
 #ifdef DHCP_DEBUG
 
@@ -544,6 +740,7 @@ int dhcp_simulate_ack(dhcp_client_t *client) {
     client->state = DHCP_STATE_BOUND;
     client->lease_start_time = dhcp_get_time();
     client->active = true;
+    route_sync_interface(client->iface);
     
     return 0;
 }
@@ -5,6 +5,9 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "netdev.h"
+#include "../timer/ktimer.h"
+#include "../sched/workqueue.h"
+#include "../sched/sync.h"
 
 // DHCP message types
 #define DHCP_DISCOVER   1
@@ -33,6 +36,19 @@
 #define DHCP_OPTION_CLIENT_ID           61
 #define DHCP_OPTION_END                 255
 
+// Retransmission (RFC 2131 4.1): DISCOVER/REQUEST wait 4s, doubling up to
+// 64s, each randomized by up to a second either way
+#define DHCP_RETRANSMIT_MIN_MS      4000
+#define DHCP_RETRANSMIT_MAX_MS      64000
+#define DHCP_RETRANSMIT_JITTER_MS   1000
+
+// REQUESTs sent for one OFFER before starting over with a DISCOVER
+#define DHCP_REQUEST_RETRIES        4
+
+// While renewing or rebinding, wait half the time left (at least this
+// long) between REQUESTs
+#define DHCP_RENEW_MIN_WAIT_MS      60000
+
 // DHCP packet structure
 typedef struct __attribute__((packed)) dhcp_packet {
     uint8_t op;             // Message op code / message type
@@ -64,7 +80,10 @@ typedef enum {
     DHCP_STATE_INIT_REBOOT
 } dhcp_state_t;
 
-// DHCP client context
+// DHCP client context. The client is event driven: replies arrive through
+// UDP receive, and one kernel timer covers retransmits and the T1/T2/lease
+// deadlines. Its expiry runs the state machine from the work queue, so
+// nothing polls and nothing blocks waiting for the server.
 typedef struct dhcp_client {
     network_interface_t *iface;
     dhcp_state_t state;
@@ -78,19 +97,30 @@ typedef struct dhcp_client {
     uint32_t renewal_time;
     uint32_t rebinding_time;
     uint32_t lease_start_time;
-    bool active;
+    uint64_t lease_start_tick;      // T1, T2 and expiry count from here
+    uint32_t retries;               // Transmissions already made in this state
+    bool enabled;                   // Between dhcp_client_start() and release
+    bool active;                    // Holding a lease
+    ktimer_t timer;
+    work_t timer_work;
+    mutex_t lock;                   // Serializes packets and timeouts
 } dhcp_client_t;
 
 // Function prototypes
 int dhcp_client_init(network_interface_t *iface);
+
+// Begin address acquisition and return at once; the rest happens on
+// replies and timer expiries
 int dhcp_client_start(dhcp_client_t *client);
-int dhcp_client_discover(dhcp_client_t *client);
-int dhcp_client_request(dhcp_client_t *client);
 int dhcp_client_release(dhcp_client_t *client);
 void dhcp_client_process_packet(dhcp_client_t *client, dhcp_packet_t *packet, size_t packet_len);
-void dhcp_client_update(dhcp_client_t *client);
 dhcp_client_t *dhcp_get_client(network_interface_t *iface);
 
+// Send one message for the current state. Called by the state machine with
+// the client locked.
+int dhcp_client_discover(dhcp_client_t *client);
+int dhcp_client_request(dhcp_client_t *client);
+
 // Utility functions
 uint32_t dhcp_generate_xid(void);
 int dhcp_add_option(uint8_t *options, int *offset, uint8_t type, uint8_t len, const void *data);
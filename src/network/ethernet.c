@@ -7,87 +7,205 @@
 // Broadcast MAC address
 static const uint8_t broadcast_mac[ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
-int ethernet_send_frame(network_interface_t *iface, uint8_t *dest_mac, uint16_t ethertype, void *payload, size_t payload_len) {
-    if (!iface || !dest_mac || !payload || payload_len == 0) {
-        return NET_INVALID_PARAM;
+// Pad p and prepend the Ethernet header. Frees p and returns an error if
+// it can't be framed.
+static int ethernet_frame(network_interface_t *iface, const uint8_t *dest_mac, uint16_t ethertype, pbuf_t *p) {
+    if (p->len > (ETH_FRAME_LEN - ETH_HLEN)) {
+        pbuf_free(p);
+        return NET_ERROR;
     }
 
-    if (payload_len > (ETH_FRAME_LEN - ETH_HLEN)) {
+    // Pad frame if necessary
+    if (ETH_HLEN + p->len < ETH_ZLEN) {
+        size_t pad = ETH_ZLEN - ETH_HLEN - p->len;
+        memset(pbuf_put(p, pad), 0, pad);
+    }
+
+    ethernet_header_t *header = pbuf_push(p, ETH_HLEN);
+    if (!header) {
+        pbuf_free(p);
         return NET_ERROR;
     }
 
-    ethernet_frame_t frame;
-    
     // Fill ethernet header
-    memcpy(frame.header.dest_mac, dest_mac, ETH_ALEN);
-    memcpy(frame.header.src_mac, iface->mac_address, ETH_ALEN);
-    frame.header.ethertype = __builtin_bswap16(ethertype); // Convert to network byte order
+    memcpy(header->dest_mac, dest_mac, ETH_ALEN);
+    memcpy(header->src_mac, iface->mac_address, ETH_ALEN);
+    header->ethertype = __builtin_bswap16(ethertype); // Convert to network byte order
 
-    // Copy payload
-    memcpy(frame.payload, payload, payload_len);
+    NETIF_STAT_INC(iface, tx_proto[ethertype == ETH_TYPE_ARP ? NET_PROTO_ARP :
+                                   ethertype == ETH_TYPE_IP ? NET_PROTO_IP : NET_PROTO_OTHER]);
+    return NET_SUCCESS;
+}
 
-    // Pad frame if necessary
-    size_t frame_len = ETH_HLEN + payload_len;
-    if (frame_len < ETH_ZLEN) {
-        memset(frame.payload + payload_len, 0, ETH_ZLEN - frame_len);
-        frame_len = ETH_ZLEN;
+int ethernet_send_pbuf(network_interface_t *iface, const uint8_t *dest_mac, uint16_t ethertype, pbuf_t *p) {
+    if (!iface || !dest_mac || !p || p->len == 0) {
+        pbuf_free(p);
+        return NET_INVALID_PARAM;
+    }
+
+    int ret = ethernet_frame(iface, dest_mac, ethertype, p);
+    if (ret != NET_SUCCESS) {
+        return ret;
     }
 
     // Send frame
-    return network_send_raw(iface, &frame, frame_len);
+    return network_send_pbuf(iface, p);
 }
 
-int ethernet_receive_frame(network_interface_t *iface, ethernet_frame_t *frame) {
-    if (!iface || !frame) {
+int ethernet_send_burst(network_interface_t *iface, const uint8_t *dest_mac, uint16_t ethertype,
+                        pbuf_t **bufs, int n) {
+    if (!iface || !dest_mac || !bufs || n <= 0) {
+        for (int i = 0; bufs && i < n; i++) {
+            pbuf_free(bufs[i]);
+        }
+        return 0;
+    }
+
+    // Frame everything, closing up the gaps left by frames that failed
+    int framed = 0;
+    for (int i = 0; i < n; i++) {
+        if (bufs[i] && bufs[i]->len > 0 &&
+            ethernet_frame(iface, dest_mac, ethertype, bufs[i]) == NET_SUCCESS) {
+            bufs[framed++] = bufs[i];
+        } else if (bufs[i] && bufs[i]->len == 0) {
+            pbuf_free(bufs[i]);
+        }
+    }
+
+    return network_send_burst(iface, bufs, framed);
+}
+
+int ethernet_send_frame(network_interface_t *iface, uint8_t *dest_mac, uint16_t ethertype, void *payload, size_t payload_len) {
+    if (!iface || !dest_mac || !payload || payload_len == 0) {
         return NET_INVALID_PARAM;
     }
 
-    int result = network_receive_raw(iface, frame, sizeof(ethernet_frame_t));
-    if (result <= 0) {
-        return result;
+    if (payload_len > (ETH_FRAME_LEN - ETH_HLEN)) {
+        return NET_ERROR;
+    }
+
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
     }
 
-    // Convert ethertype from network byte order
-    frame->header.ethertype = __builtin_bswap16(frame->header.ethertype);
+    // Copy payload
+    memcpy(pbuf_put(p, payload_len), payload, payload_len);
 
-    return result;
+    return ethernet_send_pbuf(iface, dest_mac, ethertype, p);
 }
 
-void ethernet_process_frame(network_interface_t *iface, ethernet_frame_t *frame) {
-    if (!iface || !frame) {
-        return;
+int ethernet_receive_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    if (!iface || !bufs || n <= 0) {
+        return 0;
+    }
+
+    // Zero-copy path: the driver passes up the buffers the NIC wrote into
+    if (iface->rx_burst) {
+        return iface->rx_burst(iface, bufs, n);
+    }
+
+    int count = 0;
+    while (count < n) {
+        pbuf_t *p = pbuf_alloc();
+        if (!p) {
+            break;
+        }
+
+        int result = network_receive_raw(iface, p->data, PBUF_BUF_SIZE);
+        if (result <= 0) {
+            pbuf_free(p);
+            break;
+        }
+        p->len = (uint16_t)result;
+        bufs[count++] = p;
+    }
+
+    return count;
+}
+
+// Check the destination and strip the header. Returns the ethertype, or 0
+// if the frame should be ignored.
+static uint16_t ethernet_accept(network_interface_t *iface, pbuf_t *p) {
+    NETIF_STAT_INC(iface, rx_packets);
+    NETIF_STAT_ADD(iface, rx_bytes, p->len);
+
+    if (p->len < ETH_HLEN) {
+        NETIF_STAT_INC(iface, rx_errors);
+        return 0;
     }
 
+    ethernet_header_t *header = (ethernet_header_t *)p->data;
+    uint16_t ethertype = __builtin_bswap16(header->ethertype);
+
     // Check if frame is for us or broadcast
-    bool for_us = (memcmp(frame->header.dest_mac, iface->mac_address, ETH_ALEN) == 0);
-    bool broadcast = ethernet_is_broadcast(frame->header.dest_mac);
+    bool for_us = (memcmp(header->dest_mac, iface->mac_address, ETH_ALEN) == 0);
+    bool broadcast = ethernet_is_broadcast(header->dest_mac);
     
     if (!for_us && !broadcast) {
         DEBUG_DEBUG("Ethernet: Frame not for us (dest MAC: %02x:%02x:%02x:%02x:%02x:%02x)\n",
-                   frame->header.dest_mac[0], frame->header.dest_mac[1],
-                   frame->header.dest_mac[2], frame->header.dest_mac[3],
-                   frame->header.dest_mac[4], frame->header.dest_mac[5]);
-        return; // Frame not for us
+                   header->dest_mac[0], header->dest_mac[1],
+                   header->dest_mac[2], header->dest_mac[3],
+                   header->dest_mac[4], header->dest_mac[5]);
+        NETIF_STAT_INC(iface, rx_dropped);
+        return 0; // Frame not for us
     }
 
     DEBUG_DEBUG("Ethernet: Processing frame (ethertype=0x%04x, %s)\n", 
-               frame->header.ethertype, broadcast ? "broadcast" : "unicast");
+               ethertype, broadcast ? "broadcast" : "unicast");
 
-    // Process based on ethertype
-    switch (frame->header.ethertype) {
-        case ETH_TYPE_ARP:
-            DEBUG_DEBUG("Ethernet: Forwarding to ARP handler\n");
-            arp_process_packet(iface, (arp_header_t *)frame->payload);
-            break;
-            
-        case ETH_TYPE_IP:
-            DEBUG_DEBUG("Ethernet: Forwarding to IP handler\n");
-            ip_process_packet(iface, (ip_packet_t *)frame->payload);
-            break;
-            
-        default:
-            DEBUG_DEBUG("Ethernet: Unknown ethertype 0x%04x, ignoring\n", frame->header.ethertype);
-            break;
+    pbuf_pull(p, ETH_HLEN);
+    return ethertype;
+}
+
+void ethernet_process_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    if (!iface || !bufs || n <= 0) {
+        return;
+    }
+
+    // Classify the whole burst first so IP sees its datagrams as one vector
+    pbuf_t *ip_vec[NET_RX_BURST];
+    int ip_count = 0;
+
+    for (int i = 0; i < n; i++) {
+        pbuf_t *p = bufs[i];
+        uint16_t ethertype = ethernet_accept(iface, p);
+
+        // Process based on ethertype
+        switch (ethertype) {
+            case 0:
+                break;
+
+            case ETH_TYPE_ARP:
+                DEBUG_DEBUG("Ethernet: Forwarding to ARP handler\n");
+                NETIF_STAT_INC(iface, rx_proto[NET_PROTO_ARP]);
+                if (p->len >= sizeof(arp_header_t)) {
+                    arp_process_packet(iface, (arp_header_t *)p->data);
+                } else {
+                    NETIF_STAT_INC(iface, rx_errors);
+                }
+                break;
+
+            case ETH_TYPE_IP:
+                NETIF_STAT_INC(iface, rx_proto[NET_PROTO_IP]);
+                ip_vec[ip_count++] = p;
+                if (ip_count == NET_RX_BURST) {
+                    ip_process_burst(iface, ip_vec, ip_count);
+                    ip_count = 0;
+                }
+                break;
+
+            default:
+                DEBUG_DEBUG("Ethernet: Unknown ethertype 0x%04x, ignoring\n", ethertype);
+                NETIF_STAT_INC(iface, rx_proto[NET_PROTO_OTHER]);
+                NETIF_STAT_INC(iface, rx_dropped);
+                break;
+        }
+    }
+
+    if (ip_count > 0) {
+        DEBUG_DEBUG("Ethernet: Forwarding %d frames to IP handler\n", ip_count);
+        ip_process_burst(iface, ip_vec, ip_count);
     }
 }
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "network.h"
+#include "pbuf.h"
 
 // Ethernet frame structure
 #define ETH_ALEN 6
@@ -31,8 +32,19 @@ typedef struct ethernet_frame {
 
 // Function prototypes
 int ethernet_send_frame(network_interface_t *iface, uint8_t *dest_mac, uint16_t ethertype, void *payload, size_t payload_len);
-int ethernet_receive_frame(network_interface_t *iface, ethernet_frame_t *frame);
-void ethernet_process_frame(network_interface_t *iface, ethernet_frame_t *frame);
+// Prepend the Ethernet header to p (payload at p->data) and transmit it.
+// Takes over the caller's reference in all cases.
+int ethernet_send_pbuf(network_interface_t *iface, const uint8_t *dest_mac, uint16_t ethertype, pbuf_t *p);
+// Frame and transmit n pbufs to one destination in a single driver call.
+// Takes over every reference; returns how many the device accepted.
+int ethernet_send_burst(network_interface_t *iface, const uint8_t *dest_mac, uint16_t ethertype,
+                        pbuf_t **bufs, int n);
+// Up to n received frames as pbufs; returns how many. Drivers with a burst
+// hook hand over their ring buffers directly; others are copied into pbufs.
+int ethernet_receive_burst(network_interface_t *iface, pbuf_t **bufs, int n);
+// Demultiplex a burst of frames. The caller keeps its references and frees
+// them after.
+void ethernet_process_burst(network_interface_t *iface, pbuf_t **bufs, int n);
 bool ethernet_is_broadcast(uint8_t *mac);
 void ethernet_set_multicast(uint8_t *mac, uint32_t ip);
 
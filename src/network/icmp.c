@@ -1,77 +1,104 @@
 #include "icmp.h"
 #include "ip.h"
+#include "checksum.h"
 #include "../memory/memory.h"
 #include "../timer/timer.h"
 #include "../debug/debug.h"
+#include "../sched/waitqueue.h"
 
 // Ping reply tracking
 static volatile bool ping_reply_received = false;
 static volatile uint32_t ping_reply_src_ip = 0;
 static volatile uint16_t ping_reply_seq = 0;
-static volatile uint64_t ping_send_time = 0;
+static volatile uint64_t ping_send_time = 0;    // timer_get_ns() timestamps
 static volatile uint64_t ping_reply_time = 0;
 
+// icmp_ping() sleeps here until an echo reply arrives
+static wait_queue_t ping_waiters = WAIT_QUEUE_INIT;
+
 int icmp_init(void) {
     ping_reply_received = false;
     return NET_SUCCESS;
 }
 
-int icmp_send_echo_request(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len) {
-    if (!iface) {
-        return NET_INVALID_PARAM;
+// Copy 'data' once into a TX pbuf, prepend the filled-in header and send.
+// Data beyond the maximum ICMP payload is truncated.
+static int icmp_send(network_interface_t *iface, uint32_t dest_ip, const icmp_header_t *template, const void *data, size_t data_len) {
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
     }
 
-    icmp_packet_t packet;
-    
-    // Build ICMP header
-    packet.header.type = ICMP_ECHO_REQUEST;
-    packet.header.code = 0;
-    packet.header.checksum = 0;
-    packet.header.data.echo.identifier = __builtin_bswap16(identifier);
-    packet.header.data.echo.sequence = __builtin_bswap16(sequence);
-
-    // Copy data if provided
+    // Copy data if provided, summing it on the way in
     size_t payload_len = 0;
+    uint32_t sum = 0;
     if (data && data_len > 0) {
-        size_t max_data = sizeof(packet.payload);
+        size_t max_data = sizeof(((icmp_packet_t *)0)->payload);
         payload_len = (data_len > max_data) ? max_data : data_len;
-        memcpy(packet.payload, data, payload_len);
+        sum = csum_partial_copy(data, pbuf_put(p, payload_len), payload_len, 0);
     }
 
+    icmp_header_t *header = pbuf_push(p, sizeof(icmp_header_t));
+    *header = *template;
+    header->checksum = 0;
+
     // Calculate checksum
-    packet.header.checksum = icmp_checksum(&packet.header, sizeof(icmp_header_t) + payload_len);
+    header->checksum = csum_fold(csum_partial(header, sizeof(icmp_header_t), sum));
 
     // Send via IP layer
-    return ip_send_packet(iface, dest_ip, IP_PROTOCOL_ICMP, &packet, sizeof(icmp_header_t) + payload_len);
+    return ip_send_pbuf(iface, dest_ip, IP_PROTOCOL_ICMP, p);
 }
 
-int icmp_send_echo_reply(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len) {
+// Send a header whose checksum is already final (e.g. incrementally updated)
+// in front of 'data'
+static int icmp_send_prepared(network_interface_t *iface, uint32_t dest_ip, const icmp_header_t *header, const void *data, size_t data_len) {
+    if (data_len > sizeof(((icmp_packet_t *)0)->payload)) {
+        return NET_ERROR;
+    }
+
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
+    }
+
+    memcpy(pbuf_put(p, data_len), data, data_len);
+    *(icmp_header_t *)pbuf_push(p, sizeof(icmp_header_t)) = *header;
+
+    return ip_send_pbuf(iface, dest_ip, IP_PROTOCOL_ICMP, p);
+}
+
+int icmp_send_echo_request(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len) {
     if (!iface) {
         return NET_INVALID_PARAM;
     }
 
-    icmp_packet_t packet;
+    icmp_header_t header;
     
     // Build ICMP header
-    packet.header.type = ICMP_ECHO_REPLY;
-    packet.header.code = 0;
-    packet.header.checksum = 0;
-    packet.header.data.echo.identifier = __builtin_bswap16(identifier);
-    packet.header.data.echo.sequence = __builtin_bswap16(sequence);
+    header.type = ICMP_ECHO_REQUEST;
+    header.code = 0;
+    header.checksum = 0;
+    header.data.echo.identifier = __builtin_bswap16(identifier);
+    header.data.echo.sequence = __builtin_bswap16(sequence);
 
-    // Copy data if provided
-    size_t payload_len = 0;
-    if (data && data_len > 0) {
-        size_t max_data = sizeof(packet.payload);
-        payload_len = (data_len > max_data) ? max_data : data_len;
-        memcpy(packet.payload, data, payload_len);
+    return icmp_send(iface, dest_ip, &header, data, data_len);
+}
+
+int icmp_send_echo_reply(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len) {
+    if (!iface) {
+        return NET_INVALID_PARAM;
     }
 
-    // Calculate checksum
-    packet.header.checksum = icmp_checksum(&packet.header, sizeof(icmp_header_t) + payload_len);
+    icmp_header_t header;
+    
+    // Build ICMP header
+    header.type = ICMP_ECHO_REPLY;
+    header.code = 0;
+    header.checksum = 0;
+    header.data.echo.identifier = __builtin_bswap16(identifier);
+    header.data.echo.sequence = __builtin_bswap16(sequence);
 
-    // Send via IP layer
-    return ip_send_packet(iface, dest_ip, IP_PROTOCOL_ICMP, &packet, sizeof(icmp_header_t) + payload_len);
+    return icmp_send(iface, dest_ip, &header, data, data_len);
 }
 
 int icmp_send_dest_unreachable(network_interface_t *iface, uint32_t dest_ip, uint8_t code, void *original_packet, size_t packet_len) {
@@ -79,48 +106,42 @@ int icmp_send_dest_unreachable(network_interface_t *iface, uint32_t dest_ip, uin
         return NET_INVALID_PARAM;
     }
 
-    icmp_packet_t packet;
+    icmp_header_t header;
     
     // Build ICMP header
-    packet.header.type = ICMP_DEST_UNREACHABLE;
-    packet.header.code = code;
-    packet.header.checksum = 0;
-    packet.header.data.gateway = 0; // Unused for destination unreachable
-
-    // Copy original packet data (IP header + 8 bytes of data)
-    size_t copy_len = (packet_len > sizeof(packet.payload)) ? sizeof(packet.payload) : packet_len;
-    memcpy(packet.payload, original_packet, copy_len);
+    header.type = ICMP_DEST_UNREACHABLE;
+    header.code = code;
+    header.checksum = 0;
+    header.data.gateway = 0; // Unused for destination unreachable
 
-    // Calculate checksum
-    packet.header.checksum = icmp_checksum(&packet.header, sizeof(icmp_header_t) + copy_len);
-
-    // Send via IP layer
-    return ip_send_packet(iface, dest_ip, IP_PROTOCOL_ICMP, &packet, sizeof(icmp_header_t) + copy_len);
+    // Original packet data (IP header + 8 bytes of data)
+    return icmp_send(iface, dest_ip, &header, original_packet, packet_len);
 }
 
-void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, icmp_packet_t *packet) {
+void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, icmp_packet_t *packet, size_t len) {
     (void)dest_ip; // Unused - packet already routed to us
     
-    if (!iface || !packet) {
+    if (!iface || !packet || len < sizeof(icmp_header_t)) {
         return;
     }
 
-    // Validate checksum
-    uint16_t original_checksum = packet->header.checksum;
-    packet->header.checksum = 0;
-    uint16_t calculated_checksum = icmp_checksum(&packet->header, sizeof(icmp_header_t));
-    
-    if (original_checksum != calculated_checksum) {
+    // Validate checksum (covers the header and all of the data)
+    if (icmp_checksum(&packet->header, len) != 0) {
         return; // Invalid checksum
     }
 
     switch (packet->header.type) {
         case ICMP_ECHO_REQUEST:
-            // Respond with echo reply
+            // Respond with echo reply carrying the same data. Only the type
+            // changes, so patch the checksum instead of summing the data again.
             {
-                uint16_t identifier = __builtin_bswap16(packet->header.data.echo.identifier);
-                uint16_t sequence = __builtin_bswap16(packet->header.data.echo.sequence);
-                icmp_send_echo_reply(iface, src_ip, identifier, sequence, packet->payload, 0);
+                icmp_header_t reply = packet->header;
+                uint16_t old_word = *(uint16_t *)&packet->header;   // type, code
+                reply.type = ICMP_ECHO_REPLY;
+                reply.checksum = csum_update16(packet->header.checksum, old_word,
+                                               *(uint16_t *)&reply);
+                icmp_send_prepared(iface, src_ip, &reply, packet->payload,
+                                   len - sizeof(icmp_header_t));
             }
             break;
             
@@ -130,7 +151,8 @@ void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t d
                 ping_reply_received = true;
                 ping_reply_src_ip = src_ip;
                 ping_reply_seq = __builtin_bswap16(packet->header.data.echo.sequence);
-                ping_reply_time = timer_get_ticks();
+                ping_reply_time = timer_get_ns();
+                wait_queue_wake_all(&ping_waiters);
                 DEBUG_INFO("ICMP: Echo reply from %d.%d.%d.%d seq=%u\n",
                     (src_ip >> 24) & 0xFF, (src_ip >> 16) & 0xFF,
                     (src_ip >> 8) & 0xFF, src_ip & 0xFF, ping_reply_seq);
@@ -151,25 +173,7 @@ void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t d
 }
 
 uint16_t icmp_checksum(icmp_header_t *header, size_t len) {
-    uint32_t sum = 0;
-    uint16_t *ptr = (uint16_t *)header;
-
-    // Sum all 16-bit words
-    for (size_t i = 0; i < len / 2; i++) {
-        sum += ptr[i];
-    }
-
-    // Handle odd byte
-    if (len & 1) {
-        sum += ((uint8_t *)header)[len - 1] << 8;
-    }
-
-    // Add carry
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-
-    return ~sum;
+    return csum_fold(csum_partial(header, len, 0));
 }
 
 // Ping function for shell use
@@ -189,7 +193,8 @@ int icmp_ping(network_interface_t *iface, uint32_t dest_ip, int count, ping_resu
     for (int i = 0; i < count; i++) {
         // Clear reply flag
         ping_reply_received = false;
-        ping_send_time = timer_get_ticks();
+        ping_send_time = timer_get_ns();
+        uint64_t send_tick = timer_get_ticks();
         
         // Send echo request
         int ret = icmp_send_echo_request(iface, dest_ip, identifier, (uint16_t)i, NULL, 0);
@@ -199,16 +204,25 @@ int icmp_ping(network_interface_t *iface, uint32_t dest_ip, int count, ping_resu
         result->sent++;
         
         // Wait for reply (up to 1 second = 1000 ticks at 1000 Hz)
-        uint64_t timeout = ping_send_time + 1000;
+        uint64_t timeout = send_tick + 1000;
         while (!ping_reply_received && timer_get_ticks() < timeout) {
-            // Poll network while waiting
-            network_process_packets();
-            __asm__ volatile("pause");
+            if (network_rx_interrupts()) {
+                // The RX interrupt delivers the reply; just sleep until it does
+                uint64_t now = timer_get_ticks();
+                if (now < timeout) {
+                    wait_event_timeout(&ping_waiters, ping_reply_received,
+                                       (uint32_t)(timeout - now));
+                }
+            } else {
+                // Poll network while waiting, sleeping between polls
+                network_process_packets();
+                wait_event_timeout(&ping_waiters, ping_reply_received, 1);
+            }
         }
         
         if (ping_reply_received && ping_reply_src_ip == dest_ip) {
             result->received++;
-            uint32_t rtt = (uint32_t)(ping_reply_time - ping_send_time);
+            uint32_t rtt = (uint32_t)((ping_reply_time - ping_send_time) / 1000);
             result->total_time += rtt;
             if (rtt < result->min_time) result->min_time = rtt;
             if (rtt > result->max_time) result->max_time = rtt;
@@ -218,8 +232,12 @@ int icmp_ping(network_interface_t *iface, uint32_t dest_ip, int count, ping_resu
         if (i < count - 1) {
             uint64_t delay_end = timer_get_ticks() + 500;  // 500ms delay
             while (timer_get_ticks() < delay_end) {
+                if (network_rx_interrupts()) {
+                    thread_sleep_ms((uint32_t)(delay_end - timer_get_ticks()));
+                    break;
+                }
                 network_process_packets();
-                __asm__ volatile("pause");
+                thread_sleep_ms(1);
             }
         }
     }
@@ -55,14 +55,14 @@ int icmp_init(void);
 int icmp_send_echo_request(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len);
 int icmp_send_echo_reply(network_interface_t *iface, uint32_t dest_ip, uint16_t identifier, uint16_t sequence, void *data, size_t data_len);
 int icmp_send_dest_unreachable(network_interface_t *iface, uint32_t dest_ip, uint8_t code, void *original_packet, size_t packet_len);
-void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, icmp_packet_t *packet);
+void icmp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, icmp_packet_t *packet, size_t len);
 uint16_t icmp_checksum(icmp_header_t *header, size_t len);
 
 // Ping result structure
 typedef struct {
     int sent;
     int received;
-    uint32_t min_time;  // in ms (ticks)
+    uint32_t min_time;  // in microseconds
     uint32_t max_time;
     uint32_t total_time;
 } ping_result_t;
@@ -0,0 +1,30 @@
+#ifndef INET_HASH_H
+#define INET_HASH_H
+
+#include <stdint.h>
+
+// Hashes for transport demultiplexing. Each table mixes in its own random
+// seed, picked at init, so remote hosts can't aim packets at one bucket.
+
+// Final avalanche of MurmurHash3
+static inline uint32_t inet_hash_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t inet_hash_tuple(uint32_t local_ip, uint16_t local_port,
+                                       uint32_t remote_ip, uint16_t remote_port, uint32_t seed) {
+    uint32_t h = seed ^ (local_ip * 0x9E3779B1u);
+    h = inet_hash_mix(h ^ remote_ip);
+    return inet_hash_mix(h ^ (((uint32_t)local_port << 16) | remote_port));
+}
+
+static inline uint32_t inet_hash_port(uint16_t port, uint32_t seed) {
+    return inet_hash_mix(seed ^ port);
+}
+
+#endif // INET_HASH_H
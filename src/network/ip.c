@@ -1,11 +1,14 @@
 #include "ip.h"
 #include "ethernet.h"
 #include "arp.h"
+#include "route.h"
 #include "udp.h"
 #include "tcp.h"
 #include "icmp.h"
+#include "checksum.h"
 #include "../memory/memory.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
 
 static uint16_t ip_identification = 1;
 
@@ -14,6 +17,106 @@ int ip_init(void) {
     return NET_SUCCESS;
 }
 
+static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// Prepend the IP header to p. Frees p and returns an error if it can't.
+static int ip_build_header(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, pbuf_t *p) {
+    if (p->len > (IP_PACKET_SIZE - IP_HEADER_LEN)) {
+        pbuf_free(p);
+        return NET_ERROR; // Packet too large
+    }
+
+    size_t payload_len = p->len;
+    ip_header_t *header = pbuf_push(p, IP_HEADER_LEN);
+    if (!header) {
+        pbuf_free(p);
+        return NET_ERROR;
+    }
+
+    // Build IP header
+    header->version_ihl = (IP_VERSION_4 << 4) | (IP_HEADER_LEN / 4);
+    header->tos = 0;
+    header->total_length = __builtin_bswap16(IP_HEADER_LEN + payload_len);
+    header->identification = __builtin_bswap16(ip_identification++);
+    header->flags_fragment = __builtin_bswap16(IP_FLAG_DONT_FRAGMENT);
+    header->ttl = 64;
+    header->protocol = protocol;
+    header->src_ip = __builtin_bswap32(iface->ip_address);
+    header->dest_ip = __builtin_bswap32(dest_ip);
+    header->checksum = 0;
+
+    // Calculate checksum, or leave it to the NIC
+    if (iface->features & NETIF_F_TX_IP_CSUM) {
+        p->csum_flags |= PBUF_TX_CSUM_IP;
+        p->l3_header = (uint8_t *)header;
+    } else {
+        header->checksum = ip_checksum(header);
+    }
+
+    NETIF_STAT_INC(iface, tx_proto[net_proto_index(protocol)]);
+    return NET_SUCCESS;
+}
+
+int ip_send_pbuf(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, pbuf_t *p) {
+    if (!iface || !p || p->len == 0) {
+        pbuf_free(p);
+        return NET_INVALID_PARAM;
+    }
+
+    int ret = ip_build_header(iface, dest_ip, protocol, p);
+    if (ret != NET_SUCCESS) {
+        return ret;
+    }
+
+    // For broadcast address, use broadcast MAC directly
+    if (dest_ip == 0xFFFFFFFF) {
+        return ethernet_send_pbuf(iface, broadcast_mac, ETH_TYPE_IP, p);
+    }
+
+    // Resolve the next hop's MAC; a miss queues the packet behind the
+    // ARP request instead of dropping it
+    return arp_output(iface, route_next_hop(iface, dest_ip), p);
+}
+
+int ip_send_burst(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, pbuf_t **bufs, int n) {
+    if (!iface || !bufs || n <= 0) {
+        for (int i = 0; bufs && i < n; i++) {
+            pbuf_free(bufs[i]);
+        }
+        return NET_INVALID_PARAM;
+    }
+
+    int built = 0;
+    for (int i = 0; i < n; i++) {
+        if (bufs[i] && bufs[i]->len > 0 &&
+            ip_build_header(iface, dest_ip, protocol, bufs[i]) == NET_SUCCESS) {
+            bufs[built++] = bufs[i];
+        } else if (bufs[i] && bufs[i]->len == 0) {
+            pbuf_free(bufs[i]);
+        }
+    }
+    if (built == 0) {
+        return NET_ERROR;
+    }
+
+    // Route and resolve once for the whole burst
+    uint8_t dest_mac[6];
+    if (dest_ip == 0xFFFFFFFF) {
+        memcpy(dest_mac, broadcast_mac, 6);
+    } else {
+        uint32_t next_hop = route_next_hop(iface, dest_ip);
+        if (!arp_resolve(iface, next_hop, dest_mac)) {
+            // Unresolved: let ARP queue (and later flush) each datagram
+            for (int i = 0; i < built; i++) {
+                arp_output(iface, next_hop, bufs[i]);
+            }
+            return NET_SUCCESS;
+        }
+    }
+
+    return ethernet_send_burst(iface, dest_mac, ETH_TYPE_IP, bufs, built) > 0 ? NET_SUCCESS : NET_ERROR;
+}
+
 int ip_send_packet(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, void *payload, size_t payload_len) {
     if (!iface || !payload || payload_len == 0) {
         return NET_INVALID_PARAM;
@@ -23,68 +126,88 @@ int ip_send_packet(network_interface_t *iface, uint32_t dest_ip, uint8_t protoco
         return NET_ERROR; // Packet too large
     }
 
-    ip_packet_t packet;
-    uint8_t dest_mac[6];
-
-    // Build IP header
-    packet.header.version_ihl = (IP_VERSION_4 << 4) | (IP_HEADER_LEN / 4);
-    packet.header.tos = 0;
-    packet.header.total_length = __builtin_bswap16(IP_HEADER_LEN + payload_len);
-    packet.header.identification = __builtin_bswap16(ip_identification++);
-    packet.header.flags_fragment = __builtin_bswap16(IP_FLAG_DONT_FRAGMENT);
-    packet.header.ttl = 64;
-    packet.header.protocol = protocol;
-    packet.header.src_ip = __builtin_bswap32(iface->ip_address);
-    packet.header.dest_ip = __builtin_bswap32(dest_ip);
-    packet.header.checksum = 0;
-
-    // Calculate checksum
-    packet.header.checksum = ip_checksum(&packet.header);
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
+    }
 
     // Copy payload
-    memcpy(packet.payload, payload, payload_len);
+    memcpy(pbuf_put(p, payload_len), payload, payload_len);
 
-    // Resolve destination MAC address
-    // For broadcast address, use broadcast MAC directly
-    if (dest_ip == 0xFFFFFFFF) {
-        // Broadcast - use FF:FF:FF:FF:FF:FF
-        dest_mac[0] = 0xFF;
-        dest_mac[1] = 0xFF;
-        dest_mac[2] = 0xFF;
-        dest_mac[3] = 0xFF;
-        dest_mac[4] = 0xFF;
-        dest_mac[5] = 0xFF;
-    } else if (!arp_lookup(dest_ip, dest_mac)) {
-        // MAC not in ARP table, send ARP request
-        arp_send_request(iface, dest_ip);
-        return NET_TIMEOUT; // Would need to queue packet in real implementation
-    }
-
-    // Send IP packet as ethernet frame
-    return ethernet_send_frame(iface, dest_mac, ETH_TYPE_IP, &packet, IP_HEADER_LEN + payload_len);
+    return ip_send_pbuf(iface, dest_ip, protocol, p);
 }
 
-void ip_process_packet(network_interface_t *iface, ip_packet_t *packet) {
-    if (!iface || !packet) {
-        return;
+// Verify the TCP/UDP checksum of the segment at p->data, trusting the NIC's
+// verdict when it gave one
+static bool ip_transport_checksum_ok(pbuf_t *p, uint8_t protocol, uint32_t src_ip, uint32_t dest_ip) {
+    if (p->csum_flags & PBUF_CSUM_L4_BAD) {
+        return false;
+    }
+    if (p->csum_flags & PBUF_CSUM_L4_OK) {
+        return true;
     }
 
+    // Summing a segment including its checksum field gives 0 when intact
+    switch (protocol) {
+        case IP_PROTOCOL_TCP:
+            return p->len >= TCP_HEADER_LEN &&
+                   tcp_checksum((tcp_header_t *)p->data, src_ip, dest_ip, p->len) == 0;
+
+        case IP_PROTOCOL_UDP:
+            if (p->len < UDP_HEADER_LEN) {
+                return false;
+            }
+            // A zero checksum means the sender didn't compute one
+            return ((udp_header_t *)p->data)->checksum == 0 ||
+                   udp_checksum((udp_header_t *)p->data, src_ip, dest_ip, p->len) == 0;
+
+        default:
+            return true;
+    }
+}
+
+// Validate a received datagram and step p over its header. Returns the
+// header (still in the buffer), or NULL if the datagram is to be dropped.
+static ip_header_t *ip_input(network_interface_t *iface, pbuf_t *p, uint32_t *src_out, uint32_t *dest_out) {
+    if (!iface || !p) {
+        return NULL;
+    }
+    if (p->len < IP_HEADER_LEN) {
+        NETIF_STAT_INC(iface, rx_errors);
+        return NULL;
+    }
+
+    ip_header_t *header = (ip_header_t *)p->data;
+
     // Validate IP header
-    uint8_t version = (packet->header.version_ihl >> 4) & 0x0F;
+    uint8_t version = (header->version_ihl >> 4) & 0x0F;
     if (version != IP_VERSION_4) {
         DEBUG_WARN("IP: Not IPv4 (version=%d)\n", version);
-        return; // Not IPv4
+        NETIF_STAT_INC(iface, rx_errors);
+        return NULL; // Not IPv4
     }
 
-    // Validate checksum
-    if (!ip_validate_checksum(&packet->header)) {
+    // Header and datagram must fit in what was received
+    size_t header_len = (header->version_ihl & 0x0F) * 4;
+    size_t total_len = __builtin_bswap16(header->total_length);
+    if (header_len < IP_HEADER_LEN || total_len < header_len || total_len > p->len) {
+        DEBUG_WARN("IP: Bad lengths (ihl=%lu total=%lu frame=%u)\n",
+                   header_len, total_len, p->len);
+        NETIF_STAT_INC(iface, rx_errors);
+        return NULL;
+    }
+
+    // Validate checksum unless the NIC already did
+    if ((p->csum_flags & PBUF_CSUM_IP_BAD) ||
+        (!(p->csum_flags & PBUF_CSUM_IP_OK) && !ip_validate_checksum(header))) {
         DEBUG_WARN("IP: Invalid checksum\n");
-        return; // Invalid checksum
+        NETIF_STAT_INC(iface, rx_csum_errors);
+        return NULL; // Invalid checksum
     }
 
     // Convert addresses from network byte order
-    uint32_t src_ip = __builtin_bswap32(packet->header.src_ip);
-    uint32_t dest_ip = __builtin_bswap32(packet->header.dest_ip);
+    uint32_t src_ip = __builtin_bswap32(header->src_ip);
+    uint32_t dest_ip = __builtin_bswap32(header->dest_ip);
 
     // Check if packet is for us
     // Accept if:
@@ -104,62 +227,113 @@ void ip_process_packet(network_interface_t *iface, ip_packet_t *packet) {
                    (dest_ip >> 8) & 0xFF, dest_ip & 0xFF,
                    (iface->ip_address >> 24) & 0xFF, (iface->ip_address >> 16) & 0xFF,
                    (iface->ip_address >> 8) & 0xFF, iface->ip_address & 0xFF);
-        return; // Not for us
+        NETIF_STAT_INC(iface, rx_dropped);
+        return NULL; // Not for us
     }
 
     DEBUG_DEBUG("IP: Processing packet (proto=%d, src=%d.%d.%d.%d, dest=%d.%d.%d.%d)\n",
-               packet->header.protocol,
+               header->protocol,
                (src_ip >> 24) & 0xFF, (src_ip >> 16) & 0xFF,
                (src_ip >> 8) & 0xFF, src_ip & 0xFF,
                (dest_ip >> 24) & 0xFF, (dest_ip >> 16) & 0xFF,
                (dest_ip >> 8) & 0xFF, dest_ip & 0xFF);
 
+    // Drop Ethernet padding, then step over the header
+    pbuf_trim(p, total_len);
+    pbuf_pull(p, header_len);
+
+    if (!ip_transport_checksum_ok(p, header->protocol, src_ip, dest_ip)) {
+        DEBUG_WARN("IP: Bad transport checksum (proto=%d)\n", header->protocol);
+        NETIF_STAT_INC(iface, rx_csum_errors);
+        return NULL;
+    }
+
+    NETIF_STAT_INC(iface, rx_proto[net_proto_index(header->protocol)]);
+
+    *src_out = src_ip;
+    *dest_out = dest_ip;
+    return header;
+}
+
+void ip_process_packet(network_interface_t *iface, pbuf_t *p) {
+    uint32_t src_ip, dest_ip;
+    ip_header_t *header = ip_input(iface, p, &src_ip, &dest_ip);
+    if (!header) {
+        return;
+    }
+    size_t header_len = (header->version_ihl & 0x0F) * 4;
+    TRACE(TRACE_NET_IP_RX, p->len, header->protocol);
+
     // Process based on protocol
-    switch (packet->header.protocol) {
+    switch (header->protocol) {
         case IP_PROTOCOL_ICMP:
-            icmp_process_packet(iface, src_ip, dest_ip, (icmp_packet_t *)packet->payload);
+            icmp_process_packet(iface, src_ip, dest_ip, (icmp_packet_t *)p->data, p->len);
             break;
             
         case IP_PROTOCOL_UDP:
-            udp_process_packet(iface, src_ip, dest_ip, (udp_packet_t *)packet->payload);
+            udp_process_packet(iface, src_ip, dest_ip, (udp_packet_t *)p->data);
             break;
             
         case IP_PROTOCOL_TCP:
-            tcp_process_packet(iface, src_ip, dest_ip, (tcp_packet_t *)packet->payload);
+            tcp_process_packet(iface, src_ip, dest_ip, (tcp_packet_t *)p->data, p->len);
             break;
             
         default:
             // Unknown protocol, send ICMP protocol unreachable
-            icmp_send_dest_unreachable(iface, src_ip, ICMP_PROTOCOL_UNREACHABLE, packet, sizeof(ip_header_t) + 8);
+            icmp_send_dest_unreachable(iface, src_ip, ICMP_PROTOCOL_UNREACHABLE, header, header_len + 8);
             break;
     }
 }
 
-uint16_t ip_checksum(ip_header_t *header) {
-    uint32_t sum = 0;
-    uint16_t *ptr = (uint16_t *)header;
+void ip_process_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    // TCP segments are collected and handed over as one vector so runs of
+    // the same flow can be coalesced; everything else is handled in place
+    tcp_rx_t tcp_vec[NET_RX_BURST];
+    int tcp_count = 0;
+
+    for (int i = 0; i < n; i++) {
+        pbuf_t *p = bufs[i];
+        if (p && p->len >= IP_HEADER_LEN && tcp_count < NET_RX_BURST &&
+            ((ip_header_t *)p->data)->protocol == IP_PROTOCOL_TCP) {
+            uint32_t src_ip, dest_ip;
+            if (ip_input(iface, p, &src_ip, &dest_ip)) {
+                tcp_vec[tcp_count].src_ip = src_ip;
+                tcp_vec[tcp_count].dest_ip = dest_ip;
+                tcp_vec[tcp_count].packet = (tcp_packet_t *)p->data;
+                tcp_vec[tcp_count].len = p->len;
+                tcp_count++;
+            }
+            continue;
+        }
+        ip_process_packet(iface, p);
+    }
 
-    // Sum all 16-bit words in header
-    for (int i = 0; i < IP_HEADER_LEN / 2; i++) {
-        sum += ptr[i];
+    if (tcp_count > 0) {
+        tcp_process_burst(iface, tcp_vec, tcp_count);
     }
+}
 
-    // Add carry
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+uint16_t ip_checksum(ip_header_t *header) {
+    size_t header_len = (header->version_ihl & 0x0F) * 4;
+    if (header_len < IP_HEADER_LEN) {
+        header_len = IP_HEADER_LEN;
     }
+    return csum_fold(csum_partial(header, header_len, 0));
+}
 
-    // One's complement
-    return ~sum;
+uint16_t ip_pseudo_header_sum(uint32_t src_ip, uint32_t dest_ip, uint8_t protocol, uint16_t len) {
+    // 16-bit words as they sit in memory, like the data they're summed with
+    uint32_t words[3] = {
+        __builtin_bswap32(src_ip),
+        __builtin_bswap32(dest_ip),
+        ((uint32_t)__builtin_bswap16(len) << 16) | __builtin_bswap16((uint16_t)protocol),
+    };
+    return (uint16_t)~csum_fold(csum_partial(words, sizeof(words), 0));
 }
 
 bool ip_validate_checksum(ip_header_t *header) {
-    uint16_t original_checksum = header->checksum;
-    header->checksum = 0;
-    uint16_t calculated_checksum = ip_checksum(header);
-    header->checksum = original_checksum;
-    
-    return (original_checksum == calculated_checksum);
+    // Summed together with its checksum, an intact header folds to 0
+    return ip_checksum(header) == 0;
 }
 
 uint32_t ip_str_to_addr(const char *ip_str) {
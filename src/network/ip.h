@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "network.h"
+#include "pbuf.h"
 
 // IP constants
 #define IP_VERSION_4 4
@@ -42,8 +43,23 @@ typedef struct ip_packet {
 // Function prototypes
 int ip_init(void);
 int ip_send_packet(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, void *payload, size_t payload_len);
-void ip_process_packet(network_interface_t *iface, ip_packet_t *packet);
+// Prepend the IP header to p (transport segment at p->data) and transmit it.
+// Takes over the caller's reference in all cases.
+int ip_send_pbuf(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, pbuf_t *p);
+// Same for n transport segments to one destination: routing and ARP are
+// resolved once and the frames reach the driver in a single burst. Takes
+// over every reference.
+int ip_send_burst(network_interface_t *iface, uint32_t dest_ip, uint8_t protocol, pbuf_t **bufs, int n);
+// Handle a received datagram; p->data points at the IP header. Transport
+// handlers get a pointer into the same buffer.
+void ip_process_packet(network_interface_t *iface, pbuf_t *p);
+// Same for a vector of datagrams from one receive burst
+void ip_process_burst(network_interface_t *iface, pbuf_t **bufs, int n);
 uint16_t ip_checksum(ip_header_t *header);
+// Folded (not complemented) one's-complement sum of the TCP/UDP pseudo
+// header, in network byte order. Addresses are in host order. This is what
+// goes in the checksum field when the NIC completes the checksum.
+uint16_t ip_pseudo_header_sum(uint32_t src_ip, uint32_t dest_ip, uint8_t protocol, uint16_t len);
 bool ip_validate_checksum(ip_header_t *header);
 uint32_t ip_str_to_addr(const char *ip_str);
 void ip_addr_to_str(uint32_t ip_addr, char *ip_str);
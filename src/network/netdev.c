@@ -1,7 +1,10 @@
 #include "netdev.h"
 #include "network.h"
+#include "pbuf.h"
+#include "../sched/spinlock.h"
 #include "../memory/memory.h"
 #include "../drivers/e1000.h"
+#include "../drivers/virtio_net.h"
 #include "../pci/pci.h"
 #include "../debug/debug.h"
 
@@ -25,63 +28,109 @@ static char *netdev_strncpy(char *dest, const char *src, size_t n) {
     return dest;
 }
 
-#define MAX_PACKET_QUEUE 16
+#define MAX_PACKET_QUEUE 64
 
-// Simple packet queue for loopback
+// Loopback queue: frames are passed through by reference, never copied
 typedef struct packet_queue {
-    uint8_t packets[MAX_PACKET_QUEUE][ETHERNET_FRAME_SIZE];
-    size_t lengths[MAX_PACKET_QUEUE];
+    pbuf_t *packets[MAX_PACKET_QUEUE];
     int head;
     int tail;
     int count;
+    spinlock_t lock;
 } packet_queue_t;
 
-static packet_queue_t loopback_queue = {0};
+static packet_queue_t loopback_queue = { .lock = SPINLOCK_INIT_NAMED("loopback") };
+
+static void loopback_flush_queue(void) {
+    uint64_t flags = spin_lock_irqsave(&loopback_queue.lock);
+    while (loopback_queue.count > 0) {
+        pbuf_free(loopback_queue.packets[loopback_queue.head]);
+        loopback_queue.head = (loopback_queue.head + 1) % MAX_PACKET_QUEUE;
+        loopback_queue.count--;
+    }
+    loopback_queue.head = 0;
+    loopback_queue.tail = 0;
+    spin_unlock_irqrestore(&loopback_queue.lock, flags);
+}
 
 // Loopback device operations
-static int loopback_send(network_interface_t *iface, void *data, size_t len) {
+static int loopback_tx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    (void)iface; // Unused - loopback uses global queue
+    
+    int queued = 0;
+    uint64_t flags = spin_lock_irqsave(&loopback_queue.lock);
+    while (queued < n && loopback_queue.count < MAX_PACKET_QUEUE) {
+        // Nothing can corrupt a frame that never leaves memory, so the
+        // checksums the sender skipped count as verified on the way back in
+        bufs[queued]->csum_flags = PBUF_CSUM_IP_OK | PBUF_CSUM_L4_OK;
+        loopback_queue.packets[loopback_queue.tail] = bufs[queued++];
+        loopback_queue.tail = (loopback_queue.tail + 1) % MAX_PACKET_QUEUE;
+        loopback_queue.count++;
+    }
+    spin_unlock_irqrestore(&loopback_queue.lock, flags);
+    
+    // No interrupt to announce the frames: queue the receive pass ourselves
+    if (queued > 0) {
+        network_schedule_poll();
+    }
+    
+    return queued;
+}
+
+static int loopback_rx_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
     (void)iface; // Unused - loopback uses global queue
     
+    int count = 0;
+    uint64_t flags = spin_lock_irqsave(&loopback_queue.lock);
+    while (count < n && loopback_queue.count > 0) {
+        bufs[count++] = loopback_queue.packets[loopback_queue.head];
+        loopback_queue.head = (loopback_queue.head + 1) % MAX_PACKET_QUEUE;
+        loopback_queue.count--;
+    }
+    spin_unlock_irqrestore(&loopback_queue.lock, flags);
+    
+    return count;
+}
+
+static int loopback_send(network_interface_t *iface, void *data, size_t len) {
     if (!data || len == 0 || len > ETHERNET_FRAME_SIZE) {
         return NET_INVALID_PARAM;
     }
 
-    // Add packet to queue
-    if (loopback_queue.count >= MAX_PACKET_QUEUE) {
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
         return NET_BUFFER_FULL;
     }
+    memcpy(pbuf_put(p, len), data, len);
 
-    int index = loopback_queue.tail;
-    memcpy(loopback_queue.packets[index], data, len);
-    loopback_queue.lengths[index] = len;
-    loopback_queue.tail = (loopback_queue.tail + 1) % MAX_PACKET_QUEUE;
-    loopback_queue.count++;
+    // Add packet to queue
+    if (loopback_tx_burst(iface, &p, 1) != 1) {
+        pbuf_free(p);
+        return NET_BUFFER_FULL;
+    }
 
     return NET_SUCCESS;
 }
 
 static int loopback_receive(network_interface_t *iface, void *buffer, size_t max_len) {
-    (void)iface; // Unused - loopback uses global queue
-    
     if (!buffer || max_len == 0) {
         return NET_INVALID_PARAM;
     }
 
     // Get packet from queue
-    if (loopback_queue.count == 0) {
+    pbuf_t *p;
+    if (loopback_rx_burst(iface, &p, 1) != 1) {
         return 0; // No packets available
     }
 
-    int index = loopback_queue.head;
-    size_t len = loopback_queue.lengths[index];
-    
+    size_t len = p->len;
     if (len > max_len) {
+        pbuf_free(p);
         return NET_ERROR; // Buffer too small
     }
 
-    memcpy(buffer, loopback_queue.packets[index], len);
-    loopback_queue.head = (loopback_queue.head + 1) % MAX_PACKET_QUEUE;
-    loopback_queue.count--;
+    memcpy(buffer, p->data, len);
+    pbuf_free(p);
 
     return len;
 }
@@ -95,18 +144,14 @@ static int loopback_start(network_interface_t *iface) {
 static int loopback_stop(network_interface_t *iface) {
     (void)iface; // Unused
     // Clear packet queue
-    loopback_queue.head = 0;
-    loopback_queue.tail = 0;
-    loopback_queue.count = 0;
+    loopback_flush_queue();
     return NET_SUCCESS;
 }
 
 static int loopback_init_dev(network_interface_t *iface) {
     (void)iface; // Unused
     // Initialize loopback queue
-    loopback_queue.head = 0;
-    loopback_queue.tail = 0;
-    loopback_queue.count = 0;
+    loopback_flush_queue();
     return NET_SUCCESS;
 }
 
@@ -128,6 +173,9 @@ static netdev_ops_t loopback_ops = {
     .stop = loopback_stop,
     .send = loopback_send,
     .receive = loopback_receive,
+    .rx_burst = loopback_rx_burst,
+    .tx_burst = loopback_tx_burst,
+    .features = NETIF_F_RX_CSUM | NETIF_F_TX_IP_CSUM | NETIF_F_TX_L4_CSUM,
     .set_mac = loopback_set_mac,
     .get_mac = loopback_get_mac
 };
@@ -171,6 +219,11 @@ int netdev_register(const char *name, netdev_ops_t *ops, uint8_t *mac_addr, uint
     // Set operations
     iface->send_packet = ops->send;
     iface->receive_packet = ops->receive;
+    iface->rx_burst = ops->rx_burst;
+    iface->tx_burst = ops->tx_burst;
+    iface->tx_flush = ops->tx_flush;
+    iface->features = ops->features;
+    iface->tx_batch = 0;
 
     // Initialize device
     if (ops->init) {
@@ -277,8 +330,13 @@ static netdev_ops_t ethernet_ops = {
     .init = ethernet_init_dev
 };
 
-// Create a real ethernet interface using E1000 driver
+// Create a real ethernet interface: virtio-net when running on a hypervisor
+// that offers it (far fewer VM exits per packet), the E1000 otherwise
 int ethernet_init(void) {
+    if (virtio_net_init() == 0) {
+        return virtio_net_register_netdev();
+    }
+
     // Try to initialize E1000 driver (PCI should already be initialized)
     if (e1000_init() == 0) {
         // E1000 device found and initialized, register it as network device
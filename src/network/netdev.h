@@ -13,6 +13,10 @@ typedef struct netdev_ops {
     int (*stop)(network_interface_t *iface);
     int (*send)(network_interface_t *iface, void *data, size_t len);
     int (*receive)(network_interface_t *iface, void *buffer, size_t max_len);
+    int (*rx_burst)(network_interface_t *iface, struct pbuf **bufs, int n);  // Optional zero-copy receive
+    int (*tx_burst)(network_interface_t *iface, struct pbuf **bufs, int n);  // Optional zero-copy send
+    void (*tx_flush)(network_interface_t *iface);   // Optional: end of a TX batch
+    uint32_t features;                              // NETIF_F_* offloads supported
     void (*set_mac)(network_interface_t *iface, uint8_t *mac);
     void (*get_mac)(network_interface_t *iface, uint8_t *mac);
 } netdev_ops_t;
@@ -1,14 +1,18 @@
 #include "network.h"
 #include "ethernet.h"
 #include "arp.h"
+#include "route.h"
 #include "ip.h"
 #include "udp.h"
 #include "tcp.h"
 #include "icmp.h"
 #include "netdev.h"
+#include "pbuf.h"
+#include "pcap.h"
 #include "../memory/memory.h"
 #include "../graphic/graphic.h"
 #include "../debug/debug.h"
+#include "../sched/workqueue.h"
 
 static network_interface_t *interfaces[MAX_NETWORK_INTERFACES];
 static int interface_count = 0;
@@ -22,6 +26,12 @@ int network_init(void) {
     }
     interface_count = 0;
 
+    // Drivers fill their receive rings from the pool, so it comes first
+    if (pbuf_pool_init() != 0) {
+        DEBUG_ERROR("Failed to allocate packet buffers\n");
+        return NET_ERROR;
+    }
+
     // Initialize network protocols
     DEBUG_DEBUG("Initializing ARP protocol\n");
     if (arp_init() != NET_SUCCESS) {
@@ -29,6 +39,12 @@ int network_init(void) {
         return NET_ERROR;
     }
     
+    DEBUG_DEBUG("Initializing routing table\n");
+    if (route_init() != NET_SUCCESS) {
+        DEBUG_ERROR("Failed to initialize routing table\n");
+        return NET_ERROR;
+    }
+
     DEBUG_DEBUG("Initializing IP protocol\n");
     if (ip_init() != NET_SUCCESS) {
         DEBUG_ERROR("Failed to initialize IP protocol\n");
@@ -83,6 +99,17 @@ int network_register_interface(network_interface_t *iface) {
     interfaces[interface_count] = iface;
     interface_count++;
     iface->active = true;
+    route_sync_interface(iface);
+
+    // Statically configured: announce ourselves so stale neighbour
+    // caches pick up this MAC
+    if (iface->ip_address != 0) {
+        arp_send_gratuitous(iface);
+    }
+    
+    // Frames (and their interrupt) may have arrived before the interface
+    // was visible to network_poll()
+    network_schedule_poll();
 
     return NET_SUCCESS;
 }
@@ -107,6 +134,72 @@ int network_send_raw(network_interface_t *iface, void *data, size_t len) {
     return NET_ERROR;
 }
 
+int network_send_pbuf(network_interface_t *iface, pbuf_t *p) {
+    if (!p) {
+        return NET_INVALID_PARAM;
+    }
+    return network_send_burst(iface, &p, 1) == 1 ? NET_SUCCESS : NET_ERROR;
+}
+
+int network_send_burst(network_interface_t *iface, pbuf_t **bufs, int n) {
+    if (iface == NULL || bufs == NULL || n <= 0 || !iface->active) {
+        if (iface && n > 0) {
+            NETIF_STAT_ADD(iface, tx_dropped, n);
+        }
+        for (int i = 0; bufs && i < n; i++) {
+            pbuf_free(bufs[i]);
+        }
+        return 0;
+    }
+
+    // Sized up front: once the device has a frame it may already be gone
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        if (bufs[i]) {
+            bytes += bufs[i]->len;
+            pcap_tap(iface, PCAP_DIR_TX, bufs[i]->data, bufs[i]->len);
+        }
+    }
+
+    int sent = 0;
+    if (iface->tx_burst) {
+        sent = iface->tx_burst(iface, bufs, n);
+        if (sent < n) {
+            NETIF_STAT_ADD(iface, tx_ring_full, n - sent);
+        }
+    } else {
+        // Driver copies out of a flat buffer
+        for (; sent < n; sent++) {
+            if (network_send_raw(iface, bufs[sent]->data, bufs[sent]->len) != NET_SUCCESS) {
+                NETIF_STAT_ADD(iface, tx_errors, n - sent);
+                break;
+            }
+            pbuf_free(bufs[sent]);
+        }
+    }
+
+    // Whatever the device didn't take is dropped
+    for (int i = sent; i < n; i++) {
+        bytes -= bufs[i] ? bufs[i]->len : 0;
+        pbuf_free(bufs[i]);
+    }
+    NETIF_STAT_ADD(iface, tx_packets, sent);
+    NETIF_STAT_ADD(iface, tx_bytes, bytes);
+    return sent;
+}
+
+void network_tx_batch_begin(network_interface_t *iface) {
+    __atomic_add_fetch(&iface->tx_batch, 1, __ATOMIC_ACQ_REL);
+}
+
+void network_tx_batch_end(network_interface_t *iface) {
+    // Drop the count before flushing: a sender that still saw the batch open
+    // has already queued its frame by the time the driver takes its TX lock
+    if (__atomic_sub_fetch(&iface->tx_batch, 1, __ATOMIC_ACQ_REL) == 0 && iface->tx_flush) {
+        iface->tx_flush(iface);
+    }
+}
+
 int network_receive_raw(network_interface_t *iface, void *buffer, size_t max_len) {
     if (iface == NULL || buffer == NULL || max_len == 0 || !iface->active) {
         return NET_INVALID_PARAM;
@@ -119,19 +212,110 @@ int network_receive_raw(network_interface_t *iface, void *buffer, size_t max_len
     return NET_ERROR;
 }
 
-void network_process_packets(void) {
-    ethernet_frame_t frame;
+// Set while some thread is draining the interfaces. Driver RX rings aren't
+// locked, so a second caller leaves the work to the one already in there
+// and raises rx_missed: its frames may have arrived after the owner last
+// looked, so the owner queues another pass when it lets go.
+static volatile bool rx_busy = false;
+static volatile bool rx_missed = false;
+
+int network_poll(int budget) {
+    while (__atomic_exchange_n(&rx_busy, true, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&rx_missed, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rx_busy, __ATOMIC_SEQ_CST)) {
+            return 0;           // Still held: the owner will see rx_missed
+        }
+    }
+    __atomic_store_n(&rx_missed, false, __ATOMIC_SEQ_CST);
+    
+    int processed = 0;
     
     // Process packets on all active interfaces
-    for (int i = 0; i < interface_count; i++) {
+    for (int i = 0; i < interface_count && processed < budget; i++) {
         network_interface_t *iface = interfaces[i];
         if (!iface || !iface->active) {
             continue;
         }
 
-        // Try to receive and process frames
-        while (ethernet_receive_frame(iface, &frame) > 0) {
-            ethernet_process_frame(iface, &frame);
+        // Replies generated while processing go out in one doorbell
+        network_tx_batch_begin(iface);
+
+        // Receive and process frames a burst at a time
+        while (processed < budget) {
+            pbuf_t *burst[NET_RX_BURST];
+            int want = budget - processed < NET_RX_BURST ? budget - processed : NET_RX_BURST;
+            int n = ethernet_receive_burst(iface, burst, want);
+            if (n == 0) {
+                break;
+            }
+
+            for (int j = 0; j < n; j++) {
+                pcap_tap(iface, PCAP_DIR_RX, burst[j]->data, burst[j]->len);
+            }
+            ethernet_process_burst(iface, burst, n);
+            for (int j = 0; j < n; j++) {
+                pbuf_free(burst[j]);
+            }
+            processed += n;
+        }
+
+        network_tx_batch_end(iface);
+    }
+    
+    __atomic_store_n(&rx_busy, false, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&rx_missed, false, __ATOMIC_SEQ_CST)) {
+        network_schedule_poll();
+    }
+    return processed;
+}
+
+void network_process_packets(void) {
+    while (network_poll(NET_RX_BUDGET) == NET_RX_BUDGET) {
+        // Keep going until the interfaces are drained
+    }
+}
+
+// Deferred RX pass; re-queues itself while frames keep arriving so one
+// busy interface can't monopolise the worker
+static void network_rx_work_fn(void *arg) {
+    (void)arg;
+    if (network_poll(NET_RX_BUDGET) == NET_RX_BUDGET) {
+        network_schedule_poll();
+    }
+}
+
+static work_t network_rx_work = WORK_INIT(network_rx_work_fn, NULL);
+
+void network_schedule_poll(void) {
+    work_schedule(&network_rx_work);
+}
+
+static volatile bool rx_interrupts = false;
+
+void network_set_rx_interrupts(bool enabled) {
+    rx_interrupts = enabled;
+}
+
+bool network_rx_interrupts(void) {
+    return rx_interrupts;
+}
+
+void network_get_stats(network_interface_t *iface, netif_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (!iface) {
+        return;
+    }
+
+    const uint64_t *src;
+    uint64_t *dst = (uint64_t *)stats;
+    size_t words = offsetof(netif_stats_t, tx_proto) / sizeof(uint64_t) + NET_PROTO_COUNT;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        src = (const uint64_t *)&iface->stats[cpu];
+        for (size_t w = 0; w < words; w++) {
+            dst[w] += __atomic_load_n(&src[w], __ATOMIC_RELAXED);
         }
     }
 }
@@ -148,19 +332,13 @@ network_interface_t *network_find_interface_by_ip(uint32_t ip) {
 
 // Utility function to find best interface for destination
 network_interface_t *network_find_route(uint32_t dest_ip) {
-    // Simple routing: check if destination is on local subnet
-    for (int i = 0; i < interface_count; i++) {
-        network_interface_t *iface = interfaces[i];
-        if (iface && iface->active) {
-            uint32_t network = iface->ip_address & iface->subnet_mask;
-            uint32_t dest_network = dest_ip & iface->subnet_mask;
-            if (network == dest_network) {
-                return iface;
-            }
-        }
+    route_result_t route;
+    if (route_lookup(dest_ip, &route)) {
+        return route.iface;
     }
-    
-    // If not local, use first active interface (default route)
+
+    // No route (e.g. broadcasts before DHCP has configured anything): use
+    // the first active interface
     for (int i = 0; i < interface_count; i++) {
         if (interfaces[i] && interfaces[i]->active) {
             return interfaces[i];
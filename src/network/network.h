@@ -4,13 +4,18 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "../smp/smp.h"
 
 // Network Configuration
 #define MAX_NETWORK_INTERFACES 4
 #define ETHERNET_FRAME_SIZE 1518
 #define IP_PACKET_SIZE 1500
-#define MAX_SOCKETS 64
-#define MAX_CONNECTIONS 32
+
+// Frames the deferred RX work handles per pass before re-queueing itself
+#define NET_RX_BUDGET 64
+
+// Frames pulled from a driver and pushed through the stack per burst
+#define NET_RX_BURST 32
 
 // Error codes
 #define NET_SUCCESS 0
@@ -19,6 +24,43 @@
 #define NET_BUFFER_FULL -3
 #define NET_INVALID_PARAM -4
 
+// Offload capabilities a device advertises (network_interface_t::features)
+#define NETIF_F_RX_CSUM     0x01    // Verifies IP/TCP/UDP checksums on receive
+#define NETIF_F_TX_IP_CSUM  0x02    // Fills in IP header checksums
+#define NETIF_F_TX_L4_CSUM  0x04    // Completes TCP/UDP checksums from the pseudo-header sum
+
+struct pbuf;
+
+// Protocol slots of netif_stats_t::rx_proto / tx_proto
+enum {
+    NET_PROTO_ARP,
+    NET_PROTO_IP,
+    NET_PROTO_ICMP,
+    NET_PROTO_UDP,
+    NET_PROTO_TCP,
+    NET_PROTO_OTHER,
+    NET_PROTO_COUNT
+};
+
+// Interface counters. Each CPU updates its own cache-line-aligned copy, so
+// the hot path never shares a line with another CPU; readers sum them with
+// network_get_stats().
+typedef struct netif_stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;            // Not for us, no handler, or no buffer for it
+    uint64_t rx_errors;             // Runts and malformed headers
+    uint64_t rx_csum_errors;        // IP or transport checksum failed
+    uint64_t rx_overruns;           // Device ran out of receive descriptors
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;            // Discarded before reaching the device
+    uint64_t tx_errors;             // Device refused the frame
+    uint64_t tx_ring_full;          // Frames turned away by a full TX ring
+    uint64_t rx_proto[NET_PROTO_COUNT];
+    uint64_t tx_proto[NET_PROTO_COUNT];
+} __attribute__((aligned(64))) netif_stats_t;
+
 // Network interface structure
 typedef struct network_interface {
     uint8_t mac_address[6];
@@ -29,16 +71,68 @@ typedef struct network_interface {
     char name[16];
     void (*send_packet)(struct network_interface *iface, void *data, size_t len);
     int (*receive_packet)(struct network_interface *iface, void *buffer, size_t max_len);
+    // Optional burst hooks (NULL if unsupported). rx_burst hands up to n of
+    // the driver's own buffers up instead of copying; tx_burst transmits
+    // straight from pbufs and returns how many it took, the rest stay with
+    // the caller.
+    int (*rx_burst)(struct network_interface *iface, struct pbuf **bufs, int n);
+    int (*tx_burst)(struct network_interface *iface, struct pbuf **bufs, int n);
+    // Optional: push out frames the driver held back during a TX batch
+    void (*tx_flush)(struct network_interface *iface);
+    volatile int tx_batch;      // Open network_tx_batch_begin() scopes
+    uint32_t features;          // NETIF_F_* offloads the device handles
+    netif_stats_t stats[MAX_CPUS];  // Per-CPU counters, see NETIF_STAT_ADD()
 } network_interface_t;
 
+// Bump a counter in the calling CPU's slot. The add is atomic so a thread
+// migrating mid-update can't lose someone else's increment, but the line
+// is only ever contended on such a migration.
+#define NETIF_STAT_ADD(iface, field, n) \
+    __atomic_fetch_add(&(iface)->stats[smp_cpu_id()].field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define NETIF_STAT_INC(iface, field) NETIF_STAT_ADD(iface, field, 1)
+
+// NET_PROTO_* slot for an IP protocol number
+static inline int net_proto_index(uint8_t ip_protocol) {
+    switch (ip_protocol) {
+        case 1:  return NET_PROTO_ICMP;
+        case 6:  return NET_PROTO_TCP;
+        case 17: return NET_PROTO_UDP;
+        default: return NET_PROTO_OTHER;
+    }
+}
+
 // Function prototypes
 int network_init(void);
 int network_register_interface(network_interface_t *iface);
 network_interface_t *network_get_interface(int index);
 int network_send_raw(network_interface_t *iface, void *data, size_t len);
+// Transmit a finished frame. Takes over the caller's reference in all cases.
+int network_send_pbuf(network_interface_t *iface, struct pbuf *p);
+// Transmit n finished frames in one driver call where possible. Takes over
+// every reference; returns how many were handed to the device.
+int network_send_burst(network_interface_t *iface, struct pbuf **bufs, int n);
+// Between begin and end, drivers may queue frames without ringing the
+// hardware doorbell for each one; end flushes them. Scopes nest.
+void network_tx_batch_begin(network_interface_t *iface);
+void network_tx_batch_end(network_interface_t *iface);
 int network_receive_raw(network_interface_t *iface, void *buffer, size_t max_len);
 void network_process_packets(void);
 
+// Receive and process up to 'budget' frames. Returns how many were handled
+// (0 if another thread is already draining the interfaces).
+int network_poll(int budget);
+
+// Queue a receive pass on this CPU's deferred-work thread
+void network_schedule_poll(void);
+
+// Set by drivers once received frames raise an interrupt that schedules
+// the RX pass. While false, callers have to poll.
+void network_set_rx_interrupts(bool enabled);
+bool network_rx_interrupts(void);
+
+// Sum an interface's per-CPU counters into 'stats'
+void network_get_stats(network_interface_t *iface, netif_stats_t *stats);
+
 // Utility functions
 network_interface_t *network_find_interface_by_ip(uint32_t ip);
 network_interface_t *network_find_route(uint32_t dest_ip);
@@ -0,0 +1,132 @@
+#include "pbuf.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../sched/spinlock.h"
+#include "../debug/debug.h"
+
+#define PBUFS_PER_PAGE (PAGE_SIZE / PBUF_BUF_SIZE)
+
+static pbuf_t pbuf_headers[PBUF_POOL_SIZE];
+static pbuf_t *free_list = NULL;
+static uint32_t free_count = 0;
+static spinlock_t pbuf_lock = SPINLOCK_INIT_NAMED("pbuf");
+
+int pbuf_pool_init(void) {
+    if (free_list || free_count) {
+        return 0;  // Already set up
+    }
+    
+    // Page at a time: a buffer never straddles a page, so each one is
+    // physically contiguous without needing one big contiguous run
+    uint64_t phys = 0;
+    for (int i = PBUF_POOL_SIZE - 1; i >= 0; i--) {
+        if ((i + 1) % PBUFS_PER_PAGE == 0 || i == PBUF_POOL_SIZE - 1) {
+            void *page = physical_alloc_page();
+            if (!page) {
+                DEBUG_ERROR("pbuf: out of memory after %u buffers\n", free_count);
+                return free_count ? 0 : -1;
+            }
+            phys = (uint64_t)page;
+        }
+        
+        pbuf_t *p = &pbuf_headers[i];
+        p->phys = phys + (uint64_t)(i % PBUFS_PER_PAGE) * PBUF_BUF_SIZE;
+        p->buffer = (uint8_t *)PHYS_TO_HHDM(p->phys);
+        p->data = p->buffer;
+        p->len = 0;
+        p->refcount = 0;
+        p->next = free_list;
+        free_list = p;
+        free_count++;
+    }
+    
+    DEBUG_INFO("pbuf: %d x %d byte buffers\n", PBUF_POOL_SIZE, PBUF_BUF_SIZE);
+    return 0;
+}
+
+pbuf_t *pbuf_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&pbuf_lock);
+    pbuf_t *p = free_list;
+    if (p) {
+        free_list = p->next;
+        free_count--;
+    }
+    spin_unlock_irqrestore(&pbuf_lock, flags);
+    
+    if (!p) {
+        return NULL;
+    }
+    
+    p->next = NULL;
+    p->data = p->buffer;
+    p->len = 0;
+    p->refcount = 1;
+    p->csum_flags = 0;
+    p->l3_header = NULL;
+    p->l4_header = NULL;
+    return p;
+}
+
+pbuf_t *pbuf_alloc_tx(void) {
+    pbuf_t *p = pbuf_alloc();
+    if (p) {
+        p->data = p->buffer + PBUF_TX_HEADROOM;
+    }
+    return p;
+}
+
+void pbuf_ref(pbuf_t *p) {
+    __atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void pbuf_free(pbuf_t *p) {
+    if (!p) {
+        return;
+    }
+    if (__atomic_sub_fetch(&p->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&pbuf_lock);
+    p->next = free_list;
+    free_list = p;
+    free_count++;
+    spin_unlock_irqrestore(&pbuf_lock, flags);
+}
+
+void *pbuf_pull(pbuf_t *p, size_t n) {
+    if (n > p->len) {
+        return NULL;
+    }
+    p->data += n;
+    p->len -= n;
+    return p->data;
+}
+
+void pbuf_trim(pbuf_t *p, size_t len) {
+    if (len < p->len) {
+        p->len = (uint16_t)len;
+    }
+}
+
+void *pbuf_push(pbuf_t *p, size_t n) {
+    if (n > pbuf_headroom(p)) {
+        return NULL;
+    }
+    p->data -= n;
+    p->len += n;
+    return p->data;
+}
+
+void *pbuf_put(pbuf_t *p, size_t n) {
+    if (n > pbuf_tailroom(p)) {
+        return NULL;
+    }
+    uint8_t *tail = p->data + p->len;
+    p->len += n;
+    return tail;
+}
+
+uint32_t pbuf_pool_free_count(void) {
+    return free_count;
+}
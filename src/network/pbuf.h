@@ -0,0 +1,103 @@
+#ifndef PBUF_H
+#define PBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Packet buffers. A pbuf owns one fixed-size, DMA-able buffer from a
+// preallocated pool; NIC receive descriptors point straight at pbuf
+// storage, so a received frame travels up the stack in the buffer the
+// hardware wrote it into. Each layer strips its header with pbuf_pull()
+// instead of copying the payload out.
+//
+// pbufs are reference counted: whoever wants to keep one past the call
+// that handed it over takes a reference with pbuf_ref(), and every
+// reference is dropped with pbuf_free().
+//
+// Transmit goes the other way: the payload is copied once into a pbuf
+// allocated with headroom, each layer prepends its header with pbuf_push(),
+// and the driver DMAs the finished frame out of the same buffer.
+
+#define PBUF_BUF_SIZE       2048    // Matches the E1000 RX buffer size
+#ifndef PBUF_POOL_SIZE
+#define PBUF_POOL_SIZE      1024    // Buffers in the pool (NIC rings + in flight)
+#endif
+#define PBUF_TX_HEADROOM    128     // Ethernet + IP + TCP headers, options included
+
+// Checksum offload state (pbuf_t::csum_flags). The RX bits are set by
+// drivers that verified checksums in hardware; the TX bits ask the driver
+// to fill the checksum in, with l3_header/l4_header locating the headers.
+#define PBUF_CSUM_IP_OK     0x01    // RX: IP header checksum verified good
+#define PBUF_CSUM_IP_BAD    0x02    // RX: IP header checksum verified bad
+#define PBUF_CSUM_L4_OK     0x04    // RX: TCP/UDP checksum verified good
+#define PBUF_CSUM_L4_BAD    0x08    // RX: TCP/UDP checksum verified bad
+#define PBUF_TX_CSUM_IP     0x10    // TX: device computes the IP header checksum
+#define PBUF_TX_CSUM_TCP    0x20    // TX: device completes the TCP checksum
+#define PBUF_TX_CSUM_UDP    0x40    // TX: device completes the UDP checksum
+
+typedef struct pbuf {
+    struct pbuf *next;              // Free list / queue link
+    uint8_t *data;                  // First valid byte
+    uint16_t len;                   // Valid bytes from 'data'
+    volatile uint16_t refcount;
+    uint8_t *buffer;                // Start of storage (HHDM address)
+    uint64_t phys;                  // Physical address of 'buffer' for DMA
+    uint8_t csum_flags;             // PBUF_CSUM_* / PBUF_TX_CSUM_*
+    uint8_t *l3_header;             // TX offload: IP header within the buffer
+    uint8_t *l4_header;             // TX offload: TCP/UDP header within the buffer
+} pbuf_t;
+
+// Carve the pool out of physical memory. Returns 0 on success, -1 on failure.
+int pbuf_pool_init(void);
+
+// Take a buffer from the pool with refcount 1, data at the start of the
+// buffer and len 0. Returns NULL if the pool is empty. Safe from interrupt
+// handlers.
+pbuf_t *pbuf_alloc(void);
+
+// Like pbuf_alloc(), but with PBUF_TX_HEADROOM bytes reserved in front of
+// 'data' for the headers of every layer below the caller
+pbuf_t *pbuf_alloc_tx(void);
+
+// Take another reference
+void pbuf_ref(pbuf_t *p);
+
+// Drop a reference; the buffer goes back to the pool when the last goes
+void pbuf_free(pbuf_t *p);
+
+// Strip 'n' bytes from the front (consume a header). Returns the new data
+// pointer, or NULL (leaving the pbuf unchanged) if fewer than n bytes remain.
+void *pbuf_pull(pbuf_t *p, size_t n);
+
+// Shorten the valid data to 'len' bytes (drop link-layer padding)
+void pbuf_trim(pbuf_t *p, size_t len);
+
+// Grow the data at the front by 'n' bytes (prepend a header). Returns the
+// new data pointer, or NULL (leaving the pbuf unchanged) if the headroom
+// is too small.
+void *pbuf_push(pbuf_t *p, size_t n);
+
+// Grow the data at the end by 'n' bytes. Returns a pointer to the added
+// bytes, or NULL (leaving the pbuf unchanged) if they don't fit.
+void *pbuf_put(pbuf_t *p, size_t n);
+
+// Free bytes in front of 'data'
+static inline size_t pbuf_headroom(const pbuf_t *p) {
+    return (size_t)(p->data - p->buffer);
+}
+
+// Free bytes after the valid data
+static inline size_t pbuf_tailroom(const pbuf_t *p) {
+    return (size_t)(p->buffer + PBUF_BUF_SIZE - (p->data + p->len));
+}
+
+// Physical address of 'data' for handing to a DMA engine
+static inline uint64_t pbuf_dma_addr(const pbuf_t *p) {
+    return p->phys + (uint64_t)(p->data - p->buffer);
+}
+
+// Buffers currently free in the pool
+uint32_t pbuf_pool_free_count(void);
+
+#endif // PBUF_H
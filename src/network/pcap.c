@@ -0,0 +1,366 @@
+#include "pcap.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "../fs/fat16.h"
+#include "../memory/memory.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_LINKTYPE_ETHERNET 1
+
+// Classic libpcap file header and per-record header, host byte order
+typedef struct __attribute__((packed)) pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct __attribute__((packed)) pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
+
+// One snapshot. A writer owns the slot for ticket t once it has won the
+// ticket; it clears 'seq', fills the slot and publishes seq = t + 1. A
+// reader only trusts a slot whose seq reads t + 1 both before and after
+// copying it out.
+typedef struct pcap_slot {
+    volatile uint64_t seq;
+    uint64_t ts_ns;
+    uint32_t orig_len;
+    uint16_t caplen;
+    uint8_t dir;
+    uint8_t data[PCAP_SNAPLEN_MAX];
+} pcap_slot_t;
+
+volatile bool pcap_enabled = false;
+
+// Allocated on first start and kept: a tap that saw pcap_enabled just
+// before a stop may still be writing into it
+static pcap_slot_t *ring = NULL;
+static volatile uint64_t ring_head = 0;     // Next ticket
+static volatile uint64_t filtered = 0;
+static pcap_filter_t filter;
+static uint32_t snaplen = PCAP_SNAPLEN_DEFAULT;
+
+static inline uint16_t load_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool filter_match(network_interface_t *iface, uint8_t dir, const uint8_t *frame, size_t len) {
+    if (filter.dir && !(filter.dir & dir)) {
+        return false;
+    }
+    if (filter.iface && filter.iface != iface) {
+        return false;
+    }
+    if (!filter.ethertype && !filter.ip_proto && !filter.host && !filter.port) {
+        return true;
+    }
+    if (len < ETH_HLEN) {
+        return false;
+    }
+
+    uint16_t ethertype = load_be16(frame + 12);
+    if (filter.ethertype && ethertype != filter.ethertype) {
+        return false;
+    }
+    if (!filter.ip_proto && !filter.host && !filter.port) {
+        return true;
+    }
+
+    // Everything left looks inside an IPv4 header
+    if (ethertype != ETH_TYPE_IP || len < ETH_HLEN + IP_HEADER_LEN) {
+        return false;
+    }
+    const uint8_t *ip = frame + ETH_HLEN;
+    size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+    uint8_t proto = ip[9];
+    if (filter.ip_proto && proto != filter.ip_proto) {
+        return false;
+    }
+    if (filter.host && load_be32(ip + 12) != filter.host && load_be32(ip + 16) != filter.host) {
+        return false;
+    }
+    if (filter.port) {
+        // Ports are only in the first fragment
+        if ((proto != IP_PROTOCOL_TCP && proto != IP_PROTOCOL_UDP) ||
+            (load_be16(ip + 6) & IP_FRAGMENT_OFFSET_MASK) != 0 ||
+            len < ETH_HLEN + ihl + 4) {
+            return false;
+        }
+        const uint8_t *l4 = ip + ihl;
+        if (load_be16(l4) != filter.port && load_be16(l4 + 2) != filter.port) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void pcap_capture(network_interface_t *iface, uint8_t dir, const void *frame, size_t len) {
+    pcap_slot_t *r = ring;
+    if (!r || !frame) {
+        return;
+    }
+    if (!filter_match(iface, dir, frame, len)) {
+        __atomic_fetch_add(&filtered, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t ticket = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    pcap_slot_t *slot = &r[ticket & (PCAP_RING_SLOTS - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t caplen = len < snaplen ? len : snaplen;
+    slot->ts_ns = timer_get_ns();
+    slot->orig_len = (uint32_t)len;
+    slot->caplen = (uint16_t)caplen;
+    slot->dir = dir;
+    memcpy(slot->data, frame, caplen);
+
+    __atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+int pcap_start(const pcap_filter_t *f, uint32_t len) {
+    if (len == 0) {
+        len = PCAP_SNAPLEN_DEFAULT;
+    }
+    if (len < ETH_HLEN || len > PCAP_SNAPLEN_MAX) {
+        return NET_INVALID_PARAM;
+    }
+
+    if (!ring) {
+        ring = kmalloc(sizeof(pcap_slot_t) * PCAP_RING_SLOTS);
+        if (!ring) {
+            DEBUG_ERROR("pcap: no memory for %d-slot ring\n", PCAP_RING_SLOTS);
+            return NET_ERROR;
+        }
+    }
+
+    __atomic_store_n(&pcap_enabled, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < PCAP_RING_SLOTS; i++) {
+        ring[i].seq = 0;
+    }
+    if (f) {
+        filter = *f;
+    } else {
+        memset(&filter, 0, sizeof(filter));
+    }
+    snaplen = len;
+    __atomic_store_n(&ring_head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&filtered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pcap_enabled, true, __ATOMIC_RELEASE);
+
+    DEBUG_INFO("pcap: capturing, snaplen %u\n", snaplen);
+    return NET_SUCCESS;
+}
+
+void pcap_stop(void) {
+    __atomic_store_n(&pcap_enabled, false, __ATOMIC_RELEASE);
+}
+
+void pcap_get_status(pcap_status_t *status) {
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    status->enabled = pcap_enabled;
+    status->snaplen = snaplen;
+    status->slots = PCAP_RING_SLOTS;
+    status->captured = head;
+    status->filtered = __atomic_load_n(&filtered, __ATOMIC_RELAXED);
+    status->held = head < PCAP_RING_SLOTS ? (uint32_t)head : PCAP_RING_SLOTS;
+}
+
+static bool parse_u32(const char **s, uint32_t *out) {
+    const char *p = *s;
+    uint32_t v = 0;
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (uint32_t)(*p - '0');
+        p++;
+    }
+    *s = p;
+    *out = v;
+    return true;
+}
+
+static bool parse_ipv4(const char **s, uint32_t *out) {
+    uint32_t ip = 0;
+    for (int i = 0; i < 4; i++) {
+        uint32_t octet;
+        if (!parse_u32(s, &octet) || octet > 255) {
+            return false;
+        }
+        ip = (ip << 8) | octet;
+        if (i < 3) {
+            if (**s != '.') {
+                return false;
+            }
+            (*s)++;
+        }
+    }
+    *out = ip;
+    return true;
+}
+
+// Whether the n-byte term at 's' is exactly 'word'
+static bool term_is(const char *s, size_t n, const char *word) {
+    size_t i = 0;
+    for (; i < n && word[i]; i++) {
+        if (s[i] != word[i]) {
+            return false;
+        }
+    }
+    return i == n && word[i] == '\0';
+}
+
+static const char *next_term(const char *s, size_t *len) {
+    while (*s == ' ') s++;
+    size_t n = 0;
+    while (s[n] && s[n] != ' ') n++;
+    *len = n;
+    return s;
+}
+
+int pcap_parse_filter(const char *expr, pcap_filter_t *f) {
+    memset(f, 0, sizeof(*f));
+    if (!expr) {
+        return 0;
+    }
+
+    const char *s = expr;
+    size_t n;
+    for (s = next_term(s, &n); n > 0; s = next_term(s + n, &n)) {
+        if (term_is(s, n, "rx")) {
+            f->dir |= PCAP_DIR_RX;
+        } else if (term_is(s, n, "tx")) {
+            f->dir |= PCAP_DIR_TX;
+        } else if (term_is(s, n, "arp")) {
+            f->ethertype = ETH_TYPE_ARP;
+        } else if (term_is(s, n, "ip")) {
+            f->ethertype = ETH_TYPE_IP;
+        } else if (term_is(s, n, "icmp") || term_is(s, n, "tcp") || term_is(s, n, "udp")) {
+            f->ethertype = ETH_TYPE_IP;
+            f->ip_proto = s[0] == 'i' ? IP_PROTOCOL_ICMP : s[0] == 't' ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+        } else if (term_is(s, n, "host")) {
+            const char *arg = next_term(s + n, &n);
+            s = arg;
+            if (!parse_ipv4(&s, &f->host) || s != arg + n) {
+                return -1;
+            }
+            s = arg;
+        } else if (term_is(s, n, "port")) {
+            const char *arg = next_term(s + n, &n);
+            uint32_t port;
+            s = arg;
+            if (!parse_u32(&s, &port) || s != arg + n || port == 0 || port > 0xFFFF) {
+                return -1;
+            }
+            f->port = (uint16_t)port;
+            s = arg;
+        } else if (term_is(s, n, "dev")) {
+            const char *arg = next_term(s + n, &n);
+            f->iface = NULL;
+            for (int i = 0; i < MAX_NETWORK_INTERFACES && !f->iface; i++) {
+                network_interface_t *iface = network_get_interface(i);
+                if (iface && n < sizeof(iface->name) && term_is(arg, n, iface->name)) {
+                    f->iface = iface;
+                }
+            }
+            if (!f->iface) {
+                return -1;
+            }
+            s = arg;
+        } else {
+            return -1;
+        }
+    }
+
+    // A protocol that says where ports live doesn't combine with ARP
+    if (f->ethertype == ETH_TYPE_ARP && (f->host || f->port)) {
+        return -1;
+    }
+    return 0;
+}
+
+int pcap_export(const char *name) {
+    if (!name || !*name || !ring) {
+        return NET_INVALID_PARAM;
+    }
+    if (!fat16_is_mounted()) {
+        return NET_ERROR;
+    }
+
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > PCAP_RING_SLOTS ? head - PCAP_RING_SLOTS : 0;
+    uint32_t cap = snaplen;
+
+    size_t max_size = sizeof(pcap_file_header_t) +
+                      (size_t)(head - first) * (sizeof(pcap_record_header_t) + cap);
+    uint8_t *out = kmalloc(max_size);
+    if (!out) {
+        return NET_ERROR;
+    }
+
+    pcap_file_header_t *fh = (pcap_file_header_t *)out;
+    fh->magic = PCAP_MAGIC;
+    fh->version_major = 2;
+    fh->version_minor = 4;
+    fh->thiszone = 0;
+    fh->sigfigs = 0;
+    fh->snaplen = cap;
+    fh->linktype = PCAP_LINKTYPE_ETHERNET;
+    size_t pos = sizeof(*fh);
+
+    // Capture may still be running: snapshots overwritten while being
+    // copied are dropped rather than written out torn
+    int frames = 0;
+    for (uint64_t t = first; t < head; t++) {
+        pcap_slot_t *slot = &ring[t & (PCAP_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t + 1) {
+            continue;
+        }
+
+        pcap_record_header_t rh;
+        uint32_t caplen = slot->caplen > cap ? cap : slot->caplen;
+        rh.ts_sec = (uint32_t)(slot->ts_ns / 1000000000ULL);
+        rh.ts_usec = (uint32_t)((slot->ts_ns % 1000000000ULL) / 1000);
+        rh.incl_len = caplen;
+        rh.orig_len = slot->orig_len;
+        memcpy(out + pos, &rh, sizeof(rh));
+        memcpy(out + pos + sizeof(rh), slot->data, caplen);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != t + 1) {
+            continue;
+        }
+        pos += sizeof(rh) + caplen;
+        frames++;
+    }
+
+    int ret = frames;
+    if (fat16_find_file(name, NULL) < 0 && fat16_create_file(name) < 0) {
+        ret = NET_ERROR;
+    } else if (fat16_write_file(name, out, pos) < 0) {
+        ret = NET_ERROR;
+    }
+    kfree(out);
+
+    if (ret >= 0) {
+        DEBUG_INFO("pcap: wrote %d frames (%lu bytes) to %s\n", frames, (uint64_t)pos, name);
+    }
+    return ret;
+}
@@ -0,0 +1,453 @@
+#include "route.h"
+#include "inet_hash.h"
+#include "../memory/memory.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
+#include "../sched/spinlock.h"
+
+// Trie node. Nodes without routes are glue joining two subtrees where their
+// prefixes diverge, so every glue node has exactly two children and the
+// depth is bounded by 33 regardless of how many routes there are.
+typedef struct route_node {
+    struct route_node *child[2];
+    uint32_t prefix;
+    uint8_t prefix_len;
+    route_t *routes;                // Sorted by metric, NULL for glue
+} route_node_t;
+
+typedef struct route_cache_entry {
+    uint32_t dest;
+    uint32_t generation;            // route_generation when filled; 0 = empty
+    route_result_t result;
+} route_cache_entry_t;
+
+static route_node_t *route_root;
+static uint32_t route_count;
+static uint32_t route_generation = 1;
+static uint32_t route_cache_seed;
+static route_cache_entry_t route_cache[ROUTE_CACHE_SIZE];
+static uint64_t route_cache_hits;
+static uint64_t route_cache_misses;
+static spinlock_t route_lock = SPINLOCK_INIT_NAMED("route");
+
+uint32_t route_prefix_to_mask(uint8_t prefix_len) {
+    if (prefix_len == 0) {
+        return 0;
+    }
+    if (prefix_len >= 32) {
+        return 0xFFFFFFFF;
+    }
+    return 0xFFFFFFFFu << (32 - prefix_len);
+}
+
+uint8_t route_mask_to_prefix(uint32_t mask) {
+    // Leading ones; a non-contiguous mask is cut at its first hole
+    uint32_t inv = ~mask;
+    return inv ? (uint8_t)__builtin_clz(inv) : 32;
+}
+
+// Bit 'index' of an address, counting from the most significant
+static inline int addr_bit(uint32_t addr, uint8_t index) {
+    return (addr >> (31 - index)) & 1;
+}
+
+// Length of the common leading run of two prefixes, capped at 'max'
+static inline uint8_t common_len(uint32_t a, uint32_t b, uint8_t max) {
+    uint32_t diff = a ^ b;
+    uint8_t len = diff ? (uint8_t)__builtin_clz(diff) : 32;
+    return len < max ? len : max;
+}
+
+static route_node_t *node_alloc(uint32_t prefix, uint8_t prefix_len) {
+    route_node_t *node = kmalloc(sizeof(route_node_t));
+    if (node) {
+        node->child[0] = NULL;
+        node->child[1] = NULL;
+        node->prefix = prefix;
+        node->prefix_len = prefix_len;
+        node->routes = NULL;
+    }
+    return node;
+}
+
+// Find or create the node for a prefix. Requires route_lock.
+static route_node_t *node_insert_locked(uint32_t prefix, uint8_t prefix_len) {
+    route_node_t **link = &route_root;
+
+    while (*link) {
+        route_node_t *n = *link;
+        uint8_t max = prefix_len < n->prefix_len ? prefix_len : n->prefix_len;
+        uint8_t common = common_len(prefix, n->prefix, max);
+
+        if (common < n->prefix_len) {
+            if (common == prefix_len) {
+                // Our prefix covers n: slot in above it
+                route_node_t *node = node_alloc(prefix, prefix_len);
+                if (!node) {
+                    return NULL;
+                }
+                node->child[addr_bit(n->prefix, prefix_len)] = n;
+                *link = node;
+                return node;
+            }
+
+            // The two diverge at bit 'common': join them under glue
+            route_node_t *glue = node_alloc(prefix & route_prefix_to_mask(common), common);
+            route_node_t *leaf = node_alloc(prefix, prefix_len);
+            if (!glue || !leaf) {
+                kfree(glue);
+                kfree(leaf);
+                return NULL;
+            }
+            glue->child[addr_bit(n->prefix, common)] = n;
+            glue->child[addr_bit(prefix, common)] = leaf;
+            *link = glue;
+            return leaf;
+        }
+
+        if (n->prefix_len == prefix_len) {
+            return n;
+        }
+        link = &n->child[addr_bit(prefix, n->prefix_len)];
+    }
+
+    *link = node_alloc(prefix, prefix_len);
+    return *link;
+}
+
+// First route at a node whose interface can carry traffic
+static route_t *node_usable_route(const route_node_t *node) {
+    for (route_t *r = node->routes; r; r = r->next) {
+        if (r->iface && r->iface->active) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Requires route_lock
+static route_t *lookup_locked(uint32_t dest) {
+    route_t *best = NULL;
+    route_node_t *n = route_root;
+
+    while (n) {
+        if ((dest & route_prefix_to_mask(n->prefix_len)) != n->prefix) {
+            break;
+        }
+        route_t *r = node_usable_route(n);
+        if (r) {
+            best = r;
+        }
+        if (n->prefix_len >= 32) {
+            break;
+        }
+        n = n->child[addr_bit(dest, n->prefix_len)];
+    }
+    return best;
+}
+
+static inline void invalidate_cache_locked(void) {
+    route_generation++;
+    if (route_generation == 0) {
+        // Wrapped: 0 marks empty slots, so clear them for real
+        for (int i = 0; i < ROUTE_CACHE_SIZE; i++) {
+            route_cache[i].generation = 0;
+        }
+        route_generation = 1;
+    }
+}
+
+int route_init(void) {
+    uint64_t now = timer_get_ticks();
+    route_cache_seed = inet_hash_mix((uint32_t)timer_get_ns() ^ (uint32_t)now ^ 0x165667B1);
+    route_root = NULL;
+    route_count = 0;
+    for (int i = 0; i < ROUTE_CACHE_SIZE; i++) {
+        route_cache[i].generation = 0;
+    }
+    route_generation = 1;
+    return NET_SUCCESS;
+}
+
+int route_add(uint32_t dest, uint8_t prefix_len, uint32_t gateway,
+              network_interface_t *iface, uint32_t metric, uint8_t flags) {
+    if (!iface || prefix_len > 32) {
+        return NET_INVALID_PARAM;
+    }
+    dest &= route_prefix_to_mask(prefix_len);
+
+    route_t *fresh = kmalloc(sizeof(route_t));
+    if (!fresh) {
+        return NET_ERROR;
+    }
+
+    uint64_t flags_irq = spin_lock_irqsave(&route_lock);
+    route_node_t *node = node_insert_locked(dest, prefix_len);
+    if (!node) {
+        spin_unlock_irqrestore(&route_lock, flags_irq);
+        kfree(fresh);
+        return NET_ERROR;
+    }
+
+    // Same prefix and interface: take it out so it is re-filed by metric
+    route_t **link = &node->routes;
+    route_t *route = NULL;
+    while (*link) {
+        if ((*link)->iface == iface) {
+            route = *link;
+            *link = route->next;
+            break;
+        }
+        link = &(*link)->next;
+    }
+    if (!route) {
+        route = fresh;
+        fresh = NULL;
+        route_count++;
+    }
+
+    route->dest = dest;
+    route->prefix_len = prefix_len;
+    route->gateway = gateway;
+    route->metric = metric;
+    route->flags = flags;
+    route->iface = iface;
+
+    link = &node->routes;
+    while (*link && (*link)->metric <= metric) {
+        link = &(*link)->next;
+    }
+    route->next = *link;
+    *link = route;
+
+    invalidate_cache_locked();
+    spin_unlock_irqrestore(&route_lock, flags_irq);
+
+    kfree(fresh);
+    return NET_SUCCESS;
+}
+
+int route_delete(uint32_t dest, uint8_t prefix_len, network_interface_t *iface) {
+    if (prefix_len > 32) {
+        return NET_INVALID_PARAM;
+    }
+    dest &= route_prefix_to_mask(prefix_len);
+
+    route_t *victim = NULL;
+    route_node_t *freed[2] = { NULL, NULL };
+
+    uint64_t flags = spin_lock_irqsave(&route_lock);
+
+    route_node_t **parent_link = NULL;
+    route_node_t **link = &route_root;
+    while (*link) {
+        route_node_t *n = *link;
+        if (n->prefix_len > prefix_len ||
+            (dest & route_prefix_to_mask(n->prefix_len)) != n->prefix) {
+            break;
+        }
+        if (n->prefix_len == prefix_len) {
+            route_t **rlink = &n->routes;
+            while (*rlink) {
+                if (!iface || (*rlink)->iface == iface) {
+                    victim = *rlink;
+                    *rlink = victim->next;
+                    break;
+                }
+                rlink = &(*rlink)->next;
+            }
+            break;
+        }
+        parent_link = link;
+        link = &n->child[addr_bit(dest, n->prefix_len)];
+    }
+
+    if (victim) {
+        route_count--;
+        route_node_t *n = *link;
+        if (!n->routes && !(n->child[0] && n->child[1])) {
+            // Nothing left to hold this node up; splice its child in
+            *link = n->child[0] ? n->child[0] : n->child[1];
+            freed[0] = n;
+
+            // A glue parent left with a single child goes the same way
+            if (parent_link) {
+                route_node_t *p = *parent_link;
+                if (!p->routes && !(p->child[0] && p->child[1])) {
+                    *parent_link = p->child[0] ? p->child[0] : p->child[1];
+                    freed[1] = p;
+                }
+            }
+        }
+        invalidate_cache_locked();
+    }
+    spin_unlock_irqrestore(&route_lock, flags);
+
+    if (!victim) {
+        return NET_ERROR;
+    }
+    kfree(victim);
+    kfree(freed[0]);
+    kfree(freed[1]);
+    return NET_SUCCESS;
+}
+
+bool route_lookup(uint32_t dest, route_result_t *result) {
+    if (!result) {
+        return false;
+    }
+
+    route_cache_entry_t *slot = &route_cache[inet_hash_mix(dest ^ route_cache_seed) & (ROUTE_CACHE_SIZE - 1)];
+    bool found = false;
+
+    uint64_t flags = spin_lock_irqsave(&route_lock);
+    if (slot->generation == route_generation && slot->dest == dest &&
+        slot->result.iface->active) {
+        *result = slot->result;
+        route_cache_hits++;
+        found = true;
+    } else {
+        route_cache_misses++;
+        route_t *r = lookup_locked(dest);
+        if (r) {
+            result->iface = r->iface;
+            result->next_hop = r->gateway ? r->gateway : dest;
+            result->prefix_len = r->prefix_len;
+            slot->dest = dest;
+            slot->result = *result;
+            slot->generation = route_generation;
+            found = true;
+        }
+    }
+    spin_unlock_irqrestore(&route_lock, flags);
+    return found;
+}
+
+uint32_t route_next_hop(network_interface_t *iface, uint32_t dest) {
+    route_result_t result;
+    if (route_lookup(dest, &result) && result.iface == iface) {
+        return result.next_hop;
+    }
+
+    // Caller chose a different interface than the table would; fall back
+    // to that interface's own subnet and gateway
+    if (iface && iface->gateway != 0 && iface->subnet_mask != 0 &&
+        (dest & iface->subnet_mask) != (iface->ip_address & iface->subnet_mask)) {
+        return iface->gateway;
+    }
+    return dest;
+}
+
+// Remove every ROUTE_F_AUTO route of 'iface' below '*link', then splice out
+// nodes left without routes and with fewer than two children. Requires
+// route_lock; dropped routes and nodes are handed back for freeing.
+static void drop_auto_routes_locked(route_node_t **link, network_interface_t *iface,
+                                    route_t **dropped, route_node_t **freed) {
+    route_node_t *node = *link;
+    if (!node) {
+        return;
+    }
+    route_t **rlink = &node->routes;
+    while (*rlink) {
+        route_t *r = *rlink;
+        if (r->iface == iface && (r->flags & ROUTE_F_AUTO)) {
+            *rlink = r->next;
+            r->next = *dropped;
+            *dropped = r;
+            route_count--;
+        } else {
+            rlink = &r->next;
+        }
+    }
+    drop_auto_routes_locked(&node->child[0], iface, dropped, freed);
+    drop_auto_routes_locked(&node->child[1], iface, dropped, freed);
+
+    if (!node->routes && !(node->child[0] && node->child[1])) {
+        *link = node->child[0] ? node->child[0] : node->child[1];
+        node->child[0] = *freed;
+        *freed = node;
+    }
+}
+
+void route_sync_interface(network_interface_t *iface) {
+    if (!iface) {
+        return;
+    }
+
+    route_t *dropped = NULL;
+    route_node_t *freed = NULL;
+    uint64_t flags = spin_lock_irqsave(&route_lock);
+    drop_auto_routes_locked(&route_root, iface, &dropped, &freed);
+    invalidate_cache_locked();
+    spin_unlock_irqrestore(&route_lock, flags);
+
+    while (dropped) {
+        route_t *next = dropped->next;
+        kfree(dropped);
+        dropped = next;
+    }
+    while (freed) {
+        route_node_t *next = freed->child[0];
+        kfree(freed);
+        freed = next;
+    }
+
+    if (iface->ip_address == 0) {
+        return;
+    }
+
+    uint8_t prefix_len = route_mask_to_prefix(iface->subnet_mask);
+    if (prefix_len > 0) {
+        route_add(iface->ip_address, prefix_len, 0, iface, ROUTE_METRIC_CONNECTED, ROUTE_F_AUTO);
+    }
+    if (iface->gateway != 0) {
+        route_add(0, 0, iface->gateway, iface, ROUTE_METRIC_DEFAULT, ROUTE_F_AUTO);
+    }
+
+    DEBUG_INFO("Route: %s %d.%d.%d.%d/%u gw %d.%d.%d.%d\n", iface->name,
+               (iface->ip_address >> 24) & 0xFF, (iface->ip_address >> 16) & 0xFF,
+               (iface->ip_address >> 8) & 0xFF, iface->ip_address & 0xFF, prefix_len,
+               (iface->gateway >> 24) & 0xFF, (iface->gateway >> 16) & 0xFF,
+               (iface->gateway >> 8) & 0xFF, iface->gateway & 0xFF);
+}
+
+// In-order walk filling 'info'. Requires route_lock.
+static void collect_locked(const route_node_t *node, route_info_t *info, int max, int *count) {
+    if (!node || *count >= max) {
+        return;
+    }
+    for (const route_t *r = node->routes; r && *count < max; r = r->next) {
+        route_info_t *out = &info[(*count)++];
+        out->dest = r->dest;
+        out->prefix_len = r->prefix_len;
+        out->flags = r->flags;
+        out->gateway = r->gateway;
+        out->metric = r->metric;
+        out->iface_name = r->iface->name;
+    }
+    collect_locked(node->child[0], info, max, count);
+    collect_locked(node->child[1], info, max, count);
+}
+
+int route_get_info(route_info_t *info, int max) {
+    if (!info || max <= 0) {
+        return 0;
+    }
+
+    int count = 0;
+    uint64_t flags = spin_lock_irqsave(&route_lock);
+    collect_locked(route_root, info, max, &count);
+    spin_unlock_irqrestore(&route_lock, flags);
+    return count;
+}
+
+void route_get_stats(route_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&route_lock);
+    stats->routes = route_count;
+    stats->cache_hits = route_cache_hits;
+    stats->cache_misses = route_cache_misses;
+    spin_unlock_irqrestore(&route_lock, flags);
+}
@@ -0,0 +1,82 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "network.h"
+
+// IPv4 routing table: a path-compressed binary (Patricia) trie keyed on the
+// destination prefix for longest-prefix match, fronted by a direct-mapped
+// per-destination cache. Any change to the table bumps a generation number
+// that invalidates every cached result at once.
+
+#define ROUTE_CACHE_SIZE 256        // Cached destinations, power of two
+#define ROUTE_METRIC_CONNECTED 0
+#define ROUTE_METRIC_DEFAULT 100
+
+// Route flags
+#define ROUTE_F_AUTO    0x01        // Derived from an interface's address; replaced on reconfigure
+#define ROUTE_F_STATIC  0x02        // Added by hand
+
+typedef struct route {
+    struct route *next;             // Next route for the same prefix, by metric
+    uint32_t dest;                  // Network address, host bits clear
+    uint8_t prefix_len;
+    uint8_t flags;
+    uint32_t gateway;               // 0 = destination is on-link
+    uint32_t metric;                // Lower wins among equal prefixes
+    network_interface_t *iface;
+} route_t;
+
+// Result of a lookup
+typedef struct route_result {
+    network_interface_t *iface;
+    uint32_t next_hop;              // Gateway, or the destination itself when on-link
+    uint8_t prefix_len;
+} route_result_t;
+
+// Snapshot of one route for display
+typedef struct route_info {
+    uint32_t dest;
+    uint8_t prefix_len;
+    uint8_t flags;
+    uint32_t gateway;
+    uint32_t metric;
+    const char *iface_name;
+} route_info_t;
+
+typedef struct route_stats {
+    uint32_t routes;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+} route_stats_t;
+
+int route_init(void);
+
+// Add a route. An existing route for the same prefix and interface is
+// updated in place. Returns NET_SUCCESS, NET_INVALID_PARAM or NET_ERROR.
+int route_add(uint32_t dest, uint8_t prefix_len, uint32_t gateway,
+              network_interface_t *iface, uint32_t metric, uint8_t flags);
+
+// Remove the route for a prefix (on 'iface', or any interface if NULL)
+int route_delete(uint32_t dest, uint8_t prefix_len, network_interface_t *iface);
+
+// Longest-prefix match over routes whose interface is up
+bool route_lookup(uint32_t dest, route_result_t *result);
+
+// Next hop for a packet already bound to 'iface'
+uint32_t route_next_hop(network_interface_t *iface, uint32_t dest);
+
+// Replace the ROUTE_F_AUTO routes of an interface (connected subnet and
+// default gateway) after its address changed
+void route_sync_interface(network_interface_t *iface);
+
+// Fill up to 'max' entries in prefix order; returns how many were written
+int route_get_info(route_info_t *info, int max);
+void route_get_stats(route_stats_t *stats);
+
+// Netmask <-> prefix length
+uint8_t route_mask_to_prefix(uint32_t mask);
+uint32_t route_prefix_to_mask(uint8_t prefix_len);
+
+#endif // ROUTE_H
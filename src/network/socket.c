@@ -1,28 +1,107 @@
 #include "socket.h"
 #include "udp.h"
 #include "tcp.h"
+#include "network.h"
 #include "../memory/memory.h"
+#include "../sched/spinlock.h"
+#include "../sched/sync.h"
+#include "../timer/timer.h"
 
-#define MAX_SOCKETS 64
+#define MAX_SOCKETS 4096
+#define MAX_EPOLL 16
 
-static socket_t sockets[MAX_SOCKETS];
+#define SOCKET_MS_TO_TICKS(ms) (((uint64_t)(ms) * TIMER_FREQUENCY_HZ + 999) / 1000)
+
+// Socket objects are allocated the first time their descriptor is used and
+// kept for reuse, so protocol callbacks and blocked threads holding a
+// pointer always find a valid lock and wait queue; they check the
+// generation to tell whether the descriptor still means the same socket.
+static socket_t *sockets[MAX_SOCKETS];
 static bool socket_used[MAX_SOCKETS];
 static int next_socket_fd = 0;
+static spinlock_t socket_table_lock = SPINLOCK_INIT_NAMED("sockets");
+
+// Threads in socket_poll(); every readiness change wakes them
+static wait_queue_t poll_waiters = WAIT_QUEUE_INIT;
+
+// One registration of a socket with an epoll instance
+typedef struct socket_epitem {
+    struct socket_epoll *ep;
+    socket_t *sock;
+    int fd;
+    uint32_t events;                // EPOLL* interest; 0 once a ONESHOT fired
+    uint64_t data;
+    bool queued;                    // On the ready list (ep->lock)
+    bool dead;                      // Socket closed (ep->lock)
+    struct socket_epitem *ready_next;   // ep->lock
+    struct socket_epitem *sock_next;    // sock->lock
+    struct socket_epitem *ep_next;      // ep->mutex
+} socket_epitem_t;
+
+// Lock order: conn->lock, sock->lock, ep->lock, then wait queues. The mutex
+// serialises epoll_ctl with the part of epoll_wait that inspects items.
+typedef struct socket_epoll {
+    bool used;
+    spinlock_t lock;
+    mutex_t mutex;
+    wait_queue_t wait;
+    socket_epitem_t *items;
+    socket_epitem_t *ready_head;
+    socket_epitem_t *ready_tail;
+} socket_epoll_t;
+
+static socket_epoll_t epolls[MAX_EPOLL];
+static bool epolls_initialized = false;
 
 static int allocate_socket_fd(void) {
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (!socket_used[i]) {
-            socket_used[i] = true;
-            return i;
+    int fd = -1; // No free sockets
+    uint64_t flags = spin_lock_irqsave(&socket_table_lock);
+    for (int n = 0; n < MAX_SOCKETS; n++) {
+        int i = (next_socket_fd + n) % MAX_SOCKETS;
+        if (socket_used[i]) {
+            continue;
+        }
+        if (!sockets[i]) {
+            socket_t *sock = kmalloc(sizeof(socket_t));
+            if (!sock) {
+                break;
+            }
+            memset(sock, 0, sizeof(socket_t));
+            spin_lock_init_named(&sock->lock, "socket");
+            wait_queue_init(&sock->wait);
+            sockets[i] = sock;
         }
+        socket_used[i] = true;
+        sockets[i]->generation++;
+        sockets[i]->closing = false;
+        next_socket_fd = (i + 1) % MAX_SOCKETS;
+        fd = i;
+        break;
     }
-    return -1; // No free sockets
+    spin_unlock_irqrestore(&socket_table_lock, flags);
+    return fd;
 }
 
 static void free_socket_fd(int sockfd) {
-    if (sockfd >= 0 && sockfd < MAX_SOCKETS) {
+    if (sockfd >= 0 && sockfd < MAX_SOCKETS && sockets[sockfd]) {
+        socket_t *sock = sockets[sockfd];
+        uint64_t flags = spin_lock_irqsave(&socket_table_lock);
+        sock->type = 0;
+        sock->protocol = 0;
+        sock->bound = false;
+        sock->connected = false;
+        sock->listening = false;
+        sock->bound_port = 0;
+        sock->impl.udp_socket = NULL;
+        sock->nonblocking = false;
+        sock->recv_timeout_ms = 0;
+        sock->send_timeout_ms = 0;
+        sock->rx_dropped = 0;
         socket_used[sockfd] = false;
-        memset(&sockets[sockfd], 0, sizeof(socket_t));
+        spin_unlock_irqrestore(&socket_table_lock, flags);
+
+        // Anyone still blocked on it sees the descriptor gone
+        wait_queue_wake_all(&sock->wait);
     }
 }
 
@@ -30,9 +109,167 @@ static socket_t *get_socket(int sockfd) {
     if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_used[sockfd]) {
         return NULL;
     }
-    return &sockets[sockfd];
+    return sockets[sockfd];
 }
 
+// Readiness
+
+// Queue an epoll registration on its instance's ready list. sock->lock held.
+static void epitem_mark_ready(socket_epitem_t *item) {
+    socket_epoll_t *ep = item->ep;
+    uint64_t flags = spin_lock_irqsave(&ep->lock);
+    if (!item->queued && !item->dead && item->events != 0) {
+        item->queued = true;
+        item->ready_next = NULL;
+        if (ep->ready_tail) {
+            ep->ready_tail->ready_next = item;
+        } else {
+            ep->ready_head = item;
+        }
+        ep->ready_tail = item;
+        wait_queue_wake_all(&ep->wait);
+    }
+    spin_unlock_irqrestore(&ep->lock, flags);
+}
+
+// Something about the socket changed: wake its blocked threads and tell
+// any epoll instances watching it. Never calls back into the protocols, so
+// it is safe under their locks.
+static void socket_notify(socket_t *sock) {
+    wait_queue_wake_all(&sock->wait);
+    wait_queue_wake_all(&poll_waiters);
+
+    uint64_t flags = spin_lock_irqsave(&sock->lock);
+    for (socket_epitem_t *item = sock->watchers; item; item = item->sock_next) {
+        epitem_mark_ready(item);
+    }
+    spin_unlock_irqrestore(&sock->lock, flags);
+}
+
+// TCP readiness hook, called under the connection's lock
+static void socket_tcp_ready(tcp_connection_t *conn, void *ctx) {
+    (void)conn;
+    socket_notify((socket_t *)ctx);
+}
+
+// UDP receive callback: queue a copy of the datagram for recv/recvfrom
+static void socket_udp_receive(udp_socket_t *usock, void *data, size_t len, uint32_t src_ip, uint16_t src_port) {
+    socket_t *sock = usock->context;
+    if (!sock) {
+        return;
+    }
+
+    socket_dgram_t *dgram = kmalloc(sizeof(socket_dgram_t) + len);
+    if (!dgram) {
+        return;
+    }
+    dgram->next = NULL;
+    dgram->src_ip = src_ip;
+    dgram->src_port = src_port;
+    dgram->len = len;
+    memcpy(dgram->data, data, len);
+
+    uint64_t flags = spin_lock_irqsave(&sock->lock);
+    // Closed (or reused for another socket) while this was in flight?
+    if (sock->closing || sock->impl.udp_socket != usock || sock->rx_count >= SOCKET_UDP_QUEUE_MAX) {
+        sock->rx_dropped++;
+        spin_unlock_irqrestore(&sock->lock, flags);
+        kfree(dgram);
+        return;
+    }
+    if (sock->rx_tail) {
+        sock->rx_tail->next = dgram;
+    } else {
+        sock->rx_head = dgram;
+    }
+    sock->rx_tail = dgram;
+    sock->rx_count++;
+    spin_unlock_irqrestore(&sock->lock, flags);
+
+    socket_notify(sock);
+}
+
+static socket_dgram_t *socket_dgram_pop(socket_t *sock) {
+    uint64_t flags = spin_lock_irqsave(&sock->lock);
+    socket_dgram_t *dgram = sock->rx_head;
+    if (dgram) {
+        sock->rx_head = dgram->next;
+        if (!sock->rx_head) {
+            sock->rx_tail = NULL;
+        }
+        sock->rx_count--;
+    }
+    spin_unlock_irqrestore(&sock->lock, flags);
+    return dgram;
+}
+
+// Current POLL* bits of a socket
+static uint32_t socket_readiness(socket_t *sock) {
+    uint32_t mask = 0;
+
+    switch (sock->type) {
+        case SOCK_DGRAM: {
+            uint64_t flags = spin_lock_irqsave(&sock->lock);
+            if (sock->rx_head) {
+                mask |= POLLIN;
+            }
+            spin_unlock_irqrestore(&sock->lock, flags);
+            mask |= POLLOUT;
+            break;
+        }
+
+        case SOCK_STREAM: {
+            if (!sock->connected && !sock->listening) {
+                return POLLHUP;
+            }
+            uint32_t state = tcp_poll((tcp_connection_t *)sock->impl.tcp_connection);
+            if (state & TCP_POLL_READ) {
+                mask |= POLLIN;
+            }
+            if (state & TCP_POLL_WRITE) {
+                mask |= POLLOUT;
+            }
+            if (state & TCP_POLL_HUP) {
+                mask |= POLLHUP | POLLIN;   // A read returns end of file at once
+            }
+            break;
+        }
+    }
+
+    return mask;
+}
+
+static bool socket_wait_done(socket_t *sock, uint32_t gen, uint32_t events) {
+    return sock->generation != gen || sock->closing ||
+           (socket_readiness(sock) & (events | POLLERR | POLLHUP)) != 0;
+}
+
+// Block until one of 'events' is ready on the socket. Returns 0, or
+// SOCKET_TIMEOUT, or SOCKET_ERROR if the socket was closed meanwhile.
+static int socket_wait(socket_t *sock, uint32_t events, uint32_t timeout_ms) {
+    uint32_t gen = sock->generation;
+    uint64_t deadline = timeout_ms ? timer_get_ticks() + SOCKET_MS_TO_TICKS(timeout_ms) : 0;
+
+    while (!socket_wait_done(sock, gen, events)) {
+        uint64_t now = timer_get_ticks();
+        if (deadline && now >= deadline) {
+            return SOCKET_TIMEOUT;
+        }
+
+        // Without RX interrupts nothing arrives unless someone polls
+        uint64_t slice = deadline ? deadline - now : TIMER_FREQUENCY_HZ;
+        if (!network_rx_interrupts()) {
+            network_process_packets();
+            slice = 1;
+        }
+        wait_event_timeout(&sock->wait, socket_wait_done(sock, gen, events), slice);
+    }
+
+    return (sock->generation != gen || sock->closing) ? SOCKET_ERROR : 0;
+}
+
+// Socket calls
+
 int socket_create(int domain, int type, int protocol) {
     if (domain != AF_INET) {
         return -1; // Only IPv4 supported
@@ -43,7 +280,7 @@ int socket_create(int domain, int type, int protocol) {
         return -1;
     }
 
-    socket_t *sock = &sockets[sockfd];
+    socket_t *sock = sockets[sockfd];
     sock->type = type;
     sock->protocol = protocol;
     sock->bound = false;
@@ -51,22 +288,27 @@ int socket_create(int domain, int type, int protocol) {
     sock->listening = false;
 
     switch (type) {
-        case SOCK_DGRAM:
-            sock->impl.udp_socket = udp_create_socket();
-            if (!sock->impl.udp_socket) {
+        case SOCK_DGRAM: {
+            udp_socket_t *usock = udp_create_socket();
+            if (!usock) {
                 free_socket_fd(sockfd);
                 return -1;
             }
+            usock->context = sock;
+            usock->receive_callback = socket_udp_receive;
+            sock->impl.udp_socket = usock;
             break;
-            
+        }
+
         case SOCK_STREAM:
             sock->impl.tcp_connection = tcp_create_connection();
             if (!sock->impl.tcp_connection) {
                 free_socket_fd(sockfd);
                 return -1;
             }
+            tcp_set_ready_hook((tcp_connection_t *)sock->impl.tcp_connection, socket_tcp_ready, sock);
             break;
-            
+
         default:
             free_socket_fd(sockfd);
             return -1;
@@ -91,7 +333,7 @@ int socket_bind(int sockfd, const sockaddr_t *addr, int addrlen) {
                 return 0;
             }
             break;
-            
+
         case SOCK_STREAM:
             // For TCP, binding stores the port for later listen
             sock->bound_port = port;
@@ -103,17 +345,15 @@ int socket_bind(int sockfd, const sockaddr_t *addr, int addrlen) {
 }
 
 int socket_listen(int sockfd, int backlog) {
-    (void)backlog; // Unused parameter
-    
     socket_t *sock = get_socket(sockfd);
     if (!sock || sock->type != SOCK_STREAM || !sock->bound) {
         return -1;
     }
 
-    // Use the port from bind()
+    // Use the port from bind(); the socket's connection becomes the listener
     uint16_t port = sock->bound_port;
-    
-    if (tcp_listen(port) == NET_SUCCESS) {
+
+    if (tcp_listen((tcp_connection_t *)sock->impl.tcp_connection, port, backlog) == NET_SUCCESS) {
         sock->listening = true;
         return 0;
     }
@@ -121,18 +361,54 @@ int socket_listen(int sockfd, int backlog) {
     return -1;
 }
 
+// Waits for a connection to complete its handshake unless non-blocking
 int socket_accept(int sockfd, sockaddr_t *addr, int *addrlen) {
-    (void)addr;    // Unused parameter
-    (void)addrlen; // Unused parameter
-    
     socket_t *sock = get_socket(sockfd);
     if (!sock || sock->type != SOCK_STREAM || !sock->listening) {
         return -1;
     }
 
-    // This is a simplified implementation
-    // In a real system, this would block until a connection arrives
-    return -1; // Not implemented for this basic example
+    tcp_connection_t *listener = (tcp_connection_t *)sock->impl.tcp_connection;
+    tcp_connection_t *conn;
+    while (!(conn = tcp_accept(listener, false))) {
+        if (sock->nonblocking) {
+            return SOCKET_WOULD_BLOCK;
+        }
+        int result = socket_wait(sock, POLLIN, sock->recv_timeout_ms);
+        if (result != 0) {
+            return result;
+        }
+        if (tcp_poll(listener) & TCP_POLL_HUP) {
+            return -1; // Listener closed while waiting
+        }
+    }
+
+    int newfd = allocate_socket_fd();
+    if (newfd < 0) {
+        tcp_close(conn);
+        return -1;
+    }
+
+    socket_t *child = sockets[newfd];
+    child->type = SOCK_STREAM;
+    child->protocol = sock->protocol;
+    child->bound = true;
+    child->connected = true;
+    child->listening = false;
+    child->bound_port = conn->local_port;
+    child->impl.tcp_connection = conn;
+    tcp_set_ready_hook(conn, socket_tcp_ready, child);
+
+    if (addr && addrlen && *addrlen >= (int)sizeof(sockaddr_in_t)) {
+        sockaddr_in_t *addr_in = (sockaddr_in_t *)addr;
+        memset(addr_in, 0, sizeof(*addr_in));
+        addr_in->sin_family = AF_INET;
+        addr_in->sin_port = htons(conn->remote_port);
+        addr_in->sin_addr = htonl(conn->remote_ip);
+        *addrlen = sizeof(sockaddr_in_t);
+    }
+
+    return newfd;
 }
 
 int socket_connect(int sockfd, const sockaddr_t *addr, int addrlen) {
@@ -152,21 +428,37 @@ int socket_connect(int sockfd, const sockaddr_t *addr, int addrlen) {
                 return 0;
             }
             break;
-            
-        case SOCK_STREAM:
-            if (tcp_connect((tcp_connection_t *)sock->impl.tcp_connection, ip, port) == NET_SUCCESS) {
-                sock->connected = true;
-                return 0;
+
+        case SOCK_STREAM: {
+            tcp_connection_t *conn = (tcp_connection_t *)sock->impl.tcp_connection;
+            if (tcp_connect(conn, ip, port) != NET_SUCCESS) {
+                break;
             }
-            break;
+            sock->connected = true;
+            if (sock->nonblocking) {
+                return 0;   // Handshake in progress; POLLOUT signals completion
+            }
+
+            // Blocking: wait for the handshake to finish or fail
+            int result = socket_wait(sock, POLLOUT, sock->send_timeout_ms);
+            if (result == 0 && (tcp_poll(conn) & TCP_POLL_HUP)) {
+                result = -1;
+            }
+            if (result != 0) {
+                sock->connected = false;
+            }
+            return result;
+        }
     }
 
     return -1;
 }
 
+// Blocking sockets wait for room until everything is queued (or the send
+// timeout passes); a short count is returned if some of it went
 int socket_send(int sockfd, const void *buf, size_t len, int flags) {
     (void)flags; // Unused parameter
-    
+
     socket_t *sock = get_socket(sockfd);
     if (!sock || !buf || len == 0) {
         return -1;
@@ -178,41 +470,103 @@ int socket_send(int sockfd, const void *buf, size_t len, int flags) {
                 return udp_send((udp_socket_t *)sock->impl.udp_socket, (void *)buf, len);
             }
             break;
-            
-        case SOCK_STREAM:
-            if (sock->connected) {
-                return tcp_send((tcp_connection_t *)sock->impl.tcp_connection, (void *)buf, len);
+
+        case SOCK_STREAM: {
+            if (!sock->connected) {
+                break;
             }
-            break;
+            tcp_connection_t *conn = (tcp_connection_t *)sock->impl.tcp_connection;
+            size_t sent = 0;
+            while (sent < len) {
+                int n = tcp_send(conn, (uint8_t *)buf + sent, len - sent);
+                if (n > 0) {
+                    sent += n;
+                    continue;
+                }
+                if (n != NET_BUFFER_FULL) {
+                    return sent ? (int)sent : -1;
+                }
+                if (sock->nonblocking) {
+                    return sent ? (int)sent : SOCKET_WOULD_BLOCK;
+                }
+                int result = socket_wait(sock, POLLOUT, sock->send_timeout_ms);
+                if (result != 0) {
+                    return sent ? (int)sent : result;
+                }
+            }
+            return (int)sent;
+        }
     }
 
     return -1;
 }
 
+// Copy a queued datagram out, truncating it to the buffer
+static int socket_recv_dgram(socket_t *sock, void *buf, size_t len, uint32_t *src_ip, uint16_t *src_port) {
+    socket_dgram_t *dgram;
+    while (!(dgram = socket_dgram_pop(sock))) {
+        if (sock->nonblocking) {
+            return SOCKET_WOULD_BLOCK;
+        }
+        int result = socket_wait(sock, POLLIN, sock->recv_timeout_ms);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    size_t n = dgram->len < len ? dgram->len : len;
+    memcpy(buf, dgram->data, n);
+    *src_ip = dgram->src_ip;
+    *src_port = dgram->src_port;
+    kfree(dgram);
+    return (int)n;
+}
+
+// Returns bytes read, 0 at end of file, or an error. Blocking sockets wait
+// for data (or the receive timeout).
 int socket_recv(int sockfd, void *buf, size_t len, int flags) {
     (void)flags; // Unused parameter
-    
+
     socket_t *sock = get_socket(sockfd);
     if (!sock || !buf || len == 0) {
         return -1;
     }
 
     switch (sock->type) {
-        case SOCK_DGRAM:
-            // UDP sockets use the recvfrom path or callbacks
-            // For recv on a connected UDP socket, we'd need a receive buffer
-            // This is a limitation - UDP data arrives via callbacks in udp_process_packet
-            return -1; // No data currently queued
-            
-        case SOCK_STREAM:
-            // TCP sockets would read from the connection's receive buffer
-            // This requires a receive buffer implementation in tcp_connection_t
-            if (sock->connected && sock->impl.tcp_connection) {
-                // In a full implementation, this would read from TCP receive buffer
-                // For now, return 0 to indicate no data ready (non-blocking behavior)
-                return 0;
+        case SOCK_DGRAM: {
+            uint32_t src_ip;
+            uint16_t src_port;
+            return socket_recv_dgram(sock, buf, len, &src_ip, &src_port);
+        }
+
+        case SOCK_STREAM: {
+            if (!sock->connected || !sock->impl.tcp_connection) {
+                break;
             }
-            break;
+            tcp_connection_t *conn = (tcp_connection_t *)sock->impl.tcp_connection;
+            for (;;) {
+                // Sample readiness first: if it already said readable and
+                // the read still comes back empty, that was end of file
+                uint32_t state = tcp_poll(conn);
+                int n = tcp_recv(conn, buf, len);
+                if (n > 0) {
+                    return n;
+                }
+                if (state & (TCP_POLL_READ | TCP_POLL_HUP)) {
+                    return 0;
+                }
+                if (n < 0) {
+                    return -1;
+                }
+                if (sock->nonblocking) {
+                    return SOCKET_WOULD_BLOCK;
+                }
+                int result = socket_wait(sock, POLLIN, sock->recv_timeout_ms);
+                if (result != 0) {
+                    return result;
+                }
+            }
+        }
     }
 
     return -1;
@@ -220,7 +574,7 @@ int socket_recv(int sockfd, void *buf, size_t len, int flags) {
 
 int socket_sendto(int sockfd, const void *buf, size_t len, int flags, const sockaddr_t *dest_addr, int addrlen) {
     (void)flags; // Unused parameter
-    
+
     socket_t *sock = get_socket(sockfd);
     if (!sock || !buf || len == 0 || !dest_addr || addrlen < (int)sizeof(sockaddr_in_t)) {
         return -1;
@@ -239,9 +593,7 @@ int socket_sendto(int sockfd, const void *buf, size_t len, int flags, const sock
 
 int socket_recvfrom(int sockfd, void *buf, size_t len, int flags, sockaddr_t *src_addr, int *addrlen) {
     (void)flags;    // Unused parameter
-    (void)src_addr; // Unused parameter
-    (void)addrlen;  // Unused parameter
-    
+
     socket_t *sock = get_socket(sockfd);
     if (!sock || !buf || len == 0) {
         return -1;
@@ -251,9 +603,18 @@ int socket_recvfrom(int sockfd, void *buf, size_t len, int flags, sockaddr_t *sr
         return -1; // recvfrom only for UDP
     }
 
-    // This is a simplified implementation
-    // In a real system, this would block until data arrives
-    return -1;
+    uint32_t src_ip;
+    uint16_t src_port;
+    int n = socket_recv_dgram(sock, buf, len, &src_ip, &src_port);
+    if (n >= 0 && src_addr && addrlen && *addrlen >= (int)sizeof(sockaddr_in_t)) {
+        sockaddr_in_t *addr_in = (sockaddr_in_t *)src_addr;
+        memset(addr_in, 0, sizeof(*addr_in));
+        addr_in->sin_family = AF_INET;
+        addr_in->sin_port = htons(src_port);
+        addr_in->sin_addr = htonl(src_ip);
+        *addrlen = sizeof(sockaddr_in_t);
+    }
+    return n;
 }
 
 int socket_close(int sockfd) {
@@ -262,20 +623,395 @@ int socket_close(int sockfd) {
         return -1;
     }
 
+    // Detach from the protocol first; after this no callback reaches us
     switch (sock->type) {
         case SOCK_DGRAM:
             udp_close((udp_socket_t *)sock->impl.udp_socket);
             break;
-            
+
         case SOCK_STREAM:
             tcp_close((tcp_connection_t *)sock->impl.tcp_connection);
             break;
     }
 
+    // Drop epoll registrations (their instances free them) and queued data
+    uint64_t flags = spin_lock_irqsave(&sock->lock);
+    sock->closing = true;
+    for (socket_epitem_t *item = sock->watchers; item; item = item->sock_next) {
+        uint64_t ep_flags = spin_lock_irqsave(&item->ep->lock);
+        item->dead = true;
+        spin_unlock_irqrestore(&item->ep->lock, ep_flags);
+    }
+    sock->watchers = NULL;
+    socket_dgram_t *dgram = sock->rx_head;
+    sock->rx_head = NULL;
+    sock->rx_tail = NULL;
+    sock->rx_count = 0;
+    spin_unlock_irqrestore(&sock->lock, flags);
+
+    while (dgram) {
+        socket_dgram_t *next = dgram->next;
+        kfree(dgram);
+        dgram = next;
+    }
+
     free_socket_fd(sockfd);
     return 0;
 }
 
+int socket_set_nonblocking(int sockfd, bool nonblocking) {
+    socket_t *sock = get_socket(sockfd);
+    if (!sock) {
+        return -1;
+    }
+    sock->nonblocking = nonblocking;
+    return 0;
+}
+
+int socket_set_timeout(int sockfd, uint32_t recv_timeout_ms, uint32_t send_timeout_ms) {
+    socket_t *sock = get_socket(sockfd);
+    if (!sock) {
+        return -1;
+    }
+    sock->recv_timeout_ms = recv_timeout_ms;
+    sock->send_timeout_ms = send_timeout_ms;
+    return 0;
+}
+
+// Readiness multiplexing
+
+static int poll_scan(socket_pollfd_t *fds, int nfds) {
+    int ready = 0;
+    for (int i = 0; i < nfds; i++) {
+        socket_t *sock = get_socket(fds[i].fd);
+        fds[i].revents = sock ? socket_readiness(sock) & (fds[i].events | POLLERR | POLLHUP)
+                              : POLLHUP;
+        if (fds[i].revents) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+int socket_poll(socket_pollfd_t *fds, int nfds, int timeout_ms) {
+    if (!fds || nfds < 0) {
+        return -1;
+    }
+
+    uint64_t deadline = timeout_ms > 0 ? timer_get_ticks() + SOCKET_MS_TO_TICKS(timeout_ms) : 0;
+    for (;;) {
+        int ready = poll_scan(fds, nfds);
+        uint64_t now = timer_get_ticks();
+        if (ready > 0 || timeout_ms == 0 || (deadline && now >= deadline)) {
+            return ready;
+        }
+
+        uint64_t slice = deadline ? deadline - now : TIMER_FREQUENCY_HZ;
+        if (!network_rx_interrupts()) {
+            network_process_packets();
+            slice = 1;
+        }
+        if (!wait_queue_can_sleep()) {
+            __asm__ volatile("pause");
+            continue;
+        }
+
+        // Any socket's change wakes every poller. Rescan once queued so a
+        // change between the scan above and sleeping isn't missed.
+        uint64_t wq_flags = wait_queue_prepare(&poll_waiters);
+        if (poll_scan(fds, nfds) > 0) {
+            wait_queue_cancel(&poll_waiters, wq_flags);
+            continue;
+        }
+        wait_queue_commit_timeout(&poll_waiters, wq_flags, now + slice);
+    }
+}
+
+static socket_epoll_t *get_epoll(int epfd) {
+    if (epfd < 0 || epfd >= MAX_EPOLL || !epolls[epfd].used) {
+        return NULL;
+    }
+    return &epolls[epfd];
+}
+
+int socket_epoll_create(void) {
+    int epfd = -1;
+    uint64_t flags = spin_lock_irqsave(&socket_table_lock);
+    if (!epolls_initialized) {
+        for (int i = 0; i < MAX_EPOLL; i++) {
+            spin_lock_init_named(&epolls[i].lock, "epoll");
+            mutex_init(&epolls[i].mutex);
+            wait_queue_init(&epolls[i].wait);
+        }
+        epolls_initialized = true;
+    }
+    for (int i = 0; i < MAX_EPOLL; i++) {
+        if (!epolls[i].used) {
+            epolls[i].used = true;
+            epolls[i].items = NULL;
+            epolls[i].ready_head = NULL;
+            epolls[i].ready_tail = NULL;
+            epfd = i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&socket_table_lock, flags);
+    return epfd;
+}
+
+// Unlink an item from its socket and its instance and free it. ep->mutex held.
+static void epitem_remove(socket_epoll_t *ep, socket_epitem_t *item) {
+    // Socket objects are never freed, so its lock is safe to take even if
+    // the socket closed; a dead item is no longer on its watcher list
+    uint64_t flags = spin_lock_irqsave(&item->sock->lock);
+    uint64_t ep_flags = spin_lock_irqsave(&ep->lock);
+    if (!item->dead) {
+        socket_epitem_t **pp = &item->sock->watchers;
+        while (*pp && *pp != item) {
+            pp = &(*pp)->sock_next;
+        }
+        if (*pp) {
+            *pp = item->sock_next;
+        }
+        item->dead = true;
+    }
+    if (item->queued) {
+        socket_epitem_t *prev = NULL;
+        for (socket_epitem_t *r = ep->ready_head; r; prev = r, r = r->ready_next) {
+            if (r != item) {
+                continue;
+            }
+            if (prev) {
+                prev->ready_next = r->ready_next;
+            } else {
+                ep->ready_head = r->ready_next;
+            }
+            if (ep->ready_tail == r) {
+                ep->ready_tail = prev;
+            }
+            break;
+        }
+        item->queued = false;
+    }
+    spin_unlock_irqrestore(&ep->lock, ep_flags);
+    spin_unlock_irqrestore(&item->sock->lock, flags);
+
+    socket_epitem_t **pp = &ep->items;
+    while (*pp && *pp != item) {
+        pp = &(*pp)->ep_next;
+    }
+    if (*pp) {
+        *pp = item->ep_next;
+    }
+    kfree(item);
+}
+
+// Live registration for a descriptor, freeing dead ones met on the way.
+// ep->mutex held.
+static socket_epitem_t *epitem_find(socket_epoll_t *ep, int sockfd) {
+    socket_epitem_t *item = ep->items;
+    while (item) {
+        socket_epitem_t *next = item->ep_next;
+        bool dead = __atomic_load_n(&item->dead, __ATOMIC_ACQUIRE);
+        if (dead) {
+            epitem_remove(ep, item);
+        } else if (item->fd == sockfd) {
+            return item;
+        }
+        item = next;
+    }
+    return NULL;
+}
+
+int socket_epoll_ctl(int epfd, int op, int sockfd, const socket_epoll_event_t *event) {
+    socket_epoll_t *ep = get_epoll(epfd);
+    if (!ep || ((op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) && !event)) {
+        return -1;
+    }
+
+    int result = -1;
+    mutex_lock(&ep->mutex);
+    socket_epitem_t *item = epitem_find(ep, sockfd);
+
+    switch (op) {
+        case EPOLL_CTL_ADD: {
+            socket_t *sock = get_socket(sockfd);
+            if (item || !sock) {
+                break;
+            }
+            item = kmalloc(sizeof(socket_epitem_t));
+            if (!item) {
+                break;
+            }
+            memset(item, 0, sizeof(*item));
+            item->ep = ep;
+            item->sock = sock;
+            item->fd = sockfd;
+            item->events = event->events;
+            item->data = event->data;
+
+            uint64_t flags = spin_lock_irqsave(&sock->lock);
+            if (sock->closing) {
+                spin_unlock_irqrestore(&sock->lock, flags);
+                kfree(item);
+                break;
+            }
+            item->sock_next = sock->watchers;
+            sock->watchers = item;
+            item->ep_next = ep->items;
+            ep->items = item;
+            // Check it once now: it may already be ready
+            epitem_mark_ready(item);
+            spin_unlock_irqrestore(&sock->lock, flags);
+            result = 0;
+            break;
+        }
+
+        case EPOLL_CTL_MOD: {
+            if (!item) {
+                break;
+            }
+            uint64_t flags = spin_lock_irqsave(&item->sock->lock);
+            uint64_t ep_flags = spin_lock_irqsave(&ep->lock);
+            item->events = event->events;
+            item->data = event->data;
+            spin_unlock_irqrestore(&ep->lock, ep_flags);
+            epitem_mark_ready(item);
+            spin_unlock_irqrestore(&item->sock->lock, flags);
+            result = 0;
+            break;
+        }
+
+        case EPOLL_CTL_DEL:
+            if (item) {
+                epitem_remove(ep, item);
+                result = 0;
+            }
+            break;
+    }
+
+    mutex_unlock(&ep->mutex);
+    return result;
+}
+
+// Drain the ready list into 'events'. Level-triggered items that are still
+// ready go back on the list for the next call; edge-triggered ones wait for
+// the next change. ep->mutex held.
+static int epoll_collect(socket_epoll_t *ep, socket_epoll_event_t *events, int max_events) {
+    uint64_t flags = spin_lock_irqsave(&ep->lock);
+    socket_epitem_t *list = ep->ready_head;
+    ep->ready_head = NULL;
+    ep->ready_tail = NULL;
+    for (socket_epitem_t *item = list; item; item = item->ready_next) {
+        item->queued = false;
+    }
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    int count = 0;
+    socket_epitem_t *requeue = NULL;
+    socket_epitem_t **tail = &requeue;
+    while (list) {
+        socket_epitem_t *item = list;
+        list = item->ready_next;
+        item->ready_next = NULL;
+
+        bool dead = __atomic_load_n(&item->dead, __ATOMIC_ACQUIRE);
+        if (dead) {
+            epitem_remove(ep, item);
+            continue;
+        }
+        if (item->events == 0) {
+            continue;
+        }
+        if (count >= max_events) {
+            *tail = item;       // No room this time
+            tail = &item->ready_next;
+            continue;
+        }
+
+        uint32_t ready = socket_readiness(item->sock) & (item->events | EPOLLERR | EPOLLHUP);
+        if (!ready) {
+            continue;
+        }
+        events[count].events = ready;
+        events[count].data = item->data;
+        count++;
+
+        if (item->events & EPOLLONESHOT) {
+            item->events = 0;
+        } else if (!(item->events & EPOLLET)) {
+            *tail = item;
+            tail = &item->ready_next;
+        }
+    }
+
+    // Put back what stays ready, unless a notify queued it again meanwhile
+    flags = spin_lock_irqsave(&ep->lock);
+    while (requeue) {
+        socket_epitem_t *item = requeue;
+        requeue = item->ready_next;
+        item->ready_next = NULL;
+        if (item->queued || item->dead) {
+            continue;
+        }
+        item->queued = true;
+        if (ep->ready_tail) {
+            ep->ready_tail->ready_next = item;
+        } else {
+            ep->ready_head = item;
+        }
+        ep->ready_tail = item;
+    }
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    return count;
+}
+
+int socket_epoll_wait(int epfd, socket_epoll_event_t *events, int max_events, int timeout_ms) {
+    socket_epoll_t *ep = get_epoll(epfd);
+    if (!ep || !events || max_events <= 0) {
+        return -1;
+    }
+
+    uint64_t deadline = timeout_ms > 0 ? timer_get_ticks() + SOCKET_MS_TO_TICKS(timeout_ms) : 0;
+    for (;;) {
+        mutex_lock(&ep->mutex);
+        int count = ep->used ? epoll_collect(ep, events, max_events) : -1;
+        mutex_unlock(&ep->mutex);
+        if (count != 0 || timeout_ms == 0) {
+            return count;
+        }
+
+        uint64_t now = timer_get_ticks();
+        if (deadline && now >= deadline) {
+            return 0;
+        }
+        uint64_t slice = deadline ? deadline - now : TIMER_FREQUENCY_HZ;
+        if (!network_rx_interrupts()) {
+            network_process_packets();
+            slice = 1;
+        }
+        wait_event_timeout(&ep->wait, __atomic_load_n(&ep->ready_head, __ATOMIC_ACQUIRE) != NULL ||
+                                      !ep->used, slice);
+    }
+}
+
+int socket_epoll_close(int epfd) {
+    socket_epoll_t *ep = get_epoll(epfd);
+    if (!ep) {
+        return -1;
+    }
+
+    mutex_lock(&ep->mutex);
+    while (ep->items) {
+        epitem_remove(ep, ep->items);
+    }
+    ep->used = false;
+    mutex_unlock(&ep->mutex);
+    wait_queue_wake_all(&ep->wait);
+    return 0;
+}
+
 // Utility functions
 uint32_t inet_addr(const char *cp) {
     if (!cp) {
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "../sched/spinlock.h"
+#include "../sched/waitqueue.h"
 
 // Socket types
 #define SOCK_STREAM 1  // TCP
@@ -12,6 +14,31 @@
 // Address families
 #define AF_INET 2
 
+// Return codes besides -1 for a plain error
+#define SOCKET_ERROR -1
+#define SOCKET_TIMEOUT -2       // A blocking call ran out of time
+#define SOCKET_WOULD_BLOCK -3   // A non-blocking call would have had to wait
+
+// Readiness bits for socket_poll() and the epoll interface
+#define POLLIN 0x001            // Data (or end of file, or a connection) to read
+#define POLLOUT 0x004           // Room to send
+#define POLLERR 0x008
+#define POLLHUP 0x010           // Closed or reset; always reported
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLONESHOT (1u << 30) // Report once, then disarm until EPOLL_CTL_MOD
+#define EPOLLET (1u << 31)      // Edge-triggered: report changes, not levels
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+// Datagrams a UDP socket holds before dropping new ones
+#define SOCKET_UDP_QUEUE_MAX 64
+
 // Socket address structure
 typedef struct sockaddr_in {
     uint16_t sin_family;
@@ -25,6 +52,28 @@ typedef struct sockaddr {
     char sa_data[14];
 } sockaddr_t;
 
+typedef struct socket_pollfd {
+    int fd;
+    uint32_t events;      // POLL* bits of interest
+    uint32_t revents;     // Filled in: bits that are ready
+} socket_pollfd_t;
+
+typedef struct socket_epoll_event {
+    uint32_t events;      // EPOLL* bits
+    uint64_t data;        // Returned untouched with the event
+} socket_epoll_event_t;
+
+// A received datagram waiting in a UDP socket's queue
+typedef struct socket_dgram {
+    struct socket_dgram *next;
+    uint32_t src_ip;
+    uint16_t src_port;
+    size_t len;
+    uint8_t data[];
+} socket_dgram_t;
+
+struct socket_epitem;
+
 // Socket structure
 typedef struct socket {
     int type;
@@ -37,6 +86,21 @@ typedef struct socket {
         void *udp_socket;
         void *tcp_connection;
     } impl;
+
+    bool nonblocking;
+    uint32_t recv_timeout_ms;   // 0 waits forever
+    uint32_t send_timeout_ms;
+
+    // Lock and wait queue outlive the descriptor: the object is reused
+    spinlock_t lock;            // Guards the datagram queue and watchers
+    wait_queue_t wait;          // Threads blocked in send/recv/accept/connect
+    uint32_t generation;        // Bumped each time the descriptor is reused
+    bool closing;
+    socket_dgram_t *rx_head;
+    socket_dgram_t *rx_tail;
+    int rx_count;
+    uint32_t rx_dropped;
+    struct socket_epitem *watchers; // Epoll registrations on this socket
 } socket_t;
 
 // Function prototypes
@@ -51,6 +115,22 @@ int socket_sendto(int sockfd, const void *buf, size_t len, int flags, const sock
 int socket_recvfrom(int sockfd, void *buf, size_t len, int flags, sockaddr_t *src_addr, int *addrlen);
 int socket_close(int sockfd);
 
+// Sockets block by default; a timeout of 0 means wait forever
+int socket_set_nonblocking(int sockfd, bool nonblocking);
+int socket_set_timeout(int sockfd, uint32_t recv_timeout_ms, uint32_t send_timeout_ms);
+
+// Level-triggered readiness for a set of sockets. Waits up to timeout_ms
+// (negative: forever, 0: just check). Returns how many have revents set.
+int socket_poll(socket_pollfd_t *fds, int nfds, int timeout_ms);
+
+// Readiness multiplexer with an interest list kept between calls, so each
+// wait costs O(ready) rather than O(registered). Handles are separate from
+// socket descriptors.
+int socket_epoll_create(void);
+int socket_epoll_ctl(int epfd, int op, int sockfd, const socket_epoll_event_t *event);
+int socket_epoll_wait(int epfd, socket_epoll_event_t *events, int max_events, int timeout_ms);
+int socket_epoll_close(int epfd);
+
 // Utility functions
 uint32_t inet_addr(const char *cp);
 char *inet_ntoa(uint32_t addr);
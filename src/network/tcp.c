@@ -1,205 +1,2161 @@
 #include "tcp.h"
 #include "ip.h"
+#include "checksum.h"
+#include "inet_hash.h"
 #include "../memory/memory.h"
+#include "../timer/timer.h"
+#include "../debug/debug.h"
 
-static tcp_connection_t connections[MAX_CONNECTIONS];
-static int connection_count = 0;
+#define TCP_MS_TO_TICKS(ms) (((uint64_t)(ms) * TIMER_FREQUENCY_HZ + 999) / 1000)
+
+// Sequence number comparisons, modulo 2^32
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+// Things tcp_process_packet() tells the application once the lock is dropped
+#define TCP_EVENT_CONNECT 0x01
+#define TCP_EVENT_DATA    0x02
+#define TCP_EVENT_CLOSE   0x04
+#define TCP_EVENT_WRITE   0x08    // Send buffer space freed
+
+static spinlock_t tcp_table_lock = SPINLOCK_INIT_NAMED("tcp_table");
+static tcp_connection_t **tcp_hash;             // Established flows, by 4-tuple
+static uint32_t tcp_hash_size;                  // Buckets, a power of two
+static uint32_t tcp_hashed_count;
+static tcp_connection_t *tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+static tcp_connection_t *tcp_free_list;
+static tcp_connection_t *tcp_all_list;          // Append-only, for diagnostics
+static uint32_t tcp_live;                       // Allocated and not yet released
+static uint32_t tcp_hash_seed;
+static uint32_t tcp_cookie_secret;              // Keys SYN cookies
 static uint32_t tcp_sequence_number = 1000;
+static uint32_t next_ephemeral_port;
+
+#define TCP_EPHEMERAL_FIRST 49152
+#define TCP_EPHEMERAL_COUNT 16384
+
+// Fields of an incoming segment, in host byte order
+typedef struct tcp_segment {
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+    uint16_t window;
+    const uint8_t *options;
+    size_t options_len;
+    const uint8_t *payload;
+    uint32_t payload_len;
+} tcp_segment_t;
+
+static void tcp_timer_expired(void *arg);
+static void tcp_timer_work(void *arg);
+
+// Byte ring helpers
+
+static inline uint32_t ring_used(const tcp_ring_t *ring) {
+    return ring->head - ring->tail;
+}
+
+static inline uint32_t ring_free(const tcp_ring_t *ring) {
+    return ring->size - ring_used(ring);
+}
+
+// Copy into the ring 'offset' bytes past head, without moving head
+static void ring_write_at(tcp_ring_t *ring, uint32_t offset, const uint8_t *src, uint32_t len) {
+    uint32_t pos = (ring->head + offset) & (ring->size - 1);
+    uint32_t first = ring->size - pos < len ? ring->size - pos : len;
+    memcpy(ring->data + pos, src, first);
+    memcpy(ring->data, src + first, len - first);
+}
+
+// Copy out of the ring starting 'offset' bytes past tail, without moving tail
+static void ring_read_at(const tcp_ring_t *ring, uint32_t offset, uint8_t *dst, uint32_t len) {
+    uint32_t pos = (ring->tail + offset) & (ring->size - 1);
+    uint32_t first = ring->size - pos < len ? ring->size - pos : len;
+    memcpy(dst, ring->data + pos, first);
+    memcpy(dst + first, ring->data, len - first);
+}
+
+static int ring_alloc(tcp_ring_t *ring, uint32_t size) {
+    ring->data = kmalloc(size);
+    if (!ring->data) {
+        return NET_ERROR;
+    }
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    return NET_SUCCESS;
+}
+
+static void ring_release(tcp_ring_t *ring) {
+    if (ring->data) {
+        kfree(ring->data);
+    }
+    ring->data = NULL;
+    ring->size = 0;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Connection table
+//
+// Connections come from kmalloc on demand and are never freed: a released
+// one goes on a free list and is reused as a connection, so a stale pointer
+// (a timer callback, a lookup racing a close) always finds a valid lock and
+// can recheck 'active' and the 4-tuple under it. Established flows are
+// demultiplexed through a 4-tuple hash that doubles as it fills; listeners
+// sit in a small hash keyed by port. Lock order is conn->lock, then the
+// table lock.
+
+static uint32_t tcp_tuple_bucket(uint32_t local_ip, uint16_t local_port,
+                                 uint32_t remote_ip, uint16_t remote_port) {
+    return inet_hash_tuple(local_ip, local_port, remote_ip, remote_port, tcp_hash_seed) &
+           (tcp_hash_size - 1);
+}
+
+static uint32_t tcp_listen_bucket(uint16_t port) {
+    return inet_hash_port(port, tcp_hash_seed) & (TCP_LISTEN_HASH_SIZE - 1);
+}
+
+// Table lock held
+static tcp_connection_t *tcp_hash_find(uint32_t local_ip, uint16_t local_port,
+                                       uint32_t remote_ip, uint16_t remote_port) {
+    tcp_connection_t *c = tcp_hash[tcp_tuple_bucket(local_ip, local_port, remote_ip, remote_port)];
+    for (; c; c = c->hash_next) {
+        if (c->local_ip == local_ip && c->local_port == local_port &&
+            c->remote_ip == remote_ip && c->remote_port == remote_port) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// Double the 4-tuple hash. Table lock held; on allocation failure the
+// chains just get longer.
+static void tcp_hash_grow(void) {
+    uint32_t new_size = tcp_hash_size * 2;
+    tcp_connection_t **new_hash = kmalloc(new_size * sizeof(*new_hash));
+    if (!new_hash) {
+        return;
+    }
+    memset(new_hash, 0, new_size * sizeof(*new_hash));
+
+    tcp_connection_t **old_hash = tcp_hash;
+    uint32_t old_size = tcp_hash_size;
+    tcp_hash = new_hash;
+    tcp_hash_size = new_size;
+
+    for (uint32_t i = 0; i < old_size; i++) {
+        tcp_connection_t *c = old_hash[i];
+        while (c) {
+            tcp_connection_t *next = c->hash_next;
+            uint32_t b = tcp_tuple_bucket(c->local_ip, c->local_port, c->remote_ip, c->remote_port);
+            c->hash_next = new_hash[b];
+            new_hash[b] = c;
+            c = next;
+        }
+    }
+    kfree(old_hash);
+}
+
+// Add a connection with its 4-tuple set. Table lock held. Fails if the
+// tuple is already in use.
+static int tcp_hash_insert(tcp_connection_t *conn) {
+    if (tcp_hash_find(conn->local_ip, conn->local_port, conn->remote_ip, conn->remote_port)) {
+        return NET_ERROR;
+    }
+    if (tcp_hashed_count >= tcp_hash_size && tcp_hash_size < TCP_MAX_CONNECTIONS) {
+        tcp_hash_grow();
+    }
+
+    uint32_t b = tcp_tuple_bucket(conn->local_ip, conn->local_port, conn->remote_ip, conn->remote_port);
+    conn->hash_next = tcp_hash[b];
+    tcp_hash[b] = conn;
+    conn->hashed = true;
+    tcp_hashed_count++;
+    return NET_SUCCESS;
+}
+
+// Add a listener. Table lock held. Fails if the address and port are taken.
+static int tcp_listen_insert(tcp_connection_t *conn) {
+    uint32_t b = tcp_listen_bucket(conn->local_port);
+    for (tcp_connection_t *c = tcp_listen_hash[b]; c; c = c->hash_next) {
+        if (c->local_port == conn->local_port && c->local_ip == conn->local_ip) {
+            return NET_ERROR;
+        }
+    }
+    conn->hash_next = tcp_listen_hash[b];
+    tcp_listen_hash[b] = conn;
+    conn->hashed = true;
+    return NET_SUCCESS;
+}
+
+// Remove a connection from whichever hash holds it. Table lock held; the
+// state and tuple must still be the ones it was hashed under.
+static void tcp_unhash(tcp_connection_t *conn) {
+    if (!conn->hashed) {
+        return;
+    }
+
+    tcp_connection_t **pp;
+    if (conn->state == TCP_LISTEN) {
+        pp = &tcp_listen_hash[tcp_listen_bucket(conn->local_port)];
+    } else {
+        pp = &tcp_hash[tcp_tuple_bucket(conn->local_ip, conn->local_port,
+                                        conn->remote_ip, conn->remote_port)];
+        tcp_hashed_count--;
+    }
+    while (*pp && *pp != conn) {
+        pp = &(*pp)->hash_next;
+    }
+    if (*pp) {
+        *pp = conn->hash_next;
+    }
+    conn->hash_next = NULL;
+    conn->hashed = false;
+}
+
+int tcp_init(void) {
+    uint64_t now = timer_get_ns();
+    tcp_hash_seed = inet_hash_mix((uint32_t)now ^ (uint32_t)(now >> 32) ^ 0x5BD1E995);
+    tcp_cookie_secret = inet_hash_mix(tcp_hash_seed ^ (uint32_t)(now >> 7) ^ 0x68E31DA4);
+
+    tcp_hash = kmalloc(TCP_HASH_MIN_SIZE * sizeof(*tcp_hash));
+    if (!tcp_hash) {
+        DEBUG_ERROR("TCP: Failed to allocate connection hash\n");
+        return NET_ERROR;
+    }
+    memset(tcp_hash, 0, TCP_HASH_MIN_SIZE * sizeof(*tcp_hash));
+    tcp_hash_size = TCP_HASH_MIN_SIZE;
+    tcp_hashed_count = 0;
+    return NET_SUCCESS;
+}
+
+static uint32_t tcp_new_iss(void) {
+    // Clock-driven ISN (~4us per increment) plus a per-connection offset
+    uint32_t offset = __atomic_add_fetch(&tcp_sequence_number, 64000, __ATOMIC_RELAXED);
+    return (uint32_t)(timer_get_ns() >> 12) + offset;
+}
+
+static uint8_t tcp_rcv_wscale(void) {
+    uint8_t shift = 0;
+    while ((TCP_RCV_BUF_SIZE >> shift) > 0xFFFF && shift < TCP_MAX_WSCALE) {
+        shift++;
+    }
+    return shift;
+}
+
+// Take a connection off the free list, or allocate a new one, and reset
+// it. Returns with the connection unlocked and not yet hashed.
+static tcp_connection_t *tcp_alloc_connection(void) {
+    tcp_connection_t *conn = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
+    if (tcp_live >= TCP_MAX_CONNECTIONS) {
+        spin_unlock_irqrestore(&tcp_table_lock, flags);
+        return NULL;
+    }
+    if (tcp_free_list) {
+        conn = tcp_free_list;
+        tcp_free_list = conn->free_next;
+        conn->active = true;
+        tcp_live++;
+    }
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+
+    if (!conn) {
+        // Lock, timer and work item are set up once and live as long as
+        // the object does
+        conn = kmalloc(sizeof(*conn));
+        if (!conn) {
+            return NULL;
+        }
+        memset(conn, 0, sizeof(*conn));
+        spin_lock_init_named(&conn->lock, "tcp_conn");
+        ktimer_setup(&conn->timer, tcp_timer_expired, conn);
+        work_init(&conn->timer_work, tcp_timer_work, conn);
+        wait_queue_init(&conn->accept_wait);
+        conn->state = TCP_CLOSED;
+        conn->active = true;
+
+        flags = spin_lock_irqsave(&tcp_table_lock);
+        conn->all_next = tcp_all_list;
+        __atomic_store_n(&tcp_all_list, conn, __ATOMIC_RELEASE);
+        if (tcp_live >= TCP_MAX_CONNECTIONS) {
+            // Lost a race for the last slot; keep the object for later
+            conn->active = false;
+            conn->free_next = tcp_free_list;
+            tcp_free_list = conn;
+            spin_unlock_irqrestore(&tcp_table_lock, flags);
+            return NULL;
+        }
+        tcp_live++;
+        spin_unlock_irqrestore(&tcp_table_lock, flags);
+    }
+
+    flags = spin_lock_irqsave(&conn->lock);
+    conn->local_ip = 0;
+    conn->local_port = 0;
+    conn->remote_ip = 0;
+    conn->remote_port = 0;
+    conn->state = TCP_CLOSED;
+    conn->iface = NULL;
+
+    conn->iss = 0;
+    conn->snd_una = 0;
+    conn->snd_nxt = 0;
+    conn->snd_max = 0;
+    conn->snd_wnd = 0;
+    conn->snd_wl1 = 0;
+    conn->snd_wl2 = 0;
+    conn->snd_buf_seq = 0;
+    conn->mss = TCP_DEFAULT_MSS;
+    conn->snd_wscale = 0;
+    conn->wscale_ok = false;
+
+    conn->irs = 0;
+    conn->rcv_nxt = 0;
+    conn->rcv_adv = 0;
+    conn->rcv_wscale = 0;
+
+    conn->snd_buf.data = NULL;
+    conn->rcv_buf.data = NULL;
+    conn->ooo_count = 0;
+
+    conn->srtt = 0;
+    conn->rttvar = 0;
+    conn->rto = TCP_MS_TO_TICKS(TCP_RTO_INITIAL_MS);
+    conn->rtt_active = false;
+    conn->retries = 0;
+    conn->retransmits = 0;
+    conn->fast_retransmits = 0;
+    conn->timeouts = 0;
+    conn->gso_bursts = 0;
+    conn->gso_segments = 0;
+    conn->gro_runs = 0;
+    conn->gro_segments = 0;
+
+    conn->cong = tcp_cong_default();
+    conn->cwnd = TCP_DEFAULT_MSS;
+    conn->ssthresh = TCP_INFINITE_SSTHRESH;
+    conn->bytes_acked = 0;
+    conn->recover = 0;
+    conn->rexmit_nxt = 0;
+    conn->dupacks = 0;
+    conn->in_recovery = false;
+    conn->sack_ok = false;
+    conn->sack_count = 0;
+
+    conn->fin_queued = false;
+    conn->orphaned = false;
+    conn->owned = false;
+    conn->rx_batch = false;
+    conn->rx_ack_pending = false;
+    conn->generation++;
+
+    conn->backlog = 0;
+    conn->syn_queued = 0;
+    conn->accept_count = 0;
+    conn->accept_head = NULL;
+    conn->accept_tail = NULL;
+    conn->parent = NULL;
+    conn->parent_gen = 0;
+    conn->in_syn_queue = false;
+    conn->in_accept_queue = false;
+    conn->accept_next = NULL;
+
+    conn->on_connect = NULL;
+    conn->on_data = NULL;
+    conn->on_close = NULL;
+    conn->on_ready = NULL;
+    conn->ready_ctx = NULL;
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return conn;
+}
+
+static int tcp_alloc_buffers(tcp_connection_t *conn) {
+    if (ring_alloc(&conn->snd_buf, TCP_SND_BUF_SIZE) != NET_SUCCESS) {
+        return NET_ERROR;
+    }
+    if (ring_alloc(&conn->rcv_buf, TCP_RCV_BUF_SIZE) != NET_SUCCESS) {
+        ring_release(&conn->snd_buf);
+        return NET_ERROR;
+    }
+    return NET_SUCCESS;
+}
+
+// Readiness may have changed: tell whoever watches the connection.
+// Called with conn->lock held.
+static void tcp_notify(tcp_connection_t *conn) {
+    if (conn->on_ready) {
+        conn->on_ready(conn, conn->ready_ctx);
+    }
+}
+
+// Listener queues
+//
+// A passive open lives on its listener's SYN queue until the handshake
+// completes, then on the accept queue until tcp_accept() takes it. Lock
+// order is child, then listener; a listener never locks its children.
+
+// Lock the listener a child came from, if it is still that listener.
+// Called with the child's lock held.
+static tcp_connection_t *tcp_lock_parent(tcp_connection_t *conn, uint64_t *irq_flags) {
+    tcp_connection_t *parent = conn->parent;
+    if (!parent) {
+        return NULL;
+    }
+    *irq_flags = spin_lock_irqsave(&parent->lock);
+    if (!parent->active || parent->state != TCP_LISTEN || parent->generation != conn->parent_gen) {
+        spin_unlock_irqrestore(&parent->lock, *irq_flags);
+        return NULL;
+    }
+    return parent;
+}
+
+// Take a dying child off whichever queue holds it
+static void tcp_detach_parent(tcp_connection_t *conn) {
+    uint64_t flags;
+    tcp_connection_t *parent = tcp_lock_parent(conn, &flags);
+    if (parent) {
+        if (conn->in_syn_queue) {
+            parent->syn_queued--;
+        }
+        if (conn->in_accept_queue) {
+            tcp_connection_t **pp = &parent->accept_head;
+            tcp_connection_t *prev = NULL;
+            while (*pp && *pp != conn) {
+                prev = *pp;
+                pp = &(*pp)->accept_next;
+            }
+            if (*pp) {
+                *pp = conn->accept_next;
+                if (parent->accept_tail == conn) {
+                    parent->accept_tail = prev;
+                }
+                parent->accept_count--;
+            }
+        }
+        conn->in_syn_queue = false;
+        conn->in_accept_queue = false;
+        conn->accept_next = NULL;
+        spin_unlock_irqrestore(&parent->lock, flags);
+    }
+    conn->parent = NULL;
+}
+
+// Unlink the oldest established child. Listener lock held. The child may
+// be recycled as soon as the lock drops, so hand back its generation too.
+static tcp_connection_t *tcp_accept_pop(tcp_connection_t *listener, uint32_t *gen) {
+    tcp_connection_t *conn = listener->accept_head;
+    if (!conn) {
+        return NULL;
+    }
+    listener->accept_head = conn->accept_next;
+    if (!listener->accept_head) {
+        listener->accept_tail = NULL;
+    }
+    listener->accept_count--;
+    conn->in_accept_queue = false;
+    conn->accept_next = NULL;
+    *gen = conn->generation;
+    return conn;
+}
+
+// The handshake of a passive open completed: move it to the accept queue.
+// Returns false if the queue is full (the ACK is ignored and the SYN-ACK
+// retransmitted later) or the listener is gone.
+static bool tcp_child_established(tcp_connection_t *conn, bool *listener_gone) {
+    *listener_gone = false;
+    if (!conn->parent) {
+        return true;
+    }
+
+    uint64_t flags;
+    tcp_connection_t *parent = tcp_lock_parent(conn, &flags);
+    if (!parent) {
+        *listener_gone = true;
+        return false;
+    }
+    if (parent->accept_count >= parent->backlog) {
+        spin_unlock_irqrestore(&parent->lock, flags);
+        return false;
+    }
+
+    if (conn->in_syn_queue) {
+        parent->syn_queued--;
+        conn->in_syn_queue = false;
+    }
+    conn->accept_next = NULL;
+    if (parent->accept_tail) {
+        parent->accept_tail->accept_next = conn;
+    } else {
+        parent->accept_head = conn;
+    }
+    parent->accept_tail = conn;
+    parent->accept_count++;
+    conn->in_accept_queue = true;
+    wait_queue_wake_one(&parent->accept_wait);
+    tcp_notify(parent);
+    spin_unlock_irqrestore(&parent->lock, flags);
+    return true;
+}
+
+// Unhash a connection and put it on the free list. Called with conn->lock
+// held; whoever pops it next waits on that lock before resetting it.
+//
+// A connection the application still owns is only torn down to CLOSED: it
+// stays allocated, so the application's pointer stays its own, until
+// tcp_close().
+static void tcp_release(tcp_connection_t *conn) {
+    ktimer_cancel(&conn->timer);
+    ring_release(&conn->snd_buf);
+    ring_release(&conn->rcv_buf);
+    tcp_detach_parent(conn);
+
+    bool owned = conn->owned;
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
+    tcp_unhash(conn);
+    if (conn->active && !owned) {
+        __atomic_store_n(&conn->active, false, __ATOMIC_RELEASE);
+        conn->free_next = tcp_free_list;
+        tcp_free_list = conn;
+        tcp_live--;
+    }
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+
+    conn->state = TCP_CLOSED;
+    conn->local_ip = 0;
+    conn->local_port = 0;
+    conn->remote_ip = 0;
+    conn->remote_port = 0;
+    tcp_notify(conn);
+    if (!owned) {
+        conn->on_connect = NULL;
+        conn->on_data = NULL;
+        conn->on_close = NULL;
+        conn->on_ready = NULL;
+        conn->ready_ctx = NULL;
+    }
+}
+
+// Find the connection for a 4-tuple and return it locked, or NULL
+static tcp_connection_t *tcp_lookup(uint32_t local_ip, uint16_t local_port,
+                                    uint32_t remote_ip, uint16_t remote_port, uint64_t *irq_flags) {
+    tcp_connection_t *conn = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
+    conn = tcp_hash_find(local_ip, local_port, remote_ip, remote_port);
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+
+    if (!conn) {
+        return NULL;
+    }
+
+    // It may have been recycled between the lookup and taking its lock
+    *irq_flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active || conn->local_ip != local_ip || conn->local_port != local_port ||
+        conn->remote_ip != remote_ip ||
+        conn->remote_port != remote_port) {
+        spin_unlock_irqrestore(&conn->lock, *irq_flags);
+        return NULL;
+    }
+    return conn;
+}
+
+// A listener bound to local_ip wins over a wildcard one on the same port
+static tcp_connection_t *tcp_find_listener(uint32_t local_ip, uint16_t local_port) {
+    tcp_connection_t *conn = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
+    for (tcp_connection_t *c = tcp_listen_hash[tcp_listen_bucket(local_port)]; c; c = c->hash_next) {
+        if (c->local_port != local_port) {
+            continue;
+        }
+        if (c->local_ip == local_ip) {
+            conn = c;
+            break;
+        }
+        if (c->local_ip == 0) {
+            conn = c;
+        }
+    }
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+
+    return conn;
+}
+
+// Segment output
+
+// Prepend the header (and options) to a pbuf holding the payload.
+// payload_sum is the payload's partial checksum, unused when the NIC
+// computes it. Frees p and returns an error if the header doesn't fit.
+static int tcp_build_header(network_interface_t *iface, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                            uint32_t seq, uint32_t ack, uint8_t flags, uint16_t window,
+                            const uint8_t *options, size_t options_len, pbuf_t *p, uint32_t payload_sum) {
+    size_t payload_len = p->len;
+    size_t header_len = TCP_HEADER_LEN + options_len;
+
+    tcp_header_t *header = pbuf_push(p, header_len);
+    if (!header) {
+        pbuf_free(p);
+        return NET_ERROR;
+    }
+
+    // Build TCP header
+    header->src_port = __builtin_bswap16(src_port);
+    header->dest_port = __builtin_bswap16(dest_port);
+    header->seq_num = __builtin_bswap32(seq);
+    header->ack_num = __builtin_bswap32(ack);
+    header->data_offset_reserved = (header_len / 4) << 4;
+    header->flags = flags;
+    header->window = __builtin_bswap16(window);
+    header->checksum = 0;
+    header->urgent_ptr = 0;
+    if (options_len > 0) {
+        memcpy((uint8_t *)header + TCP_HEADER_LEN, options, options_len);
+    }
+
+    // Calculate checksum, or seed it with the pseudo header for the NIC
+    uint32_t sum = ip_pseudo_header_sum(iface->ip_address, dest_ip, IP_PROTOCOL_TCP,
+                                        header_len + payload_len);
+    if (iface->features & NETIF_F_TX_L4_CSUM) {
+        header->checksum = (uint16_t)sum;
+        p->csum_flags |= PBUF_TX_CSUM_TCP;
+        p->l4_header = (uint8_t *)header;
+    } else {
+        sum = csum_add(sum, payload_sum);
+        header->checksum = csum_fold(csum_partial(header, header_len, sum));
+    }
+    return NET_SUCCESS;
+}
+
+// Build the header and send the segment via the IP layer
+static int tcp_emit(network_interface_t *iface, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                    uint32_t seq, uint32_t ack, uint8_t flags, uint16_t window,
+                    const uint8_t *options, size_t options_len, pbuf_t *p, uint32_t payload_sum) {
+    int ret = tcp_build_header(iface, dest_ip, src_port, dest_port, seq, ack, flags, window,
+                               options, options_len, p, payload_sum);
+    if (ret != NET_SUCCESS) {
+        return ret;
+    }
+    return ip_send_pbuf(iface, dest_ip, IP_PROTOCOL_TCP, p);
+}
+
+int tcp_send_packet(network_interface_t *iface, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                   uint32_t seq, uint32_t ack, uint8_t flags, void *payload, size_t payload_len) {
+    if (!iface) {
+        return NET_INVALID_PARAM;
+    }
+
+    if (payload_len > TCP_MAX_PAYLOAD) {
+        return NET_ERROR;
+    }
+
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
+    }
+
+    // Copy payload if any, straight into the buffer the NIC will DMA from.
+    // Without offload, sum it on the way in rather than re-reading it.
+    uint32_t payload_sum = 0;
+    if (payload && payload_len > 0) {
+        if (iface->features & NETIF_F_TX_L4_CSUM) {
+            memcpy(pbuf_put(p, payload_len), payload, payload_len);
+        } else {
+            payload_sum = csum_partial_copy(payload, pbuf_put(p, payload_len), payload_len, 0);
+        }
+    }
+
+    return tcp_emit(iface, dest_ip, src_port, dest_port, seq, ack, flags, TCP_WINDOW_SIZE,
+                    NULL, 0, p, payload_sum);
+}
+
+// Window field for an outgoing segment; records the right edge advertised
+static uint16_t tcp_window(tcp_connection_t *conn, bool syn) {
+    uint32_t wnd = conn->rcv_buf.data ? ring_free(&conn->rcv_buf) : 0;
+    // The window in a SYN is never scaled (RFC 7323)
+    uint8_t shift = syn ? 0 : conn->rcv_wscale;
+    uint32_t field = wnd >> shift;
+    if (field > 0xFFFF) {
+        field = 0xFFFF;
+    }
+    conn->rcv_adv = conn->rcv_nxt + (field << shift);
+    return field;
+}
+
+// Copy 'len' bytes of the send buffer starting at 'seq' into p, fusing the
+// checksum when the bytes are contiguous. Returns the payload's partial sum
+// (0 when the NIC computes it).
+static uint32_t tcp_copy_payload(tcp_connection_t *conn, uint32_t seq, pbuf_t *p, uint32_t len, bool offload) {
+    const tcp_ring_t *ring = &conn->snd_buf;
+    uint32_t offset = seq - conn->snd_buf_seq;
+    uint32_t pos = (ring->tail + offset) & (ring->size - 1);
+    uint8_t *dst = pbuf_put(p, len);
+    if (pos + len <= ring->size && !offload) {
+        return csum_partial_copy(ring->data + pos, dst, len, 0);
+    }
+    ring_read_at(ring, offset, dst, len);
+    return offload ? 0 : csum_partial(dst, len, 0);
+}
+
+// Send one segment for a connection: 'len' bytes of the send buffer starting
+// at 'seq', plus control flags. Called with conn->lock held.
+static int tcp_output_segment(tcp_connection_t *conn, uint32_t seq, uint8_t flags, uint32_t len) {
+    network_interface_t *iface = conn->iface;
+    if (!iface) {
+        return NET_ERROR;
+    }
+
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
+    }
+
+    bool offload = (iface->features & NETIF_F_TX_L4_CSUM) != 0;
+    uint32_t payload_sum = 0;
+    if (len > 0) {
+        payload_sum = tcp_copy_payload(conn, seq, p, len, offload);
+    }
+
+    // SYNs carry our MSS and, when negotiating them, window scale and
+    // SACK-permitted
+    uint8_t options[40];
+    size_t options_len = 0;
+    if (flags & TCP_FLAG_SYN) {
+        options[options_len++] = TCP_OPT_MSS;
+        options[options_len++] = 4;
+        options[options_len++] = TCP_MSS >> 8;
+        options[options_len++] = TCP_MSS & 0xFF;
+        if (conn->wscale_ok) {
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_WSCALE;
+            options[options_len++] = 3;
+            options[options_len++] = conn->rcv_wscale;
+        }
+        if (conn->sack_ok) {
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_NOP;
+            options[options_len++] = TCP_OPT_SACK_PERMITTED;
+            options[options_len++] = 2;
+        }
+    } else if (conn->sack_ok && conn->ooo_count > 0 && len == 0) {
+        // Report out-of-order data on pure ACKs, newest range first. Data
+        // segments skip it so the payload never has to shrink below MSS.
+        int blocks = conn->ooo_count < TCP_SACK_BLOCKS ? conn->ooo_count : TCP_SACK_BLOCKS;
+        options[options_len++] = TCP_OPT_NOP;
+        options[options_len++] = TCP_OPT_NOP;
+        options[options_len++] = TCP_OPT_SACK;
+        options[options_len++] = 2 + 8 * blocks;
+        for (int i = 0; i < blocks; i++) {
+            int r = conn->ooo_count - 1 - i;
+            uint32_t edges[2] = { __builtin_bswap32(conn->ooo[r].start),
+                                  __builtin_bswap32(conn->ooo[r].end) };
+            memcpy(options + options_len, edges, sizeof(edges));
+            options_len += sizeof(edges);
+        }
+    }
+
+    uint16_t window = tcp_window(conn, (flags & TCP_FLAG_SYN) != 0);
+    uint32_t ack = (flags & TCP_FLAG_ACK) ? conn->rcv_nxt : 0;
+
+    return tcp_emit(iface, conn->remote_ip, conn->local_port, conn->remote_port, seq, ack, flags,
+                    window, options, options_len, p, payload_sum);
+}
+
+// Software segmentation offload: send 'len' bytes starting at 'seq' as MSS
+// sized segments in one pass. The header fields shared by the run are worked
+// out once, and the whole run goes down through a single route and ARP
+// lookup into one driver burst. Only the last segment carries 'flags' PSH.
+// Returns the bytes actually handed to IP (0 if nothing could be). Called
+// with conn->lock held.
+static uint32_t tcp_output_burst(tcp_connection_t *conn, uint32_t seq, uint8_t flags, uint32_t len) {
+    network_interface_t *iface = conn->iface;
+    if (!iface || len == 0) {
+        return 0;
+    }
+
+    bool offload = (iface->features & NETIF_F_TX_L4_CSUM) != 0;
+    uint16_t window = tcp_window(conn, false);
+    uint32_t ack = conn->rcv_nxt;
+
+    pbuf_t *bufs[TCP_GSO_MAX_SEGS];
+    int n = 0;
+    uint32_t built = 0;
+    while (built < len && n < TCP_GSO_MAX_SEGS) {
+        uint32_t seg_len = len - built < conn->mss ? len - built : conn->mss;
+        pbuf_t *p = pbuf_alloc_tx();
+        if (!p) {
+            break;
+        }
+        uint32_t payload_sum = tcp_copy_payload(conn, seq + built, p, seg_len, offload);
+        uint8_t seg_flags = built + seg_len == len ? flags : (flags & ~TCP_FLAG_PSH);
+        if (tcp_build_header(iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                             seq + built, ack, seg_flags, window, NULL, 0, p, payload_sum) != NET_SUCCESS) {
+            break;
+        }
+        bufs[n++] = p;
+        built += seg_len;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    conn->gso_bursts++;
+    conn->gso_segments += n;
+    ip_send_burst(iface, conn->remote_ip, IP_PROTOCOL_TCP, bufs, n);
+    return built;
+}
+
+static void tcp_arm_timer(tcp_connection_t *conn, uint64_t ticks) {
+    ktimer_add(&conn->timer, timer_get_ticks() + ticks);
+}
+
+// States in which queued data may still be (re)transmitted
+static bool tcp_can_send_data(tcp_state_t state) {
+    return state == TCP_ESTABLISHED || state == TCP_CLOSE_WAIT ||
+           state == TCP_FIN_WAIT_1 || state == TCP_CLOSING || state == TCP_LAST_ACK;
+}
+
+// Bytes believed to still be in the network during SACK recovery (RFC 6675,
+// simplified): everything above the highest SACKed byte, plus the holes
+// below it that have already been resent. Unresent holes count as lost.
+static uint32_t tcp_sack_pipe(const tcp_connection_t *conn) {
+    if (conn->sack_count == 0) {
+        return conn->snd_max - conn->snd_una;
+    }
+
+    uint32_t high = conn->sack[conn->sack_count - 1].end;
+    uint32_t pipe = SEQ_GT(conn->snd_max, high) ? conn->snd_max - high : 0;
+    uint32_t pos = conn->snd_una;
+    for (int i = 0; i < conn->sack_count && SEQ_LT(pos, conn->rexmit_nxt); i++) {
+        uint32_t hole_end = SEQ_LT(conn->sack[i].start, conn->rexmit_nxt) ?
+                            conn->sack[i].start : conn->rexmit_nxt;
+        if (SEQ_LT(pos, hole_end)) {
+            pipe += hole_end - pos;
+        }
+        pos = conn->sack[i].end;
+    }
+    return pipe;
+}
+
+// First un-SACKed range at or after 'from' that lies below the highest
+// SACKed byte. Returns false if there is none.
+static bool tcp_sack_next_hole(const tcp_connection_t *conn, uint32_t from,
+                               uint32_t *start, uint32_t *len) {
+    if (SEQ_LT(from, conn->snd_una)) {
+        from = conn->snd_una;
+    }
+    for (int i = 0; i < conn->sack_count; i++) {
+        if (SEQ_LT(from, conn->sack[i].start)) {
+            *start = from;
+            *len = conn->sack[i].start - from;
+            return true;
+        }
+        if (SEQ_LT(from, conn->sack[i].end)) {
+            from = conn->sack[i].end;
+        }
+    }
+    return false;
+}
+
+// Push out as much of the send buffer as the peer's window and cwnd allow,
+// then the FIN once everything queued has gone. During SACK recovery the
+// holes the peer reported go first. With ack_now, an ACK goes out even when
+// there is nothing to send. Called with conn->lock held.
+static void tcp_output(tcp_connection_t *conn, bool ack_now) {
+    bool sent = false;
+    uint32_t data_end = conn->snd_buf_seq + ring_used(&conn->snd_buf);
+    uint32_t unsent = 0;
+    bool sack_recovery = conn->in_recovery && conn->sack_ok;
+
+    if (tcp_can_send_data(conn->state)) {
+        for (;;) {
+            unsent = SEQ_LT(conn->snd_nxt, data_end) ? data_end - conn->snd_nxt : 0;
+            uint32_t in_flight = sack_recovery ? tcp_sack_pipe(conn) : conn->snd_nxt - conn->snd_una;
+            uint32_t cwnd_room = conn->cwnd > in_flight ? conn->cwnd - in_flight : 0;
+            if (cwnd_room == 0) {
+                break;
+            }
+
+            uint32_t hole, hole_len;
+            if (sack_recovery && tcp_sack_next_hole(conn, conn->rexmit_nxt, &hole, &hole_len)) {
+                // Resend the next hole; it lies inside the peer's window already
+                uint32_t len = hole_len;
+                if (len > conn->mss) {
+                    len = conn->mss;
+                }
+                if (len > cwnd_room) {
+                    len = cwnd_room;
+                }
+                if (SEQ_GT(hole + len, data_end)) {
+                    len = data_end - hole;
+                }
+                if (len == 0 || tcp_output_segment(conn, hole, TCP_FLAG_ACK, len) == NET_BUFFER_FULL) {
+                    break;
+                }
+                conn->retransmits++;
+                conn->rexmit_nxt = hole + len;
+                sent = true;
+                continue;
+            }
+
+            uint32_t window_edge = conn->snd_una + conn->snd_wnd;
+            uint32_t usable = SEQ_GT(window_edge, conn->snd_nxt) ? window_edge - conn->snd_nxt : 0;
+            if (usable > cwnd_room) {
+                usable = cwnd_room;
+            }
+
+            // Up to TCP_GSO_MAX_SEGS segments' worth goes out as one burst
+            uint32_t len = unsent;
+            if (len > conn->mss * TCP_GSO_MAX_SEGS) {
+                len = conn->mss * TCP_GSO_MAX_SEGS;
+            }
+            if (len > usable) {
+                len = usable;
+            }
+            if (len == 0) {
+                break;
+            }
+
+            // Sender-side silly window avoidance: hold back a runt while
+            // earlier data is in flight; its ACK makes room for a full segment
+            if (len < conn->mss && len < unsent && in_flight > 0) {
+                break;
+            }
+
+            uint8_t flags = TCP_FLAG_ACK;
+            if (len == unsent) {
+                flags |= TCP_FLAG_PSH;
+            }
+            if (len > conn->mss) {
+                uint32_t sent_len = tcp_output_burst(conn, conn->snd_nxt, flags, len);
+                if (sent_len == 0) {
+                    break;
+                }
+                len = sent_len;
+            } else if (tcp_output_segment(conn, conn->snd_nxt, flags, len) == NET_BUFFER_FULL) {
+                break;
+            }
+
+            if (SEQ_LT(conn->snd_nxt, conn->snd_max)) {
+                conn->retransmits++;
+            } else if (!conn->rtt_active) {
+                // Time new data only, never a retransmission (Karn)
+                conn->rtt_active = true;
+                conn->rtt_seq = conn->snd_nxt;
+                conn->rtt_start = timer_get_ticks();
+            }
+
+            conn->snd_nxt += len;
+            if (SEQ_GT(conn->snd_nxt, conn->snd_max)) {
+                conn->snd_max = conn->snd_nxt;
+            }
+            sent = true;
+        }
+
+        // The FIN takes the sequence number after the last data byte
+        if (conn->fin_queued && conn->snd_nxt == data_end && conn->state != TCP_ESTABLISHED &&
+            conn->state != TCP_CLOSE_WAIT) {
+            tcp_output_segment(conn, conn->snd_nxt, TCP_FLAG_FIN | TCP_FLAG_ACK, 0);
+            conn->snd_nxt++;
+            if (SEQ_GT(conn->snd_nxt, conn->snd_max)) {
+                conn->snd_max = conn->snd_nxt;
+            }
+            sent = true;
+        }
+    }
+
+    if (!sent && ack_now) {
+        tcp_output_segment(conn, conn->snd_nxt, TCP_FLAG_ACK, 0);
+    }
+
+    // Anything outstanding or stuck behind a closed window needs the timer
+    if (!conn->timer.pending && (conn->snd_una != conn->snd_max || unsent > 0)) {
+        tcp_arm_timer(conn, conn->rto);
+    }
+}
+
+// Resend the oldest unacknowledged segment (fast retransmit, NewReno
+// partial ACKs)
+static void tcp_retransmit_head(tcp_connection_t *conn) {
+    uint32_t data_end = conn->snd_buf_seq + ring_used(&conn->snd_buf);
+    uint32_t len = SEQ_LT(conn->snd_una, data_end) ? data_end - conn->snd_una : 0;
+    if (len > conn->mss) {
+        len = conn->mss;
+    }
+
+    if (len > 0) {
+        tcp_output_segment(conn, conn->snd_una, TCP_FLAG_ACK, len);
+    } else if (conn->fin_queued) {
+        tcp_output_segment(conn, conn->snd_una, TCP_FLAG_FIN | TCP_FLAG_ACK, 0);
+    } else {
+        return;
+    }
+    conn->retransmits++;
+
+    // Its ACK can no longer be told apart from the original's (Karn)
+    if (conn->rtt_active && SEQ_LEQ(conn->rtt_seq, conn->snd_una + len)) {
+        conn->rtt_active = false;
+    }
+}
+
+// Tell the peer about a window that reading has opened up noticeably
+static void tcp_window_update(tcp_connection_t *conn) {
+    if (!conn->rcv_buf.data || conn->state == TCP_SYN_SENT || conn->state == TCP_SYN_RECEIVED) {
+        return;
+    }
+
+    uint32_t edge = conn->rcv_nxt + ring_free(&conn->rcv_buf);
+    uint32_t threshold = conn->rcv_buf.size / 2 < 2u * conn->mss ? conn->rcv_buf.size / 2 : 2u * conn->mss;
+    if (SEQ_GT(edge, conn->rcv_adv) && edge - conn->rcv_adv >= threshold) {
+        tcp_output_segment(conn, conn->snd_nxt, TCP_FLAG_ACK, 0);
+    }
+}
+
+// Round-trip estimation
+
+// Fold one RTT sample into SRTT/RTTVAR and recompute the RTO (RFC 6298)
+static void tcp_rtt_sample(tcp_connection_t *conn, uint32_t m) {
+    if (m == 0) {
+        m = 1;
+    }
+
+    if (conn->srtt == 0) {
+        conn->srtt = m << 3;
+        conn->rttvar = m << 1;
+    } else {
+        int32_t delta = (int32_t)m - (int32_t)(conn->srtt >> 3);
+        conn->srtt += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        conn->rttvar += delta - (conn->rttvar >> 2);
+    }
+
+    uint32_t rto = (conn->srtt >> 3) + (conn->rttvar > 1 ? conn->rttvar : 1);
+    if (rto < TCP_MS_TO_TICKS(TCP_RTO_MIN_MS)) {
+        rto = TCP_MS_TO_TICKS(TCP_RTO_MIN_MS);
+    }
+    if (rto > TCP_MS_TO_TICKS(TCP_RTO_MAX_MS)) {
+        rto = TCP_MS_TO_TICKS(TCP_RTO_MAX_MS);
+    }
+    conn->rto = rto;
+}
+
+// Options and input
+
+// Find option 'kind' in a segment. Returns a pointer to it (kind byte first)
+// with its length in *len, or NULL.
+static const uint8_t *tcp_find_option(const tcp_segment_t *seg, uint8_t kind, uint8_t *len) {
+    const uint8_t *opt = seg->options;
+    size_t left = seg->options_len;
+
+    while (left > 0) {
+        if (opt[0] == TCP_OPT_END) {
+            break;
+        }
+        if (opt[0] == TCP_OPT_NOP) {
+            opt++;
+            left--;
+            continue;
+        }
+        if (left < 2 || opt[1] < 2 || opt[1] > left) {
+            break;
+        }
+        if (opt[0] == kind) {
+            *len = opt[1];
+            return opt;
+        }
+        left -= opt[1];
+        opt += opt[1];
+    }
+    return NULL;
+}
+
+// Options of a SYN: MSS, window scale, SACK-permitted
+static void tcp_parse_options(tcp_connection_t *conn, const tcp_segment_t *seg) {
+    uint32_t mss = TCP_DEFAULT_MSS;
+    int wscale = -1;
+    uint8_t len;
+
+    const uint8_t *opt = tcp_find_option(seg, TCP_OPT_MSS, &len);
+    if (opt && len == 4) {
+        mss = ((uint32_t)opt[2] << 8) | opt[3];
+    }
+    opt = tcp_find_option(seg, TCP_OPT_WSCALE, &len);
+    if (opt && len == 3) {
+        wscale = opt[2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : opt[2];
+    }
+
+    conn->mss = mss == 0 ? TCP_DEFAULT_MSS : (mss > TCP_MSS ? TCP_MSS : mss);
+
+    // Scaling only applies when both SYNs carry the option
+    if (conn->wscale_ok && wscale >= 0) {
+        conn->snd_wscale = wscale;
+    } else {
+        conn->wscale_ok = false;
+        conn->snd_wscale = 0;
+        conn->rcv_wscale = 0;
+    }
+
+    // Likewise SACK
+    if (!tcp_find_option(seg, TCP_OPT_SACK_PERMITTED, &len) || len != 2) {
+        conn->sack_ok = false;
+    }
+}
+
+// Merge the SACK blocks of an ACK into the sender's scoreboard
+static void tcp_sack_update(tcp_connection_t *conn, const tcp_segment_t *seg) {
+    uint8_t len;
+    const uint8_t *opt = tcp_find_option(seg, TCP_OPT_SACK, &len);
+    if (!opt || len < 10) {
+        return;
+    }
+
+    for (int b = 0; b < (len - 2) / 8; b++) {
+        uint32_t edges[2];
+        memcpy(edges, opt + 2 + b * 8, sizeof(edges));
+        uint32_t start = __builtin_bswap32(edges[0]);
+        uint32_t end = __builtin_bswap32(edges[1]);
+
+        // Only blocks covering data we sent and is still unacknowledged
+        if (!SEQ_LT(start, end) || SEQ_LEQ(end, conn->snd_una) || SEQ_GT(end, conn->snd_max)) {
+            continue;
+        }
+        if (SEQ_LT(start, conn->snd_una)) {
+            start = conn->snd_una;
+        }
+
+        // Insert in order, absorbing every block it overlaps or touches
+        int i = 0;
+        while (i < conn->sack_count && SEQ_LT(conn->sack[i].end, start)) {
+            i++;
+        }
+        int j = i;
+        while (j < conn->sack_count && SEQ_LEQ(conn->sack[j].start, end)) {
+            if (SEQ_LT(conn->sack[j].start, start)) {
+                start = conn->sack[j].start;
+            }
+            if (SEQ_GT(conn->sack[j].end, end)) {
+                end = conn->sack[j].end;
+            }
+            j++;
+        }
+
+        int removed = j - i;
+        if (removed == 0 && conn->sack_count == TCP_SACK_MAX) {
+            if (i == TCP_SACK_MAX) {
+                continue;   // Highest and no room: forget it
+            }
+            conn->sack_count--;  // Drop the highest block to make room
+        }
+        int shift = 1 - removed;
+        if (shift > 0) {
+            for (int k = conn->sack_count - 1; k >= j; k--) {
+                conn->sack[k + shift] = conn->sack[k];
+            }
+        } else if (shift < 0) {
+            for (int k = j; k < conn->sack_count; k++) {
+                conn->sack[k + shift] = conn->sack[k];
+            }
+        }
+        conn->sack_count += shift;
+        conn->sack[i].start = start;
+        conn->sack[i].end = end;
+    }
+}
+
+// Drop scoreboard entries the cumulative ACK has overtaken
+static void tcp_sack_prune(tcp_connection_t *conn) {
+    int keep = 0;
+    for (int i = 0; i < conn->sack_count; i++) {
+        if (SEQ_LEQ(conn->sack[i].end, conn->snd_una)) {
+            continue;
+        }
+        conn->sack[keep] = conn->sack[i];
+        if (SEQ_LT(conn->sack[keep].start, conn->snd_una)) {
+            conn->sack[keep].start = conn->snd_una;
+        }
+        keep++;
+    }
+    conn->sack_count = keep;
+}
+
+static uint32_t tcp_sacked_bytes(const tcp_connection_t *conn) {
+    uint32_t bytes = 0;
+    for (int i = 0; i < conn->sack_count; i++) {
+        bytes += conn->sack[i].end - conn->sack[i].start;
+    }
+    return bytes;
+}
+
+// Congestion window at the start of a connection: RFC 6928's initial window,
+// or a single segment if the handshake needed a retransmission (RFC 5681)
+static void tcp_cong_start(tcp_connection_t *conn) {
+    uint32_t iw = 14600 > 2u * conn->mss ? 14600 : 2u * conn->mss;
+    if (iw > 10u * conn->mss) {
+        iw = 10u * conn->mss;
+    }
+    conn->cwnd = conn->retransmits ? conn->mss : iw;
+    conn->ssthresh = TCP_INFINITE_SSTHRESH;
+    conn->bytes_acked = 0;
+    if (conn->cong->init) {
+        conn->cong->init(conn);
+    }
+}
+
+// New data acknowledged: leave or continue recovery, or grow the window
+static void tcp_cong_on_ack(tcp_connection_t *conn, uint32_t ack, uint32_t acked) {
+    if (conn->in_recovery) {
+        if (SEQ_GEQ(ack, conn->recover)) {
+            // Full ACK: deflate to ssthresh, without a burst (RFC 6582 3.2 step 3)
+            uint32_t flight = tcp_flight_size(conn) + conn->mss;
+            conn->cwnd = conn->sack_ok || flight > conn->ssthresh ? conn->ssthresh : flight;
+            conn->in_recovery = false;
+            conn->dupacks = 0;
+            conn->bytes_acked = 0;
+        } else if (!conn->sack_ok) {
+            // Partial ACK: the next hole is at snd_una; resend it and
+            // deflate by what was acknowledged
+            tcp_retransmit_head(conn);
+            conn->cwnd = conn->cwnd > acked ? conn->cwnd - acked : 0;
+            if (acked >= conn->mss) {
+                conn->cwnd += conn->mss;
+            }
+            if (conn->cwnd < conn->mss) {
+                conn->cwnd = conn->mss;
+            }
+        } else if (SEQ_LT(conn->rexmit_nxt, conn->snd_una)) {
+            conn->rexmit_nxt = conn->snd_una;
+        }
+        return;
+    }
+
+    conn->dupacks = 0;
+    conn->cong->cong_avoid(conn, acked);
+}
+
+// A duplicate ACK: count it and enter fast retransmit/fast recovery at the
+// threshold (or as soon as SACK shows enough data beyond a hole)
+static void tcp_cong_on_dupack(tcp_connection_t *conn) {
+    conn->dupacks++;
+
+    if (conn->in_recovery) {
+        if (!conn->sack_ok) {
+            conn->cwnd += conn->mss;   // Inflate: another segment has left the network
+        }
+        return;
+    }
+
+    bool lost = conn->dupacks >= TCP_DUPACK_THRESHOLD ||
+                (conn->sack_ok && tcp_sacked_bytes(conn) >= TCP_DUPACK_THRESHOLD * conn->mss);
+    if (!lost) {
+        return;
+    }
+
+    conn->ssthresh = conn->cong->ssthresh(conn);
+    conn->recover = conn->snd_max;
+    conn->in_recovery = true;
+    conn->fast_retransmits++;
+    conn->bytes_acked = 0;
+
+    if (conn->sack_ok) {
+        conn->cwnd = conn->ssthresh;
+        conn->rexmit_nxt = conn->snd_una;   // tcp_output() resends the holes
+    } else {
+        tcp_retransmit_head(conn);
+        conn->cwnd = conn->ssthresh + TCP_DUPACK_THRESHOLD * conn->mss;
+    }
+    DEBUG_DEBUG("TCP: Fast retransmit at %u (cwnd %u ssthresh %u)\n",
+                conn->snd_una, conn->cwnd, conn->ssthresh);
+}
+
+// Add [start, end) to the out-of-order list, merging neighbours. Returns
+// false if there is no room to track another hole.
+static bool tcp_ooo_insert(tcp_connection_t *conn, uint32_t start, uint32_t end) {
+    for (int i = 0; i < conn->ooo_count; i++) {
+        if (SEQ_LEQ(conn->ooo[i].start, end) && SEQ_LEQ(start, conn->ooo[i].end)) {
+            if (SEQ_LT(conn->ooo[i].start, start)) {
+                start = conn->ooo[i].start;
+            }
+            if (SEQ_GT(conn->ooo[i].end, end)) {
+                end = conn->ooo[i].end;
+            }
+            conn->ooo[i] = conn->ooo[--conn->ooo_count];
+            i = -1;   // Rescan: the wider range may now touch another
+        }
+    }
+
+    if (conn->ooo_count == TCP_OOO_MAX) {
+        return false;
+    }
+    conn->ooo[conn->ooo_count].start = start;
+    conn->ooo[conn->ooo_count].end = end;
+    conn->ooo_count++;
+    return true;
+}
+
+// Move rcv_nxt over out-of-order ranges the new data has made contiguous
+static void tcp_ooo_drain(tcp_connection_t *conn) {
+    for (int i = 0; i < conn->ooo_count; i++) {
+        if (SEQ_LEQ(conn->ooo[i].start, conn->rcv_nxt)) {
+            if (SEQ_GT(conn->ooo[i].end, conn->rcv_nxt)) {
+                conn->rcv_buf.head += conn->ooo[i].end - conn->rcv_nxt;
+                conn->rcv_nxt = conn->ooo[i].end;
+            }
+            conn->ooo[i] = conn->ooo[--conn->ooo_count];
+            i = -1;
+        }
+    }
+}
+
+// Place segment data (already trimmed to the window) in the receive ring.
+// Returns true if rcv_nxt advanced.
+static bool tcp_receive_data(tcp_connection_t *conn, uint32_t seq, const uint8_t *data, uint32_t len) {
+    uint32_t offset = seq - conn->rcv_nxt;
+
+    if (offset > 0) {
+        // Out of order: park it at its place in the ring past the hole
+        if (tcp_ooo_insert(conn, seq, seq + len)) {
+            ring_write_at(&conn->rcv_buf, offset, data, len);
+        }
+        return false;
+    }
+
+    ring_write_at(&conn->rcv_buf, 0, data, len);
+    conn->rcv_buf.head += len;
+    conn->rcv_nxt += len;
+    tcp_ooo_drain(conn);
+
+    // Nobody will read it any more; acknowledge and drop
+    if (conn->orphaned) {
+        conn->rcv_buf.tail = conn->rcv_buf.head;
+    }
+    return true;
+}
+
+// Process an acceptable ACK that covers new data. Called with conn->lock held.
+static void tcp_ack_advance(tcp_connection_t *conn, uint32_t ack) {
+    if (conn->rtt_active && SEQ_GT(ack, conn->rtt_seq)) {
+        tcp_rtt_sample(conn, (uint32_t)(timer_get_ticks() - conn->rtt_start));
+        conn->rtt_active = false;
+    }
+
+    // Drop acknowledged bytes from the retransmission queue
+    if (SEQ_GT(ack, conn->snd_buf_seq)) {
+        uint32_t acked = ack - conn->snd_buf_seq;
+        if (acked > ring_used(&conn->snd_buf)) {
+            acked = ring_used(&conn->snd_buf);  // The rest covers SYN/FIN
+        }
+        conn->snd_buf.tail += acked;
+        conn->snd_buf_seq += acked;
+    }
+
+    conn->snd_una = ack;
+    if (SEQ_LT(conn->snd_nxt, conn->snd_una)) {
+        conn->snd_nxt = conn->snd_una;
+    }
+    conn->retries = 0;
+    tcp_sack_prune(conn);
+
+    // Restart the retransmit timer for what is still outstanding (RFC 6298 5.3)
+    ktimer_cancel(&conn->timer);
+    if (conn->snd_una != conn->snd_max) {
+        tcp_arm_timer(conn, conn->rto);
+    }
+}
+
+static bool tcp_fin_acked(const tcp_connection_t *conn) {
+    return conn->fin_queued && ring_used(&conn->snd_buf) == 0 &&
+           conn->snd_una == conn->snd_buf_seq + 1;
+}
+
+static void tcp_enter_time_wait(tcp_connection_t *conn) {
+    conn->state = TCP_TIME_WAIT;
+    ktimer_cancel(&conn->timer);
+    tcp_arm_timer(conn, TCP_MS_TO_TICKS(TCP_TIME_WAIT_MS));
+}
+
+static void tcp_input_syn_sent(tcp_connection_t *conn, const tcp_segment_t *seg, int *events) {
+    bool ack_ok = false;
+
+    if (seg->flags & TCP_FLAG_ACK) {
+        if (seg->ack != conn->iss + 1) {
+            if (!(seg->flags & TCP_FLAG_RST)) {
+                tcp_send_packet(conn->iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                                seg->ack, 0, TCP_FLAG_RST, NULL, 0);
+            }
+            return;
+        }
+        ack_ok = true;
+    }
+
+    if (seg->flags & TCP_FLAG_RST) {
+        if (ack_ok) {
+            DEBUG_DEBUG("TCP: Connection to port %d refused\n", conn->remote_port);
+            *events |= TCP_EVENT_CLOSE;
+            tcp_release(conn);
+        }
+        return;
+    }
+
+    // Simultaneous open (SYN without ACK) is not supported
+    if (!(seg->flags & TCP_FLAG_SYN) || !ack_ok) {
+        return;
+    }
+
+    tcp_parse_options(conn, seg);
+    conn->irs = seg->seq;
+    conn->rcv_nxt = seg->seq + 1;
+    conn->snd_wnd = seg->window;
+    conn->snd_wl1 = seg->seq;
+    conn->snd_wl2 = seg->ack;
+    tcp_ack_advance(conn, seg->ack);
+
+    conn->state = TCP_ESTABLISHED;
+    tcp_cong_start(conn);
+    *events |= TCP_EVENT_CONNECT;
+    DEBUG_DEBUG("TCP: Connected to port %d (mss %d, wscale %d/%d)\n", conn->remote_port,
+                conn->mss, conn->snd_wscale, conn->rcv_wscale);
+
+    // ACK the SYN, carrying any data queued while connecting
+    tcp_output(conn, true);
+}
+
+// Segment processing for every state past SYN-SENT (RFC 793 section 3.9).
+// Called with conn->lock held.
+static void tcp_input(tcp_connection_t *conn, tcp_segment_t *seg, int *events) {
+    uint32_t seq = seg->seq;
+    const uint8_t *data = seg->payload;
+    uint32_t len = seg->payload_len;
+    bool fin = (seg->flags & TCP_FLAG_FIN) != 0;
+
+    if (seg->flags & TCP_FLAG_SYN) {
+        seq++;  // A retransmitted SYN occupies the sequence number before the data
+    }
+
+    // Trim bytes we already have
+    if (SEQ_LT(seq, conn->rcv_nxt)) {
+        uint32_t dup = conn->rcv_nxt - seq;
+        if (dup > len || (dup == len && !fin)) {
+            // Entirely old: a retransmission whose ACK got lost
+            if (!(seg->flags & TCP_FLAG_RST)) {
+                tcp_output(conn, true);
+            }
+            return;
+        }
+        data += dup;
+        len -= dup;
+        seq = conn->rcv_nxt;
+    }
+
+    // Trim what falls past the window
+    uint32_t rcv_wnd = ring_free(&conn->rcv_buf);
+    uint32_t offset = seq - conn->rcv_nxt;
+    if (offset > rcv_wnd) {
+        if (!(seg->flags & TCP_FLAG_RST)) {
+            tcp_output(conn, true);
+        }
+        return;
+    }
+    if (len > rcv_wnd - offset) {
+        len = rcv_wnd - offset;
+        fin = false;
+    }
+
+    if (seg->flags & TCP_FLAG_RST) {
+        DEBUG_DEBUG("TCP: Connection reset by peer (port %d)\n", conn->remote_port);
+        *events |= TCP_EVENT_CLOSE;
+        tcp_release(conn);
+        return;
+    }
+
+    // A SYN inside the window of a synchronized connection: challenge ACK
+    if ((seg->flags & TCP_FLAG_SYN) && conn->state != TCP_SYN_RECEIVED) {
+        tcp_output(conn, true);
+        return;
+    }
+
+    if (!(seg->flags & TCP_FLAG_ACK)) {
+        return;
+    }
+
+    bool handshake = false;
+    if (conn->state == TCP_SYN_RECEIVED) {
+        if (SEQ_LEQ(seg->ack, conn->snd_una) || SEQ_GT(seg->ack, conn->snd_max)) {
+            tcp_send_packet(conn->iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                            seg->ack, 0, TCP_FLAG_RST, NULL, 0);
+            return;
+        }
+        bool listener_gone;
+        if (!tcp_child_established(conn, &listener_gone)) {
+            if (listener_gone) {
+                tcp_send_packet(conn->iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                                seg->ack, 0, TCP_FLAG_RST, NULL, 0);
+                tcp_release(conn);
+            }
+            return;
+        }
+        conn->state = TCP_ESTABLISHED;
+        conn->snd_wl1 = seg->seq - 1;   // Force the window update below
+        tcp_cong_start(conn);
+        handshake = true;
+        *events |= TCP_EVENT_CONNECT;
+        DEBUG_DEBUG("TCP: Accepted connection from port %d\n", conn->remote_port);
+    }
+
+    // ACK processing
+    if (SEQ_GT(seg->ack, conn->snd_max)) {
+        tcp_output(conn, true);   // Acknowledges something we never sent
+        return;
+    }
+    if (conn->sack_ok) {
+        tcp_sack_update(conn, seg);
+    }
+    if (SEQ_GT(seg->ack, conn->snd_una)) {
+        uint32_t acked = seg->ack - conn->snd_una;
+        tcp_ack_advance(conn, seg->ack);
+        *events |= TCP_EVENT_WRITE;
+        if (!handshake) {
+            tcp_cong_on_ack(conn, seg->ack, acked);
+        }
+    } else if (seg->ack == conn->snd_una && conn->snd_una != conn->snd_max &&
+               seg->payload_len == 0 && !(seg->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) &&
+               ((uint32_t)seg->window << conn->snd_wscale) == conn->snd_wnd) {
+        // Duplicate ACK (RFC 5681): nothing new acknowledged, no data, same window
+        tcp_cong_on_dupack(conn);
+    }
+
+    // Window update, ignoring segments older than the last one used
+    if (SEQ_LT(conn->snd_wl1, seg->seq) ||
+        (conn->snd_wl1 == seg->seq && SEQ_LEQ(conn->snd_wl2, seg->ack))) {
+        if (conn->snd_wnd == 0) {
+            conn->retries = 0;    // The peer answers our probes; keep probing
+        }
+        conn->snd_wnd = (uint32_t)seg->window << conn->snd_wscale;
+        conn->snd_wl1 = seg->seq;
+        conn->snd_wl2 = seg->ack;
+    }
+
+    if (tcp_fin_acked(conn)) {
+        switch (conn->state) {
+            case TCP_FIN_WAIT_1:
+                conn->state = TCP_FIN_WAIT_2;
+                break;
+            case TCP_CLOSING:
+                tcp_enter_time_wait(conn);
+                break;
+            case TCP_LAST_ACK:
+                tcp_release(conn);
+                return;
+            default:
+                break;
+        }
+    }
+
+    // Data
+    bool ack_now = false;
+    if (len > 0) {
+        if (conn->state == TCP_ESTABLISHED || conn->state == TCP_FIN_WAIT_1 ||
+            conn->state == TCP_FIN_WAIT_2) {
+            if (tcp_receive_data(conn, seq, data, len) && !conn->orphaned) {
+                *events |= TCP_EVENT_DATA;
+            }
+        }
+        ack_now = true;
+    }
+
+    // FIN, honoured only once everything before it has arrived
+    if (fin && seq + len == conn->rcv_nxt) {
+        conn->rcv_nxt++;
+        ack_now = true;
+
+        switch (conn->state) {
+            case TCP_ESTABLISHED:
+                conn->state = TCP_CLOSE_WAIT;
+                *events |= TCP_EVENT_CLOSE;
+                break;
+            case TCP_FIN_WAIT_1:
+                if (tcp_fin_acked(conn)) {
+                    tcp_enter_time_wait(conn);
+                } else {
+                    conn->state = TCP_CLOSING;
+                }
+                break;
+            case TCP_FIN_WAIT_2:
+            case TCP_TIME_WAIT:
+                tcp_enter_time_wait(conn);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Within a receive run the ACK (and anything it clocks out) is sent
+    // once, after the run's last segment
+    if (conn->rx_batch) {
+        conn->rx_ack_pending |= ack_now;
+        return;
+    }
+    tcp_output(conn, ack_now);
+}
+
+// SYN cookies
+//
+// When a listener's SYN queue is full we answer SYNs without keeping any
+// state: the ISS of the SYN-ACK encodes a coarse timestamp and the MSS, and
+// a keyed hash of both and the 4-tuple. A returning ACK that carries a valid
+// cookie recreates the connection. Window scaling and SACK can't be
+// recovered that way, so such connections run without them. The hash is
+// keyed but not cryptographic.
+
+#define TCP_COOKIE_PERIOD_MS 64000  // Timestamp granularity; 5 bits wrap in ~34 min
+
+static const uint16_t tcp_cookie_mss[] = { 536, 1024, 1220, 1360, 1440, 1460 };
+#define TCP_COOKIE_MSS_COUNT ((uint32_t)(sizeof(tcp_cookie_mss) / sizeof(tcp_cookie_mss[0])))
+
+static uint32_t tcp_cookie_time(void) {
+    return (uint32_t)(timer_get_ticks() / TCP_MS_TO_TICKS(TCP_COOKIE_PERIOD_MS)) & 0x1F;
+}
+
+static uint32_t tcp_cookie_hash(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip,
+                                uint16_t remote_port, uint32_t irs, uint32_t t, uint32_t mss_idx) {
+    uint32_t h = inet_hash_tuple(local_ip, local_port, remote_ip, remote_port,
+                                 tcp_cookie_secret ^ (t * 0x9E3779B1u));
+    return inet_hash_mix(h ^ irs ^ (mss_idx << 29)) & 0xFFFFFF;
+}
+
+static uint32_t tcp_cookie_make(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip,
+                                uint16_t remote_port, uint32_t irs, uint16_t peer_mss) {
+    uint32_t idx = 0;
+    for (uint32_t i = 0; i < TCP_COOKIE_MSS_COUNT; i++) {
+        if (tcp_cookie_mss[i] <= peer_mss) {
+            idx = i;
+        }
+    }
+    uint32_t t = tcp_cookie_time();
+    return (t << 27) | (idx << 24) |
+           tcp_cookie_hash(local_ip, local_port, remote_ip, remote_port, irs, t, idx);
+}
+
+// MSS encoded in a cookie, or 0 if it is forged or stale (older than one period)
+static uint16_t tcp_cookie_check(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip,
+                                 uint16_t remote_port, uint32_t irs, uint32_t cookie) {
+    uint32_t t = cookie >> 27;
+    uint32_t idx = (cookie >> 24) & 0x7;
+    if (idx >= TCP_COOKIE_MSS_COUNT || ((tcp_cookie_time() - t) & 0x1F) > 1) {
+        return 0;
+    }
+    if (tcp_cookie_hash(local_ip, local_port, remote_ip, remote_port, irs, t, idx) !=
+        (cookie & 0xFFFFFF)) {
+        return 0;
+    }
+    return tcp_cookie_mss[idx];
+}
+
+// Answer a SYN with a cookie SYN-ACK, keeping no state
+static void tcp_send_cookie(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip,
+                            uint16_t src_port, uint16_t dest_port, const tcp_segment_t *seg) {
+    uint16_t peer_mss = TCP_DEFAULT_MSS;
+    uint8_t len;
+    const uint8_t *opt = tcp_find_option(seg, TCP_OPT_MSS, &len);
+    if (opt && len == 4) {
+        peer_mss = ((uint16_t)opt[2] << 8) | opt[3];
+    }
+
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return;
+    }
+
+    uint32_t cookie = tcp_cookie_make(dest_ip, dest_port, src_ip, src_port, seg->seq, peer_mss);
+    uint8_t options[4] = { TCP_OPT_MSS, 4, TCP_MSS >> 8, TCP_MSS & 0xFF };
+    uint16_t window = TCP_RCV_BUF_SIZE > 0xFFFF ? 0xFFFF : TCP_RCV_BUF_SIZE;
+    tcp_emit(iface, src_ip, dest_port, src_port, cookie, seg->seq + 1, TCP_FLAG_SYN | TCP_FLAG_ACK,
+             window, options, sizeof(options), p, 0);
+    DEBUG_DEBUG("TCP: SYN queue full on port %d, sent cookie\n", dest_port);
+}
+
+// Passive open
+
+// Create a child of 'listener' for the given 4-tuple, hashed and in
+// SYN_RECEIVED with buffers allocated. Returns it locked, or NULL.
+static tcp_connection_t *tcp_spawn_child(tcp_connection_t *listener, network_interface_t *iface,
+                                         uint32_t src_ip, uint32_t dest_ip, uint16_t src_port,
+                                         uint16_t dest_port, uint64_t *irq_flags) {
+    tcp_connection_t *conn = tcp_alloc_connection();
+    if (!conn) {
+        DEBUG_WARN("TCP: Connection table full, dropping SYN for port %d\n", dest_port);
+        return NULL;
+    }
+
+    *irq_flags = spin_lock_irqsave(&conn->lock);
+
+    // Take a SYN queue place and inherit the listener's settings; from here
+    // tcp_release() gives the place back
+    uint64_t flags = spin_lock_irqsave(&listener->lock);
+    if (!listener->active || listener->state != TCP_LISTEN) {
+        spin_unlock_irqrestore(&listener->lock, flags);
+        tcp_release(conn);
+        spin_unlock_irqrestore(&conn->lock, *irq_flags);
+        return NULL;
+    }
+    listener->syn_queued++;
+    conn->parent = listener;
+    conn->parent_gen = listener->generation;
+    conn->in_syn_queue = true;
+    conn->on_connect = listener->on_connect;
+    conn->on_data = listener->on_data;
+    conn->on_close = listener->on_close;
+    conn->cong = listener->cong;
+    spin_unlock_irqrestore(&listener->lock, flags);
+
+    conn->local_ip = dest_ip;
+    conn->local_port = dest_port;
+    conn->remote_ip = src_ip;
+    conn->remote_port = src_port;
+    conn->iface = iface;
+
+    if (tcp_alloc_buffers(conn) != NET_SUCCESS) {
+        tcp_release(conn);
+        spin_unlock_irqrestore(&conn->lock, *irq_flags);
+        return NULL;
+    }
+
+    // A retransmitted SYN can race its first copy here
+    uint64_t table_flags = spin_lock_irqsave(&tcp_table_lock);
+    int result = tcp_hash_insert(conn);
+    spin_unlock_irqrestore(&tcp_table_lock, table_flags);
+    if (result != NET_SUCCESS) {
+        tcp_release(conn);
+        spin_unlock_irqrestore(&conn->lock, *irq_flags);
+        return NULL;
+    }
+
+    conn->state = TCP_SYN_RECEIVED;
+    return conn;
+}
+
+// A SYN arrived for a listening port
+static void tcp_accept_syn(tcp_connection_t *listener, network_interface_t *iface,
+                           uint32_t src_ip, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                           const tcp_segment_t *seg) {
+    uint64_t flags = spin_lock_irqsave(&listener->lock);
+    bool accept_full = listener->accept_count >= listener->backlog;
+    bool syn_full = listener->syn_queued >= listener->backlog;
+    spin_unlock_irqrestore(&listener->lock, flags);
+
+    if (accept_full) {
+        // Nobody is accepting: let the peer retry rather than pile up more
+        DEBUG_DEBUG("TCP: Accept queue full on port %d, dropping SYN\n", dest_port);
+        return;
+    }
+    if (syn_full) {
+        tcp_send_cookie(iface, src_ip, dest_ip, src_port, dest_port, seg);
+        return;
+    }
+
+    tcp_connection_t *conn = tcp_spawn_child(listener, iface, src_ip, dest_ip, src_port, dest_port, &flags);
+    if (!conn) {
+        return;
+    }
 
-int tcp_init(void) {
-    // Initialize connections
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        connections[i].local_ip = 0;
-        connections[i].local_port = 0;
-        connections[i].remote_ip = 0;
-        connections[i].remote_port = 0;
-        connections[i].state = TCP_CLOSED;
-        connections[i].seq_num = 0;
-        connections[i].ack_num = 0;
-        connections[i].window_size = TCP_WINDOW_SIZE;
-        connections[i].active = false;
-        connections[i].on_connect = NULL;
-        connections[i].on_data = NULL;
-        connections[i].on_close = NULL;
-    }
-    connection_count = 0;
-    return NET_SUCCESS;
+    conn->wscale_ok = true;
+    conn->sack_ok = true;
+    conn->rcv_wscale = tcp_rcv_wscale();
+    tcp_parse_options(conn, seg);
+
+    conn->irs = seg->seq;
+    conn->rcv_nxt = seg->seq + 1;
+    conn->iss = tcp_new_iss();
+    conn->snd_una = conn->iss;
+    conn->snd_nxt = conn->iss + 1;
+    conn->snd_max = conn->iss + 1;
+    conn->snd_buf_seq = conn->iss + 1;
+    conn->snd_wnd = seg->window;
+
+    conn->rtt_active = true;
+    conn->rtt_seq = conn->iss;
+    conn->rtt_start = timer_get_ticks();
+    tcp_output_segment(conn, conn->iss, TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+    tcp_arm_timer(conn, conn->rto);
+    spin_unlock_irqrestore(&conn->lock, flags);
 }
 
-int tcp_send_packet(network_interface_t *iface, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port, 
-                   uint32_t seq, uint32_t ack, uint8_t flags, void *payload, size_t payload_len) {
-    if (!iface) {
-        return NET_INVALID_PARAM;
+// An ACK for a listening port with no connection: if it answers one of our
+// cookies, rebuild the connection as if it had sat in the SYN queue. Returns
+// it locked, still in SYN_RECEIVED, for the ACK to complete the handshake.
+static tcp_connection_t *tcp_cookie_child(tcp_connection_t *listener, network_interface_t *iface,
+                                          uint32_t src_ip, uint32_t dest_ip, uint16_t src_port,
+                                          uint16_t dest_port, const tcp_segment_t *seg,
+                                          uint64_t *irq_flags) {
+    uint32_t irs = seg->seq - 1;
+    uint32_t iss = seg->ack - 1;
+    uint16_t mss = tcp_cookie_check(dest_ip, dest_port, src_ip, src_port, irs, iss);
+    if (mss == 0) {
+        return NULL;
     }
 
-    if (payload_len > TCP_MAX_PAYLOAD) {
-        return NET_ERROR;
+    tcp_connection_t *conn = tcp_spawn_child(listener, iface, src_ip, dest_ip, src_port, dest_port, irq_flags);
+    if (!conn) {
+        return NULL;
     }
 
-    tcp_packet_t packet;
-    
-    // Build TCP header
-    packet.header.src_port = __builtin_bswap16(src_port);
-    packet.header.dest_port = __builtin_bswap16(dest_port);
-    packet.header.seq_num = __builtin_bswap32(seq);
-    packet.header.ack_num = __builtin_bswap32(ack);
-    packet.header.data_offset_reserved = (TCP_HEADER_LEN / 4) << 4;
-    packet.header.flags = flags;
-    packet.header.window = __builtin_bswap16(TCP_WINDOW_SIZE);
-    packet.header.checksum = 0;
-    packet.header.urgent_ptr = 0;
-
-    // Copy payload if any
-    if (payload && payload_len > 0) {
-        memcpy(packet.payload, payload, payload_len);
-    }
+    conn->mss = mss;
+    conn->wscale_ok = false;
+    conn->sack_ok = false;
+    conn->irs = irs;
+    conn->rcv_nxt = seg->seq;
+    conn->iss = iss;
+    conn->snd_una = iss;
+    conn->snd_nxt = iss + 1;
+    conn->snd_max = iss + 1;
+    conn->snd_buf_seq = iss + 1;
+    conn->snd_wnd = seg->window;
+
+    // Resends the SYN-ACK should the accept queue turn out to be full
+    tcp_arm_timer(conn, conn->rto);
+    DEBUG_DEBUG("TCP: Valid cookie from port %d\n", src_port);
+    return conn;
+}
 
-    // Calculate checksum
-    packet.header.checksum = tcp_checksum(&packet.header, iface->ip_address, dest_ip, TCP_HEADER_LEN + payload_len);
+// Hand in-order data to an on_data callback, outside the lock. Only the RX
+// path appends to the ring, and it is the caller, so the bytes stay put.
+static void tcp_deliver(tcp_connection_t *conn) {
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&conn->lock);
+        void (*on_data)(struct tcp_connection *, void *, size_t) = conn->on_data;
+        tcp_ring_t *ring = &conn->rcv_buf;
+        uint32_t used = conn->active && ring->data ? ring_used(ring) : 0;
+        if (!on_data || used == 0) {
+            spin_unlock_irqrestore(&conn->lock, flags);
+            return;
+        }
+
+        uint32_t pos = ring->tail & (ring->size - 1);
+        uint32_t chunk = ring->size - pos < used ? ring->size - pos : used;
+        uint8_t *ptr = ring->data + pos;
+        spin_unlock_irqrestore(&conn->lock, flags);
 
-    // Send via IP layer
-    return ip_send_packet(iface, dest_ip, IP_PROTOCOL_TCP, &packet, TCP_HEADER_LEN + payload_len);
+        on_data(conn, ptr, chunk);
+
+        flags = spin_lock_irqsave(&conn->lock);
+        if (conn->active && ring->data) {
+            ring->tail += chunk;
+            tcp_window_update(conn);
+        }
+        spin_unlock_irqrestore(&conn->lock, flags);
+    }
 }
 
-void tcp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, tcp_packet_t *packet) {
-    if (!iface || !packet) {
-        return;
+// Decode a received segment's header. Returns false if it is malformed.
+static bool tcp_parse_segment(tcp_packet_t *packet, size_t len, tcp_segment_t *seg,
+                              uint16_t *src_port, uint16_t *dest_port) {
+    if (!packet || len < TCP_HEADER_LEN) {
+        return false;
+    }
+
+    size_t header_len = (packet->header.data_offset_reserved >> 4) * 4;
+    if (header_len < TCP_HEADER_LEN || header_len > len) {
+        DEBUG_WARN("TCP: Invalid header length %lu\n", header_len);
+        return false;
     }
 
     // Convert from network byte order
-    uint16_t src_port = __builtin_bswap16(packet->header.src_port);
-    uint16_t dest_port = __builtin_bswap16(packet->header.dest_port);
-    uint32_t seq_num = __builtin_bswap32(packet->header.seq_num);
-    uint32_t ack_num = __builtin_bswap32(packet->header.ack_num);
-    uint8_t flags = packet->header.flags;
-    uint16_t window = __builtin_bswap16(packet->header.window);
-
-    // Find connection
-    tcp_connection_t *conn = NULL;
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (connections[i].active &&
-            connections[i].local_ip == dest_ip &&
-            connections[i].local_port == dest_port &&
-            connections[i].remote_ip == src_ip &&
-            connections[i].remote_port == src_port) {
-            conn = &connections[i];
-            break;
+    *src_port = __builtin_bswap16(packet->header.src_port);
+    *dest_port = __builtin_bswap16(packet->header.dest_port);
+    seg->seq = __builtin_bswap32(packet->header.seq_num);
+    seg->ack = __builtin_bswap32(packet->header.ack_num);
+    seg->flags = packet->header.flags;
+    seg->window = __builtin_bswap16(packet->header.window);
+    seg->options = (const uint8_t *)packet + TCP_HEADER_LEN;
+    seg->options_len = header_len - TCP_HEADER_LEN;
+    seg->payload = (const uint8_t *)packet + header_len;
+    seg->payload_len = len - header_len;
+    return true;
+}
+
+// Find the connection for a segment, handing SYNs and cookie ACKs to their
+// listener and resetting strays. Returns the connection locked, or NULL if
+// the segment has been dealt with.
+static tcp_connection_t *tcp_demux(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip,
+                                   uint16_t src_port, uint16_t dest_port, tcp_segment_t *seg,
+                                   uint64_t *flags) {
+    tcp_connection_t *conn = tcp_lookup(dest_ip, dest_port, src_ip, src_port, flags);
+
+    if (!conn) {
+        uint8_t kind = seg->flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST);
+        if (kind == TCP_FLAG_SYN || kind == TCP_FLAG_ACK) {
+            tcp_connection_t *listener = tcp_find_listener(dest_ip, dest_port);
+            if (listener && kind == TCP_FLAG_SYN) {
+                tcp_accept_syn(listener, iface, src_ip, dest_ip, src_port, dest_port, seg);
+                return NULL;
+            }
+            if (listener) {
+                conn = tcp_cookie_child(listener, iface, src_ip, dest_ip, src_port, dest_port, seg, flags);
+            }
         }
     }
 
-    // Handle SYN to listening port
-    if (!conn && (flags & TCP_FLAG_SYN) && !(flags & TCP_FLAG_ACK)) {
-        // Look for listening connection
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            if (connections[i].active &&
-                connections[i].local_ip == dest_ip &&
-                connections[i].local_port == dest_port &&
-                connections[i].state == TCP_LISTEN) {
-                conn = &connections[i];
-                conn->remote_ip = src_ip;
-                conn->remote_port = src_port;
-                break;
+    if (!conn) {
+        // No connection found: reset, never in answer to a reset (RFC 793)
+        if (!(seg->flags & TCP_FLAG_RST)) {
+            if (seg->flags & TCP_FLAG_ACK) {
+                tcp_send_packet(iface, src_ip, dest_port, src_port, seg->ack, 0, TCP_FLAG_RST, NULL, 0);
+            } else {
+                uint32_t seg_len = seg->payload_len + ((seg->flags & TCP_FLAG_SYN) ? 1 : 0) +
+                                   ((seg->flags & TCP_FLAG_FIN) ? 1 : 0);
+                tcp_send_packet(iface, src_ip, dest_port, src_port, 0, seg->seq + seg_len,
+                                TCP_FLAG_RST | TCP_FLAG_ACK, NULL, 0);
             }
         }
     }
+    return conn;
+}
+
+static void tcp_segment_input(tcp_connection_t *conn, tcp_segment_t *seg, int *events) {
+    if (conn->state == TCP_SYN_SENT) {
+        tcp_input_syn_sent(conn, seg, events);
+    } else {
+        tcp_input(conn, seg, events);
+    }
+}
+
+// Whether a locked connection may take the next segment of its run
+// directly, without another lookup
+static bool tcp_run_continues(const tcp_connection_t *conn) {
+    return conn->active && conn->state != TCP_CLOSED && conn->state != TCP_LISTEN &&
+           conn->state != TCP_SYN_SENT;
+}
+
+// Handle a run of segments that share a 4-tuple (a single segment being a
+// run of one). The connection is looked up and locked once; segments go
+// through tcp_input() one by one, so ACK, SACK and duplicate-ACK
+// processing see each of them, but the reply, readiness notification and
+// data delivery happen once for the run. Returns how many segments were
+// consumed; the connection may stop taking them part way (it closed, or
+// the run began with a handshake), leaving the rest for another pass.
+static int tcp_process_run(network_interface_t *iface, tcp_rx_t *segs, int n) {
+    tcp_segment_t seg;
+    uint16_t src_port, dest_port;
+    int first = 0;
+
+    // Parse ahead to the first well-formed segment
+    while (first < n && !tcp_parse_segment(segs[first].packet, segs[first].len, &seg, &src_port, &dest_port)) {
+        first++;
+    }
+    if (first == n) {
+        return n;
+    }
 
+    uint64_t flags;
+    tcp_connection_t *conn = tcp_demux(iface, segs[first].src_ip, segs[first].dest_ip,
+                                       src_port, dest_port, &seg, &flags);
     if (!conn) {
-        // No connection found, send RST
-        tcp_send_packet(iface, src_ip, dest_port, src_port, 0, seq_num + 1, TCP_FLAG_RST | TCP_FLAG_ACK, NULL, 0);
-        return;
+        return first + 1;   // Handled by the listener or answered with a reset
     }
 
-    // Process packet based on connection state
-    switch (conn->state) {
-        case TCP_LISTEN:
-            if (flags & TCP_FLAG_SYN) {
-                // Send SYN-ACK
-                conn->ack_num = seq_num + 1;
-                conn->seq_num = tcp_sequence_number++;
-                tcp_send_packet(iface, src_ip, dest_port, src_port, conn->seq_num, conn->ack_num, 
-                              TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0);
-                conn->state = TCP_SYN_RECEIVED;
-            }
+    int events = 0;
+    int taken = 1;
+    bool batch = n - first > 1 && tcp_run_continues(conn);
+    conn->rx_batch = batch;
+    tcp_segment_input(conn, &seg, &events);
+
+    int next = first + 1;
+    for (; batch && next < n; next++) {
+        if (!tcp_run_continues(conn)) {
             break;
+        }
+        if (tcp_parse_segment(segs[next].packet, segs[next].len, &seg, &src_port, &dest_port)) {
+            tcp_segment_input(conn, &seg, &events);
+            taken++;
+        }
+    }
+
+    if (batch) {
+        conn->rx_batch = false;
+        if (taken > 1) {
+            conn->gro_runs++;
+            conn->gro_segments += taken;
+        }
+        if (tcp_run_continues(conn)) {
+            tcp_output(conn, conn->rx_ack_pending);
+        }
+        conn->rx_ack_pending = false;
+    }
+
+    if (events) {
+        tcp_notify(conn);
+    }
 
+    // Callbacks run unlocked so they may call back into TCP
+    void (*on_connect)(struct tcp_connection *) = conn->on_connect;
+    void (*on_close)(struct tcp_connection *) = conn->on_close;
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    if ((events & TCP_EVENT_CONNECT) && on_connect) {
+        on_connect(conn);
+    }
+    if (events & TCP_EVENT_DATA) {
+        tcp_deliver(conn);
+    }
+    if ((events & TCP_EVENT_CLOSE) && on_close) {
+        on_close(conn);
+    }
+    return next;
+}
+
+void tcp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, tcp_packet_t *packet, size_t len) {
+    if (!iface || !packet) {
+        return;
+    }
+
+    tcp_rx_t seg = { src_ip, dest_ip, packet, len };
+    tcp_process_run(iface, &seg, 1);
+}
+
+static bool tcp_same_flow(const tcp_rx_t *a, const tcp_rx_t *b) {
+    return a->src_ip == b->src_ip && a->dest_ip == b->dest_ip &&
+           a->len >= TCP_HEADER_LEN && b->len >= TCP_HEADER_LEN &&
+           a->packet->header.src_port == b->packet->header.src_port &&
+           a->packet->header.dest_port == b->packet->header.dest_port;
+}
+
+void tcp_process_burst(network_interface_t *iface, tcp_rx_t *segs, int n) {
+    if (!iface || !segs) {
+        return;
+    }
+
+    // Runs are consecutive segments of one flow, as a bulk transfer lands
+    int i = 0;
+    while (i < n) {
+        int j = i + 1;
+        while (j < n && j - i < TCP_GRO_MAX_SEGS && tcp_same_flow(&segs[i], &segs[j])) {
+            j++;
+        }
+        while (i < j) {
+            i += tcp_process_run(iface, &segs[i], j - i);
+        }
+    }
+}
+
+// Timers
+
+// Timer interrupt context: defer to the work queue
+static void tcp_timer_expired(void *arg) {
+    tcp_connection_t *conn = arg;
+    work_schedule(&conn->timer_work);
+}
+
+static void tcp_timer_work(void *arg) {
+    tcp_connection_t *conn = arg;
+    void (*on_close)(struct tcp_connection *) = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+
+    // Re-armed or cancelled since it fired, or the slot was recycled
+    if (!conn->active || conn->timer.pending || timer_get_ticks() < conn->timer.expires) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return;
+    }
+
+    if (conn->state == TCP_TIME_WAIT) {
+        tcp_release(conn);
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return;
+    }
+
+    uint32_t data_end = conn->snd_buf_seq + ring_used(&conn->snd_buf);
+    bool outstanding = conn->snd_una != conn->snd_max;
+    bool blocked = conn->snd_wnd == 0 && SEQ_LT(conn->snd_nxt, data_end);
+    if (!outstanding && !blocked) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return;
+    }
+
+    if (++conn->retries > TCP_MAX_RETRIES) {
+        DEBUG_WARN("TCP: Connection to port %d timed out\n", conn->remote_port);
+        if (conn->state != TCP_SYN_SENT) {
+            tcp_send_packet(conn->iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                            conn->snd_nxt, 0, TCP_FLAG_RST, NULL, 0);
+        }
+        on_close = conn->on_close;
+        tcp_release(conn);
+        spin_unlock_irqrestore(&conn->lock, flags);
+        if (on_close) {
+            on_close(conn);
+        }
+        return;
+    }
+
+    // Exponential backoff; the next clean RTT sample resets it
+    conn->rto = conn->rto * 2 > TCP_MS_TO_TICKS(TCP_RTO_MAX_MS) ?
+                TCP_MS_TO_TICKS(TCP_RTO_MAX_MS) : conn->rto * 2;
+    conn->rtt_active = false;
+
+    switch (conn->state) {
         case TCP_SYN_SENT:
-            if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == (TCP_FLAG_SYN | TCP_FLAG_ACK)) {
-                // Received SYN-ACK
-                conn->ack_num = seq_num + 1;
-                tcp_send_packet(iface, src_ip, dest_port, src_port, conn->seq_num + 1, conn->ack_num, 
-                              TCP_FLAG_ACK, NULL, 0);
-                conn->state = TCP_ESTABLISHED;
-                if (conn->on_connect) {
-                    conn->on_connect(conn);
-                }
-            }
+            tcp_output_segment(conn, conn->iss, TCP_FLAG_SYN, 0);
+            conn->retransmits++;
+            conn->timeouts++;
+            tcp_arm_timer(conn, conn->rto);
             break;
 
         case TCP_SYN_RECEIVED:
-            if (flags & TCP_FLAG_ACK) {
-                conn->state = TCP_ESTABLISHED;
-                if (conn->on_connect) {
-                    conn->on_connect(conn);
-                }
-            }
+            tcp_output_segment(conn, conn->iss, TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+            conn->retransmits++;
+            conn->timeouts++;
+            tcp_arm_timer(conn, conn->rto);
             break;
 
-        case TCP_ESTABLISHED:
-            // Handle data and control packets
-            if (flags & TCP_FLAG_PSH) {
-                // Data packet
-                size_t data_len = TCP_HEADER_LEN; // Calculate actual data length
-                if (data_len > 0 && conn->on_data) {
-                    conn->on_data(conn, packet->payload, data_len);
+        default:
+            if (outstanding && conn->snd_wnd != 0) {
+                // Loss: back off to one segment and slow start again
+                // (RFC 5681 3.1). SACK state from before is not trusted.
+                conn->ssthresh = conn->cong->ssthresh(conn);
+                conn->cwnd = conn->mss;
+                conn->bytes_acked = 0;
+                conn->in_recovery = false;
+                conn->dupacks = 0;
+                conn->sack_count = 0;
+                conn->timeouts++;
+            }
+
+            // Go back to the oldest unacknowledged byte and resend from there
+            conn->snd_nxt = conn->snd_una;
+            if (conn->snd_wnd == 0 && SEQ_LT(conn->snd_nxt, data_end)) {
+                // Zero-window probe: one byte past the closed window
+                tcp_output_segment(conn, conn->snd_nxt, TCP_FLAG_ACK, 1);
+                if (outstanding) {
+                    conn->retransmits++;
                 }
-                // Send ACK
-                conn->ack_num = seq_num + data_len;
-                tcp_send_packet(iface, src_ip, dest_port, src_port, conn->seq_num, conn->ack_num, 
-                              TCP_FLAG_ACK, NULL, 0);
-            }
-            
-            if (flags & TCP_FLAG_FIN) {
-                // Connection close initiated by remote
-                conn->ack_num = seq_num + 1;
-                tcp_send_packet(iface, src_ip, dest_port, src_port, conn->seq_num, conn->ack_num, 
-                              TCP_FLAG_ACK, NULL, 0);
-                conn->state = TCP_CLOSE_WAIT;
-                if (conn->on_close) {
-                    conn->on_close(conn);
+                conn->snd_nxt++;
+                if (SEQ_GT(conn->snd_nxt, conn->snd_max)) {
+                    conn->snd_max = conn->snd_nxt;
                 }
+                tcp_arm_timer(conn, conn->rto);
+            } else {
+                tcp_output(conn, false);
             }
             break;
-
-        case TCP_CLOSE_WAIT:
-            // Application should close connection
-            break;
-
-        default:
-            break;
     }
+
+    spin_unlock_irqrestore(&conn->lock, flags);
 }
 
+// Application interface
+
 tcp_connection_t *tcp_create_connection(void) {
-    if (connection_count >= MAX_CONNECTIONS) {
-        return NULL;
+    tcp_connection_t *conn = tcp_alloc_connection();
+    if (conn) {
+        uint64_t flags = spin_lock_irqsave(&conn->lock);
+        conn->owned = true;
+        spin_unlock_irqrestore(&conn->lock, flags);
     }
-
-    tcp_connection_t *conn = &connections[connection_count];
-    connection_count++;
-    
-    conn->local_ip = 0;
-    conn->local_port = 0;
-    conn->remote_ip = 0;
-    conn->remote_port = 0;
-    conn->state = TCP_CLOSED;
-    conn->seq_num = tcp_sequence_number++;
-    conn->ack_num = 0;
-    conn->window_size = TCP_WINDOW_SIZE;
-    conn->active = true;
-    conn->on_connect = NULL;
-    conn->on_data = NULL;
-    conn->on_close = NULL;
-
     return conn;
 }
 
@@ -214,95 +2170,412 @@ int tcp_connect(tcp_connection_t *conn, uint32_t remote_ip, uint16_t remote_port
         return NET_ERROR;
     }
 
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active || conn->state != TCP_CLOSED) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return NET_ERROR;
+    }
+
+    if (!conn->snd_buf.data && tcp_alloc_buffers(conn) != NET_SUCCESS) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return NET_BUFFER_FULL;
+    }
+
+    conn->iface = iface;
     conn->local_ip = iface->ip_address;
-    conn->local_port = 32768 + (tcp_sequence_number % 32768); // Ephemeral port
     conn->remote_ip = remote_ip;
     conn->remote_port = remote_port;
 
-    // Send SYN
+    // First ephemeral port whose 4-tuple is free
+    int result = NET_ERROR;
+    uint64_t table_flags = spin_lock_irqsave(&tcp_table_lock);
+    for (uint32_t tries = 0; tries < TCP_EPHEMERAL_COUNT && result != NET_SUCCESS; tries++) {
+        conn->local_port = TCP_EPHEMERAL_FIRST + (next_ephemeral_port++ % TCP_EPHEMERAL_COUNT);
+        result = tcp_hash_insert(conn);
+    }
+    spin_unlock_irqrestore(&tcp_table_lock, table_flags);
+    if (result != NET_SUCCESS) {
+        conn->local_port = 0;
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return NET_ERROR;
+    }
+
+    conn->wscale_ok = true;
+    conn->sack_ok = true;
+    conn->rcv_wscale = tcp_rcv_wscale();
+    conn->iss = tcp_new_iss();
+    conn->snd_una = conn->iss;
+    conn->snd_nxt = conn->iss + 1;
+    conn->snd_max = conn->iss + 1;
+    conn->snd_buf_seq = conn->iss + 1;
+    conn->rcv_nxt = 0;
+
+    // Send SYN; if it is lost (or ARP is still resolving) the timer resends it
     conn->state = TCP_SYN_SENT;
-    return tcp_send_packet(iface, remote_ip, conn->local_port, remote_port, conn->seq_num, 0, TCP_FLAG_SYN, NULL, 0);
+    conn->rtt_active = true;
+    conn->rtt_seq = conn->iss;
+    conn->rtt_start = timer_get_ticks();
+    tcp_output_segment(conn, conn->iss, TCP_FLAG_SYN, 0);
+    tcp_arm_timer(conn, conn->rto);
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return NET_SUCCESS;
 }
 
-int tcp_listen(uint16_t port) {
-    tcp_connection_t *conn = tcp_create_connection();
-    if (!conn) {
-        return NET_ERROR;
+int tcp_listen(tcp_connection_t *conn, uint16_t port, int backlog) {
+    if (!conn || port == 0) {
+        return NET_INVALID_PARAM;
+    }
+    if (backlog <= 0) {
+        backlog = TCP_DEFAULT_BACKLOG;
+    } else if (backlog > TCP_MAX_BACKLOG) {
+        backlog = TCP_MAX_BACKLOG;
     }
 
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active || conn->state != TCP_CLOSED) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return NET_ERROR;
+    }
+    conn->local_ip = 0;
     conn->local_port = port;
+    conn->backlog = backlog;
     conn->state = TCP_LISTEN;
 
-    return NET_SUCCESS;
+    uint64_t table_flags = spin_lock_irqsave(&tcp_table_lock);
+    int result = tcp_listen_insert(conn);
+    spin_unlock_irqrestore(&tcp_table_lock, table_flags);
+    if (result != NET_SUCCESS) {
+        DEBUG_WARN("TCP: Port %d already has a listener\n", port);
+        conn->state = TCP_CLOSED;
+        conn->local_port = 0;
+        conn->backlog = 0;
+    }
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return result;
+}
+
+static bool tcp_accept_ready(tcp_connection_t *listener, uint32_t gen) {
+    return __atomic_load_n(&listener->accept_head, __ATOMIC_ACQUIRE) != NULL ||
+           !__atomic_load_n(&listener->active, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&listener->state, __ATOMIC_ACQUIRE) != TCP_LISTEN ||
+           __atomic_load_n(&listener->generation, __ATOMIC_ACQUIRE) != gen;
+}
+
+tcp_connection_t *tcp_accept(tcp_connection_t *listener, bool block) {
+    if (!listener) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&listener->lock);
+    uint32_t gen = listener->generation;
+    spin_unlock_irqrestore(&listener->lock, flags);
+
+    for (;;) {
+        flags = spin_lock_irqsave(&listener->lock);
+        if (!listener->active || listener->state != TCP_LISTEN || listener->generation != gen) {
+            spin_unlock_irqrestore(&listener->lock, flags);
+            return NULL;
+        }
+
+        uint32_t conn_gen;
+        tcp_connection_t *conn = tcp_accept_pop(listener, &conn_gen);
+        if (conn) {
+            spin_unlock_irqrestore(&listener->lock, flags);
+
+            // Reset by the peer and recycled while we took it off the queue?
+            flags = spin_lock_irqsave(&conn->lock);
+            bool ok = conn->active && conn->generation == conn_gen;
+            if (ok) {
+                conn->parent = NULL;
+                conn->owned = true;
+            }
+            spin_unlock_irqrestore(&conn->lock, flags);
+            if (ok) {
+                return conn;
+            }
+            continue;
+        }
+        spin_unlock_irqrestore(&listener->lock, flags);
+
+        if (!block) {
+            return NULL;
+        }
+        wait_event(&listener->accept_wait, tcp_accept_ready(listener, gen));
+    }
 }
 
 int tcp_send(tcp_connection_t *conn, void *data, size_t len) {
-    if (!conn || !data || len == 0 || conn->state != TCP_ESTABLISHED) {
+    if (!conn || !data || len == 0) {
         return NET_INVALID_PARAM;
     }
 
-    // Find interface
-    network_interface_t *iface = network_find_route(conn->remote_ip);
-    if (!iface) {
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active || conn->fin_queued || !conn->snd_buf.data ||
+        (conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT &&
+         conn->state != TCP_SYN_SENT && conn->state != TCP_SYN_RECEIVED)) {
+        spin_unlock_irqrestore(&conn->lock, flags);
         return NET_ERROR;
     }
 
-    // Send data
-    int result = tcp_send_packet(iface, conn->remote_ip, conn->local_port, conn->remote_port, 
-                                conn->seq_num, conn->ack_num, TCP_FLAG_PSH | TCP_FLAG_ACK, data, len);
-    
-    if (result == NET_SUCCESS) {
-        conn->seq_num += len;
+    // Queue what fits; the window decides how much goes out now
+    uint32_t room = ring_free(&conn->snd_buf);
+    uint32_t n = len < room ? len : room;
+    if (n > 0) {
+        ring_write_at(&conn->snd_buf, 0, data, n);
+        conn->snd_buf.head += n;
+        tcp_output(conn, false);
     }
+    spin_unlock_irqrestore(&conn->lock, flags);
 
-    return result;
+    return n > 0 ? (int)n : NET_BUFFER_FULL;
+}
+
+int tcp_recv(tcp_connection_t *conn, void *buf, size_t len) {
+    if (!conn || !buf || len == 0) {
+        return NET_INVALID_PARAM;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active || !conn->rcv_buf.data) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return NET_ERROR;
+    }
+
+    uint32_t used = ring_used(&conn->rcv_buf);
+    uint32_t n = len < used ? len : used;
+    if (n > 0) {
+        ring_read_at(&conn->rcv_buf, 0, buf, n);
+        conn->rcv_buf.tail += n;
+        tcp_window_update(conn);
+    }
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return n;
+}
+
+// Reset the established connections no one will accept now. Called with the
+// listener unlocked: each child is locked on its own, never under the parent.
+static void tcp_abort_accept_queue(tcp_connection_t *listener) {
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&listener->lock);
+        uint32_t gen;
+        tcp_connection_t *conn = tcp_accept_pop(listener, &gen);
+        spin_unlock_irqrestore(&listener->lock, flags);
+        if (!conn) {
+            return;
+        }
+
+        flags = spin_lock_irqsave(&conn->lock);
+        if (conn->active && conn->generation == gen) {
+            tcp_send_packet(conn->iface, conn->remote_ip, conn->local_port, conn->remote_port,
+                            conn->snd_nxt, 0, TCP_FLAG_RST, NULL, 0);
+            tcp_release(conn);
+        }
+        spin_unlock_irqrestore(&conn->lock, flags);
+    }
 }
 
 void tcp_close(tcp_connection_t *conn) {
-    if (!conn || conn->state == TCP_CLOSED) {
+    if (!conn) {
         return;
     }
 
-    // Find interface
-    network_interface_t *iface = network_find_route(conn->remote_ip);
-    if (iface && conn->state == TCP_ESTABLISHED) {
-        // Send FIN
-        tcp_send_packet(iface, conn->remote_ip, conn->local_port, conn->remote_port, 
-                       conn->seq_num, conn->ack_num, TCP_FLAG_FIN | TCP_FLAG_ACK, NULL, 0);
-        conn->state = TCP_FIN_WAIT_1;
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return;
     }
 
-    conn->active = false;
-    conn->state = TCP_CLOSED;
+    // The application is done with it: no more callbacks, unread data is dropped
+    conn->orphaned = true;
+    conn->owned = false;
+    conn->on_connect = NULL;
+    conn->on_data = NULL;
+    conn->on_close = NULL;
+    conn->on_ready = NULL;
+    conn->ready_ctx = NULL;
+    if (conn->rcv_buf.data) {
+        conn->rcv_buf.tail = conn->rcv_buf.head;
+    }
+
+    switch (conn->state) {
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+            // Send FIN once the queued data has gone; the slot lingers until
+            // the close handshake completes
+            conn->fin_queued = true;
+            conn->state = TCP_FIN_WAIT_1;
+            tcp_output(conn, false);
+            break;
+
+        case TCP_CLOSE_WAIT:
+            conn->fin_queued = true;
+            conn->state = TCP_LAST_ACK;
+            tcp_output(conn, false);
+            break;
+
+        case TCP_LISTEN:
+            // Refuse new handshakes, then reset whatever is still queued
+            conn->backlog = 0;
+            spin_unlock_irqrestore(&conn->lock, flags);
+            tcp_abort_accept_queue(conn);
+            flags = spin_lock_irqsave(&conn->lock);
+            if (conn->active && conn->state == TCP_LISTEN) {
+                tcp_release(conn);
+            }
+            wait_queue_wake_all(&conn->accept_wait);
+            break;
+
+        case TCP_CLOSED:
+        case TCP_SYN_SENT:
+            tcp_release(conn);
+            break;
+
+        default:
+            break;  // Already closing
+    }
+    spin_unlock_irqrestore(&conn->lock, flags);
 }
 
-uint16_t tcp_checksum(tcp_header_t *header, uint32_t src_ip, uint32_t dest_ip, size_t len) {
-    uint32_t sum = 0;
-    uint16_t *ptr;
+void tcp_set_ready_hook(tcp_connection_t *conn, void (*fn)(struct tcp_connection *, void *), void *ctx) {
+    if (!conn) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    conn->on_ready = fn;
+    conn->ready_ctx = ctx;
+    spin_unlock_irqrestore(&conn->lock, flags);
+}
+
+uint32_t tcp_poll(tcp_connection_t *conn) {
+    if (!conn) {
+        return TCP_POLL_HUP;
+    }
+
+    uint32_t mask = 0;
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->active) {
+        mask = TCP_POLL_HUP;
+    } else {
+        switch (conn->state) {
+            case TCP_LISTEN:
+                if (conn->accept_head) {
+                    mask |= TCP_POLL_READ;
+                }
+                break;
+
+            case TCP_CLOSED:
+                mask |= TCP_POLL_HUP;
+                break;
+
+            case TCP_SYN_SENT:
+            case TCP_SYN_RECEIVED:
+                break;
+
+            default:
+                // The peer's FIN has arrived in every state past these two
+                // but the FIN_WAITs: reading then returns end of file
+                if ((conn->rcv_buf.data && ring_used(&conn->rcv_buf) > 0) ||
+                    (conn->state != TCP_ESTABLISHED && conn->state != TCP_FIN_WAIT_1 &&
+                     conn->state != TCP_FIN_WAIT_2)) {
+                    mask |= TCP_POLL_READ;
+                }
+                if ((conn->state == TCP_ESTABLISHED || conn->state == TCP_CLOSE_WAIT) &&
+                    !conn->fin_queued && conn->snd_buf.data && ring_free(&conn->snd_buf) > 0) {
+                    mask |= TCP_POLL_WRITE;
+                }
+                break;
+        }
+    }
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return mask;
+}
 
-    // Pseudo header
-    sum += (src_ip >> 16) & 0xFFFF;
-    sum += src_ip & 0xFFFF;
-    sum += (dest_ip >> 16) & 0xFFFF;
-    sum += dest_ip & 0xFFFF;
-    sum += __builtin_bswap16(IP_PROTOCOL_TCP);
-    sum += __builtin_bswap16(len);
+int tcp_set_congestion(tcp_connection_t *conn, const char *name) {
+    const tcp_cong_ops_t *ops = tcp_cong_find(name);
+    if (!conn || !ops) {
+        return NET_INVALID_PARAM;
+    }
 
-    // TCP header and data
-    ptr = (uint16_t *)header;
-    for (size_t i = 0; i < len / 2; i++) {
-        sum += ptr[i];
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    conn->cong = ops;
+    if (conn->state != TCP_CLOSED && conn->state != TCP_LISTEN &&
+        conn->state != TCP_SYN_SENT && conn->state != TCP_SYN_RECEIVED && ops->init) {
+        ops->init(conn);   // Switching mid-connection keeps cwnd, resets private state
     }
+    spin_unlock_irqrestore(&conn->lock, flags);
+
+    return NET_SUCCESS;
+}
+
+int tcp_get_info(tcp_info_t *info, int max) {
+    int count = 0;
+
+    // The all-connections list only ever grows at the head, so it can be
+    // walked without the table lock
+    tcp_connection_t *conn = __atomic_load_n(&tcp_all_list, __ATOMIC_ACQUIRE);
+    for (; conn && count < max; conn = conn->all_next) {
+        if (!__atomic_load_n(&conn->active, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
 
-    // Handle odd byte
-    if (len & 1) {
-        sum += ((uint8_t *)header)[len - 1] << 8;
+        uint64_t flags = spin_lock_irqsave(&conn->lock);
+        if (conn->active) {
+            tcp_info_t *out = &info[count++];
+            out->local_ip = conn->local_ip;
+            out->local_port = conn->local_port;
+            out->remote_ip = conn->remote_ip;
+            out->remote_port = conn->remote_port;
+            out->state = conn->state;
+            out->cong = conn->cong ? conn->cong->name : "none";
+            out->cwnd = conn->cwnd;
+            out->ssthresh = conn->ssthresh;
+            out->snd_wnd = conn->snd_wnd;
+            out->in_flight = conn->snd_max - conn->snd_una;
+            out->mss = conn->mss;
+            out->srtt_ms = (uint32_t)((conn->srtt >> 3) * 1000 / TIMER_FREQUENCY_HZ);
+            out->rttvar_ms = (uint32_t)((conn->rttvar >> 2) * 1000 / TIMER_FREQUENCY_HZ);
+            out->rto_ms = (uint32_t)((uint64_t)conn->rto * 1000 / TIMER_FREQUENCY_HZ);
+            out->retransmits = conn->retransmits;
+            out->fast_retransmits = conn->fast_retransmits;
+            out->timeouts = conn->timeouts;
+            out->gso_segments = conn->gso_segments;
+            out->gro_segments = conn->gro_segments;
+            out->in_recovery = conn->in_recovery;
+            out->sack = conn->sack_ok;
+        }
+        spin_unlock_irqrestore(&conn->lock, flags);
     }
 
-    // Add carry
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    return count;
+}
+
+int tcp_connection_count(void) {
+    return (int)__atomic_load_n(&tcp_live, __ATOMIC_RELAXED);
+}
+
+const char *tcp_state_name(tcp_state_t state) {
+    switch (state) {
+        case TCP_CLOSED:       return "CLOSED";
+        case TCP_LISTEN:       return "LISTEN";
+        case TCP_SYN_SENT:     return "SYN_SENT";
+        case TCP_SYN_RECEIVED: return "SYN_RECV";
+        case TCP_ESTABLISHED:  return "ESTABLISHED";
+        case TCP_FIN_WAIT_1:   return "FIN_WAIT1";
+        case TCP_FIN_WAIT_2:   return "FIN_WAIT2";
+        case TCP_CLOSE_WAIT:   return "CLOSE_WAIT";
+        case TCP_CLOSING:      return "CLOSING";
+        case TCP_LAST_ACK:     return "LAST_ACK";
+        case TCP_TIME_WAIT:    return "TIME_WAIT";
     }
+    return "?";
+}
 
-    return ~sum;
+uint16_t tcp_checksum(tcp_header_t *header, uint32_t src_ip, uint32_t dest_ip, size_t len) {
+    // Pseudo header, then TCP header and data
+    uint32_t sum = ip_pseudo_header_sum(src_ip, dest_ip, IP_PROTOCOL_TCP, len);
+    return csum_fold(csum_partial(header, len, sum));
 }
@@ -6,12 +6,80 @@
 #include <stdbool.h>
 #include "network.h"
 #include "ip.h"
+#include "../sched/spinlock.h"
+#include "../sched/workqueue.h"
+#include "../sched/waitqueue.h"
+#include "../timer/ktimer.h"
+#include "tcp_cong.h"
 
 // TCP constants
 #define TCP_HEADER_LEN 20
 #define TCP_MAX_PAYLOAD (IP_PACKET_SIZE - IP_HEADER_LEN - TCP_HEADER_LEN)
 #define TCP_WINDOW_SIZE 65535
 #define TCP_MSS 1460
+#define TCP_DEFAULT_MSS 536         // Assumed when the peer sends no MSS option
+
+// Per-connection buffer sizes (powers of two). The receive buffer size sets
+// the window scale we offer, so 256 KiB advertises with a shift of 3.
+#ifndef TCP_SND_BUF_SIZE
+#define TCP_SND_BUF_SIZE (256 * 1024)
+#endif
+#ifndef TCP_RCV_BUF_SIZE
+#define TCP_RCV_BUF_SIZE (256 * 1024)
+#endif
+
+#if (TCP_SND_BUF_SIZE & (TCP_SND_BUF_SIZE - 1)) || (TCP_RCV_BUF_SIZE & (TCP_RCV_BUF_SIZE - 1))
+#error "TCP buffer sizes must be powers of two"
+#endif
+
+// Connection table limits. Connections are allocated on demand; the
+// established-flow hash starts small and doubles as the table fills.
+#ifndef TCP_MAX_CONNECTIONS
+#define TCP_MAX_CONNECTIONS 65536
+#endif
+#define TCP_HASH_MIN_SIZE 256       // Buckets in the initial 4-tuple hash
+#define TCP_LISTEN_HASH_SIZE 64     // Buckets for listeners, keyed by port
+
+// Listen backlog: sizes both the SYN queue (handshakes in progress) and the
+// accept queue (established, waiting for accept). SYNs past a full SYN
+// queue are answered with SYN cookies instead of being dropped.
+#define TCP_DEFAULT_BACKLOG 16
+#define TCP_MAX_BACKLOG 1024
+
+// Out-of-order ranges held in the receive buffer past rcv_nxt
+#define TCP_OOO_MAX 4
+
+// SACK blocks: most an option can carry, and how many the sender remembers
+#define TCP_SACK_BLOCKS 4
+#define TCP_SACK_MAX 8
+
+// Segmentation and receive coalescing. Output builds up to
+// TCP_GSO_MAX_SEGS MSS-sized segments per pass and sends them as one burst;
+// input takes runs of up to TCP_GRO_MAX_SEGS consecutive segments of one
+// flow under a single lookup and lock, answering them with one ACK.
+#define TCP_GSO_MAX_SEGS 16
+#define TCP_GRO_MAX_SEGS 16
+
+// Duplicate ACKs that trigger fast retransmit
+#define TCP_DUPACK_THRESHOLD 3
+
+// Retransmission timeout bounds (RFC 6298), in milliseconds
+#define TCP_RTO_INITIAL_MS 1000
+#define TCP_RTO_MIN_MS 200
+#define TCP_RTO_MAX_MS 60000
+#define TCP_MAX_RETRIES 8           // Timeouts in a row before the connection is reset
+
+// How long a closed connection lingers in TIME-WAIT
+#define TCP_TIME_WAIT_MS 2000
+
+// TCP options
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WSCALE 3
+#define TCP_OPT_SACK_PERMITTED 4
+#define TCP_OPT_SACK 5
+#define TCP_MAX_WSCALE 14
 
 // TCP flags
 #define TCP_FLAG_FIN 0x01
@@ -55,6 +123,15 @@ typedef struct tcp_packet {
     uint8_t payload[TCP_MAX_PAYLOAD];
 } tcp_packet_t;
 
+// Byte ring backing the send and receive buffers. head and tail run freely
+// and are masked on access, so head - tail is the fill level.
+typedef struct tcp_ring {
+    uint8_t *data;
+    uint32_t size;                  // Power of two
+    uint32_t head;                  // Write position
+    uint32_t tail;                  // Read position
+} tcp_ring_t;
+
 // TCP connection structure
 typedef struct tcp_connection {
     uint32_t local_ip;
@@ -62,27 +139,195 @@ typedef struct tcp_connection {
     uint32_t remote_ip;
     uint16_t remote_port;
     tcp_state_t state;
-    uint32_t seq_num;
-    uint32_t ack_num;
-    uint16_t window_size;
     bool active;
-    
+    network_interface_t *iface;     // Interface the connection runs over
+    spinlock_t lock;
+
+    // Send sequence space (RFC 793 names)
+    uint32_t iss;
+    uint32_t snd_una;               // Oldest unacknowledged sequence number
+    uint32_t snd_nxt;               // Next sequence number to send
+    uint32_t snd_max;               // Highest sequence number sent so far
+    uint32_t snd_wnd;               // Peer's receive window, already scaled
+    uint32_t snd_wl1;               // Segment seq/ack of the last window update
+    uint32_t snd_wl2;
+    uint32_t snd_buf_seq;           // Sequence number of the byte at snd_buf.tail
+    uint16_t mss;                   // Largest segment we send
+    uint8_t snd_wscale;             // Shift applied to the peer's window
+    bool wscale_ok;                 // Window scaling offered / negotiated
+
+    // Receive sequence space
+    uint32_t irs;
+    uint32_t rcv_nxt;               // Next sequence number expected
+    uint32_t rcv_adv;               // Right edge of the last window advertised
+    uint8_t rcv_wscale;             // Shift applied to the window we advertise
+
+    // Unacknowledged and unsent data / in-order data not yet read. The
+    // retransmission queue is the send ring between snd_una and snd_max.
+    tcp_ring_t snd_buf;
+    tcp_ring_t rcv_buf;
+
+    // Out-of-order data already copied into rcv_buf past rcv_nxt
+    struct {
+        uint32_t start;
+        uint32_t end;
+    } ooo[TCP_OOO_MAX];
+    int ooo_count;
+
+    // Round-trip estimation (Jacobson/Karels), in ticks. srtt is scaled by 8
+    // and rttvar by 4; one segment is timed at a time (Karn's algorithm).
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t rtt_seq;
+    uint64_t rtt_start;
+    bool rtt_active;
+    uint8_t retries;                // Consecutive timeouts
+    uint32_t retransmits;           // Segments resent over the connection's life
+    uint32_t fast_retransmits;      // Recoveries entered on duplicate ACKs
+    uint32_t timeouts;              // Retransmission timeouts
+    uint32_t gso_bursts;            // Multi-segment sends
+    uint32_t gso_segments;          // Segments sent in them
+    uint32_t gro_runs;              // Receive runs of more than one segment
+    uint32_t gro_segments;          // Segments that arrived in them
+
+    // Congestion control (RFC 5681, NewReno recovery per RFC 6582, SACK
+    // recovery per RFC 6675). The algorithm decides backoff and growth.
+    const tcp_cong_ops_t *cong;
+    tcp_cong_priv_t cc;             // Algorithm private state
+    uint32_t cwnd;                  // Congestion window, bytes
+    uint32_t ssthresh;
+    uint32_t bytes_acked;           // Byte counter for window growth
+    uint32_t recover;               // snd_max when recovery began
+    uint32_t rexmit_nxt;            // Next byte to consider resending in SACK recovery
+    uint8_t dupacks;
+    bool in_recovery;
+    bool sack_ok;                   // SACK offered / negotiated
+
+    // Peer's SACK blocks above snd_una, sorted and merged
+    struct {
+        uint32_t start;
+        uint32_t end;
+    } sack[TCP_SACK_MAX];
+    int sack_count;
+
+    ktimer_t timer;                 // Retransmit, zero-window probe or TIME-WAIT
+    work_t timer_work;              // Timer expiry, handled outside IRQ context
+
+    bool fin_queued;                // Application closed; FIN follows the data
+    bool orphaned;                  // Application no longer holds the connection
+    bool owned;                     // Held by the application until tcp_close()
+    bool rx_batch;                  // Inside a receive run: output waits for its end
+    bool rx_ack_pending;            // A segment of the run asked for an immediate ACK
+
+    // Table linkage, guarded by the table lock rather than conn->lock
+    struct tcp_connection *hash_next;   // 4-tuple or listener hash chain
+    struct tcp_connection *free_next;   // Free list
+    struct tcp_connection *all_next;    // Every connection ever allocated
+    bool hashed;
+    uint32_t generation;            // Bumped on every reuse of the object
+
+    // Listener side, guarded by the listener's lock
+    int backlog;
+    int syn_queued;                 // Children still in SYN_RECEIVED
+    int accept_count;
+    struct tcp_connection *accept_head;
+    struct tcp_connection *accept_tail;
+    wait_queue_t accept_wait;       // Threads blocked in tcp_accept()
+
+    // Child side. parent and parent_gen are written under the child's lock;
+    // the queue flags and accept_next belong to the parent's lock.
+    struct tcp_connection *parent;
+    uint32_t parent_gen;
+    bool in_syn_queue;
+    bool in_accept_queue;
+    struct tcp_connection *accept_next;
+
     // Callbacks
     void (*on_connect)(struct tcp_connection *conn);
     void (*on_data)(struct tcp_connection *conn, void *data, size_t len);
     void (*on_close)(struct tcp_connection *conn);
+
+    // Readiness hook for the socket layer: called with conn->lock held
+    // whenever tcp_poll() may have changed, so it must not call into TCP
+    void (*on_ready)(struct tcp_connection *conn, void *ctx);
+    void *ready_ctx;
 } tcp_connection_t;
 
+// tcp_poll() readiness bits
+#define TCP_POLL_READ  0x01         // Data buffered, end of file, or a connection to accept
+#define TCP_POLL_WRITE 0x02         // Room in the send buffer
+#define TCP_POLL_HUP   0x04         // Closed or reset
+
+// Snapshot of one connection for diagnostics
+typedef struct tcp_info {
+    uint32_t local_ip;
+    uint16_t local_port;
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    tcp_state_t state;
+    const char *cong;               // Congestion control algorithm
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t snd_wnd;
+    uint32_t in_flight;
+    uint16_t mss;
+    uint32_t srtt_ms;
+    uint32_t rttvar_ms;
+    uint32_t rto_ms;
+    uint32_t retransmits;
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+    uint32_t gso_segments;
+    uint32_t gro_segments;
+    bool in_recovery;
+    bool sack;
+} tcp_info_t;
+
 // Function prototypes
 int tcp_init(void);
 int tcp_send_packet(network_interface_t *iface, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port, 
                    uint32_t seq, uint32_t ack, uint8_t flags, void *payload, size_t payload_len);
-void tcp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, tcp_packet_t *packet);
+void tcp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, tcp_packet_t *packet, size_t len);
+
+// One received segment of a burst; 'packet' points at the TCP header
+typedef struct tcp_rx {
+    uint32_t src_ip;
+    uint32_t dest_ip;
+    tcp_packet_t *packet;
+    size_t len;
+} tcp_rx_t;
+
+// Process a burst of segments in arrival order, coalescing runs of the same
+// flow (see TCP_GRO_MAX_SEGS)
+void tcp_process_burst(network_interface_t *iface, tcp_rx_t *segs, int n);
 tcp_connection_t *tcp_create_connection(void);
 int tcp_connect(tcp_connection_t *conn, uint32_t remote_ip, uint16_t remote_port);
-int tcp_listen(uint16_t port);
+// Turn an unconnected connection into a listener on 'port' (any local
+// address) with room for 'backlog' pending connections
+int tcp_listen(tcp_connection_t *conn, uint16_t port, int backlog);
+// Take an established connection off a listener's accept queue, waiting for
+// one if 'block' is set. Returns NULL if none is ready or the listener closed.
+tcp_connection_t *tcp_accept(tcp_connection_t *listener, bool block);
+// Queue data on the send buffer and push what the window allows. Returns the
+// number of bytes accepted (possibly fewer than len), or a NET_* error.
 int tcp_send(tcp_connection_t *conn, void *data, size_t len);
+// Copy in-order received data out of the receive buffer. Returns the number
+// of bytes read, 0 if none are buffered, or a NET_* error.
+int tcp_recv(tcp_connection_t *conn, void *buf, size_t len);
 void tcp_close(tcp_connection_t *conn);
+// Readiness of a connection, TCP_POLL_* bits
+uint32_t tcp_poll(tcp_connection_t *conn);
+// Install the on_ready hook (NULL to remove)
+void tcp_set_ready_hook(tcp_connection_t *conn, void (*fn)(struct tcp_connection *, void *), void *ctx);
+// Pick the congestion control algorithm for one connection. Returns
+// NET_SUCCESS, or NET_INVALID_PARAM if the name is unknown.
+int tcp_set_congestion(tcp_connection_t *conn, const char *name);
+// Fill up to 'max' entries with the live connections. Returns how many.
+int tcp_get_info(tcp_info_t *info, int max);
+// Number of live connections, listeners included
+int tcp_connection_count(void);
+const char *tcp_state_name(tcp_state_t state);
 uint16_t tcp_checksum(tcp_header_t *header, uint32_t src_ip, uint32_t dest_ip, size_t len);
 
 #endif // TCP_H
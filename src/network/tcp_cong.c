@@ -0,0 +1,103 @@
+#include "tcp_cong.h"
+#include "tcp.h"
+
+static const tcp_cong_ops_t *const algorithms[] = {
+    &tcp_newreno_ops,
+    &tcp_cubic_ops,
+};
+
+#define NUM_ALGORITHMS ((int)(sizeof(algorithms) / sizeof(algorithms[0])))
+
+static const tcp_cong_ops_t *default_ops = NULL;
+
+static bool name_equal(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+const tcp_cong_ops_t *tcp_cong_find(const char *name) {
+    if (!name) {
+        return NULL;
+    }
+    for (int i = 0; i < NUM_ALGORITHMS; i++) {
+        if (name_equal(algorithms[i]->name, name)) {
+            return algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+const tcp_cong_ops_t *tcp_cong_get(int index) {
+    if (index < 0 || index >= NUM_ALGORITHMS) {
+        return NULL;
+    }
+    return algorithms[index];
+}
+
+const tcp_cong_ops_t *tcp_cong_default(void) {
+    const tcp_cong_ops_t *ops = __atomic_load_n(&default_ops, __ATOMIC_ACQUIRE);
+    if (!ops) {
+        ops = tcp_cong_find(TCP_CONG_DEFAULT);
+    }
+    return ops ? ops : &tcp_newreno_ops;
+}
+
+int tcp_cong_set_default(const char *name) {
+    const tcp_cong_ops_t *ops = tcp_cong_find(name);
+    if (!ops) {
+        return -1;
+    }
+    __atomic_store_n(&default_ops, ops, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint32_t tcp_flight_size(const tcp_connection_t *conn) {
+    return conn->snd_max - conn->snd_una;
+}
+
+uint32_t tcp_slow_start(tcp_connection_t *conn, uint32_t acked) {
+    uint32_t limit = 2u * conn->mss;
+    uint32_t grow = acked < limit ? acked : limit;
+
+    if (conn->cwnd + grow > conn->ssthresh) {
+        grow = conn->ssthresh > conn->cwnd ? conn->ssthresh - conn->cwnd : 0;
+    }
+    conn->cwnd += grow;
+    return acked - grow;
+}
+
+void tcp_cong_avoid_reno(tcp_connection_t *conn, uint32_t acked) {
+    conn->bytes_acked += acked;
+    if (conn->bytes_acked >= conn->cwnd) {
+        conn->bytes_acked -= conn->cwnd;
+        conn->cwnd += conn->mss;
+    }
+}
+
+// NewReno (RFC 5681 / RFC 6582). The recovery mechanics themselves live in
+// tcp.c since every algorithm shares them.
+
+static uint32_t newreno_ssthresh(tcp_connection_t *conn) {
+    uint32_t half = tcp_flight_size(conn) / 2;
+    return half > 2u * conn->mss ? half : 2u * conn->mss;
+}
+
+static void newreno_cong_avoid(tcp_connection_t *conn, uint32_t acked) {
+    if (conn->cwnd < conn->ssthresh) {
+        acked = tcp_slow_start(conn, acked);
+        if (acked == 0) {
+            return;
+        }
+    }
+    tcp_cong_avoid_reno(conn, acked);
+}
+
+const tcp_cong_ops_t tcp_newreno_ops = {
+    .name = "newreno",
+    .init = NULL,
+    .ssthresh = newreno_ssthresh,
+    .cong_avoid = newreno_cong_avoid,
+};
@@ -0,0 +1,74 @@
+#ifndef TCP_CONG_H
+#define TCP_CONG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Pluggable TCP congestion control. The stack owns loss detection and
+// recovery (slow start threshold, fast retransmit/fast recovery, SACK); an
+// algorithm decides how far the window backs off and how it grows again.
+
+struct tcp_connection;
+
+// Algorithm picked for new connections unless told otherwise
+#ifndef TCP_CONG_DEFAULT
+#define TCP_CONG_DEFAULT "newreno"
+#endif
+
+#define TCP_INFINITE_SSTHRESH 0x7FFFFFFF
+
+// CUBIC (RFC 8312) per-connection state
+typedef struct tcp_cubic {
+    uint32_t w_max;                 // cwnd (bytes) before the last reduction
+    uint32_t w_last_max;            // Previous w_max, for fast convergence
+    uint32_t w_est;                 // Reno-friendly estimate, bytes
+    uint32_t k_ms;                  // Time for the cubic to climb back to w_max
+    uint64_t epoch_start;           // Tick the current growth epoch began, 0 = none
+} tcp_cubic_t;
+
+// Private state, one member per algorithm that needs any
+typedef union tcp_cong_priv {
+    tcp_cubic_t cubic;
+} tcp_cong_priv_t;
+
+typedef struct tcp_cong_ops {
+    const char *name;
+
+    // Optional: set up private state when the connection is established
+    void (*init)(struct tcp_connection *conn);
+
+    // New slow start threshold after a loss (fast retransmit or timeout)
+    uint32_t (*ssthresh)(struct tcp_connection *conn);
+
+    // Grow cwnd for 'acked' newly acknowledged bytes outside recovery
+    void (*cong_avoid)(struct tcp_connection *conn, uint32_t acked);
+} tcp_cong_ops_t;
+
+extern const tcp_cong_ops_t tcp_newreno_ops;
+extern const tcp_cong_ops_t tcp_cubic_ops;
+
+// Look up an algorithm by name. Returns NULL if unknown.
+const tcp_cong_ops_t *tcp_cong_find(const char *name);
+
+// Algorithm at 'index' in the registry, NULL past the end (for listing)
+const tcp_cong_ops_t *tcp_cong_get(int index);
+
+const tcp_cong_ops_t *tcp_cong_default(void);
+
+// Change the algorithm new connections start with. Returns 0, or -1 if unknown.
+int tcp_cong_set_default(const char *name);
+
+// Shared building blocks for algorithms
+
+// Slow start (RFC 5681 with RFC 3465 byte counting, L = 2*MSS). Returns the
+// part of 'acked' left over once cwnd reaches ssthresh.
+uint32_t tcp_slow_start(struct tcp_connection *conn, uint32_t acked);
+
+// Reno congestion avoidance: one MSS per window of acknowledged bytes
+void tcp_cong_avoid_reno(struct tcp_connection *conn, uint32_t acked);
+
+// Data sent but not yet acknowledged
+uint32_t tcp_flight_size(const struct tcp_connection *conn);
+
+#endif // TCP_CONG_H
@@ -0,0 +1,131 @@
+#include "tcp_cong.h"
+#include "tcp.h"
+#include "../timer/timer.h"
+
+// CUBIC (RFC 8312). Window growth is a cubic function of the time since the
+// last reduction, centred on the window at which that loss happened, so it
+// probes gently near the old maximum and quickly away from it. Fixed point
+// throughout: C = 0.4, beta = 0.7, time in milliseconds.
+
+#define CUBIC_BETA_NUM      7       // beta = 7/10
+#define CUBIC_BETA_DEN      10
+#define CUBIC_MAX_DELTA_MS  100000  // Clamp |t - K| so the cube can't overflow
+
+static uint32_t ticks_to_ms(uint64_t ticks) {
+    return (uint32_t)(ticks * 1000 / TIMER_FREQUENCY_HZ);
+}
+
+// Integer cube root, bit by bit
+static uint64_t cubic_root(uint64_t x) {
+    uint64_t y = 0;
+    for (int s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        uint64_t b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+    return y;
+}
+
+static void cubic_init(tcp_connection_t *conn) {
+    tcp_cubic_t *ca = &conn->cc.cubic;
+    ca->w_max = 0;
+    ca->w_last_max = 0;
+    ca->w_est = 0;
+    ca->k_ms = 0;
+    ca->epoch_start = 0;
+}
+
+static uint32_t cubic_ssthresh(tcp_connection_t *conn) {
+    tcp_cubic_t *ca = &conn->cc.cubic;
+    uint32_t cwnd = conn->cwnd;
+
+    // Fast convergence: losing below the previous maximum means another flow
+    // wants bandwidth, so give some up by aiming lower
+    if (cwnd < ca->w_last_max) {
+        ca->w_last_max = cwnd;
+        ca->w_max = (uint32_t)((uint64_t)cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN));
+    } else {
+        ca->w_last_max = cwnd;
+        ca->w_max = cwnd;
+    }
+    ca->epoch_start = 0;
+
+    uint32_t ssthresh = (uint32_t)((uint64_t)cwnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN);
+    return ssthresh > 2u * conn->mss ? ssthresh : 2u * conn->mss;
+}
+
+static void cubic_cong_avoid(tcp_connection_t *conn, uint32_t acked) {
+    tcp_cubic_t *ca = &conn->cc.cubic;
+
+    if (conn->cwnd < conn->ssthresh) {
+        acked = tcp_slow_start(conn, acked);
+        if (acked == 0) {
+            return;
+        }
+    }
+
+    uint64_t now = timer_get_ticks();
+    if (ca->epoch_start == 0) {
+        ca->epoch_start = now ? now : 1;
+        if (conn->cwnd < ca->w_max) {
+            // K = cbrt((W_max - cwnd) / C), in segments and seconds
+            uint64_t diff = ca->w_max - conn->cwnd;
+            ca->k_ms = (uint32_t)cubic_root(diff * 2500000000ULL / conn->mss);
+        } else {
+            ca->k_ms = 0;
+            ca->w_max = conn->cwnd;
+        }
+        ca->w_est = conn->cwnd;
+    }
+
+    // Where the cubic says cwnd should be one RTT from now
+    int64_t t = (int64_t)ticks_to_ms(now - ca->epoch_start) + ticks_to_ms(conn->srtt >> 3);
+    int64_t d = t - ca->k_ms;
+    uint64_t ad = d < 0 ? -d : d;
+    if (ad > CUBIC_MAX_DELTA_MS) {
+        ad = CUBIC_MAX_DELTA_MS;
+    }
+    // C * d^3 in units of MSS/1024: 0.4 * 1024 / 10^9 ms^3 per second^3
+    uint64_t offset = ad * ad * ad * 4096 / 10000000000ULL;
+    uint64_t delta = (offset * conn->mss) >> 10;
+
+    uint64_t target;
+    if (d >= 0) {
+        target = ca->w_max + delta;
+    } else {
+        target = delta < ca->w_max ? ca->w_max - delta : conn->mss;
+    }
+
+    // TCP-friendly region: never grow slower than Reno would
+    // (3 * (1 - beta) / (1 + beta) = 9/17 segments per RTT)
+    ca->w_est += (uint32_t)((uint64_t)acked * conn->mss * 9 / (17 * (uint64_t)conn->cwnd));
+    if (target < ca->w_est) {
+        target = ca->w_est;
+    }
+
+    if (target > conn->cwnd) {
+        // Spread the step over the window's ACKs, at most 1.5x per RTT
+        uint64_t inc = (target - conn->cwnd) * acked / conn->cwnd;
+        if (inc > acked / 2) {
+            inc = acked / 2;
+        }
+        conn->cwnd += (uint32_t)inc;
+    } else {
+        // Plateau near W_max: creep up by one MSS per 100 windows
+        conn->bytes_acked += acked;
+        if (conn->bytes_acked >= 100ULL * conn->cwnd) {
+            conn->bytes_acked = 0;
+            conn->cwnd += conn->mss;
+        }
+    }
+}
+
+const tcp_cong_ops_t tcp_cubic_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .ssthresh = cubic_ssthresh,
+    .cong_avoid = cubic_cong_avoid,
+};
@@ -1,23 +1,50 @@
 #include "udp.h"
 #include "ip.h"
+#include "checksum.h"
 #include "dhcp.h"
+#include "inet_hash.h"
 #include "../memory/memory.h"
 #include "../debug/debug.h"
+#include "../timer/timer.h"
+#include "../sched/spinlock.h"
+
+// Sockets are allocated on demand and recycled through a free list rather
+// than freed, so a callback racing udp_close() never touches freed memory.
+// Bound sockets are found through a hash on the local port.
+static spinlock_t udp_table_lock = SPINLOCK_INIT_NAMED("udp_table");
+static udp_socket_t *udp_port_hash[UDP_HASH_SIZE];
+static udp_socket_t *udp_free_list;
+static uint32_t udp_hash_seed;
+
+static uint32_t udp_port_bucket(uint16_t port) {
+    return inet_hash_port(port, udp_hash_seed) & (UDP_HASH_SIZE - 1);
+}
 
-static udp_socket_t sockets[MAX_SOCKETS];
-static int socket_count = 0;
+// Table lock held
+static udp_socket_t *udp_find_bound(uint16_t port) {
+    for (udp_socket_t *s = udp_port_hash[udp_port_bucket(port)]; s; s = s->hash_next) {
+        if (s->local_port == port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Table lock held
+static void udp_unhash(udp_socket_t *socket) {
+    udp_socket_t **pp = &udp_port_hash[udp_port_bucket(socket->local_port)];
+    while (*pp && *pp != socket) {
+        pp = &(*pp)->hash_next;
+    }
+    if (*pp) {
+        *pp = socket->hash_next;
+    }
+    socket->hash_next = NULL;
+}
 
 int udp_init(void) {
-    // Initialize sockets
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        sockets[i].local_port = 0;
-        sockets[i].remote_ip = 0;
-        sockets[i].remote_port = 0;
-        sockets[i].bound = false;
-        sockets[i].connected = false;
-        sockets[i].receive_callback = NULL;
-    }
-    socket_count = 0;
+    uint64_t now = timer_get_ns();
+    udp_hash_seed = inet_hash_mix((uint32_t)now ^ (uint32_t)(now >> 32) ^ 0x27D4EB2F);
     return NET_SUCCESS;
 }
 
@@ -30,22 +57,48 @@ int udp_send_packet(network_interface_t *iface, uint32_t dest_ip, uint16_t src_p
         return NET_ERROR;
     }
 
-    udp_packet_t packet;
-    
-    // Build UDP header
-    packet.header.src_port = __builtin_bswap16(src_port);
-    packet.header.dest_port = __builtin_bswap16(dest_port);
-    packet.header.length = __builtin_bswap16(UDP_HEADER_LEN + payload_len);
-    packet.header.checksum = 0; // Optional for IPv4
+    // The one copy: payload straight into the buffer the NIC will DMA from,
+    // with room in front for every header below
+    pbuf_t *p = pbuf_alloc_tx();
+    if (!p) {
+        return NET_BUFFER_FULL;
+    }
 
-    // Copy payload
-    memcpy(packet.payload, payload, payload_len);
+    // Without offload, sum the payload on the way in rather than re-reading it
+    bool offload = (iface->features & NETIF_F_TX_L4_CSUM) != 0;
+    uint32_t payload_sum = 0;
+    if (offload) {
+        memcpy(pbuf_put(p, payload_len), payload, payload_len);
+    } else {
+        payload_sum = csum_partial_copy(payload, pbuf_put(p, payload_len), payload_len, 0);
+    }
 
-    // Calculate checksum (optional but recommended)
-    packet.header.checksum = udp_checksum(&packet.header, iface->ip_address, dest_ip, UDP_HEADER_LEN + payload_len);
+    udp_header_t *header = pbuf_push(p, UDP_HEADER_LEN);
+    
+    // Build UDP header
+    header->src_port = __builtin_bswap16(src_port);
+    header->dest_port = __builtin_bswap16(dest_port);
+    header->length = __builtin_bswap16(UDP_HEADER_LEN + payload_len);
+    header->checksum = 0; // Optional for IPv4
+
+    // Calculate checksum (optional but recommended), or seed it with the
+    // pseudo header for the NIC
+    uint32_t sum = ip_pseudo_header_sum(iface->ip_address, dest_ip, IP_PROTOCOL_UDP,
+                                        UDP_HEADER_LEN + payload_len);
+    if (offload) {
+        header->checksum = (uint16_t)sum;
+        p->csum_flags |= PBUF_TX_CSUM_UDP;
+        p->l4_header = (uint8_t *)header;
+    } else {
+        sum = csum_add(sum, payload_sum);
+        header->checksum = csum_fold(csum_partial(header, UDP_HEADER_LEN, sum));
+        if (header->checksum == 0) {
+            header->checksum = 0xFFFF; // Zero would mean "no checksum"
+        }
+    }
 
     // Send via IP layer
-    return ip_send_packet(iface, dest_ip, IP_PROTOCOL_UDP, &packet, UDP_HEADER_LEN + payload_len);
+    return ip_send_pbuf(iface, dest_ip, IP_PROTOCOL_UDP, p);
 }
 
 void udp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t dest_ip, udp_packet_t *packet) {
@@ -81,32 +134,46 @@ void udp_process_packet(network_interface_t *iface, uint32_t src_ip, uint32_t de
         return;
     }
 
-    // Find socket listening on destination port
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        udp_socket_t *socket = &sockets[i];
-        if (socket->bound && socket->local_port == dest_port) {
-            if (socket->receive_callback) {
-                socket->receive_callback(socket, packet->payload, payload_len, src_ip, src_port);
-            }
-            break;
-        }
+    // Find socket listening on destination port; call it unlocked so it
+    // may send a reply
+    udp_socket_t *socket = NULL;
+    void (*callback)(struct udp_socket *, void *, size_t, uint32_t, uint16_t) = NULL;
+    uint64_t flags = spin_lock_irqsave(&udp_table_lock);
+    socket = udp_find_bound(dest_port);
+    if (socket) {
+        callback = socket->receive_callback;
+    }
+    spin_unlock_irqrestore(&udp_table_lock, flags);
+
+    if (callback) {
+        callback(socket, packet->payload, payload_len, src_ip, src_port);
     }
 }
 
 udp_socket_t *udp_create_socket(void) {
-    if (socket_count >= MAX_SOCKETS) {
-        return NULL;
+    uint64_t flags = spin_lock_irqsave(&udp_table_lock);
+    udp_socket_t *socket = udp_free_list;
+    if (socket) {
+        udp_free_list = socket->free_next;
+    }
+    spin_unlock_irqrestore(&udp_table_lock, flags);
+
+    if (!socket) {
+        socket = kmalloc(sizeof(*socket));
+        if (!socket) {
+            return NULL;
+        }
     }
 
-    udp_socket_t *socket = &sockets[socket_count];
-    socket_count++;
-    
     socket->local_port = 0;
     socket->remote_ip = 0;
     socket->remote_port = 0;
     socket->bound = false;
     socket->connected = false;
     socket->receive_callback = NULL;
+    socket->context = NULL;
+    socket->hash_next = NULL;
+    socket->free_next = NULL;
 
     return socket;
 }
@@ -116,15 +183,18 @@ int udp_bind(udp_socket_t *socket, uint16_t port) {
         return NET_INVALID_PARAM;
     }
 
-    // Check if port is already in use
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (sockets[i].bound && sockets[i].local_port == port) {
-            return NET_ERROR; // Port already in use
-        }
+    uint64_t flags = spin_lock_irqsave(&udp_table_lock);
+    if (socket->bound || udp_find_bound(port)) {
+        spin_unlock_irqrestore(&udp_table_lock, flags);
+        return NET_ERROR; // Port already in use
     }
 
     socket->local_port = port;
     socket->bound = true;
+    uint32_t b = udp_port_bucket(port);
+    socket->hash_next = udp_port_hash[b];
+    udp_port_hash[b] = socket;
+    spin_unlock_irqrestore(&udp_table_lock, flags);
 
     return NET_SUCCESS;
 }
@@ -164,43 +234,27 @@ int udp_sendto(udp_socket_t *socket, void *data, size_t len, uint32_t dest_ip, u
 }
 
 void udp_close(udp_socket_t *socket) {
-    if (socket) {
-        socket->bound = false;
-        socket->connected = false;
-        socket->local_port = 0;
-        socket->remote_ip = 0;
-        socket->remote_port = 0;
-        socket->receive_callback = NULL;
-    }
-}
-
-uint16_t udp_checksum(udp_header_t *header, uint32_t src_ip, uint32_t dest_ip, size_t len) {
-    uint32_t sum = 0;
-    uint16_t *ptr;
-
-    // Pseudo header
-    sum += (src_ip >> 16) & 0xFFFF;
-    sum += src_ip & 0xFFFF;
-    sum += (dest_ip >> 16) & 0xFFFF;
-    sum += dest_ip & 0xFFFF;
-    sum += __builtin_bswap16(IP_PROTOCOL_UDP);
-    sum += __builtin_bswap16(len);
-
-    // UDP header and data
-    ptr = (uint16_t *)header;
-    for (size_t i = 0; i < len / 2; i++) {
-        sum += ptr[i];
-    }
-
-    // Handle odd byte
-    if (len & 1) {
-        sum += ((uint8_t *)header)[len - 1] << 8;
+    if (!socket) {
+        return;
     }
 
-    // Add carry
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    uint64_t flags = spin_lock_irqsave(&udp_table_lock);
+    if (socket->bound) {
+        udp_unhash(socket);
     }
+    socket->bound = false;
+    socket->connected = false;
+    socket->local_port = 0;
+    socket->remote_ip = 0;
+    socket->remote_port = 0;
+    socket->receive_callback = NULL;
+    socket->free_next = udp_free_list;
+    udp_free_list = socket;
+    spin_unlock_irqrestore(&udp_table_lock, flags);
+}
 
-    return ~sum;
+uint16_t udp_checksum(udp_header_t *header, uint32_t src_ip, uint32_t dest_ip, size_t len) {
+    // Pseudo header, then UDP header and data
+    uint32_t sum = ip_pseudo_header_sum(src_ip, dest_ip, IP_PROTOCOL_UDP, len);
+    return csum_fold(csum_partial(header, len, sum));
 }
@@ -11,6 +11,9 @@
 #define UDP_HEADER_LEN 8
 #define UDP_MAX_PAYLOAD (IP_PACKET_SIZE - IP_HEADER_LEN - UDP_HEADER_LEN)
 
+// Buckets in the bound-port hash (power of two)
+#define UDP_HASH_SIZE 1024
+
 // UDP header
 typedef struct __attribute__((packed)) udp_header {
     uint16_t src_port;
@@ -33,6 +36,9 @@ typedef struct udp_socket {
     bool bound;
     bool connected;
     void (*receive_callback)(struct udp_socket *socket, void *data, size_t len, uint32_t src_ip, uint16_t src_port);
+    void *context;                  // Owner's pointer, for receive_callback
+    struct udp_socket *hash_next;   // Port hash chain, under the table lock
+    struct udp_socket *free_next;   // Free list
 } udp_socket_t;
 
 // Function prototypes
@@ -1,109 +1,250 @@
 #include "pci.h"
 #include "../memory/memory.h"
+#include "../memory/vmm.h"
 #include "../graphic/graphic.h"
 #include "../debug/debug.h"
+#include "../acpi/acpi.h"
+#include "../interrupt/lapic.h"
+#include "../smp/smp.h"
+#include "../sched/spinlock.h"
 
 static pci_device_t pci_devices[MAX_PCI_DEVICES];
 static int pci_device_count = 0;
 
+// ECAM window for segment 0, NULL if MCFG doesn't describe one. Each
+// function gets 4 KB at bus << 20 | device << 15 | function << 12.
+static volatile uint8_t *ecam_base;
+static uint8_t ecam_start_bus;
+static uint8_t ecam_end_bus;
+
+// The 0xCF8/0xCFC pair is one shared register window
+static spinlock_t pci_legacy_lock = SPINLOCK_INIT_NAMED("pci.cf8");
+
+// Buses already enumerated (guards against bridge loops)
+static uint8_t bus_scanned[256 / 8];
+
+static void pci_ecam_init(void) {
+    acpi_mcfg_t *mcfg = acpi_find_table("MCFG");
+    if (!mcfg) {
+        DEBUG_INFO("PCI: no MCFG table, using port I/O configuration access\n");
+        return;
+    }
+    
+    size_t count = (mcfg->header.length - sizeof(acpi_mcfg_t)) / sizeof(acpi_mcfg_entry_t);
+    for (size_t i = 0; i < count; i++) {
+        acpi_mcfg_entry_t *entry = &mcfg->entries[i];
+        if (entry->segment != 0 || entry->end_bus < entry->start_bus) {
+            continue;
+        }
+        
+        // Map only the buses the window covers (1 MB each)
+        uint64_t buses = (uint64_t)entry->end_bus - entry->start_bus + 1;
+        uint64_t phys = entry->base_address + ((uint64_t)entry->start_bus << 20);
+        volatile uint8_t *window = vmm_map_mmio(phys, buses << 20);
+        if (!window) {
+            DEBUG_WARN("PCI: failed to map ECAM window at 0x%lx\n", phys);
+            return;
+        }
+        
+        ecam_start_bus = entry->start_bus;
+        ecam_end_bus = entry->end_bus;
+        ecam_base = window - ((uint64_t)entry->start_bus << 20);
+        DEBUG_INFO("PCI: ECAM at 0x%lx, buses %u-%u\n",
+                   entry->base_address, ecam_start_bus, ecam_end_bus);
+        return;
+    }
+    DEBUG_INFO("PCI: MCFG has no segment 0 window, using port I/O\n");
+}
+
 void pci_init(void) {
     pci_device_count = 0;
+    pci_ecam_init();
     pci_scan_devices();
 }
 
-uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return inl(PCI_CONFIG_DATA);
+bool pci_ecam_enabled(void) {
+    return ecam_base != NULL;
 }
 
-uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return (inl(PCI_CONFIG_DATA) >> ((offset & 2) * 8)) & 0xFFFF;
+// ECAM address of a register, or NULL to use port I/O
+static inline volatile void *ecam_addr(uint8_t bus, uint8_t device, uint8_t function,
+                                       uint16_t offset) {
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus) {
+        return NULL;
+    }
+    return ecam_base + ((uint64_t)bus << 20) + ((uint64_t)(device & 0x1F) << 15) +
+           ((uint64_t)(function & 0x7) << 12) + (offset & 0xFFF);
 }
 
-uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return (inl(PCI_CONFIG_DATA) >> ((offset & 3) * 8)) & 0xFF;
+static inline uint32_t legacy_address(uint8_t bus, uint8_t device, uint8_t function,
+                                      uint16_t offset) {
+    return (1U << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
 }
 
-void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    outl(PCI_CONFIG_DATA, value);
+static uint32_t legacy_read32(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    if (offset >= PCI_CONFIG_SPACE_SIZE) {
+        return 0xFFFFFFFF;
+    }
+    uint64_t flags = spin_lock_irqsave(&pci_legacy_lock);
+    outl(PCI_CONFIG_ADDRESS, legacy_address(bus, device, function, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_legacy_lock, flags);
+    return value;
 }
 
-void pci_config_write16(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    uint32_t data = inl(PCI_CONFIG_DATA);
-    data &= ~(0xFFFF << ((offset & 2) * 8));
-    data |= value << ((offset & 2) * 8);
+// Read-modify-write of the dword holding 'offset' ('mask' selects the bytes)
+static void legacy_write(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset,
+                         uint32_t mask, uint32_t value) {
+    if (offset >= PCI_CONFIG_SPACE_SIZE) {
+        return;
+    }
+    uint32_t shift = (offset & 3) * 8;
+    uint64_t flags = spin_lock_irqsave(&pci_legacy_lock);
+    outl(PCI_CONFIG_ADDRESS, legacy_address(bus, device, function, offset));
+    uint32_t data = mask == 0xFFFFFFFF ? 0 : inl(PCI_CONFIG_DATA);
+    data = (data & ~(mask << shift)) | ((value & mask) << shift);
     outl(PCI_CONFIG_DATA, data);
+    spin_unlock_irqrestore(&pci_legacy_lock, flags);
 }
 
-void pci_config_write8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint8_t value) {
-    uint32_t address = (1 << 31) | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC);
-    outl(PCI_CONFIG_ADDRESS, address);
-    uint32_t data = inl(PCI_CONFIG_DATA);
-    data &= ~(0xFF << ((offset & 3) * 8));
-    data |= value << ((offset & 3) * 8);
-    outl(PCI_CONFIG_DATA, data);
+uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    volatile void *addr = ecam_addr(bus, device, function, offset & ~3);
+    if (addr) {
+        return *(volatile uint32_t *)addr;
+    }
+    return legacy_read32(bus, device, function, offset);
+}
+
+uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    volatile void *addr = ecam_addr(bus, device, function, offset & ~1);
+    if (addr) {
+        return *(volatile uint16_t *)addr;
+    }
+    return (legacy_read32(bus, device, function, offset) >> ((offset & 2) * 8)) & 0xFFFF;
+}
+
+uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    volatile void *addr = ecam_addr(bus, device, function, offset);
+    if (addr) {
+        return *(volatile uint8_t *)addr;
+    }
+    return (legacy_read32(bus, device, function, offset) >> ((offset & 3) * 8)) & 0xFF;
+}
+
+void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value) {
+    volatile void *addr = ecam_addr(bus, device, function, offset & ~3);
+    if (addr) {
+        *(volatile uint32_t *)addr = value;
+        return;
+    }
+    legacy_write(bus, device, function, offset & ~3, 0xFFFFFFFF, value);
+}
+
+void pci_config_write16(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint16_t value) {
+    volatile void *addr = ecam_addr(bus, device, function, offset & ~1);
+    if (addr) {
+        *(volatile uint16_t *)addr = value;
+        return;
+    }
+    legacy_write(bus, device, function, offset & ~1, 0xFFFF, value);
+}
+
+void pci_config_write8(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint8_t value) {
+    volatile void *addr = ecam_addr(bus, device, function, offset);
+    if (addr) {
+        *(volatile uint8_t *)addr = value;
+        return;
+    }
+    legacy_write(bus, device, function, offset, 0xFF, value);
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+// Record one function; descend into it if it is a PCI-to-PCI bridge
+static void pci_scan_function(uint8_t bus, uint8_t device, uint8_t function, uint16_t vendor_id) {
+    if (pci_device_count >= MAX_PCI_DEVICES) {
+        DEBUG_WARN("Maximum PCI devices reached (%d)\n", MAX_PCI_DEVICES);
+        return;
+    }
+    
+    pci_device_t *dev = &pci_devices[pci_device_count];
+    memset(dev, 0, sizeof(*dev));
+    dev->bus = bus;
+    dev->device = device;
+    dev->function = function;
+    dev->vendor_id = vendor_id;
+    dev->device_id = pci_config_read16(bus, device, function, PCI_DEVICE_ID);
+    dev->class_code = pci_config_read8(bus, device, function, PCI_CLASS_CODE);
+    dev->subclass = pci_config_read8(bus, device, function, PCI_SUBCLASS);
+    dev->prog_if = pci_config_read8(bus, device, function, PCI_PROG_IF);
+    dev->revision_id = pci_config_read8(bus, device, function, PCI_REVISION_ID);
+    dev->interrupt_line = pci_config_read8(bus, device, function, PCI_INTERRUPT_LINE);
+    dev->interrupt_pin = pci_config_read8(bus, device, function, PCI_INTERRUPT_PIN);
+    
+    uint8_t header_type = pci_config_read8(bus, device, function, PCI_HEADER_TYPE) &
+                          PCI_HEADER_TYPE_MASK;
+    
+    // Type 0 headers have six BARs, bridges two
+    int bars = header_type == PCI_HEADER_TYPE_BRIDGE ? 2 : 6;
+    for (int i = 0; i < bars; i++) {
+        dev->bar[i] = pci_config_read32(bus, device, function, PCI_BAR0 + i * 4);
+    }
+    
+    DEBUG_DEBUG("Found PCI device: %02x:%02x.%x - Vendor: %04x, Device: %04x, Class: %02x\n", 
+               bus, device, function, vendor_id, dev->device_id, dev->class_code);
+    
+    pci_device_count++;
+    
+    if (header_type == PCI_HEADER_TYPE_BRIDGE) {
+        uint8_t secondary = pci_config_read8(bus, device, function, PCI_SECONDARY_BUS);
+        if (secondary != 0) {
+            pci_scan_bus(secondary);
+        }
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    if (bus_scanned[bus / 8] & (1 << (bus % 8))) {
+        return;
+    }
+    bus_scanned[bus / 8] |= 1 << (bus % 8);
+    
+    for (int device = 0; device < 32; device++) {
+        uint16_t vendor_id = pci_config_read16(bus, device, 0, PCI_VENDOR_ID);
+        if (vendor_id == 0xFFFF) {
+            continue;
+        }
+        pci_scan_function(bus, device, 0, vendor_id);
+        
+        // Other functions exist only on multi-function devices
+        if (!(pci_config_read8(bus, device, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTI_FUNC)) {
+            continue;
+        }
+        for (int function = 1; function < 8; function++) {
+            vendor_id = pci_config_read16(bus, device, function, PCI_VENDOR_ID);
+            if (vendor_id != 0xFFFF) {
+                pci_scan_function(bus, device, function, vendor_id);
+            }
+        }
+    }
 }
 
 int pci_scan_devices(void) {
     pci_device_count = 0;
-    DEBUG_INFO("Starting PCI bus scan...\n");
-    
-    for (int bus = 0; bus < 256; bus++) {
-        for (int device = 0; device < 32; device++) {
-            for (int function = 0; function < 8; function++) {
-                uint16_t vendor_id = pci_config_read16(bus, device, function, PCI_VENDOR_ID);
-                
-                if (vendor_id == 0xFFFF) {
-                    if (function == 0) break; // No device here, skip to next device
-                    continue; // No function here, try next function
-                }
-                
-                if (pci_device_count >= MAX_PCI_DEVICES) {
-                    DEBUG_WARN("Maximum PCI devices reached (%d)\n", MAX_PCI_DEVICES);
-                    return pci_device_count;
-                }
-                
-                pci_device_t *dev = &pci_devices[pci_device_count];
-                dev->bus = bus;
-                dev->device = device;
-                dev->function = function;
-                dev->vendor_id = vendor_id;
-                dev->device_id = pci_config_read16(bus, device, function, PCI_DEVICE_ID);
-                dev->class_code = pci_config_read8(bus, device, function, PCI_CLASS_CODE);
-                dev->subclass = pci_config_read8(bus, device, function, PCI_SUBCLASS);
-                dev->prog_if = pci_config_read8(bus, device, function, PCI_PROG_IF);
-                dev->revision_id = pci_config_read8(bus, device, function, PCI_REVISION_ID);
-                dev->interrupt_line = pci_config_read8(bus, device, function, PCI_INTERRUPT_LINE);
-                dev->interrupt_pin = pci_config_read8(bus, device, function, PCI_INTERRUPT_PIN);
-                
-                // Read BARs
-                for (int i = 0; i < 6; i++) {
-                    dev->bar[i] = pci_config_read32(bus, device, function, PCI_BAR0 + i * 4);
-                }
-                
-                DEBUG_DEBUG("Found PCI device: %02x:%02x.%x - Vendor: %04x, Device: %04x, Class: %02x\n", 
-                           bus, device, function, vendor_id, dev->device_id, dev->class_code);
-                
-                pci_device_count++;
-                
-                // If this is not a multi-function device, skip other functions
-                if (function == 0) {
-                    uint8_t header_type = pci_config_read8(bus, device, function, PCI_HEADER_TYPE);
-                    if ((header_type & 0x80) == 0) {
-                        break;
-                    }
-                }
+    memset(bus_scanned, 0, sizeof(bus_scanned));
+    DEBUG_INFO("Starting PCI bus scan (%s)...\n", ecam_base ? "ECAM" : "port I/O");
+    
+    // Walk down from the root bus through the bridges. A multi-function
+    // host bridge at 00:00 means one root bus per function.
+    if (pci_config_read16(0, 0, 0, PCI_VENDOR_ID) != 0xFFFF &&
+        (pci_config_read8(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTI_FUNC)) {
+        for (int function = 0; function < 8; function++) {
+            if (pci_config_read16(0, 0, function, PCI_VENDOR_ID) != 0xFFFF) {
+                pci_scan_bus(function);
             }
         }
+    } else {
+        pci_scan_bus(0);
     }
     
     DEBUG_INFO("PCI bus scan completed. Found %d devices\n", pci_device_count);
@@ -176,3 +317,215 @@ void pci_print_devices(int start_x, int start_y) {
     
     DEBUG_INFO("=== End PCI Device List ===\n");
 }
+
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id) {
+    uint16_t status = pci_config_read16(dev->bus, dev->device, dev->function, PCI_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    
+    uint8_t offset = pci_config_read8(dev->bus, dev->device, dev->function, PCI_CAPABILITIES) & 0xFC;
+    
+    // Bound the walk in case of a malformed (looping) list
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        uint8_t id = pci_config_read8(dev->bus, dev->device, dev->function, offset);
+        if (id == cap_id) {
+            return offset;
+        }
+        offset = pci_config_read8(dev->bus, dev->device, dev->function, offset + 1) & 0xFC;
+    }
+    
+    return 0;
+}
+
+int pci_enable_msi(pci_device_t *dev, uint8_t vector, uint32_t lapic_id) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    if (!cap) {
+        return -1;
+    }
+    
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + PCI_MSI_CTRL);
+    
+    pci_config_write32(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDR_LO,
+                       PCI_MSI_ADDR_BASE | ((lapic_id & 0xFF) << 12));
+    if (ctrl & PCI_MSI_CTRL_64BIT) {
+        pci_config_write32(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDR_HI, 0);
+        pci_config_write16(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_64, vector);
+    } else {
+        pci_config_write16(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_32, vector);
+    }
+    
+    // One vector (Multiple Message Enable = 0), then enable
+    ctrl &= ~(0x7 << 4);
+    ctrl |= PCI_MSI_CTRL_ENABLE;
+    pci_config_write16(dev->bus, dev->device, dev->function, cap + PCI_MSI_CTRL, ctrl);
+    
+    uint16_t command = pci_config_read16(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    pci_config_write16(dev->bus, dev->device, dev->function, PCI_COMMAND,
+                       command | PCI_COMMAND_INTX_DISABLE);
+    
+    DEBUG_INFO("PCI %d:%d.%d: MSI vector 0x%x -> APIC %u\n",
+               dev->bus, dev->device, dev->function, vector, lapic_id);
+    return 0;
+}
+
+uint16_t pci_find_ext_capability(pci_device_t *dev, uint16_t cap_id) {
+    if (!ecam_addr(dev->bus, dev->device, dev->function, PCI_EXT_CAP_START)) {
+        return 0;
+    }
+    
+    // Header: ID in bits 0-15, version 16-19, next offset 20-31
+    uint16_t offset = PCI_EXT_CAP_START;
+    for (int i = 0; i < (PCIE_CONFIG_SPACE_SIZE - PCI_EXT_CAP_START) / 4 && offset >= PCI_EXT_CAP_START; i++) {
+        uint32_t header = pci_config_read32(dev->bus, dev->device, dev->function, offset);
+        if (header == 0 || header == 0xFFFFFFFF) {
+            return 0;
+        }
+        if ((header & 0xFFFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 20) & 0xFFC;
+    }
+    
+    return 0;
+}
+
+int pci_msix_count(pci_device_t *dev) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) {
+        return 0;
+    }
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CTRL);
+    return (ctrl & PCI_MSIX_CTRL_SIZE) + 1;
+}
+
+uint64_t pci_bar_address(pci_device_t *dev, int bar) {
+    uint32_t low = dev->bar[bar];
+    if (low & 1) {
+        return 0;                   // I/O space
+    }
+    uint64_t addr = low & ~0xFULL;
+    if ((low & 0x6) == 0x4 && bar < 5) {
+        addr |= (uint64_t)dev->bar[bar + 1] << 32;
+    }
+    return addr;
+}
+
+int pci_enable_msix(pci_device_t *dev, const uint8_t *vectors,
+                    const uint32_t *lapic_ids, int count) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap || count <= 0) {
+        return -1;
+    }
+    
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CTRL);
+    if (count > (ctrl & PCI_MSIX_CTRL_SIZE) + 1) {
+        return -1;
+    }
+    
+    uint32_t table = pci_config_read32(dev->bus, dev->device, dev->function, cap + PCI_MSIX_TABLE);
+    uint64_t base = pci_bar_address(dev, table & PCI_MSIX_BIR_MASK);
+    if (!base) {
+        DEBUG_ERROR("PCI %d:%d.%d: MSI-X table BAR %u unusable\n",
+                    dev->bus, dev->device, dev->function, table & PCI_MSIX_BIR_MASK);
+        return -1;
+    }
+    
+    if (!dev->msix_table) {
+        dev->msix_table = vmm_map_mmio(base + (table & ~PCI_MSIX_BIR_MASK),
+                                       (size_t)((ctrl & PCI_MSIX_CTRL_SIZE) + 1) * PCI_MSIX_ENTRY_SIZE);
+        if (!dev->msix_table) {
+            return -1;
+        }
+    }
+    
+    // Enable with the function masked, so no entry fires half-programmed
+    pci_config_write16(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CTRL,
+                       ctrl | PCI_MSIX_CTRL_ENABLE | PCI_MSIX_CTRL_MASKALL);
+    
+    for (int i = 0; i < count; i++) {
+        volatile uint32_t *entry = dev->msix_table + i * (PCI_MSIX_ENTRY_SIZE / 4);
+        entry[PCI_MSIX_ENTRY_CTRL / 4] = PCI_MSIX_ENTRY_MASKED;
+        entry[PCI_MSIX_ENTRY_ADDR_LO / 4] = PCI_MSI_ADDR_BASE | ((lapic_ids[i] & 0xFF) << 12);
+        entry[PCI_MSIX_ENTRY_ADDR_HI / 4] = 0;
+        entry[PCI_MSIX_ENTRY_DATA / 4] = vectors[i];
+        entry[PCI_MSIX_ENTRY_CTRL / 4] = 0;
+    }
+    dev->msix_entries = (uint16_t)count;
+    
+    pci_config_write16(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CTRL,
+                       (ctrl | PCI_MSIX_CTRL_ENABLE) & ~PCI_MSIX_CTRL_MASKALL);
+    
+    uint16_t command = pci_config_read16(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    pci_config_write16(dev->bus, dev->device, dev->function, PCI_COMMAND,
+                       command | PCI_COMMAND_INTX_DISABLE);
+    
+    DEBUG_INFO("PCI %d:%d.%d: MSI-X, %d vectors from 0x%x\n",
+               dev->bus, dev->device, dev->function, count, vectors[0]);
+    return 0;
+}
+
+void pci_msix_mask(pci_device_t *dev, int entry, bool masked) {
+    if (!dev->msix_table || entry < 0 || entry >= dev->msix_entries) {
+        return;
+    }
+    dev->msix_table[entry * (PCI_MSIX_ENTRY_SIZE / 4) + PCI_MSIX_ENTRY_CTRL / 4] =
+        masked ? PCI_MSIX_ENTRY_MASKED : 0;
+}
+
+int pci_alloc_irq_vectors(pci_device_t *dev, int count, irq_handler_t handler,
+                          void *const *ctx, uint8_t *vectors) {
+    // Both MSI flavours target a local APIC
+    if (!lapic_is_ready() || count <= 0) {
+        return -1;
+    }
+    if (count > PCI_MAX_IRQ_VECTORS) {
+        count = PCI_MAX_IRQ_VECTORS;
+    }
+    
+    int entries = pci_msix_count(dev);
+    if (entries > 0) {
+        if (count > entries) {
+            count = entries;
+        }
+        
+        // Entry i goes to the i-th online CPU (round robin)
+        uint32_t online[MAX_CPUS];
+        uint32_t ncpus = 0;
+        for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+            if (smp_cpu_online(cpu)) {
+                online[ncpus++] = smp_get_cpu(cpu)->lapic_id;
+            }
+        }
+        
+        uint32_t targets[PCI_MAX_IRQ_VECTORS];
+        int n = 0;
+        for (; n < count; n++) {
+            int vector = irq_alloc_msi_vector(handler, ctx[n]);
+            if (vector < 0) {
+                break;
+            }
+            vectors[n] = (uint8_t)vector;
+            targets[n] = online[n % ncpus];
+        }
+        if (n > 0 && pci_enable_msix(dev, vectors, targets, n) == 0) {
+            return n;
+        }
+        for (int i = 0; i < n; i++) {
+            irq_free_msi_vector(vectors[i]);
+        }
+    }
+    
+    if (pci_find_capability(dev, PCI_CAP_ID_MSI)) {
+        int vector = irq_alloc_msi_vector(handler, ctx[0]);
+        if (vector >= 0) {
+            if (pci_enable_msi(dev, (uint8_t)vector, smp_get_cpu(0)->lapic_id) == 0) {
+                vectors[0] = (uint8_t)vector;
+                return 1;
+            }
+            irq_free_msi_vector(vector);
+        }
+    }
+    
+    return -1;
+}
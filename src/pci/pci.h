@@ -4,11 +4,18 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "../interrupt/irq.h"
 
 // PCI Configuration Space Registers
 #define PCI_CONFIG_ADDRESS  0xCF8
 #define PCI_CONFIG_DATA     0xCFC
 
+// Port I/O reaches the first 256 bytes; ECAM (memory-mapped, located by the
+// ACPI MCFG table) the full 4 KB PCI Express space
+#define PCI_CONFIG_SPACE_SIZE   256
+#define PCIE_CONFIG_SPACE_SIZE  4096
+#define PCI_EXT_CAP_START       0x100
+
 // PCI Header Type 0 offsets
 #define PCI_VENDOR_ID       0x00
 #define PCI_DEVICE_ID       0x02
@@ -36,6 +43,13 @@
 #define PCI_INTERRUPT_LINE  0x3C
 #define PCI_INTERRUPT_PIN   0x3D
 
+// PCI-to-PCI bridge (header type 1)
+#define PCI_PRIMARY_BUS     0x18
+#define PCI_SECONDARY_BUS   0x19
+#define PCI_HEADER_TYPE_MASK    0x7F
+#define PCI_HEADER_TYPE_BRIDGE  0x01
+#define PCI_HEADER_MULTI_FUNC   0x80
+
 // PCI Command Register bits
 #define PCI_COMMAND_IO          0x01
 #define PCI_COMMAND_MEMORY      0x02
@@ -49,9 +63,51 @@
 #define PCI_COMMAND_FAST_BACK   0x200
 #define PCI_COMMAND_INTX_DISABLE 0x400
 
+// PCI Status Register bits
+#define PCI_STATUS_CAP_LIST     0x10    // Capability list at PCI_CAPABILITIES
+
+// Capability IDs
+#define PCI_CAP_ID_MSI          0x05
+#define PCI_CAP_ID_EXP          0x10    // PCI Express
+#define PCI_CAP_ID_MSIX         0x11
+
+// MSI capability layout (offsets from the capability header)
+#define PCI_MSI_CTRL            0x02
+#define PCI_MSI_ADDR_LO         0x04
+#define PCI_MSI_ADDR_HI         0x08    // 64-bit capable functions only
+#define PCI_MSI_DATA_32         0x08
+#define PCI_MSI_DATA_64         0x0C
+#define PCI_MSI_CTRL_ENABLE     0x0001
+#define PCI_MSI_CTRL_64BIT      0x0080
+
+// MSI message address: fixed delivery, physical destination
+#define PCI_MSI_ADDR_BASE       0xFEE00000
+
+// MSI-X capability layout
+#define PCI_MSIX_CTRL           0x02
+#define PCI_MSIX_TABLE          0x04    // BAR index (low 3 bits) + offset
+#define PCI_MSIX_PBA            0x08
+#define PCI_MSIX_CTRL_SIZE      0x07FF  // Table size - 1
+#define PCI_MSIX_CTRL_MASKALL   0x4000
+#define PCI_MSIX_CTRL_ENABLE    0x8000
+#define PCI_MSIX_BIR_MASK       0x7
+
+// MSI-X table entry (16 bytes each, in the BAR named by PCI_MSIX_TABLE)
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_ADDR_LO  0x0
+#define PCI_MSIX_ENTRY_ADDR_HI  0x4
+#define PCI_MSIX_ENTRY_DATA     0x8
+#define PCI_MSIX_ENTRY_CTRL     0xC
+#define PCI_MSIX_ENTRY_MASKED   0x1
+
+// Most vectors pci_alloc_irq_vectors() hands one function
+#define PCI_MAX_IRQ_VECTORS     8
+
 // PCI Class Codes
 #define PCI_CLASS_NETWORK       0x02
 #define PCI_SUBCLASS_ETHERNET   0x00
+#define PCI_CLASS_STORAGE       0x01
+#define PCI_SUBCLASS_IDE        0x01
 
 // E1000 Vendor/Device IDs
 #define E1000_VENDOR_ID         0x8086
@@ -74,22 +130,68 @@ typedef struct pci_device {
     uint32_t bar[6];
     uint8_t interrupt_line;
     uint8_t interrupt_pin;
+    volatile uint32_t *msix_table;  // Mapped by pci_enable_msix()
+    uint16_t msix_entries;          // Entries programmed in msix_table
 } pci_device_t;
 
 // PCI functions
 void pci_init(void);
-uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
-uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
-uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
-void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
-void pci_config_write16(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value);
-void pci_config_write8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint8_t value);
+
+// Configuration space access: ECAM when MCFG covers the bus, port I/O
+// otherwise. Offsets at or past 256 need ECAM; without it reads return all
+// ones and writes are dropped.
+uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+uint16_t pci_config_read16(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value);
+void pci_config_write16(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint16_t value);
+void pci_config_write8(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint8_t value);
+
+// Whether configuration cycles go through ECAM
+bool pci_ecam_enabled(void);
 pci_device_t *pci_find_device(uint16_t vendor_id, uint16_t device_id);
 int pci_scan_devices(void);
 pci_device_t *pci_get_device(int index);
 int pci_get_device_count(void);
 void pci_print_devices(int start_x, int start_y);
 
+// Config-space offset of the first capability with 'cap_id', or 0 if the
+// function doesn't have one
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id);
+
+// Program and enable single-vector MSI delivering 'vector' to the CPU with
+// APIC ID 'lapic_id'. Also disables INTx. Returns 0 on success, -1 if the
+// function has no MSI capability.
+int pci_enable_msi(pci_device_t *dev, uint8_t vector, uint32_t lapic_id);
+
+// Config-space offset of the first PCI Express extended capability with
+// 'cap_id', or 0 if there is none (or no ECAM to reach it)
+uint16_t pci_find_ext_capability(pci_device_t *dev, uint16_t cap_id);
+
+// Physical address of memory BAR 'bar' (64-bit BARs span two slots), or 0
+// for an I/O BAR
+uint64_t pci_bar_address(pci_device_t *dev, int bar);
+
+// Number of MSI-X table entries, 0 without MSI-X
+int pci_msix_count(pci_device_t *dev);
+
+// Program MSI-X entries 0..count-1 to deliver vectors[i] to lapic_ids[i],
+// enable MSI-X and disable INTx. Returns 0, or -1 if the function has no
+// MSI-X capability, too few entries or an unusable table BAR.
+int pci_enable_msix(pci_device_t *dev, const uint8_t *vectors,
+                    const uint32_t *lapic_ids, int count);
+
+// Mask or unmask one MSI-X entry (e.g. while its queue is being reset)
+void pci_msix_mask(pci_device_t *dev, int entry, bool masked);
+
+// Allocate up to 'count' interrupt vectors for a function and route them:
+// MSI-X with one vector per entry, spread over the online CPUs and calling
+// handler(ctx[i]) for entry i, or else a single MSI vector (handler(ctx[0])
+// on the BSP). Vector numbers go to 'vectors'. Returns how many were set
+// up, or -1 if neither MSI-X nor MSI is usable (fall back to INTx).
+int pci_alloc_irq_vectors(pci_device_t *dev, int count, irq_handler_t handler,
+                          void *const *ctx, uint8_t *vectors);
+
 // I/O port functions (these should be implemented in your kernel)
 static inline void outl(uint16_t port, uint32_t value) {
     __asm__ volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
@@ -0,0 +1,261 @@
+/**
+ * FPU/SIMD State Management for CGOS
+ *
+ * Invariant: CR0.TS is clear exactly while the running thread has a section
+ * open and its registers are live (fpu_depth > 0, fpu_saved false). Every
+ * other FPU instruction traps to fpu_handle_nm().
+ */
+
+#include "fpu.h"
+#include "spinlock.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../debug/debug.h"
+#include <string.h>
+
+#define CR0_MP              (1ULL << 1)
+#define CR0_EM              (1ULL << 2)
+#define CR0_TS              (1ULL << 3)
+#define CR0_NE              (1ULL << 5)
+#define CR4_OSFXSR          (1ULL << 9)
+#define CR4_OSXMMEXCPT      (1ULL << 10)
+#define CR4_OSXSAVE         (1ULL << 18)
+
+#define CPUID_1_ECX_XSAVE   (1U << 26)
+#define CPUID_1_ECX_AVX     (1U << 28)
+#define CPUID_D1_EAX_XSAVEOPT (1U << 0)
+
+#define XCR0_X87            (1ULL << 0)
+#define XCR0_SSE            (1ULL << 1)
+#define XCR0_AVX            (1ULL << 2)
+
+#define MXCSR_DEFAULT       0x1F80      // All exceptions masked
+#define FCW_DEFAULT         0x037F
+
+// Legacy FXSAVE region plus the XSAVE header: enough for XRSTOR to put
+// every component in its initial state (XSTATE_BV = 0)
+static uint8_t fpu_init_image[576] __attribute__((aligned(64)));
+
+static bool fpu_ready;
+static bool use_xsave;
+static bool use_xsaveopt;
+static bool avx_enabled;
+static uint64_t xcr0_mask;
+static uint32_t save_size;
+
+static inline void cpuid_count(uint32_t leaf, uint32_t sub, uint32_t *a, uint32_t *b,
+                               uint32_t *c, uint32_t *d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static inline void clts(void) {
+    __asm__ volatile("clts" ::: "memory");
+}
+
+static inline void stts(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS) : "memory");
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    __asm__ volatile("xsetbv" :: "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)xcr0_mask, hi = (uint32_t)(xcr0_mask >> 32);
+    if (use_xsaveopt) {
+        __asm__ volatile("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else if (use_xsave) {
+        __asm__ volatile("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const void *area) {
+    uint32_t lo = (uint32_t)xcr0_mask, hi = (uint32_t)(xcr0_mask >> 32);
+    if (use_xsave) {
+        __asm__ volatile("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+    }
+}
+
+// Control registers for the chosen mode, with TS set (lazy)
+static void fpu_setup_cpu(void) {
+    uint64_t cr0, cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (use_xsave) {
+        cr4 |= CR4_OSXSAVE;
+    }
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
+    if (use_xsave) {
+        xsetbv(0, xcr0_mask);
+    }
+
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS;
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid_count(1, 0, &a, &b, &c, &d);
+    uint32_t features = c;
+
+    use_xsave = (features & CPUID_1_ECX_XSAVE) != 0;
+    xcr0_mask = XCR0_X87 | XCR0_SSE;
+    save_size = 512;
+
+    if (use_xsave) {
+        uint32_t supported;
+        cpuid_count(0xD, 0, &supported, &b, &c, &d);
+        if ((features & CPUID_1_ECX_AVX) && (supported & XCR0_AVX)) {
+            xcr0_mask |= XCR0_AVX;
+            avx_enabled = true;
+        }
+        cpuid_count(0xD, 1, &a, &b, &c, &d);
+        use_xsaveopt = (a & CPUID_D1_EAX_XSAVEOPT) != 0;
+    }
+
+    fpu_setup_cpu();
+
+    if (use_xsave) {
+        // EBX: save area size for the features now enabled in XCR0
+        cpuid_count(0xD, 0, &a, &b, &c, &d);
+        save_size = b;
+    }
+    if (save_size > PAGE_SIZE) {
+        DEBUG_WARN("FPU: %u byte save area does not fit a page, SIMD disabled\n", save_size);
+        return;
+    }
+
+    // FCW at offset 0, MXCSR at offset 24 in the legacy region
+    memset(fpu_init_image, 0, sizeof(fpu_init_image));
+    *(uint16_t *)&fpu_init_image[0] = FCW_DEFAULT;
+    *(uint32_t *)&fpu_init_image[24] = MXCSR_DEFAULT;
+
+    fpu_ready = true;
+    DEBUG_INFO("FPU: %s%s, AVX %s, %u byte save area\n",
+               use_xsave ? "XSAVE" : "FXSAVE", use_xsaveopt ? "OPT" : "",
+               avx_enabled ? "on" : "off", save_size);
+}
+
+void fpu_init_cpu(void) {
+    fpu_setup_cpu();
+}
+
+bool fpu_available(void) {
+    return fpu_ready;
+}
+
+bool fpu_has_avx(void) {
+    return fpu_ready && avx_enabled;
+}
+
+static inline bool interrupts_enabled(void) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(rflags));
+    return (rflags & (1 << 9)) != 0;
+}
+
+bool kernel_fpu_begin(void) {
+    // Interrupt handlers run with IF clear; they may have interrupted a
+    // thread whose section is live, so they must not touch the registers
+    if (!fpu_ready || !interrupts_enabled()) {
+        return false;
+    }
+    thread_t *t = thread_current();
+    if (!t) {
+        return false;
+    }
+
+    if (!t->fpu_state) {
+        void *page = physical_alloc_page();
+        if (!page) {
+            return false;
+        }
+        t->fpu_state = (void *)PHYS_TO_HHDM((uint64_t)page);
+    }
+
+    uint64_t flags = irq_save();
+    if (t->fpu_depth++ == 0) {
+        clts();
+        fpu_restore(fpu_init_image);
+        t->fpu_saved = false;
+    }
+    irq_restore(flags);
+    return true;
+}
+
+void kernel_fpu_end(void) {
+    thread_t *t = thread_current();
+
+    uint64_t flags = irq_save();
+    if (t->fpu_depth > 0 && --t->fpu_depth == 0) {
+        // Nothing to keep: the next section starts from the initial state
+        t->fpu_saved = false;
+        stts();
+    }
+    irq_restore(flags);
+}
+
+void fpu_switch_out(thread_t *prev) {
+    if (prev->fpu_depth && !prev->fpu_saved) {
+        fpu_save(prev->fpu_state);
+        prev->fpu_saved = true;
+        stts();
+    }
+}
+
+bool fpu_handle_nm(void) {
+    thread_t *t = thread_current();
+    if (!t || t->fpu_depth == 0 || !t->fpu_saved) {
+        DEBUG_ERROR("FPU instruction outside a kernel_fpu_begin() section\n");
+        return false;
+    }
+
+    clts();
+    fpu_restore(t->fpu_state);
+    t->fpu_saved = false;
+    return true;
+}
+
+void fpu_thread_free(thread_t *thread) {
+    if (thread->fpu_state) {
+        physical_free_page((void *)HHDM_TO_PHYS((uint64_t)thread->fpu_state));
+        thread->fpu_state = NULL;
+    }
+}
+
+void fpu_copy_nt(void *dst, const void *src, size_t bytes) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    // Non-temporal stores need a 16-byte aligned destination
+    while (bytes && ((uintptr_t)d & 15)) {
+        *d++ = *s++;
+        bytes--;
+    }
+
+    for (; bytes >= 64; bytes -= 64, d += 64, s += 64) {
+        __asm__ volatile("movdqu   (%1), %%xmm0\n\t"
+                         "movdqu 16(%1), %%xmm1\n\t"
+                         "movdqu 32(%1), %%xmm2\n\t"
+                         "movdqu 48(%1), %%xmm3\n\t"
+                         "movntdq %%xmm0,   (%0)\n\t"
+                         "movntdq %%xmm1, 16(%0)\n\t"
+                         "movntdq %%xmm2, 32(%0)\n\t"
+                         "movntdq %%xmm3, 48(%0)"
+                         :: "r"(d), "r"(s) : "memory");
+    }
+    // Order the weakly-ordered stores before anything that follows
+    __asm__ volatile("sfence" ::: "memory");
+
+    while (bytes--) {
+        *d++ = *s++;
+    }
+}
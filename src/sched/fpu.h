@@ -0,0 +1,53 @@
+/**
+ * FPU/SIMD State Management for CGOS
+ *
+ * The kernel is built without SSE, so the only code touching the FPU is
+ * inside kernel_fpu_begin()/kernel_fpu_end() sections. CR0.TS stays set
+ * outside them; a section gets a fresh register state, and only a thread
+ * switched out mid-section has its registers saved (XSAVEOPT, or FXSAVE
+ * without XSAVE). They are restored lazily by the #NM trap on its first
+ * SIMD instruction after it runs again.
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "thread.h"
+
+// Detect XSAVE/AVX and configure the BSP. Call once before any thread runs.
+void fpu_init(void);
+
+// Apply the BSP's FPU configuration to the calling AP
+void fpu_init_cpu(void);
+
+// Whether kernel_fpu_begin() can succeed at all, and whether AVX is usable
+bool fpu_available(void);
+bool fpu_has_avx(void);
+
+// Start using SSE/AVX registers from thread context with interrupts
+// enabled. Returns false (use a scalar path) in interrupt context, before
+// the scheduler runs, or if no save area could be allocated. Sections
+// nest and may block; register contents do not survive kernel_fpu_end().
+bool kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+// Scheduler hook, interrupts disabled: save 'prev' if it is switched out
+// with a section open
+void fpu_switch_out(thread_t *prev);
+
+// #NM (device not available) handler. Returns false if the fault did not
+// come from a kernel FPU section.
+bool fpu_handle_nm(void);
+
+// Release a thread's save area (thread_reap)
+void fpu_thread_free(thread_t *thread);
+
+// Copy with 16-byte loads and non-temporal stores, for large copies to
+// memory that will not be read back soon (the framebuffer). Only inside a
+// kernel FPU section.
+void fpu_copy_nt(void *dst, const void *src, size_t bytes);
+
+#endif // FPU_H
@@ -0,0 +1,102 @@
+#include "kstack.h"
+#include "spinlock.h"
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../debug/debug.h"
+
+static spinlock_t kstack_lock = SPINLOCK_INIT_NAMED("kstack");
+
+// LIFO of released slot indices, so a recycled stack is likely still cached
+static uint16_t free_slots[KSTACK_SLOTS];
+static uint32_t free_top = 0;
+
+// Slots [0, mapped_slots) have their stack pages mapped
+static uint32_t mapped_slots = 0;
+
+static inline uint64_t slot_base(uint32_t slot) {
+    return KSTACK_VIRTUAL_BASE + (uint64_t)slot * KSTACK_SLOT_SIZE + KSTACK_GUARD_SIZE;
+}
+
+// Back the next unmapped slot with physical pages. Requires kstack_lock.
+static int map_next_slot(void) {
+    if (mapped_slots >= KSTACK_SLOTS) {
+        return -1;
+    }
+
+    void *pages = physical_alloc_pages(KERNEL_STACK_SIZE / PAGE_SIZE);
+    if (!pages) {
+        return -1;
+    }
+
+    uint32_t slot = mapped_slots;
+    if (!vmm_map_range((uint64_t)pages, slot_base(slot), KERNEL_STACK_SIZE,
+                       PAGE_WRITABLE)) {
+        physical_free_pages(pages, KERNEL_STACK_SIZE / PAGE_SIZE);
+        return -1;
+    }
+
+    mapped_slots++;
+    free_slots[free_top++] = (uint16_t)slot;
+    return 0;
+}
+
+int kstack_init(void) {
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+    int result = 0;
+    while (mapped_slots < KSTACK_PREALLOC) {
+        if (map_next_slot() != 0) {
+            result = -1;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&kstack_lock, flags);
+
+    DEBUG_INFO("kstack: %u stacks mapped at 0x%lx (slot %u bytes, guard %u bytes)\n",
+               mapped_slots, (uint64_t)KSTACK_VIRTUAL_BASE,
+               (uint32_t)KSTACK_SLOT_SIZE, (uint32_t)KSTACK_GUARD_SIZE);
+    return result;
+}
+
+uint64_t kstack_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+
+    if (free_top == 0 && map_next_slot() != 0) {
+        spin_unlock_irqrestore(&kstack_lock, flags);
+        DEBUG_ERROR("kstack: pool exhausted (%u stacks mapped)\n", mapped_slots);
+        return 0;
+    }
+
+    uint32_t slot = free_slots[--free_top];
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    return slot_base(slot);
+}
+
+void kstack_free(uint64_t base) {
+    uint64_t offset = base - KSTACK_VIRTUAL_BASE - KSTACK_GUARD_SIZE;
+    uint32_t slot = (uint32_t)(offset / KSTACK_SLOT_SIZE);
+    if (base < KSTACK_VIRTUAL_BASE || offset % KSTACK_SLOT_SIZE != 0 ||
+        slot >= mapped_slots) {
+        DEBUG_ERROR("kstack_free: 0x%lx is not a pool stack\n", base);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+    free_slots[free_top++] = (uint16_t)slot;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
+
+bool kstack_is_guard(uint64_t addr) {
+    if (addr < KSTACK_VIRTUAL_BASE ||
+        addr >= KSTACK_VIRTUAL_BASE + (uint64_t)KSTACK_SLOTS * KSTACK_SLOT_SIZE) {
+        return false;
+    }
+    return (addr - KSTACK_VIRTUAL_BASE) % KSTACK_SLOT_SIZE < KSTACK_GUARD_SIZE;
+}
+
+uint32_t kstack_mapped_count(void) {
+    return mapped_slots;
+}
+
+uint32_t kstack_free_count(void) {
+    return free_top;
+}
@@ -0,0 +1,38 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "thread.h"
+
+// Kernel thread stacks live in a dedicated virtual range instead of the
+// HHDM. Every slot is an unmapped guard page followed by KERNEL_STACK_SIZE
+// bytes of mapped stack, so running off the bottom of a stack faults
+// instead of silently overwriting whatever sits below it.
+#define KSTACK_GUARD_SIZE       4096
+#define KSTACK_SLOT_SIZE        (KSTACK_GUARD_SIZE + KERNEL_STACK_SIZE)
+#define KSTACK_SLOTS            MAX_THREADS
+
+// Slots mapped up front by kstack_init(); the rest are mapped on first use.
+// Released stacks stay mapped and go back on the free list.
+#define KSTACK_PREALLOC         16
+
+// Map the preallocated slots. Returns 0 on success, -1 on failure.
+int kstack_init(void);
+
+// Take a stack from the pool. Returns the lowest usable address (the stack
+// top is that plus KERNEL_STACK_SIZE), or 0 if the pool is exhausted.
+uint64_t kstack_alloc(void);
+
+// Return a stack obtained from kstack_alloc(). Must not be the stack the
+// caller is running on.
+void kstack_free(uint64_t base);
+
+// True if addr falls inside one of the pool's guard pages
+bool kstack_is_guard(uint64_t addr);
+
+// Pool usage for diagnostics
+uint32_t kstack_mapped_count(void);
+uint32_t kstack_free_count(void);
+
+#endif // KSTACK_H
@@ -1,119 +1,516 @@
 #include "scheduler.h"
 #include "context.h"
+#include "fpu.h"
+#include "spinlock.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
 #include "../timer/timer.h"
+#include "../timer/tsc.h"
 #include "../gdt/gdt.h"
+#include "../smp/smp.h"
+#include "../memory/pmm.h"
 #include <string.h>
 
+// One bit per priority level in ready_mask
+_Static_assert(PRIORITY_LEVELS <= 64, "ready_mask cannot describe PRIORITY_LEVELS");
+
+// Affinity masks are 32 bits wide
+_Static_assert(MAX_CPUS <= 32, "thread_t::cpu_affinity cannot describe MAX_CPUS");
+
+// Ticks between periodic load-balancing passes (100ms at 1kHz)
+#define SCHED_BALANCE_INTERVAL  100
+
 // ============== Data Structures ==============
 
-// Per-priority ready queues (circular doubly-linked lists)
-static thread_t *ready_queue_heads[PRIORITY_LEVELS];
-static thread_t *ready_queue_tails[PRIORITY_LEVELS];
+// Per-CPU scheduler instance, protected by its lock. Other CPUs enqueue
+// (wakeups, scheduler_add) and steal from it, but never take a thread whose
+// on_cpu flag is still set, so nobody resumes a thread before it is saved.
+typedef struct {
+    spinlock_t lock;
+    
+    // Per-priority ready queues (doubly-linked lists)
+    thread_t *ready_queue_heads[PRIORITY_LEVELS];
+    thread_t *ready_queue_tails[PRIORITY_LEVELS];
+    
+    // Bit p set <=> ready_queue_heads[p] is non-empty
+    uint64_t ready_mask;
+    
+    // Runnable deadline threads, earliest absolute deadline first
+    thread_t *dl_head;
+    
+    // Idle thread - runs when no other thread is ready on this CPU
+    thread_t *idle_thread;
+    
+    // Current running thread
+    thread_t *current_thread;
+    
+    // Thread switched away from, released by scheduler_finish_switch()
+    thread_t *prev_thread;
+    
+    // Threads placed on this CPU (used to balance scheduler_add)
+    uint32_t nr_threads;
+    
+    // Scheduler statistics for this CPU
+    scheduler_stats_t stats;
+    
+    // Deferred reschedule flag - set by scheduler_tick(), checked by scheduler_yield()
+    // This prevents context switching from inside the timer IRQ handler
+    volatile bool need_reschedule;
+    
+    // The yield in progress is acting on an expired slice (counted as an
+    // involuntary switch if it switches away)
+    bool switch_involuntary;
+    
+    // Dummy "previous thread" for the one-way switch in scheduler start-up
+    thread_t bootstrap_thread;
+} cpu_sched_t;
+
+static cpu_sched_t cpu_sched[MAX_CPUS];
+
+// Sleeping threads sit on the kernel timer wheel (thread->sleep_timer);
+// sleep_lock only guards the sleeping/blocked bookkeeping below
+static spinlock_t sleep_lock = SPINLOCK_INIT_NAMED("sched.sleep");
 
-// Sleep queue (ordered by wake_time, singly linked)
-static thread_t *sleep_queue;
+// Serializes deadline admission; guards every CPU's stats.dl_util_ppm
+static spinlock_t dl_admit_lock = SPINLOCK_INIT_NAMED("sched.dl_admit");
 
 // Blocked queue (singly linked)
 static thread_t *blocked_queue;
 
-// Idle thread - runs when no other thread is ready
-static thread_t *idle_thread;
+// Sleeping/blocked counts are global since those threads sit on no CPU
+static uint32_t threads_sleeping;
+static uint32_t threads_blocked;
+
+// Is scheduler running?
+static volatile bool scheduler_running = false;
+
+static inline cpu_sched_t *this_cpu(void) {
+    return &cpu_sched[smp_cpu_id()];
+}
 
-// Current running thread
-static thread_t *current_thread = NULL;
+static inline bool cpu_allowed(thread_t *thread, uint32_t cpu) {
+    return (thread->cpu_affinity & (1u << cpu)) != 0;
+}
 
-// Scheduler statistics
-static scheduler_stats_t stats;
+// Ready threads plus the running one (if it isn't the idle thread)
+static inline uint32_t cpu_load(cpu_sched_t *cs) {
+    return cs->stats.threads_ready + (cs->current_thread != cs->idle_thread ? 1 : 0);
+}
 
-// Is scheduler running?
-static bool scheduler_running = false;
+// Take two run queue locks in CPU index order so CPUs balancing against
+// each other can't deadlock
+static void lock_pair(uint32_t a, uint32_t b) {
+    if (a > b) {
+        uint32_t tmp = a; a = b; b = tmp;
+    }
+    spin_lock(&cpu_sched[a].lock);
+    if (a != b) {
+        spin_lock(&cpu_sched[b].lock);
+    }
+}
+
+static void unlock_pair(uint32_t a, uint32_t b) {
+    spin_unlock(&cpu_sched[a].lock);
+    if (a != b) {
+        spin_unlock(&cpu_sched[b].lock);
+    }
+}
+
+// ============== Deadline Class ==============
+// A deadline thread is linked on dl_head exactly when it is READY and not
+// throttled. Its budget is charged with the rest of its runtime
+// (charge_runtime); running out parks it until the next period. Wakeups
+// follow the constant bandwidth server rule, so a thread that sleeps
+// cannot save up budget and overrun its reservation later.
+
+static void dl_replenish(void *arg);
+
+// Start a new period (and job) at 'now' with a full budget
+static void dl_new_period(thread_t *thread, uint64_t now) {
+    thread->dl_period_start = now;
+    thread->dl_abs_deadline = now + thread->dl_deadline_ns;
+    thread->dl_budget_ns = (int64_t)thread->dl_runtime_ns;
+    thread->dl_missed = false;
+}
+
+// Park a thread that used up its budget until its next period starts
+static void dl_throttle(thread_t *thread, uint64_t now) {
+    uint64_t next = thread->dl_period_start + thread->dl_period_ns;
+    uint64_t wait = next > now ? next - now : 0;
+    
+    thread->dl_throttled = true;
+    thread->dl_throttles++;
+    cpu_sched[thread->cpu].stats.dl_throttles++;
+    ktimer_add(&thread->dl_timer,
+               timer_get_ticks() + (wait + TIMER_NS_PER_TICK - 1) / TIMER_NS_PER_TICK);
+}
+
+// Deduct 'ran' ns from a running deadline thread's budget
+static void dl_charge(thread_t *thread, uint64_t ran, uint64_t now) {
+    thread->dl_budget_ns -= (int64_t)ran;
+    if (!thread->dl_missed && now > thread->dl_abs_deadline) {
+        thread->dl_missed = true;
+        thread->dl_misses++;
+    }
+    if (thread->dl_budget_ns <= 0 && !thread->dl_throttled) {
+        dl_throttle(thread, now);
+    }
+}
 
-// Scheduling lock (simple spinlock for now - interrupts disabled)
-static volatile bool sched_lock = false;
+// Link a deadline thread in deadline order, unless it has to wait for its
+// budget. A job that can no longer finish its remaining budget by its
+// deadline at the reserved rate is replaced by a new one.
+static void dl_enqueue(cpu_sched_t *cs, thread_t *thread) {
+    thread->state = THREAD_STATE_READY;
+    if (thread->dl_throttled) {
+        return;                     // dl_replenish() queues it
+    }
+    
+    uint64_t now = timer_get_ns();
+    if (thread->dl_budget_ns <= 0 && now < thread->dl_period_start + thread->dl_period_ns) {
+        dl_throttle(thread, now);
+        return;
+    }
+    uint64_t left = thread->dl_abs_deadline > now ? thread->dl_abs_deadline - now : 0;
+    if (left == 0 || thread->dl_budget_ns <= 0 ||
+        (uint64_t)thread->dl_budget_ns * thread->dl_deadline_ns > left * thread->dl_runtime_ns) {
+        dl_new_period(thread, now);
+    }
+    
+    thread_t **link = &cs->dl_head;
+    thread_t *before = NULL;
+    while (*link && (*link)->dl_abs_deadline <= thread->dl_abs_deadline) {
+        before = *link;
+        link = &(*link)->next;
+    }
+    thread->prev = before;
+    thread->next = *link;
+    if (*link) {
+        (*link)->prev = thread;
+    }
+    *link = thread;
+    
+    cs->stats.threads_ready++;
+    if (!thread->ready_since_tsc) {
+        thread->ready_since_tsc = rdtsc();
+    }
+}
 
-// Deferred reschedule flag - set by scheduler_tick(), checked by scheduler_yield()
-// This prevents context switching from inside the timer IRQ handler
-static volatile bool need_reschedule = false;
+static void dl_remove(cpu_sched_t *cs, thread_t *thread) {
+    if (thread->prev) {
+        thread->prev->next = thread->next;
+    } else {
+        cs->dl_head = thread->next;
+    }
+    if (thread->next) {
+        thread->next->prev = thread->prev;
+    }
+    thread->next = NULL;
+    thread->prev = NULL;
+    cs->stats.threads_ready--;
+}
 
 // ============== Queue Operations ==============
+// All of these require cs->lock to be held with interrupts disabled
 
-// Add thread to tail of a priority queue
-static void enqueue_ready(thread_t *thread) {
+// Add thread to tail of its ready queue
+static void enqueue_ready(cpu_sched_t *cs, thread_t *thread) {
+    if (thread->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_enqueue(cs, thread);
+        return;
+    }
+    
     uint8_t p = thread->priority;
     thread->next = NULL;
-    thread->prev = ready_queue_tails[p];
+    thread->prev = cs->ready_queue_tails[p];
     
-    if (ready_queue_tails[p]) {
-        ready_queue_tails[p]->next = thread;
+    if (cs->ready_queue_tails[p]) {
+        cs->ready_queue_tails[p]->next = thread;
     } else {
-        ready_queue_heads[p] = thread;
+        cs->ready_queue_heads[p] = thread;
     }
-    ready_queue_tails[p] = thread;
+    cs->ready_queue_tails[p] = thread;
+    cs->ready_mask |= 1ULL << p;
     
     thread->state = THREAD_STATE_READY;
-    stats.threads_ready++;
+    cs->stats.threads_ready++;
+    
+    // Keep the original stamp if the thread is only being moved between
+    // CPUs, so a migration does not hide how long it has waited
+    if (!thread->ready_since_tsc) {
+        thread->ready_since_tsc = rdtsc();
+    }
 }
 
 // Remove thread from head of a priority queue
-static thread_t *dequeue_ready(uint8_t priority) {
-    thread_t *thread = ready_queue_heads[priority];
+static thread_t *dequeue_ready(cpu_sched_t *cs, uint8_t priority) {
+    thread_t *thread = cs->ready_queue_heads[priority];
     if (!thread) return NULL;
     
-    ready_queue_heads[priority] = thread->next;
-    if (ready_queue_heads[priority]) {
-        ready_queue_heads[priority]->prev = NULL;
+    cs->ready_queue_heads[priority] = thread->next;
+    if (cs->ready_queue_heads[priority]) {
+        cs->ready_queue_heads[priority]->prev = NULL;
     } else {
-        ready_queue_tails[priority] = NULL;
+        cs->ready_queue_tails[priority] = NULL;
+        cs->ready_mask &= ~(1ULL << priority);
     }
     
     thread->next = NULL;
     thread->prev = NULL;
-    stats.threads_ready--;
+    cs->stats.threads_ready--;
     
     return thread;
 }
 
 // Remove specific thread from its ready queue
-static void remove_from_ready(thread_t *thread) {
+static void remove_from_ready(cpu_sched_t *cs, thread_t *thread) {
+    if (thread->sched_class == SCHED_CLASS_DEADLINE) {
+        if (!thread->dl_throttled) {
+            dl_remove(cs, thread);
+        }
+        return;
+    }
+    
     uint8_t p = thread->priority;
     
     if (thread->prev) {
         thread->prev->next = thread->next;
     } else {
-        ready_queue_heads[p] = thread->next;
+        cs->ready_queue_heads[p] = thread->next;
     }
     
     if (thread->next) {
         thread->next->prev = thread->prev;
     } else {
-        ready_queue_tails[p] = thread->prev;
+        cs->ready_queue_tails[p] = thread->prev;
+    }
+    
+    if (!cs->ready_queue_heads[p]) {
+        cs->ready_mask &= ~(1ULL << p);
     }
     
     thread->next = NULL;
     thread->prev = NULL;
-    stats.threads_ready--;
+    cs->stats.threads_ready--;
 }
 
-// Add thread to sleep queue (ordered by wake_time)
-static void enqueue_sleep(thread_t *thread) {
-    thread->state = THREAD_STATE_SLEEPING;
-    thread->next = NULL;
-    
-    // Insert in sorted order
-    if (!sleep_queue || thread->wake_time < sleep_queue->wake_time) {
-        thread->next = sleep_queue;
-        sleep_queue = thread;
+// Wake one idle CPU (other than 'busy') that may run 'thread', so it can
+// steal it instead of leaving it queued behind a busy CPU
+static void kick_idle_cpu(thread_t *thread, uint32_t busy) {
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu == busy || !smp_cpu_online(cpu) || !cpu_allowed(thread, cpu)) {
+            continue;
+        }
+        if (cpu_sched[cpu].current_thread == cpu_sched[cpu].idle_thread) {
+            smp_send_reschedule(cpu);
+            return;
+        }
+    }
+}
+
+// Make a thread runnable on its home CPU, waking that CPU if it is idle
+// (or another idle CPU that can steal it if not).
+// Must be called with interrupts disabled.
+static void make_ready(thread_t *thread) {
+    uint32_t cpu = thread->cpu;
+    cpu_sched_t *cs = &cpu_sched[cpu];
+    
+    spin_lock(&cs->lock);
+    enqueue_ready(cs, thread);
+    bool target_idle = (cs->current_thread == cs->idle_thread);
+    spin_unlock(&cs->lock);
+    
+    if (target_idle) {
+        smp_send_reschedule(cpu);
     } else {
-        thread_t *prev = sleep_queue;
-        while (prev->next && prev->next->wake_time <= thread->wake_time) {
-            prev = prev->next;
+        kick_idle_cpu(thread, cpu);
+    }
+}
+
+// Timer wheel callback: a throttled deadline thread's next period begins
+static void dl_replenish(void *arg) {
+    thread_t *thread = (thread_t *)arg;
+    cpu_sched_t *cs = &cpu_sched[thread->cpu];
+    
+    spin_lock(&cs->lock);
+    bool parked = (thread->state == THREAD_STATE_READY);
+    thread->dl_throttled = false;
+    dl_new_period(thread, timer_get_ns());
+    if (parked) {
+        enqueue_ready(cs, thread);
+    }
+    bool target_idle = (cs->current_thread == cs->idle_thread);
+    spin_unlock(&cs->lock);
+    
+    if (parked && target_idle) {
+        smp_send_reschedule(thread->cpu);
+    }
+}
+
+int scheduler_set_deadline(thread_t *thread, uint64_t runtime_ns,
+                           uint64_t deadline_ns, uint64_t period_ns) {
+    if (!thread || thread->state != THREAD_STATE_CREATED) {
+        return -1;
+    }
+    if (deadline_ns == 0) {
+        deadline_ns = period_ns;
+    }
+    if (period_ns < SCHED_DL_MIN_PERIOD_NS || period_ns > SCHED_DL_MAX_PERIOD_NS ||
+        runtime_ns == 0 || runtime_ns > deadline_ns || deadline_ns > period_ns) {
+        DEBUG_WARN("Deadline '%s': invalid runtime/deadline/period %lu/%lu/%lu ns\n",
+                   thread->name, runtime_ns, deadline_ns, period_ns);
+        return -1;
+    }
+    
+    // Density, not utilization: sufficient for EDF with deadline <= period
+    uint32_t util = (uint32_t)((runtime_ns * 1000000ULL + deadline_ns - 1) / deadline_ns);
+    
+    uint64_t flags = spin_lock_irqsave(&dl_admit_lock);
+    uint32_t best = MAX_CPUS;
+    uint32_t best_util = SCHED_DL_MAX_UTIL_PPM + 1;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (!smp_cpu_online(cpu) || !cpu_allowed(thread, cpu)) continue;
+        uint32_t used = cpu_sched[cpu].stats.dl_util_ppm;
+        if (used + util <= SCHED_DL_MAX_UTIL_PPM && used < best_util) {
+            best = cpu;
+            best_util = used;
         }
-        thread->next = prev->next;
-        prev->next = thread;
+    }
+    if (best < MAX_CPUS) {
+        cpu_sched[best].stats.dl_util_ppm += util;
+    }
+    spin_unlock_irqrestore(&dl_admit_lock, flags);
+    
+    if (best == MAX_CPUS) {
+        DEBUG_WARN("Deadline '%s': %u ppm does not fit on any CPU\n", thread->name, util);
+        return -1;
     }
     
-    stats.threads_sleeping++;
+    thread->sched_class = SCHED_CLASS_DEADLINE;
+    thread->dl_util = util;
+    thread->dl_runtime_ns = runtime_ns;
+    thread->dl_deadline_ns = deadline_ns;
+    thread->dl_period_ns = period_ns;
+    thread->cpu_affinity = 1u << best;
+    ktimer_setup(&thread->dl_timer, dl_replenish, thread);
+    
+    DEBUG_INFO("Deadline '%s' admitted on CPU %u: %lu/%lu/%lu ns (%u ppm)\n",
+               thread->name, best, runtime_ns, deadline_ns, period_ns, util);
+    return 0;
+}
+
+// Give back a terminating deadline thread's reservation
+static void dl_release(thread_t *thread) {
+    ktimer_cancel(&thread->dl_timer);
+    spin_lock(&dl_admit_lock);
+    cpu_sched[thread->cpu].stats.dl_util_ppm -= thread->dl_util;
+    spin_unlock(&dl_admit_lock);
+}
+
+// ============== Load Balancing ==============
+
+// Detach one thread that may move to 'to_cpu' from a victim's ready queues,
+// scanning from the lowest priority up so the victim keeps its most urgent
+// (and most likely cache-hot) work. Requires the victim's lock.
+static thread_t *detach_stealable(cpu_sched_t *victim, uint32_t to_cpu) {
+    uint64_t mask = victim->ready_mask;
+    while (mask) {
+        int p = 63 - __builtin_clzll(mask);
+        mask &= ~(1ULL << p);
+        for (thread_t *t = victim->ready_queue_tails[p]; t; t = t->prev) {
+            if (t->on_cpu || !cpu_allowed(t, to_cpu)) {
+                continue;
+            }
+            remove_from_ready(victim, t);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Move a detached thread onto another CPU. Requires both locks.
+static void attach_thread(cpu_sched_t *from, uint32_t to_cpu, thread_t *thread) {
+    cpu_sched_t *to = &cpu_sched[to_cpu];
+    from->nr_threads--;
+    to->nr_threads++;
+    thread->cpu = to_cpu;
+    enqueue_ready(to, thread);
+}
+
+// The online CPU (other than 'self') with the most threads waiting
+static uint32_t busiest_cpu(uint32_t self, uint32_t *ready_out) {
+    uint32_t best = self;
+    uint32_t best_ready = 0;
+    
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu == self || !smp_cpu_online(cpu)) continue;
+        uint32_t ready = cpu_sched[cpu].stats.threads_ready;
+        if (ready > best_ready) {
+            best = cpu;
+            best_ready = ready;
+        }
+    }
+    *ready_out = best_ready;
+    return best;
+}
+
+// Periodic pass from the tick: if the load gap between the busiest and
+// the least loaded CPU is two or more, migrate one thread across
+static void rebalance(void) {
+    uint32_t count = smp_cpu_count();
+    if (count < 2) return;
+    
+    uint32_t busiest = 0, idlest = 0;
+    uint32_t max_load = 0, min_load = 0xFFFFFFFF;
+    for (uint32_t cpu = 0; cpu < count; cpu++) {
+        if (!smp_cpu_online(cpu)) continue;
+        uint32_t load = cpu_load(&cpu_sched[cpu]);
+        if (load > max_load) {
+            max_load = load;
+            busiest = cpu;
+        }
+        if (load < min_load) {
+            min_load = load;
+            idlest = cpu;
+        }
+    }
+    if (busiest == idlest || max_load < min_load + 2) return;
+    
+    lock_pair(busiest, idlest);
+    thread_t *t = detach_stealable(&cpu_sched[busiest], idlest);
+    bool target_idle = false;
+    if (t) {
+        attach_thread(&cpu_sched[busiest], idlest, t);
+        cpu_sched[idlest].stats.threads_migrated++;
+        target_idle = (cpu_sched[idlest].current_thread == cpu_sched[idlest].idle_thread);
+    }
+    unlock_pair(busiest, idlest);
+    
+    if (t) {
+        DEBUG_DEBUG("Rebalance: moved '%s' CPU %u -> %u\n", t->name, busiest, idlest);
+        if (target_idle) {
+            smp_send_reschedule(idlest);
+        }
+    }
+}
+
+bool scheduler_try_steal(void) {
+    uint32_t self = smp_cpu_id();
+    uint32_t ready;
+    uint32_t victim = busiest_cpu(self, &ready);
+    if (victim == self || ready == 0) {
+        return false;
+    }
+    
+    lock_pair(self, victim);
+    thread_t *t = detach_stealable(&cpu_sched[victim], self);
+    if (t) {
+        attach_thread(&cpu_sched[victim], self, t);
+        cpu_sched[self].stats.threads_stolen++;
+    }
+    unlock_pair(self, victim);
+    
+    return t != NULL;
 }
 
 // ============== Adaptive Priority ==============
@@ -132,9 +529,9 @@ static void update_cpu_usage(thread_t *thread, uint8_t usage_percent) {
 }
 
 // Adjust priority based on CPU usage pattern
-static void adjust_priority(thread_t *thread) {
+static void adjust_priority(cpu_sched_t *cs, thread_t *thread) {
     // Don't adjust idle thread or realtime threads
-    if (thread == idle_thread || thread->base_priority == PRIORITY_REALTIME) {
+    if (thread == cs->idle_thread || thread->base_priority == PRIORITY_REALTIME) {
         return;
     }
     
@@ -144,7 +541,7 @@ static void adjust_priority(thread_t *thread) {
     if (thread->avg_cpu_usage > PRIORITY_DEMOTE_THRESHOLD) {
         if (thread->priority < PRIORITY_LOW) {
             thread->priority++;
-            stats.priority_demotions++;
+            cs->stats.priority_demotions++;
             DEBUG_INFO("Thread '%s' demoted %d->%d (CPU: %d%%)\n",
                        thread->name, old_priority, thread->priority,
                        thread->avg_cpu_usage);
@@ -154,7 +551,7 @@ static void adjust_priority(thread_t *thread) {
     else if (thread->avg_cpu_usage < PRIORITY_BOOST_THRESHOLD) {
         if (thread->priority > thread->base_priority) {
             thread->priority--;
-            stats.priority_boosts++;
+            cs->stats.priority_boosts++;
             DEBUG_INFO("Thread '%s' boosted %d->%d (CPU: %d%%)\n",
                        thread->name, old_priority, thread->priority,
                        thread->avg_cpu_usage);
@@ -168,278 +565,596 @@ static void adjust_priority(thread_t *thread) {
     }
 }
 
+// Percentage of the slice length a thread has used so far (capped at 100),
+// measured on the high-resolution clock rather than in whole ticks
+static uint8_t slice_usage(thread_t *thread, uint64_t now) {
+    if (thread->time_slice_length == 0) {
+        return 100;
+    }
+    uint64_t used = now - thread->slice_start_ns;
+    uint64_t usage = (used * 100) / (thread->time_slice_length * TIMER_NS_PER_TICK);
+    return usage > 100 ? 100 : (uint8_t)usage;
+}
+
+// Fold the time since slice_start_ns into a thread's lifetime runtime
+// (and a deadline thread's budget)
+static void charge_runtime(thread_t *thread, uint64_t now) {
+    uint64_t ran = now - thread->slice_start_ns;
+    thread->total_ns += ran;
+    thread->slice_start_ns = now;
+    if (thread->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_charge(thread, ran, now);
+    }
+}
+
+// Fold the time a just-picked thread spent ready into its latency histogram
+static void account_wait(thread_t *thread, uint64_t now_tsc) {
+    uint64_t since = thread->ready_since_tsc;
+    if (!since) return;
+    thread->ready_since_tsc = 0;
+    
+    uint64_t cycles = now_tsc > since ? now_tsc - since : 0;
+    if (cycles > thread->wait_max_cycles) {
+        thread->wait_max_cycles = cycles;
+    }
+    
+    uint64_t us = tsc_cycles_to_ns(cycles) / 1000;
+    uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= THREAD_WAIT_BUCKETS) {
+        bucket = THREAD_WAIT_BUCKETS - 1;
+    }
+    thread->wait_hist[bucket]++;
+}
+
 // ============== Core Scheduler ==============
 
-// Pick the next thread to run
-static thread_t *pick_next_thread(void) {
-    // Scan priority queues from highest (0) to lowest (PRIORITY_LEVELS-1)
-    for (int p = 0; p < PRIORITY_LEVELS; p++) {
-        if (ready_queue_heads[p]) {
-            return dequeue_ready(p);
-        }
+// Pick the next thread to run on this CPU. Requires cs->lock.
+static thread_t *pick_next_thread(cpu_sched_t *cs) {
+    // Earliest deadline first, ahead of every priority level
+    if (cs->dl_head) {
+        thread_t *thread = cs->dl_head;
+        dl_remove(cs, thread);
+        return thread;
+    }
+    
+    // Lowest set bit = highest non-empty priority (0 is highest)
+    if (cs->ready_mask) {
+        return dequeue_ready(cs, __builtin_ctzll(cs->ready_mask));
     }
     
     // Nothing ready - return idle thread
-    return idle_thread;
+    return cs->idle_thread;
 }
 
-// Wake threads whose sleep time has elapsed
-static void wake_expired_sleepers(void) {
-    uint64_t now = timer_get_ticks();
+// Timer wheel callback: a sleeping thread's wake time has arrived
+// Runs in the timer interrupt with interrupts disabled
+static void sleep_timer_expired(void *arg) {
+    thread_t *thread = (thread_t *)arg;
     
-    while (sleep_queue && sleep_queue->wake_time <= now) {
-        thread_t *thread = sleep_queue;
-        sleep_queue = sleep_queue->next;
-        thread->next = NULL;
-        stats.threads_sleeping--;
-        
-        DEBUG_INFO("Waking thread '%s' (TID=%d)\n", thread->name, thread->tid);
-        enqueue_ready(thread);
-    }
+    spin_lock(&sleep_lock);
+    threads_sleeping--;
+    spin_unlock(&sleep_lock);
+    
+    DEBUG_INFO("Waking thread '%s' (TID=%d)\n", thread->name, thread->tid);
+    make_ready(thread);
 }
 
-// Perform the actual context switch
-static void switch_to(thread_t *next) {
-    if (next == current_thread) {
-        return;  // Already running this thread
+// Internal: switch this CPU to its next thread.
+// Called with interrupts disabled and cs->lock held; releases the lock.
+static void schedule(cpu_sched_t *cs) {
+    thread_t *prev = cs->current_thread;
+    thread_t *next = pick_next_thread(cs);
+    bool involuntary = cs->switch_involuntary;
+    cs->switch_involuntary = false;
+    uint64_t now_tsc = rdtsc();
+    account_wait(next, now_tsc);
+    
+    if (next == prev) {
+        // Nothing better to run (or we were woken before switching away)
+        next->state = THREAD_STATE_RUNNING;
+        spin_unlock(&cs->lock);
+        return;
     }
     
-    thread_t *prev = current_thread;
-    current_thread = next;
+    cs->current_thread = next;
+    cs->prev_thread = prev;
     next->state = THREAD_STATE_RUNNING;
-    
-    // Update TSS with new thread's kernel stack
-    uint64_t stack_top = next->kernel_stack_base + next->kernel_stack_size;
-    gdt_set_kernel_stack(stack_top);
+    next->on_cpu = true;
     
     // Reset time slice for new thread
+    uint64_t now = timer_get_ns();
+    charge_runtime(prev, now);
     next->time_slice = next->time_slice_length;
-    next->slice_start_ticks = timer_get_ticks();
-    next->ticks_used_this_slice = 0;
+    next->slice_start_ns = now;
     
-    stats.total_switches++;
+    prev->run_cycles += now_tsc - prev->switch_in_tsc;
+    next->switch_in_tsc = now_tsc;
+    if (involuntary) {
+        prev->involuntary_switches++;
+    } else {
+        prev->voluntary_switches++;
+    }
+    
+    cs->stats.total_switches++;
+    spin_unlock(&cs->lock);
+    
+    // Update TSS with new thread's kernel stack
+    uint64_t stack_top = next->kernel_stack_base + next->kernel_stack_size;
+    gdt_set_kernel_stack(stack_top);
+    TRACE(TRACE_SCHED_SWITCH, prev->tid, next->tid);
+    fpu_switch_out(prev);
     
-    // Actually switch
+    // Actually switch. Safe after dropping the lock: 'prev' keeps on_cpu set
+    // until the next thread calls scheduler_finish_switch(), so no other CPU
+    // can steal and resume it before its registers are saved.
     context_switch(prev, next);
+    
+    // Back in 'prev', possibly on a different CPU than before
+    scheduler_finish_switch();
 }
 
-// Internal: schedule the next thread
-static void schedule(void) {
-    thread_t *next = pick_next_thread();
+void scheduler_finish_switch(void) {
+    cpu_sched_t *cs = this_cpu();
+    thread_t *prev = cs->prev_thread;
+    cs->prev_thread = NULL;
+    if (prev) {
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+        
+        // An exited thread is off its stack now and can never be picked
+        // again, so its stack can go back to the pool
+        if (prev->state == THREAD_STATE_TERMINATED && prev != &cs->bootstrap_thread) {
+            thread_reap(prev);
+        }
+    }
+}
+
+// Charge one timer tick to whatever is running on a CPU. Tickless idle
+// accounts idle time itself, so count_idle is false for LAPIC ticks.
+static void tick_cpu(cpu_sched_t *cs, bool count_idle) {
+    spin_lock(&cs->lock);
+    
+    thread_t *t = cs->current_thread;
+    if (!t || t->state != THREAD_STATE_RUNNING) {
+        spin_unlock(&cs->lock);
+        return;
+    }
     
-    if (next != current_thread) {
-        switch_to(next);
+    // Track idle time
+    if (t == cs->idle_thread && count_idle) {
+        cs->stats.idle_ticks++;
+    }
+    
+    // Track CPU usage for current thread
+    t->total_ticks++;
+    
+    // Deadline budgets are enforced at tick granularity
+    if (t->sched_class == SCHED_CLASS_DEADLINE) {
+        charge_runtime(t, timer_get_ns());
+        if (t->dl_throttled) {
+            cs->need_reschedule = true;
+        }
+        spin_unlock(&cs->lock);
+        return;
+    }
+    
+    // Decrement time slice
+    if (t->time_slice > 0) {
+        t->time_slice--;
+        
+        // Time slice just expired?
+        if (t->time_slice == 0 && t != cs->idle_thread) {
+            // Used the entire slice: fold it into the history and start the
+            // next slice, so a thread that never yields keeps being demoted
+            uint64_t now = timer_get_ns();
+            update_cpu_usage(t, slice_usage(t, now));
+            adjust_priority(cs, t);
+            t->time_slice = t->time_slice_length;
+            charge_runtime(t, now);
+            
+            // Set flag to reschedule - DO NOT switch here!
+            // Context switching inside IRQ handler corrupts stack
+            cs->need_reschedule = true;
+        }
     }
+    
+    spin_unlock(&cs->lock);
 }
 
 // ============== Public API ==============
 
-// Idle thread function - runs when no other thread is ready
+// Idle thread function - runs when no other thread is ready on this CPU
 static void idle_thread_entry(void *arg) {
     (void)arg;
     while (1) {
-        // Enable interrupts and halt until next interrupt
-        __asm__ volatile("sti; hlt");
+        // Check for work with interrupts off so a reschedule IPI can't slip
+        // in between the check and the hlt; sti takes effect after hlt starts
+        __asm__ volatile("cli");
+        if (scheduler_has_ready() || scheduler_try_steal()) {
+            scheduler_yield();
+        } else if (physical_zero_pool_wanted()) {
+            // Nothing to run: pre-zero a small batch of pages with
+            // interrupts on, then look for work again
+            __asm__ volatile("sti");
+            physical_zero_pool_refill(PMM_ZERO_REFILL_BATCH);
+        } else {
+            // Stop the tick while halted and charge the whole gap on wakeup
+            uint64_t start = timer_get_ticks();
+            timer_idle_enter();
+            __asm__ volatile("sti; hlt; cli");
+            timer_idle_exit();
+            if (timer_is_tickless()) {
+                this_cpu()->stats.idle_ticks += timer_get_ticks() - start;
+            }
+            __asm__ volatile("sti");
+        }
     }
 }
 
+// Create the idle thread and reset the run queues for one CPU
+static int init_cpu_sched(uint32_t cpu) {
+    cpu_sched_t *cs = &cpu_sched[cpu];
+    
+    // Clear all queues and statistics
+    memset(cs, 0, sizeof(*cs));
+    spin_lock_init_named(&cs->lock, "sched.runqueue");
+    
+    char name[8] = "idle";
+    if (cpu > 0) {
+        // APs get "idle<N>" so they are distinguishable in thread listings
+        int pos = 4;
+        if (cpu >= 10) {
+            name[pos++] = '0' + cpu / 10;
+        }
+        name[pos++] = '0' + cpu % 10;
+        name[pos] = '\0';
+    }
+    
+    cs->idle_thread = thread_create_priority(name, idle_thread_entry, NULL, PRIORITY_IDLE);
+    if (!cs->idle_thread) {
+        DEBUG_ERROR("Failed to create idle thread for CPU %u!\n", cpu);
+        return -1;
+    }
+    
+    // Idle thread doesn't go in ready queue - it's the fallback
+    cs->idle_thread->cpu = cpu;
+    cs->idle_thread->cpu_affinity = 1u << cpu;
+    cs->idle_thread->state = THREAD_STATE_READY;
+    return 0;
+}
+
 void scheduler_init(void) {
     DEBUG_INFO("Initializing scheduler...\n");
     
-    // Clear all queues
-    memset(ready_queue_heads, 0, sizeof(ready_queue_heads));
-    memset(ready_queue_tails, 0, sizeof(ready_queue_tails));
-    sleep_queue = NULL;
     blocked_queue = NULL;
-    
-    // Clear statistics
-    memset(&stats, 0, sizeof(stats));
+    threads_sleeping = 0;
+    threads_blocked = 0;
     
     // Initialize thread subsystem
     thread_init();
     
-    // Create idle thread
-    idle_thread = thread_create_priority("idle", idle_thread_entry, NULL, PRIORITY_IDLE);
-    if (!idle_thread) {
-        DEBUG_ERROR("Failed to create idle thread!\n");
+    // The BSP's scheduler instance; APs are added by scheduler_init_cpu()
+    if (init_cpu_sched(0) != 0) {
         return;
     }
     
-    // Idle thread doesn't go in ready queue - it's the fallback
-    idle_thread->state = THREAD_STATE_READY;
-    
     // Current "thread" is the bootstrap kernel
     // We'll create a proper thread for it when scheduler_start is called
     
     DEBUG_INFO("Scheduler initialized\n");
 }
 
+int scheduler_init_cpu(uint32_t cpu) {
+    if (cpu == 0 || cpu >= MAX_CPUS) {
+        return -1;
+    }
+    return init_cpu_sched(cpu);
+}
+
+// Pick the online CPU in 'affinity' with the fewest threads placed on it
+// (CPU 0 if the mask names no online CPU)
+static uint32_t least_loaded_cpu(uint32_t affinity) {
+    uint32_t best = 0;
+    uint32_t best_load = 0xFFFFFFFF;
+    
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (!smp_cpu_online(cpu) || !(affinity & (1u << cpu))) continue;
+        if (cpu_sched[cpu].nr_threads < best_load) {
+            best = cpu;
+            best_load = cpu_sched[cpu].nr_threads;
+        }
+    }
+    return best;
+}
+
+// Queue a thread on a CPU it is allowed to run on
+static void place_thread(thread_t *thread, uint32_t cpu) {
+    // Disable interrupts for queue manipulation
+    uint64_t flags = irq_save();
+    
+    thread->cpu = cpu;
+    cpu_sched_t *cs = &cpu_sched[cpu];
+    spin_lock(&cs->lock);
+    cs->nr_threads++;
+    spin_unlock(&cs->lock);
+    
+    make_ready(thread);
+    
+    irq_restore(flags);
+}
+
 void scheduler_add(thread_t *thread) {
     if (!thread) return;
     
-    // Disable interrupts for queue manipulation
-    __asm__ volatile("cli");
+    place_thread(thread, least_loaded_cpu(thread->cpu_affinity));
+}
+
+void scheduler_add_on(thread_t *thread, uint32_t cpu) {
+    if (!thread) return;
     
-    enqueue_ready(thread);
+    if (!smp_cpu_online(cpu)) {
+        DEBUG_WARN("scheduler_add_on: CPU %u is not online, using CPU 0\n", cpu);
+        cpu = 0;
+    }
     
-    __asm__ volatile("sti");
+    thread->cpu_affinity = 1u << cpu;
+    place_thread(thread, cpu);
 }
 
 void scheduler_remove(thread_t *thread) {
     if (!thread) return;
     
-    __asm__ volatile("cli");
-    
-    if (thread->state == THREAD_STATE_READY) {
-        remove_from_ready(thread);
+    cpu_sched_t *cs = &cpu_sched[thread->cpu];
+    uint64_t flags = spin_lock_irqsave(&cs->lock);
+    if (thread->state == THREAD_STATE_READY && thread != cs->idle_thread) {
+        remove_from_ready(cs, thread);
     }
+    spin_unlock_irqrestore(&cs->lock, flags);
     // TODO: remove from sleep queue if sleeping
     // TODO: remove from blocked queue if blocked
-    
-    __asm__ volatile("sti");
 }
 
+static uint32_t balance_countdown = SCHED_BALANCE_INTERVAL;
+
 void scheduler_tick(void) {
-    if (!scheduler_running || !current_thread) return;
+    if (!scheduler_running) return;
     
-    // Track idle time
-    if (current_thread == idle_thread) {
-        stats.idle_ticks++;
+    // Only the BSP receives the PIT interrupt, so it does the accounting
+    // for every CPU's running thread
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (smp_cpu_online(cpu)) {
+            tick_cpu(&cpu_sched[cpu], true);
+        }
     }
     
-    // Wake sleeping threads
-    wake_expired_sleepers();
-    
-    // Track CPU usage for current thread
-    current_thread->total_ticks++;
-    current_thread->ticks_used_this_slice++;
-    
-    // Decrement time slice
-    if (current_thread->time_slice > 0) {
-        current_thread->time_slice--;
+    // Even out queue lengths; idle CPUs also steal on their own
+    if (--balance_countdown == 0) {
+        balance_countdown = SCHED_BALANCE_INTERVAL;
+        rebalance();
     }
+}
+
+void scheduler_tick_local(void) {
+    if (!scheduler_running) return;
     
-    // Time slice expired?
-    if (current_thread->time_slice == 0 && current_thread != idle_thread) {
-        // Calculate CPU usage for this slice
-        // 100% means used the entire slice
-        uint64_t slice_len = current_thread->time_slice_length;
-        uint8_t usage = (current_thread->ticks_used_this_slice * 100) / slice_len;
-        if (usage > 100) usage = 100;
-        
-        update_cpu_usage(current_thread, usage);
-        adjust_priority(current_thread);
-        
-        // Put current thread back in ready queue
-        enqueue_ready(current_thread);
-        
-        // Set flag to reschedule - DO NOT call schedule() here!
-        // Context switching inside IRQ handler corrupts stack
-        need_reschedule = true;
+    tick_cpu(this_cpu(), false);
+    
+    // CPU 0 keeps the balancing cadence (it may skip periods while idle)
+    if (smp_cpu_id() == 0 && --balance_countdown == 0) {
+        balance_countdown = SCHED_BALANCE_INTERVAL;
+        rebalance();
     }
 }
 
+bool scheduler_has_ready(void) {
+    cpu_sched_t *cs = this_cpu();
+    return cs->stats.threads_ready > 0;
+}
+
 void scheduler_yield(void) {
-    __asm__ volatile("cli");
+    uint64_t flags = irq_save();
+    
+    cpu_sched_t *cs = this_cpu();
+    thread_t *current = cs->current_thread;
     
-    if (!scheduler_running || !current_thread) {
-        __asm__ volatile("sti");
+    if (!scheduler_running || !current) {
+        irq_restore(flags);
         return;
     }
     
-    // Clear deferred reschedule flag - we're handling it now
-    need_reschedule = false;
+    spin_lock(&cs->lock);
+    
+    // Clear deferred reschedule flag - we're handling it now. A yield that
+    // consumes an expired slice is a preemption, not the thread's choice.
+    cs->switch_involuntary = cs->need_reschedule && current != cs->idle_thread;
+    cs->need_reschedule = false;
     
     // Calculate partial CPU usage (yielded early = low usage)
-    if (current_thread != idle_thread && current_thread->time_slice_length > 0) {
-        uint8_t usage = (current_thread->ticks_used_this_slice * 100) / 
-                        current_thread->time_slice_length;
-        update_cpu_usage(current_thread, usage);
-        adjust_priority(current_thread);
+    if (current != cs->idle_thread) {
+        update_cpu_usage(current, slice_usage(current, timer_get_ns()));
+        adjust_priority(cs, current);
+    }
+    
+    // Deadline threads pay for this run before re-queueing, so one that
+    // just used up its budget is parked instead of picked again
+    if (current->sched_class == SCHED_CLASS_DEADLINE) {
+        charge_runtime(current, timer_get_ns());
     }
     
     // Current thread goes back to ready queue (unless terminated)
-    if (current_thread->state != THREAD_STATE_TERMINATED) {
-        enqueue_ready(current_thread);
+    if (current->state == THREAD_STATE_TERMINATED) {
+        cs->nr_threads--;
+        if (current->sched_class == SCHED_CLASS_DEADLINE) {
+            dl_release(current);
+        }
+    } else if (current != cs->idle_thread) {
+        enqueue_ready(cs, current);
     }
     
     // Pick next thread (interrupts re-enabled by context switch)
-    schedule();
+    schedule(cs);
     
     // We return here when this thread is scheduled again
-    __asm__ volatile("sti");
+    irq_restore(flags);
 }
 
 void scheduler_block(thread_t *thread) {
-    __asm__ volatile("cli");
+    uint64_t flags = irq_save();
     
+    spin_lock(&sleep_lock);
     thread->state = THREAD_STATE_BLOCKED;
-    stats.threads_blocked++;
+    threads_blocked++;
+    spin_unlock(&sleep_lock);
     
     // If blocking current thread, need to switch
-    if (thread == current_thread) {
-        schedule();
+    cpu_sched_t *cs = this_cpu();
+    if (thread == cs->current_thread) {
+        spin_lock(&cs->lock);
+        schedule(cs);
+    }
+    
+    irq_restore(flags);
+}
+
+// Wake a blocked thread. The state leaves BLOCKED under sleep_lock, so a
+// racing scheduler_block_cancel() always sees the wakeup. Returns false if
+// the thread was not blocked. Must be called with interrupts disabled.
+static bool unblock_thread(thread_t *thread, bool timed_out) {
+    spin_lock(&sleep_lock);
+    bool was_blocked = (thread->state == THREAD_STATE_BLOCKED);
+    if (was_blocked) {
+        thread->state = THREAD_STATE_READY;
+        thread->wait_timed_out = timed_out;
+        threads_blocked--;
     }
+    spin_unlock(&sleep_lock);
     
-    __asm__ volatile("sti");
+    if (was_blocked) {
+        make_ready(thread);
+    }
+    return was_blocked;
+}
+
+// Timer wheel callback: a blocked thread's timeout has arrived
+static void block_timer_expired(void *arg) {
+    unblock_thread((thread_t *)arg, true);
 }
 
 void scheduler_unblock(thread_t *thread) {
-    __asm__ volatile("cli");
+    // Safe from interrupt handlers (wait queue wakeups)
+    uint64_t flags = irq_save();
+    unblock_thread(thread, false);
+    irq_restore(flags);
+}
+
+void scheduler_block_prepare(void) {
+    thread_t *current = this_cpu()->current_thread;
+    
+    spin_lock(&sleep_lock);
+    current->state = THREAD_STATE_BLOCKED;
+    current->wait_timed_out = false;
+    threads_blocked++;
+    spin_unlock(&sleep_lock);
+}
+
+void scheduler_block_commit(void) {
+    cpu_sched_t *cs = this_cpu();
+    spin_lock(&cs->lock);
+    schedule(cs);
+}
+
+bool scheduler_block_commit_timeout(uint64_t expires) {
+    thread_t *current = this_cpu()->current_thread;
+    
+    ktimer_setup(&current->sleep_timer, block_timer_expired, current);
+    ktimer_add(&current->sleep_timer, expires);
     
-    if (thread->state == THREAD_STATE_BLOCKED) {
-        stats.threads_blocked--;
-        enqueue_ready(thread);
+    cpu_sched_t *cs = this_cpu();
+    spin_lock(&cs->lock);
+    schedule(cs);
+    
+    // Woken by someone else first: the timer must not fire later, and an
+    // expiry already running must finish before the next wait re-arms it
+    ktimer_cancel_sync(&current->sleep_timer);
+    return !current->wait_timed_out;
+}
+
+void scheduler_block_cancel(void) {
+    cpu_sched_t *cs = this_cpu();
+    thread_t *current = cs->current_thread;
+    
+    spin_lock(&sleep_lock);
+    bool still_blocked = (current->state == THREAD_STATE_BLOCKED);
+    if (still_blocked) {
+        current->state = THREAD_STATE_RUNNING;
+        threads_blocked--;
     }
+    spin_unlock(&sleep_lock);
     
-    __asm__ volatile("sti");
+    if (!still_blocked) {
+        // A wakeup already queued us; schedule() takes us back off the
+        // ready queue (usually without switching)
+        spin_lock(&cs->lock);
+        schedule(cs);
+    }
 }
 
 void scheduler_sleep(thread_t *thread, uint64_t wake_time) {
-    __asm__ volatile("cli");
+    uint64_t flags = irq_save();
     
+    spin_lock(&sleep_lock);
     thread->wake_time = wake_time;
-    enqueue_sleep(thread);
+    thread->state = THREAD_STATE_SLEEPING;
+    threads_sleeping++;
+    spin_unlock(&sleep_lock);
+    
+    // O(1) insert; the wheel calls sleep_timer_expired() at wake_time
+    ktimer_setup(&thread->sleep_timer, sleep_timer_expired, thread);
+    ktimer_add(&thread->sleep_timer, wake_time);
     
     // If sleeping current thread, need to switch
-    if (thread == current_thread) {
-        schedule();
+    cpu_sched_t *cs = this_cpu();
+    if (thread == cs->current_thread) {
+        spin_lock(&cs->lock);
+        schedule(cs);
     }
     
-    __asm__ volatile("sti");
+    irq_restore(flags);
 }
 
-void scheduler_start(void) {
-    DEBUG_INFO("Starting scheduler...\n");
-    
-    __asm__ volatile("cli");
-    
-    scheduler_running = true;
+// Start running threads on the calling CPU. Never returns.
+static void __attribute__((noreturn)) start_this_cpu(void) {
+    cpu_sched_t *cs = this_cpu();
     
     // Pick first thread to run
-    thread_t *first = pick_next_thread();
+    spin_lock(&cs->lock);
+    thread_t *first = pick_next_thread(cs);
     if (!first) {
-        first = idle_thread;
+        first = cs->idle_thread;
     }
     
     first->state = THREAD_STATE_RUNNING;
-    current_thread = first;
-    first->slice_start_ticks = timer_get_ticks();
+    first->on_cpu = true;
+    cs->current_thread = first;
+    first->slice_start_ns = timer_get_ns();
+    first->switch_in_tsc = rdtsc();
+    spin_unlock(&cs->lock);
     
     // Update TSS
     uint64_t stack_top = first->kernel_stack_base + first->kernel_stack_size;
     gdt_set_kernel_stack(stack_top);
     
-    DEBUG_INFO("First thread: '%s' (TID=%d)\n", first->name, first->tid);
+    DEBUG_INFO("CPU %u first thread: '%s' (TID=%d)\n", smp_cpu_id(), first->name, first->tid);
+    
+    // Per-CPU LAPIC tick, if the high-resolution timers came up
+    timer_start_cpu();
     
     // Jump to first thread - this is a one-way switch
     // We set up a fake "previous" thread that we don't care about saving
-    static thread_t bootstrap_thread;
-    memset(&bootstrap_thread, 0, sizeof(bootstrap_thread));
-    bootstrap_thread.rsp = 0;  // Won't be used
+    memset(&cs->bootstrap_thread, 0, sizeof(cs->bootstrap_thread));
+    cs->bootstrap_thread.rsp = 0;  // Won't be used
     
     // This will "return" to the first thread's entry point
-    context_switch(&bootstrap_thread, first);
+    context_switch(&cs->bootstrap_thread, first);
     
     // Should never reach here
     while (1) {
@@ -447,51 +1162,104 @@ void scheduler_start(void) {
     }
 }
 
+void scheduler_start(void) {
+    DEBUG_INFO("Starting scheduler...\n");
+    
+    __asm__ volatile("cli");
+    
+    // Releases the APs waiting in scheduler_start_ap()
+    __atomic_store_n(&scheduler_running, true, __ATOMIC_RELEASE);
+    
+    start_this_cpu();
+}
+
+void scheduler_start_ap(void) {
+    __asm__ volatile("cli");
+    
+    while (!__atomic_load_n(&scheduler_running, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile("pause");
+    }
+    
+    start_this_cpu();
+}
+
 bool scheduler_is_running(void) {
     return scheduler_running;
 }
 
 void scheduler_get_stats(scheduler_stats_t *out_stats) {
-    if (out_stats) {
-        *out_stats = stats;
+    if (!out_stats) return;
+    
+    // Sum the per-CPU counters
+    memset(out_stats, 0, sizeof(*out_stats));
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        scheduler_stats_t *s = &cpu_sched[cpu].stats;
+        out_stats->total_switches += s->total_switches;
+        out_stats->threads_ready += s->threads_ready;
+        out_stats->priority_boosts += s->priority_boosts;
+        out_stats->priority_demotions += s->priority_demotions;
+        out_stats->idle_ticks += s->idle_ticks;
+        out_stats->threads_stolen += s->threads_stolen;
+        out_stats->threads_migrated += s->threads_migrated;
+        out_stats->dl_util_ppm += s->dl_util_ppm;
+        out_stats->dl_throttles += s->dl_throttles;
     }
+    out_stats->threads_sleeping = threads_sleeping;
+    out_stats->threads_blocked = threads_blocked;
+}
+
+bool scheduler_get_cpu_stats(uint32_t cpu, scheduler_stats_t *out_stats) {
+    if (!out_stats || cpu >= smp_cpu_count()) {
+        return false;
+    }
+    *out_stats = cpu_sched[cpu].stats;
+    return true;
 }
 
 void scheduler_print_threads(void) {
     DEBUG_INFO("=== Thread List ===\n");
-    DEBUG_INFO("Current: %s (TID=%d)\n", 
-               current_thread ? current_thread->name : "none",
-               current_thread ? current_thread->tid : 0);
-    
-    DEBUG_INFO("Ready queues:\n");
-    for (int p = 0; p < PRIORITY_LEVELS; p++) {
-        if (ready_queue_heads[p]) {
-            DEBUG_INFO("  Priority %d:\n", p);
-            thread_t *t = ready_queue_heads[p];
-            while (t) {
-                DEBUG_INFO("    - %s (TID=%d, CPU=%d%%)\n", 
-                          t->name, t->tid, t->avg_cpu_usage);
-                t = t->next;
-            }
-        }
-    }
     
-    if (sleep_queue) {
-        DEBUG_INFO("Sleep queue:\n");
-        thread_t *t = sleep_queue;
-        while (t) {
-            DEBUG_INFO("  - %s (TID=%d, wake@%lu)\n", 
-                      t->name, t->tid, t->wake_time);
-            t = t->next;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        cpu_sched_t *cs = &cpu_sched[cpu];
+        if (!smp_cpu_online(cpu)) continue;
+        
+        DEBUG_INFO("CPU %u current: %s (TID=%d)\n", cpu,
+                   cs->current_thread ? cs->current_thread->name : "none",
+                   cs->current_thread ? cs->current_thread->tid : 0);
+        
+        for (thread_t *t = cs->dl_head; t; t = t->next) {
+            DEBUG_INFO("  Deadline: %s (TID=%d, budget=%ldus, deadline in %ldus, misses=%u)\n",
+                       t->name, t->tid, t->dl_budget_ns / 1000,
+                       (int64_t)(t->dl_abs_deadline - timer_get_ns()) / 1000, t->dl_misses);
         }
+        
+        DEBUG_INFO("CPU %u ready queues:\n", cpu);
+        for (int p = 0; p < PRIORITY_LEVELS; p++) {
+            if (cs->ready_queue_heads[p]) {
+                DEBUG_INFO("  Priority %d:\n", p);
+                thread_t *t = cs->ready_queue_heads[p];
+                while (t) {
+                    DEBUG_INFO("    - %s (TID=%d, CPU=%d%%, run=%lums, vol=%u, invol=%u)\n", 
+                              t->name, t->tid, t->avg_cpu_usage,
+                              t->total_ns / 1000000,
+                              t->voluntary_switches, t->involuntary_switches);
+                    t = t->next;
+                }
+            }
+        }
+        
+        DEBUG_INFO("CPU %u stats: switches=%u, boosts=%u, demotes=%u, idle=%lu, stolen=%u, migrated=%u, dl=%uppm\n",
+                   cpu, cs->stats.total_switches, cs->stats.priority_boosts,
+                   cs->stats.priority_demotions, cs->stats.idle_ticks,
+                   cs->stats.threads_stolen, cs->stats.threads_migrated,
+                   cs->stats.dl_util_ppm);
     }
     
-    DEBUG_INFO("Stats: switches=%u, boosts=%u, demotes=%u\n",
-               stats.total_switches, stats.priority_boosts, 
-               stats.priority_demotions);
+    DEBUG_INFO("Sleeping: %u threads, %u kernel timers armed\n",
+               threads_sleeping, ktimer_pending_count());
 }
 
 // Get the currently running thread
 thread_t *thread_current(void) {
-    return current_thread;
+    return this_cpu()->current_thread;
 }
@@ -4,6 +4,7 @@
 #include "thread.h"
 
 // ============== Scheduler Statistics ==============
+// Kept per CPU; scheduler_get_stats() returns the sum over all CPUs
 typedef struct {
     uint32_t total_switches;        // Total context switches performed
     uint32_t threads_ready;         // Current number of ready threads
@@ -12,18 +13,43 @@ typedef struct {
     uint32_t priority_boosts;       // Number of priority boosts (I/O-bound detection)
     uint32_t priority_demotions;    // Number of priority demotions (CPU-bound detection)
     uint64_t idle_ticks;            // Ticks spent in idle thread
+    uint32_t threads_stolen;        // Threads this CPU pulled from another CPU while idle
+    uint32_t threads_migrated;      // Threads moved here by periodic rebalancing
+    uint32_t dl_util_ppm;           // Deadline reservations admitted (runtime/deadline)
+    uint32_t dl_throttles;          // Deadline threads parked for using up their budget
 } scheduler_stats_t;
 
+// Deadline class admission: the summed runtime/deadline of the threads on
+// one CPU may not exceed this, leaving the rest for normal threads
+#define SCHED_DL_MAX_UTIL_PPM   900000
+// Budgets are enforced from the tick, so shorter periods can't be honoured
+#define SCHED_DL_MIN_PERIOD_NS  10000000ULL     // 10 ticks
+#define SCHED_DL_MAX_PERIOD_NS  1000000000ULL
+
 // ============== Scheduler API ==============
 
 // Initialize the scheduler subsystem
-// Creates the idle thread and sets up data structures
+// Creates the BSP's idle thread and sets up data structures
 void scheduler_init(void);
 
-// Add a thread to the ready queue
+// Set up the scheduler instance (run queues, idle thread) for an AP
+// Called on the BSP during SMP bring-up. Returns 0 on success.
+int scheduler_init_cpu(uint32_t cpu);
+
+// Add a thread to the ready queue of the least loaded CPU in its affinity mask
 // Thread must be in CREATED or READY state
 void scheduler_add(thread_t *thread);
 
+// Add a thread to the ready queue of a specific CPU
+// Pins the thread there (affinity = that CPU only)
+void scheduler_add_on(thread_t *thread, uint32_t cpu);
+
+// Move a thread that has not been added yet into the deadline class, on
+// the online CPU in its affinity mask with the most spare reservation.
+// Returns -1 for invalid parameters or when admission fails.
+int scheduler_set_deadline(thread_t *thread, uint64_t runtime_ns,
+                           uint64_t deadline_ns, uint64_t period_ns);
+
 // Remove a thread from all scheduler queues
 void scheduler_remove(thread_t *thread);
 
@@ -31,6 +57,9 @@ void scheduler_remove(thread_t *thread);
 // Handles preemption, wakes sleeping threads, adjusts priorities
 void scheduler_tick(void);
 
+// Per-CPU tick from the LAPIC timer: accounts only the calling CPU
+void scheduler_tick_local(void);
+
 // Voluntarily yield CPU to another ready thread
 // Current thread goes back to ready queue
 void scheduler_yield(void);
@@ -43,20 +72,48 @@ void scheduler_block(thread_t *thread);
 // Thread is added back to ready queue
 void scheduler_unblock(thread_t *thread);
 
+// Two-phase blocking for wait queues, all with interrupts disabled:
+// prepare marks the running thread blocked; the caller then publishes
+// itself to a waker and either commits (switch away until unblocked, or
+// until tick 'expires' - returns false on timeout) or cancels (keep
+// running). An unblock that lands between prepare and commit is not lost.
+void scheduler_block_prepare(void);
+void scheduler_block_commit(void);
+bool scheduler_block_commit_timeout(uint64_t expires);
+void scheduler_block_cancel(void);
+
 // Put a thread to sleep until wake_time (in timer ticks)
 void scheduler_sleep(thread_t *thread, uint64_t wake_time);
 
 // Start the scheduler
-// Picks the first ready thread and switches to it
+// Picks the first ready thread and switches to it, and releases the APs
 // This function never returns
 void scheduler_start(void) __attribute__((noreturn));
 
+// AP side of scheduler_start(): waits for the BSP, then runs this CPU's threads
+void scheduler_start_ap(void) __attribute__((noreturn));
+
+// Whether the calling CPU has threads waiting in its ready queues
+bool scheduler_has_ready(void);
+
+// Idle CPUs: pull one ready thread from the busiest CPU's lowest-priority
+// queues onto this CPU. Returns true if a thread was stolen.
+// Must be called with interrupts disabled.
+bool scheduler_try_steal(void);
+
+// Called on the new thread right after a context switch (also from
+// thread_entry_wrapper) to mark the previous thread as switched out
+void scheduler_finish_switch(void);
+
 // Check if scheduler is running
 bool scheduler_is_running(void);
 
-// Get scheduler statistics
+// Get scheduler statistics (summed over all CPUs)
 void scheduler_get_stats(scheduler_stats_t *stats);
 
+// Get one CPU's scheduler statistics. Returns false for an unknown CPU.
+bool scheduler_get_cpu_stats(uint32_t cpu, scheduler_stats_t *stats);
+
 // Debug: Print all threads and their states
 void scheduler_print_threads(void);
 
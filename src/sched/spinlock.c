@@ -0,0 +1,43 @@
+#include "spinlock.h"
+
+#ifdef LOCK_STATS
+
+// Every named lock that has been taken at least once
+static spinlock_t *registered_locks = NULL;
+
+void spinlock_stats_register(spinlock_t *lock) {
+    if (__atomic_exchange_n(&lock->registered, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    
+    // Lock-free push: this runs inside spin_lock(), so it can't take a lock
+    spinlock_t *head = __atomic_load_n(&registered_locks, __ATOMIC_RELAXED);
+    do {
+        lock->stats_next = head;
+    } while (!__atomic_compare_exchange_n(&registered_locks, &head, lock, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+spinlock_t *spinlock_stats_first(void) {
+    return __atomic_load_n(&registered_locks, __ATOMIC_ACQUIRE);
+}
+
+void spinlock_stats_reset(void) {
+    for (spinlock_t *lock = spinlock_stats_first(); lock; lock = lock->stats_next) {
+        lock->acquisitions = 0;
+        lock->contended = 0;
+        lock->spins = 0;
+        lock->max_hold_cycles = 0;
+    }
+}
+
+#else
+
+spinlock_t *spinlock_stats_first(void) {
+    return NULL;
+}
+
+void spinlock_stats_reset(void) {
+}
+
+#endif // LOCK_STATS
@@ -0,0 +1,154 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "../timer/tsc.h"
+
+// FIFO ticket spinlock: waiters are served in arrival order, so no CPU can
+// starve under contention. Callers that can race with an interrupt handler
+// taking the same lock must use the _irqsave variants (or disable
+// interrupts themselves).
+//
+// LOCK_STATS builds also count acquisitions, contended acquisitions, spin
+// iterations and the longest hold time (TSC cycles) of every named lock.
+// Name only locks with static lifetime: they stay on a global list.
+typedef struct spinlock {
+    volatile uint16_t owner;        // Ticket being served
+    volatile uint16_t next;         // Next ticket to hand out
+#ifdef LOCK_STATS
+    const char *name;               // NULL = not tracked
+    uint64_t acquisitions;
+    uint64_t contended;             // Acquisitions that had to wait
+    uint64_t spins;                 // pause iterations spent waiting
+    uint64_t max_hold_cycles;
+    uint64_t hold_start;            // TSC when the current holder got it
+    struct spinlock *stats_next;    // Registered-lock list
+    volatile uint32_t registered;
+#endif
+} spinlock_t;
+
+#ifdef LOCK_STATS
+#define SPINLOCK_INIT_NAMED(n)  { .owner = 0, .next = 0, .name = (n) }
+#else
+#define SPINLOCK_INIT_NAMED(n)  { .owner = 0, .next = 0 }
+#endif
+#define SPINLOCK_INIT           SPINLOCK_INIT_NAMED(NULL)
+
+#ifdef LOCK_STATS
+// Add a named lock to the list walked by spinlock_stats_first() (once)
+void spinlock_stats_register(spinlock_t *lock);
+#endif
+
+// First tracked lock (follow ->stats_next), NULL if none or LOCK_STATS is off
+spinlock_t *spinlock_stats_first(void);
+
+// Clear the counters of every tracked lock
+void spinlock_stats_reset(void);
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->owner = 0;
+    lock->next = 0;
+}
+
+static inline void spin_lock_init_named(spinlock_t *lock, const char *name) {
+    spin_lock_init(lock);
+#ifdef LOCK_STATS
+    lock->name = name;
+#else
+    (void)name;
+#endif
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+#ifdef LOCK_STATS
+    uint64_t spins = 0;
+#endif
+    // Spin on a plain read so the cache line stays shared while we wait
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ volatile("pause");
+#ifdef LOCK_STATS
+        spins++;
+#endif
+    }
+#ifdef LOCK_STATS
+    if (lock->name) {
+        if (!lock->registered) {
+            spinlock_stats_register(lock);
+        }
+        lock->acquisitions++;
+        if (spins) {
+            lock->contended++;
+            lock->spins += spins;
+        }
+        lock->hold_start = rdtsc();
+    }
+#endif
+}
+
+// Take the lock only if it is free. Returns true on success.
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint16_t expected = owner;
+    // Free means no outstanding tickets; grab the next one atomically
+    if (!__atomic_compare_exchange_n(&lock->next, &expected, (uint16_t)(owner + 1),
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+#ifdef LOCK_STATS
+    if (lock->name) {
+        if (!lock->registered) {
+            spinlock_stats_register(lock);
+        }
+        lock->acquisitions++;
+        lock->hold_start = rdtsc();
+    }
+#endif
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+#ifdef LOCK_STATS
+    if (lock->name) {
+        uint64_t held = rdtsc() - lock->hold_start;
+        if (held > lock->max_hold_cycles) {
+            lock->max_hold_cycles = held;
+        }
+    }
+#endif
+    // Only the holder writes owner, so a plain increment is enough
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+// Disable interrupts, returning the previous RFLAGS for irq_restore()
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Restore the interrupt state saved by irq_save()
+static inline void irq_restore(uint64_t flags) {
+    __asm__ volatile("push %0; popfq" :: "r"(flags) : "memory", "cc");
+}
+
+// Lock with interrupts disabled; returns the interrupt state to restore
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif // SPINLOCK_H
@@ -90,6 +90,9 @@ context_switch:
 # =============================================================================
 
 thread_entry_wrapper:
+    # Release the thread we switched away from (clears its on_cpu flag)
+    call scheduler_finish_switch
+    
     # Enable interrupts now that we're in the new thread
     sti
     
@@ -0,0 +1,130 @@
+#include "sync.h"
+#include "scheduler.h"
+
+// Spin iterations before a contended mutex_lock() goes to sleep
+#define MUTEX_SPIN_LIMIT    1000
+
+// ============== Mutex ==============
+
+void mutex_init(mutex_t *mutex) {
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    wait_queue_init(&mutex->waiters);
+}
+
+bool mutex_trylock(mutex_t *mutex) {
+    if (__atomic_exchange_n(&mutex->locked, 1, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    mutex->owner = thread_current();
+    return true;
+}
+
+void mutex_lock(mutex_t *mutex) {
+    while (!mutex_trylock(mutex)) {
+        // An owner that is running will likely release soon; one that is
+        // switched out won't, so don't burn the CPU waiting for it
+        for (int i = 0; i < MUTEX_SPIN_LIMIT && mutex->locked; i++) {
+            thread_t *owner = mutex->owner;
+            if (owner && !owner->on_cpu) {
+                break;
+            }
+            __asm__ volatile("pause");
+        }
+        
+        wait_event(&mutex->waiters, !mutex->locked);
+    }
+}
+
+void mutex_unlock(mutex_t *mutex) {
+    mutex->owner = NULL;
+    __atomic_store_n(&mutex->locked, 0, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&mutex->waiters);
+}
+
+// ============== Semaphore ==============
+
+void sem_init(semaphore_t *sem, int32_t count) {
+    sem->count = count;
+    wait_queue_init(&sem->waiters);
+}
+
+bool sem_trywait(semaphore_t *sem) {
+    int32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void sem_wait(semaphore_t *sem) {
+    while (!sem_trywait(sem)) {
+        wait_event(&sem->waiters, sem->count > 0);
+    }
+}
+
+bool sem_wait_timeout(semaphore_t *sem, uint32_t timeout_ms) {
+    uint64_t deadline = timer_get_ticks() + timeout_ms;
+    while (!sem_trywait(sem)) {
+        uint64_t now = timer_get_ticks();
+        if (now >= deadline ||
+            !wait_event_timeout(&sem->waiters, sem->count > 0, deadline - now)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sem_post(semaphore_t *sem) {
+    __atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&sem->waiters);
+}
+
+// ============== Condition Variable ==============
+
+void cond_init(condvar_t *cond) {
+    wait_queue_init(&cond->waiters);
+}
+
+void cond_wait(condvar_t *cond, mutex_t *mutex) {
+    if (!wait_queue_can_sleep()) {
+        // No scheduler yet: a spurious wakeup is the best we can do
+        mutex_unlock(mutex);
+        __asm__ volatile("pause");
+        mutex_lock(mutex);
+        return;
+    }
+    
+    // Queue up before dropping the mutex so a signal in between isn't lost
+    uint64_t flags = wait_queue_prepare(&cond->waiters);
+    mutex_unlock(mutex);
+    wait_queue_commit(&cond->waiters, flags);
+    mutex_lock(mutex);
+}
+
+bool cond_wait_timeout(condvar_t *cond, mutex_t *mutex, uint32_t timeout_ms) {
+    if (!wait_queue_can_sleep()) {
+        mutex_unlock(mutex);
+        __asm__ volatile("pause");
+        mutex_lock(mutex);
+        return true;
+    }
+    
+    uint64_t expires = timer_get_ticks() + timeout_ms;
+    uint64_t flags = wait_queue_prepare(&cond->waiters);
+    mutex_unlock(mutex);
+    bool woken = wait_queue_commit_timeout(&cond->waiters, flags, expires);
+    mutex_lock(mutex);
+    return woken;
+}
+
+void cond_signal(condvar_t *cond) {
+    wait_queue_wake_one(&cond->waiters);
+}
+
+void cond_broadcast(condvar_t *cond) {
+    wait_queue_wake_all(&cond->waiters);
+}
@@ -0,0 +1,75 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "waitqueue.h"
+
+// Sleeping locks built on wait queues. Only threads may block on these;
+// interrupt handlers may use the try/post/signal operations.
+
+// ============== Mutex ==============
+
+typedef struct {
+    volatile uint32_t locked;
+    thread_t *owner;
+    wait_queue_t waiters;
+} mutex_t;
+
+#define MUTEX_INIT { 0, NULL, WAIT_QUEUE_INIT }
+
+void mutex_init(mutex_t *mutex);
+
+// Acquire, spinning briefly while the owner is running on another CPU and
+// sleeping otherwise
+void mutex_lock(mutex_t *mutex);
+
+// Acquire without waiting. Returns true on success.
+bool mutex_trylock(mutex_t *mutex);
+
+void mutex_unlock(mutex_t *mutex);
+
+// ============== Semaphore ==============
+
+typedef struct {
+    volatile int32_t count;
+    wait_queue_t waiters;
+} semaphore_t;
+
+#define SEMAPHORE_INIT(n) { (n), WAIT_QUEUE_INIT }
+
+void sem_init(semaphore_t *sem, int32_t count);
+
+// Take one unit, sleeping while the count is zero
+void sem_wait(semaphore_t *sem);
+
+// Take one unit if available. Returns true on success.
+bool sem_trywait(semaphore_t *sem);
+
+// Take one unit, giving up after timeout_ms. Returns true on success.
+bool sem_wait_timeout(semaphore_t *sem, uint32_t timeout_ms);
+
+// Release one unit and wake a waiter
+void sem_post(semaphore_t *sem);
+
+// ============== Condition Variable ==============
+
+typedef struct {
+    wait_queue_t waiters;
+} condvar_t;
+
+#define CONDVAR_INIT { WAIT_QUEUE_INIT }
+
+void cond_init(condvar_t *cond);
+
+// Atomically release 'mutex' and sleep until signalled, then re-acquire it.
+// Wakeups may be spurious: always wait in a loop on the predicate.
+void cond_wait(condvar_t *cond, mutex_t *mutex);
+
+// As cond_wait(), giving up after timeout_ms. Returns false on timeout.
+bool cond_wait_timeout(condvar_t *cond, mutex_t *mutex, uint32_t timeout_ms);
+
+void cond_signal(condvar_t *cond);
+void cond_broadcast(condvar_t *cond);
+
+#endif // SYNC_H
@@ -0,0 +1,249 @@
+#include "taskpool.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "spinlock.h"
+#include "../smp/smp.h"
+#include "../debug/debug.h"
+
+typedef struct {
+    spinlock_t lock;
+    task_t *head;                   // FIFO of queued tasks
+    task_t *tail;
+    thread_t *worker;
+    taskpool_stats_t stats;
+} taskpool_cpu_t;
+
+static taskpool_cpu_t pool_cpus[MAX_CPUS];
+
+// Idle workers sleep here until something is queued anywhere
+static wait_queue_t pool_waiters = WAIT_QUEUE_INIT;
+static volatile uint32_t queued_tasks = 0;
+
+static uint32_t worker_count = 0;
+static bool pool_running = false;
+
+static void queue_push(taskpool_cpu_t *pc, task_t *task) {
+    task->next = NULL;
+    uint64_t flags = spin_lock_irqsave(&pc->lock);
+    if (pc->tail) {
+        pc->tail->next = task;
+    } else {
+        pc->head = task;
+    }
+    pc->tail = task;
+    __atomic_add_fetch(&queued_tasks, 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&pc->lock, flags);
+}
+
+static task_t *queue_pop(taskpool_cpu_t *pc) {
+    // Unlocked peek so thieves don't bounce every empty queue's lock
+    if (!__atomic_load_n(&pc->head, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pc->lock);
+    task_t *task = pc->head;
+    if (task) {
+        pc->head = task->next;
+        if (!pc->head) {
+            pc->tail = NULL;
+        }
+        __atomic_sub_fetch(&queued_tasks, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock_irqrestore(&pc->lock, flags);
+    return task;
+}
+
+// A queued task from our own CPU's queue, else stolen from the next CPU
+// that has one
+static task_t *take_task(uint32_t self, bool *stolen) {
+    if (!__atomic_load_n(&queued_tasks, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    task_t *task = queue_pop(&pool_cpus[self]);
+    *stolen = false;
+    for (uint32_t i = 1; !task && i < MAX_CPUS; i++) {
+        task = queue_pop(&pool_cpus[(self + i) % MAX_CPUS]);
+        *stolen = task != NULL;
+    }
+    return task;
+}
+
+static void run_task(task_t *task) {
+    __atomic_store_n(&task->state, TASK_RUNNING, __ATOMIC_RELAXED);
+    task->result = task->fn(task->arg);
+    __atomic_store_n(&task->state, TASK_DONE, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&task->waiters);
+
+    // From here the joiner may return and reuse or free the task
+    __atomic_store_n(&task->state, TASK_RELEASED, __ATOMIC_RELEASE);
+}
+
+static void worker_entry(void *arg) {
+    uint32_t cpu = (uint32_t)(uintptr_t)arg;
+    taskpool_cpu_t *pc = &pool_cpus[cpu];
+
+    while (1) {
+        wait_event(&pool_waiters, __atomic_load_n(&queued_tasks, __ATOMIC_ACQUIRE) != 0);
+
+        bool stolen;
+        task_t *task = take_task(cpu, &stolen);
+        if (!task) {
+            // Another worker or a joiner got there first
+            continue;
+        }
+        run_task(task);
+        pc->stats.executed++;
+        if (stolen) {
+            pc->stats.stolen++;
+        }
+
+        // Bulk tasks can keep coming; let the rest of this CPU run in between
+        thread_yield();
+    }
+}
+
+int taskpool_init(void) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        taskpool_cpu_t *pc = &pool_cpus[cpu];
+        spin_lock_init_named(&pc->lock, "taskpool");
+        if (!smp_cpu_online(cpu)) {
+            continue;
+        }
+
+        char name[] = "kpool/00";
+        name[6] = '0' + cpu / 10;
+        name[7] = '0' + cpu % 10;
+
+        pc->worker = thread_create(name, worker_entry, (void *)(uintptr_t)cpu);
+        if (!pc->worker) {
+            DEBUG_ERROR("taskpool: failed to create worker for CPU %u\n", cpu);
+            break;
+        }
+        scheduler_add_on(pc->worker, cpu);
+        worker_count++;
+    }
+
+    pool_running = worker_count > 0;
+    DEBUG_INFO("taskpool: %u workers started\n", worker_count);
+    return pool_running ? 0 : -1;
+}
+
+uint32_t taskpool_workers(void) {
+    return pool_running && scheduler_is_running() ? worker_count : 1;
+}
+
+void task_submit(task_t *task, task_fn_t fn, void *arg) {
+    task->fn = fn;
+    task->arg = arg;
+    task->result = NULL;
+    wait_queue_init(&task->waiters);
+
+    // No workers to hand it to (yet): just run it
+    if (!pool_running || !scheduler_is_running()) {
+        run_task(task);
+        return;
+    }
+
+    __atomic_store_n(&task->state, TASK_QUEUED, __ATOMIC_RELAXED);
+    uint64_t flags = irq_save();
+    queue_push(&pool_cpus[smp_cpu_id()], task);
+    irq_restore(flags);
+    wait_queue_wake_one(&pool_waiters);
+}
+
+void *task_join(task_t *task) {
+    while (!task_done(task)) {
+        // Run queued work instead of sleeping; that may well be this task
+        bool stolen;
+        uint32_t self = smp_cpu_id();
+        task_t *other = take_task(self, &stolen);
+        if (other) {
+            run_task(other);
+            pool_cpus[self].stats.helped++;
+            continue;
+        }
+        wait_event(&task->waiters, task_done(task));
+    }
+
+    while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_RELEASED) {
+        __asm__ volatile("pause");
+    }
+    task->state = TASK_IDLE;
+    return task->result;
+}
+
+typedef struct {
+    parallel_fn_t fn;
+    void *arg;
+    size_t end;
+    size_t chunk;
+    volatile size_t next;           // Start of the next unclaimed piece
+} parallel_job_t;
+
+// Claim and run pieces until the range is used up
+static void run_pieces(parallel_job_t *job) {
+    while (1) {
+        size_t begin = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if (begin >= job->end) {
+            return;
+        }
+        size_t stop = job->end - begin < job->chunk ? job->end : begin + job->chunk;
+        job->fn(begin, stop, job->arg);
+    }
+}
+
+static void *parallel_helper(void *arg) {
+    run_pieces((parallel_job_t *)arg);
+    return NULL;
+}
+
+void parallel_for(size_t start, size_t end, size_t chunk, parallel_fn_t fn, void *arg) {
+    if (start >= end || !fn) {
+        return;
+    }
+
+    size_t count = end - start;
+    uint32_t workers = taskpool_workers();
+    if (chunk == 0) {
+        chunk = count / ((size_t)workers * TASKPOOL_CHUNKS_PER_WORKER);
+        if (chunk == 0) {
+            chunk = 1;
+        }
+    }
+    size_t pieces = count / chunk + (count % chunk != 0);
+
+    parallel_job_t job = {
+        .fn = fn,
+        .arg = arg,
+        .end = end,
+        .chunk = chunk,
+        .next = start,
+    };
+
+    // Pieces are claimed dynamically, so one helper per other worker is
+    // enough; the caller takes part too
+    task_t helpers[MAX_CPUS];
+    uint32_t n = workers - 1;
+    if (n > pieces - 1) {
+        n = (uint32_t)(pieces - 1);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        task_submit(&helpers[i], parallel_helper, &job);
+    }
+
+    run_pieces(&job);
+
+    for (uint32_t i = 0; i < n; i++) {
+        task_join(&helpers[i]);
+    }
+}
+
+bool taskpool_get_stats(uint32_t cpu, taskpool_stats_t *stats) {
+    if (cpu >= MAX_CPUS || !stats) {
+        return false;
+    }
+    *stats = pool_cpus[cpu].stats;
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "waitqueue.h"
+
+// Kernel thread pool for CPU-parallel bulk work. One pinned worker per
+// online CPU runs tasks from its CPU's queue and, once that is empty,
+// steals from the others. Tasks are queued on the submitting CPU, so work
+// starts local and spreads out only when other workers are idle.
+//
+// A task_t is both the work item and its future: task_join() waits for it
+// and returns its result. Joining runs other queued tasks while the joined
+// task is still pending, so tasks may themselves submit and join (nested
+// parallel_for) without tying up every worker.
+
+// parallel_for() with chunk 0 cuts the range into this many pieces per
+// worker, so uneven pieces still balance out
+#define TASKPOOL_CHUNKS_PER_WORKER  4
+
+typedef void *(*task_fn_t)(void *arg);
+
+enum {
+    TASK_IDLE = 0,          // Never submitted, or joined
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_DONE,              // Result published, waiters being woken
+    TASK_RELEASED           // Pool no longer touches the task
+};
+
+// Caller-owned; must stay valid until task_join() returns
+typedef struct task {
+    task_fn_t fn;
+    void *arg;
+    void *result;
+    struct task *next;
+    volatile uint32_t state;
+    wait_queue_t waiters;
+} task_t;
+
+// Per-CPU counters
+typedef struct {
+    uint64_t executed;      // Tasks run by this CPU's worker
+    uint64_t stolen;        // Of those, taken from another CPU's queue
+    uint64_t helped;        // Tasks run by joiners on this CPU
+} taskpool_stats_t;
+
+// Start one worker per online CPU. Call after smp_init() and before
+// scheduler_start(). Until the scheduler runs, tasks run inline.
+int taskpool_init(void);
+
+// Number of workers (1 if the pool isn't running)
+uint32_t taskpool_workers(void);
+
+// Queue fn(arg) on the calling CPU's queue. The task must not be in flight
+// (never submitted, or joined). Before the pool runs, fn runs right here.
+void task_submit(task_t *task, task_fn_t fn, void *arg);
+
+// Whether the task's result is available
+static inline bool task_done(const task_t *task) {
+    return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) >= TASK_DONE;
+}
+
+// Wait for the task and return what its function returned. The task may
+// be submitted again afterwards.
+void *task_join(task_t *task);
+
+// fn(begin, end, arg) over [start, end) in pieces of 'chunk' items
+// (0: split evenly over the workers), run by the caller and the pool
+// together. Returns once every piece has finished.
+typedef void (*parallel_fn_t)(size_t begin, size_t end, void *arg);
+void parallel_for(size_t start, size_t end, size_t chunk, parallel_fn_t fn, void *arg);
+
+// Counters for one CPU. Returns false for an invalid CPU.
+bool taskpool_get_stats(uint32_t cpu, taskpool_stats_t *stats);
+
+#endif // TASKPOOL_H
@@ -1,12 +1,18 @@
 #include "thread.h"
+#include "kstack.h"
+#include "fpu.h"
+#include "spinlock.h"
 #include "../memory/pmm.h"
 #include "../memory/vmm.h"
 #include "../debug/debug.h"
 #include "../gdt/gdt.h"
+#include "../timer/tsc.h"
 #include <string.h>
 
 // Thread table - all threads in the system
 static thread_t *all_threads[MAX_THREADS];
+// Guards all_threads against reaping while thread_get_stats() reads it
+static spinlock_t thread_table_lock = SPINLOCK_INIT_NAMED("thread.table");
 static uint32_t next_tid = 1;
 
 // Forward declaration of scheduler functions
@@ -65,24 +71,23 @@ thread_t *thread_create_priority(const char *name, thread_entry_t entry,
     
     // Allocate thread structure
     // For simplicity, allocate from physical pages and use HHDM
-    void *thread_page = physical_alloc_page();
+    void *thread_page = physical_alloc_zeroed_page();
     if (!thread_page) {
         DEBUG_ERROR("thread_create: failed to allocate thread structure\n");
         return NULL;
     }
     thread_t *thread = (thread_t *)PHYS_TO_HHDM((uint64_t)thread_page);
-    memset(thread, 0, sizeof(thread_t));
     
-    // Allocate kernel stack (2 pages = 8KB)
-    void *stack_pages = physical_alloc_pages(KERNEL_STACK_SIZE / 4096);
-    if (!stack_pages) {
+    // Take a guarded kernel stack from the pool
+    uint64_t stack_base = kstack_alloc();
+    if (!stack_base) {
         DEBUG_ERROR("thread_create: failed to allocate kernel stack\n");
         physical_free_page(thread_page);
         return NULL;
     }
     
-    // Assign TID
-    thread->tid = next_tid++;
+    // Assign TID (threads are created from parallel boot tasks too)
+    thread->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
     
     // Copy name (simple implementation to avoid strncpy dependency)
     size_t i;
@@ -95,8 +100,8 @@ thread_t *thread_create_priority(const char *name, thread_entry_t entry,
     thread->entry = entry;
     thread->arg = arg;
     
-    // Set up stack (convert to virtual address via HHDM)
-    thread->kernel_stack_base = (uint64_t)PHYS_TO_HHDM((uint64_t)stack_pages);
+    // Set up stack
+    thread->kernel_stack_base = stack_base;
     thread->kernel_stack_size = KERNEL_STACK_SIZE;
     
     // Set priority
@@ -105,6 +110,9 @@ thread_t *thread_create_priority(const char *name, thread_entry_t entry,
     thread->time_slice_length = calculate_time_slice(priority);
     thread->time_slice = thread->time_slice_length;
     
+    // May run anywhere until told otherwise
+    thread->cpu_affinity = CPU_AFFINITY_ALL;
+    
     // Initialize CPU usage tracking
     thread->history_index = 0;
     thread->avg_cpu_usage = 50;  // Assume 50% initially
@@ -114,12 +122,14 @@ thread_t *thread_create_priority(const char *name, thread_entry_t entry,
     thread_init_stack(thread);
     
     // Add to global thread table
+    uint64_t flags = spin_lock_irqsave(&thread_table_lock);
     for (int i = 0; i < MAX_THREADS; i++) {
         if (all_threads[i] == NULL) {
             all_threads[i] = thread;
             break;
         }
     }
+    spin_unlock_irqrestore(&thread_table_lock, flags);
     
     thread->state = THREAD_STATE_CREATED;
     
@@ -134,6 +144,40 @@ thread_t *thread_create(const char *name, thread_entry_t entry, void *arg) {
     return thread_create_priority(name, entry, arg, PRIORITY_NORMAL);
 }
 
+thread_t *thread_create_deadline(const char *name, thread_entry_t entry, void *arg,
+                                 uint64_t runtime_ns, uint64_t deadline_ns,
+                                 uint64_t period_ns) {
+    extern int scheduler_set_deadline(thread_t *thread, uint64_t runtime_ns,
+                                      uint64_t deadline_ns, uint64_t period_ns);
+    
+    thread_t *thread = thread_create_priority(name, entry, arg, PRIORITY_REALTIME);
+    if (!thread) {
+        return NULL;
+    }
+    if (scheduler_set_deadline(thread, runtime_ns, deadline_ns, period_ns) != 0) {
+        thread_reap(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void thread_reap(thread_t *thread) {
+    uint64_t flags = spin_lock_irqsave(&thread_table_lock);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (all_threads[i] == thread) {
+            all_threads[i] = NULL;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&thread_table_lock, flags);
+    
+    DEBUG_INFO("Reaped thread '%s' (TID=%d)\n", thread->name, thread->tid);
+    
+    fpu_thread_free(thread);
+    kstack_free(thread->kernel_stack_base);
+    physical_free_page((void *)HHDM_TO_PHYS(thread));
+}
+
 void thread_exit(void) {
     thread_t *t = thread_current();
     if (t) {
@@ -175,6 +219,13 @@ void thread_set_priority(thread_t *thread, uint8_t priority) {
     }
 }
 
+void thread_set_affinity(thread_t *thread, uint32_t mask) {
+    if (thread && mask != 0) {
+        thread->cpu_affinity = mask;
+        DEBUG_INFO("Thread '%s' affinity set to 0x%x\n", thread->name, mask);
+    }
+}
+
 // thread_current() is defined in scheduler.c
 // We just provide thread_set_current() here
 
@@ -200,6 +251,39 @@ thread_t *thread_get_by_id(uint32_t tid) {
     return NULL;
 }
 
+int thread_get_stats(thread_stats_t *out, int max) {
+    int n = 0;
+    uint64_t flags = spin_lock_irqsave(&thread_table_lock);
+    uint64_t now = rdtsc();
+    
+    for (int i = 0; i < MAX_THREADS && n < max; i++) {
+        thread_t *t = all_threads[i];
+        if (!t) continue;
+        
+        // Counters are updated by their CPU's scheduler without this lock,
+        // so a snapshot may be a switch or two stale
+        thread_stats_t *s = &out[n++];
+        s->tid = t->tid;
+        memcpy(s->name, t->name, sizeof(s->name));
+        s->state = t->state;
+        s->priority = t->priority;
+        s->avg_cpu_usage = t->avg_cpu_usage;
+        s->cpu = t->cpu;
+        s->run_cycles = t->run_cycles;
+        uint64_t since = t->switch_in_tsc;
+        if (s->state == THREAD_STATE_RUNNING && since && now > since) {
+            s->run_cycles += now - since;
+        }
+        s->wait_max_cycles = t->wait_max_cycles;
+        s->voluntary_switches = t->voluntary_switches;
+        s->involuntary_switches = t->involuntary_switches;
+        memcpy(s->wait_hist, t->wait_hist, sizeof(s->wait_hist));
+    }
+    
+    spin_unlock_irqrestore(&thread_table_lock, flags);
+    return n;
+}
+
 const char *thread_state_name(thread_state_t state) {
     switch (state) {
         case THREAD_STATE_CREATED:    return "CREATED";
@@ -231,6 +315,12 @@ void thread_init(void) {
     // Clear thread table
     memset(all_threads, 0, sizeof(all_threads));
     
+    // Map the first batch of guarded stacks so early thread creation
+    // doesn't have to touch the page tables
+    if (kstack_init() != 0) {
+        DEBUG_WARN("Thread stack pool only partially mapped\n");
+    }
+    
     // The bootstrap "thread" (kernel main) will be set up by scheduler_init
     // current_thread is managed by scheduler.c
     
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "../timer/ktimer.h"
 
 // Thread states
 typedef enum {
@@ -31,11 +32,35 @@ typedef enum {
 #define PRIORITY_BOOST_THRESHOLD    30  // Boost if CPU usage < 30%
 #define PRIORITY_DEMOTE_THRESHOLD   80  // Demote if CPU usage > 80%
 #define MAX_THREADS             256     // Maximum concurrent threads
+#define THREAD_WAIT_BUCKETS     16      // Runqueue latency histogram buckets
+
+// Scheduling classes. Runnable deadline threads always run before any
+// thread in the priority queues.
+#define SCHED_CLASS_NORMAL      0   // Multilevel feedback queues
+#define SCHED_CLASS_DEADLINE    1   // EDF with a runtime budget per period
+
+// CPU affinity: bit N set = thread may run on CPU N
+#define CPU_AFFINITY_ALL        0xFFFFFFFFu
 
 // Forward declaration
 struct thread;
 typedef struct thread thread_t;
 
+// Snapshot of one thread's accounting (thread_get_stats)
+typedef struct {
+    uint32_t tid;
+    char name[32];
+    thread_state_t state;
+    uint8_t priority;
+    uint8_t avg_cpu_usage;
+    uint32_t cpu;
+    uint64_t run_cycles;            // Includes the current run if on a CPU
+    uint64_t wait_max_cycles;
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+    uint32_t wait_hist[THREAD_WAIT_BUCKETS];
+} thread_stats_t;
+
 // Thread entry function type
 typedef void (*thread_entry_t)(void *arg);
 
@@ -63,18 +88,58 @@ struct thread {
     uint32_t time_slice;            // Remaining ticks in current time slice
     uint32_t time_slice_length;     // Full time slice length for this priority
     uint64_t total_ticks;           // Total CPU ticks consumed (lifetime)
+    uint32_t cpu;                   // CPU whose run queue this thread belongs to
+    uint32_t cpu_affinity;          // CPUs this thread may be placed on or stolen to
+    volatile bool on_cpu;           // Registers still live on a CPU (not yet switched out)
     
     // Adaptive scheduling - CPU usage tracking
     uint8_t cpu_usage_history[CPU_HISTORY_SAMPLES];  // Recent CPU usage percentages
     uint8_t history_index;          // Current index in history ring buffer
     uint8_t avg_cpu_usage;          // Smoothed average CPU usage
-    uint64_t slice_start_ticks;     // Timer tick when current slice started
-    uint64_t ticks_used_this_slice; // Ticks used in current slice
+    uint64_t slice_start_ns;        // timer_get_ns() when the current slice started
+    uint64_t total_ns;              // CPU time consumed (lifetime, clock resolution)
+    
+    // Detailed accounting (TSC based, see thread_get_stats)
+    uint64_t run_cycles;            // Cycles spent running (lifetime)
+    uint64_t switch_in_tsc;         // rdtsc() when last switched in
+    uint64_t ready_since_tsc;       // rdtsc() when queued to run, 0 if not waiting
+    uint64_t wait_max_cycles;       // Longest time spent ready but not running
+    uint32_t voluntary_switches;    // Switched out by yield, block or sleep
+    uint32_t involuntary_switches;  // Switched out after using its whole slice
+    // Runqueue latency: bucket 0 is < 1us, bucket i is [2^(i-1), 2^i) us,
+    // the last bucket also holds everything longer
+    uint32_t wait_hist[THREAD_WAIT_BUCKETS];
+    
+    // SIMD state (see fpu.h)
+    void *fpu_state;                // Save area page, allocated on first use
+    uint8_t fpu_depth;              // Open kernel_fpu_begin() sections
+    bool fpu_saved;                 // Registers are in fpu_state, not on a CPU
+    
+    // Deadline class (see thread_create_deadline). Times are timer_get_ns().
+    uint8_t sched_class;            // SCHED_CLASS_*
+    bool dl_throttled;              // Budget used up, parked until dl_timer fires
+    bool dl_missed;                 // Current job already counted in dl_misses
+    uint32_t dl_util;               // Admitted runtime/deadline, parts per million
+    uint64_t dl_runtime_ns;         // Budget per period
+    uint64_t dl_deadline_ns;        // Relative deadline (<= period)
+    uint64_t dl_period_ns;
+    uint64_t dl_period_start;       // Start of the current period
+    uint64_t dl_abs_deadline;       // Deadline of the current job
+    int64_t dl_budget_ns;           // Budget left in the current period
+    uint32_t dl_misses;             // Jobs still running past their deadline
+    uint32_t dl_throttles;          // Periods that ran out of budget
+    ktimer_t dl_timer;              // Replenishes the budget at the next period
     
     // Sleep support
     uint64_t wake_time;             // Timer tick at which to wake up
+    ktimer_t sleep_timer;           // Wakeup timer on the kernel timer wheel
     
-    // Queue linkage (for ready/sleep/blocked queues)
+    // Wait queue linkage (see waitqueue.h)
+    struct wait_queue *wait_queue;  // Queue this thread is on, NULL if none
+    thread_t *wait_next;            // Next waiter on that queue
+    volatile bool wait_timed_out;   // Last block ended by its timeout
+    
+    // Queue linkage (for ready/blocked queues)
     thread_t *next;                 // Next thread in queue
     thread_t *prev;                 // Previous thread in queue
     
@@ -91,9 +156,21 @@ thread_t *thread_create(const char *name, thread_entry_t entry, void *arg);
 thread_t *thread_create_priority(const char *name, thread_entry_t entry, 
                                   void *arg, uint8_t priority);
 
+// Create a deadline-class thread that may run 'runtime_ns' in every
+// 'period_ns', finishing each job within 'deadline_ns' of its release
+// (0 = the period). Returns NULL if no CPU can admit the reservation.
+// The thread is pinned to the admitting CPU; add it with scheduler_add().
+thread_t *thread_create_deadline(const char *name, thread_entry_t entry, void *arg,
+                                 uint64_t runtime_ns, uint64_t deadline_ns,
+                                 uint64_t period_ns);
+
 // Exit the current thread
 void thread_exit(void) __attribute__((noreturn));
 
+// Release a terminated thread's stack and control block. Called by the
+// scheduler once the thread has been switched away from for good.
+void thread_reap(thread_t *thread);
+
 // Voluntarily yield the CPU to another thread
 void thread_yield(void);
 
@@ -103,6 +180,10 @@ void thread_sleep_ms(uint32_t ms);
 // Set a thread's priority
 void thread_set_priority(thread_t *thread, uint8_t priority);
 
+// Restrict the CPUs a thread may run on (bitmask, see CPU_AFFINITY_ALL)
+// Takes effect the next time the thread is placed, stolen or rebalanced
+void thread_set_affinity(thread_t *thread, uint32_t mask);
+
 // Get the currently running thread
 thread_t *thread_current(void);
 
@@ -112,6 +193,10 @@ uint32_t thread_get_tid(void);
 // Get thread by ID (NULL if not found)
 thread_t *thread_get_by_id(uint32_t tid);
 
+// Copy the accounting of up to 'max' live threads into 'out'. Returns the
+// number filled in.
+int thread_get_stats(thread_stats_t *out, int max);
+
 // Get thread state as string (for debugging)
 const char *thread_state_name(thread_state_t state);
 
@@ -0,0 +1,144 @@
+#include "waitqueue.h"
+#include "scheduler.h"
+
+void wait_queue_init(wait_queue_t *wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+bool wait_queue_can_sleep(void) {
+    return scheduler_is_running() && thread_current() != NULL;
+}
+
+// ============== Queue Lists ==============
+// All require wq->lock
+
+static void queue_append(wait_queue_t *wq, thread_t *thread) {
+    thread->wait_queue = wq;
+    thread->wait_next = NULL;
+    if (wq->tail) {
+        wq->tail->wait_next = thread;
+    } else {
+        wq->head = thread;
+    }
+    wq->tail = thread;
+}
+
+static thread_t *queue_pop(wait_queue_t *wq) {
+    thread_t *thread = wq->head;
+    if (thread) {
+        wq->head = thread->wait_next;
+        if (!wq->head) {
+            wq->tail = NULL;
+        }
+        thread->wait_next = NULL;
+        thread->wait_queue = NULL;
+    }
+    return thread;
+}
+
+// Unlink a thread that left without being woken (timeout or cancel)
+static void queue_remove(wait_queue_t *wq, thread_t *thread) {
+    if (thread->wait_queue != wq) {
+        return;
+    }
+    
+    thread_t *prev = NULL;
+    for (thread_t *t = wq->head; t; prev = t, t = t->wait_next) {
+        if (t != thread) {
+            continue;
+        }
+        if (prev) {
+            prev->wait_next = t->wait_next;
+        } else {
+            wq->head = t->wait_next;
+        }
+        if (wq->tail == t) {
+            wq->tail = prev;
+        }
+        break;
+    }
+    thread->wait_next = NULL;
+    thread->wait_queue = NULL;
+}
+
+// ============== Waiting ==============
+
+uint64_t wait_queue_prepare(wait_queue_t *wq) {
+    uint64_t flags = irq_save();
+    
+    spin_lock(&wq->lock);
+    queue_append(wq, thread_current());
+    scheduler_block_prepare();
+    spin_unlock(&wq->lock);
+    
+    return flags;
+}
+
+// Back from the scheduler: make sure we are off the queue
+static void finish_wait(wait_queue_t *wq, uint64_t flags) {
+    thread_t *current = thread_current();
+    if (current->wait_queue == wq) {
+        spin_lock(&wq->lock);
+        queue_remove(wq, current);
+        spin_unlock(&wq->lock);
+    }
+    irq_restore(flags);
+}
+
+void wait_queue_commit(wait_queue_t *wq, uint64_t flags) {
+    scheduler_block_commit();
+    finish_wait(wq, flags);
+}
+
+bool wait_queue_commit_timeout(wait_queue_t *wq, uint64_t flags, uint64_t expires) {
+    bool woken = scheduler_block_commit_timeout(expires);
+    finish_wait(wq, flags);
+    return woken;
+}
+
+void wait_queue_cancel(wait_queue_t *wq, uint64_t flags) {
+    thread_t *current = thread_current();
+    
+    spin_lock(&wq->lock);
+    queue_remove(wq, current);
+    spin_unlock(&wq->lock);
+    
+    scheduler_block_cancel();
+    irq_restore(flags);
+}
+
+// ============== Waking ==============
+
+int wait_queue_wake_one(wait_queue_t *wq) {
+    uint64_t flags = irq_save();
+    
+    // Unblock under the queue lock: once unlocked, a waker-less thread (one
+    // that timed out) may already be queueing itself again
+    spin_lock(&wq->lock);
+    thread_t *thread = queue_pop(wq);
+    if (thread) {
+        scheduler_unblock(thread);
+    }
+    spin_unlock(&wq->lock);
+    
+    irq_restore(flags);
+    return thread ? 1 : 0;
+}
+
+int wait_queue_wake_all(wait_queue_t *wq) {
+    uint64_t flags = irq_save();
+    
+    int woken = 0;
+    spin_lock(&wq->lock);
+    thread_t *thread;
+    while ((thread = queue_pop(wq)) != NULL) {
+        scheduler_unblock(thread);
+        woken++;
+    }
+    spin_unlock(&wq->lock);
+    
+    irq_restore(flags);
+    return woken;
+}
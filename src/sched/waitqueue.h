@@ -0,0 +1,80 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+#include "thread.h"
+#include "../timer/timer.h"
+
+// FIFO of threads blocked until some condition changes. Wakers change the
+// condition first, then call wait_queue_wake_*(); waiters always recheck
+// the condition after waking (wakeups may be spurious).
+typedef struct wait_queue {
+    spinlock_t lock;
+    thread_t *head;
+    thread_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL, NULL }
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Whether the caller is a thread that may block (the scheduler is running
+// threads on this CPU). Before that, waits degrade to polling. Never wait
+// from an interrupt handler or the idle thread.
+bool wait_queue_can_sleep(void);
+
+// Low-level protocol behind wait_event(): prepare queues the current thread
+// and marks it blocked (returns the saved interrupt state); then the caller
+// rechecks its condition and either commits (sleep until woken, or until
+// tick 'expires' - returns false on timeout) or cancels.
+uint64_t wait_queue_prepare(wait_queue_t *wq);
+void wait_queue_commit(wait_queue_t *wq, uint64_t flags);
+bool wait_queue_commit_timeout(wait_queue_t *wq, uint64_t flags, uint64_t expires);
+void wait_queue_cancel(wait_queue_t *wq, uint64_t flags);
+
+// Wake the longest waiter / every waiter. Return how many were woken.
+// Safe from interrupt handlers. Lock order: wq->lock before scheduler locks.
+int wait_queue_wake_one(wait_queue_t *wq);
+int wait_queue_wake_all(wait_queue_t *wq);
+
+// Sleep until 'condition' is true
+#define wait_event(wq, condition)                                   \
+    do {                                                            \
+        while (!(condition)) {                                      \
+            if (!wait_queue_can_sleep()) {                          \
+                __asm__ volatile("pause");                          \
+                continue;                                           \
+            }                                                       \
+            uint64_t __wq_flags = wait_queue_prepare(wq);           \
+            if (condition) {                                        \
+                wait_queue_cancel(wq, __wq_flags);                  \
+                break;                                              \
+            }                                                       \
+            wait_queue_commit(wq, __wq_flags);                      \
+        }                                                           \
+    } while (0)
+
+// Sleep until 'condition' is true or timeout_ms elapse. Evaluates to the
+// final value of the condition (false means timed out).
+#define wait_event_timeout(wq, condition, timeout_ms) ({            \
+    uint64_t __wq_deadline = timer_get_ticks() + (timeout_ms);      \
+    bool __wq_done;                                                 \
+    while (!(__wq_done = (condition)) &&                            \
+           timer_get_ticks() < __wq_deadline) {                     \
+        if (!wait_queue_can_sleep()) {                              \
+            __asm__ volatile("pause");                              \
+            continue;                                               \
+        }                                                           \
+        uint64_t __wq_flags = wait_queue_prepare(wq);               \
+        if (condition) {                                            \
+            wait_queue_cancel(wq, __wq_flags);                      \
+            continue;                                               \
+        }                                                           \
+        wait_queue_commit_timeout(wq, __wq_flags, __wq_deadline);   \
+    }                                                               \
+    __wq_done;                                                      \
+})
+
+#endif // WAITQUEUE_H
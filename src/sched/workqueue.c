@@ -0,0 +1,133 @@
+#include "workqueue.h"
+#include "waitqueue.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "spinlock.h"
+#include "../smp/smp.h"
+#include "../debug/debug.h"
+
+#define WORK_RING_MASK (WORK_RING_SIZE - 1)
+
+typedef struct {
+    work_t *ring[WORK_RING_SIZE];
+    volatile uint32_t head;         // Next slot to fill (producer)
+    volatile uint32_t tail;         // Next slot to run (worker)
+    wait_queue_t waiters;           // The worker, when the ring is empty
+    thread_t *worker;
+    work_stats_t stats;
+} work_cpu_t;
+
+static work_cpu_t work_cpus[MAX_CPUS];
+
+static bool ring_empty(work_cpu_t *wc) {
+    return __atomic_load_n(&wc->tail, __ATOMIC_RELAXED) ==
+           __atomic_load_n(&wc->head, __ATOMIC_ACQUIRE);
+}
+
+void work_init(work_t *work, work_fn_t fn, void *arg) {
+    work->fn = fn;
+    work->arg = arg;
+    work->pending = false;
+}
+
+int work_schedule(work_t *work) {
+    uint64_t flags = irq_save();
+    work_cpu_t *wc = &work_cpus[smp_cpu_id()];
+    
+    // Already queued somewhere: it will see whatever state we just published
+    if (__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQ_REL)) {
+        wc->stats.coalesced++;
+        irq_restore(flags);
+        return 0;
+    }
+    
+    uint32_t head = wc->head;
+    if (head - __atomic_load_n(&wc->tail, __ATOMIC_ACQUIRE) >= WORK_RING_SIZE) {
+        wc->stats.dropped++;
+        __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+        irq_restore(flags);
+        return -1;
+    }
+    
+    wc->ring[head & WORK_RING_MASK] = work;
+    __atomic_store_n(&wc->head, head + 1, __ATOMIC_RELEASE);
+    wc->stats.queued++;
+    
+    wait_queue_wake_one(&wc->waiters);
+    irq_restore(flags);
+    return 0;
+}
+
+// Run up to WORK_BATCH_LIMIT items. Returns how many ran.
+static uint32_t run_batch(work_cpu_t *wc) {
+    uint32_t ran = 0;
+    
+    while (ran < WORK_BATCH_LIMIT && !ring_empty(wc)) {
+        uint32_t tail = wc->tail;
+        work_t *work = wc->ring[tail & WORK_RING_MASK];
+        __atomic_store_n(&wc->tail, tail + 1, __ATOMIC_RELEASE);
+        
+        // Clear before running so the item can be queued again meanwhile
+        __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+        work->fn(work->arg);
+        ran++;
+    }
+    
+    return ran;
+}
+
+static void worker_entry(void *arg) {
+    work_cpu_t *wc = (work_cpu_t *)arg;
+    
+    while (1) {
+        wait_event(&wc->waiters, !ring_empty(wc));
+        
+        uint32_t ran = run_batch(wc);
+        wc->stats.executed += ran;
+        wc->stats.batches++;
+        if (ran > wc->stats.max_batch) {
+            wc->stats.max_batch = ran;
+        }
+        
+        // Hit the batch limit: let anything else runnable go first
+        if (ran == WORK_BATCH_LIMIT) {
+            thread_yield();
+        }
+    }
+}
+
+int workqueue_init(void) {
+    int started = 0;
+    
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        // The rings and wait queues are valid zero-initialized, so
+        // interrupts may already have queued work before this point
+        work_cpu_t *wc = &work_cpus[cpu];
+        if (!smp_cpu_online(cpu)) {
+            continue;
+        }
+        
+        char name[] = "kworker/00";
+        name[8] = '0' + cpu / 10;
+        name[9] = '0' + cpu % 10;
+        
+        wc->worker = thread_create_priority(name, worker_entry, wc, PRIORITY_REALTIME);
+        if (!wc->worker) {
+            DEBUG_ERROR("workqueue: failed to create worker for CPU %u\n", cpu);
+            return -1;
+        }
+        scheduler_add_on(wc->worker, cpu);
+        started++;
+    }
+    
+    DEBUG_INFO("workqueue: %d workers started\n", started);
+    return 0;
+}
+
+bool workqueue_get_stats(uint32_t cpu, work_stats_t *stats) {
+    if (cpu >= MAX_CPUS || !stats) {
+        return false;
+    }
+    *stats = work_cpus[cpu].stats;
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred work: interrupt handlers (top halves) do the minimum with the
+// device and queue a work item; a per-CPU high-priority worker thread runs
+// the rest (the bottom half) with interrupts enabled.
+//
+// Each CPU has a lock-free single-producer/single-consumer ring. Producers
+// only ever push onto their own CPU's ring with interrupts disabled, so the
+// only consumer is that CPU's worker and no lock is needed.
+
+// Slots per CPU ring (power of two). An item occupies at most one slot.
+#define WORK_RING_SIZE      256
+
+// Items a worker runs before yielding, so a flood of work can't starve
+// other threads on that CPU
+#define WORK_BATCH_LIMIT    32
+
+typedef void (*work_fn_t)(void *arg);
+
+// A deferrable piece of work. Embed it in the owning object; it must stay
+// valid until it has run.
+typedef struct work {
+    work_fn_t fn;
+    void *arg;
+    volatile bool pending;          // Queued and not yet started
+} work_t;
+
+#define WORK_INIT(f, a) { .fn = (f), .arg = (a), .pending = false }
+
+// Per-CPU counters
+typedef struct {
+    uint64_t queued;                // Items accepted by work_schedule()
+    uint64_t coalesced;             // Requests for items already pending
+    uint64_t dropped;               // Ring full
+    uint64_t executed;              // Items run by the worker
+    uint64_t batches;               // Worker passes
+    uint32_t max_batch;             // Largest single pass
+} work_stats_t;
+
+void work_init(work_t *work, work_fn_t fn, void *arg);
+
+// Queue 'work' on the calling CPU and wake its worker. Safe from interrupt
+// handlers. Returns 0 if queued (or already pending), -1 if the ring is full.
+// An item may re-schedule itself from its own function.
+int work_schedule(work_t *work);
+
+// Start one worker thread per online CPU. Call after smp_init() and before
+// scheduler_start(); items queued earlier run once the workers start.
+int workqueue_init(void);
+
+// Counters for one CPU. Returns false for an invalid CPU.
+bool workqueue_get_stats(uint32_t cpu, work_stats_t *stats);
+
+#endif // WORKQUEUE_H
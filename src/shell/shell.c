@@ -12,17 +12,30 @@
 #include "../network/dhcp.h"
 #include "../network/arp.h"
 #include "../network/icmp.h"
+#include "../network/tcp.h"
+#include "../network/route.h"
+#include "../network/pcap.h"
 #include "../fs/fat16.h"
+#include "../fs/bcache.h"
 #include "../acpi/acpi.h"
-#include "../drivers/ata.h"
+#include "../drivers/blkdev.h"
 #include "../graphic/graphic.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
+#include "../bench/bench.h"
+#include "../timer/tsc.h"
 #include "../sched/thread.h"
+#include "../smp/smp.h"
+#include "../sched/spinlock.h"
+#include "../boot/boot.h"
 
 // Command buffer
 static char cmd_buffer[SHELL_BUFFER_SIZE];
 static int cmd_pos = 0;
 
+// Longest the idle shell sleeps before polling the network / DHCP again
+#define SHELL_POLL_MS 10
+
 // Command history
 #define HISTORY_SIZE 16
 static char history[HISTORY_SIZE][SHELL_BUFFER_SIZE];
@@ -61,18 +74,26 @@ static int shell_strncmp(const char *s1, const char *s2, int n) {
     return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
 
+// Past the last line: move the whole output area up one line (the new
+// bottom line comes out blank) and stay on the last line
+static void shell_scroll(void) {
+    int lines = (max_y - shell_start_y + line_height - 1) / line_height;
+    graphic_scroll(10, shell_start_y, 780, lines * line_height, line_height, 0x6495ED);
+    shell_y -= line_height;
+}
+
 void shell_print(const char *str) {
     while (*str) {
         if (*str == '\n') {
             shell_x = 10;
             shell_y += line_height;
             if (shell_y >= max_y) {
-                shell_y = shell_start_y;
-                // Clear old line
-                draw_rect(10, shell_y, 780, line_height, 0, 0x6495ED, true);
+                shell_scroll();
             }
+            // Long-running commands show their output a frame at a time
+            graphic_flush_frame();
         } else {
-            draw_char(shell_x, shell_y, *str, 0xFFFFFF);
+            draw_char_bg(shell_x, shell_y, *str, 0xFFFFFF, 0x6495ED);
             shell_x += 8;
         }
         str++;
@@ -97,7 +118,7 @@ static void shell_newline(void) {
     shell_x = 10;
     shell_y += line_height;
     if (shell_y >= max_y) {
-        shell_y = shell_start_y;
+        shell_scroll();
     }
     shell_clear_line();
 }
@@ -111,15 +132,29 @@ static void cmd_help(void) {
     shell_println("  pci     - List PCI devices");
     shell_println("  net     - Show network info");
     shell_println("  arp     - Show ARP table");
+    shell_println("  netstat - Interface and protocol counters (also ifstat)");
+    shell_println("  tcp     - TCP connections (tcp cc <alg> sets default)");
+    shell_println("  pcap    - Capture (pcap start [snap n] [filter]|stop|save <file>)");
+    shell_println("  route   - Routes (route add|del <net>/<len>|default [via gw] [dev if])");
     shell_println("  uptime  - Show system uptime");
+    shell_println("  boot    - Boot stage and init task timings");
     shell_println("  ping    - Ping an IP address");
-    shell_println("  ls      - List files");
+    shell_println("  ls      - List files [path]");
+    shell_println("  mkdir   - Create a directory");
+    shell_println("  rm      - Remove a file or empty directory");
     shell_println("  cat     - Display file contents");
     shell_println("  shutdown- Power off");
     shell_println("  reboot  - Restart system");
     shell_println("  disk    - List disk drives");
     shell_println("  format  - Format a drive with FAT16");
+    shell_println("  sync    - Write cached disk data back");
     shell_println("  write   - Write text to file");
+    shell_println("  append  - Append a line to a file");
+    shell_println("  locks   - Show lock contention stats");
+    shell_println("  top     - Live per-thread CPU use (top <tid>: wait histogram)");
+    shell_println("  log     - Debug log ring stats");
+    shell_println("  bench   - Run microbenchmarks (bench <name>|all)");
+    shell_println("  prof    - Profile (prof start|stop|trace; no args: report)");
 }
 
 static void cmd_clear(void) {
@@ -195,6 +230,47 @@ static void cmd_net(void) {
     }
 }
 
+static void cmd_netstat(void) {
+    char buf[96];
+    bool any = false;
+
+    for (int i = 0; i < MAX_NETWORK_INTERFACES; i++) {
+        network_interface_t *iface = network_get_interface(i);
+        if (!iface || !iface->active) {
+            continue;
+        }
+        any = true;
+
+        netif_stats_t st;
+        network_get_stats(iface, &st);
+        kprintf_to_buffer(buf, sizeof(buf), "%s:", iface->name);
+        shell_println(buf);
+        kprintf_to_buffer(buf, sizeof(buf), "  RX %lu pkts %lu bytes drop=%lu err=%lu csum=%lu overrun=%lu",
+            st.rx_packets, st.rx_bytes, st.rx_dropped, st.rx_errors, st.rx_csum_errors, st.rx_overruns);
+        shell_println(buf);
+        kprintf_to_buffer(buf, sizeof(buf), "  TX %lu pkts %lu bytes drop=%lu err=%lu ring-full=%lu",
+            st.tx_packets, st.tx_bytes, st.tx_dropped, st.tx_errors, st.tx_ring_full);
+        shell_println(buf);
+
+        static const char *const proto_names[NET_PROTO_COUNT] = {
+            "arp", "ip", "icmp", "udp", "tcp", "other"
+        };
+        for (int dir = 0; dir < 2; dir++) {
+            const uint64_t *counts = dir == 0 ? st.rx_proto : st.tx_proto;
+            shell_print(dir == 0 ? "  RX" : "  TX");
+            for (int p = 0; p < NET_PROTO_COUNT; p++) {
+                kprintf_to_buffer(buf, sizeof(buf), " %s=%lu", proto_names[p], counts[p]);
+                shell_print(buf);
+            }
+            shell_println("");
+        }
+    }
+
+    if (!any) {
+        shell_println("No active interfaces");
+    }
+}
+
 static void cmd_arp(void) {
     shell_println("ARP Table:");
     shell_println("  (ARP entries stored in memory)");
@@ -203,6 +279,64 @@ static void cmd_arp(void) {
     arp_print_table();  // This outputs to debug console
 }
 
+static void cmd_tcp(const char *args) {
+    char buf[96];
+    while (*args == ' ') args++;
+
+    if (shell_strncmp(args, "cc", 2) == 0) {
+        args += 2;
+        while (*args == ' ') args++;
+        if (*args && tcp_cong_set_default(args) != 0) {
+            shell_print("Unknown algorithm: ");
+            shell_println(args);
+        }
+        shell_print("Congestion control:");
+        for (int i = 0; tcp_cong_get(i); i++) {
+            const tcp_cong_ops_t *ops = tcp_cong_get(i);
+            kprintf_to_buffer(buf, sizeof(buf), " %s%s", ops->name,
+                              ops == tcp_cong_default() ? "*" : "");
+            shell_print(buf);
+        }
+        shell_println("");
+        return;
+    }
+
+    static tcp_info_t info[16];
+    int count = tcp_get_info(info, 16);
+    if (count == 0) {
+        shell_println("No TCP connections");
+        return;
+    }
+    int total = tcp_connection_count();
+
+    for (int i = 0; i < count; i++) {
+        tcp_info_t *t = &info[i];
+        kprintf_to_buffer(buf, sizeof(buf), "  %d.%d.%d.%d:%u -> %d.%d.%d.%d:%u %s",
+            (t->local_ip >> 24) & 0xFF, (t->local_ip >> 16) & 0xFF,
+            (t->local_ip >> 8) & 0xFF, t->local_ip & 0xFF, t->local_port,
+            (t->remote_ip >> 24) & 0xFF, (t->remote_ip >> 16) & 0xFF,
+            (t->remote_ip >> 8) & 0xFF, t->remote_ip & 0xFF, t->remote_port,
+            tcp_state_name(t->state));
+        shell_println(buf);
+        if (t->state == TCP_LISTEN) {
+            continue;
+        }
+        kprintf_to_buffer(buf, sizeof(buf), "    %s%s cwnd=%u ssthresh=%u wnd=%u flight=%u mss=%u%s",
+            t->cong, t->sack ? "+sack" : "", t->cwnd, t->ssthresh, t->snd_wnd, t->in_flight,
+            t->mss, t->in_recovery ? " recovery" : "");
+        shell_println(buf);
+        kprintf_to_buffer(buf, sizeof(buf), "    srtt=%ums rttvar=%ums rto=%ums rexmit=%u fast=%u timeouts=%u",
+            t->srtt_ms, t->rttvar_ms, t->rto_ms, t->retransmits, t->fast_retransmits, t->timeouts);
+        shell_println(buf);
+        kprintf_to_buffer(buf, sizeof(buf), "    gso=%u gro=%u segments", t->gso_segments, t->gro_segments);
+        shell_println(buf);
+    }
+    if (total > count) {
+        kprintf_to_buffer(buf, sizeof(buf), "  ... %d more (%d total)", total - count, total);
+        shell_println(buf);
+    }
+}
+
 // List directory callback
 static void ls_callback(const char *name, uint32_t size, bool is_dir) {
     char buf[80];
@@ -214,18 +348,52 @@ static void ls_callback(const char *name, uint32_t size, bool is_dir) {
     shell_println(buf);
 }
 
-static void cmd_ls(void) {
+static void cmd_ls(const char *args) {
+    while (*args == ' ') args++;
+    
     if (!fat16_is_mounted()) {
         shell_println("No filesystem mounted");
         return;
     }
     
     shell_println("Files:");
-    if (fat16_list_root(ls_callback) < 0) {
+    if (fat16_list_dir(args, ls_callback) < 0) {
         shell_println("Error reading directory");
     }
 }
 
+static void cmd_mkdir(const char *args) {
+    while (*args == ' ') args++;
+    
+    if (*args == '\0') {
+        shell_println("Usage: mkdir <path>");
+        return;
+    }
+    if (!fat16_is_mounted()) {
+        shell_println("No filesystem mounted");
+        return;
+    }
+    if (fat16_mkdir(args) < 0) {
+        shell_println("Failed to create directory");
+    }
+}
+
+static void cmd_rm(const char *args) {
+    while (*args == ' ') args++;
+    
+    if (*args == '\0') {
+        shell_println("Usage: rm <path>");
+        return;
+    }
+    if (!fat16_is_mounted()) {
+        shell_println("No filesystem mounted");
+        return;
+    }
+    if (fat16_delete_file(args) < 0) {
+        shell_println("Failed to remove (missing, open, or a non-empty directory)");
+    }
+}
+
 static void cmd_cat(const char *args) {
     // Skip whitespace
     while (*args == ' ') args++;
@@ -240,34 +408,42 @@ static void cmd_cat(const char *args) {
         return;
     }
     
-    // Read file (max 4KB to display)
-    static char file_buf[4096];
-    int size = fat16_read_file(args, file_buf, sizeof(file_buf) - 1);
-    
-    if (size < 0) {
+    fat16_file_t *file = fat16_open(args, FAT16_O_READ);
+    if (!file) {
         shell_println("File not found");
         return;
     }
     
-    file_buf[size] = '\0';
-    
-    // Print file contents line by line
-    char *ptr = file_buf;
+    // Stream the file in chunks, printing it line by line
+    static char file_buf[4096];
     char line[256];
     int line_pos = 0;
+    int size;
+    bool cr = false;
     
-    while (*ptr) {
-        if (*ptr == '\n' || *ptr == '\r') {
-            line[line_pos] = '\0';
-            if (line_pos > 0) {
-                shell_println(line);
+    while ((size = fat16_read(file, file_buf, sizeof(file_buf))) > 0) {
+        for (int i = 0; i < size; i++) {
+            char c = file_buf[i];
+            if (c == '\n' && cr) {
+                cr = false;         // Second half of CRLF
+                continue;
+            }
+            cr = c == '\r';
+            if (c == '\n' || c == '\r') {
+                line[line_pos] = '\0';
+                if (line_pos > 0) {
+                    shell_println(line);
+                }
+                line_pos = 0;
+            } else if (line_pos < 255) {
+                line[line_pos++] = c;
             }
-            line_pos = 0;
-            if (*ptr == '\r' && *(ptr + 1) == '\n') ptr++;
-        } else if (line_pos < 255) {
-            line[line_pos++] = *ptr;
         }
-        ptr++;
+    }
+    fat16_close(file);
+    
+    if (size < 0) {
+        shell_println("Read error");
     }
     
     // Print remaining line
@@ -277,6 +453,51 @@ static void cmd_cat(const char *args) {
     }
 }
 
+static void cmd_append(const char *args) {
+    while (*args == ' ') args++;
+    
+    char filename[64];
+    int i = 0;
+    while (*args && *args != ' ' && i < 63) {
+        filename[i++] = *args++;
+    }
+    filename[i] = '\0';
+    while (*args && *args != ' ') args++;   // Over-long names are cut
+    while (*args == ' ') args++;
+    const char *text = args;
+    
+    if (i == 0 || *text == '\0') {
+        shell_println("Usage: append <filename> <text>");
+        return;
+    }
+    if (!fat16_is_mounted()) {
+        shell_println("No filesystem mounted");
+        return;
+    }
+    
+    fat16_file_t *file = fat16_open(filename, FAT16_O_WRITE | FAT16_O_CREATE | FAT16_O_APPEND);
+    if (!file) {
+        shell_println("Failed to open file");
+        return;
+    }
+    
+    size_t len = 0;
+    while (text[len]) len++;
+    bool ok = fat16_write(file, text, len) == (int)len && fat16_write(file, "\n", 1) == 1;
+    uint32_t total = file->file_size;
+    if (fat16_close(file) < 0) {
+        ok = false;
+    }
+    
+    char buf[96];
+    if (ok) {
+        kprintf_to_buffer(buf, sizeof(buf), "%s is now %u bytes", filename, total);
+    } else {
+        kprintf_to_buffer(buf, sizeof(buf), "Failed to append to %s", filename);
+    }
+    shell_println(buf);
+}
+
 static void cmd_write(const char *args) {
     // Skip whitespace
     while (*args == ' ') args++;
@@ -293,13 +514,13 @@ static void cmd_write(const char *args) {
     }
     
     // Parse filename (until space), skip quotes
-    char filename[13];
+    char filename[64];
     int i = 0;
     
     // Skip opening quote if present
     if (*args == '\'' || *args == '"') args++;
     
-    while (*args && *args != ' ' && *args != '\'' && *args != '"' && i < 12) {
+    while (*args && *args != ' ' && *args != '\'' && *args != '"' && i < 63) {
         filename[i++] = *args++;
     }
     filename[i] = '\0';
@@ -346,60 +567,82 @@ static void cmd_write(const char *args) {
         return;
     }
     
-    char buf[64];
+    char buf[96];
     kprintf_to_buffer(buf, sizeof(buf), "Wrote %u bytes to %s", (uint32_t)len, filename);
     shell_println(buf);
 }
 
 static void cmd_disk(void) {
-    shell_println("ATA Drives:");
-    char buf[80];
+    shell_println("Block devices:");
+    char buf[96];
     bool found = false;
     
-    for (int i = 0; i < 2; i++) {
-        ata_drive_t *drive = ata_get_drive_info(i);
-        if (drive && drive->present) {
-            found = true;
-            uint32_t size_mb = drive->size_sectors / 2048;
-            kprintf_to_buffer(buf, sizeof(buf), "  Drive %d (%s): %s (%u MB)",
-                i, i == 0 ? "Master" : "Slave",
-                drive->model, size_mb);
-            shell_println(buf);
-        }
+    for (int i = 0; i < blkdev_count(); i++) {
+        blkdev_t *dev = blkdev_get(i);
+        found = true;
+        kprintf_to_buffer(buf, sizeof(buf), "  Drive %d (%s): %s (%lu MB, %s)",
+            i, dev->name, dev->model, dev->sectors / 2048,
+            dev->driver ? dev->driver : "?");
+        shell_println(buf);
+
+        blkdev_stats_t st;
+        blkdev_get_stats(dev, &st);
+        kprintf_to_buffer(buf, sizeof(buf), "    Queue: %lu reqs -> %lu cmds, %lu merged, %lu bounced",
+            st.requests, st.commands, st.merged, st.bounced);
+        shell_println(buf);
     }
     
     if (!found) {
         shell_println("  No drives detected");
     }
+
+    bcache_stats_t cs;
+    bcache_get_stats(&cs);
+    kprintf_to_buffer(buf, sizeof(buf), "Cache: %u/%u buffers, %u dirty, %lu hits, %lu misses",
+        cs.in_use, cs.buffers, cs.dirty, cs.hits, cs.misses);
+    shell_println(buf);
+    kprintf_to_buffer(buf, sizeof(buf), "       %lu evictions, %lu sectors written back",
+        cs.evictions, cs.writebacks);
+    shell_println(buf);
     
     // Show mounted filesystem
     if (fat16_is_mounted()) {
-        shell_println("Mounted: FAT16 filesystem");
+        fat16_fs_t *fs = fat16_get_fs();
+        kprintf_to_buffer(buf, sizeof(buf), "Mounted: FAT16 filesystem (%lu KB free)",
+            (uint64_t)fat16_free_clusters() * fs->sectors_per_cluster / 2);
+        shell_println(buf);
     } else {
         shell_println("No filesystem mounted");
     }
 }
 
+static void cmd_sync(void) {
+    int ret = fat16_sync();
+    if (bcache_sync(NULL) < 0 || ret < 0) {
+        shell_println("Sync failed: some buffers are still dirty");
+    } else {
+        shell_println("Sync complete");
+    }
+}
+
 static void cmd_format(const char *args) {
     // Skip whitespace
     while (*args == ' ') args++;
     
     // Parse drive number
     int drive = -1;
-    if (*args >= '0' && *args <= '1') {
+    if (*args >= '0' && *args <= '9') {
         drive = *args - '0';
-    } else {
-        // Auto-detect first available drive
-        for (int i = 0; i < 2; i++) {
-            if (ata_drive_present(i)) {
-                drive = i;
-                break;
-            }
+        if (!blkdev_get(drive)) {
+            drive = -1;
         }
+    } else if (blkdev_count() > 0) {
+        // First available drive
+        drive = 0;
     }
     
     if (drive < 0) {
-        shell_println("Usage: format [0|1]");
+        shell_println("Usage: format [drive]");
         shell_println("No drives available");
         return;
     }
@@ -435,6 +678,273 @@ static void cmd_uptime(void) {
     shell_println(buf);
 }
 
+static void cmd_boot(void) {
+    boot_report(shell_println);
+    if (!boot_complete()) {
+        shell_println("(boot tasks still running)");
+    }
+}
+
+static void cmd_log(void) {
+    debug_log_stats_t stats;
+    debug_get_log_stats(&stats);
+
+    char buf[96];
+    kprintf_to_buffer(buf, sizeof(buf), "Debug log: %s", stats.async ? "asynchronous" : "synchronous");
+    shell_println(buf);
+    kprintf_to_buffer(buf, sizeof(buf), "  records: %lu, dropped: %lu, queued: %lu bytes",
+                      stats.records, stats.dropped, stats.queued_bytes);
+    shell_println(buf);
+}
+
+static void cmd_bench(const char *args) {
+    while (*args == ' ') args++;
+    if (*args == '\0') {
+        shell_println("Usage: bench <name>|all. Benchmarks:");
+        bench_list(shell_println);
+        return;
+    }
+    if (bench_run(args, shell_println) < 0) {
+        shell_print("Unknown benchmark: ");
+        shell_println(args);
+    }
+}
+
+#define PROF_REPORT_LINES 15
+#define PROF_TRACE_LINES  16
+
+static void cmd_prof(const char *args) {
+    char buf[96];
+    while (*args == ' ') args++;
+
+    if (shell_strcmp(args, "start") == 0) {
+        trace_start();
+        shell_println("Profiling and tracing started");
+        return;
+    }
+    if (shell_strcmp(args, "stop") == 0) {
+        trace_stop();
+        shell_println("Profiling and tracing stopped");
+        return;
+    }
+    if (shell_strcmp(args, "trace") == 0) {
+        uint64_t counts[TRACE_EVENT_COUNT];
+        trace_get_counts(counts);
+        for (int ev = 0; ev < TRACE_EVENT_COUNT; ev++) {
+            kprintf_to_buffer(buf, sizeof(buf), "  %s: %lu", trace_event_name(ev), counts[ev]);
+            shell_println(buf);
+        }
+
+        static trace_entry_t recent[PROF_TRACE_LINES];
+        uint32_t n = trace_read_recent(recent, PROF_TRACE_LINES);
+        uint64_t hz = tsc_get_hz();
+        for (uint32_t i = 0; i < n; i++) {
+            const trace_entry_t *e = &recent[i];
+            uint64_t us = hz ? tsc_cycles_to_ns(e->tsc - recent[0].tsc) / 1000 : 0;
+            kprintf_to_buffer(buf, sizeof(buf), "  +%luus c%u t%u %s %lx %lx", us,
+                              (unsigned)e->cpu, e->tid, trace_event_name(e->event), e->a, e->b);
+            shell_println(buf);
+        }
+        return;
+    }
+    if (*args) {
+        shell_println("Usage: prof [start|stop|trace]");
+        return;
+    }
+
+    static prof_entry_t top[PROF_REPORT_LINES];
+    int n = prof_report(top, PROF_REPORT_LINES);
+    prof_stats_t stats;
+    prof_get_stats(&stats);
+    kprintf_to_buffer(buf, sizeof(buf), "Profile: %u samples (%u dropped), %u symbols, %s",
+                      stats.samples, stats.dropped, stats.symbols,
+                      stats.running ? "running" : "stopped");
+    shell_println(buf);
+    for (int i = 0; i < n; i++) {
+        // Keep long (C++-style or static) names inside one line
+        char name[56];
+        int len = 0;
+        if (top[i].name) {
+            while (top[i].name[len] && len < (int)sizeof(name) - 1) {
+                name[len] = top[i].name[len];
+                len++;
+            }
+        }
+        name[len] = '\0';
+        uint32_t pct = stats.samples ? top[i].samples * 100 / stats.samples : 0;
+        if (top[i].name) {
+            kprintf_to_buffer(buf, sizeof(buf), "  %u %u%% %s", top[i].samples, pct, name);
+        } else {
+            kprintf_to_buffer(buf, sizeof(buf), "  %u %u%% (unknown, e.g. 0x%lx)",
+                              top[i].samples, pct, top[i].addr);
+        }
+        shell_println(buf);
+    }
+}
+
+static void cmd_locks(const char *args) {
+#ifdef LOCK_STATS
+    while (*args == ' ') args++;
+    if (shell_strcmp(args, "reset") == 0) {
+        spinlock_stats_reset();
+        shell_println("Lock statistics cleared");
+        return;
+    }
+
+    char buf[96];
+    shell_println("  name: acquired contended spins max-hold(cycles)");
+    for (spinlock_t *lock = spinlock_stats_first(); lock; lock = lock->stats_next) {
+        kprintf_to_buffer(buf, sizeof(buf), "  %s: %u %u %u %lu",
+                          lock->name,
+                          (uint32_t)lock->acquisitions,
+                          (uint32_t)lock->contended,
+                          (uint32_t)lock->spins,
+                          (unsigned long)lock->max_hold_cycles);
+        shell_println(buf);
+    }
+#else
+    (void)args;
+    shell_println("Lock statistics disabled (build with LOCK_STATS=1)");
+#endif
+}
+
+#define TOP_MAX_THREADS 64
+#define TOP_LINES       40
+#define TOP_REFRESH_MS  1000
+
+static thread_stats_t top_prev[TOP_MAX_THREADS];
+static thread_stats_t top_cur[TOP_MAX_THREADS];
+static uint64_t top_delta[TOP_MAX_THREADS];
+static int top_order[TOP_MAX_THREADS];
+
+// Upper bound (us) of the histogram bucket holding the given percentile
+static uint64_t top_wait_percentile(const thread_stats_t *t, uint32_t pct) {
+    uint64_t total = 0;
+    for (int b = 0; b < THREAD_WAIT_BUCKETS; b++) total += t->wait_hist[b];
+    if (total == 0) return 0;
+
+    uint64_t want = (total * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < THREAD_WAIT_BUCKETS; b++) {
+        seen += t->wait_hist[b];
+        if (seen >= want) return 1ULL << b;
+    }
+    return 1ULL << (THREAD_WAIT_BUCKETS - 1);
+}
+
+// One thread's wait-time histogram
+static void top_show_thread(uint32_t tid) {
+    int n = thread_get_stats(top_cur, TOP_MAX_THREADS);
+    char buf[96];
+    for (int i = 0; i < n; i++) {
+        thread_stats_t *t = &top_cur[i];
+        if (t->tid != tid) continue;
+
+        kprintf_to_buffer(buf, sizeof(buf), "TID %u '%s' %s CPU %u, run %lu ms",
+                          t->tid, t->name, thread_state_name(t->state), t->cpu,
+                          tsc_cycles_to_ns(t->run_cycles) / 1000000);
+        shell_println(buf);
+        kprintf_to_buffer(buf, sizeof(buf), "  switches: %u voluntary, %u involuntary, max wait %lu us",
+                          t->voluntary_switches, t->involuntary_switches,
+                          tsc_cycles_to_ns(t->wait_max_cycles) / 1000);
+        shell_println(buf);
+        shell_println("  runqueue wait (us): count");
+        for (int b = 0; b < THREAD_WAIT_BUCKETS; b++) {
+            if (t->wait_hist[b] == 0) continue;
+            if (b == 0) {
+                kprintf_to_buffer(buf, sizeof(buf), "    < 1: %u", t->wait_hist[b]);
+            } else if (b == THREAD_WAIT_BUCKETS - 1) {
+                kprintf_to_buffer(buf, sizeof(buf), "    >= %lu: %u",
+                                  1UL << (b - 1), t->wait_hist[b]);
+            } else {
+                kprintf_to_buffer(buf, sizeof(buf), "    %lu-%lu: %u",
+                                  1UL << (b - 1), (1UL << b) - 1, t->wait_hist[b]);
+            }
+            shell_println(buf);
+        }
+        return;
+    }
+    kprintf_to_buffer(buf, sizeof(buf), "No thread with TID %u", tid);
+    shell_println(buf);
+}
+
+// Draw one refresh: CPU share of each thread since the previous sample
+static void top_draw(int nprev, int ncur, uint64_t elapsed_cycles) {
+    uint64_t busy = 0;
+    for (int i = 0; i < ncur; i++) {
+        top_delta[i] = top_cur[i].run_cycles;
+        for (int j = 0; j < nprev; j++) {
+            if (top_prev[j].tid == top_cur[i].tid) {
+                top_delta[i] -= top_prev[j].run_cycles;
+                break;
+            }
+        }
+        if (shell_strncmp(top_cur[i].name, "idle", 4) != 0) {
+            busy += top_delta[i];
+        }
+        top_order[i] = i;
+    }
+
+    // Busiest first (insertion sort, at most TOP_MAX_THREADS entries)
+    for (int i = 1; i < ncur; i++) {
+        int k = top_order[i];
+        int j = i - 1;
+        while (j >= 0 && top_delta[top_order[j]] < top_delta[k]) {
+            top_order[j + 1] = top_order[j];
+            j--;
+        }
+        top_order[j + 1] = k;
+    }
+
+    uint32_t cpus = 0;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (smp_cpu_online(cpu)) cpus++;
+    }
+    if (elapsed_cycles == 0) elapsed_cycles = 1;
+
+    cmd_clear();
+    char buf[96];
+    kprintf_to_buffer(buf, sizeof(buf), "top: %d threads, %u CPUs %u%% busy - any key exits",
+                      ncur, cpus, (uint32_t)(busy * 100 / (elapsed_cycles * (cpus ? cpus : 1))));
+    shell_println(buf);
+    shell_println("  TID NAME             ST CPU  CPU%  RUN(ms)    VOL  INVOL  P99us  MAXus");
+    for (int i = 0; i < ncur && i < TOP_LINES; i++) {
+        thread_stats_t *t = &top_cur[top_order[i]];
+        kprintf_to_buffer(buf, sizeof(buf), "%5u %-16s %c %3u %5u %8lu %6u %6u %6lu %6lu",
+                          t->tid, t->name, thread_state_name(t->state)[0], t->cpu,
+                          (uint32_t)(top_delta[top_order[i]] * 100 / elapsed_cycles),
+                          tsc_cycles_to_ns(t->run_cycles) / 1000000,
+                          t->voluntary_switches, t->involuntary_switches,
+                          top_wait_percentile(t, 99),
+                          tsc_cycles_to_ns(t->wait_max_cycles) / 1000);
+        shell_println(buf);
+    }
+    graphic_flush();
+}
+
+static void cmd_top(const char *args) {
+    while (*args == ' ') args++;
+    if (*args >= '0' && *args <= '9') {
+        uint32_t tid = 0;
+        while (*args >= '0' && *args <= '9') tid = tid * 10 + (*args++ - '0');
+        top_show_thread(tid);
+        return;
+    }
+
+    int nprev = thread_get_stats(top_prev, TOP_MAX_THREADS);
+    uint64_t prev_tsc = rdtsc();
+    while (!keyboard_wait_key(TOP_REFRESH_MS)) {
+        int ncur = thread_get_stats(top_cur, TOP_MAX_THREADS);
+        uint64_t now = rdtsc();
+        top_draw(nprev, ncur, now - prev_tsc);
+
+        for (int i = 0; i < ncur; i++) top_prev[i] = top_cur[i];
+        nprev = ncur;
+        prev_tsc = now;
+    }
+    keyboard_get_char();
+}
+
 // Simple IP address parser (e.g., "10.0.2.2")
 static uint32_t parse_ip(const char *str) {
     uint32_t ip = 0;
@@ -503,7 +1013,7 @@ static void cmd_ping(const char *args) {
     
     if (result.received > 0) {
         uint32_t avg = result.total_time / result.received;
-        kprintf_to_buffer(buf, sizeof(buf), "RTT: min=%u avg=%u max=%u ms",
+        kprintf_to_buffer(buf, sizeof(buf), "RTT: min=%u avg=%u max=%u us",
             result.min_time, avg, result.max_time);
         shell_println(buf);
     } else {
@@ -511,6 +1021,189 @@ static void cmd_ping(const char *args) {
     }
 }
 
+// Print one address in dotted form into 'buf'
+static void format_ip(char *buf, size_t size, uint32_t ip) {
+    kprintf_to_buffer(buf, size, "%d.%d.%d.%d",
+        (ip >> 24) & 0xFF, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+}
+
+// Step past the current word and any spaces after it
+static const char *next_word(const char *s) {
+    while (*s && *s != ' ') s++;
+    while (*s == ' ') s++;
+    return s;
+}
+
+static void cmd_route(const char *args) {
+    char buf[96];
+    while (*args == ' ') args++;
+
+    bool add = shell_strncmp(args, "add ", 4) == 0;
+    bool del = shell_strncmp(args, "del ", 4) == 0;
+    if (add || del) {
+        args = next_word(args);
+
+        // <net>/<len> or "default"
+        uint32_t dest = 0;
+        uint32_t prefix_len = 0;
+        if (shell_strncmp(args, "default", 7) != 0) {
+            dest = parse_ip(args);
+            prefix_len = 32;
+            while (*args && *args != '/' && *args != ' ') args++;
+            if (*args == '/') {
+                prefix_len = 0;
+                for (args++; *args >= '0' && *args <= '9'; args++) {
+                    prefix_len = prefix_len * 10 + (*args - '0');
+                }
+            }
+        }
+        args = next_word(args);
+        if (prefix_len > 32) {
+            shell_println("Invalid prefix length");
+            return;
+        }
+
+        uint32_t gateway = 0;
+        uint32_t metric = ROUTE_METRIC_DEFAULT;
+        network_interface_t *iface = NULL;
+        while (*args) {
+            if (shell_strncmp(args, "via ", 4) == 0) {
+                args = next_word(args);
+                gateway = parse_ip(args);
+            } else if (shell_strncmp(args, "dev ", 4) == 0) {
+                args = next_word(args);
+                char name[16];
+                int n = 0;
+                while (args[n] && args[n] != ' ' && n < (int)sizeof(name) - 1) {
+                    name[n] = args[n];
+                    n++;
+                }
+                name[n] = '\0';
+                iface = netdev_get_by_name(name);
+                if (!iface) {
+                    shell_print("Unknown interface: ");
+                    shell_println(name);
+                    return;
+                }
+            } else if (shell_strncmp(args, "metric ", 7) == 0) {
+                args = next_word(args);
+                metric = 0;
+                for (const char *d = args; *d >= '0' && *d <= '9'; d++) {
+                    metric = metric * 10 + (*d - '0');
+                }
+            } else {
+                shell_print("Unexpected argument: ");
+                shell_println(args);
+                return;
+            }
+            args = next_word(args);
+        }
+
+        int ret;
+        if (add) {
+            // Without a device, go out wherever the gateway is reachable
+            if (!iface && gateway) {
+                iface = network_find_route(gateway);
+            }
+            if (!iface) {
+                shell_println("Need 'dev <if>' or a reachable 'via <gw>'");
+                return;
+            }
+            ret = route_add(dest, (uint8_t)prefix_len, gateway, iface, metric, ROUTE_F_STATIC);
+        } else {
+            ret = route_delete(dest, (uint8_t)prefix_len, iface);
+        }
+        if (ret != NET_SUCCESS) {
+            shell_println(add ? "Failed to add route" : "No such route");
+        }
+        return;
+    }
+
+    static route_info_t info[16];
+    int count = route_get_info(info, 16);
+    route_stats_t stats;
+    route_get_stats(&stats);
+    if (count == 0) {
+        shell_println("No routes");
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        route_info_t *r = &info[i];
+        char dest[16];
+        char gw[16];
+        format_ip(dest, sizeof(dest), r->dest);
+        format_ip(gw, sizeof(gw), r->gateway);
+        kprintf_to_buffer(buf, sizeof(buf), "  %s/%u %s%s dev %s metric %u%s",
+            dest, (unsigned)r->prefix_len,
+            r->gateway ? "via " : "", r->gateway ? gw : "link",
+            r->iface_name, r->metric,
+            (r->flags & ROUTE_F_STATIC) ? " static" : "");
+        shell_println(buf);
+    }
+    if ((int)stats.routes > count) {
+        kprintf_to_buffer(buf, sizeof(buf), "  ... %d more (%u total)", (int)stats.routes - count, stats.routes);
+        shell_println(buf);
+    }
+    kprintf_to_buffer(buf, sizeof(buf), "  cache: %lu hits, %lu misses", stats.cache_hits, stats.cache_misses);
+    shell_println(buf);
+}
+
+static void cmd_pcap(const char *args) {
+    char buf[96];
+    while (*args == ' ') args++;
+
+    if (shell_strncmp(args, "start", 5) == 0 && (args[5] == '\0' || args[5] == ' ')) {
+        args = next_word(args);
+        uint32_t snap = 0;
+        if (shell_strncmp(args, "snap ", 5) == 0) {
+            args = next_word(args);
+            while (*args >= '0' && *args <= '9') {
+                snap = snap * 10 + (uint32_t)(*args++ - '0');
+            }
+            while (*args == ' ') args++;
+        }
+
+        pcap_filter_t filter;
+        if (pcap_parse_filter(args, &filter) != 0) {
+            shell_print("Bad filter: ");
+            shell_println(args);
+            return;
+        }
+        int ret = pcap_start(&filter, snap);
+        if (ret == NET_INVALID_PARAM) {
+            kprintf_to_buffer(buf, sizeof(buf), "Snap length out of range (max %d)", PCAP_SNAPLEN_MAX);
+            shell_println(buf);
+            return;
+        } else if (ret != NET_SUCCESS) {
+            shell_println("Failed to start capture");
+            return;
+        }
+    } else if (shell_strcmp(args, "stop") == 0) {
+        pcap_stop();
+    } else if (shell_strncmp(args, "save ", 5) == 0) {
+        args = next_word(args);
+        int frames = pcap_export(args);
+        if (frames < 0) {
+            shell_println(fat16_is_mounted() ? "Save failed" : "No filesystem mounted");
+        } else {
+            kprintf_to_buffer(buf, sizeof(buf), "Wrote %d frames to %s", frames, args);
+            shell_println(buf);
+        }
+        return;
+    } else if (*args) {
+        shell_println("Usage: pcap [start [snap n] [rx|tx] [arp|ip|icmp|tcp|udp]");
+        shell_println("            [host a.b.c.d] [port n] [dev if] | stop | save <file>]");
+        return;
+    }
+
+    pcap_status_t st;
+    pcap_get_status(&st);
+    kprintf_to_buffer(buf, sizeof(buf), "Capture %s: %lu captured, %lu filtered, %u/%u held, snap %u",
+        st.enabled ? "on" : "off", st.captured, st.filtered, st.held, st.slots, st.snaplen);
+    shell_println(buf);
+}
+
 static void shell_execute(const char *cmd) {
     // Skip leading whitespace
     while (*cmd == ' ') cmd++;
@@ -529,18 +1222,40 @@ static void shell_execute(const char *cmd) {
         cmd_pci();
     } else if (shell_strcmp(cmd, "net") == 0) {
         cmd_net();
+    } else if (shell_strcmp(cmd, "netstat") == 0 || shell_strcmp(cmd, "ifstat") == 0) {
+        cmd_netstat();
     } else if (shell_strcmp(cmd, "arp") == 0) {
         cmd_arp();
+    } else if (shell_strcmp(cmd, "tcp") == 0 || shell_strncmp(cmd, "tcp ", 4) == 0) {
+        cmd_tcp(cmd + 3);
+    } else if (shell_strcmp(cmd, "pcap") == 0 || shell_strncmp(cmd, "pcap ", 5) == 0) {
+        cmd_pcap(cmd + 4);
+    } else if (shell_strcmp(cmd, "route") == 0 || shell_strncmp(cmd, "route ", 6) == 0) {
+        cmd_route(cmd + 5);
+    } else if (shell_strcmp(cmd, "bench") == 0 || shell_strncmp(cmd, "bench ", 6) == 0) {
+        cmd_bench(cmd + 5);
+    } else if (shell_strcmp(cmd, "prof") == 0 || shell_strncmp(cmd, "prof ", 5) == 0) {
+        cmd_prof(cmd + 4);
+    } else if (shell_strcmp(cmd, "log") == 0) {
+        cmd_log();
     } else if (shell_strcmp(cmd, "uptime") == 0) {
         cmd_uptime();
+    } else if (shell_strcmp(cmd, "boot") == 0) {
+        cmd_boot();
     } else if (shell_strncmp(cmd, "ping ", 5) == 0 || shell_strcmp(cmd, "ping") == 0) {
         cmd_ping(cmd + 4);
-    } else if (shell_strcmp(cmd, "ls") == 0) {
-        cmd_ls();
+    } else if (shell_strcmp(cmd, "ls") == 0 || shell_strncmp(cmd, "ls ", 3) == 0) {
+        cmd_ls(cmd + 2);
+    } else if (shell_strcmp(cmd, "mkdir") == 0 || shell_strncmp(cmd, "mkdir ", 6) == 0) {
+        cmd_mkdir(cmd + 5);
+    } else if (shell_strcmp(cmd, "rm") == 0 || shell_strncmp(cmd, "rm ", 3) == 0) {
+        cmd_rm(cmd + 2);
     } else if (shell_strcmp(cmd, "cat") == 0 || shell_strncmp(cmd, "cat ", 4) == 0) {
         cmd_cat(cmd + 3);
     } else if (shell_strcmp(cmd, "write") == 0 || shell_strncmp(cmd, "write ", 6) == 0) {
         cmd_write(cmd + 5);
+    } else if (shell_strcmp(cmd, "append") == 0 || shell_strncmp(cmd, "append ", 7) == 0) {
+        cmd_append(cmd + 6);
     } else if (shell_strcmp(cmd, "shutdown") == 0) {
         shell_println("Shutting down...");
         acpi_shutdown();
@@ -549,8 +1264,14 @@ static void shell_execute(const char *cmd) {
         acpi_reboot();
     } else if (shell_strcmp(cmd, "disk") == 0) {
         cmd_disk();
+    } else if (shell_strcmp(cmd, "sync") == 0) {
+        cmd_sync();
     } else if (shell_strcmp(cmd, "format") == 0 || shell_strncmp(cmd, "format ", 7) == 0) {
         cmd_format(cmd + 6);
+    } else if (shell_strcmp(cmd, "locks") == 0 || shell_strncmp(cmd, "locks ", 6) == 0) {
+        cmd_locks(cmd + 5);
+    } else if (shell_strcmp(cmd, "top") == 0 || shell_strncmp(cmd, "top ", 4) == 0) {
+        cmd_top(cmd + 3);
     } else {
         shell_print("Unknown command: ");
         shell_println(cmd);
@@ -567,7 +1288,7 @@ static void shell_redraw_cmd(void) {
     
     // Redraw command
     for (int i = 0; i < cmd_pos; i++) {
-        draw_char(shell_x, shell_y, cmd_buffer[i], 0xFFFFFF);
+        draw_char_bg(shell_x, shell_y, cmd_buffer[i], 0xFFFFFF, 0x6495ED);
         shell_x += 8;
     }
 }
@@ -650,7 +1371,7 @@ void shell_process_char(unsigned char c) {
         // Printable character
         if (cmd_pos < SHELL_BUFFER_SIZE - 1) {
             cmd_buffer[cmd_pos++] = c;
-            draw_char(shell_x, shell_y, c, 0xFFFFFF);
+            draw_char_bg(shell_x, shell_y, c, 0xFFFFFF, 0x6495ED);
             shell_x += 8;
         }
     }
@@ -669,13 +1390,10 @@ void shell_init(void) {
     draw_string(10, 8, "CGOS Shell - Type 'help' for commands", 0xFFFFFF);
     
     shell_prompt();
+    graphic_flush();
 }
 
 void shell_run(void) {
-    // Get eth0 interface for DHCP polling
-    network_interface_t *eth = network_get_interface(1);  // eth0
-    dhcp_client_t *dhcp = eth ? dhcp_get_client(eth) : NULL;
-    
     static uint32_t loop_count = 0;
     
     DEBUG_INFO("Shell loop starting...\n");
@@ -695,17 +1413,18 @@ void shell_run(void) {
         if (keyboard_has_key()) {
             char c = keyboard_get_char();
             shell_process_char(c);
+            graphic_flush();
         } else {
-            // No key available - yield CPU to other threads
-            // This makes the shell appear I/O-bound (low CPU usage)
-            // and prevents priority demotion
-            thread_yield();
+            // No key available - sleep until one arrives or it is time to
+            // poll the network again. This keeps the shell I/O-bound (low
+            // CPU usage, no priority demotion) and lets the CPU go idle.
+            keyboard_wait_key(SHELL_POLL_MS);
         }
         
-        // Process network packets (keep DHCP working)
-        network_process_packets();
-        if (dhcp) {
-            dhcp_client_update(dhcp);
+        // Without RX interrupts, hand the deferred-work thread a receive
+        // pass every iteration (keeps DHCP replies coming in)
+        if (!network_rx_interrupts()) {
+            network_schedule_poll();
         }
     }
 }
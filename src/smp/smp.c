@@ -0,0 +1,126 @@
+#include "smp.h"
+#include <limine.h>
+#include "../interrupt/interrupt.h"
+#include "../interrupt/lapic.h"
+#include "../gdt/gdt.h"
+#include "../sched/scheduler.h"
+#include "../sched/fpu.h"
+#include "../debug/debug.h"
+
+// How long to wait for an AP to report in before giving up on it
+#define AP_STARTUP_SPINS    50000000
+
+static cpu_info_t cpus[MAX_CPUS];
+static uint32_t cpu_count = 1;
+
+// Point GS at this CPU's block so smp_cpu_id() is a single load
+static void smp_setup_percpu(uint32_t cpu) {
+    cpus[cpu].self = &cpus[cpu];
+    cpus[cpu].id = cpu;
+    wrmsr(IA32_GS_BASE_MSR, (uint64_t)&cpus[cpu]);
+}
+
+void smp_bsp_init(void) {
+    smp_setup_percpu(0);
+    cpus[0].online = true;
+}
+
+// Entry point for application processors (jumped to by Limine)
+static void ap_entry(struct limine_mp_info *info) {
+    uint32_t cpu = (uint32_t)info->extra_argument;
+    
+    // Segment reload in gdt_init_ap clears GS, so set it up afterwards
+    gdt_init_ap(cpu);
+    smp_setup_percpu(cpu);
+    interrupt_load();
+    lapic_init();
+    fpu_init_cpu();
+    
+    DEBUG_INFO("SMP: CPU %u (LAPIC %u) online\n", cpu, cpus[cpu].lapic_id);
+    __atomic_store_n(&cpus[cpu].online, true, __ATOMIC_RELEASE);
+    
+    // Wait for the BSP to start scheduling, then run this CPU's threads
+    scheduler_start_ap();
+}
+
+void smp_init(struct limine_mp_response *mp) {
+    DEBUG_INFO("Initializing SMP...\n");
+    
+    lapic_init();
+    idt_set_gate(IPI_RESCHEDULE_VECTOR, (uint64_t)irq_handler_resched,
+                 GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
+    cpus[0].lapic_id = lapic_get_id();
+    
+    if (!mp) {
+        DEBUG_WARN("SMP: no MP response from bootloader, running on the BSP only\n");
+        return;
+    }
+    
+    DEBUG_INFO("SMP: bootloader reports %lu CPUs, BSP LAPIC %u\n",
+               mp->cpu_count, mp->bsp_lapic_id);
+    
+    for (uint64_t i = 0; i < mp->cpu_count; i++) {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) {
+            continue;
+        }
+        if (cpu_count >= MAX_CPUS) {
+            DEBUG_WARN("SMP: ignoring CPU with LAPIC %u (MAX_CPUS=%d)\n",
+                       info->lapic_id, MAX_CPUS);
+            continue;
+        }
+        
+        uint32_t cpu = cpu_count;
+        cpus[cpu].lapic_id = info->lapic_id;
+        cpus[cpu].online = false;
+        
+        // Per-CPU scheduler state (idle thread etc.) is allocated here on
+        // the BSP so APs never race on the allocator during bring-up
+        if (scheduler_init_cpu(cpu) != 0) {
+            DEBUG_ERROR("SMP: failed to set up scheduler for CPU %u\n", cpu);
+            continue;
+        }
+        cpu_count++;
+        
+        // Writing goto_address releases the AP
+        info->extra_argument = cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+        
+        uint64_t spins = 0;
+        while (!__atomic_load_n(&cpus[cpu].online, __ATOMIC_ACQUIRE) &&
+               spins++ < AP_STARTUP_SPINS) {
+            __asm__ volatile("pause");
+        }
+        if (!cpus[cpu].online) {
+            DEBUG_ERROR("SMP: CPU %u (LAPIC %u) did not come online\n",
+                        cpu, info->lapic_id);
+        }
+    }
+    
+    DEBUG_INFO("SMP: %u CPUs started\n", cpu_count);
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+bool smp_cpu_online(uint32_t cpu) {
+    return cpu < cpu_count && cpus[cpu].online;
+}
+
+cpu_info_t *smp_get_cpu(uint32_t cpu) {
+    return cpu < MAX_CPUS ? &cpus[cpu] : NULL;
+}
+
+void smp_send_reschedule(uint32_t cpu) {
+    if (cpu == smp_cpu_id() || !smp_cpu_online(cpu) || !lapic_is_ready()) {
+        return;
+    }
+    lapic_send_ipi(cpus[cpu].lapic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+void smp_reschedule_irq_handler(void) {
+    // Nothing to do besides waking up: the idle loop rechecks its run
+    // queue as soon as hlt returns
+    lapic_eoi();
+}
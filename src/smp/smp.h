@@ -0,0 +1,59 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct limine_mp_response;
+
+// Maximum number of CPUs we bring up; extra CPUs reported by the
+// bootloader are left parked
+#define MAX_CPUS                16
+
+// IPI sent to a CPU when work is queued on it while it may be halted
+#define IPI_RESCHEDULE_VECTOR   0xF0
+
+// IA32_GS_BASE: each CPU's GS segment points at its own cpu_info_t
+#define IA32_GS_BASE_MSR        0xC0000101
+
+// Per-CPU identity block, reached through GS
+typedef struct cpu_info {
+    struct cpu_info *self;      // Offset 0: pointer to this block
+    uint32_t id;                // Logical CPU index (0 = BSP)
+    uint32_t lapic_id;          // Local APIC ID
+    volatile bool online;       // Finished bring-up and running its scheduler
+} cpu_info_t;
+
+// Set up CPU 0's per-CPU block. Call right after gdt_init() (loading the
+// GDT clears the GS base) and before anything asks for smp_cpu_id().
+void smp_bsp_init(void);
+
+// Start every application processor reported by the bootloader. Each AP
+// loads its own GDT/TSS, the shared IDT and its LAPIC, then waits for
+// scheduler_start() on the BSP. mp may be NULL (uniprocessor boot).
+void smp_init(struct limine_mp_response *mp);
+
+// Logical index of the calling CPU
+static inline uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(cpu_info_t, id)));
+    return id;
+}
+
+// Number of CPUs that have been started (including the BSP)
+uint32_t smp_cpu_count(void);
+
+// Whether a CPU index refers to a CPU that is up and scheduling
+bool smp_cpu_online(uint32_t cpu);
+
+// Per-CPU block for a CPU index (NULL if out of range)
+cpu_info_t *smp_get_cpu(uint32_t cpu);
+
+// Kick another CPU out of hlt so it rechecks its run queue
+void smp_send_reschedule(uint32_t cpu);
+
+// C handler for IPI_RESCHEDULE_VECTOR (called from assembly stub)
+void smp_reschedule_irq_handler(void);
+
+#endif // SMP_H
@@ -0,0 +1,70 @@
+#include "hpet.h"
+#include "../acpi/acpi.h"
+#include "../memory/vmm.h"
+#include "../debug/debug.h"
+
+static volatile uint8_t *hpet_base = NULL;
+static uint64_t period_fs = 0;      // Femtoseconds per counter tick
+static uint64_t counter_start = 0;
+
+static inline uint64_t hpet_read(uint32_t reg) {
+    return *(volatile uint64_t *)(hpet_base + reg);
+}
+
+static inline void hpet_write(uint32_t reg, uint64_t value) {
+    *(volatile uint64_t *)(hpet_base + reg) = value;
+}
+
+int hpet_init(void) {
+    acpi_hpet_t *table = acpi_find_table("HPET");
+    if (!table) {
+        DEBUG_WARN("HPET: no ACPI HPET table\n");
+        return -1;
+    }
+    if (table->base_address.address_space != 0) {
+        DEBUG_WARN("HPET: registers not in memory space\n");
+        return -1;
+    }
+    
+    hpet_base = vmm_map_mmio(table->base_address.address, PAGE_SIZE);
+    if (!hpet_base) {
+        return -1;
+    }
+    
+    uint64_t caps = hpet_read(HPET_REG_CAPABILITIES);
+    period_fs = caps >> 32;
+    if (period_fs == 0 || period_fs > 100000000ULL) {
+        DEBUG_WARN("HPET: invalid counter period %lu fs\n", period_fs);
+        hpet_base = NULL;
+        return -1;
+    }
+    if (!(caps & HPET_CAP_COUNT_64BIT)) {
+        // A 32-bit counter wraps every few minutes; not worth the trouble
+        DEBUG_WARN("HPET: only a 32-bit main counter, not using it\n");
+        hpet_base = NULL;
+        return -1;
+    }
+    
+    // Make sure the main counter is running
+    hpet_write(HPET_REG_CONFIG, hpet_read(HPET_REG_CONFIG) | HPET_CONFIG_ENABLE);
+    counter_start = hpet_read(HPET_REG_MAIN_COUNTER);
+    
+    DEBUG_INFO("HPET: %lu kHz main counter at phys 0x%lx\n",
+               1000000000000ULL / period_fs, table->base_address.address);
+    return 0;
+}
+
+bool hpet_is_available(void) {
+    return hpet_base != NULL;
+}
+
+uint64_t hpet_read_counter(void) {
+    return hpet_read(HPET_REG_MAIN_COUNTER);
+}
+
+uint64_t hpet_get_ns(void) {
+    uint64_t count = hpet_read(HPET_REG_MAIN_COUNTER) - counter_start;
+    // Split the multiply so count * period_fs can't overflow
+    return (count / HPET_FS_PER_NS) * period_fs +
+           ((count % HPET_FS_PER_NS) * period_fs) / HPET_FS_PER_NS;
+}
@@ -0,0 +1,30 @@
+#ifndef HPET_H
+#define HPET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// HPET register offsets
+#define HPET_REG_CAPABILITIES   0x000   // [63:32] counter period in femtoseconds
+#define HPET_REG_CONFIG         0x010
+#define HPET_REG_MAIN_COUNTER   0x0F0
+
+#define HPET_CAP_COUNT_64BIT    (1ULL << 13)
+#define HPET_CONFIG_ENABLE      (1ULL << 0)
+
+#define HPET_FS_PER_NS          1000000ULL
+
+// Locate the HPET through ACPI, map it and start the main counter.
+// Returns 0 on success, -1 if no usable (64-bit) HPET is present.
+int hpet_init(void);
+
+// Whether hpet_init() succeeded
+bool hpet_is_available(void);
+
+// Raw main counter value
+uint64_t hpet_read_counter(void);
+
+// Nanoseconds since hpet_init()
+uint64_t hpet_get_ns(void);
+
+#endif // HPET_H
@@ -0,0 +1,246 @@
+#include "ktimer.h"
+#include "timer.h"
+#include "../sched/spinlock.h"
+
+// Ticks covered by levels 0..n
+#define LEVEL_SPAN(level)   (1ULL << (KTIMER_SLOT_BITS * ((level) + 1)))
+#define MAX_DELTA           (LEVEL_SPAN(KTIMER_LEVELS - 1) - 1)
+
+static ktimer_t *wheel[KTIMER_LEVELS][KTIMER_SLOTS];
+
+// Bit per non-empty slot (KTIMER_SLOTS is 64), so finding the next event
+// never scans the slots themselves
+static uint64_t occupied[KTIMER_LEVELS];
+
+// Next tick the wheel will process
+static uint64_t wheel_now;
+static uint32_t pending_count;
+static spinlock_t wheel_lock = SPINLOCK_INIT_NAMED("ktimer");
+
+// Timer whose callback ktimer_process() is running; its pending flag is
+// already clear. ktimer_cancel_sync() waits for this to move on.
+static ktimer_t *volatile running_timer;
+
+// ============== Slot Lists ==============
+// All require wheel_lock
+
+static void slot_insert(ktimer_t *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel_now) {
+        expires = wheel_now;
+    }
+    uint64_t delta = expires - wheel_now;
+    if (delta > MAX_DELTA) {
+        // Park in the last level; re-filed when its slot cascades
+        expires = wheel_now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    
+    int level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= LEVEL_SPAN(level)) {
+        level++;
+    }
+    int slot = (expires >> (KTIMER_SLOT_BITS * level)) & KTIMER_SLOT_MASK;
+    
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel[level][slot];
+    if (timer->next) {
+        timer->next->prev = timer;
+    }
+    wheel[level][slot] = timer;
+    occupied[level] |= 1ULL << slot;
+}
+
+static void slot_remove(ktimer_t *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    if (!wheel[timer->level][timer->slot]) {
+        occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Re-file every timer of one upper-level slot into the levels below
+// Returns the slot index so the caller knows whether to cascade further
+static int cascade(int level) {
+    int slot = (wheel_now >> (KTIMER_SLOT_BITS * level)) & KTIMER_SLOT_MASK;
+    ktimer_t *timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+    
+    while (timer) {
+        ktimer_t *next = timer->next;
+        slot_insert(timer);
+        timer = next;
+    }
+    return slot;
+}
+
+// Earliest tick with a due timer or a cascade to run
+static uint64_t next_event_locked(void) {
+    if (pending_count == 0) {
+        return UINT64_MAX;
+    }
+    
+    // Level 0 holds exact deadlines for the next KTIMER_SLOTS ticks; rotate
+    // its bitmap so bit 0 is the slot for wheel_now
+    uint64_t next = UINT64_MAX;
+    int base = wheel_now & KTIMER_SLOT_MASK;
+    if (occupied[0]) {
+        uint64_t bits = occupied[0] >> base;
+        if (base) {
+            bits |= occupied[0] << (KTIMER_SLOTS - base);
+        }
+        next = wheel_now + __builtin_ctzll(bits);
+    }
+    
+    // Coarser levels only move down at a level-0 wrap, so if any are
+    // populated the wheel must at least be run at the next wrap
+    uint64_t wrap = (wheel_now + KTIMER_SLOT_MASK) & ~(uint64_t)KTIMER_SLOT_MASK;
+    if (wrap < next) {
+        for (int level = 1; level < KTIMER_LEVELS; level++) {
+            if (occupied[level]) {
+                next = wrap;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+// ============== Public API ==============
+
+void ktimer_init(uint64_t now) {
+    for (int level = 0; level < KTIMER_LEVELS; level++) {
+        for (int slot = 0; slot < KTIMER_SLOTS; slot++) {
+            wheel[level][slot] = NULL;
+        }
+        occupied[level] = 0;
+    }
+    wheel_now = now;
+    pending_count = 0;
+}
+
+void ktimer_setup(ktimer_t *timer, ktimer_callback_t callback, void *arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->level = -1;
+    timer->slot = 0;
+    timer->pending = false;
+}
+
+void ktimer_add(ktimer_t *timer, uint64_t expires) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    
+    if (timer->pending) {
+        slot_remove(timer);
+    } else {
+        pending_count++;
+    }
+    timer->expires = expires;
+    timer->pending = true;
+    slot_insert(timer);
+    
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    
+    // A tickless CPU 0 may be sleeping past this deadline
+    timer_deadline_added(expires);
+}
+
+bool ktimer_cancel(ktimer_t *timer) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    
+    bool was_pending = timer->pending;
+    if (was_pending) {
+        slot_remove(timer);
+        timer->pending = false;
+        pending_count--;
+    }
+    
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return was_pending;
+}
+
+bool ktimer_cancel_sync(ktimer_t *timer) {
+    bool was_pending = ktimer_cancel(timer);
+    while (running_timer == timer) {
+        __asm__ volatile("pause");
+    }
+    return was_pending;
+}
+
+void ktimer_process(uint64_t now) {
+    spin_lock(&wheel_lock);
+    while (wheel_now <= now) {
+        // Go straight to the next tick with work. After a tickless idle
+        // that skips every empty tick instead of walking them one by one.
+        uint64_t next = next_event_locked();
+        if (next > now) {
+            wheel_now = now + 1;
+            break;
+        }
+        wheel_now = next;
+        
+        // Crossing a level-0 wrap: pull the next slot of each coarser level
+        // down, stopping at the first level that didn't wrap
+        if ((wheel_now & KTIMER_SLOT_MASK) == 0) {
+            for (int level = 1; level < KTIMER_LEVELS; level++) {
+                if (cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+        
+        uint64_t tick = wheel_now++;
+        int slot = tick & KTIMER_SLOT_MASK;
+        
+        // Take the due timers off one at a time, each under the lock, and
+        // run the callback unlocked so it can re-arm timers. A cancel then
+        // either finds the timer still queued or sees it running.
+        ktimer_t *timer = wheel[0][slot];
+        while (timer) {
+            if (timer->expires > tick) {
+                // Armed a full lap ahead while this slot was draining
+                timer = timer->next;
+                continue;
+            }
+            slot_remove(timer);
+            timer->pending = false;
+            pending_count--;
+            ktimer_callback_t callback = timer->callback;
+            void *arg = timer->arg;
+            running_timer = timer;
+            spin_unlock(&wheel_lock);
+            
+            callback(arg);
+            
+            spin_lock(&wheel_lock);
+            running_timer = NULL;
+            timer = wheel[0][slot];
+        }
+    }
+    spin_unlock(&wheel_lock);
+}
+
+uint64_t ktimer_next_event(void) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    uint64_t next = next_event_locked();
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return next;
+}
+
+uint32_t ktimer_pending_count(void) {
+    return pending_count;
+}
@@ -0,0 +1,63 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Hierarchical timing wheel: 4 levels of 64 slots, each level 64x coarser
+// than the one below. Level 0 resolves single ticks, level 3 reaches 2^24
+// ticks (~4.6 hours at 1kHz); longer timers are parked in the last level
+// and re-filed when they cascade down.
+#define KTIMER_LEVELS       4
+#define KTIMER_SLOT_BITS    6
+#define KTIMER_SLOTS        (1 << KTIMER_SLOT_BITS)
+#define KTIMER_SLOT_MASK    (KTIMER_SLOTS - 1)
+
+typedef void (*ktimer_callback_t)(void *arg);
+
+// A one-shot kernel timer. Embed it in the owning object; the wheel never
+// allocates.
+typedef struct ktimer {
+    struct ktimer *next;
+    struct ktimer *prev;
+    uint64_t expires;               // Absolute tick at which the callback runs
+    ktimer_callback_t callback;     // Runs in timer interrupt context
+    void *arg;
+    int8_t level;                   // Wheel position while pending
+    uint8_t slot;
+    volatile bool pending;          // Queued and not yet fired or cancelled
+} ktimer_t;
+
+// Initialize the wheel at the current tick count
+void ktimer_init(uint64_t now);
+
+// Prepare a timer for use (does not arm it). The timer must be neither
+// pending nor running.
+void ktimer_setup(ktimer_t *timer, ktimer_callback_t callback, void *arg);
+
+// Arm (or re-arm) a timer for absolute tick 'expires'. A deadline in the
+// past fires on the next tick. Also allowed from the timer's own callback.
+// O(1).
+void ktimer_add(ktimer_t *timer, uint64_t expires);
+
+// Disarm a timer. Returns true if it was pending. A callback that has
+// already started keeps running. O(1).
+bool ktimer_cancel(ktimer_t *timer);
+
+// Disarm a timer and wait for a running callback to return. Never call it
+// from that callback, or while holding a lock the callback takes.
+bool ktimer_cancel_sync(ktimer_t *timer);
+
+// Run every timer due at or before 'now'. Called from the timer interrupt;
+// amortized O(1) per tick.
+void ktimer_process(uint64_t now);
+
+// Number of armed timers
+uint32_t ktimer_pending_count(void);
+
+// Earliest tick at which ktimer_process() has work to do (a due timer or a
+// cascade), or UINT64_MAX if nothing is pending. Used to program tickless idle.
+uint64_t ktimer_next_event(void);
+
+#endif // KTIMER_H
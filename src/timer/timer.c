@@ -1,11 +1,52 @@
 #include "timer.h"
 #include "../debug/debug.h"
+#include "../debug/trace.h"
 #include "../interrupt/interrupt.h"
 #include "../sched/scheduler.h"
+#include "../sched/waitqueue.h"
+#include "../sched/spinlock.h"
+#include "../interrupt/lapic.h"
+#include "../gdt/gdt.h"
+#include "../smp/smp.h"
+#include "ktimer.h"
+#include "hpet.h"
+#include "tsc.h"
 
 // Global tick counter
 static volatile uint64_t ticks = 0;
 
+// Clock behind timer_get_ns(). Each switch records the time and the new
+// source's raw reading, so the clock continues without a jump.
+typedef enum {
+    CLOCK_PIT,
+    CLOCK_HPET,
+    CLOCK_TSC
+} clock_source_t;
+
+static clock_source_t clock_source = CLOCK_PIT;
+static uint64_t clock_base_ns = 0;
+static uint64_t clock_base_raw = 0;     // HPET ns or TSC value at the switch
+
+// Per-CPU LAPIC one-shot ticks instead of the PIT
+static bool lapic_tick_mode = false;
+static bool tsc_deadline_mode = false;
+static uint32_t lapic_counts_per_tick = 0;
+static uint64_t tsc_cycles_per_tick = 0;
+
+// Longest one-shot we program, in ticks (bounded by the 32-bit initial
+// count; about a minute in TSC-deadline mode)
+static uint64_t lapic_max_ticks = 0;
+#define TSC_DEADLINE_MAX_TICKS  (60 * TIMER_FREQUENCY_HZ)
+
+// Tick CPU 0 will wake at while in tickless idle, 0 when it is not idle.
+// UINT64_MAX while it is still deciding, so a racing ktimer_add() kicks it.
+static volatile uint64_t bsp_idle_until = 0;
+
+// Calibration windows; the 1 ms PIT clock needs a longer one
+#define LAPIC_CALIBRATE_NS      (10 * 1000000ULL)
+#define TSC_CALIBRATE_NS_HPET   (10 * 1000000ULL)
+#define TSC_CALIBRATE_NS_PIT    (100 * 1000000ULL)
+
 // Initialize the 8259 PIC (Programmable Interrupt Controller)
 void pic_init(void) {
     DEBUG_INFO("Initializing PIC...\n");
@@ -55,6 +96,10 @@ void pic_send_eoi(uint8_t irq) {
     outb(PIC1_COMMAND, PIC_EOI);
 }
 
+// PIC mask updates are read-modify-write; drivers probed on parallel boot
+// threads unmask their lines concurrently
+static spinlock_t pic_lock = SPINLOCK_INIT_NAMED("pic");
+
 // Mask (disable) an IRQ
 void pic_set_mask(uint8_t irq) {
     uint16_t port;
@@ -66,8 +111,10 @@ void pic_set_mask(uint8_t irq) {
         port = PIC2_DATA;
         irq -= 8;
     }
+    uint64_t flags = spin_lock_irqsave(&pic_lock);
     value = inb(port) | (1 << irq);
     outb(port, value);
+    spin_unlock_irqrestore(&pic_lock, flags);
 }
 
 // Unmask (enable) an IRQ
@@ -81,16 +128,24 @@ void pic_clear_mask(uint8_t irq) {
         port = PIC2_DATA;
         irq -= 8;
     }
+    uint64_t flags = spin_lock_irqsave(&pic_lock);
     value = inb(port) & ~(1 << irq);
     outb(port, value);
+    spin_unlock_irqrestore(&pic_lock, flags);
 }
 
 // Timer interrupt handler (called from assembly stub)
-void timer_irq_handler(void) {
+void timer_irq_handler(interrupt_frame_t *frame) {
     ticks++;
+    prof_sample(frame->rip);
+    
+    // Fire due kernel timers (including sleeping-thread wakeups)
+    ktimer_process(timer_get_ticks());
     
-    // Let scheduler handle preemption
-    scheduler_tick();
+    // Let scheduler handle preemption (each CPU ticks itself in LAPIC mode)
+    if (!lapic_tick_mode) {
+        scheduler_tick();
+    }
     
     // Send EOI to PIC (inline to minimize overhead)
     outb(PIC1_COMMAND, PIC_EOI);
@@ -103,6 +158,9 @@ void timer_init(void) {
     // First, initialize the PIC
     pic_init();
     
+    // Timer wheel starts at the current tick
+    ktimer_init(ticks);
+    
     // Calculate divisor for desired frequency
     uint16_t divisor = PIT_FREQUENCY / TIMER_FREQUENCY_HZ;
     
@@ -125,20 +183,239 @@ void timer_init(void) {
     DEBUG_INFO("Timer initialized at %d Hz, interrupts enabled\n", TIMER_FREQUENCY_HZ);
 }
 
-// Get current tick count
+// Get current tick count. With the HPET/TSC this is derived from the clock,
+// so it stays correct on a CPU 0 that skipped ticks in tickless idle.
 uint64_t timer_get_ticks(void) {
+    if (clock_source != CLOCK_PIT) {
+        return timer_get_ns() / TIMER_NS_PER_TICK;
+    }
     return ticks;
 }
 
 // Get elapsed seconds since boot
 uint32_t timer_get_seconds(void) {
-    return (uint32_t)(ticks / TIMER_FREQUENCY_HZ);
+    return (uint32_t)(timer_get_ticks() / TIMER_FREQUENCY_HZ);
 }
 
-// Sleep for a given number of milliseconds (busy wait)
+// Sleep for a given number of milliseconds. Threads really sleep; early
+// boot code (no scheduler yet) busy-waits.
 void timer_sleep_ms(uint32_t ms) {
-    uint64_t target = ticks + ms;  // At 1000 Hz, 1 tick = 1 ms
-    while (ticks < target) {
+    if (wait_queue_can_sleep()) {
+        thread_sleep_ms(ms);
+        return;
+    }
+    
+    uint64_t target = timer_get_ticks() + ms;  // At 1000 Hz, 1 tick = 1 ms
+    while (timer_get_ticks() < target) {
         __asm__ volatile("pause");  // Hint to CPU we're in a spin loop
     }
 }
+
+// ============== High-Resolution Clock / Tickless ==============
+
+uint64_t timer_get_ns(void) {
+    switch (clock_source) {
+        case CLOCK_TSC:
+            return clock_base_ns + tsc_cycles_to_ns(rdtsc() - clock_base_raw);
+        case CLOCK_HPET:
+            return clock_base_ns + (hpet_get_ns() - clock_base_raw);
+        default:
+            return ticks * TIMER_NS_PER_TICK;
+    }
+}
+
+uint64_t timer_get_cycles(void) {
+    return rdtsc();
+}
+
+const char *timer_clock_name(void) {
+    switch (clock_source) {
+        case CLOCK_TSC:  return "TSC";
+        case CLOCK_HPET: return "HPET";
+        default:         return "PIT";
+    }
+}
+
+void timer_delay_ns(uint64_t ns) {
+    uint64_t target = timer_get_ns() + ns;
+    while (timer_get_ns() < target) {
+        __asm__ volatile("pause");
+    }
+}
+
+bool timer_is_tickless(void) {
+    return lapic_tick_mode;
+}
+
+// Hand timer_get_ns() over to a new source, continuing from the current time
+static void switch_clock(clock_source_t source) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    
+    uint64_t now = timer_get_ns();
+    clock_base_raw = (source == CLOCK_TSC) ? rdtsc() : hpet_get_ns();
+    clock_base_ns = now;
+    clock_source = source;
+    
+    __asm__ volatile("push %0; popfq" :: "r"(flags) : "memory", "cc");
+}
+
+// Count LAPIC timer decrements over a fixed window of the current clock
+static uint32_t lapic_calibrate(void) {
+    lapic_timer_setup(false);
+    
+    uint64_t start = timer_get_ns();
+    lapic_timer_arm(0xFFFFFFFF);
+    while (timer_get_ns() - start < LAPIC_CALIBRATE_NS) {
+        __asm__ volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_timer_remaining();
+    uint64_t window = timer_get_ns() - start;
+    lapic_timer_arm(0);
+    
+    return (uint32_t)((uint64_t)elapsed * TIMER_NS_PER_TICK / window);
+}
+
+// Program this CPU's next LAPIC timer interrupt 'delta' ticks from now
+static void lapic_arm_ticks(uint64_t delta) {
+    if (delta > lapic_max_ticks) {
+        delta = lapic_max_ticks;
+    }
+    if (tsc_deadline_mode) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, rdtsc() + delta * tsc_cycles_per_tick);
+    } else {
+        lapic_timer_arm((uint32_t)(delta * lapic_counts_per_tick));
+    }
+}
+
+static void lapic_stop(void) {
+    if (tsc_deadline_mode) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    } else {
+        lapic_timer_arm(0);
+    }
+}
+
+int timer_init_highres(void) {
+    if (hpet_init() == 0) {
+        switch_clock(CLOCK_HPET);
+    } else {
+        DEBUG_WARN("No HPET, calibrating against the PIT\n");
+    }
+    
+    // An invariant TSC is the cheapest clock to read (no MMIO or port access)
+    tsc_detect();
+    uint64_t window = (clock_source == CLOCK_HPET) ?
+                      TSC_CALIBRATE_NS_HPET : TSC_CALIBRATE_NS_PIT;
+    if (tsc_is_invariant() && tsc_calibrate(window) == 0) {
+        switch_clock(CLOCK_TSC);
+    }
+    
+    DEBUG_INFO("Clocksource: %s\n", timer_clock_name());
+    if (clock_source == CLOCK_PIT) {
+        // Ticks could not be derived from a clock while tickless
+        return -1;
+    }
+    
+    if (!lapic_is_ready()) {
+        DEBUG_WARN("No LAPIC, keeping the PIT tick\n");
+        return -1;
+    }
+    
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)irq_handler_lapic_timer,
+                 GDT_KERNEL_CODE, IDT_TYPE_INTERRUPT_GATE);
+    
+    if (clock_source == CLOCK_TSC && tsc_has_deadline()) {
+        // The timer fires at an absolute TSC value, no LAPIC calibration
+        tsc_deadline_mode = true;
+        tsc_cycles_per_tick = tsc_ns_to_cycles(TIMER_NS_PER_TICK);
+        lapic_max_ticks = TSC_DEADLINE_MAX_TICKS;
+        DEBUG_INFO("LAPIC timer: TSC-deadline mode, %lu cycles per tick\n",
+                   tsc_cycles_per_tick);
+    } else {
+        lapic_counts_per_tick = lapic_calibrate();
+        if (lapic_counts_per_tick == 0) {
+            DEBUG_WARN("LAPIC timer calibration failed, keeping the PIT tick\n");
+            return -1;
+        }
+        lapic_max_ticks = 0xFFFFFFFFULL / lapic_counts_per_tick;
+        DEBUG_INFO("LAPIC timer: %u counts per tick\n", lapic_counts_per_tick);
+    }
+    
+    // Takes effect as each CPU reaches timer_start_cpu()
+    lapic_tick_mode = true;
+    return 0;
+}
+
+void timer_start_cpu(void) {
+    if (!lapic_tick_mode) {
+        return;
+    }
+    
+    lapic_timer_setup(tsc_deadline_mode);
+    if (smp_cpu_id() == 0) {
+        // CPU 0 now runs the timer wheel off its own LAPIC
+        pic_set_mask(IRQ_TIMER);
+    }
+    lapic_arm_ticks(1);
+}
+
+void timer_lapic_irq_handler(interrupt_frame_t *frame) {
+    lapic_eoi();
+    prof_sample(frame->rip);
+    
+    if (smp_cpu_id() == 0) {
+        uint64_t now = timer_get_ticks();
+        ticks = now;
+        ktimer_process(now);
+    }
+    
+    scheduler_tick_local();
+    
+    // Next tick; an idle CPU overrides this in timer_idle_enter()
+    lapic_arm_ticks(1);
+}
+
+void timer_idle_enter(void) {
+    if (!lapic_tick_mode) {
+        return;
+    }
+    
+    if (smp_cpu_id() != 0) {
+        // Nothing on an AP needs time to pass; wakeups arrive as IPIs
+        lapic_stop();
+        return;
+    }
+    
+    // Publish "idle" before sampling the wheel so a concurrent ktimer_add()
+    // either lands in the sample or sees the flag and sends an IPI
+    __atomic_store_n(&bsp_idle_until, UINT64_MAX, __ATOMIC_SEQ_CST);
+    
+    uint64_t next = ktimer_next_event();
+    uint64_t now = timer_get_ticks();
+    uint64_t delta = next > now ? next - now : 1;
+    if (delta > lapic_max_ticks) {
+        delta = lapic_max_ticks;
+    }
+    
+    __atomic_store_n(&bsp_idle_until, now + delta, __ATOMIC_SEQ_CST);
+    lapic_arm_ticks(delta);
+}
+
+void timer_idle_exit(void) {
+    if (!lapic_tick_mode) {
+        return;
+    }
+    
+    if (smp_cpu_id() == 0) {
+        __atomic_store_n(&bsp_idle_until, 0, __ATOMIC_SEQ_CST);
+    }
+    lapic_arm_ticks(1);
+}
+
+void timer_deadline_added(uint64_t expires) {
+    uint64_t until = __atomic_load_n(&bsp_idle_until, __ATOMIC_SEQ_CST);
+    if (until != 0 && expires < until && smp_cpu_id() != 0) {
+        smp_send_reschedule(0);
+    }
+}
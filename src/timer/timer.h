@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include "../pci/pci.h"  // For outb, inb
 
+struct interrupt_frame;
+
 // PIT (Programmable Interval Timer) ports
 #define PIT_CHANNEL0_DATA   0x40
 #define PIT_CHANNEL1_DATA   0x41
@@ -38,6 +40,7 @@
 // Timer frequency
 #define PIT_FREQUENCY       1193182  // ~1.193182 MHz
 #define TIMER_FREQUENCY_HZ  1000     // 1000 Hz = 1ms per tick
+#define TIMER_NS_PER_TICK   (1000000000ULL / TIMER_FREQUENCY_HZ)
 
 // IRQ numbers
 #define IRQ_TIMER           0
@@ -51,7 +54,46 @@ void timer_init(void);
 uint64_t timer_get_ticks(void);
 uint32_t timer_get_seconds(void);
 void timer_sleep_ms(uint32_t ms);
-void timer_irq_handler(void);
+void timer_irq_handler(struct interrupt_frame *frame);
+
+// ---- High-resolution clock and tickless operation ----
+
+// Pick the best clocksource (invariant TSC, else HPET) and set up the LAPIC
+// timer (TSC-deadline mode when available, else a calibrated one-shot).
+// Once this succeeds each CPU drives its own tick from the LAPIC (armed in
+// timer_start_cpu) and the PIT is retired. Returns -1 and keeps the PIT
+// tick if no high-resolution clock or no LAPIC is available.
+int timer_init_highres(void);
+
+// Start the per-CPU tick on the calling CPU (no-op in PIT mode)
+void timer_start_cpu(void);
+
+// True once ticks come from per-CPU LAPIC one-shots
+bool timer_is_tickless(void);
+
+// Nanoseconds since boot (TSC/HPET resolution when available, else 1 ms)
+uint64_t timer_get_ns(void);
+
+// Raw TSC value, for cycle-level measurements
+uint64_t timer_get_cycles(void);
+
+// Name of the clocksource behind timer_get_ns() ("TSC", "HPET" or "PIT")
+const char *timer_clock_name(void);
+
+// Busy-wait for a number of nanoseconds
+void timer_delay_ns(uint64_t ns);
+
+// Called by the idle loop with interrupts disabled around its hlt. Enter
+// stops this CPU's tick (CPU 0 instead sleeps until the next kernel timer);
+// exit restarts the regular tick.
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+
+// Called by ktimer_add() so a tickless CPU 0 is woken for an earlier deadline
+void timer_deadline_added(uint64_t expires);
+
+// LAPIC timer interrupt handler (called from assembly stub)
+void timer_lapic_irq_handler(struct interrupt_frame *frame);
 
 // PIC functions
 void pic_init(void);
@@ -0,0 +1,83 @@
+#include "tsc.h"
+#include "timer.h"
+#include "../debug/debug.h"
+
+static bool invariant = false;
+static bool deadline = false;
+static uint64_t tsc_hz = 0;
+
+// ns = (cycles * ns_mult) >> 32, and the reverse
+static uint64_t ns_mult = 0;
+static uint64_t cycles_mult = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+void tsc_detect(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+    
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        invariant = (edx & CPUID_80000007_EDX_INVARIANT) != 0;
+    }
+    
+    DEBUG_INFO("TSC: invariant=%d deadline=%d\n", invariant, deadline);
+}
+
+int tsc_calibrate(uint64_t window) {
+    // Start on a clock edge so a coarse clock doesn't cost a whole period
+    uint64_t edge = timer_get_ns();
+    uint64_t start_ns;
+    while ((start_ns = timer_get_ns()) == edge) {
+        __asm__ volatile("pause");
+    }
+    uint64_t start_tsc = rdtsc();
+    
+    uint64_t end_ns;
+    while ((end_ns = timer_get_ns()) - start_ns < window) {
+        __asm__ volatile("pause");
+    }
+    uint64_t cycles = rdtsc() - start_tsc;
+    uint64_t elapsed = end_ns - start_ns;
+    
+    // Windows stay well under a second, so cycles * 10^9 fits in 64 bits
+    if (elapsed == 0 || cycles == 0) {
+        return -1;
+    }
+    tsc_hz = cycles * 1000000000ULL / elapsed;
+    if (tsc_hz == 0) {
+        return -1;
+    }
+    
+    ns_mult = (1000000000ULL << 32) / tsc_hz;
+    cycles_mult = ((tsc_hz / 1000000000ULL) << 32) +
+                  ((tsc_hz % 1000000000ULL) << 32) / 1000000000ULL;
+    
+    DEBUG_INFO("TSC: %lu kHz\n", tsc_hz / 1000);
+    return 0;
+}
+
+bool tsc_is_invariant(void) {
+    return invariant;
+}
+
+bool tsc_has_deadline(void) {
+    return deadline;
+}
+
+uint64_t tsc_get_hz(void) {
+    return tsc_hz;
+}
+
+uint64_t tsc_cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> 32);
+}
+
+uint64_t tsc_ns_to_cycles(uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns * cycles_mult) >> 32);
+}
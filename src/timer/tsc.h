@@ -0,0 +1,45 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// CPUID feature bits
+#define CPUID_1_ECX_TSC_DEADLINE        (1U << 24)
+#define CPUID_80000007_EDX_INVARIANT    (1U << 8)
+
+#define IA32_TSC_DEADLINE_MSR           0x6E0
+
+// Read the time stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Probe CPUID for invariant TSC and TSC-deadline support
+void tsc_detect(void);
+
+// Measure the TSC frequency against timer_get_ns() over 'window' ns. Needs a
+// running clock (HPET, or the PIT with interrupts enabled; give the 1 ms PIT
+// a longer window). Returns 0 on success.
+int tsc_calibrate(uint64_t window);
+
+// TSC ticks at a constant rate regardless of P/C-states, so it can serve as
+// the system clock
+bool tsc_is_invariant(void);
+
+// The LAPIC timer can fire at an absolute TSC value
+bool tsc_has_deadline(void);
+
+// Calibrated frequency in Hz (0 before tsc_calibrate succeeds)
+uint64_t tsc_get_hz(void);
+
+// Convert a TSC delta to nanoseconds (no overflow for any 64-bit delta
+// shorter than ~2^32 seconds)
+uint64_t tsc_cycles_to_ns(uint64_t cycles);
+
+// Convert nanoseconds to TSC cycles
+uint64_t tsc_ns_to_cycles(uint64_t ns);
+
+#endif // TSC_H